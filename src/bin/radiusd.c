@@ -29,6 +29,7 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/io/log_writer.h>
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/dependency.h>
 #include <freeradius-devel/server/map_proc.h>
@@ -207,6 +208,7 @@ int main(int argc, char *argv[])
 	int		from_child[2] = {-1, -1};
 	char		*program;
 	fr_schedule_t	*sc = NULL;
+	fr_log_writer_t	*log_writer = NULL;
 	int		ret = EXIT_SUCCESS;
 
 	TALLOC_CTX	*global_ctx = NULL;
@@ -767,6 +769,35 @@ int main(int argc, char *argv[])
 	 */
 	if (log_global_init(&default_log, config->daemonize) < 0) EXIT_WITH_FAILURE;
 
+	/*
+	 *	Write log messages from a dedicated thread.  This has
+	 *	to be done after we've forked.
+	 */
+	if (config->log_async && config->spawn_workers) {
+		fr_log_writer_config_t	log_writer_config = {
+			.queue_size = config->log_async_queue_size,
+		};
+		int			full;
+
+		full = fr_table_value_by_str(fr_log_writer_full_table, config->log_async_full, -1);
+		if (full < 0) {
+			ERROR("Invalid value \"%s\" for log.async_full", config->log_async_full);
+			EXIT_WITH_FAILURE;
+		}
+		log_writer_config.full = full;
+
+		log_writer = fr_log_writer_create(global_ctx, &log_writer_config);
+		if (!log_writer) {
+			PERROR("Failed starting the log writer");
+			EXIT_WITH_FAILURE;
+		}
+
+		if (fr_command_register_hook(NULL, NULL, log_writer, cmd_log_writer_table) < 0) {
+			PERROR("Failed adding log writer commands");
+			EXIT_WITH_FAILURE;
+		}
+	}
+
 	/*
 	 *	Start the network / worker threads.
 	 */
@@ -778,6 +809,11 @@ int main(int argc, char *argv[])
 		schedule->max_workers = config->max_workers;
 		schedule->max_networks = config->max_networks;
 		schedule->stats_interval = config->stats_interval;
+		schedule->per_core = config->per_core;
+		schedule->pin_threads = config->pin_threads;
+		schedule->network_cpus = config->network_cpus;
+		schedule->worker_cpus = config->worker_cpus;
+		schedule->work_stealing = config->work_stealing;
 
 		schedule->network.max_outstanding = config->max_requests;
 		schedule->worker.max_requests = config->max_requests;
@@ -1018,6 +1054,11 @@ cleanup:
 	 */
 	(void) fr_schedule_destroy(&sc);
 
+	/*
+	 *  Write any queued log messages, and stop the log writer.
+	 */
+	TALLOC_FREE(log_writer);
+
 	/*
 	 *  Frees request specific logging resources which is OK
 	 *  because all the requests will have been stopped.
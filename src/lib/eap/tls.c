@@ -79,6 +79,7 @@ fr_table_num_ordered_t const eap_tls_status_table[] = {
 	{ L("established"),		EAP_TLS_ESTABLISHED		},
 	{ L("fail"),			EAP_TLS_FAIL			},
 	{ L("handled"),			EAP_TLS_HANDLED			},
+	{ L("yield"),			EAP_TLS_YIELD			},
 
 	{ L("start"),			EAP_TLS_START_SEND		},
 	{ L("request"),			EAP_TLS_RECORD_SEND		},
@@ -824,6 +825,7 @@ ignore_length:
  * @param[in] eap_session	to continue.
  * @return
  *	- EAP_TLS_FAIL if the message is invalid.
+ *	- EAP_TLS_YIELD if the handshake is waiting for an async job.
  *	- EAP_TLS_HANDLED if we need to send an additional request to the peer.
  *	- EAP_TLS_ESTABLISHED if the handshake completed successfully, and there's
  *	  no more data to send.
@@ -842,6 +844,12 @@ static eap_tls_status_t eap_tls_handshake(request_t *request, eap_session_t *eap
 		return EAP_TLS_FAIL;
 	}
 
+	/*
+	 *	A private key operation is being run by an async
+	 *	engine.  The caller yields until it's complete.
+	 */
+	if (tls_session->async_pending) return EAP_TLS_YIELD;
+
 	/*
 	 *	FIXME: return success/fail.
 	 *
@@ -878,6 +886,112 @@ static eap_tls_status_t eap_tls_handshake(request_t *request, eap_session_t *eap
 	return EAP_TLS_FAIL;
 }
 
+#ifdef SSL_MODE_ASYNC
+/** Remove the fds of the async job a handshake is waiting for from the request
+ *
+ * OpenSSL closes them once the job has finished with them, so they must
+ * be removed before the handshake continues.
+ */
+static void eap_tls_async_fd_delete(request_t *request, eap_tls_session_t *eap_tls_session)
+{
+	SSL	*ssl = eap_tls_session->tls_session->ssl;
+	size_t	num_fds = 0;
+	size_t	i;
+
+	if ((SSL_get_all_async_fds(ssl, NULL, &num_fds) != 1) || (num_fds == 0)) return;
+
+	{
+		OSSL_ASYNC_FD	fds[num_fds];
+
+		if (SSL_get_all_async_fds(ssl, fds, &num_fds) != 1) return;
+
+		for (i = 0; i < num_fds; i++) (void) unlang_module_fd_delete(request, eap_tls_session, fds[i]);
+	}
+}
+
+/** Resume a request when the async job its handshake is waiting for has finished
+ *
+ */
+static void eap_tls_async_ready(UNUSED module_ctx_t const *mctx, request_t *request, void *rctx, UNUSED int fd)
+{
+	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(rctx, eap_tls_session_t);
+
+	eap_tls_async_fd_delete(request, eap_tls_session);
+	unlang_interpret_mark_resumable(request);
+}
+
+/** Remove the fds of the async job if the request is cancelled
+ *
+ */
+static void eap_tls_async_signal(UNUSED module_ctx_t const *mctx, request_t *request, void *rctx,
+				 fr_state_signal_t action)
+{
+	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(rctx, eap_tls_session_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	eap_tls_async_fd_delete(request, eap_tls_session);
+}
+#endif
+
+/** Yield until the async job a handshake is waiting for has finished
+ *
+ * Called by the EAP method when #eap_tls_process returns EAP_TLS_YIELD.
+ * We wait for the fds of the job to become readable, then the resume
+ * function should call #eap_tls_process again, which continues the
+ * handshake from where it stopped.
+ *
+ * @param[out] p_result		Result of the module call, if we fail.
+ * @param[in] request		the current subrequest.
+ * @param[in] eap_session	whose handshake is waiting.
+ * @param[in] resume		function of the EAP method, which calls #eap_tls_process.
+ * @return an instruction for the interpreter.
+ */
+unlang_action_t eap_tls_async_yield(rlm_rcode_t *p_result, request_t *request, eap_session_t *eap_session,
+				    unlang_module_resume_t resume)
+{
+	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(eap_session->opaque, eap_tls_session_t);
+	fr_tls_session_t	*tls_session = eap_tls_session->tls_session;
+#ifdef SSL_MODE_ASYNC
+	size_t			num_fds = 0;
+	size_t			i;
+#endif
+
+	fr_assert(tls_session->async_pending);
+
+#ifndef SSL_MODE_ASYNC
+	/*
+	 *	async_pending is never set without async support.
+	 */
+	RETURN_MODULE_FAIL;
+#else
+	if ((SSL_get_all_async_fds(tls_session->ssl, NULL, &num_fds) != 1) || (num_fds == 0)) {
+		fr_tls_log_error(request, "Async job has no fds to wait on");
+	error:
+		fr_tls_cache_deny(tls_session);
+		RETURN_MODULE_FAIL;
+	}
+
+	{
+		OSSL_ASYNC_FD	fds[num_fds];
+
+		(void) SSL_get_all_async_fds(tls_session->ssl, fds, &num_fds);
+
+		for (i = 0; i < num_fds; i++) {
+			if (unlang_module_fd_add(request, eap_tls_async_ready, NULL, NULL, eap_tls_session, fds[i]) < 0) {
+				REDEBUG("Failed inserting async job fd");
+				eap_tls_async_fd_delete(request, eap_tls_session);
+				goto error;
+			}
+		}
+	}
+
+	RDEBUG3("Yielding until async job completes");
+
+	return unlang_module_yield(request, resume, eap_tls_async_signal, eap_tls_session);
+#endif
+}
+
 /** Process an EAP TLS request
  *
  * Here we implement a basic state machine.  The state machine is implicit and
@@ -900,6 +1014,7 @@ static eap_tls_status_t eap_tls_handshake(request_t *request, eap_session_t *eap
  * @return
  *	- EAP_TLS_ESTABLISHED
  *	- EAP_TLS_HANDLED
+ *	- EAP_TLS_YIELD
  */
 eap_tls_status_t eap_tls_process(request_t *request, eap_session_t *eap_session)
 {
@@ -917,6 +1032,13 @@ eap_tls_status_t eap_tls_process(request_t *request, eap_session_t *eap_session)
 
 	RDEBUG2("Continuing EAP-TLS");
 
+	/*
+	 *	We yielded while the handshake was waiting for an
+	 *	async job.  There's no new data from the peer, so
+	 *	just resume the handshake.
+	 */
+	if (tls_session->async_pending) return eap_tls_handshake(request, eap_session);
+
 	/*
 	 *	Call eap_tls_verify to sanity check the incoming EAP data.
 	 */
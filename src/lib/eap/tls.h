@@ -51,6 +51,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/tls/base.h>
 #include <freeradius-devel/eap/base.h>
+#include <freeradius-devel/unlang/base.h>
 
 #define TLS_HEADER_LEN 4
 #define TLS_HEADER_LENGTH_FIELD_LEN 4
@@ -92,6 +93,8 @@ typedef enum {
 	EAP_TLS_ESTABLISHED,       			//!< Session established, send success (or start phase2).
 	EAP_TLS_FAIL,       				//!< Fail, send fail.
 	EAP_TLS_HANDLED,	  			//!< TLS code has handled it.
+	EAP_TLS_YIELD,					//!< The handshake is waiting for an async job,
+							///< call #eap_tls_async_yield.
 
 	/*
 	 *	Composition states, we need to
@@ -158,6 +161,9 @@ eap_tls_status_t	eap_tls_process(request_t *request, eap_session_t *eap_session)
 
 int			eap_tls_start(request_t *request, eap_session_t *eap_session) CC_HINT(nonnull);
 
+unlang_action_t		eap_tls_async_yield(rlm_rcode_t *p_result, request_t *request, eap_session_t *eap_session,
+					    unlang_module_resume_t resume) CC_HINT(nonnull);
+
 int			eap_tls_success(request_t *request, eap_session_t *eap_session,
 					char const *keying_prf_label, size_t keying_prf_label_len,
 					char const *sessid_prf_label, size_t sessid_prf_label_len) CC_HINT(nonnull(1));
@@ -6,6 +6,7 @@ SOURCES	:= \
 	channel.c \
 	control.c \
 	load.c \
+	log_writer.c \
 	master.c \
 	message.c \
 	network.c \
@@ -20,6 +21,8 @@ TGT_LDFLAGS	:= $(LDFLAGS)
 
 HEADERS		:= $(subst src/lib/,,$(wildcard src/lib/io/*.h))
 
+SUBMAKEFILES	:= log_writer_tests.mk
+
 #
 #  Create the build directory.
 #
@@ -58,6 +58,7 @@ typedef struct {
 	fr_io_encode_t			encode;		//!< Pack fr_pair_ts back into a byte array.
 
 	fr_io_signal_t			flush;		//!< Flush the data when the socket is ready for writing.
+							//!< Returns >0 if data remains, and the socket would block.
 
 	fr_io_signal_t			error;		//!< There was an error on the socket.
 	fr_io_close_t			close;		//!< Close the transport.
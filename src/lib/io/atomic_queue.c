@@ -140,15 +140,15 @@ void fr_atomic_queue_free(fr_atomic_queue_t **aq)
  * @param[in] aq	The atomic queue to add data to.
  * @param[in] data	to push.
  * @return
- *	- true on successful push
- *	- false on queue full
+ *	- >= 0 the index of the entry we claimed.
+ *	- -1 on queue full.
  */
-bool fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data)
+static inline int64_t atomic_queue_push(fr_atomic_queue_t *aq, void *data)
 {
 	int64_t head;
 	fr_atomic_queue_entry_t *entry;
 
-	if (!data) return false;
+	if (!data) return -1;
 
 	head = load(aq->head);
 
@@ -169,7 +169,7 @@ bool fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data)
 #if 0
 			fr_atomic_queue_debug(aq, stderr);
 #endif
-			return false;
+			return -1;
 		}
 
 		/*
@@ -198,6 +198,47 @@ bool fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data)
 	 */
 	entry->data = data;
 	store(entry->seq, head + 1);
+	return head;
+}
+
+/** Push a pointer into the atomic queue
+ *
+ * @param[in] aq	The atomic queue to add data to.
+ * @param[in] data	to push.
+ * @return
+ *	- true on successful push
+ *	- false on queue full
+ */
+bool fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data)
+{
+	return (atomic_queue_push(aq, data) >= 0);
+}
+
+/** Push a pointer into the atomic queue, and check if the consumer had caught up
+ *
+ * The check is made against the entry we actually claimed, after
+ * the data has been published.  So unlike checking
+ * #fr_atomic_queue_num_elements before the push, it isn't confused
+ * by entries which other producers have claimed, but not yet
+ * written.
+ *
+ * @param[in] aq	The atomic queue to add data to.
+ * @param[in] data	to push.
+ * @param[out] first	true if every entry before ours had been
+ *			popped, i.e. the consumer may have found the
+ *			queue empty, and stopped reading it.
+ * @return
+ *	- true on successful push
+ *	- false on queue full
+ */
+bool fr_atomic_queue_push_first(fr_atomic_queue_t *aq, void *data, bool *first)
+{
+	int64_t head;
+
+	head = atomic_queue_push(aq, data);
+	if (head < 0) return false;
+
+	*first = (aquire(aq->tail) >= head);
 	return true;
 }
 
@@ -265,6 +306,33 @@ size_t fr_atomic_queue_size(fr_atomic_queue_t *aq)
 	return aq->size;
 }
 
+/** Return the number of entries currently in the queue
+ *
+ * The result is only a snapshot.  When called by the consumer, entries
+ * may be added concurrently, so a result of zero means "empty at some
+ * point during the call".  When called by the producer, entries may be
+ * removed concurrently.
+ *
+ * @param[in] aq	the atomic queue to check.
+ * @return the number of entries in the queue.
+ */
+size_t fr_atomic_queue_num_elements(fr_atomic_queue_t *aq)
+{
+	int64_t head, tail;
+
+	/*
+	 *	Read tail first.  It can only increase, so the
+	 *	difference can't go negative if the producer and
+	 *	consumer race us.
+	 */
+	tail = aquire(aq->tail);
+	head = aquire(aq->head);
+
+	if (head <= tail) return 0;
+
+	return (size_t)(head - tail);
+}
+
 #ifdef WITH_VERIFY_PTR
 /** Check the talloc chunk is still valid
  *
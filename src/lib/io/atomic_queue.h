@@ -56,8 +56,10 @@ typedef struct fr_atomic_queue_s fr_atomic_queue_t;
 fr_atomic_queue_t	*fr_atomic_queue_alloc(TALLOC_CTX *ctx, size_t size);
 void			fr_atomic_queue_free(fr_atomic_queue_t **aq);
 bool			fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data);
+bool			fr_atomic_queue_push_first(fr_atomic_queue_t *aq, void *data, bool *first);
 bool			fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data);
 size_t			fr_atomic_queue_size(fr_atomic_queue_t *aq);
+size_t			fr_atomic_queue_num_elements(fr_atomic_queue_t *aq);
 
 #ifdef WITH_VERIFY_PTR
 void			fr_atomic_queue_verify(fr_atomic_queue_t *aq);
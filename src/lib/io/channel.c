@@ -44,11 +44,6 @@ RCSID("$Id$")
 #define MPRINT(...)
 #endif
 
-/*
- *	We disable this until we fix all of the signaling issues...
- */
-#define ENABLE_SKIPS (0)
-
 typedef enum {
 	TO_RESPONDER = 0,
 	TO_REQUESTOR = 1
@@ -62,10 +57,6 @@ static fr_table_num_sorted_t const channel_direction[] = {
 size_t channel_direction_len = NUM_ELEMENTS(channel_direction);
 #endif
 
-#if 0
-#define SIGNAL_INTERVAL (1000000)	//!< The minimum interval between responder signals.
-#endif
-
 /** Size of the atomic queues
  *
  * The queue reader MUST service the queue occasionally,
@@ -118,15 +109,17 @@ typedef struct {
 	fr_channel_recv_callback_t recv;	//!< callback for receiving messages
 	void			*recv_uctx;	//!< context for receiving messages
 
-	bool			must_signal;	//!< we need to signal the other end
+	bool			must_signal;	//!< we need to signal the other end, i.e. the
+						///< last signal failed.
 
+	atomic_bool		reader_sleeping; //!< The reader of this end's queue has drained
+						///< it, and is waiting for a signal before
+						///< it looks at the queue again.
 
 	uint64_t		sequence;	//!< Sequence number for this channel.
 	uint64_t		ack;		//!< Sequence number of the other end.
 	uint64_t		their_view_of_my_sequence;	//!< Should be clear.
 
-	uint64_t		sequence_at_last_signal;	//!< When we last signaled.
-
 	fr_atomic_queue_t	*aq;		//!< The queue of messages - visible only to this channel.
 
 	atomic_bool		active;		//!< Whether the channel is active.
@@ -170,65 +163,89 @@ fr_table_num_sorted_t const channel_packet_priority[] = {
 size_t channel_packet_priority_len = NUM_ELEMENTS(channel_packet_priority);
 
 
-/** Create a new channel
+/** Allocate the queue and ring buffer for one end of a channel
+ *
+ * Both are written by the thread sending to this end, so this should be
+ * called from that thread, for the memory to be placed on its NUMA node.
+ */
+static int channel_end_alloc(fr_channel_t *ch, fr_channel_direction_t direction)
+{
+	fr_channel_end_t *end = &ch->end[direction];
+
+	end->aq = fr_atomic_queue_alloc(ch, ATOMIC_QUEUE_SIZE);
+	if (!end->aq) {
+		fr_strerror_const("Failed allocating memory");
+		return -1;
+	}
+
+	/*
+	 *	Ring buffer for sending control-plane messages
+	 *	to the other end.
+	 */
+	end->rb = fr_ring_buffer_create(ch, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
+	if (!end->rb) {
+		fr_strerror_const_push("Failed allocating ring buffer");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Create the responder's half of a new channel
+ *
+ * Must be called from the responder's thread.  The channel can't be used
+ * until #fr_channel_requestor_attach has been called from the requestor's
+ * thread.
  *
  * @param[in] ctx	The talloc_ctx to allocate channel data in.
- * @param[in] requestor	control plane.
  * @param[in] responder	control plane.
- * @param[in] same	whether or not the channel is for the same thread
  * @return
  *	- NULL on error
  *	- channel on success
  */
-fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *requestor, fr_control_t *responder, bool same)
+fr_channel_t *fr_channel_responder_create(TALLOC_CTX *ctx, fr_control_t *responder)
 {
-	fr_time_t now;
 	fr_channel_t *ch;
 
 	ch = talloc_zero(ctx, fr_channel_t);
 	if (!ch) {
-	nomem:
 		fr_strerror_const("Failed allocating memory");
 		return NULL;
 	}
 
-	ch->same_thread = same;
-
 	ch->end[TO_RESPONDER].direction = TO_RESPONDER;
 	ch->end[TO_REQUESTOR].direction = TO_REQUESTOR;
 
-	ch->end[TO_RESPONDER].aq = fr_atomic_queue_alloc(ch, ATOMIC_QUEUE_SIZE);
-	if (!ch->end[TO_RESPONDER].aq) {
-		talloc_free(ch);
-		goto nomem;
-	}
-
-	ch->end[TO_REQUESTOR].aq = fr_atomic_queue_alloc(ch, ATOMIC_QUEUE_SIZE);
-	if (!ch->end[TO_REQUESTOR].aq) {
-		talloc_free(ch);
-		goto nomem;
-	}
-
 	ch->end[TO_RESPONDER].control = responder;
-	ch->end[TO_REQUESTOR].control = requestor;
 
-	/*
-	 *	Create the ring buffer for the requestor to send
-	 *	control-plane messages to the responder, and vice-versa.
-	 */
-	ch->end[TO_RESPONDER].rb = fr_ring_buffer_create(ch, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
-	if (!ch->end[TO_RESPONDER].rb) {
-	rb_nomem:
-		fr_strerror_const_push("Failed allocating ring buffer");
+	if (channel_end_alloc(ch, TO_REQUESTOR) < 0) {
 		talloc_free(ch);
 		return NULL;
 	}
 
-	ch->end[TO_REQUESTOR].rb = fr_ring_buffer_create(ch, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
-	if (!ch->end[TO_REQUESTOR].rb) {
-		talloc_free(ch);
-		goto rb_nomem;
-	}
+	return ch;
+}
+
+/** Complete a channel created by #fr_channel_responder_create
+ *
+ * Must be called from the requestor's thread.
+ *
+ * @param[in] ch	to complete.
+ * @param[in] requestor	control plane.
+ * @param[in] same	whether or not the channel is for the same thread
+ * @return
+ *	- <0 on error.  The channel should be freed.
+ *	- 0 on success
+ */
+int fr_channel_requestor_attach(fr_channel_t *ch, fr_control_t *requestor, bool same)
+{
+	fr_time_t now;
+
+	if (channel_end_alloc(ch, TO_RESPONDER) < 0) return -1;
+
+	ch->same_thread = same;
+
+	ch->end[TO_REQUESTOR].control = requestor;
 
 	/*
 	 *	Initialize all of the timers to now.
@@ -245,6 +262,35 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *requestor, fr_con
 	ch->end[TO_REQUESTOR].stats.last_sent_signal = now;
 	atomic_store(&ch->end[TO_REQUESTOR].active, true);
 
+	return 0;
+}
+
+/** Create a new channel
+ *
+ * All of the channel's memory is allocated by the calling thread.  Use
+ * #fr_channel_responder_create and #fr_channel_requestor_attach if the
+ * requestor and responder are on different NUMA nodes.
+ *
+ * @param[in] ctx	The talloc_ctx to allocate channel data in.
+ * @param[in] requestor	control plane.
+ * @param[in] responder	control plane.
+ * @param[in] same	whether or not the channel is for the same thread
+ * @return
+ *	- NULL on error
+ *	- channel on success
+ */
+fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *requestor, fr_control_t *responder, bool same)
+{
+	fr_channel_t *ch;
+
+	ch = fr_channel_responder_create(ctx, responder);
+	if (!ch) return NULL;
+
+	if (fr_channel_requestor_attach(ch, requestor, same) < 0) {
+		talloc_free(ch);
+		return NULL;
+	}
+
 	return ch;
 }
 
@@ -285,7 +331,74 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
 	       fr_table_str_by_value(channel_direction, end->direction, "<INVALID>"),
 	       fr_table_str_by_value(channel_signals, which, "<INVALID>"));
 
-	return fr_control_message_send(end->control, end->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
+	if (fr_control_message_send(end->control, end->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc)) < 0) {
+		end->must_signal = true;
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Decide whether a message we just pushed needs a signal
+ *
+ * The reader of a queue only waits for a signal once it has drained
+ * the queue, and told us so via #channel_end_sleeping.  So we only
+ * have to wake it up when:
+ *
+ *   - it has told us it's sleeping.
+ *   - the queue went from empty to non-empty.  The reader may have
+ *     drained the queue, but not yet gone to sleep.  This is decided
+ *     from the entry our push claimed, see #fr_atomic_queue_push_first.
+ *   - a previous signal failed.
+ *
+ * Otherwise the reader is either awake and will find the message
+ * when it next drains the queue, or there's already a signal in
+ * flight which will cause it to do so.
+ *
+ * @param[in] end	which we just pushed a message to.
+ * @param[in] was_empty	whether every message before ours had been read.
+ * @return
+ *	- true if the reader must be signalled.
+ *	- false if the signal can be skipped.
+ */
+static inline bool channel_must_signal(fr_channel_end_t *end, bool was_empty)
+{
+	/*
+	 *	Pairs with the fence in channel_end_sleeping().
+	 *	Either we see that the reader is sleeping, or the
+	 *	reader sees our message in the queue.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_exchange(&end->reader_sleeping, false)) return true;
+
+	return was_empty || end->must_signal;
+}
+
+/** Tell the writer of a queue that we're about to sleep
+ *
+ * The flag is left set even if we find messages.  The queue depth
+ * includes entries which the writer has claimed, but not yet
+ * written, so draining the queue may not find them.  Leaving the
+ * flag set means that the writer of such an entry will see it once
+ * the entry is written, and signal us.  At worst, that's one
+ * unnecessary signal.
+ *
+ * @param[in] end	whose queue we read from.
+ * @return
+ *	- 0 if the queue is empty, and we can sleep.
+ *	- 1 if there are messages in the queue, and we should read them.
+ */
+static int channel_end_sleeping(fr_channel_end_t *end)
+{
+	atomic_store(&end->reader_sleeping, true);
+
+	/*
+	 *	Pairs with the fence in channel_must_signal().
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return (fr_atomic_queue_num_elements(end->aq) > 0);
 }
 
 #define IALPHA (8)
@@ -308,6 +421,7 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
 	uint64_t sequence;
 	fr_time_t when, message_interval;
 	fr_channel_end_t *requestor;
+	bool was_empty;
 
 	if (!fr_cond_assert_msg(atomic_load(&ch->end[TO_RESPONDER].active), "Channel not active")) return -1;
 
@@ -330,7 +444,7 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
 	 *	Push the message onto the queue for the other end.  If
 	 *	the push fails, the caller should try another queue.
 	 */
-	if (!fr_atomic_queue_push(requestor->aq, cd)) {
+	if (!fr_atomic_queue_push_first(requestor->aq, cd, &was_empty)) {
 		fr_strerror_printf("Failed pushing to atomic queue - full.  Queue contains %zu items",
 				   fr_atomic_queue_size(requestor->aq));
 		while (fr_channel_recv_reply(ch));
@@ -356,34 +470,11 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
 
 	MPRINT("REQUESTOR requests %"PRIu64", num_outstanding %"PRIu64"\n", requestor->stats.packets, requestor->stats.outstanding);
 
-#if ENABLE_SKIPS
-	/*
-	 *	We just sent the first packet.  There can't possibly be a reply, so don't bother looking.
-	 */
-	if (requestor->stats.outstanding == 1) {
-
-		/*
-		 *	There is at least one old packet which is
-		 *	outstanding, look for a reply.
-		 */
-	} else if (requestor->stats.outstanding > 1) {
-		bool has_reply;
-
-		has_reply = fr_channel_recv_reply(ch);
-
-		if (has_reply) while (fr_channel_recv_reply(ch));
-
-		/*
-		 *	There's no reply yet, so we still have packets outstanding.
-		 *	Or, there is a reply, and there are more packets outstanding.
-		 *	Skip the signal.
-		 */
-		if (!requestor->must_signal && (!has_reply || (has_reply && (requestor->stats.outstanding > 1)))) {
-			MPRINT("REQUESTOR SKIPS signal\n");
-			return 0;
-		}
+	if (!channel_must_signal(requestor, was_empty)) {
+		MPRINT("REQUESTOR SKIPS signal\n");
+		requestor->stats.skipped++;
+		return 0;
 	}
-#endif
 
 	/*
 	 *	Tell the other end that there is new data ready.
@@ -512,6 +603,7 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 	uint64_t		sequence;
 	fr_time_t		when, message_interval;
 	fr_channel_end_t	*responder;
+	bool			was_empty;
 
 	if (!fr_cond_assert_msg(atomic_load(&ch->end[TO_REQUESTOR].active), "Channel not active")) return -1;
 
@@ -531,7 +623,7 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 	cd->live.sequence = sequence;
 	cd->live.ack = responder->ack;
 
-	if (!fr_atomic_queue_push(responder->aq, cd)) {
+	if (!fr_atomic_queue_push_first(responder->aq, cd, &was_empty)) {
 		fr_strerror_printf("Failed pushing to atomic queue - full.  Queue contains %zu items",
 				   fr_atomic_queue_size(responder->aq));
 		while (fr_channel_recv_request(ch));
@@ -560,49 +652,11 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 	 */
 	while (fr_channel_recv_request(ch));
 
-	/*
-	 *	No packets outstanding, we HAVE to signal the requestor
-	 *	thread.
-	 */
-	if (responder->stats.outstanding == 0) {
-		(void) fr_channel_data_ready(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_DONE_RESPONDER);
-		return 0;
-	}
-
-	MPRINT("\twhen - last_read_other = %"PRIu64" - %"PRIu64" = %"PRIu64"\n", when, responder->stats.last_read_other, when - responder->stats.last_read_other);
-	MPRINT("\twhen - last signal = %"PRIu64" - %"PRIu64" = %"PRIu64"\n", when, responder->stats.last_sent_signal, when - responder->stats.last_sent_signal);
-	MPRINT("\tsequence - ack = %"PRIu64" - %"PRIu64" = %"PRIu64"\n", responder->sequence, responder->their_view_of_my_sequence, responder->sequence - responder->their_view_of_my_sequence);
-
-#ifdef __APPLE__
-	/*
-	 *	If we've sent them a signal since the last ACK, they
-	 *	will receive it, and process the packets.  So we don't
-	 *	need to signal them again.
-	 *
-	 *	But... this doesn't appear to work on the Linux
-	 *	libkqueue implementation.
-	 */
-	if (responder->sequence_at_last_signal > responder->their_view_of_my_sequence) return 0;
-#endif
-
-	/*
-	 *	If we've received a new packet in the last while, OR
-	 *	we've sent a signal in the last while, then we don't
-	 *	need to send a new signal.  But we DO send a signal if
-	 *	we haven't seen an ACK for a few packets.
-	 *
-	 *	FIXME: make these limits configurable, or include
-	 *	predictions about packet processing time?
-	 */
-	fr_assert(responder->their_view_of_my_sequence <= responder->sequence);
-#if 0
-	if (((responder->sequence - their_view_of_my_sequence) <= 1000) &&
-	    ((when - responder->stats.last_read_other < SIGNAL_INTERVAL) ||
-	     ((when - responder->stats.last_sent_signal) < SIGNAL_INTERVAL))) {
+	if (!channel_must_signal(responder, was_empty)) {
 		MPRINT("\tRESPONDER SKIPS signal\n");
+		responder->stats.skipped++;
 		return 0;
 	}
-#endif
 
 	MPRINT("\tRESPONDER SIGNALS num_outstanding %"PRIu64"\n", responder->stats.outstanding);
 	(void) fr_channel_data_ready(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_TO_REQUESTOR);
@@ -631,39 +685,42 @@ int fr_channel_null_reply(fr_channel_t *ch)
 
 
 
-/** Signal a channel that the responder is sleeping
+/** Tell the requestor that the responder is about to sleep
  *
  * This function should be called from the responders idle loop.
- * i.e. only when it has nothing else to do.
+ * i.e. only when it has nothing else to do, and immediately before
+ * it waits for events.  Once called, the next request sent on the
+ * channel will signal the responder.
  *
- * @param[in] ch	the channel to signal we're no longer listening on.
+ * @param[in] ch	the channel we will no longer be polling.
  * @return
- *	- <0 on error
- *	- 0 on success
+ *	- 0 if there are no requests, and the responder may sleep.
+ *	- 1 if there are requests, which should be read via #fr_channel_recv_request.
  */
 int fr_channel_responder_sleeping(fr_channel_t *ch)
 {
-	fr_channel_end_t *responder;
-	fr_channel_control_t cc;
-
-	responder = &(ch->end[TO_REQUESTOR]);
-
-	/*
-	 *	We don't have any outstanding requests to process for
-	 *	this channel, don't signal the network thread that
-	 *	we're sleeping.  It already knows.
-	 */
-	if (responder->stats.outstanding == 0) return 0;
+	MPRINT("\tRESPONDER SLEEPING num_outstanding %"PRIu64", packets in %"PRIu64", packets out %"PRIu64"\n",
+	       ch->end[TO_REQUESTOR].stats.outstanding,
+	       ch->end[TO_RESPONDER].stats.packets, ch->end[TO_REQUESTOR].stats.packets);
 
-	responder->stats.signals++;
+	return channel_end_sleeping(&ch->end[TO_RESPONDER]);
+}
 
-	cc.signal = FR_CHANNEL_SIGNAL_RESPONDER_SLEEPING;
-	cc.ack = responder->ack;
-	cc.ch = ch;
 
-	MPRINT("\tRESPONDER SLEEPING num_outstanding %"PRIu64", packets in %"PRIu64", packets out %"PRIu64"\n", responder->stats.outstanding,
-	       ch->end[TO_RESPONDER].stats.packets, responder->stats.packets);
-	return fr_control_message_send(responder->control, responder->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
+/** Tell the responder that the requestor is about to sleep
+ *
+ * This function should be called from the requestors idle loop,
+ * immediately before it waits for events.  Once called, the next
+ * reply sent on the channel will signal the requestor.
+ *
+ * @param[in] ch	the channel we will no longer be polling.
+ * @return
+ *	- 0 if there are no replies, and the requestor may sleep.
+ *	- 1 if there are replies, which should be read via #fr_channel_recv_reply.
+ */
+int fr_channel_requestor_sleeping(fr_channel_t *ch)
+{
+	return channel_end_sleeping(&ch->end[TO_REQUESTOR]);
 }
 
 
@@ -680,25 +737,16 @@ int fr_channel_responder_sleeping(fr_channel_t *ch)
  *	- FR_CHANNEL_OPEN when a channel has been opened and sent to us
  *	- FR_CHANNEL_CLOSE when a channel should be closed
  */
-fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size)
+fr_channel_event_t fr_channel_service_message(UNUSED fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size)
 {
-	int rcode;
-#if ENABLE_SKIPS
-	uint64_t ack;
-#endif
 	fr_channel_control_t cc;
 	fr_channel_signal_t cs;
-	fr_channel_event_t ce = FR_CHANNEL_ERROR;
-	fr_channel_end_t *requestor;
 	fr_channel_t *ch;
 
 	fr_assert(data_size == sizeof(cc));
 	memcpy(&cc, data, data_size);
 
 	cs = cc.signal;
-#if ENABLE_SKIPS
-	ack = cc.ack;
-#endif
 	*p_channel = ch = cc.ch;
 
 	switch (cs) {
@@ -716,57 +764,21 @@ fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_c
 		return (fr_channel_event_t) cs;
 
 	/*
-	 *	Only sent by the responder.  Both of these
-	 *	situations are largely the same, except for
-	 *	return codes.
+	 *	No longer sent.  The responder advertises that it's
+	 *	sleeping via the channel end, and the requestor
+	 *	signals it when it next pushes a request.  There's
+	 *	no need to wake the responder up again here.
 	 */
 	case FR_CHANNEL_SIGNAL_DATA_DONE_RESPONDER:
 		MPRINT("channel got data_done_responder\n");
-		ce = FR_CHANNEL_DATA_READY_REQUESTOR;
-		ch->end[TO_RESPONDER].must_signal = true;
-		break;
+		return FR_CHANNEL_DATA_READY_REQUESTOR;
 
 	case FR_CHANNEL_SIGNAL_RESPONDER_SLEEPING:
 		MPRINT("channel got responder_sleeping\n");
-		ce = FR_CHANNEL_NOOP;
-		ch->end[TO_RESPONDER].must_signal = true;
-		break;
-	}
-
-	/*
-	 *	Compare their ACK to the last sequence we
-	 *	sent.  If it's different, we signal the responder
-	 *	to wake up.
-	 */
-	requestor = &ch->end[TO_RESPONDER];
-#if ENABLE_SKIPS
-	if (!requestor->must_signal && (ack == requestor->sequence)) {
-		MPRINT("REQUESTOR SKIPS signal AFTER CE %d num_outstanding %"PRIu64"\n", cs, requestor->stats.outstanding);
-		MPRINT("REQUESTOR has ack %"PRIu64", my seq %"PRIu64" my_view %"PRIu64"\n", ack, requestor->sequence, requestor->their_view_of_my_sequence);
-		return ce;
+		return FR_CHANNEL_NOOP;
 	}
 
-	/*
-	 *	The responder is sleeping or done.  There are more
-	 *	packets available, so we signal it to wake up again.
-	 */
-	fr_assert(ack <= requestor->sequence);
-#endif
-
-	/*
-	 *	We're signaling it again...
-	 */
-	requestor->stats.resignals++;
-
-	/*
-	 *	The responder hasn't seen our last few packets.  Signal
-	 *	that there is data ready.
-	 */
-	MPRINT("REQUESTOR SIGNALS AFTER CE %d\n", cs);
-	rcode = fr_channel_data_ready(ch, when, requestor, FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER);
-	if (rcode < 0) return FR_CHANNEL_ERROR;
-
-	return ce;
+	return FR_CHANNEL_ERROR;
 }
 
 
@@ -962,7 +974,7 @@ void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char cons
 {
 	fr_log(log, L_INFO, file, line, "requestor\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.signals);
-	fr_log(log, L_INFO, file, line, "\tsignals re-sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.resignals);
+	fr_log(log, L_INFO, file, line, "\tsignals skipped = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.skipped);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.kevents);
 	fr_log(log, L_INFO, file, line, "\toutstanding = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.outstanding);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.packets);
@@ -973,6 +985,7 @@ void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char cons
 
 	fr_log(log, L_INFO, file, line, "responder\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64"\n", ch->end[TO_REQUESTOR].stats.signals);
+	fr_log(log, L_INFO, file, line, "\tsignals skipped = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.skipped);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.kevents);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.packets);
 	fr_log(log, L_INFO, file, line, "\tmessage interval (RTT) = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.message_interval);
@@ -80,7 +80,8 @@ typedef enum fr_channel_event_t {
 typedef struct {
 	uint64_t       		outstanding; 	//!< Number of outstanding requests with no reply.
 	uint64_t		signals;	//!< Number of kevent signals we've sent.
-	uint64_t		resignals;	//!< Number of signals resent.
+	uint64_t		skipped;	//!< Number of messages sent without signalling
+						///< the other end.
 
 	uint64_t		packets;	//!< Number of actual data packets.
 
@@ -158,6 +159,10 @@ extern size_t channel_packet_priority_len;
 
 fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *frontend, fr_control_t *worker, bool same) CC_HINT(nonnull);
 
+fr_channel_t *fr_channel_responder_create(TALLOC_CTX *ctx, fr_control_t *worker) CC_HINT(nonnull(2));
+
+int	fr_channel_requestor_attach(fr_channel_t *ch, fr_control_t *frontend, bool same) CC_HINT(nonnull);
+
 int	fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cm) CC_HINT(nonnull);
 bool	fr_channel_recv_request(fr_channel_t *ch) CC_HINT(nonnull);
 
@@ -171,6 +176,7 @@ int	fr_channel_set_recv_reply(fr_channel_t *ch, void *ctx, fr_channel_recv_callb
 int	fr_channel_set_recv_request(fr_channel_t *ch, void *ctx, fr_channel_recv_callback_t recv_reply) CC_HINT(nonnull(1,3));
 
 int	fr_channel_responder_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
+int	fr_channel_requestor_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
 
 int	fr_channel_service_kevent(fr_channel_t *ch, fr_control_t *c, struct kevent const *kev) CC_HINT(nonnull);
 fr_channel_event_t	fr_channel_service_message(fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size) CC_HINT(nonnull);
@@ -35,6 +35,10 @@ RCSID("$Id$")
 #include <string.h>
 #include <sys/event.h>
 
+#ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+#endif
+
 #define FR_CONTROL_MAX_TYPES	(32)
 
 /*
@@ -81,24 +85,26 @@ struct fr_control_s {
 
 	fr_atomic_queue_t	*aq;			//!< destination AQ
 
-	int			pipe[2];       		//!< our pipes
+	int			pipe[2];       		//!< our pipes.  When using an eventfd,
+							///< both entries are the same descriptor.
 
 	bool			same_thread;		//!< are the two ends in the same thread
 
 	fr_control_ctx_t 	type[FR_CONTROL_MAX_TYPES];	//!< callbacks
 };
 
-static void pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+/** Service control messages
+ *
+ * @param[in] c		the control structure.
+ * @param[in] num	the number of signals we received, and thus
+ *			the maximum number of messages to pop.
+ */
+static void control_service(fr_control_t *c, uint64_t num)
 {
-	fr_control_t *c = talloc_get_type_abort(uctx, fr_control_t);
-	ssize_t i, num;
+	uint64_t i;
 	fr_time_t now;
-	char read_buffer[256];
 	uint8_t	data[256];
 
-	num = read(fd, read_buffer, sizeof(read_buffer));
-	if (num <= 0) return;
-
 	now = fr_time();
 
 	for (i = 0; i < num; i++) {
@@ -116,6 +122,44 @@ static void pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void
 	}
 }
 
+static void pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_control_t *c = talloc_get_type_abort(uctx, fr_control_t);
+	ssize_t num;
+	char read_buffer[256];
+
+	num = read(fd, read_buffer, sizeof(read_buffer));
+	if (num <= 0) return;
+
+	control_service(c, num);
+}
+
+#ifdef HAVE_SYS_EVENTFD_H
+/** Read the signal counter from an eventfd
+ *
+ * The kernel adds together all of the signals written since our
+ * last read, so one read drains any number of signals.
+ */
+static void control_eventfd_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_control_t *c = talloc_get_type_abort(uctx, fr_control_t);
+	uint64_t num;
+
+	if (read(fd, &num, sizeof(num)) != sizeof(num)) return;
+
+	control_service(c, num);
+}
+#endif
+
+/** Close the descriptors used for signalling
+ *
+ */
+static void control_close(fr_control_t *c)
+{
+	close(c->pipe[0]);
+	if (c->pipe[1] != c->pipe[0]) close(c->pipe[1]);
+}
+
 /** Free a control structure
  *
  *  This function really only calls the underlying "garbage collect".
@@ -131,8 +175,7 @@ static int _control_free(fr_control_t *c)
 #endif
 	(void) fr_event_fd_delete(c->el, c->pipe[0], FR_EVENT_FILTER_IO);
 
-	close(c->pipe[0]);
-	close(c->pipe[1]);
+	control_close(c);
 
 	return 0;
 }
@@ -149,6 +192,7 @@ static int _control_free(fr_control_t *c)
 fr_control_t *fr_control_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_atomic_queue_t *aq)
 {
 	fr_control_t *c;
+	fr_event_fd_cb_t read_cb = pipe_read;
 
 	c = talloc_zero(ctx, fr_control_t);
 	if (!c) {
@@ -158,20 +202,36 @@ fr_control_t *fr_control_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_atomic_
 	c->el = el;
 	c->aq = aq;
 
-	if (pipe((int *) &c->pipe) < 0) {
-		talloc_free(c);
-		fr_strerror_printf("Failed opening pipe for control socket: %s", fr_syserror(errno));
-		return NULL;
-	}
-	talloc_set_destructor(c, _control_free);
-
+#ifdef HAVE_SYS_EVENTFD_H
 	/*
-	 *	We don't want reads from the pipe to be blocking.
+	 *	Prefer an eventfd.  Signals are coalesced into a
+	 *	single counter, so the reader needs only one read()
+	 *	no matter how many signals were sent.
+	 *
+	 *	Fall back to a pipe if the kernel doesn't support
+	 *	eventfd.
 	 */
-	(void) fcntl(c->pipe[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
-	(void) fcntl(c->pipe[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+	c->pipe[0] = c->pipe[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (c->pipe[0] >= 0) {
+		read_cb = control_eventfd_read;
+	} else
+#endif
+	{
+		if (pipe((int *) &c->pipe) < 0) {
+			talloc_free(c);
+			fr_strerror_printf("Failed opening pipe for control socket: %s", fr_syserror(errno));
+			return NULL;
+		}
 
-	if (fr_event_fd_insert(c, el, c->pipe[0], pipe_read, NULL, NULL, c) < 0) {
+		/*
+		 *	We don't want reads from the pipe to be blocking.
+		 */
+		(void) fcntl(c->pipe[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+		(void) fcntl(c->pipe[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+	}
+	talloc_set_destructor(c, _control_free);
+
+	if (fr_event_fd_insert(c, el, c->pipe[0], read_cb, NULL, NULL, c) < 0) {
 		talloc_free(c);
 		fr_strerror_const_push("Failed adding FD to event list control socket");
 		return NULL;
@@ -353,6 +413,18 @@ int fr_control_message_send(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id,
 
 	if (fr_control_message_push(c, rb, id, data, data_size) < 0) return -1;
 
+#ifdef HAVE_SYS_EVENTFD_H
+	if (c->pipe[0] == c->pipe[1]) {
+		uint64_t one = 1;
+
+		while (write(c->pipe[1], &one, sizeof(one)) == 0) {
+			/* nothing */
+		}
+
+		return 0;
+	}
+#endif
+
 	while (write(c->pipe[1], ".", 1) == 0) {
 		/* nothing */
 	}
@@ -472,8 +544,7 @@ int fr_control_same_thread(fr_control_t *c)
 {
 	c->same_thread = true;
 	(void) fr_event_fd_delete(c->el, c->pipe[0], FR_EVENT_FILTER_IO);
-	close(c->pipe[0]);
-	close(c->pipe[1]);
+	control_close(c);
 
 	/*
 	 *	Nothing more to do now that everything is gone.
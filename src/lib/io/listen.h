@@ -39,6 +39,13 @@ struct fr_listen {
 
 	bool			connected;		//!< is this for a connected socket?
 	bool			track_duplicates;	//!< do we track duplicate packets?
+	bool			read_pending;		//!< app_io has buffered packets, and read()
+							///< should be called again without waiting
+							///< for the socket to become readable.
+	bool			per_network_socket;	//!< open one socket per network thread, all bound to
+							///< the same address with SO_REUSEPORT - set by open
+	bool			steer_by_source;	//!< steer packets to the per-network sockets by
+							///< source IP address - set by open
 	size_t			default_message_size;	//!< copied from app_io, but may be changed
 	size_t			num_messages;		//!< for the message ring buffer
 };
@@ -61,6 +68,10 @@ struct fr_async_s {
 						//!< and how we'll send the reply.
 	uint32_t		priority;	//!< higher == higher priority
 	bool			fake;		//!< is it a fake request
+
+	void			*stolen_from;	//!< Backlog entry of the worker which received this request,
+						//!< if another worker stole it.  The reply is
+						//!< handed back to that worker to send.
 };
 
 int fr_io_listen_free(fr_listen_t *li);
@@ -0,0 +1,437 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Write log messages from a dedicated thread.
+ * @file io/log_writer.c
+ *
+ *  Network and worker threads format their log messages as usual, but
+ *  instead of calling write() or syslog(), they put the message into
+ *  a queue.  The log writer thread takes messages from the queue, and
+ *  writes them in batches with writev().  A slow disk or syslog daemon
+ *  then delays only the log writer, and not request processing.
+ *
+ *  When the queue is full, messages are either discarded, or the
+ *  thread logging the message waits for the log writer to catch up.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/log_writer.h>
+#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYSLOG_H
+#  include <syslog.h>
+#endif
+
+/*
+ *	Write at most this many messages with one call to writev().
+ */
+#define LOG_WRITER_BATCH	(64)
+
+/** A formatted message, waiting to be written
+ *
+ * Allocated by the thread which logged the message, and freed by the
+ * log writer.
+ */
+typedef struct {
+	fr_log_dst_t		dst;		//!< Where the message goes.
+	int			fd;		//!< For the "files" destination.
+	int			priority;	//!< For syslog.
+	size_t			msg_len;	//!< Length of the message.
+	char			msg[];		//!< The message.
+} fr_log_writer_msg_t;
+
+struct fr_log_writer_s {
+	fr_log_writer_config_t	config;		//!< Our configuration.
+
+	pthread_t		pthread_id;	//!< The log writer thread.
+	bool			running;	//!< Whether the thread was started.
+
+	fr_atomic_queue_t	*queue;		//!< Messages waiting to be written.
+
+	pthread_mutex_t		mutex;		//!< Protects cond and space.
+	pthread_cond_t		cond;		//!< Signalled when there are messages to write.
+	atomic_bool		sleeping;	//!< The log writer is waiting on cond.
+	pthread_cond_t		space;		//!< Signalled when the log writer has made room in the queue.
+	atomic_uint32_t		blocked;	//!< Number of threads waiting on space.
+	atomic_bool		exiting;	//!< The log writer should exit once the queue is empty.
+
+	atomic_uint64_t		written;	//!< Number of messages written.
+	atomic_uint64_t		dropped;	//!< Number of messages discarded because the queue was full.
+	atomic_uint64_t		max_depth;	//!< Most messages which have been waiting at once.
+};
+
+/*
+ *	There's only one set of log destinations, so there's only
+ *	one log writer.
+ */
+static fr_log_writer_t *log_writer = NULL;
+
+fr_table_num_sorted_t const fr_log_writer_full_table[] = {
+	{ L("block"),	FR_LOG_WRITER_FULL_BLOCK },
+	{ L("drop"),	FR_LOG_WRITER_FULL_DROP }
+};
+size_t fr_log_writer_full_table_len = NUM_ELEMENTS(fr_log_writer_full_table);
+
+/** Wake the log writer, if it's waiting for messages
+ *
+ */
+static void log_writer_wake(fr_log_writer_t *lw)
+{
+	/*
+	 *	Pairs with the fence in log_writer_thread().  Either
+	 *	we see that it's sleeping, or it sees our message.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!atomic_load_explicit(&lw->sleeping, memory_order_relaxed)) return;
+
+	pthread_mutex_lock(&lw->mutex);
+	pthread_cond_signal(&lw->cond);
+	pthread_mutex_unlock(&lw->mutex);
+}
+
+/** Queue a message for the log writer
+ *
+ * Called by the thread which is logging the message, via the hook set
+ * with #fr_log_async_write_set.  The destination is copied into the
+ * message, as the fr_log_t may be freed before the message is written.
+ */
+static int log_writer_write(fr_log_t const *log, int priority, char const *msg, size_t msg_len)
+{
+	fr_log_writer_t		*lw = log_writer;
+	fr_log_writer_msg_t	*m;
+	uint64_t		depth, max_depth;
+
+	/*
+	 *	The message is freed by the log writer, so it can't
+	 *	be parented from anything in this thread.
+	 */
+	m = talloc_size(NULL, sizeof(*m) + msg_len);
+	if (!m) return -1;
+	talloc_set_name_const(m, "fr_log_writer_msg_t");
+
+	m->dst = log->dst;
+	m->fd = log->fd;
+	m->priority = priority;
+	m->msg_len = msg_len;
+	memcpy(m->msg, msg, msg_len);
+
+	while (!fr_atomic_queue_push(lw->queue, m)) {
+		if ((lw->config.full == FR_LOG_WRITER_FULL_DROP) ||
+		    atomic_load_explicit(&lw->exiting, memory_order_relaxed)) {
+			atomic_fetch_add_explicit(&lw->dropped, 1, memory_order_relaxed);
+			talloc_free(m);
+			return -1;
+		}
+
+		log_writer_wake(lw);
+
+		/*
+		 *	Wait for the log writer to make room.  Pairs
+		 *	with the fence in log_writer_thread().  Either
+		 *	it sees that we're blocked, or we see the room
+		 *	it made.
+		 */
+		pthread_mutex_lock(&lw->mutex);
+		atomic_fetch_add_explicit(&lw->blocked, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if ((fr_atomic_queue_num_elements(lw->queue) >= fr_atomic_queue_size(lw->queue)) &&
+		    !atomic_load(&lw->exiting)) {
+			pthread_cond_wait(&lw->space, &lw->mutex);
+		}
+
+		atomic_fetch_sub_explicit(&lw->blocked, 1, memory_order_relaxed);
+		pthread_mutex_unlock(&lw->mutex);
+	}
+
+	/*
+	 *	Track the high water mark, so that admins can tell
+	 *	whether the queue is big enough.
+	 */
+	depth = fr_atomic_queue_num_elements(lw->queue);
+	max_depth = atomic_load_explicit(&lw->max_depth, memory_order_relaxed);
+	while ((depth > max_depth) &&
+	       !atomic_compare_exchange_weak_explicit(&lw->max_depth, &max_depth, depth,
+						      memory_order_relaxed, memory_order_relaxed));
+
+	log_writer_wake(lw);
+
+	return 0;
+}
+
+/** Write out a vector, retrying after short writes
+ *
+ * Messages which fail to be written are discarded, as there's nowhere
+ * to report the error.
+ */
+static void log_writer_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t	wrote;
+
+		wrote = writev(fd, iov, iovcnt);
+		if (wrote < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+
+		/*
+		 *	Skip over the elements which were written
+		 *	completely, and adjust the one which was
+		 *	written partially.
+		 */
+		while ((iovcnt > 0) && ((size_t) wrote >= iov->iov_len)) {
+			wrote -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt == 0) return;
+
+		iov->iov_base = ((uint8_t *) iov->iov_base) + wrote;
+		iov->iov_len -= wrote;
+	}
+}
+
+/** Write a batch of messages to their destinations
+ *
+ * Consecutive messages for the same file are written with one call
+ * to writev().
+ */
+static void log_writer_flush(fr_log_writer_t *lw, fr_log_writer_msg_t **batch, int num)
+{
+	struct iovec	iov[LOG_WRITER_BATCH];
+	int		i, j, k;
+
+	for (i = 0; i < num; i = j) {
+		int fd = batch[i]->fd;
+
+#ifdef HAVE_SYSLOG_H
+		if (batch[i]->dst == L_DST_SYSLOG) {
+			syslog(batch[i]->priority, "%.*s", (int) batch[i]->msg_len, batch[i]->msg);
+			j = i + 1;
+			continue;
+		}
+#endif
+
+		for (j = i, k = 0; (j < num) && (batch[j]->dst == L_DST_FILES) && (batch[j]->fd == fd); j++, k++) {
+			iov[k].iov_base = batch[j]->msg;
+			iov[k].iov_len = batch[j]->msg_len;
+		}
+
+		log_writer_writev(fd, iov, k);
+	}
+
+	for (i = 0; i < num; i++) talloc_free(batch[i]);
+
+	atomic_fetch_add_explicit(&lw->written, num, memory_order_relaxed);
+}
+
+/** Main loop of the log writer thread
+ *
+ */
+static void *log_writer_thread(void *arg)
+{
+	fr_log_writer_t		*lw = talloc_get_type_abort(arg, fr_log_writer_t);
+	fr_log_writer_msg_t	*batch[LOG_WRITER_BATCH];
+	int			num;
+
+	for (;;) {
+		for (num = 0; num < LOG_WRITER_BATCH; num++) {
+			if (!fr_atomic_queue_pop(lw->queue, (void **) &batch[num])) break;
+		}
+
+		if (num > 0) {
+			/*
+			 *	Wake any threads waiting for room.
+			 *	Pairs with the fence in log_writer_write().
+			 */
+			atomic_thread_fence(memory_order_seq_cst);
+			if (atomic_load_explicit(&lw->blocked, memory_order_relaxed) > 0) {
+				pthread_mutex_lock(&lw->mutex);
+				pthread_cond_broadcast(&lw->space);
+				pthread_mutex_unlock(&lw->mutex);
+			}
+
+			log_writer_flush(lw, batch, num);
+			continue;
+		}
+
+		if (atomic_load(&lw->exiting)) break;
+
+		/*
+		 *	Nothing to write.  Tell the logging threads
+		 *	that they need to wake us, and check again in
+		 *	case one of them raced us.
+		 */
+		pthread_mutex_lock(&lw->mutex);
+		atomic_store(&lw->sleeping, true);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if ((fr_atomic_queue_num_elements(lw->queue) == 0) && !atomic_load(&lw->exiting)) {
+			pthread_cond_wait(&lw->cond, &lw->mutex);
+		}
+
+		atomic_store(&lw->sleeping, false);
+		pthread_mutex_unlock(&lw->mutex);
+	}
+
+	return NULL;
+}
+
+/** Stop the log writer thread, and write any messages still in the queue
+ *
+ */
+static int _log_writer_free(fr_log_writer_t *lw)
+{
+	fr_log_writer_msg_t	*batch[LOG_WRITER_BATCH];
+	int			num;
+
+	if (log_writer == lw) {
+		fr_log_async_write_set(NULL);
+		log_writer = NULL;
+	}
+
+	if (lw->running) {
+		atomic_store(&lw->exiting, true);
+
+		/*
+		 *	Threads waiting for room discard their
+		 *	messages instead.
+		 */
+		pthread_mutex_lock(&lw->mutex);
+		pthread_cond_signal(&lw->cond);
+		pthread_cond_broadcast(&lw->space);
+		pthread_mutex_unlock(&lw->mutex);
+
+		pthread_join(lw->pthread_id, NULL);
+	}
+
+	/*
+	 *	Messages which were queued while the log writer
+	 *	was exiting.
+	 */
+	do {
+		for (num = 0; num < LOG_WRITER_BATCH; num++) {
+			if (!fr_atomic_queue_pop(lw->queue, (void **) &batch[num])) break;
+		}
+		if (num > 0) log_writer_flush(lw, batch, num);
+	} while (num == LOG_WRITER_BATCH);
+
+	pthread_cond_destroy(&lw->cond);
+	pthread_cond_destroy(&lw->space);
+	pthread_mutex_destroy(&lw->mutex);
+
+	return 0;
+}
+
+/** Start the log writer thread
+ *
+ * Once the thread is running, messages for the "files" and "syslog"
+ * destinations are written by it.  Freeing the log writer stops the
+ * thread, and messages are written directly again.
+ *
+ * This must be called before the network and worker threads start,
+ * and the log writer freed only after they've exited.
+ *
+ * @param[in] ctx	to allocate the log writer in.
+ * @param[in] config	for the log writer.
+ * @return
+ *	- NULL on error.
+ *	- the log writer on success.
+ */
+fr_log_writer_t *fr_log_writer_create(TALLOC_CTX *ctx, fr_log_writer_config_t const *config)
+{
+	fr_log_writer_t	*lw;
+	pthread_attr_t	attr;
+	int		ret;
+
+	if (log_writer) {
+		fr_strerror_const("The log writer is already running");
+		return NULL;
+	}
+
+	lw = talloc_zero(ctx, fr_log_writer_t);
+	if (!lw) {
+	nomem:
+		fr_strerror_const("Failed allocating memory");
+		return NULL;
+	}
+	lw->config = *config;
+
+	if (lw->config.queue_size < LOG_WRITER_BATCH) lw->config.queue_size = LOG_WRITER_BATCH;
+
+	lw->queue = fr_atomic_queue_alloc(lw, lw->config.queue_size);
+	if (!lw->queue) {
+		talloc_free(lw);
+		goto nomem;
+	}
+
+	pthread_mutex_init(&lw->mutex, NULL);
+	pthread_cond_init(&lw->cond, NULL);
+	pthread_cond_init(&lw->space, NULL);
+	talloc_set_destructor(lw, _log_writer_free);
+
+	pthread_attr_init(&attr);
+	ret = pthread_create(&lw->pthread_id, &attr, log_writer_thread, lw);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating log writer thread: %s", fr_syserror(ret));
+		talloc_free(lw);
+		return NULL;
+	}
+	lw->running = true;
+
+	log_writer = lw;
+	fr_log_async_write_set(log_writer_write);
+
+	return lw;
+}
+
+static int cmd_stats_log_writer(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_log_writer_t *lw = ctx;
+
+	fprintf(fp, "count.written\t%" PRIu64 "\n", atomic_load_explicit(&lw->written, memory_order_relaxed));
+	fprintf(fp, "count.dropped\t%" PRIu64 "\n", atomic_load_explicit(&lw->dropped, memory_order_relaxed));
+	fprintf(fp, "queue.depth\t%zu\n", fr_atomic_queue_num_elements(lw->queue));
+	fprintf(fp, "queue.max_depth\t%" PRIu64 "\n", atomic_load_explicit(&lw->max_depth, memory_order_relaxed));
+	fprintf(fp, "queue.size\t%u\n", lw->config.queue_size);
+
+	return 0;
+}
+
+fr_cmd_table_t cmd_log_writer_table[] = {
+	{
+		.parent = "stats",
+		.name = "log",
+		.func = cmd_stats_log_writer,
+		.help = "Show statistics for the log writer thread.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
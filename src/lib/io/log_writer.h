@@ -0,0 +1,59 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file io/log_writer.h
+ * @brief Write log messages from a dedicated thread.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(log_writer_h, "$Id$")
+
+#include <freeradius-devel/server/command.h>
+#include <freeradius-devel/util/log.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_log_writer_s fr_log_writer_t;
+
+/** What to do when the queue of messages is full
+ *
+ */
+typedef enum {
+	FR_LOG_WRITER_FULL_DROP = 0,		//!< Discard the message, and count it.
+	FR_LOG_WRITER_FULL_BLOCK		//!< Wait until the log writer has made room.
+} fr_log_writer_full_t;
+
+typedef struct {
+	uint32_t		queue_size;	//!< Maximum number of messages waiting to be written.
+	fr_log_writer_full_t	full;		//!< What to do when the queue is full.
+} fr_log_writer_config_t;
+
+fr_log_writer_t	*fr_log_writer_create(TALLOC_CTX *ctx, fr_log_writer_config_t const *config);
+
+extern fr_table_num_sorted_t const fr_log_writer_full_table[];
+extern size_t fr_log_writer_full_table_len;
+
+extern fr_cmd_table_t cmd_log_writer_table[];
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,220 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the log writer thread
+ *
+ * @file src/lib/io/log_writer_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+#include "log_writer.c"
+
+#define NUM_THREADS	(4)
+#define NUM_MESSAGES	(10000)
+
+typedef struct {
+	fr_log_t	*log;
+	unsigned int	id;
+} log_thread_t;
+
+/** Log numbered messages, as one of several threads
+ *
+ */
+static void *log_thread(void *arg)
+{
+	log_thread_t	*t = arg;
+	unsigned int	i;
+	char		buffer[64];
+	int		len;
+
+	for (i = 0; i < NUM_MESSAGES; i++) {
+		len = snprintf(buffer, sizeof(buffer), "%u %u\n", t->id, i);
+		(void) log_writer_write(t->log, 0, buffer, len);
+	}
+
+	return NULL;
+}
+
+/** Read everything the log writer wrote to a pipe
+ *
+ */
+static void *read_thread(void *arg)
+{
+	int		fd = *(int *) arg;
+	char		*data = NULL;
+	size_t		used = 0, size = 0;
+	ssize_t		slen;
+
+	for (;;) {
+		if ((size - used) < 4096) {
+			size = (size * 2) + 4096;
+			data = realloc(data, size + 1);
+			if (!data) return NULL;
+		}
+
+		slen = read(fd, data + used, size - used);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (slen == 0) break;
+
+		used += slen;
+	}
+
+	data[used] = '\0';
+	return data;
+}
+
+/** Check that messages from each thread arrive in order
+ *
+ * @return the number of messages, or -1 if any were out of order.
+ */
+static int log_check_order(char *data, unsigned int num_threads, bool gaps)
+{
+	unsigned int	next[NUM_THREADS] = { 0 };
+	char		*p = data, *q;
+	unsigned int	id, i;
+	int		count = 0;
+
+	while (*p) {
+		id = strtoul(p, &q, 10);
+		if ((q == p) || (*q != ' ') || (id >= num_threads)) return -1;
+		p = q + 1;
+
+		i = strtoul(p, &q, 10);
+		if ((q == p) || (*q != '\n')) return -1;
+		p = q + 1;
+
+		if (gaps ? (i < next[id]) : (i != next[id])) return -1;
+		next[id] = i + 1;
+		count++;
+	}
+
+	return count;
+}
+
+/** Messages from each thread are written in the order they were logged
+ *
+ */
+static void log_writer_order(void)
+{
+	fr_log_writer_t		*lw;
+	fr_log_t		log = { .dst = L_DST_FILES };
+	log_thread_t		t[NUM_THREADS];
+	pthread_t		thread[NUM_THREADS], reader;
+	int			fd[2];
+	unsigned int		i;
+	char			*data;
+
+	TEST_CHECK(pipe(fd) == 0);
+	log.fd = fd[1];
+
+	lw = fr_log_writer_create(NULL, &(fr_log_writer_config_t){ .queue_size = 128,
+								     .full = FR_LOG_WRITER_FULL_BLOCK });
+	TEST_CHECK(lw != NULL);
+	if (!lw) return;
+
+	TEST_CHECK(pthread_create(&reader, NULL, read_thread, &fd[0]) == 0);
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		t[i] = (log_thread_t){ .log = &log, .id = i };
+		TEST_CHECK(pthread_create(&thread[i], NULL, log_thread, &t[i]) == 0);
+	}
+	for (i = 0; i < NUM_THREADS; i++) pthread_join(thread[i], NULL);
+
+	TEST_CHECK(atomic_load(&lw->dropped) == 0);
+	TEST_MSG("Expected no messages to be dropped, got %" PRIu64, atomic_load(&lw->dropped));
+
+	talloc_free(lw);
+	close(fd[1]);
+
+	pthread_join(reader, (void **) &data);
+	close(fd[0]);
+	TEST_CHECK(data != NULL);
+	if (!data) return;
+
+	/*
+	 *	Nothing was dropped, so every message from each
+	 *	thread is there, and in sequence.
+	 */
+	TEST_CHECK(log_check_order(data, NUM_THREADS, false) == (NUM_THREADS * NUM_MESSAGES));
+	free(data);
+}
+
+/** Messages are dropped and counted when the queue is full
+ *
+ */
+static void log_writer_drop(void)
+{
+	fr_log_writer_t		*lw;
+	fr_log_t		log = { .dst = L_DST_FILES };
+	pthread_t		reader;
+	int			fd[2];
+	int			count, len;
+	unsigned int		i;
+	uint64_t		dropped = 0;
+	char			buffer[64];
+	char			*data;
+
+	TEST_CHECK(pipe(fd) == 0);
+	log.fd = fd[1];
+
+	lw = fr_log_writer_create(NULL, &(fr_log_writer_config_t){ .queue_size = 64,
+								     .full = FR_LOG_WRITER_FULL_DROP });
+	TEST_CHECK(lw != NULL);
+	if (!lw) return;
+
+	/*
+	 *	Nothing reads the pipe yet, so the log writer blocks
+	 *	once it's full, and the queue fills up behind it.
+	 */
+	for (i = 0; (i < (NUM_MESSAGES * 100)) && (dropped < 10); i++) {
+		len = snprintf(buffer, sizeof(buffer), "0 %u\n", i);
+		if (log_writer_write(&log, 0, buffer, len) < 0) dropped++;
+	}
+
+	TEST_CHECK(dropped == atomic_load(&lw->dropped));
+	TEST_CHECK(dropped > 0);
+	TEST_MSG("Expected messages to be dropped");
+
+	TEST_CHECK(pthread_create(&reader, NULL, read_thread, &fd[0]) == 0);
+
+	talloc_free(lw);
+	close(fd[1]);
+
+	pthread_join(reader, (void **) &data);
+	close(fd[0]);
+	TEST_CHECK(data != NULL);
+	if (!data) return;
+
+	/*
+	 *	The messages which weren't dropped are still in order.
+	 */
+	count = log_check_order(data, 1, true);
+	TEST_CHECK(count > 0);
+	TEST_CHECK((uint64_t) count + dropped == i);
+	TEST_MSG("Expected %u messages, got %d written and %" PRIu64 " dropped", i, count, dropped);
+	free(data);
+}
+
+TEST_LIST = {
+	{ "log_writer_order",	log_writer_order },
+	{ "log_writer_drop",	log_writer_drop },
+	{ NULL }
+};
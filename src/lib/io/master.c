@@ -375,6 +375,11 @@ static RADCLIENT *radclient_clone(TALLOC_CTX *ctx, RADCLIENT const *parent)
 	DUP_FIELD(server);
 	DUP_FIELD(nas_type);
 
+	if (c->secret) {
+		c->secret_key = fr_md5_key_alloc(c, (uint8_t const *) c->secret, talloc_array_length(c->secret) - 1);
+		if (!c->secret_key) goto error;
+	}
+
 	COPY_FIELD(message_authenticator);
 	/* dynamic MUST be false */
 	COPY_FIELD(server_cs);
@@ -620,6 +625,7 @@ static fr_io_connection_t *fr_io_connection_alloc(fr_io_instance_t const *inst,
 		 *	Glue in the actual app_io
 		 */
 		li->connected = true;
+		li->read_pending = false;
 		li->app_io = thread->child->app_io;
 		li->thread_instance = connection;
 		li->app_io_instance = dl_inst->data;
@@ -660,6 +666,7 @@ static fr_io_connection_t *fr_io_connection_alloc(fr_io_instance_t const *inst,
 		fr_assert(li->app_io == &fr_master_app_io);
 
 		li->connected = true;
+		li->read_pending = false;
 		li->thread_instance = connection;
 		li->app_io_instance = li->thread_instance;
 		li->track_duplicates = thread->child->app_io->track_duplicates;
@@ -1085,8 +1092,8 @@ static int _client_live_free(fr_io_client_t *client)
  *
  *  The app_io->read does the transport-specific data read.
  */
-static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p,
-			uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, bool *is_dup)
+static ssize_t master_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p,
+			   uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, bool *is_dup)
 {
 	fr_io_instance_t const *inst;
 	fr_io_thread_t *thread;
@@ -1724,6 +1731,28 @@ done:
 	return 0;
 }
 
+/** Read a packet, and tell the network if the child has more buffered
+ *
+ *  The child app_io may read multiple packets from the socket at once
+ *  (e.g. via recvmmsg()).  Those packets aren't visible to the event
+ *  loop, so the network has to keep calling us until they're drained.
+ */
+static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p,
+			uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, bool *is_dup)
+{
+	fr_io_instance_t const *inst;
+	fr_io_connection_t *connection;
+	fr_listen_t *child;
+	ssize_t packet_len;
+
+	packet_len = master_read(li, packet_ctx, recv_time_p, buffer, buffer_len, leftover, priority, is_dup);
+
+	get_inst(li, &inst, NULL, &connection, &child);
+	li->read_pending = child->read_pending;
+
+	return packet_len;
+}
+
 /** Inject a packet to a connection.
  *
  *  Always called in the context of the network.
@@ -2503,6 +2532,22 @@ reread:
 	return buffer_len;
 }
 
+/** Flush any replies which the underlying transport has buffered
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	fr_io_instance_t const *inst;
+	fr_io_connection_t *connection;
+	fr_listen_t *child;
+
+	get_inst(li, &inst, NULL, &connection, &child);
+
+	if (!inst->app_io->flush) return 0;
+
+	return inst->app_io->flush(child);
+}
+
 /** Close the socket.
  *
  */
@@ -2874,25 +2919,15 @@ int fr_io_listen_free(fr_listen_t *li)
 	return 0;
 }
 
-int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
-			size_t default_message_size, size_t num_messages)
+/** Allocate a master listener and its child, and open the child's socket
+ *
+ */
+static fr_listen_t *master_io_listen_alloc(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+					  size_t default_message_size, size_t num_messages)
 {
 	fr_listen_t	*li, *child;
 	fr_io_thread_t	*thread;
 
-	/*
-	 *	No IO paths, so we don't initialize them.
-	 */
-	if (!inst->app_io) {
-		fr_assert(!inst->dynamic_clients);
-		return 0;
-	}
-
-	if (!inst->app_io->thread_inst_size) {
-		fr_strerror_const("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
-		return -1;
-	}
-
 	/*
 	 *	Build the #fr_listen_t.  This describes the complete
 	 *	path data takes from the socket to the decoder and
@@ -2994,7 +3029,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	if (inst->app_io->open(child) < 0) {
 		cf_log_err(inst->app_io_conf, "Failed opening %s interface", inst->app_io->name);
 		talloc_free(li);
-		return -1;
+		return NULL;
 	}
 
 	li->fd = child->fd;	/* copy this back up */
@@ -3006,13 +3041,41 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	}
 	li->name = child->name;
 
+	return li;
+}
+
+int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+			size_t default_message_size, size_t num_messages)
+{
+	fr_listen_t	*li, *child;
+	fr_listen_t	**siblings;
+	unsigned int	i, num_networks;
+
+	/*
+	 *	No IO paths, so we don't initialize them.
+	 */
+	if (!inst->app_io) {
+		fr_assert(!inst->dynamic_clients);
+		return 0;
+	}
+
+	if (!inst->app_io->thread_inst_size) {
+		fr_strerror_const("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
+		return -1;
+	}
+
+	li = master_io_listen_alloc(ctx, inst, sc, default_message_size, num_messages);
+	if (!li) return -1;
+
+	child = ((fr_io_thread_t *) li->thread_instance)->child;
+
 	/*
 	 *	Record which socket we opened.
 	 */
 	if (child->app_io_addr) {
 		fr_listen_t *other;
 
-		other = listen_find_any(thread->child);
+		other = listen_find_any(child);
 		if (other) {
 			ERROR("Failed opening %s - that port is already in use by another listener in server %s { ... } - %s",
 			      child->name, cf_section_name2(other->server_cs), other->name);
@@ -3026,18 +3089,74 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 		(void) listen_record(child);
 	}
 
+	num_networks = fr_schedule_num_networks(sc);
+
 	/*
 	 *	Add the socket to the scheduler, where it might end up
 	 *	in a different thread.
 	 */
-	if (!fr_schedule_listen_add(sc, li)) {
-		talloc_free(li);
-		return -1;
+	if (!child->per_network_socket || (num_networks == 1)) {
+		if (!fr_schedule_listen_add(sc, li)) {
+			talloc_free(li);
+			return -1;
+		}
+
+		return 0;
 	}
 
+	/*
+	 *	The transport wants one socket per network thread.
+	 *	They're all bound to the same address with
+	 *	SO_REUSEPORT, and the kernel spreads the packets
+	 *	across them.
+	 *
+	 *	Each socket has its own master listener, and
+	 *	therefore its own client and tracking tables.  So
+	 *	packets from one client should always arrive on the
+	 *	same socket, otherwise dedup won't work.
+	 *
+	 *	We open all of the sockets before adding any of them
+	 *	to the networks, so that the kernel numbers them in
+	 *	the same order as the networks.
+	 */
+	MEM(siblings = talloc_zero_array(NULL, fr_listen_t *, num_networks));
+	siblings[0] = li;
+
+	for (i = 1; i < num_networks; i++) {
+		siblings[i] = master_io_listen_alloc(ctx, inst, sc, default_message_size, num_messages);
+		if (!siblings[i]) {
+			i = 0;
+			goto error;
+		}
+	}
+
+	if (child->steer_by_source && child->app_io_addr &&
+	    (fr_socket_reuseport_steer(li->fd, child->app_io_addr->inet.src_ipaddr.af, num_networks) < 0)) {
+		PWARN("Failed steering packets for %s by source address", li->name);
+	}
+
+	for (i = 0; i < num_networks; i++) {
+		if (!fr_schedule_listen_add_network(sc, siblings[i], i)) {
+			PERROR("Failed adding %s to network %u", siblings[i]->name, i);
+			goto error;
+		}
+	}
+
+	DEBUG("Opened %u sockets for %s, one per network", num_networks, li->name);
+
+	talloc_free(siblings);
+
 	return 0;
-}
 
+error:
+	/*
+	 *	Listeners which have already been added belong to
+	 *	their network.
+	 */
+	for (/* nothing */; i < num_networks; i++) talloc_free(siblings[i]);
+	talloc_free(siblings);
+	return -1;
+}
 
 fr_app_io_t fr_master_app_io = {
 	.magic			= RLM_MODULE_INIT,
@@ -3051,6 +3170,7 @@ fr_app_io_t fr_master_app_io = {
 
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.inject			= mod_inject,
 
 	.open			= mod_open,
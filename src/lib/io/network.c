@@ -57,6 +57,14 @@ typedef struct {
 	fr_time_t		recv_time;
 } fr_network_inject_t;
 
+/** Sent by a worker to add itself to a network
+ *
+ */
+typedef struct {
+	fr_worker_t		*worker;		//!< The worker.
+	fr_channel_t		*channel;		//!< Worker's half of the channel, allocated on its thread.
+} fr_network_worker_add_t;
+
 /** Associate a worker thread with a network thread
  *
  */
@@ -66,6 +74,7 @@ typedef struct {
 	fr_time_t		predicted;		//!< predicted processing time for one packet
 
 	bool			blocked;		//!< is this worker blocked?
+	int			numa_node;		//!< NUMA node the worker is on, or -1.
 
 	fr_channel_t		*channel;		//!< channel to the worker
 	fr_worker_t		*worker;		//!< worker pointer
@@ -92,7 +101,10 @@ typedef struct {
 
 	fr_channel_data_t	*pending;		//!< the currently pending partial packet
 	fr_heap_t		*waiting;		//!< packets waiting to be written
+	fr_dlist_t		flush_entry;		//!< in the list of sockets which need flushing.
 	fr_io_stats_t		stats;
+	uint64_t		reads;			//!< number of times the socket was readable, and
+							///< we read at least one packet.
 } fr_network_socket_t;
 
 /*
@@ -126,6 +138,7 @@ struct fr_network_s {
 	fr_event_list_t		*el;			//!< our event list
 
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
+	fr_dlist_head_t		flush;			//!< sockets with replies buffered by the app_io.
 
 	fr_io_stats_t		stats;
 
@@ -143,11 +156,18 @@ struct fr_network_s {
 
 	fr_network_config_t	config;			//!< configuration
 	fr_network_worker_t	*workers[MAX_WORKERS]; 	//!< each worker
+
+	int			cpu;			//!< CPU we're pinned to, or -1.
+	int			numa_node;		//!< NUMA node we're on, or -1.
+	int			num_local;		//!< number of workers on our NUMA node.
+	fr_network_worker_t	*local[MAX_WORKERS];	//!< workers on our NUMA node.
 };
 
 static void fr_network_post_event(fr_event_list_t *el, fr_time_t now, void *uctx);
+static void fr_network_local_update(fr_network_t *nr);
 static int fr_network_pre_event(void *ctx, fr_time_t wake);
 static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s);
+static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUSED int flags, void *ctx);
 static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int flags, void *ctx);
 static int8_t reply_cmp(void const *one, void const *two)
 {
@@ -265,13 +285,18 @@ int fr_network_directory_add(fr_network_t *nr, fr_listen_t *li)
 }
 
 /** Add a worker to a network
+ *
+ * Must be called from the worker's thread.  The half of the channel
+ * which the worker writes to is allocated here, so that it's placed on
+ * the worker's NUMA node.  The network allocates the other half.
  *
  * @param nr the network
  * @param worker the worker
  */
 int fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker)
 {
-	fr_ring_buffer_t *rb;
+	fr_ring_buffer_t	*rb;
+	fr_network_worker_add_t	add;
 
 	rb = fr_network_rb_init();
 	if (!rb) return -1;
@@ -279,7 +304,16 @@ int fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker)
 	(void) talloc_get_type_abort(nr, fr_network_t);
 	(void) talloc_get_type_abort(worker, fr_worker_t);
 
-	return fr_control_message_send(nr->control, rb, FR_CONTROL_ID_WORKER, &worker, sizeof(worker));
+	add.worker = worker;
+	add.channel = fr_worker_channel_alloc(worker);
+	if (!add.channel) return -1;
+
+	if (fr_control_message_send(nr->control, rb, FR_CONTROL_ID_WORKER, &add, sizeof(add)) < 0) {
+		talloc_free(add.channel);
+		return -1;
+	}
+
+	return 0;
 }
 
 /** Signal the network to read from a listener
@@ -530,11 +564,14 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 				/*
 				 *	Close the hole...
 				 */
-				memcpy(&nr->workers[i], &nr->workers[i + 1], ((nr->num_workers - i) - 1));
+				memmove(&nr->workers[i], &nr->workers[i + 1],
+					sizeof(nr->workers[0]) * ((nr->num_workers - i) - 1));
+				nr->workers[nr->num_workers - 1] = NULL;
 				break;
 			}
 		}
 		nr->num_workers--;
+		fr_network_local_update(nr);
 	}
 		break;
 	}
@@ -563,17 +600,27 @@ retry:
 		}
 
 	} else if (nr->num_blocked == 0) {
-		uint32_t one, two;
+		uint32_t one, two, num = nr->num_workers;
+		fr_network_worker_t **workers = nr->workers;
 
-		one = fr_rand() % nr->num_workers;
+		/*
+		 *	Prefer workers on our NUMA node, so that the
+		 *	packets and replies don't cross between nodes.
+		 */
+		if (nr->num_local > 1) {
+			num = nr->num_local;
+			workers = nr->local;
+		}
+
+		one = fr_rand() % num;
 		do {
-			two = fr_rand() % nr->num_workers;
+			two = fr_rand() % num;
 		} while (two == one);
 
-		if (nr->workers[one]->cpu_time < nr->workers[two]->cpu_time) {
-			worker = nr->workers[one];
+		if (workers[one]->cpu_time < workers[two]->cpu_time) {
+			worker = workers[one];
 		} else {
-			worker = nr->workers[two];
+			worker = workers[two];
 		}
 	} else {
 		int i;
@@ -665,6 +712,8 @@ static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s)
 
 	fr_event_fd_delete(nr->el, s->listen->fd, s->filter);
 
+	if (fr_dlist_entry_in_list(&s->flush_entry)) fr_dlist_remove(&nr->flush, s);
+
 	/*
 	 *	If there are no outstanding packets, then we can free
 	 *	it now.
@@ -692,6 +741,7 @@ static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s)
 static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int flags, void *ctx)
 {
 	int			num_messages = 0;
+	uint64_t		num_packets = 0;
 	fr_network_socket_t	*s = ctx;
 	fr_network_t		*nr = s->nr;
 	ssize_t			data_size;
@@ -723,10 +773,15 @@ next_message:
 	/*
 	 *	Poll this socket, but not too often.  We have to go
 	 *	service other sockets, too.
+	 *
+	 *	Packets which the app_io has already read into its
+	 *	own buffers are always drained.  The event loop
+	 *	doesn't know about them, and won't tell us to read
+	 *	them again.
 	 */
-	if (num_messages > 16) {
+	if ((num_messages > 16) && !s->listen->read_pending) {
 		s->cd = cd;
-		return;
+		goto done;
 	}
 
 	cd->request.is_dup = false;
@@ -745,6 +800,16 @@ next_message:
 	data_size = s->listen->app_io->read(s->listen, &cd->packet_ctx, &cd->request.recv_time,
 					    cd->m.data, cd->m.rb_size, &s->leftover, &cd->priority, &cd->request.is_dup);
 	if (data_size == 0) {
+		/*
+		 *	The app_io discarded the packet, but has more
+		 *	buffered.  Re-use the same message for the
+		 *	next one.
+		 */
+		if (s->listen->read_pending) {
+			num_messages++;
+			goto next_message;
+		}
+
 		/*
 		 *	Cache the message for later.  This is
 		 *	important for stream sockets, which can do
@@ -757,7 +822,7 @@ next_message:
 		 *	blocking issues can happen for stream sockets.
 		 */
 		s->cd = cd;
-		return;
+		goto done;
 	}
 
 	/*
@@ -773,6 +838,7 @@ next_message:
 	DEBUG3("Read %zd byte(s) from FD %u", data_size, sockfd);
 	nr->stats.in++;
 	s->stats.in++;
+	num_packets++;
 
 	/*
 	 *	Initialize the rest of the fields of the channel data.
@@ -847,6 +913,26 @@ next_message:
 		num_messages++;
 		goto next_message;
 	}
+
+	/*
+	 *	The app_io has more packets from a batched read.
+	 *	Allocate a new message, and go get the next one.
+	 */
+	if (s->listen->read_pending) {
+		cd = (fr_channel_data_t *) fr_message_reserve(s->ms, s->listen->default_message_size);
+		if (!cd) {
+			ERROR("Failed allocating message size %zd! - Closing socket",
+			      s->listen->default_message_size);
+			fr_network_socket_dead(nr, s);
+			return;
+		}
+
+		num_messages++;
+		goto next_message;
+	}
+
+done:
+	if (num_packets) s->reads++;
 }
 
 
@@ -895,6 +981,47 @@ static void fr_network_error(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 }
 
 
+/** Ask the app_io to write any replies it has buffered
+ *
+ *  If the socket would block, we add the write callback, and
+ *  fr_network_write() will try again when the socket is writable.
+ *
+ * @param[in] nr	the network.
+ * @param[in] s		the socket to flush.
+ * @return
+ *	- 0 all replies were written.
+ *	- >0 the socket is blocked.
+ *	- <0 the socket is dead.
+ */
+static int fr_network_flush(fr_network_t *nr, fr_network_socket_t *s)
+{
+	fr_listen_t *li = s->listen;
+	int rcode;
+
+	if (fr_dlist_entry_in_list(&s->flush_entry)) fr_dlist_remove(&nr->flush, s);
+
+	rcode = li->app_io->flush(li);
+	if (rcode < 0) {
+		PERROR("Failed flushing socket %s", li->name);
+		return rcode;
+	}
+
+	if ((rcode > 0) && !s->blocked) {
+		if (fr_event_fd_insert(nr, nr->el, li->fd,
+				       fr_network_read,
+				       fr_network_write,
+				       fr_network_error,
+				       s) < 0) {
+			PERROR("Failed adding write callback to event loop");
+			return -1;
+		}
+
+		s->blocked = true;
+	}
+
+	return rcode;
+}
+
 /** Write packets to the network.
  *
  * @param el the event list
@@ -911,6 +1038,22 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 
 	(void) talloc_get_type_abort(nr, fr_network_t);
 
+	/*
+	 *	The socket is writable again, so send any replies
+	 *	which the app_io has buffered before we give it more.
+	 */
+	if (s->blocked && li->app_io->flush) {
+		int rcode;
+
+		rcode = fr_network_flush(nr, s);
+		if (rcode < 0) {
+			fr_network_socket_dead(nr, s);
+			return;
+		}
+
+		if (rcode > 0) return;
+	}
+
 	/*
 	 *	Start with the currently pending message, and then
 	 *	work through the priority heap.
@@ -1015,6 +1158,15 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		nr->stats.out++;
 		s->stats.out++;
 
+		/*
+		 *	The app_io may buffer replies, so that it can
+		 *	send them all at once.  Ask it to flush them
+		 *	after we've processed all of the replies.
+		 */
+		if (li->app_io->flush && !fr_dlist_entry_in_list(&s->flush_entry)) {
+			fr_dlist_insert_tail(&nr->flush, s);
+		}
+
 		/*
 		 *	Grab the net entry.
 		 */
@@ -1047,6 +1199,8 @@ static int _network_socket_free(fr_network_socket_t *s)
 
 	fr_event_fd_delete(nr->el, s->listen->fd, s->filter);
 
+	if (fr_dlist_entry_in_list(&s->flush_entry)) fr_dlist_remove(&nr->flush, s);
+
 	if (s->listen->app_io->close) {
 		s->listen->app_io->close(s->listen);
 	} else {
@@ -1228,19 +1382,21 @@ static void fr_network_worker_started_callback(void *ctx, void const *data, size
 {
 	int i;
 	fr_network_t *nr = ctx;
-	fr_worker_t *worker;
+	fr_network_worker_add_t add;
 	fr_network_worker_t *w;
 
-	fr_assert(data_size == sizeof(worker));
+	fr_assert(data_size == sizeof(add));
 
-	memcpy(&worker, data, data_size);
-	(void) talloc_get_type_abort(worker, fr_worker_t);
+	memcpy(&add, data, data_size);
+	(void) talloc_get_type_abort(add.worker, fr_worker_t);
 
 	MEM(w = talloc_zero(nr, fr_network_worker_t));
 
-	w->worker = worker;
-	w->channel = fr_worker_channel_create(worker, w, nr->control);
-	fr_fatal_assert_msg(w->channel, "Failed creating new channel");
+	w->worker = add.worker;
+	w->numa_node = fr_worker_numa_node(add.worker);
+	w->channel = add.channel;
+	fr_fatal_assert_msg(fr_worker_channel_open(add.worker, w->channel, w, nr->control) == 0,
+			    "Failed creating new channel");
 
 	fr_channel_requestor_uctx_add(w->channel, w);
 	fr_channel_set_recv_reply(w->channel, nr, fr_network_recv_reply);
@@ -1255,6 +1411,7 @@ static void fr_network_worker_started_callback(void *ctx, void const *data, size
 		if (nr->workers[i]) continue;
 
 		nr->workers[i] = w;
+		fr_network_local_update(nr);
 		return;
 	}
 
@@ -1326,6 +1483,7 @@ static int fr_network_pre_event(void *ctx, UNUSED fr_time_t wake)
 static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
 {
 	fr_channel_data_t *cd;
+	fr_network_socket_t *s;
 	fr_network_t *nr = talloc_get_type_abort(uctx, fr_network_t);
 
 	/*
@@ -1334,7 +1492,6 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 	 */
 	while ((cd = fr_heap_pop(nr->replies)) != NULL) {
 		fr_listen_t *li;
-		fr_network_socket_t *s;
 
 		li = cd->listen;
 
@@ -1381,16 +1538,22 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 		}
 
 		/*
-		 *	No pending message, let's try writing it.
+		 *	If the socket isn't blocked, let's try writing it.
 		 *
-		 *	If there is a pending message, then we're
-		 *	waiting for IO write to become ready.
+		 *	If it is blocked, then we're waiting for IO
+		 *	write to become ready, and the message stays
+		 *	in the queue until then.
 		 */
-		if (!s->pending) {
-			fr_assert(!s->blocked);
-			(void) fr_heap_insert(s->waiting, cd);
-			fr_network_write(nr->el, s->listen->fd, 0, s);
-		}
+		(void) fr_heap_insert(s->waiting, cd);
+		if (!s->blocked) fr_network_write(nr->el, s->listen->fd, 0, s);
+	}
+
+	/*
+	 *	Send all of the replies the app_io has buffered in
+	 *	this pass, with (ideally) one system call per socket.
+	 */
+	while ((s = fr_dlist_head(&nr->flush)) != NULL) {
+		if (fr_network_flush(nr, s) < 0) fr_network_socket_dead(nr, s);
 	}
 }
 
@@ -1512,6 +1675,27 @@ void fr_network(fr_network_t *nr)
 		 *	the event loop, but we don't wait for events.
 		 */
 		wait_for_event = (fr_heap_num_elements(nr->replies) == 0);
+		if (wait_for_event) {
+			int i;
+
+			/*
+			 *	Tell the workers that we're about to
+			 *	sleep, so that they signal us when they
+			 *	send a new reply.  If they raced us, read
+			 *	the new replies instead.
+			 */
+			for (i = 0; i < nr->num_workers; i++) {
+				fr_network_worker_t *w = nr->workers[i];
+
+				if (!w) continue;
+
+				if (fr_channel_requestor_sleeping(w->channel) > 0) {
+					while (fr_channel_recv_reply(w->channel));
+				}
+			}
+
+			wait_for_event = (fr_heap_num_elements(nr->replies) == 0);
+		}
 
 		/*
 		 *	Check the event list.  If there's an error
@@ -1524,9 +1708,13 @@ void fr_network(fr_network_t *nr)
 		if (num_events < 0) break;
 
 		/*
-		 *	Service outstanding events.
+		 *	Service outstanding events, and write any
+		 *	pending replies.  In per-core mode, the
+		 *	worker's post event adds replies after ours
+		 *	has run, so there can be replies to write
+		 *	even when there are no events.
 		 */
-		if (num_events > 0) {
+		if ((num_events > 0) || !wait_for_event) {
 			DEBUG4("Servicing event(s)");
 			fr_event_service(nr->el);
 		}
@@ -1596,6 +1784,8 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 	nr->num_workers = 0;
 	nr->signal_pipe[0] = -1;
 	nr->signal_pipe[1] = -1;
+	nr->cpu = -1;
+	nr->numa_node = -1;
 	if (config) nr->config = *config;
 
 	nr->aq_control = fr_atomic_queue_alloc(nr, 1024);
@@ -1672,6 +1862,8 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 		goto fail2;
 	}
 
+	fr_dlist_init(&nr->flush, fr_network_socket_t, flush_entry);
+
 	if (fr_event_pre_insert(nr->el, fr_network_pre_event, nr) < 0) {
 		fr_strerror_const("Failed adding pre-check to event list");
 		goto fail2;
@@ -1713,6 +1905,41 @@ int fr_network_stats(fr_network_t const *nr, int num, uint64_t *stats)
 	return 5;
 }
 
+/** Rebuild the list of workers on our NUMA node
+ *
+ */
+static void fr_network_local_update(fr_network_t *nr)
+{
+	int i;
+
+	nr->num_local = 0;
+	if (nr->numa_node < 0) return;
+
+	for (i = 0; i < nr->max_workers; i++) {
+		if (!nr->workers[i]) continue;
+		if (nr->workers[i]->numa_node != nr->numa_node) continue;
+
+		nr->local[nr->num_local++] = nr->workers[i];
+	}
+}
+
+/** Record where the network is running
+ *
+ * When the NUMA node is known, packets are preferentially sent to
+ * workers on the same node.  Must be called from the network's thread.
+ *
+ * @param[in] nr	to update.
+ * @param[in] cpu	the network is pinned to, or -1.
+ * @param[in] numa_node	the network is on, or -1 if unknown.
+ */
+void fr_network_placement_set(fr_network_t *nr, int cpu, int numa_node)
+{
+	nr->cpu = cpu;
+	nr->numa_node = numa_node;
+
+	fr_network_local_update(nr);
+}
+
 void fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log)
 {
 	int i;
@@ -1736,6 +1963,10 @@ static int cmd_stats_self(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cm
 	fprintf(fp, "count.dup\t%" PRIu64 "\n", nr->stats.dup);
 	fprintf(fp, "count.dropped\t%" PRIu64 "\n", nr->stats.dropped);
 	fprintf(fp, "count.sockets\t%u\n", rbtree_num_elements(nr->sockets));
+	fprintf(fp, "count.workers\t%d\n", nr->num_workers);
+	fprintf(fp, "count.local_workers\t%d\n", nr->num_local);
+	fprintf(fp, "placement.cpu\t%d\n", nr->cpu);
+	fprintf(fp, "placement.numa_node\t%d\n", nr->numa_node);
 
 	return 0;
 }
@@ -1779,6 +2010,8 @@ static int cmd_stats_socket(FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t con
 	fprintf(fp, "count.out\t%" PRIu64 "\n", s->stats.out);
 	fprintf(fp, "count.dup\t%" PRIu64 "\n", s->stats.dup);
 	fprintf(fp, "count.dropped\t%" PRIu64 "\n", s->stats.dropped);
+	fprintf(fp, "count.reads\t%" PRIu64 "\n", s->reads);
+	if (s->reads) fprintf(fp, "average.packets_per_read\t%.2f\n", (double) s->stats.in / (double) s->reads);
 
 	return 0;
 }
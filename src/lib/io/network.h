@@ -75,6 +75,8 @@ int		fr_network_stats(fr_network_t const *nr, int num, uint64_t *stats) CC_HINT(
 
 void		fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log) CC_HINT(nonnull);
 
+void		fr_network_placement_set(fr_network_t *nr, int cpu, int numa_node) CC_HINT(nonnull);
+
 extern fr_cmd_table_t cmd_network_table[];
 
 #ifdef __cplusplus
@@ -29,6 +29,7 @@ RCSID("$Id$")
 #include <freeradius-devel/autoconf.h>
 
 #include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/rbtree.h>
 #include <freeradius-devel/util/syserror.h>
@@ -36,6 +37,11 @@ RCSID("$Id$")
 
 #include <pthread.h>
 
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#include <dirent.h>
+#endif
+
 /*
  *	Other OS's have sem_init, OS X doesn't.
  */
@@ -75,6 +81,14 @@ typedef enum fr_schedule_child_status_t {
 	FR_CHILD_FAIL				//!< failed, and in the exited queue
 } fr_schedule_child_status_t;
 
+/** Where a network or worker thread runs
+ *
+ */
+typedef struct {
+	int		cpu;			//!< CPU the thread is pinned to, or -1 if it isn't pinned.
+	int		node;			//!< NUMA node of the CPU, or -1 if unknown.
+} fr_schedule_placement_t;
+
 /** Scheduler specific information for worker threads
  *
  * Wraps a fr_worker_t, tracking additional information that
@@ -95,6 +109,8 @@ typedef struct {
 
 	fr_schedule_child_status_t status;	//!< status of the worker
 	fr_worker_t	*worker;		//!< the worker data structure
+
+	fr_schedule_placement_t placement;	//!< where the thread runs.
 } fr_schedule_worker_t;
 
 /** Scheduler specific information for network threads
@@ -114,8 +130,12 @@ typedef struct {
 
 	fr_schedule_child_status_t status;	//!< status of the worker
 	fr_network_t	*nr;			//!< the receive data structure
+	fr_schedule_worker_t *sw;		//!< the worker running in the same thread.
+						///< Only used in per-core mode.
 
 	fr_event_timer_t const *ev;		//!< timer for stats_interval
+
+	fr_schedule_placement_t placement;	//!< where the thread runs.
 } fr_schedule_network_t;
 
 
@@ -146,6 +166,16 @@ struct fr_schedule_s {
 
 	fr_network_t	*single_network;	//!< for single-threaded mode
 	fr_worker_t	*single_worker;		//!< for single-threaded mode
+
+	fr_worker_group_t *group;		//!< workers which steal requests from each other.
+
+	int		*cpu_node;		//!< NUMA node of each CPU, -1 if unknown.
+	int		*network_cpus;		//!< CPUs from the "network_cpus" configuration.
+	int		num_network_cpus;	//!< number of CPUs in network_cpus.
+	int		*worker_cpus;		//!< CPUs from the "worker_cpus" configuration.
+	int		num_worker_cpus;	//!< number of CPUs in worker_cpus.
+	int		*auto_cpus;		//!< allowed CPUs, interleaved across NUMA nodes.
+	int		num_auto_cpus;		//!< number of CPUs in auto_cpus.
 };
 
 static _Thread_local int worker_id;		//!< Internal ID of the current worker thread.
@@ -159,6 +189,294 @@ int fr_schedule_worker_id(void)
 	return worker_id;
 }
 
+/** Call the thread instantiation callback for a worker
+ *
+ * @param[in] sc	the scheduler.
+ * @param[in] sw	the worker, with its ctx and el already set.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int fr_schedule_worker_instantiate(fr_schedule_t *sc, fr_schedule_worker_t *sw)
+{
+	CONF_SECTION	*cs;
+	char		section_name[32];
+
+	/*
+	 *	@todo make this a registry
+	 */
+	if (!sc->worker_thread_instantiate) return 0;
+
+	snprintf(section_name, sizeof(section_name), "%u", sw->id);
+
+	cs = cf_section_find(sc->cs, "worker", section_name);
+	if (!cs) cs = cf_section_find(sc->cs, "worker", NULL);
+
+	return sc->worker_thread_instantiate(sw->ctx, sw->el, cs);
+}
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+/** Parse a list of CPUs, e.g. "0-3,8,10-11"
+ *
+ * This is the format used by taskset, and by /sys/devices/system/node.
+ *
+ * @param[out] set	of CPUs in the list.
+ * @param[in] list	to parse.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int fr_schedule_cpulist_parse(cpu_set_t *set, char const *list)
+{
+	char const	*p = list;
+	char		*q;
+	unsigned long	first, last;
+
+	CPU_ZERO(set);
+
+	while (*p) {
+		while (isspace((uint8_t) *p) || (*p == ',')) p++;
+		if (!*p) break;
+
+		if (!isdigit((uint8_t) *p)) {
+		invalid:
+			fr_strerror_printf("Invalid CPU list \"%s\"", list);
+			return -1;
+		}
+
+		first = last = strtoul(p, &q, 10);
+		p = q;
+
+		if (*p == '-') {
+			p++;
+			if (!isdigit((uint8_t) *p)) goto invalid;
+
+			last = strtoul(p, &q, 10);
+			p = q;
+		}
+
+		if ((last < first) || (last >= CPU_SETSIZE)) goto invalid;
+
+		while (first <= last) CPU_SET(first++, set);
+	}
+
+	return 0;
+}
+
+/** Find the NUMA node of each CPU
+ *
+ * @param[out] cpu_node		indexed by CPU.  CPUs which aren't in
+ *				any node are left as -1.
+ * @return
+ *	- the number of NUMA nodes.
+ *	- 0 if the topology isn't available.
+ */
+static int fr_schedule_topology(int *cpu_node)
+{
+	DIR		*dir;
+	struct dirent	*dp;
+	int		i, num_nodes = 0;
+
+	for (i = 0; i < CPU_SETSIZE; i++) cpu_node[i] = -1;
+
+	dir = opendir("/sys/devices/system/node");
+	if (!dir) return 0;
+
+	while ((dp = readdir(dir)) != NULL) {
+		char		path[PATH_MAX], buffer[1024];
+		unsigned int	node;
+		cpu_set_t	cpus;
+		FILE		*fp;
+
+		if (sscanf(dp->d_name, "node%u", &node) != 1) continue;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", dp->d_name);
+		fp = fopen(path, "r");
+		if (!fp) continue;
+
+		if (!fgets(buffer, sizeof(buffer), fp) || (fr_schedule_cpulist_parse(&cpus, buffer) < 0)) {
+			fclose(fp);
+			continue;
+		}
+		fclose(fp);
+
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (CPU_ISSET(i, &cpus)) cpu_node[i] = node;
+		}
+		num_nodes++;
+	}
+	closedir(dir);
+
+	return num_nodes;
+}
+
+/** Turn a set of CPUs into an array, in the order threads should use them
+ *
+ * CPUs are interleaved across NUMA nodes, so that consecutive threads
+ * go to different nodes.  The first CPU of each node is used first,
+ * then the second CPU of each node, and so on.
+ *
+ * @param[in] ctx	to allocate the array in.
+ * @param[out] out	the array of CPUs.
+ * @param[in] cpus	to put into the array.
+ * @param[in] cpu_node	the NUMA node of each CPU.
+ * @return the number of CPUs in the array.
+ */
+static int fr_schedule_cpus_order(TALLOC_CTX *ctx, int **out, cpu_set_t *cpus, int const *cpu_node)
+{
+	int		*array;
+	int		i, num, count = 0;
+	cpu_set_t	left;
+
+	num = CPU_COUNT(cpus);
+	if (num == 0) {
+		*out = NULL;
+		return 0;
+	}
+
+	MEM(array = talloc_array(ctx, int, num));
+
+	memcpy(&left, cpus, sizeof(left));
+	while (count < num) {
+		cpu_set_t done_nodes;
+
+		/*
+		 *	One pass takes the lowest unused CPU from
+		 *	each node.  CPUs with no node are treated as
+		 *	being in their own node.
+		 */
+		CPU_ZERO(&done_nodes);
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (!CPU_ISSET(i, &left)) continue;
+
+			if (cpu_node[i] >= 0) {
+				if (CPU_ISSET(cpu_node[i], &done_nodes)) continue;
+				CPU_SET(cpu_node[i], &done_nodes);
+			}
+
+			CPU_CLR(i, &left);
+			array[count++] = i;
+		}
+	}
+
+	*out = array;
+	return count;
+}
+
+/** Work out which CPUs the network and worker threads are pinned to
+ *
+ * @param[in] sc	the scheduler.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int fr_schedule_cpus_plan(fr_schedule_t *sc)
+{
+	cpu_set_t	cpus;
+	int		ret, num_nodes;
+
+	if (!sc->config->pin_threads && !sc->config->network_cpus && !sc->config->worker_cpus) return 0;
+
+	MEM(sc->cpu_node = talloc_array(sc, int, CPU_SETSIZE));
+	num_nodes = fr_schedule_topology(sc->cpu_node);
+	DEBUG2("Found %d NUMA node(s)", num_nodes);
+
+	if (sc->config->network_cpus) {
+		if (fr_schedule_cpulist_parse(&cpus, sc->config->network_cpus) < 0) return -1;
+
+		sc->num_network_cpus = fr_schedule_cpus_order(sc, &sc->network_cpus, &cpus, sc->cpu_node);
+	}
+
+	if (sc->config->worker_cpus) {
+		if (fr_schedule_cpulist_parse(&cpus, sc->config->worker_cpus) < 0) return -1;
+
+		sc->num_worker_cpus = fr_schedule_cpus_order(sc, &sc->worker_cpus, &cpus, sc->cpu_node);
+	}
+
+	if (!sc->config->pin_threads) return 0;
+
+	/*
+	 *	Only use the CPUs we're allowed to run on, so that
+	 *	restrictions from taskset or cgroups are respected.
+	 */
+	ret = pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (ret != 0) {
+		fr_strerror_printf("Failed getting CPU affinity: %s", fr_syserror(ret));
+		return -1;
+	}
+
+	sc->num_auto_cpus = fr_schedule_cpus_order(sc, &sc->auto_cpus, &cpus, sc->cpu_node);
+
+	return 0;
+}
+#endif
+
+/** Decide where a network or worker thread runs
+ *
+ * Explicit CPU lists take priority.  Otherwise, if "pin_threads" is
+ * set, networks use the first CPUs in the automatic layout, and
+ * workers use the CPUs after them.  As the layout interleaves NUMA
+ * nodes, both networks and workers are spread evenly across nodes.
+ *
+ * @param[in] sc		the scheduler.
+ * @param[out] placement	where the thread runs.
+ * @param[in] network		true for network threads, false for worker
+ *				and per-core threads.
+ * @param[in] id		of the thread.
+ */
+static void fr_schedule_place(fr_schedule_t *sc, fr_schedule_placement_t *placement, bool network, unsigned int id)
+{
+	placement->cpu = -1;
+	placement->node = -1;
+
+	if (network && sc->num_network_cpus) {
+		placement->cpu = sc->network_cpus[id % sc->num_network_cpus];
+
+	} else if (!network && sc->num_worker_cpus) {
+		placement->cpu = sc->worker_cpus[id % sc->num_worker_cpus];
+
+	} else if (sc->num_auto_cpus) {
+		if (!network && !sc->config->per_core) id += sc->config->max_networks;
+
+		placement->cpu = sc->auto_cpus[id % sc->num_auto_cpus];
+	}
+
+	if ((placement->cpu >= 0) && sc->cpu_node) placement->node = sc->cpu_node[placement->cpu];
+}
+
+/** Pin the current thread to the CPU it was placed on
+ *
+ * @param[in] name		of the thread, for logging.
+ * @param[in] placement		from fr_schedule_place().  If pinning
+ *				fails, it is updated to say that the thread
+ *				isn't pinned.
+ */
+static void fr_schedule_pin(fr_schedule_t *sc, char const *name, fr_schedule_placement_t *placement)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t	cpus;
+	int		ret;
+
+	if (placement->cpu < 0) return;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(placement->cpu, &cpus);
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (ret != 0) {
+		WARN("%s - Not pinning thread to CPU %d: %s", name, placement->cpu, fr_syserror(ret));
+		placement->cpu = placement->node = -1;
+		return;
+	}
+
+	if (placement->node >= 0) {
+		DEBUG2("%s - Pinned to CPU %d on NUMA node %d", name, placement->cpu, placement->node);
+	} else {
+		DEBUG2("%s - Pinned to CPU %d", name, placement->cpu);
+	}
+#endif
+}
+
 /** Entry point for worker threads
  *
  * @param[in] arg	the fr_schedule_worker_t
@@ -177,6 +495,12 @@ static void *fr_schedule_worker_thread(void *arg)
 
 	snprintf(worker_name, sizeof(worker_name), "Worker %d", sw->id);
 
+	/*
+	 *	Pin the thread before allocating anything, so that
+	 *	our memory is allocated on our NUMA node.
+	 */
+	fr_schedule_pin(sc, worker_name, &sw->placement);
+
 	sw->ctx = ctx = talloc_init("%s", worker_name);
 	if (!ctx) {
 		ERROR("%s - Failed allocating memory", worker_name);
@@ -197,23 +521,16 @@ static void *fr_schedule_worker_thread(void *arg)
 		PERROR("%s - Failed creating worker", worker_name);
 		goto fail;
 	}
+	fr_worker_placement_set(sw->worker, sw->placement.cpu, sw->placement.node);
 
-	/*
-	 *	@todo make this a registry
-	 */
-	if (sc->worker_thread_instantiate) {
-		CONF_SECTION	*cs;
-		char		section_name[32];
-
-		snprintf(section_name, sizeof(section_name), "%u", sw->id);
-
-		cs = cf_section_find(sc->cs, "worker", section_name);
-		if (!cs) cs = cf_section_find(sc->cs, "worker", NULL);
+	if (sc->group && (fr_worker_group_join(sw->worker, sc->group) < 0)) {
+		PERROR("%s - Failed joining worker group", worker_name);
+		goto fail;
+	}
 
-		if (sc->worker_thread_instantiate(sw->ctx, sw->el, cs) < 0) {
-			PERROR("%s - Failed calling thread instantiate", worker_name);
-			goto fail;
-		}
+	if (fr_schedule_worker_instantiate(sc, sw) < 0) {
+		PERROR("%s - Failed calling thread instantiate", worker_name);
+		goto fail;
 	}
 
 	sw->status = FR_CHILD_RUNNING;
@@ -298,6 +615,8 @@ static void *fr_schedule_network_thread(void *arg)
 
 	INFO("%s - Starting", network_name);
 
+	fr_schedule_pin(sc, network_name, &sn->placement);
+
 	sn->ctx = ctx = talloc_init("%s", network_name);
 	if (!ctx) {
 		ERROR("%s - Failed allocating memory", network_name);
@@ -315,6 +634,7 @@ static void *fr_schedule_network_thread(void *arg)
 		PERROR("%s - Failed creating network", network_name);
 		goto fail;
 	}
+	fr_network_placement_set(sn->nr, sn->placement.cpu, sn->placement.node);
 
 	sn->status = FR_CHILD_RUNNING;
 
@@ -352,6 +672,141 @@ fail:
 	return NULL;
 }
 
+/** Initialize and run a per-core thread
+ *
+ * The thread runs one network and one worker on the same event list.
+ * The network only sends packets to this worker, so packets are read,
+ * processed, and replied to without crossing threads.
+ *
+ * The channel between the network and the worker is still used, as in
+ * single-threaded mode.  But both ends are serviced by the same event
+ * loop, so there are no cross-thread wakeups.
+ *
+ * @param[in] arg the fr_schedule_network_t
+ * @return NULL
+ */
+static void *fr_schedule_core_thread(void *arg)
+{
+	TALLOC_CTX			*ctx;
+	fr_schedule_network_t		*sn = talloc_get_type_abort(arg, fr_schedule_network_t);
+	fr_schedule_worker_t		*sw = sn->sw;
+	fr_schedule_t			*sc = sn->sc;
+	fr_schedule_child_status_t	status = FR_CHILD_FAIL;
+	fr_event_list_t			*el;
+	char				core_name[32];
+
+	worker_id = sw->id;		/* Store the current worker ID */
+
+	snprintf(core_name, sizeof(core_name), "Core %d", sn->id);
+
+	INFO("%s - Starting", core_name);
+
+	fr_schedule_pin(sc, core_name, &sw->placement);
+	sn->placement = sw->placement;
+
+	sn->ctx = sw->ctx = ctx = talloc_init("%s", core_name);
+	if (!ctx) {
+		ERROR("%s - Failed allocating memory", core_name);
+		goto fail;
+	}
+
+	sw->el = el = fr_event_list_alloc(ctx, NULL, NULL);
+	if (!el) {
+		PERROR("%s - Failed creating event list", core_name);
+		goto fail;
+	}
+
+	sn->nr = fr_network_create(ctx, el, core_name, sc->log, sc->lvl, &sc->config->network);
+	if (!sn->nr) {
+		PERROR("%s - Failed creating network", core_name);
+		goto fail;
+	}
+	fr_network_placement_set(sn->nr, sn->placement.cpu, sn->placement.node);
+
+	sw->worker = fr_worker_create(ctx, el, core_name, sc->log, sc->lvl, &sc->config->worker);
+	if (!sw->worker) {
+		PERROR("%s - Failed creating worker", core_name);
+		goto fail;
+	}
+	fr_worker_placement_set(sw->worker, sw->placement.cpu, sw->placement.node);
+
+	if (fr_schedule_worker_instantiate(sc, sw) < 0) {
+		PERROR("%s - Failed calling thread instantiate", core_name);
+		goto fail;
+	}
+
+	/*
+	 *	The worker is driven by the network's event loop,
+	 *	the same as in single-threaded mode.
+	 */
+	if (fr_event_pre_insert(el, fr_worker_pre_event, sw->worker) < 0) {
+		PERROR("%s - Failed adding pre-check to event list", core_name);
+		goto fail;
+	}
+
+	if (fr_event_post_insert(el, fr_worker_post_event, sw->worker) < 0) {
+		PERROR("%s - Failed inserting post-processing event", core_name);
+		goto fail;
+	}
+
+	(void) fr_network_worker_add(sn->nr, sw->worker);
+
+	sn->status = sw->status = FR_CHILD_RUNNING;
+
+	/*
+	 *	Tell the originator that the thread has started.
+	 */
+	sem_post(&sc->network_sem);
+
+	DEBUG3("%s - Started", core_name);
+
+	if (sc->config->stats_interval) (void) fr_event_timer_in(sn, el, &sn->ev, sc->config->stats_interval, stats_timer, sn);
+
+	/*
+	 *	Exits once the network has been told to exit, and the
+	 *	worker has closed its channel.
+	 */
+	fr_network(sn->nr);
+
+	status = FR_CHILD_EXITED;
+
+fail:
+	sn->status = sw->status = status;
+
+	if (sw->worker) {
+		fr_worker_destroy(sw->worker);
+		sw->worker = NULL;
+	}
+
+	INFO("%s - Exiting", core_name);
+
+	if (sc->worker_thread_detach) sc->worker_thread_detach(NULL);
+
+	/*
+	 *	The scheduler forgets about cores which failed to
+	 *	start, and so never frees their context.  Clean up
+	 *	here instead.  Cores which ran are freed by
+	 *	fr_schedule_destroy() once it has joined the thread.
+	 */
+	if (status == FR_CHILD_FAIL) {
+		if (sn->nr) {
+			fr_network_destroy(sn->nr);
+			sn->nr = NULL;
+		}
+
+		sw->el = NULL;
+		TALLOC_FREE(sn->ctx);
+		sw->ctx = NULL;
+	}
+
+	/*
+	 *	Tell the scheduler we're done.
+	 */
+	sem_post(&sc->network_sem);
+
+	return NULL;
+}
+
 /** Creates a new thread using our standard set of options
  *
  * New threads are:
@@ -538,6 +993,24 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		return NULL;
 	}
 
+	/*
+	 *	In per-core mode, each thread has its own network and
+	 *	worker.  So there are as many networks as workers.
+	 */
+	if (sc->config->per_core) sc->config->max_networks = sc->config->max_workers;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if (fr_schedule_cpus_plan(sc) < 0) {
+		PERROR("Failed setting CPU affinity");
+		fr_schedule_destroy(&sc);
+		return NULL;
+	}
+#else
+	if (sc->config->pin_threads || sc->config->network_cpus || sc->config->worker_cpus) {
+		WARN("Setting CPU affinity is not supported on this system");
+	}
+#endif
+
 	/*
 	 *	Create the network threads first.
 	 */
@@ -556,8 +1029,31 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		sn->id = i;
 		sn->sc = sc;
 		sn->status = FR_CHILD_INITIALIZING;
+		fr_schedule_place(sc, &sn->placement, true, i);
 		fr_dlist_insert_head(&sc->networks, sn);
 
+		if (sc->config->per_core) {
+			sw = talloc_zero(sn, fr_schedule_worker_t);
+			if (!sw) {
+				ERROR("Core %u - Failed allocating memory", i);
+				fr_dlist_remove(&sc->networks, sn);
+				break;
+			}
+
+			sw->id = i;
+			sw->sc = sc;
+			sw->status = FR_CHILD_INITIALIZING;
+			sn->sw = sw;
+			fr_schedule_place(sc, &sw->placement, false, i);
+
+			if (fr_schedule_pthread_create(&sn->pthread_id, fr_schedule_core_thread, sn) < 0) {
+				PERROR("Failed creating core %u", i);
+				fr_dlist_remove(&sc->networks, sn);
+				break;
+			}
+			continue;
+		}
+
 		if (fr_schedule_pthread_create(&sn->pthread_id, fr_schedule_network_thread, sn) < 0) {
 			PERROR("Failed creating network %u", i);
 			break;
@@ -597,6 +1093,24 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		return NULL;
 	}
 
+	/*
+	 *	The workers were created by the per-core threads.
+	 */
+	if (sc->config->per_core) goto register_commands;
+
+	/*
+	 *	Stealing requests is only useful when there's more
+	 *	than one worker.
+	 */
+	if (sc->config->work_stealing && (sc->config->max_workers > 1)) {
+		sc->group = fr_worker_group_alloc(sc, sc->config->max_workers);
+		if (!sc->group) {
+			PERROR("Failed creating worker group");
+			fr_schedule_destroy(&sc);
+			return NULL;
+		}
+	}
+
 	/*
 	 *	Create all of the workers.
 	 */
@@ -615,6 +1129,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		sw->id = i;
 		sw->sc = sc;
 		sw->status = FR_CHILD_INITIALIZING;
+		fr_schedule_place(sc, &sw->placement, false, i);
 		fr_dlist_insert_head(&sc->workers, sw);
 
 		if (fr_schedule_pthread_create(&sw->pthread_id, fr_schedule_worker_thread, sw) < 0) {
@@ -671,6 +1186,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		}
 	}
 
+register_commands:
 	for (sn = fr_dlist_head(&sc->networks), i = 0;
 	     sn != NULL;
 	     sn = next_sn, i++) {
@@ -683,6 +1199,17 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 			PERROR("Failed adding network commands");
 			goto st_fail;
 		}
+
+		if (sn->sw && (fr_command_register_hook(NULL, buffer, sn->sw->worker, cmd_worker_table) < 0)) {
+			PERROR("Failed adding worker commands");
+			goto st_fail;
+		}
+	}
+
+	if (sc->config->per_core) {
+		INFO("Scheduler created successfully with %u per-core threads",
+		     (unsigned int)fr_dlist_num_elements(&sc->networks));
+		return sc;
 	}
 
 	if (sc) INFO("Scheduler created successfully with %u networks and %u workers",
@@ -815,6 +1342,85 @@ done:
 	return 0;
 }
 
+/** Return the number of network threads in a scheduler
+ *
+ * @param[in] sc the scheduler
+ * @return the number of networks.  Always 1 in single-threaded mode.
+ */
+unsigned int fr_schedule_num_networks(fr_schedule_t const *sc)
+{
+	if (sc->el) return 1;
+
+	return fr_dlist_num_elements(&sc->networks);
+}
+
+/** Check that a listener with only one socket can be added to a scheduler
+ *
+ * Such a listener is always added to the first network, so any other
+ * networks would sit idle.  More than one network is therefore only
+ * allowed when every listener opens one socket per network, or in
+ * per-core mode, where each network also runs a worker.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] li the listener being added.
+ * @return
+ *	- 0 if the listener can be added.
+ *	- -1 if it can't.
+ */
+static int fr_schedule_single_socket_check(fr_schedule_t *sc, fr_listen_t const *li)
+{
+	if (sc->el || sc->config->per_core || (sc->config->max_networks == 1)) return 0;
+
+	ERROR("%s does not open one socket per network, and can't be used with thread.num_networks = %u",
+	      li->name ? li->name : li->app_io->name, sc->config->max_networks);
+	ERROR("Either set thread.num_networks = 1, or set 'per_network_socket = yes' for every listener");
+
+	return -1;
+}
+
+/** Add a fr_listen_t to a particular network thread of a scheduler.
+ *
+ * This is used for listeners which open one socket per network
+ * thread, so that the sockets are spread evenly across the networks.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] li the ctx and callbacks for the transport.
+ * @param[in] id of the network, from 0 to fr_schedule_num_networks() - 1.
+ * @return
+ *	- NULL on error
+ *	- the fr_network_t that the socket was added to.
+ */
+fr_network_t *fr_schedule_listen_add_network(fr_schedule_t *sc, fr_listen_t *li, unsigned int id)
+{
+	fr_network_t *nr = NULL;
+
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) {
+		nr = sc->single_network;
+	} else {
+		fr_schedule_network_t *sn;
+
+		for (sn = fr_dlist_head(&sc->networks);
+		     sn != NULL;
+		     sn = fr_dlist_next(&sc->networks, sn)) {
+			if (sn->id == id) {
+				nr = sn->nr;
+				break;
+			}
+		}
+	}
+
+	if (!nr) {
+		fr_strerror_printf("No such network %u", id);
+		return NULL;
+	}
+
+	if (fr_network_listen_add(nr, li) < 0) return NULL;
+
+	return nr;
+}
+
 /** Add a fr_listen_t to a scheduler.
  *
  * @param[in] sc the scheduler
@@ -829,6 +1435,8 @@ fr_network_t *fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li)
 
 	(void) talloc_get_type_abort(sc, fr_schedule_t);
 
+	if (fr_schedule_single_socket_check(sc, li) < 0) return NULL;
+
 	if (sc->el) {
 		nr = sc->single_network;
 	} else {
@@ -861,6 +1469,8 @@ fr_network_t *fr_schedule_directory_add(fr_schedule_t *sc, fr_listen_t *li)
 
 	(void) talloc_get_type_abort(sc, fr_schedule_t);
 
+	if (fr_schedule_single_socket_check(sc, li) < 0) return NULL;
+
 	if (sc->el) {
 		nr = sc->single_network;
 	} else {
@@ -68,6 +68,13 @@ typedef struct {
 	fr_network_config_t network;		//!< configuration for each network;
 
 	fr_time_delta_t	stats_interval;		//!< print channel statistics
+
+	bool		per_core;		//!< run one network and one worker in each
+						///< thread, instead of separate threads.
+	bool		pin_threads;		//!< pin each thread to a CPU, spread across NUMA nodes.
+	char const	*network_cpus;		//!< explicit list of CPUs for network threads.
+	char const	*worker_cpus;		//!< explicit list of CPUs for worker and per-core threads.
+	bool		work_stealing;		//!< let idle workers steal requests from busy ones.
 } fr_schedule_config_t;
 
 int			fr_schedule_worker_id(void);
@@ -80,7 +87,10 @@ fr_schedule_t		*fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_
 /* schedulers are async, so there's no fr_schedule_run() */
 int			fr_schedule_destroy(fr_schedule_t **sc);
 
+unsigned int		fr_schedule_num_networks(fr_schedule_t const *sc) CC_HINT(nonnull);
+
 fr_network_t		*fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
+fr_network_t		*fr_schedule_listen_add_network(fr_schedule_t *sc, fr_listen_t *li, unsigned int id) CC_HINT(nonnull);
 fr_network_t		*fr_schedule_directory_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
 #ifdef __cplusplus
 }
@@ -41,6 +41,15 @@
  *  "time_order" heap, and ages out requests which have been active
  *  for "too long".
  *
+ *  When workers are in a group, a busy worker doesn't decode new
+ *  packets immediately.  It puts them into a "backlog" queue, which
+ *  idle workers in the same group can steal from.  The thief runs
+ *  the request, and hands the encoded reply back to the original
+ *  worker, which sends it over the channel the packet arrived on.
+ *  The original worker keeps track of packets in its backlog, and
+ *  of the ones which were stolen, so that it can still find
+ *  duplicate and conflicting packets for them.
+ *
  *  A request may return one of RLM_MODULE_YIELD,
  *  RLM_MODULE_OK, or RLM_MODULE_HANDLED.  If a request is
  *  yielded, it is placed onto the yielded list in the worker
@@ -61,8 +70,11 @@ RCSID("$Id$")
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/syserror.h>
 
 #include <stdalign.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #ifdef WITH_VERIFY_PTR
 static void worker_verify(fr_worker_t *worker);
@@ -76,6 +88,63 @@ static _Thread_local fr_worker_t *thread_local_worker;
 #define CACHE_LINE_SIZE	64
 static alignas(CACHE_LINE_SIZE) atomic_uint64_t request_number = 0;
 
+#define WORKER_BACKLOG_SIZE	1024
+
+/** The parts of a worker which other workers in its group can see
+ *
+ * These are owned by the group, and not by the worker, so that
+ * they're still valid if the worker exits before its peers.
+ */
+typedef struct {
+	fr_atomic_queue_t	*backlog;	//!< Packets we've read from our channels, but not started.
+						///< Idle workers steal from here.
+	fr_atomic_queue_t	*returned;	//!< Replies to stolen requests, which we need to send.
+	atomic_uint32_t		stolen;		//!< Requests stolen from us, which haven't been returned.
+	atomic_bool		idle;		//!< Worker is about to wait for events.
+	atomic_bool		closed;		//!< Worker is exiting, don't steal from it.
+	int			pipe[2];	//!< For waking the worker.
+} fr_worker_slot_t;
+
+/** Workers which steal requests from each other
+ *
+ */
+struct fr_worker_group_s {
+	unsigned int		num_slots;	//!< Number of slots.
+	atomic_uint32_t		num_joined;	//!< Number of slots which have been claimed.
+	fr_worker_slot_t	**slot;		//!< One for each worker.
+};
+
+/** A packet in a worker's backlog
+ *
+ * Allocated and freed by the worker which received the packet.  If
+ * the packet is stolen, the thief hands the entry back with the reply.
+ */
+typedef struct {
+	fr_channel_data_t	*cd;		//!< The packet.
+	fr_worker_slot_t	*slot;		//!< Slot of the worker which received the packet.
+	fr_listen_t		*listen;	//!< Listener the packet arrived on.
+	void			*packet_ctx;	//!< From the original packet.
+	fr_time_t		recv_time;	//!< When the packet was received.
+	atomic_bool		cancelled;	//!< A conflicting packet was received, don't reply to this one.
+	bool			in_dedup;	//!< Whether we're in the "given" tree of the worker
+						///< which received the packet.
+} fr_worker_backlog_t;
+
+/** Reply to a stolen request
+ *
+ * Allocated by the thief, and freed by the worker it was stolen from.
+ */
+typedef struct {
+	fr_worker_backlog_t	*entry;		//!< Backlog entry of the original packet.
+	fr_channel_t		*ch;		//!< Channel the request arrived on.
+	fr_listen_t		*listen;	//!< Listener the request arrived on.
+	void			*packet_ctx;	//!< From the original packet.
+	fr_time_t		request_time;	//!< When the original packet was received.
+	fr_time_delta_t		processing_time; //!< How long the thief spent on the request.
+	size_t			data_size;	//!< Size of the encoded reply.
+	uint8_t			data[];		//!< The encoded reply.
+} fr_worker_stolen_t;
+
 /**
  *  A worker which takes packets from a master, and processes them.
  */
@@ -99,6 +168,7 @@ struct fr_worker_s {
 	fr_heap_t      		*runnable;	//!< current runnable requests which we've spent time processing
 	fr_heap_t		*time_order;	//!< time ordered heap of requests
 	rbtree_t		*dedup;		//!< de-dup tree
+	rbtree_t		*given;		//!< de-dup tree for packets in our backlog, or stolen from it.
 
 	fr_io_stats_t		stats;		//!< input / output stats
 	fr_time_elapsed_t	cpu_time;	//!< histogram of total CPU time per request
@@ -107,10 +177,18 @@ struct fr_worker_s {
 	uint64_t    		num_naks;	//!< number of messages which were nak'd
 	uint64_t    		num_active;	//!< number of active requests
 
+	fr_worker_group_t	*group;		//!< Group we steal requests from, if any.
+	fr_worker_slot_t	*slot;		//!< Our slot in the group.
+	unsigned int		slot_id;	//!< Index of our slot in the group.
+	uint64_t		num_stolen;	//!< Requests we stole from other workers.
+	uint64_t		num_given;	//!< Our requests which other workers ran.
+
+	int			cpu;		//!< CPU we're pinned to, or -1.
+	int			numa_node;	//!< NUMA node we're on, or -1.
+
 	fr_time_delta_t		predicted;	//!< How long we predict a request will take to execute.
 	fr_time_tracking_t	tracking;	//!< how much time the worker has spent doing things.
 
-	bool			was_sleeping;	//!< used to suppress multiple sleep signals in a row
 	bool			exiting;	//!< are we exiting?
 
 	fr_time_t		checked_timeout; //!< when we last checked the tails of the queues
@@ -120,7 +198,10 @@ struct fr_worker_s {
 	fr_channel_t		**channel;	//!< list of channels
 };
 
-static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now);
+static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
+				     fr_worker_backlog_t *stolen_from, fr_time_t now);
+static bool worker_backlog_push(fr_worker_t *worker, fr_channel_data_t *cd);
+static fr_channel_data_t *worker_backlog_pop(fr_worker_t *worker);
 
 /** Callback which handles a message being received on the worker side.
  *
@@ -135,7 +216,39 @@ static void worker_recv_request(void *ctx, fr_channel_t *ch, fr_channel_data_t *
 	worker->stats.in++;
 	DEBUG3("Received request %" PRIu64 "", worker->stats.in);
 	cd->channel.ch = ch;
-	worker_request_bootstrap(worker, cd, fr_time());
+
+	/*
+	 *	We're busy, so leave it where other workers can
+	 *	steal it.
+	 */
+	if (worker->slot && worker_backlog_push(worker, cd)) return;
+
+	worker_request_bootstrap(worker, cd, NULL, fr_time());
+}
+
+/** Stop other workers from stealing our requests, and run the ones in our backlog
+ *
+ * Packets from the closing channel are discarded, as the network
+ * won't accept replies to them.
+ *
+ * @param[in] worker	the worker.
+ * @param[in] ch	which is being closed.
+ */
+static void worker_backlog_close(fr_worker_t *worker, fr_channel_t *ch)
+{
+	fr_channel_data_t	*cd;
+	fr_time_t		now = fr_time();
+
+	atomic_store(&worker->slot->closed, true);
+
+	while ((cd = worker_backlog_pop(worker)) != NULL) {
+		if (cd->channel.ch == ch) {
+			fr_message_done(&cd->m);
+			continue;
+		}
+
+		worker_request_bootstrap(worker, cd, NULL, now);
+	}
 }
 
 static void worker_exit(fr_worker_t *worker)
@@ -163,19 +276,12 @@ static void worker_exit(fr_worker_t *worker)
 static void worker_channel_callback(void *ctx, void const *data, size_t data_size, fr_time_t now)
 {
 	int			i;
-	bool			ok, was_sleeping;
+	bool			ok;
 	fr_channel_t		*ch;
 	fr_message_set_t	*ms;
 	fr_channel_event_t	ce;
 	fr_worker_t		*worker = ctx;
 
-	was_sleeping = worker->was_sleeping;
-	worker->was_sleeping = false;
-
-	/*
-	 *	We were woken up by a signal to do something.  We're
-	 *	not sleeping.
-	 */
 	ce = fr_channel_service_message(now, &ch, data, data_size);
 	DEBUG3("Channel %s",
 	       fr_table_str_by_value(channel_signals, ce, "<INVALID>"));
@@ -196,10 +302,7 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 	case FR_CHANNEL_DATA_READY_RESPONDER:
 		fr_assert(ch != NULL);
 
-		if (!fr_channel_recv_request(ch)) {
-			worker->was_sleeping = was_sleeping;
-
-		} else while (fr_channel_recv_request(ch));
+		while (fr_channel_recv_request(ch));
 		break;
 
 	case FR_CHANNEL_OPEN:
@@ -231,6 +334,8 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 	case FR_CHANNEL_CLOSE:
 		fr_assert(ch != NULL);
 
+		if (worker->slot) worker_backlog_close(worker, ch);
+
 		ok = false;
 
 		/*
@@ -268,17 +373,376 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 }
 
 
+/** Wake a worker which is waiting for events
+ *
+ */
+static void worker_slot_wake(fr_worker_slot_t *slot)
+{
+	/*
+	 *	If the pipe is full, the worker is already going
+	 *	to wake up.
+	 */
+	if (write(slot->pipe[1], &(uint8_t){ 0x01 }, 1) < 0) return;
+}
+
+/** Allocate a reply to a stolen request
+ *
+ * The reply is allocated in the NULL ctx, as it's freed by a different
+ * thread.
+ */
+static fr_worker_stolen_t *worker_stolen_alloc(fr_worker_backlog_t *entry, fr_channel_t *ch, fr_listen_t *listen,
+					       void *packet_ctx, fr_time_t request_time, size_t size)
+{
+	fr_worker_stolen_t	*stolen;
+
+	MEM(stolen = talloc_zero_size(NULL, sizeof(*stolen) + size));
+	talloc_set_name_const(stolen, "fr_worker_stolen_t");
+
+	stolen->entry = entry;
+	stolen->ch = ch;
+	stolen->listen = listen;
+	stolen->packet_ctx = packet_ctx;
+	stolen->request_time = request_time;
+
+	return stolen;
+}
+
+/** Give a reply back to the worker we stole the request from
+ *
+ * The queue can't be full, as thieves never have more outstanding
+ * requests than there is room for in the queue.
+ */
+static void worker_stolen_return(fr_worker_stolen_t *stolen)
+{
+	fr_worker_slot_t	*slot = stolen->entry->slot;
+
+	if (!fr_cond_assert(fr_atomic_queue_push(slot->returned, stolen))) {
+		talloc_free(stolen);
+		return;
+	}
+
+	worker_slot_wake(slot);
+}
+
+/** Free a backlog entry, and remove it from the "given" tree
+ *
+ * Only the worker which received the packet can do this.
+ */
+static void worker_backlog_free(fr_worker_t *worker, fr_worker_backlog_t *entry)
+{
+	if (entry->in_dedup) (void) rbtree_deletebydata(worker->given, entry);
+	talloc_free(entry);
+}
+
+/** Free a reply to a stolen request, without sending it
+ *
+ */
+static void worker_stolen_free(fr_worker_t *worker, fr_worker_stolen_t *stolen)
+{
+	atomic_fetch_sub(&worker->slot->stolen, 1);
+	worker_backlog_free(worker, stolen->entry);
+	talloc_free(stolen);
+}
+
+/** Send a reply to a request which another worker stole from us
+ *
+ * @param[in] worker	the worker.
+ * @param[in] stolen	the reply to send.
+ * @param[in] now	the current time.
+ */
+static void worker_stolen_send(fr_worker_t *worker, fr_worker_stolen_t *stolen, fr_time_t now)
+{
+	int			i;
+	fr_channel_data_t	*reply;
+	fr_message_set_t	*ms;
+
+	worker->num_given++;
+
+	/*
+	 *	We received a conflicting packet while the other
+	 *	worker was running the request, so the reply is
+	 *	stale.
+	 */
+	if (atomic_load(&stolen->entry->cancelled)) {
+		DEBUG2("Discarding reply to stolen request, as a conflicting packet was received");
+		worker_stolen_free(worker, stolen);
+		return;
+	}
+
+	/*
+	 *	The channel may have been closed while the other
+	 *	worker was running the request.
+	 */
+	for (i = 0; i < worker->config.max_channels; i++) {
+		if (worker->channel[i] == stolen->ch) break;
+	}
+	if ((i == worker->config.max_channels) || !fr_channel_active(stolen->ch) || worker->exiting) {
+		worker_stolen_free(worker, stolen);
+		return;
+	}
+
+	ms = fr_channel_responder_uctx_get(stolen->ch);
+	fr_assert(ms != NULL);
+
+	reply = (fr_channel_data_t *) fr_message_reserve(ms, stolen->data_size);
+	if (!reply) {
+		ERROR("Failed allocating reply to stolen request - dropping it");
+		worker_stolen_free(worker, stolen);
+		return;
+	}
+
+	if (stolen->data_size) {
+		memcpy(reply->m.data, stolen->data, stolen->data_size);
+		(void) fr_message_alloc(ms, &reply->m, stolen->data_size);
+	}
+
+	reply->m.when = now;
+	reply->reply.cpu_time = worker->tracking.running_total;
+	reply->reply.processing_time = stolen->processing_time;
+	reply->reply.request_time = stolen->request_time;
+
+	reply->listen = stolen->listen;
+	reply->packet_ctx = stolen->packet_ctx;
+
+	if (fr_channel_send_reply(stolen->ch, reply) < 0) {
+		DEBUG2("Failed sending reply to channel");
+	}
+
+	worker->stats.out++;
+	worker_stolen_free(worker, stolen);
+}
+
+/** Read handler for the slot's wakeup pipe
+ *
+ * Another worker either wants us to steal a request, or has returned
+ * a request it stole from us.
+ */
+static void worker_slot_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_worker_t		*worker = talloc_get_type_abort(uctx, fr_worker_t);
+	fr_worker_stolen_t	*stolen;
+	uint8_t			buffer[64];
+	fr_time_t		now = fr_time();
+
+	while (read(fd, buffer, sizeof(buffer)) > 0);
+
+	while (fr_atomic_queue_pop(worker->slot->returned, (void **) &stolen)) {
+		worker_stolen_send(worker, stolen, now);
+	}
+}
+
+/** Wake one idle worker in our group, so that it can steal a request
+ *
+ */
+static void worker_wake_idle(fr_worker_t *worker)
+{
+	fr_worker_group_t	*group = worker->group;
+	unsigned int		i;
+
+	/*
+	 *	Pairs with the fence in fr_worker().  Either we see
+	 *	that the other worker is idle, or it sees our backlog.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	for (i = 1; i < group->num_slots; i++) {
+		fr_worker_slot_t *slot = group->slot[(worker->slot_id + i) % group->num_slots];
+
+		if (!atomic_load_explicit(&slot->idle, memory_order_relaxed)) continue;
+
+		if (!atomic_exchange(&slot->idle, false)) continue;
+
+		worker_slot_wake(slot);
+		return;
+	}
+}
+
+/** Put a new packet into our backlog, if we're busy
+ *
+ * @param[in] worker	the worker.
+ * @param[in] cd	the packet.
+ * @return
+ *	- true if the packet is in the backlog.
+ *	- false if the caller should start the request now.
+ */
+static bool worker_backlog_push(fr_worker_t *worker, fr_channel_data_t *cd)
+{
+	fr_worker_slot_t	*slot = worker->slot;
+	fr_worker_backlog_t	*entry;
+
+	if (atomic_load_explicit(&slot->closed, memory_order_relaxed)) return false;
+
+	/*
+	 *	We're not busy.  Unless there are older packets in
+	 *	the backlog, which should be started first.
+	 */
+	if ((fr_heap_num_elements(worker->runnable) == 0) &&
+	    (fr_atomic_queue_num_elements(slot->backlog) == 0)) return false;
+
+	/*
+	 *	Duplicates and conflicting packets have to be checked
+	 *	against the requests we're already running.
+	 */
+	if (cd->request.is_dup) return false;
+
+	if (cd->listen->track_duplicates) {
+		fr_async_t		async = { .listen = cd->listen, .packet_ctx = cd->packet_ctx };
+		request_t		key = { .async = &async };
+		fr_worker_backlog_t	given = { .listen = cd->listen, .packet_ctx = cd->packet_ctx };
+
+		if (rbtree_finddata(worker->dedup, &key)) return false;
+		if (rbtree_finddata(worker->given, &given)) return false;
+	}
+
+	MEM(entry = talloc_zero(NULL, fr_worker_backlog_t));
+	entry->cd = cd;
+	entry->slot = slot;
+	entry->listen = cd->listen;
+	entry->packet_ctx = cd->packet_ctx;
+	entry->recv_time = cd->request.recv_time;
+	atomic_init(&entry->cancelled, false);
+
+	/*
+	 *	Duplicate and conflicting packets have to find this
+	 *	one, even after another worker steals it.
+	 */
+	if (cd->listen->track_duplicates) entry->in_dedup = rbtree_insert(worker->given, entry);
+
+	if (!fr_atomic_queue_push(slot->backlog, entry)) {
+		worker_backlog_free(worker, entry);
+		return false;
+	}
+
+	worker_wake_idle(worker);
+
+	return true;
+}
+
+/** Steal a packet from the busiest worker in our group
+ *
+ * @param[in] worker	the worker.
+ * @param[in] now	the current time.
+ * @return
+ *	- true if we stole a packet.
+ *	- false if there was nothing to steal.
+ */
+static bool worker_steal(fr_worker_t *worker, fr_time_t now)
+{
+	fr_worker_group_t	*group = worker->group;
+	fr_worker_slot_t	*victim = NULL;
+	fr_worker_backlog_t	*entry;
+	size_t			most = 0;
+	uint32_t		stolen;
+	unsigned int		i;
+
+	for (i = 0; i < group->num_slots; i++) {
+		fr_worker_slot_t	*slot = group->slot[i];
+		size_t			num;
+
+		if (slot == worker->slot) continue;
+		if (atomic_load_explicit(&slot->closed, memory_order_relaxed)) continue;
+
+		num = fr_atomic_queue_num_elements(slot->backlog);
+		if (num > most) {
+			most = num;
+			victim = slot;
+		}
+	}
+	if (!victim) return false;
+
+	/*
+	 *	Limit the number of outstanding stolen requests, so
+	 *	that the replies always fit into the returned queue.
+	 */
+	stolen = atomic_load(&victim->stolen);
+	do {
+		if (stolen >= WORKER_BACKLOG_SIZE) return false;
+	} while (!atomic_compare_exchange_weak(&victim->stolen, &stolen, stolen + 1));
+
+	if (!fr_atomic_queue_pop(victim->backlog, (void **) &entry)) {
+		atomic_fetch_sub(&victim->stolen, 1);
+		return false;
+	}
+
+	/*
+	 *	The other worker received a conflicting packet.  Don't
+	 *	run this one, but still hand the entry back, so that
+	 *	it can be freed.
+	 */
+	if (atomic_load(&entry->cancelled)) {
+		fr_message_done(&entry->cd->m);
+		worker_stolen_return(worker_stolen_alloc(entry, entry->cd->channel.ch, entry->listen,
+							 entry->packet_ctx, entry->recv_time, 0));
+		return true;
+	}
+
+	DEBUG3("Stole request from another worker");
+	worker->num_stolen++;
+	worker_request_bootstrap(worker, entry->cd, entry, now);
+
+	return true;
+}
+
+/** Start the next request from our backlog, or steal one
+ *
+ * @param[in] worker	the worker.
+ * @param[in] now	the current time.
+ * @return
+ *	- true if a packet was taken from a backlog.
+ *	- false if all of the backlogs are empty.
+ */
+static bool worker_backlog_next(fr_worker_t *worker, fr_time_t now)
+{
+	fr_channel_data_t	*cd;
+
+	cd = worker_backlog_pop(worker);
+	if (!cd) return worker_steal(worker, now);
+
+	worker_request_bootstrap(worker, cd, NULL, now);
+
+	return true;
+}
+
+/** Take the next packet from our own backlog
+ *
+ * Packets which have been replaced by conflicting ones are discarded.
+ *
+ * @param[in] worker	the worker.
+ * @return
+ *	- the packet.
+ *	- NULL if the backlog is empty.
+ */
+static fr_channel_data_t *worker_backlog_pop(fr_worker_t *worker)
+{
+	fr_worker_backlog_t	*entry;
+	fr_channel_data_t	*cd;
+	bool			cancelled;
+
+	while (fr_atomic_queue_pop(worker->slot->backlog, (void **) &entry)) {
+		cd = entry->cd;
+		cancelled = atomic_load(&entry->cancelled);
+		worker_backlog_free(worker, entry);
+
+		if (!cancelled) return cd;
+
+		fr_message_done(&cd->m);
+	}
+
+	return NULL;
+}
+
 /** Send a NAK to the network thread
  *
  * The network thread believes that a worker is running a request until that request has been NAK'd.
  * We typically NAK requests when they've been hanging around in the worker's backlog too long,
  * or there was an error executing the request.
  *
- * @param[in] worker	the worker
- * @param[in] cd	the message to NAK
- * @param[in] now	when the message is NAKd
+ * @param[in] worker		the worker
+ * @param[in] cd		the message to NAK
+ * @param[in] stolen_from	backlog entry of the worker we stole the message from, if any.
+ * @param[in] now		when the message is NAKd
  */
-static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now)
+static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_worker_backlog_t *stolen_from, fr_time_t now)
 {
 	size_t			size;
 	fr_channel_data_t	*reply;
@@ -288,6 +752,32 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 
 	worker->num_naks++;
 
+	/*
+	 *	The worker we stole it from sends the NAK.
+	 */
+	if (stolen_from) {
+		fr_worker_stolen_t	*stolen;
+
+		listen = cd->listen;
+		size = listen->app_io->default_reply_size;
+		if (!size) size = listen->app_io->default_message_size;
+
+		stolen = worker_stolen_alloc(stolen_from, cd->channel.ch, listen, cd->packet_ctx,
+					     cd->request.recv_time, size);
+		if (listen->app_io->nak) {
+			stolen->data_size = listen->app_io->nak(listen, cd->packet_ctx, cd->m.data,
+								cd->m.data_size, stolen->data, size);
+		} else {
+			stolen->data_size = 1;
+		}
+		stolen->processing_time = 10;
+
+		fr_message_done(&cd->m);
+
+		worker_stolen_return(stolen);
+		return;
+	}
+
 	/*
 	 *	Cache the outbound channel.  We'll need it later.
 	 */
@@ -358,6 +848,63 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 
 static void worker_max_request_timer(fr_worker_t *worker);
 
+/** Encode a reply
+ *
+ * @param[in] request	to encode the reply for.
+ * @param[out] buffer	to write the reply to.
+ * @param[in] buffer_len	length of the buffer.
+ * @return the length of the reply.
+ */
+static size_t worker_request_encode(request_t *request, uint8_t *buffer, size_t buffer_len)
+{
+	ssize_t			slen = 0;
+	fr_listen_t const	*listen = request->async->listen;
+
+	if (listen->app->encode) {
+		slen = listen->app->encode(listen->app_instance, request, buffer, buffer_len);
+	} else if (listen->app_io->encode) {
+		slen = listen->app_io->encode(listen->app_io_instance, request, buffer, buffer_len);
+	}
+	if (slen < 0) {
+		RPERROR("Failed encoding request");
+		*buffer = 0;
+		slen = 1;
+	}
+
+	fr_assert((size_t) slen <= buffer_len);
+
+	return slen;
+}
+
+/** Give a finished request back to the worker we stole it from
+ *
+ * @param[in] worker	This worker.
+ * @param[in] request	we're sending a reply for.
+ * @param[in] size	The maximum size of the reply data
+ * @param[in] now	The current time
+ */
+static void worker_stolen_reply(fr_worker_t *worker, request_t *request, size_t size, fr_time_t now)
+{
+	fr_worker_stolen_t	*stolen;
+
+	stolen = worker_stolen_alloc(request->async->stolen_from, request->async->channel, request->async->listen,
+				     request->async->packet_ctx, request->async->recv_time, size);
+
+	if (size) stolen->data_size = worker_request_encode(request, stolen->data, size);
+
+	fr_time_tracking_end(&worker->predicted, &request->async->tracking, now);
+	fr_assert(worker->num_active > 0);
+	worker->num_active--;
+
+	stolen->processing_time = request->async->tracking.running_total;
+
+	fr_time_elapsed_update(&worker->cpu_time, now, now + stolen->processing_time);
+	fr_time_elapsed_update(&worker->wall_clock, stolen->request_time, now);
+
+	RDEBUG("Finished request, returning it to the worker it was stolen from");
+
+	worker_stolen_return(stolen);
+}
 
 /** Send a response packet to the network side
  *
@@ -388,6 +935,15 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, size_t si
 		goto finished;
 	}
 
+	/*
+	 *	We stole the request, so the worker we stole it
+	 *	from sends the reply.
+	 */
+	if (request->async->stolen_from) {
+		worker_stolen_reply(worker, request, size, now);
+		goto finished;
+	}
+
 	/*
 	 *	Allocate and send the reply.
 	 */
@@ -415,28 +971,15 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, size_t si
 	 *	Encode it, if required.
 	 */
 	if (size) {
-		ssize_t slen = 0;
-		fr_listen_t const *listen = request->async->listen;
-
-		if (listen->app->encode) {
-			slen = listen->app->encode(listen->app_instance, request,
-						   reply->m.data, reply->m.rb_size);
-		} else if (listen->app_io->encode) {
-			slen = listen->app_io->encode(listen->app_io_instance, request,
-						      reply->m.data, reply->m.rb_size);
-		}
-		if (slen < 0) {
-			RPERROR("Failed encoding request");
-			*reply->m.data = 0;
-			slen = 1;
-		}
+		size_t slen;
+
+		slen = worker_request_encode(request, reply->m.data, reply->m.rb_size);
 
 		/*
 		 *	Shrink the buffer to the actual packet size.
 		 *
 		 *	This will ALWAYS return the same message as we put in.
 		 */
-		fr_assert((size_t) slen <= reply->m.rb_size);
 		(void) fr_message_alloc(ms, &reply->m, slen);
 	}
 
@@ -696,7 +1239,16 @@ static void worker_request_time_tracking_start(fr_worker_t *worker, request_t *r
 	if (!worker->ev_cleanup) worker_max_request_timer(worker);
 }
 
-static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now)
+/** Decode a packet into a new request, and mark it runnable
+ *
+ * @param[in] worker		the worker.
+ * @param[in] cd		the packet.
+ * @param[in] stolen_from	backlog entry of the worker we stole the packet from.
+ *				NULL if the packet arrived on one of our channels.
+ * @param[in] now		the current time.
+ */
+static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
+				     fr_worker_backlog_t *stolen_from, fr_time_t now)
 {
 	bool			is_dup;
 	int			ret = -1;
@@ -746,7 +1298,7 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 	if (ret < 0) {
 		talloc_free(ctx);
 nak:
-		worker_nak(worker, cd, now);
+		worker_nak(worker, cd, stolen_from, now);
 		return;
 	}
 
@@ -758,7 +1310,7 @@ nak:
 
 	if (!request->async->process) {
 		RERROR("Protocol failed to set 'process' function");
-		worker_nak(worker, cd, now);
+		worker_nak(worker, cd, stolen_from, now);
 		return;
 	}
 
@@ -768,15 +1320,53 @@ nak:
 	is_dup = cd->request.is_dup;
 	fr_message_done(&cd->m);
 
+	/*
+	 *	Stolen requests are checked for duplicates by the
+	 *	worker we stole them from, which keeps their backlog
+	 *	entries in its "given" tree.
+	 */
+	request->async->stolen_from = stolen_from;
+
 	/*
 	 *	Look for conflicting / duplicate packets, but only if
 	 *	requested to do so.
 	 */
-	if (request->async->listen->track_duplicates) {
-		request_t *old;
+	if (!stolen_from && request->async->listen->track_duplicates) {
+		request_t		*old;
+		fr_worker_backlog_t	*given;
 
 		old = rbtree_finddata(worker->dedup, request);
 		if (!old) {
+			/*
+			 *	The old packet is in our backlog, or
+			 *	another worker is running it.
+			 */
+			given = rbtree_finddata(worker->given,
+						&(fr_worker_backlog_t){ .listen = request->async->listen,
+									.packet_ctx = request->async->packet_ctx });
+			if (given) {
+				if (given->recv_time == request->async->recv_time) {
+					RWARN("Discarding duplicate of request which is in the backlog");
+
+					fr_channel_null_reply(request->async->channel);
+					talloc_free(request);
+					worker->stats.dup++;
+					return;
+				}
+
+				/*
+				 *	The old packet won't be started,
+				 *	or its reply will be discarded.
+				 */
+				RWARN("Got conflicting packet for request which is in the backlog, telling old request to stop");
+
+				atomic_store(&given->cancelled, true);
+				(void) rbtree_deletebydata(worker->given, given);
+				given->in_dedup = false;
+				worker->stats.dropped++;
+				goto insert_new;
+			}
+
 			/*
 			 *	Ignore duplicate packets where we've
 			 *	already sent the reply.
@@ -875,7 +1465,14 @@ static void worker_run_request(fr_worker_t *worker, fr_time_t start)
 
 redo:
 	request = fr_heap_pop(worker->runnable);
-	if (!request) return;
+	if (!request) {
+		/*
+		 *	Start the next packet from our backlog, or
+		 *	steal one from another worker.
+		 */
+		if (!worker->slot || !worker_backlog_next(worker, now)) return;
+		goto redo;
+	}
 
 	REQUEST_VERIFY(request);
 	fr_assert(request->runnable_id < 0);
@@ -898,6 +1495,19 @@ redo:
 		return;
 	}
 
+	/*
+	 *	The worker we stole the request from received a
+	 *	conflicting packet.  The reply would be discarded, so
+	 *	just hand the request back.
+	 */
+	if (request->async->stolen_from &&
+	    atomic_load(&((fr_worker_backlog_t *) request->async->stolen_from)->cancelled)) {
+		RWARN("Got conflicting packet for stolen request, stopping it");
+		worker_stop_request(worker, request, now);
+		worker_send_reply(worker, request, 0, now);
+		return;
+	}
+
 	/*
 	 *	Everything else, run the request.
 	 */
@@ -1017,6 +1627,20 @@ static int worker_dedup_cmp(void const *one, void const *two)
 	return (a->async->packet_ctx > b->async->packet_ctx) - (a->async->packet_ctx < b->async->packet_ctx);
 }
 
+/**
+ *  Track a fr_worker_backlog_t in the "given" tree
+ */
+static int worker_given_cmp(void const *one, void const *two)
+{
+	int ret;
+	fr_worker_backlog_t const *a = one, *b = two;
+
+	ret = (a->listen > b->listen) - (a->listen < b->listen);
+	if (ret) return ret;
+
+	return (a->packet_ctx > b->packet_ctx) - (a->packet_ctx < b->packet_ctx);
+}
+
 /** Destroy a worker
  *
  * The input channels are signaled, and local messages are cleaned up.
@@ -1053,6 +1677,22 @@ void fr_worker_destroy(fr_worker_t *worker)
 	}
 	fr_assert(fr_heap_num_elements(worker->runnable) == 0);
 
+	/*
+	 *	Stop other workers stealing from us.  Packets still in
+	 *	the backlog belong to the network, the same as ones in
+	 *	the channels.  Replies to requests which were stolen
+	 *	from us can't be sent any more.
+	 */
+	if (worker->slot) {
+		fr_worker_stolen_t *stolen;
+
+		atomic_store(&worker->slot->closed, true);
+
+		while (fr_atomic_queue_pop(worker->slot->returned, (void **) &stolen)) {
+			worker_stolen_free(worker, stolen);
+		}
+	}
+
 	/*
 	 *	Signal the channels that we're closing.
 	 *
@@ -1101,6 +1741,9 @@ nomem:
 
 	if (config) worker->config = *config;
 
+	worker->cpu = -1;
+	worker->numa_node = -1;
+
 #define CHECK_CONFIG(_x, _min, _max) do { \
 		if (!worker->config._x) worker->config._x = _min; \
 		if (worker->config._x < _min) worker->config._x = _min; \
@@ -1169,12 +1812,168 @@ nomem:
 		goto fail;
 	}
 
+	worker->given = rbtree_talloc_alloc(worker, worker_given_cmp, fr_worker_backlog_t, NULL, RBTREE_FLAG_NONE);
+	if (!worker->given) {
+		fr_strerror_const("Failed creating given tree");
+		goto fail;
+	}
+
 	thread_local_worker = worker;
 
 	return worker;
 }
 
 
+static int _worker_group_free(fr_worker_group_t *group)
+{
+	unsigned int		i;
+	fr_worker_stolen_t	*stolen;
+	fr_worker_backlog_t	*entry;
+
+	for (i = 0; i < group->num_slots; i++) {
+		fr_worker_slot_t *slot = group->slot[i];
+
+		if (!slot) continue;
+
+		if (slot->pipe[0] >= 0) close(slot->pipe[0]);
+		if (slot->pipe[1] >= 0) close(slot->pipe[1]);
+
+		if (slot->backlog) {
+			while (fr_atomic_queue_pop(slot->backlog, (void **) &entry)) talloc_free(entry);
+		}
+
+		if (!slot->returned) continue;
+
+		while (fr_atomic_queue_pop(slot->returned, (void **) &stolen)) {
+			talloc_free(stolen->entry);
+			talloc_free(stolen);
+		}
+	}
+
+	return 0;
+}
+
+/** Allocate a group of workers which steal requests from each other
+ *
+ * Each worker joins the group with #fr_worker_group_join.  The group
+ * must not be freed until all of its workers have exited.
+ *
+ * @param[in] ctx		to allocate the group in.
+ * @param[in] num_workers	the maximum number of workers in the group.
+ * @return
+ *	- NULL on error.
+ *	- fr_worker_group_t on success.
+ */
+fr_worker_group_t *fr_worker_group_alloc(TALLOC_CTX *ctx, unsigned int num_workers)
+{
+	fr_worker_group_t	*group;
+	unsigned int		i;
+
+	group = talloc_zero(ctx, fr_worker_group_t);
+	if (!group) {
+	nomem:
+		fr_strerror_const("Failed allocating memory");
+		return NULL;
+	}
+
+	group->slot = talloc_zero_array(group, fr_worker_slot_t *, num_workers);
+	if (!group->slot) {
+	fail:
+		talloc_free(group);
+		goto nomem;
+	}
+	group->num_slots = num_workers;
+	talloc_set_destructor(group, _worker_group_free);
+
+	for (i = 0; i < num_workers; i++) {
+		fr_worker_slot_t *slot;
+
+		slot = group->slot[i] = talloc_zero(group->slot, fr_worker_slot_t);
+		if (!slot) goto fail;
+
+		slot->pipe[0] = slot->pipe[1] = -1;
+
+		slot->backlog = fr_atomic_queue_alloc(slot, WORKER_BACKLOG_SIZE);
+		if (!slot->backlog) goto fail;
+
+		slot->returned = fr_atomic_queue_alloc(slot, WORKER_BACKLOG_SIZE);
+		if (!slot->returned) goto fail;
+
+		if (pipe(slot->pipe) < 0) {
+			fr_strerror_printf("Failed opening pipe: %s", fr_syserror(errno));
+			talloc_free(group);
+			return NULL;
+		}
+
+		(void) fcntl(slot->pipe[0], F_SETFL, O_NONBLOCK);
+		(void) fcntl(slot->pipe[1], F_SETFL, O_NONBLOCK);
+		(void) fcntl(slot->pipe[0], F_SETFD, FD_CLOEXEC);
+		(void) fcntl(slot->pipe[1], F_SETFD, FD_CLOEXEC);
+	}
+
+	return group;
+}
+
+/** Add a worker to a group of workers which steal requests from each other
+ *
+ * Must be called by the worker's thread, before it starts processing
+ * requests.
+ *
+ * @param[in] worker	to add.
+ * @param[in] group	to add it to.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_worker_group_join(fr_worker_t *worker, fr_worker_group_t *group)
+{
+	unsigned int		id;
+	fr_worker_slot_t	*slot;
+
+	id = atomic_fetch_add(&group->num_joined, 1);
+	if (id >= group->num_slots) {
+		fr_strerror_const("Too many workers in group");
+		return -1;
+	}
+	slot = group->slot[id];
+
+	if (fr_event_fd_insert(worker, worker->el, slot->pipe[0], worker_slot_read, NULL, NULL, worker) < 0) {
+		fr_strerror_const_push("Failed adding wakeup pipe to event list");
+		return -1;
+	}
+
+	worker->group = group;
+	worker->slot = slot;
+	worker->slot_id = id;
+
+	return 0;
+}
+
+/** Record where the worker is running
+ *
+ * Networks use the NUMA node to prefer workers which are close to
+ * them.  Must be called before the worker is added to any network.
+ *
+ * @param[in] worker	to update.
+ * @param[in] cpu	the worker is pinned to, or -1.
+ * @param[in] numa_node	the worker is on, or -1 if unknown.
+ */
+void fr_worker_placement_set(fr_worker_t *worker, int cpu, int numa_node)
+{
+	worker->cpu = cpu;
+	worker->numa_node = numa_node;
+}
+
+/** Return the NUMA node the worker is on
+ *
+ * @param[in] worker	to check.
+ * @return the NUMA node, or -1 if unknown.
+ */
+int fr_worker_numa_node(fr_worker_t const *worker)
+{
+	return worker->numa_node;
+}
+
 /** The main loop and entry point of the worker thread.
  *
  * @param[in] worker the worker data structure to manage
@@ -1195,7 +1994,41 @@ void fr_worker(fr_worker_t *worker)
 		 */
 		wait_for_event = (fr_heap_num_elements(worker->runnable) == 0);
 		if (wait_for_event) {
-			DEBUG4("Ready to process requests");
+			int i;
+
+			/*
+			 *	Tell the network threads that we're
+			 *	about to sleep, so that they signal us
+			 *	when they send a new request.  If they
+			 *	raced us, read the new requests instead.
+			 */
+			for (i = 0; i < worker->config.max_channels; i++) {
+				if (!worker->channel[i]) continue;
+
+				if (fr_channel_responder_sleeping(worker->channel[i]) > 0) {
+					while (fr_channel_recv_request(worker->channel[i]));
+				}
+			}
+
+			/*
+			 *	Tell the other workers that we're about
+			 *	to sleep, so that they wake us when
+			 *	they have requests for us to steal.  If
+			 *	they raced us, steal them instead.
+			 *
+			 *	The fence pairs with the one in
+			 *	worker_wake_idle().
+			 */
+			if (worker->slot) {
+				atomic_store(&worker->slot->idle, true);
+				atomic_thread_fence(memory_order_seq_cst);
+
+				while ((fr_heap_num_elements(worker->runnable) == 0) &&
+				       worker_backlog_next(worker, fr_time()));
+			}
+
+			wait_for_event = (fr_heap_num_elements(worker->runnable) == 0);
+			if (wait_for_event) DEBUG4("Ready to process requests");
 		}
 
 		/*
@@ -1212,6 +2045,8 @@ void fr_worker(fr_worker_t *worker)
 		DEBUG3("%u event(s) pending%s",
 		       num_events == -1 ? 0 : num_events, num_events == -1 ? " - event loop exiting" : "");
 
+		if (worker->slot) atomic_store_explicit(&worker->slot->idle, false, memory_order_relaxed);
+
 		/*
 		 *	Service outstanding events.
 		 */
@@ -1313,38 +2148,90 @@ void fr_worker_debug(fr_worker_t *worker, FILE *fp)
 
 }
 
-/** Create a channel to the worker
+/** Allocate the worker's half of a channel
  *
- * Called by the master (i.e. network) thread when it needs to create
- * a new channel to a particuler worker.
+ * Called from the worker's own thread, so that the queue and ring buffer
+ * the worker writes replies to are placed on its NUMA node.  The channel
+ * is then passed to the master (i.e. network) thread, which calls
+ * #fr_worker_channel_open.
+ *
+ * @param[in] worker the worker
+ * @return
+ *	- A new channel, with no talloc parent.
+ *	- NULL on error.
+ */
+fr_channel_t *fr_worker_channel_alloc(fr_worker_t *worker)
+{
+	WORKER_VERIFY;
+
+	fr_assert(pthread_equal(pthread_self(), worker->thread_id) != 0);
+
+	return fr_channel_responder_create(NULL, worker->control);
+}
+
+/** Complete a channel to the worker, and tell the worker about it
+ *
+ * Called by the master (i.e. network) thread.
  *
  * @param[in] worker the worker
+ * @param[in] ch from #fr_worker_channel_alloc, or #fr_channel_responder_create.
+ * @param[in] ctx the context the channel will be moved to
  * @param[in] master the control plane of the master
- * @param[in] ctx the context in which the channel will be created
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.  The channel has been freed.
  */
-fr_channel_t *fr_worker_channel_create(fr_worker_t *worker, TALLOC_CTX *ctx, fr_control_t *master)
+int fr_worker_channel_open(fr_worker_t *worker, fr_channel_t *ch, TALLOC_CTX *ctx, fr_control_t *master)
 {
-	fr_channel_t *ch;
 	pthread_t id;
 	bool same;
 
 	WORKER_VERIFY;
 
+	talloc_steal(ctx, ch);
+
 	id = pthread_self();
 	same = (pthread_equal(id, worker->thread_id) != 0);
 
-	ch = fr_channel_create(ctx, master, worker->control, same);
-	if (!ch) return NULL;
+	if (fr_channel_requestor_attach(ch, master, same) < 0) {
+	error:
+		talloc_free(ch);
+		return -1;
+	}
 
 	fr_channel_set_recv_request(ch, worker, worker_recv_request);
 
 	/*
 	 *	Tell the worker about the channel
 	 */
-	if (fr_channel_signal_open(ch) < 0) {
-		talloc_free(ch);
-		return NULL;
-	}
+	if (fr_channel_signal_open(ch) < 0) goto error;
+
+	return 0;
+}
+
+/** Create a channel to the worker
+ *
+ * Called by the master (i.e. network) thread when it needs to create
+ * a new channel to a particuler worker.
+ *
+ * All of the channel's memory is allocated by the calling thread.
+ * #fr_worker_channel_alloc and #fr_worker_channel_open should be used
+ * where the master and the worker may be on different NUMA nodes.
+ *
+ * @param[in] worker the worker
+ * @param[in] master the control plane of the master
+ * @param[in] ctx the context in which the channel will be created
+ */
+fr_channel_t *fr_worker_channel_create(fr_worker_t *worker, TALLOC_CTX *ctx, fr_control_t *master)
+{
+	fr_channel_t *ch;
+
+	WORKER_VERIFY;
+
+	ch = fr_channel_responder_create(ctx, worker->control);
+	if (!ch) return NULL;
+
+	if (fr_worker_channel_open(worker, ch, ctx, master) < 0) return NULL;
 
 	return ch;
 }
@@ -1392,10 +2279,12 @@ int fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats)
 	if (num >= 4) stats[3] = worker->stats.dropped;
 	if (num >= 5) stats[4] = worker->num_naks;
 	if (num >= 6) stats[5] = worker->num_active;
+	if (num >= 7) stats[6] = worker->num_stolen;
+	if (num >= 8) stats[7] = worker->num_given;
 
-	if (num <= 6) return num;
+	if (num <= 8) return num;
 
-	return 6;
+	return 8;
 }
 
 static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
@@ -1411,6 +2300,11 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fprintf(fp, "count.naks\t\t\t%" PRIu64 "\n", worker->num_naks);
 		fprintf(fp, "count.active\t\t\t%" PRIu64 "\n", worker->num_active);
 		fprintf(fp, "count.runnable\t\t\t%u\n", fr_heap_num_elements(worker->runnable));
+		fprintf(fp, "count.stolen\t\t\t%" PRIu64 "\n", worker->num_stolen);
+		fprintf(fp, "count.given\t\t\t%" PRIu64 "\n", worker->num_given);
+		if (worker->slot) {
+			fprintf(fp, "count.backlog\t\t\t%zu\n", fr_atomic_queue_num_elements(worker->slot->backlog));
+		}
 	}
 
 	if ((info->argc == 0) || (strcmp(info->argv[0], "cpu") == 0)) {
@@ -1431,6 +2325,11 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fr_time_elapsed_fprint(fp, &worker->wall_clock, "time.requests", 4);
 	}
 
+	if ((info->argc == 0) || (strcmp(info->argv[0], "placement") == 0)) {
+		fprintf(fp, "placement.cpu\t\t\t%d\n", worker->cpu);
+		fprintf(fp, "placement.numa_node\t\t%d\n", worker->numa_node);
+	}
+
 	return 0;
 }
 
@@ -1446,7 +2345,7 @@ fr_cmd_table_t cmd_worker_table[] = {
 		.parent = "stats worker",
 		.add_name = true,
 		.name = "self",
-		.syntax = "[(count|cpu)]",
+		.syntax = "[(count|cpu|placement)]",
 		.func = cmd_stats_worker,
 		.help = "Show statistics for a specific worker thread.",
 		.read_only = true
@@ -37,6 +37,11 @@ extern "C" {
  */
 typedef struct fr_worker_s fr_worker_t;
 
+/**
+ *  A group of workers which steal requests from each other.
+ */
+typedef struct fr_worker_group_s fr_worker_group_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -83,8 +88,21 @@ void		fr_worker_post_event(fr_event_list_t *el, fr_time_t now, void *uctx);
 
 fr_channel_t	*fr_worker_channel_create(fr_worker_t *worker, TALLOC_CTX *ctx, fr_control_t *master) CC_HINT(nonnull);
 
+fr_channel_t	*fr_worker_channel_alloc(fr_worker_t *worker) CC_HINT(nonnull);
+
+int		fr_worker_channel_open(fr_worker_t *worker, fr_channel_t *ch,
+				       TALLOC_CTX *ctx, fr_control_t *master) CC_HINT(nonnull);
+
 int		fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats) CC_HINT(nonnull);
 
+fr_worker_group_t *fr_worker_group_alloc(TALLOC_CTX *ctx, unsigned int num_workers);
+
+int		fr_worker_group_join(fr_worker_t *worker, fr_worker_group_t *group) CC_HINT(nonnull);
+
+void		fr_worker_placement_set(fr_worker_t *worker, int cpu, int numa_node) CC_HINT(nonnull);
+
+int		fr_worker_numa_node(fr_worker_t const *worker) CC_HINT(nonnull);
+
 #include <freeradius-devel/server/module.h>
 
 int		fr_worker_request_add(request_t *request, module_method_t process, void *ctx);
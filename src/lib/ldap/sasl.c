@@ -123,6 +123,14 @@ static void _ldap_sasl_bind_io_read(fr_event_list_t *el, int fd, UNUSED int flag
 	fr_ldap_connection_t	*c = sasl_ctx->c;
 	fr_ldap_rcode_t		status;
 
+	/*
+	 *	Free the old result (if there is one)
+	 */
+	if (sasl_ctx->result) {
+		ldap_msgfree(sasl_ctx->result);
+		sasl_ctx->result = NULL;
+	}
+
 	/*
 	 *	If LDAP parse result indicates there was an error
 	 *	then we're done.
@@ -132,17 +140,13 @@ static void _ldap_sasl_bind_io_read(fr_event_list_t *el, int fd, UNUSED int flag
 	case LDAP_PROC_SUCCESS:
 	case LDAP_PROC_CONTINUE:
 	{
-		struct berval			*srv_cred;
+		struct berval			*srv_cred = NULL;
 		int				ret;
 
 		/*
-		 *	Free the old result (if there is one)
+		 *	The result is kept, as it's passed to the
+		 *	next call to ldap_sasl_interactive_bind.
 		 */
-		if (sasl_ctx->result) {
-			ldap_msgfree(sasl_ctx->result);
-			sasl_ctx->result = NULL;
-		}
-
 		ret = ldap_parse_sasl_bind_result(c->handle, sasl_ctx->result, &srv_cred, 0);
 		if (ret != LDAP_SUCCESS) {
 			ERROR("SASL decode failed (bind failed): %s", ldap_err2string(ret));
@@ -152,8 +156,10 @@ static void _ldap_sasl_bind_io_read(fr_event_list_t *el, int fd, UNUSED int flag
 			return;
 		}
 
-		DEBUG3("SASL response  : %pV", fr_box_strvalue_len(srv_cred->bv_val, srv_cred->bv_len));
-		ldap_memfree(srv_cred);
+		if (srv_cred) {
+			DEBUG3("SASL response  : %pV", fr_box_strvalue_len(srv_cred->bv_val, srv_cred->bv_len));
+			ber_bvfree(srv_cred);
+		}
 
 		/*
 		 *	If we need to continue, wait until the
@@ -242,6 +248,16 @@ static void _ldap_sasl_bind_io_write(fr_event_list_t *el, int fd, UNUSED int fla
 	 *	Want to read more SASL stuff...
 	 */
 	case LDAP_SASL_BIND_IN_PROGRESS:
+		/*
+		 *	We may have been called directly, before
+		 *	libldap had a file descriptor to give us.
+		 */
+		if ((fd < 0) &&
+		    ((ldap_get_option(c->handle, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS) || (fd < 0))) {
+			ERROR("Failed retrieving file descriptor from libldap");
+			goto error;
+		}
+
 		ret = fr_event_fd_insert(sasl_ctx, el, fd,
 					 _ldap_sasl_bind_io_read,
 					 NULL,
@@ -318,7 +334,7 @@ int fr_ldap_sasl_bind_async(fr_ldap_connection_t *c,
 
 	el = c->conn->el;
 
-	if (ldap_get_option(c->handle, LDAP_OPT_DESC, &fd) == LDAP_SUCCESS) {
+	if ((ldap_get_option(c->handle, LDAP_OPT_DESC, &fd) == LDAP_SUCCESS) && (fd >= 0)) {
 		int ret;
 
 		ret = fr_event_fd_insert(sasl_ctx, el, fd,
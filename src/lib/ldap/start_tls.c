@@ -123,6 +123,7 @@ static void _ldap_start_tls_io_read(UNUSED fr_event_list_t *el, UNUSED int fd, U
 		if (ret != LDAP_SUCCESS) {
 			ERROR("ldap_install_tls failed: %s", ldap_err2string(ret));
 			fr_ldap_state_error(c);		/* Restart the connection state machine */
+			break;
 		}
 
 		fr_ldap_state_next(c);			/* onto the next operation */
@@ -193,6 +194,16 @@ static void _ldap_start_tls_io_write(fr_event_list_t *el, int fd, UNUSED int fla
 		break;
 
 	case LDAP_SUCCESS:
+		/*
+		 *	We may have been called directly, before
+		 *	libldap had a file descriptor to give us.
+		 */
+		if ((fd < 0) &&
+		    ((ldap_get_option(c->handle, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS) || (fd < 0))) {
+			ERROR("Failed retrieving file descriptor from libldap");
+			goto error;
+		}
+
 		ret = fr_event_fd_insert(tls_ctx, el, fd,
 					 _ldap_start_tls_io_read,
 					 NULL,
@@ -234,7 +245,7 @@ int fr_ldap_start_tls_async(fr_ldap_connection_t *c, LDAPControl **serverctrls,
 
 	el = c->conn->el;
 
-	if (ldap_get_option(c->handle, LDAP_OPT_DESC, &fd) == LDAP_SUCCESS) {
+	if ((ldap_get_option(c->handle, LDAP_OPT_DESC, &fd) == LDAP_SUCCESS) && (fd >= 0)) {
 		int ret;
 
 		ret = fr_event_fd_insert(tls_ctx, el, fd,
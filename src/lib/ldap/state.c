@@ -115,6 +115,13 @@ again:
 			goto again;
 		}
 	 */
+
+		/*
+		 *	Whoever owns the connection handle
+		 *	installs its own I/O handlers when
+		 *	it's told the connection is up.
+		 */
+		fr_connection_signal_connected(c->conn);
 		break;
 
 	/*
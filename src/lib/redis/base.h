@@ -44,6 +44,7 @@ extern "C" {
 #define REDIS_ERROR_MOVED_STR		"MOVED"
 #define REDIS_ERROR_ASK_STR		"ASK"
 #define REDIS_ERROR_TRY_AGAIN_STR	"TRYAGAIN"
+#define REDIS_ERROR_CLUSTER_DOWN_STR	"CLUSTERDOWN"
 #define REDIS_ERROR_NO_SCRIPT_STR	"NOSCRIPT"
 #define REDIS_DEFAULT_PORT		6379
 
@@ -157,7 +157,7 @@
 #include "cluster.h"
 #include "crc16.h"
 
-#define KEY_SLOTS		16384			//!< Maximum number of keyslots (should not change).
+#define KEY_SLOTS		FR_REDIS_CLUSTER_KEY_SLOTS	//!< Maximum number of keyslots (should not change).
 
 #define MAX_SLAVES		5			//!< Maximum number of slaves associated
 							//!< with a keyslot.
@@ -245,6 +245,8 @@ struct fr_redis_cluster {
 	bool			remap_needed;		//!< Set true if at least one cluster node is definitely
 							//!< unreachable. Set false on successful remap.
 	time_t			last_updated;		//!< Last time the cluster mappings were updated.
+	uint64_t		version;		//!< Incremented each time the cluster mappings are
+							//!< updated.
 	CONF_SECTION		*module;		//!< Module configuration.
 
 	fr_redis_conf_t		*conf;			//!< Base configuration data such as the database number
@@ -747,6 +749,7 @@ do { \
 
 	cluster->remapping = false;
 	cluster->last_updated = time(NULL);
+	cluster->version++;
 
 	/*
 	 *	Sanity checks
@@ -1660,6 +1663,113 @@ int fr_redis_cluster_port(uint16_t *out, fr_redis_cluster_node_t const *node)
 	return 0;
 }
 
+/** Resolve a key to the address of the master node currently serving it
+ *
+ * Used by callers which maintain their own connections to each node,
+ * such as the asynchronous pipelining code, and only need to know where
+ * a key lives.
+ *
+ * @param[out] key_slot	The key slot the key resolved to.
+ * @param[out] out	Address of the master node serving the key slot.
+ * @param[out] version	of the cluster mappings the key was resolved with.
+ *			Changes whenever the cluster is remapped.
+ * @param[in] cluster	To resolve key in.
+ * @param[in] request	The current request.  May be NULL.
+ * @param[in] key	to resolve.  If NULL, or key_len is 0, a random
+ *			key slot will be chosen.
+ * @param[in] key_len	Length of the key.
+ * @return
+ *	- 0 on success.
+ *	- -1 if no node is serving the key slot.
+ */
+int fr_redis_cluster_addr_by_key(uint16_t *key_slot, fr_socket_t *out, uint64_t *version,
+				 fr_redis_cluster_t *cluster, request_t *request, uint8_t const *key, size_t key_len)
+{
+	fr_redis_cluster_key_slot_t const	*slot;
+	fr_redis_cluster_node_t const		*node;
+
+	slot = fr_redis_cluster_slot_by_key(cluster, request, key, key_len);
+	*key_slot = slot - cluster->key_slot;
+
+	pthread_mutex_lock(&cluster->mutex);
+	*version = cluster->version;
+	node = &cluster->node[slot->master];
+	if (!node->is_active) {
+		pthread_mutex_unlock(&cluster->mutex);
+		fr_strerror_printf("No active node serving key slot %u", *key_slot);
+		return -1;
+	}
+	*out = node->addr;
+	pthread_mutex_unlock(&cluster->mutex);
+
+	return 0;
+}
+
+typedef struct {
+	fr_socket_t	*out;		//!< Where to write the address of the node we picked.
+	unsigned int	count;		//!< How many active nodes we've seen.
+} addr_random_ctx_t;
+
+/** Pick an active node at random, with equal probability
+ *
+ */
+static int _cluster_addr_random_walk(void *data, void *uctx)
+{
+	addr_random_ctx_t		*ctx = uctx;
+	fr_redis_cluster_node_t		*node = data;
+
+	if (!node->is_active) return 0;
+
+	if ((fr_rand() % ++ctx->count) == 0) *ctx->out = node->addr;
+
+	return 0;
+}
+
+/** Return the address of a random active node
+ *
+ * Used by callers which maintain their own connections to each node, when the
+ * node serving a key slot is unknown, or has failed.  Unlike #fr_redis_cluster_remap
+ * this doesn't need a connection, so won't block.  If the node doesn't serve the
+ * key slot it'll respond with a -MOVED redirect to the node which does.
+ *
+ * @param[out] out	Address of the node.
+ * @param[in] cluster	to pick a node from.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there are no active nodes.
+ */
+int fr_redis_cluster_addr_random(fr_socket_t *out, fr_redis_cluster_t *cluster)
+{
+	addr_random_ctx_t	ctx = { .out = out };
+
+	pthread_mutex_lock(&cluster->mutex);
+	rbtree_walk(cluster->used_nodes, RBTREE_IN_ORDER, _cluster_addr_random_walk, &ctx);
+	pthread_mutex_unlock(&cluster->mutex);
+
+	if (ctx.count == 0) {
+		fr_strerror_const("No active nodes in cluster");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Extract the key slot and node address from a -MOVED or -ASK error
+ *
+ * @note Errors may be retrieved with fr_strerror().
+ *
+ * @param[out] key_slot	The key slot which has moved.  May be NULL.
+ * @param[out] out	Address of the node now serving the key slot.
+ * @param[in] reply	containing the redirect.
+ * @return
+ *	- FR_REDIS_CLUSTER_RCODE_SUCCESS on success.
+ *	- FR_REDIS_CLUSTER_RCODE_BAD_INPUT if the reply wasn't a valid redirect.
+ */
+fr_redis_cluster_rcode_t fr_redis_cluster_redirect_addr(uint16_t *key_slot, fr_socket_t *out, redisReply *reply)
+{
+	return cluster_node_conf_from_redirect(key_slot, out, reply);
+}
+
 /** Resolve a key to a pool, and reserve a connection in that pool
  *
  * This should be used with #fr_redis_cluster_state_next, and #fr_redis_command_status, to
@@ -2306,6 +2416,7 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 	} else {
 		cluster->log_prefix = talloc_strdup(cluster, log_prefix);
 	}
+	if (!conf->log_prefix) conf->log_prefix = cluster->log_prefix;	/* Used by the per-thread trunks */
 
 	/*
 	 *	Ensure we always have a pool section (even if it's empty)
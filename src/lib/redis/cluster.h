@@ -35,6 +35,8 @@ RCSIDH(cluster_h, "$Id$")
 extern "C" {
 #endif
 
+#define FR_REDIS_CLUSTER_KEY_SLOTS	16384		//!< Number of key slots in a cluster.
+
 typedef struct fr_redis_cluster fr_redis_cluster_t;
 typedef struct fr_redis_cluster_key_slot_s fr_redis_cluster_key_slot_t;
 typedef struct fr_redis_cluster_node_s fr_redis_cluster_node_t;
@@ -100,6 +102,12 @@ int fr_redis_cluster_ipaddr(fr_ipaddr_t *out, fr_redis_cluster_node_t const *nod
 
 int fr_redis_cluster_port(uint16_t *out, fr_redis_cluster_node_t const *node);
 
+int fr_redis_cluster_addr_by_key(uint16_t *key_slot, fr_socket_t *out, uint64_t *version,
+				 fr_redis_cluster_t *cluster, request_t *request, uint8_t const *key, size_t key_len);
+
+int fr_redis_cluster_addr_random(fr_socket_t *out, fr_redis_cluster_t *cluster);
+
+fr_redis_cluster_rcode_t fr_redis_cluster_redirect_addr(uint16_t *key_slot, fr_socket_t *out, redisReply *reply);
 
 
 /*
@@ -54,16 +54,80 @@ static void _redis_disconnected(redisAsyncContext const *ac, UNUSED int status)
 	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
 }
 
+/** Process the reply to an AUTH or SELECT command sent when the connection opened
+ *
+ * The connection is only signalled as connected once all the setup
+ * commands have succeeded.
+ */
+static void _redis_setup_reply(redisAsyncContext *ac, void *vreply, void *privdata)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(privdata, fr_connection_t);
+	fr_redis_handle_t	*h = conn->h;
+	redisReply		*reply = vreply;
+
+	/*
+	 *	hiredis calls pending callbacks with
+	 *	a NULL reply when the context is freed.
+	 */
+	if (!reply) return;
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		ERROR("Connection setup failed: %.*s", (int)reply->len, reply->str);
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	if (--h->setup_pending > 0) return;
+
+	DEBUG4("redis handle %p - Setup complete", h);
+
+	fr_connection_signal_connected(conn);
+}
+
 /** Called by hiredis to indicate the connection is live
  *
+ * If a password or database were configured, AUTH and SELECT are sent
+ * before the connection is signalled as connected, so that commands
+ * from the trunk are never sent on a connection in the wrong state.
  */
-static void _redis_connected(redisAsyncContext const *ac, UNUSED int status)
+static void _redis_connected(redisAsyncContext const *ac, int status)
 {
 	fr_connection_t		*conn = talloc_get_type_abort(ac->data, fr_connection_t);
+	fr_redis_handle_t	*h = conn->h;
+	fr_redis_io_conf_t const *conf = h->conf;
+	redisAsyncContext	*our_ac;
+
+	if (status != REDIS_OK) {
+		DEBUG4("Signalled by hiredis, connection failed");
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
 
 	DEBUG4("Signalled by hiredis, connection is open");
 
-	fr_connection_signal_connected(conn);
+	if (!conf->password && (conf->database == 0)) {
+		fr_connection_signal_connected(conn);
+		return;
+	}
+
+	memcpy(&our_ac, &ac, sizeof(our_ac)); /* const issues */
+
+	if (conf->password) {
+		if (redisAsyncCommand(our_ac, _redis_setup_reply, conn, "AUTH %s", conf->password) != REDIS_OK) {
+		error:
+			ERROR("Failed sending connection setup commands");
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+			return;
+		}
+		h->setup_pending++;
+	}
+
+	if (conf->database > 0) {
+		if (redisAsyncCommand(our_ac, _redis_setup_reply, conn, "SELECT %u", conf->database) != REDIS_OK) {
+			goto error;
+		}
+		h->setup_pending++;
+	}
 }
 
 /** Redis FD became readable
@@ -320,6 +384,7 @@ static fr_connection_state_t _redis_io_connection_init(void **h_out, fr_connecti
 		return FR_CONNECTION_STATE_FAILED;
 	}
 	talloc_set_destructor(h, _redis_handle_free);
+	h->conf = conf;
 
 	h->ac = redisAsyncConnect(host, port);
 	if (!h->ac) {
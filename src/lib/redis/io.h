@@ -68,8 +68,12 @@ typedef struct {
 	bool			write_set;		//!< We're listening for writes.
 	bool			ignore_disconnect_cb;	//!< Ensure that redisAsyncFree doesn't cause
 							///< a callback loop.
+	unsigned int		setup_pending;		//!< AUTH and SELECT commands we're waiting for
+							///< replies to, before the connection is usable.
 	fr_event_timer_t const	*timer;			//!< Connection timer.
 
+	fr_redis_io_conf_t const *conf;			//!< Configuration the connection was opened with.
+
 
 	redisAsyncContext	*ac;			//!< Async handle for hiredis.
 
@@ -107,7 +111,7 @@ static inline void fr_redis_connection_ignore_response(fr_redis_handle_t *h, fr_
 {
 	fr_redis_sqn_ignore_t *ignore;
 
-	fr_assert(sqn <= h->rsp_sqn);
+	fr_assert(sqn >= h->rsp_sqn);		/* Must not have been received yet */
 
 	MEM(ignore = talloc_zero(h, fr_redis_sqn_ignore_t));
 	ignore->sqn = sqn;
@@ -27,14 +27,15 @@
 
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/util/debug.h>
 
 #include "pipeline.h"
 #include "io.h"
 
-
 /** Thread local state for a cluster
  *
- * MOVE ME TO NEW ASYNC CLUSTER CODE
+ * Holds a trunk for each cluster node the thread has sent commands to,
+ * and a map of key slots to those trunks.
  */
 struct fr_redis_cluster_thread_s {
 	fr_event_list_t			*el;
@@ -42,23 +43,48 @@ struct fr_redis_cluster_thread_s {
 	char				*log_prefix;	//!< Common log prefix to use for all cluster related
 							///< messages.
 	bool				delay_start;	//!< Prevent connections from spawning immediately.
+
+	fr_redis_cluster_t		*cluster;	//!< Shared cluster state, used to resolve keys
+							///< to nodes.  May be NULL if commands are only
+							///< enqueued on specific trunks.
+	fr_redis_conf_t const		*conf;		//!< Database, password and redirect limits.
+	rbtree_t			*trunks;	//!< Trunks to each node, indexed by address.
+	fr_redis_trunk_t		**slot;		//!< Trunk serving each key slot.  Populated as
+							///< commands are enqueued, updated when we're
+							///< redirected with -MOVED, and cleared when the
+							///< node fails, or the cluster is remapped.
+	bool				*slot_unknown;	//!< The node serving the key slot failed, or told
+							///< us the cluster is unavailable.  Command sets
+							///< for the slot are sent to a random node until
+							///< a -MOVED redirect tells us where it lives.
+	uint64_t			version;	//!< Version of the cluster mappings the slot
+							///< entries were resolved with.
 };
 
 /** The thread local free list
  *
- * Any entries remaining in the list will be freed when the thread is joined
+ * Any entries remaining in the list are freed with the last cluster thread
+ * in this thread.  This isn't left to an exit handler, as the library may
+ * have been unloaded along with the modules using it by the time that runs.
  */
 static _Thread_local fr_dlist_head_t *command_set_free_list;
 
+/** How many cluster threads have been allocated in this thread
+ *
+ */
+static _Thread_local unsigned int cluster_thread_count;
+
 typedef enum {
 	FR_REDIS_COMMAND_NORMAL = 0,			//!< A normal, non-transactional command.
 	FR_REDIS_COMMAND_TRANSACTION_START,		//!< Start of a transaction block. Either WATCH or MULTI.
 							///< if a transaction is started with WATCH, then multi
 							///< is not marked up as a transaction start.
-	FR_REDIS_COMMAND_TRANSACTION_END		//!< End of a transaction block. Either EXEC or DISCARD.
+	FR_REDIS_COMMAND_TRANSACTION_END,		//!< End of a transaction block. Either EXEC or DISCARD.
 							///< If this command fails with
 							///< MOVED or ASK, all commands back to the previous
 							///< MULTI command must be requeued.
+	FR_REDIS_COMMAND_ASKING				//!< ASKING command we inserted to follow an -ASK
+							///< redirect.  Its reply isn't passed to the caller.
 } fr_redis_command_type_t;
 
 /** Represents a single command
@@ -69,6 +95,10 @@ struct fr_redis_command_s {
 	fr_dlist_t			entry;		//!< Entry in the command buffer.
 
 	fr_redis_command_type_t		type;		//!< Redis command type.
+	bool				in_txn;		//!< Command is queued within a MULTI block.
+	uint32_t			idx;		//!< Position of the command in the command set.
+							///< Keeps replies in order when only some of the
+							///< commands are sent again.
 
 	char const			*str;		//!< The command string.
 	size_t				len;		//!< Length of the command string.
@@ -95,7 +125,15 @@ struct fr_redis_command_set_s {
 	fr_dlist_head_t			completed;	//!< Commands complete with replies.
 	/** @} */
 
+	uint32_t			num_cmds;	//!< How many commands have been added.
 	uint8_t				redirected;	//!< How many times this command set was redirected.
+	bool				redirecting;	//!< Command set is being removed from a trunk
+							///< so it can be enqueued on another.
+	bool				pinned;		//!< Command set must run on the node it was
+							///< enqueued on.  Redirects are returned to
+							///< the caller.
+	uint16_t			slot;		//!< Key slot the command set was resolved to.
+							///< Only valid if the command set isn't pinned.
 
 	/** @name Request state
 	 *
@@ -105,8 +143,9 @@ struct fr_redis_command_set_s {
 	 * encapsulated within the command set, not just within the trunk.
 	 * @{
  	 */
+	fr_redis_trunk_t		*rtrunk;	//!< Trunk the command set is currently enqueued on.
 	fr_trunk_request_t		*treq;		//!< Trunk request this command set is associated with.
-	request_t				*request;	//!< Request this commands set is associated with (if any).
+	request_t			*request;	//!< Request this commands set is associated with (if any).
 	void				*rctx;		//!< Resume context to write results to.
 	/** @} */
 
@@ -147,16 +186,26 @@ struct fr_redis_trunk_s {
 	fr_trunk_t			*trunk;		//!< Trunk containing all the connections to a specific
 							///< host.
 	fr_redis_cluster_thread_t	*cluster;	//!< Cluster this trunk belongs to.
+	fr_socket_t			addr;		//!< Address of the node, if the trunk was allocated
+							///< by the cluster thread.
 };
 
-/** Free any free requests when the thread is joined
+/** Free any command sets in this thread's free list
  *
  */
-static void _command_set_free_list_free_on_exit(void *arg)
+static void command_set_free_list_free(void)
 {
-	fr_dlist_head_t		*list = talloc_get_type_abort(arg, fr_dlist_head_t);
+	fr_dlist_head_t		*list = command_set_free_list;
 	fr_redis_command_set_t	*cmds;
 
+	if (!list) return;
+
+	/*
+	 *	Command sets freed from here on
+	 *	are freed, not added to the list.
+	 */
+	command_set_free_list = NULL;
+
 	/*
 	 *	See the destructor for why this works
 	 */
@@ -169,8 +218,6 @@ static void _command_set_free_list_free_on_exit(void *arg)
  */
 static int _redis_command_set_free(fr_redis_command_set_t *cmds)
 {
-	if (fr_dlist_num_elements(command_set_free_list) >= 1024) return 0;	/* Keep a buffer of 1024 */
-
 	/*
 	 *	Freed from the free list....
 	 */
@@ -179,8 +226,11 @@ static int _redis_command_set_free(fr_redis_command_set_t *cmds)
 		return 0;
 	}
 
+	if (!command_set_free_list ||
+	    (fr_dlist_num_elements(command_set_free_list) >= 1024)) return 0;	/* Keep a buffer of 1024 */
+
 	talloc_free_children(cmds);
-	memset(&cmds, 0, sizeof(cmds));
+	memset(cmds, 0, sizeof(*cmds));
 
 	fr_dlist_insert_head(command_set_free_list, cmds);
 
@@ -195,6 +245,11 @@ static int _redis_command_set_free(fr_redis_command_set_t *cmds)
  * Control will be returned to the caller via the registered complete
  * and fail functions.
  *
+ * @note ctx should usually be NULL.  Once enqueued, the command set is owned
+ *	 by the trunk, and is freed after the complete or fail function is called.
+ *	 If the caller is no longer interested in the results, it should call
+ *	 #fr_redis_command_set_cancel.
+ *
  * @param[in] ctx	to bind the command set's lifetime to.
  * @param[in] request	to pass to places that need it.
  * @param[in] complete	Function to call when all commands have been processed.
@@ -222,7 +277,7 @@ fr_redis_command_set_t *fr_redis_command_set_alloc(TALLOC_CTX *ctx,
 	if (unlikely(!command_set_free_list)) {
 		MEM(free_list = talloc(NULL, fr_dlist_head_t));
 		fr_dlist_init(free_list, fr_redis_command_set_t, entry);
-		fr_thread_local_set_destructor(command_set_free_list, _command_set_free_list_free_on_exit, free_list);
+		command_set_free_list = free_list;
 	} else {
 		free_list = command_set_free_list;
 	}
@@ -238,10 +293,10 @@ fr_redis_command_set_t *fr_redis_command_set_alloc(TALLOC_CTX *ctx,
 						     COMMAND_PRE_ALLOC_COUNT * (sizeof(fr_redis_command_t) +
 						     COMMAND_PRE_ALLOC_LEN)));
 		talloc_set_destructor(cmds, _redis_command_set_free);
-		fr_dlist_entry_init(&cmds->entry);
 	} else {
 		fr_dlist_remove(free_list, cmds);
 	}
+	fr_dlist_entry_init(&cmds->entry);
 
 	fr_dlist_talloc_init(&cmds->pending, fr_redis_command_t, entry);
 	fr_dlist_talloc_init(&cmds->sent, fr_redis_command_t, entry);
@@ -262,19 +317,78 @@ fr_redis_command_set_t *fr_redis_command_set_alloc(TALLOC_CTX *ctx,
  */
 static int _redis_command_free(fr_redis_command_t *cmd)
 {
-	//if (cmd->result) fr_redis_reply_free(&cmd->result);
+	if (cmd->result) fr_redis_reply_free(&cmd->result);
 
 	return 0;
 }
 
+/** Return the result of a command
+ *
+ * @param[in] cmd	to retrieve the result of.
+ * @return
+ *	- The reply from the REDIS server.  This is freed with the command set.
+ *	- NULL if there's no reply.
+ */
 redisReply *fr_redis_command_get_result(fr_redis_command_t *cmd)
 {
 	return cmd->result;
 }
 
+/** Take ownership of the result of a command
+ *
+ * Allows the result to be used after the command set has been freed.
+ *
+ * @param[in] cmd	to retrieve the result of.
+ * @return
+ *	- The reply from the REDIS server.  Must be freed with #fr_redis_reply_free.
+ *	- NULL if there's no reply.
+ */
+redisReply *fr_redis_command_steal_result(fr_redis_command_t *cmd)
+{
+	redisReply *reply = cmd->result;
+
+	cmd->result = NULL;
+
+	return reply;
+}
+
+/** Find the name of a RESP encoded command
+ *
+ * @param[out] name	Start of the command name.
+ * @param[in] cmd_str	RESP encoded command.
+ * @param[in] cmd_len	Length of the command.
+ * @return
+ *	- The length of the command name.
+ *	- 0 if the command isn't a valid RESP array of bulk strings.
+ */
+static size_t redis_command_name(char const **name, char const *cmd_str, size_t cmd_len)
+{
+	char const	*p = cmd_str, *end = cmd_str + cmd_len;
+	char		*q;
+	unsigned long	len;
+
+	if ((p >= end) || (*p++ != '*')) return 0;
+
+	p = memchr(p, '\n', end - p);
+	if (!p || (++p >= end) || (*p++ != '$')) return 0;
+
+	len = strtoul(p, &q, 10);
+	if (((end - q) < 2) || (q[0] != '\r') || (q[1] != '\n')) return 0;
+	p = q + 2;
+	if (len > (size_t)(end - p)) return 0;
+
+	*name = p;
+
+	return len;
+}
+
+#define IS_COMMAND(_name, _name_len, _cmd) \
+	((_name_len == (sizeof(_cmd) - 1)) && (strncasecmp(_name, _cmd, sizeof(_cmd) - 1) == 0))
+
 /** Add a preformatted/expanded command to the command set
  *
- * The command must either be entirely static, or parented by the command set.
+ * The command must be RESP encoded, as produced by redisFormatCommand,
+ * and either be entirely static, or parented by the command set.
  *
  * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
  * 	 As subscribing to a stream where we're not expecting it would break
@@ -292,9 +406,18 @@ redisReply *fr_redis_command_get_result(fr_redis_command_t *cmd)
 fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
 							     char const *cmd_str, size_t cmd_len)
 {
-	request_t			*request = cmds->request;
+	request_t		*request = cmds->request;
 	fr_redis_command_t	*cmd;
 	fr_redis_command_type_t	type = FR_REDIS_COMMAND_NORMAL;
+	char const		*name;
+	size_t			name_len;
+	bool			in_txn = (cmds->txn_start > cmds->txn_end);
+
+	name_len = redis_command_name(&name, cmd_str, cmd_len);
+	if (!name_len) {
+		ROPTIONAL(REDEBUG, ERROR, "Malformed command");
+		return FR_REDIS_PIPELINE_BAD_CMDS;
+	}
 
 	/*
 	 *	Transaction sanity checks.
@@ -306,16 +429,15 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 	 *	We try very hard to do this without incurring a performance penalty
 	 *      for non-transactional commands.
 	 */
-	switch (tolower(cmd_str[0])) {
+	switch (tolower(name[0])) {
 	case 'm':
-		if (tolower(cmd_str[1] != 'u')) break;
-		if (strncasecmp(cmd_str, "multi", sizeof("multi") - 1) != 0) break;
+		if (!IS_COMMAND(name, name_len, "multi")) break;
 		/*
 		 *	There should only ever be a difference of
 		 *	1 between txn starts and txn ends.
 		 */
-		if ((cmds->txn_end < cmds->txn_start) && ((cmds->txn_start - cmds->txn_end) > 1)) {
-			ROPTIONAL(ERROR, REDEBUG, "Too many consecutive \"MULTI\" commands");
+		if (in_txn) {
+			ROPTIONAL(REDEBUG, ERROR, "Too many consecutive \"MULTI\" commands");
 			return FR_REDIS_PIPELINE_BAD_CMDS;
 		}
 		/*
@@ -323,13 +445,13 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 		 *	that's marked as the start of the transaction
 		 *	block.
 		 */
-		type = cmds->txn_watch ? FR_REDIS_COMMAND_TRANSACTION_START : FR_REDIS_COMMAND_NORMAL;
+		type = cmds->txn_watch ? FR_REDIS_COMMAND_NORMAL : FR_REDIS_COMMAND_TRANSACTION_START;
 		cmds->txn_start++;	/* Yes MULTI increments start, not WATCH */
+		cmds->txn_watch = false;
 		break;
 
 	case 'e':
-		if (tolower(cmd_str[1] != 'e')) break;
-		if (strncasecmp(cmd_str, "exec", sizeof("exec") - 1) != 0) break;
+		if (!IS_COMMAND(name, name_len, "exec")) break;
 		goto txn_end;
 
 	/*
@@ -338,11 +460,10 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 	 *	executing the commands.
 	 */
 	case 'd':
-		if (tolower(cmd_str[1] != 'i')) break;
-		if (strncasecmp(cmd_str, "discard", sizeof("discard") - 1) != 0) break;
+		if (!IS_COMMAND(name, name_len, "discard")) break;
 	txn_end:
-		if (cmds->txn_start <= cmds->txn_end) {
-			ROPTIONAL(ERROR, REDEBUG, "Transaction not started, missing \"MULTI\" command");
+		if (!in_txn) {
+			ROPTIONAL(REDEBUG, ERROR, "Transaction not started, missing \"MULTI\" command");
 			return FR_REDIS_PIPELINE_BAD_CMDS;
 		}
 		type = FR_REDIS_COMMAND_TRANSACTION_END;
@@ -350,17 +471,18 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 		break;
 
 	case 'w':
-		if (tolower(cmd_str[1] != 'a')) break;
-		if (strncasecmp(cmd_str, "watch", sizeof("watch") - 1) != 0) break;
+		if (!IS_COMMAND(name, name_len, "watch")) break;
 		if (cmds->txn_watch) {
-			ROPTIONAL(ERROR, REDEBUG, "Too many consecutive \"WATCH\" commands");
+			ROPTIONAL(REDEBUG, ERROR, "Too many consecutive \"WATCH\" commands");
 			return FR_REDIS_PIPELINE_BAD_CMDS;
 		}
-		if (cmds->txn_start > cmds->txn_end) {
-			ROPTIONAL(ERROR, REDEBUG, "\"WATCH\" can only be used before \"MULTI\"");
+		if (in_txn) {
+			ROPTIONAL(REDEBUG, ERROR, "\"WATCH\" can only be used before \"MULTI\"");
 			return FR_REDIS_PIPELINE_BAD_CMDS;
 		}
-		FALL_THROUGH;
+		type = FR_REDIS_COMMAND_TRANSACTION_START;
+		cmds->txn_watch = true;
+		break;
 
 	default:
 		break;
@@ -370,6 +492,8 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 	talloc_set_destructor(cmd, _redis_command_free);
 	cmd->cmds = cmds;
 	cmd->type = type;
+	cmd->in_txn = in_txn;
+	cmd->idx = cmds->num_cmds++;
 	cmd->str = cmd_str;
 	cmd->len = cmd_len;
 	fr_dlist_insert_tail(&cmds->pending, cmd);
@@ -377,6 +501,77 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 	return FR_REDIS_PIPELINE_OK;
 }
 
+/** Copy a RESP encoded command allocated by hiredis into the command set, and add it
+ *
+ */
+static fr_redis_pipeline_status_t redis_command_formatted_add(fr_redis_command_set_t *cmds, char *cmd_str, int cmd_len)
+{
+	request_t			*request = cmds->request;
+	char				*our_cmd_str;
+	fr_redis_pipeline_status_t	ret;
+
+	if (cmd_len < 0) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed formatting command");
+		return FR_REDIS_PIPELINE_BAD_CMDS;
+	}
+
+	MEM(our_cmd_str = talloc_memdup(cmds, cmd_str, (size_t)cmd_len));
+	free(cmd_str);		/* Allocated by hiredis */
+
+	ret = fr_redis_command_preformatted_add(cmds, our_cmd_str, (size_t)cmd_len);
+	if (ret != FR_REDIS_PIPELINE_OK) talloc_free(our_cmd_str);
+
+	return ret;
+}
+
+/** Add a command to the command set, from an array of arguments
+ *
+ * Arguments are sent as binary safe strings, so don't need escaping.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] argc	Number of arguments, including the command name.
+ * @param[in] argv	Command name, followed by its arguments.
+ * @param[in] argv_len	Length of each argument.  If NULL, the arguments
+ *			are treated as \0 terminated strings.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_argv_add(fr_redis_command_set_t *cmds,
+						     int argc, char const **argv, size_t const *argv_len)
+{
+	char	*cmd_str = NULL;
+	int	cmd_len;
+
+	cmd_len = redisFormatCommandArgv(&cmd_str, argc, argv, argv_len);
+
+	return redis_command_formatted_add(cmds, cmd_str, cmd_len);
+}
+
+/** Add a command to the command set, using hiredis' printf style formatting
+ *
+ * As with redisCommand, %s and %b arguments are sent as binary safe strings.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] fmt	Command format string.
+ * @param[in] ...	Arguments for the format string.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_printf_add(fr_redis_command_set_t *cmds, char const *fmt, ...)
+{
+	va_list	ap;
+	char	*cmd_str = NULL;
+	int	cmd_len;
+
+	va_start(ap, fmt);
+	cmd_len = redisvFormatCommand(&cmd_str, fmt, ap);
+	va_end(ap);
+
+	return redis_command_formatted_add(cmds, cmd_str, cmd_len);
+}
+
 /** Enqueue a command set on a specific trunk
  *
  * The command set may be passed around several trunks before it is complete.
@@ -391,11 +586,15 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
  */
 fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, fr_redis_command_set_t *cmds)
 {
+	request_t *request = cmds->request;
+
 	if (cmds->txn_start != cmds->txn_end) {
-		ERROR("Refusing to enqueue - Unbalanced transaction start/stop commands");
+		ROPTIONAL(REDEBUG, ERROR, "Refusing to enqueue - Unbalanced transaction start/stop commands");
 		return FR_REDIS_PIPELINE_BAD_CMDS;
 	}
 
+	cmds->rtrunk = rtrunk;
+
 	switch (fr_trunk_request_enqueue(&cmds->treq, rtrunk->trunk, cmds->request, cmds, cmds->rctx)) {
 	case FR_TRUNK_ENQUEUE_OK:
 	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
@@ -409,6 +608,505 @@ fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, f
 	}
 }
 
+/** Find or allocate the trunk for a cluster node
+ *
+ */
+static fr_redis_trunk_t *redis_trunk_by_addr(fr_redis_cluster_thread_t *cluster_thread, fr_socket_t const *addr)
+{
+	fr_redis_trunk_t	*rtrunk;
+	fr_redis_io_conf_t	*io_conf;
+	fr_redis_conf_t const	*conf = cluster_thread->conf;
+	char			buffer[FR_IPADDR_STRLEN];
+
+	rtrunk = rbtree_finddata(cluster_thread->trunks, &(fr_redis_trunk_t){ .addr = *addr });
+	if (rtrunk) return rtrunk;
+
+	MEM(io_conf = talloc_zero(cluster_thread, fr_redis_io_conf_t));
+	fr_inet_ntop(buffer, sizeof(buffer), &addr->inet.dst_ipaddr);
+	io_conf->hostname = talloc_typed_strdup(io_conf, buffer);
+	io_conf->port = addr->inet.dst_port;
+	if (conf) {
+		io_conf->database = conf->database;
+		io_conf->password = conf->password;
+		io_conf->connection_timeout = conf->connection_timeout;
+		io_conf->reconnection_delay = conf->reconnection_delay;
+		io_conf->log_prefix = conf->log_prefix;
+	}
+
+	rtrunk = fr_redis_trunk_alloc(cluster_thread, io_conf);
+	if (!rtrunk) {
+		talloc_free(io_conf);
+		return NULL;
+	}
+	talloc_steal(rtrunk, io_conf);
+	rtrunk->addr = *addr;
+
+	if (!rbtree_insert(cluster_thread->trunks, rtrunk)) {
+		talloc_free(rtrunk);
+		return NULL;
+	}
+
+	return rtrunk;
+}
+
+/** Stop using the trunk a command set was sent on for its key slot
+ *
+ * Called when the node failed to execute the command set, or told us it
+ * can't serve the slot.  The next command set for the slot will be sent to
+ * a random node, which will redirect us if it doesn't serve the slot.
+ */
+static void redis_command_set_slot_invalidate(fr_redis_command_set_t *cmds)
+{
+	fr_redis_cluster_thread_t	*cluster_thread = cmds->rtrunk->cluster;
+
+	if (!cluster_thread->cluster || cmds->pinned) return;
+
+	if (cluster_thread->slot[cmds->slot] == cmds->rtrunk) cluster_thread->slot[cmds->slot] = NULL;
+	if (!cluster_thread->slot[cmds->slot]) cluster_thread->slot_unknown[cmds->slot] = true;
+}
+
+/** Enqueue a command set on the trunk for the cluster node serving a key
+ *
+ * All commands in the set must operate on keys which hash to the same key slot.
+ *
+ * @param[in] cluster_thread	to find the node's trunk in.
+ * @param[in] cmds		Command set to enqueue.
+ * @param[in] key		to resolve to a cluster node.  If NULL, or key_len
+ *				is 0, a random node is chosen.
+ * @param[in] key_len		Length of the key.
+ * @return
+ *	- FR_REDIS_PIPELINE_OK if commands were immediately enqueued or placed in the backlog.
+ *	- FR_REDIS_PIPELINE_DST_UNAVAILABLE if no node is serving the key, or the node is unreachable.
+ *	- FR_REDIS_PIPELINE_FAIL any other general error.
+ */
+fr_redis_pipeline_status_t fr_redis_command_set_enqueue(fr_redis_cluster_thread_t *cluster_thread,
+							fr_redis_command_set_t *cmds,
+							uint8_t const *key, size_t key_len)
+{
+	request_t			*request = cmds->request;
+	fr_redis_trunk_t		*rtrunk;
+	fr_redis_pipeline_status_t	ret;
+	fr_socket_t			addr;
+	uint64_t			version;
+	uint16_t			slot;
+	int				resolved;
+
+	if (!cluster_thread->cluster) {
+		ROPTIONAL(REDEBUG, ERROR, "No cluster to resolve key to a node");
+		return FR_REDIS_PIPELINE_FAIL;
+	}
+
+	resolved = fr_redis_cluster_addr_by_key(&slot, &addr, &version, cluster_thread->cluster,
+						request, key, key_len);
+
+	/*
+	 *	The shared map has changed since we populated
+	 *	the slot entries, so anything we learned from
+	 *	-MOVED redirects may be stale.
+	 */
+	if (version != cluster_thread->version) {
+		memset(cluster_thread->slot, 0, sizeof(*cluster_thread->slot) * FR_REDIS_CLUSTER_KEY_SLOTS);
+		memset(cluster_thread->slot_unknown, 0,
+		       sizeof(*cluster_thread->slot_unknown) * FR_REDIS_CLUSTER_KEY_SLOTS);
+		cluster_thread->version = version;
+	}
+
+	/*
+	 *	Otherwise prefer what we learned from -MOVED
+	 *	redirects, as it's likely more recent.
+	 */
+	rtrunk = cluster_thread->slot[slot];
+	if (!rtrunk) {
+		bool guess = (resolved < 0) || cluster_thread->slot_unknown[slot];
+
+		/*
+		 *	No node is serving the key slot, or the node
+		 *	we were using failed, or told us the cluster
+		 *	is down.
+		 *
+		 *	Remapping needs a pooled connection, and would
+		 *	block the worker, so send the commands to any
+		 *	node.  If it doesn't serve the key slot, it'll
+		 *	redirect us to the node which does.
+		 */
+		if (guess && (fr_redis_cluster_addr_random(&addr, cluster_thread->cluster) < 0)) {
+			ROPTIONAL(RPEDEBUG, PERROR, "Failed resolving key to a cluster node");
+			return FR_REDIS_PIPELINE_DST_UNAVAILABLE;
+		}
+
+		rtrunk = redis_trunk_by_addr(cluster_thread, &addr);
+		if (!rtrunk) return FR_REDIS_PIPELINE_DST_UNAVAILABLE;
+		if (!guess) cluster_thread->slot[slot] = rtrunk;
+	}
+	cmds->slot = slot;
+
+	ret = redis_command_set_enqueue(rtrunk, cmds);
+	if (ret == FR_REDIS_PIPELINE_DST_UNAVAILABLE) redis_command_set_slot_invalidate(cmds);
+
+	return ret;
+}
+
+/** Enqueue a command set on the trunk for a specific cluster node
+ *
+ * Redirects are not followed, the -MOVED or -ASK errors are returned to the caller.
+ *
+ * @param[in] cluster_thread	to find the node's trunk in.
+ * @param[in] cmds		Command set to enqueue.
+ * @param[in] addr		of the node.
+ * @return
+ *	- FR_REDIS_PIPELINE_OK if commands were immediately enqueued or placed in the backlog.
+ *	- FR_REDIS_PIPELINE_DST_UNAVAILABLE if the REDIS host is unreachable.
+ *	- FR_REDIS_PIPELINE_FAIL any other general error.
+ */
+fr_redis_pipeline_status_t fr_redis_command_set_enqueue_by_addr(fr_redis_cluster_thread_t *cluster_thread,
+								fr_redis_command_set_t *cmds,
+								fr_socket_t const *addr)
+{
+	fr_redis_trunk_t *rtrunk;
+
+	rtrunk = redis_trunk_by_addr(cluster_thread, addr);
+	if (!rtrunk) return FR_REDIS_PIPELINE_DST_UNAVAILABLE;
+	cmds->pinned = true;
+
+	return redis_command_set_enqueue(rtrunk, cmds);
+}
+
+/** Signal that the caller is no longer interested in the results of a command set
+ *
+ * The command set will be freed, and the complete and fail functions won't be called.
+ *
+ * @param[in] cmds	to cancel.
+ */
+void fr_redis_command_set_cancel(fr_redis_command_set_t *cmds)
+{
+	if (!cmds->treq) {
+		talloc_free(cmds);
+		return;
+	}
+
+	fr_trunk_request_signal_cancel(cmds->treq);
+}
+
+/** Put commands we don't have replies for back into the pending list
+ *
+ * Commands which have already completed are left alone, so they're not
+ * executed twice, unless they're part of a transaction block which hasn't
+ * completed.  The whole block has to be sent again on the same connection.
+ *
+ * The remaining commands are placed back into the pending list in their
+ * original order.
+ */
+static void redis_command_set_reset(fr_redis_command_set_t *cmds)
+{
+	fr_dlist_head_t		pending;
+	fr_redis_command_t	*cmd, *block = NULL;
+
+	fr_dlist_talloc_init(&pending, fr_redis_command_t, entry);
+
+	for (cmd = fr_dlist_tail(&cmds->completed);
+	     cmd && (cmd->type != FR_REDIS_COMMAND_TRANSACTION_END);
+	     cmd = fr_dlist_prev(&cmds->completed, cmd)) {
+		if (cmd->type == FR_REDIS_COMMAND_TRANSACTION_START) block = cmd;
+	}
+
+	while (block) {
+		cmd = fr_dlist_next(&cmds->completed, block);
+
+		fr_dlist_remove(&cmds->completed, block);
+		fr_redis_reply_free(&block->result);
+		fr_dlist_insert_tail(&pending, block);
+
+		block = cmd;
+	}
+
+	while ((cmd = fr_dlist_pop_head(&cmds->sent))) fr_dlist_insert_tail(&pending, cmd);
+	while ((cmd = fr_dlist_pop_head(&cmds->pending))) fr_dlist_insert_tail(&pending, cmd);
+
+	while ((cmd = fr_dlist_pop_head(&pending))) {
+		if (cmd->type == FR_REDIS_COMMAND_ASKING) {
+			talloc_free(cmd);
+			continue;
+		}
+		fr_dlist_insert_tail(&cmds->pending, cmd);
+	}
+}
+
+/** Add a command to the completed list, in the order it was added to the command set
+ *
+ * Commands are usually completed in order, so this is normally an append.
+ */
+static void redis_command_completed_insert(fr_redis_command_set_t *cmds, fr_redis_command_t *cmd)
+{
+	fr_redis_command_t *prev;
+
+	for (prev = fr_dlist_tail(&cmds->completed);
+	     prev && (prev->idx > cmd->idx);
+	     prev = fr_dlist_prev(&cmds->completed, prev));
+
+	fr_dlist_insert_after(&cmds->completed, prev, cmd);
+}
+
+/** Make a deep copy of a reply
+ *
+ * hiredis frees replies as soon as the callback they're passed to returns,
+ * so we need our own copy to give to the caller.
+ *
+ * The copy is allocated the same way as hiredis allocates replies, so it can
+ * be freed with freeReplyObject.
+ */
+static redisReply *redis_reply_copy(redisReply const *in)
+{
+	redisReply	*out;
+	size_t		i;
+
+	out = malloc(sizeof(*out));
+	if (!out) return NULL;
+
+	memcpy(out, in, sizeof(*out));
+	out->str = NULL;
+	out->element = NULL;
+
+	if (in->str) {
+		out->str = malloc(in->len + 1);
+		if (!out->str) goto error;
+		memcpy(out->str, in->str, in->len + 1);
+	}
+
+	if (in->element) {
+		out->element = calloc(in->elements, sizeof(redisReply *));
+		if (!out->element) goto error;
+
+		for (i = 0; i < in->elements; i++) {
+			if (!in->element[i]) continue;
+
+			out->element[i] = redis_reply_copy(in->element[i]);
+			if (!out->element[i]) goto error;
+		}
+	}
+
+	return out;
+
+error:
+	freeReplyObject(out);
+	return NULL;
+}
+
+/** Check whether a reply is a -MOVED or -ASK error
+ *
+ */
+static bool redis_reply_is_redirect(bool *ask, redisReply const *reply)
+{
+	if (!reply || (reply->type != REDIS_REPLY_ERROR) || !reply->str) return false;
+
+	if (strncmp(REDIS_ERROR_MOVED_STR, reply->str, sizeof(REDIS_ERROR_MOVED_STR) - 1) == 0) {
+		*ask = false;
+		return true;
+	}
+
+	if (strncmp(REDIS_ERROR_ASK_STR, reply->str, sizeof(REDIS_ERROR_ASK_STR) - 1) == 0) {
+		*ask = true;
+		return true;
+	}
+
+	return false;
+}
+
+/** Find the first -MOVED or -ASK error in the replies to a command set
+ *
+ */
+static redisReply *redis_command_set_redirect(bool *ask, fr_redis_command_set_t *cmds)
+{
+	fr_redis_command_t *cmd;
+
+	for (cmd = fr_dlist_head(&cmds->completed);
+	     cmd;
+	     cmd = fr_dlist_next(&cmds->completed, cmd)) {
+		if (redis_reply_is_redirect(ask, cmd->result)) return cmd->result;
+	}
+
+	return NULL;
+}
+
+/** Move the commands which were redirected back into the pending list
+ *
+ * Commands which completed on the node aren't sent again.  Sending them again
+ * would repeat commands which aren't idempotent, like INCR or LPUSH.
+ *
+ * A transaction block is only executed if none of the commands within it were
+ * redirected, so if any were, the whole block is sent again.
+ */
+static void redis_command_set_redirect_requeue(fr_redis_command_set_t *cmds)
+{
+	fr_redis_command_t	*cmd, *next, *block = NULL;
+	bool			ask;
+
+	for (cmd = fr_dlist_head(&cmds->completed); cmd; cmd = next) {
+		next = fr_dlist_next(&cmds->completed, cmd);
+
+		if (cmd->type == FR_REDIS_COMMAND_TRANSACTION_START) block = cmd;
+		if (!block && !redis_reply_is_redirect(&ask, cmd->result)) continue;
+		if (block && (cmd->type != FR_REDIS_COMMAND_TRANSACTION_END)) continue;
+
+		/*
+		 *	End of a transaction block, requeue all of
+		 *	it, or none of it.
+		 */
+		if (block) {
+			fr_redis_command_t *p, *end = next;
+
+			for (p = block; p != end; p = fr_dlist_next(&cmds->completed, p)) {
+				if (redis_reply_is_redirect(&ask, p->result)) break;
+			}
+			if (p == end) {
+				block = NULL;
+				continue;
+			}
+
+			for (p = block; p != end; p = next) {
+				next = fr_dlist_next(&cmds->completed, p);
+				fr_dlist_remove(&cmds->completed, p);
+				fr_redis_reply_free(&p->result);
+				fr_dlist_insert_tail(&cmds->pending, p);
+			}
+			next = end;
+			block = NULL;
+			continue;
+		}
+
+		fr_dlist_remove(&cmds->completed, cmd);
+		fr_redis_reply_free(&cmd->result);
+		fr_dlist_insert_tail(&cmds->pending, cmd);
+	}
+
+	/*
+	 *	WATCH without a MULTI, so the commands which
+	 *	followed it weren't part of a transaction.
+	 */
+	for (cmd = block; cmd; cmd = next) {
+		next = fr_dlist_next(&cmds->completed, cmd);
+
+		if (!redis_reply_is_redirect(&ask, cmd->result)) continue;
+
+		fr_dlist_remove(&cmds->completed, cmd);
+		fr_redis_reply_free(&cmd->result);
+		fr_dlist_insert_tail(&cmds->pending, cmd);
+	}
+}
+
+/** Check whether any replies to a command set were -CLUSTERDOWN or -TRYAGAIN errors
+ *
+ */
+static bool redis_command_set_cluster_unavailable(fr_redis_command_set_t *cmds)
+{
+	fr_redis_command_t *cmd;
+
+	for (cmd = fr_dlist_head(&cmds->completed);
+	     cmd;
+	     cmd = fr_dlist_next(&cmds->completed, cmd)) {
+		redisReply *reply = cmd->result;
+
+		if (!reply || (reply->type != REDIS_REPLY_ERROR) || !reply->str) continue;
+
+		if ((strncmp(REDIS_ERROR_CLUSTER_DOWN_STR, reply->str, sizeof(REDIS_ERROR_CLUSTER_DOWN_STR) - 1) == 0) ||
+		    (strncmp(REDIS_ERROR_TRY_AGAIN_STR, reply->str, sizeof(REDIS_ERROR_TRY_AGAIN_STR) - 1) == 0)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/** Follow a -MOVED or -ASK redirect
+ *
+ * The command set is removed from its current trunk, and enqueued on the trunk
+ * for the node we were redirected to.
+ *
+ * @return
+ *	- 0 if the command set was enqueued on another trunk, or freed.
+ *	- -1 if the command set couldn't be redirected.  The caller should signal failure.
+ */
+static int redis_command_set_redirect_follow(fr_redis_command_set_t *cmds, redisReply *redirect, bool ask)
+{
+	fr_redis_cluster_thread_t	*cluster_thread = cmds->rtrunk->cluster;
+	request_t			*request = cmds->request;
+	fr_redis_trunk_t		*rtrunk;
+	fr_redis_command_t		*cmd;
+	fr_socket_t			addr;
+	uint16_t			slot;
+
+	if (!cluster_thread->conf || (cmds->redirected >= cluster_thread->conf->max_redirects)) {
+		ROPTIONAL(REDEBUG, ERROR, "Too many redirects (%u)", cmds->redirected);
+		return -1;
+	}
+
+	if (fr_redis_cluster_redirect_addr(&slot, &addr, redirect) != FR_REDIS_CLUSTER_RCODE_SUCCESS) {
+		ROPTIONAL(RPEDEBUG, PERROR, "Failed parsing redirect");
+		return -1;
+	}
+
+	rtrunk = redis_trunk_by_addr(cluster_thread, &addr);
+	if (!rtrunk) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed allocating trunk for redirect");
+		return -1;
+	}
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Following %s redirect to %pV:%u",
+		  ask ? "-ASK" : "-MOVED", fr_box_ipaddr(addr.inet.dst_ipaddr), addr.inet.dst_port);
+
+	/*
+	 *	-MOVED means the slot has been permanently
+	 *	reassigned, so future commands for keys in
+	 *	the slot should go straight to the new node.
+	 */
+	if (!ask && (slot < FR_REDIS_CLUSTER_KEY_SLOTS)) {
+		cluster_thread->slot[slot] = rtrunk;
+		cluster_thread->slot_unknown[slot] = false;
+		cmds->slot = slot;
+	}
+
+	/*
+	 *	Remove the command set from the current trunk
+	 *	without notifying the caller, or freeing it.
+	 */
+	cmds->redirecting = true;
+	fr_trunk_request_signal_complete(cmds->treq);
+	cmds->redirecting = false;
+
+	redis_command_set_redirect_requeue(cmds);
+	cmds->redirected++;
+
+	/*
+	 *	The node will only serve keys in a slot being
+	 *	imported if the command is preceded by ASKING.
+	 *
+	 *	The flag persists whilst commands are being
+	 *	queued in a MULTI block, so only the command
+	 *	starting the block needs it.
+	 */
+	if (ask) for (cmd = fr_dlist_head(&cmds->pending);
+		      cmd;
+		      cmd = fr_dlist_next(&cmds->pending, cmd)) {
+		fr_redis_command_t *asking;
+
+		if (cmd->in_txn) continue;
+
+		MEM(asking = talloc_zero(cmds, fr_redis_command_t));
+		asking->cmds = cmds;
+		asking->type = FR_REDIS_COMMAND_ASKING;
+		asking->str = "*1\r\n$6\r\nASKING\r\n";
+		asking->len = sizeof("*1\r\n$6\r\nASKING\r\n") - 1;
+		fr_dlist_insert_before(&cmds->pending, cmd, asking);
+	}
+
+	if (redis_command_set_enqueue(rtrunk, cmds) != FR_REDIS_PIPELINE_OK) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed enqueueing redirected commands");
+		if (cmds->fail) cmds->fail(cmds->request, &cmds->completed, cmds->rctx);
+		talloc_free(cmds);
+	}
+
+	return 0;
+}
+
 /** Callback for for receiving Redis replies
  *
  * This is called by hiredis for each response is receives.  privData is set to the
@@ -428,37 +1126,70 @@ static void _redis_pipeline_demux(struct redisAsyncContext *ac, void *vreply, vo
 {
 	fr_redis_command_t	*cmd;
 	fr_redis_command_set_t	*cmds;
-	fr_connection_t		*conn = talloc_get_type_abort(ac->ev.data, fr_connection_t);
-	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
-	redisReply		*reply = vreply;
+	fr_connection_t		*conn;
+	fr_redis_handle_t	*h;
+	redisReply		*reply = vreply, *redirect;
+	bool			ask;
+
 	/*
-	 *	First check if we should ignore the response
+	 *	hiredis calls any outstanding callbacks
+	 *	with a NULL reply when the context is
+	 *	freed.  The trunk has already dealt with
+	 *	the command sets that were sent on the
+	 *	connection, so privdata may no longer
+	 *	be valid.
+	 */
+	if (!reply) return;
+
+	conn = talloc_get_type_abort(ac->ev.data, fr_connection_t);
+	h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
+
+	/*
+	 *	First check if we should ignore the response.
+	 *	hiredis frees the reply when we return.
 	 */
 	if (!fr_redis_connection_process_response(h)) {
 		DEBUG4("Ignoring response with SQN %"PRIu64, (h->rsp_sqn - 1));	/* Already incremented */
-		fr_redis_reply_free((redisReply **)&reply);
 		return;
 	}
 
-	/*
-	 *	FIXME - Need to check TRYAGAIN, MOVED etc...
-	 *	I guess we might want to wait for the end of
-	 *	the command set to do that.
-	 */
 	cmd = talloc_get_type_abort(privdata, fr_redis_command_t);
 	cmds = cmd->cmds;
-	cmd->result = reply;
 
 	fr_dlist_remove(&cmds->sent, cmd);
-	fr_dlist_insert_tail(&cmds->completed, cmd);
+	if (cmd->type == FR_REDIS_COMMAND_ASKING) {
+		talloc_free(cmd);
+	} else {
+		MEM(cmd->result = redis_reply_copy(reply));
+		redis_command_completed_insert(cmds, cmd);
+	}
 
 	/*
 	 *	Check is the command set is complete,
 	 *	and if it is, tell the trunk the treq
 	 *	is complete.
 	 */
-	if ((fr_dlist_num_elements(&cmds->pending) == 0) &&
-	    (fr_dlist_num_elements(&cmds->sent) == 0)) fr_trunk_request_signal_complete(cmds->treq);
+	if ((fr_dlist_num_elements(&cmds->pending) != 0) ||
+	    (fr_dlist_num_elements(&cmds->sent) != 0)) return;
+
+	/*
+	 *	Follow any redirects before letting the
+	 *	caller see the results.
+	 */
+	redirect = cmds->pinned ? NULL : redis_command_set_redirect(&ask, cmds);
+	if (redirect && cmds->rtrunk->cluster->cluster) {
+		if (redis_command_set_redirect_follow(cmds, redirect, ask) < 0) fr_trunk_request_signal_fail(cmds->treq);
+		return;
+	}
+
+	/*
+	 *	The node can't serve the key slot at the moment.
+	 *	The caller gets the errors, but we shouldn't
+	 *	keep sending the node commands for the slot.
+	 */
+	if (redis_command_set_cluster_unavailable(cmds)) redis_command_set_slot_invalidate(cmds);
+
+	fr_trunk_request_signal_complete(cmds->treq);
 }
 
 static fr_connection_t *_redis_pipeline_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
@@ -473,57 +1204,80 @@ static fr_connection_t *_redis_pipeline_connection_alloc(fr_trunk_connection_t *
 /** Enqueue one or more command sets onto a redis handle
  *
  * Because the trunk is in always writable mode, _redis_pipeline_mux
- * will be called any time fr_trunk_request_enqueue is called, so there'll only
- * ever be one command to dequeue.
+ * will be called any time fr_trunk_request_enqueue is called, so there'll
+ * usually only be one command set to dequeue.
  *
+ * @param[in] el		Event list.  Unused.
  * @param[in] tconn		Trunk connection holding the commands to enqueue.
  * @param[in] conn		Connection handle containing the fr_redis_handle_t.
- * @param[in] uctx		fr_redis_cluster_t.  Unused.
+ * @param[in] uctx		fr_redis_trunk_t.  Unused.
  */
-static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+static void _redis_pipeline_mux(UNUSED fr_event_list_t *el,
+				fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
 {
 	fr_trunk_request_t	*treq;
 	fr_redis_command_set_t 	*cmds;
 	fr_redis_command_t	*cmd;
 	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
-	request_t			*request;
-
-	treq = fr_trunk_connection_pop_request(&request, (void *)&cmds, NULL, tconn);
-	while ((cmd = fr_dlist_head(&cmds->pending))) {
-		/*
-		 *	If this fails it probably means the connection
-		 *	is disconnecting, but if that's happening then
-		 *	we shouldn't be enqueueing new requests?
-		 */
-		if (unlikely(redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str) != REDIS_OK)) {
-			ROPTIONAL(ERROR, REDEBUG, "Unexpected error queueing REDIS command");
-
-			while ((cmd = fr_dlist_head(&cmds->sent))) {
-				fr_redis_connection_ignore_response(h, cmd->sqn);
-				fr_dlist_remove(&cmds->sent, cmd);
-				fr_dlist_insert_tail(&cmds->pending, cmd);
+	request_t		*request;
+
+	while (fr_trunk_connection_pop_request(&treq, tconn) == 0) {
+		bool failed = false;
+
+		cmds = talloc_get_type_abort(treq->preq, fr_redis_command_set_t);
+		request = treq->request;
+
+		while ((cmd = fr_dlist_head(&cmds->pending))) {
+			/*
+			 *	If this fails it probably means the connection
+			 *	is disconnecting, but if that's happening then
+			 *	we shouldn't be enqueueing new requests?
+			 */
+			if (unlikely(redisAsyncFormattedCommand(h->ac, _redis_pipeline_demux, cmd,
+								cmd->str, cmd->len) != REDIS_OK)) {
+				ROPTIONAL(REDEBUG, ERROR, "Unexpected error queueing REDIS command");
+
+				while ((cmd = fr_dlist_tail(&cmds->sent))) {
+					fr_redis_connection_ignore_response(h, cmd->sqn);
+					fr_dlist_remove(&cmds->sent, cmd);
+					fr_dlist_insert_head(&cmds->pending, cmd);
+				}
+				fr_trunk_request_signal_fail(treq);
+				failed = true;
+				break;
 			}
-			fr_trunk_request_signal_fail(treq);
-			return;
+			cmd->sqn = fr_redis_connection_sent_request(h);
+			fr_dlist_remove(&cmds->pending, cmd);
+			fr_dlist_insert_tail(&cmds->sent, cmd);
 		}
-		cmd->sqn = fr_redis_connection_sent_request(h);
-		fr_dlist_remove(&cmds->pending, cmd);
-		fr_dlist_insert_tail(&cmds->sent, cmd);
+		if (!failed) fr_trunk_request_signal_sent(treq);
 	}
-	fr_trunk_request_signal_sent(treq);
 }
 
 /** Deal with cancellation of sent requests
  *
- * We can't actually signal redis to not process the request, so depending
- * on why the commands were cancelled, we either tell the handle to ignore
- * them, or move them back into the pending list.
+ * We can't actually signal redis to not process the request, so we always
+ * tell the handle to ignore the responses.  Then depending on why the
+ * commands were cancelled, we either leave them to be freed, or move
+ * them back into the pending list, to be sent on another connection.
  */
-static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_trunk_request_t *treq, void *preq,
+static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, void *preq,
 					       fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
-	fr_redis_handle_t	*h = conn->h;
+	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
+	fr_redis_command_t	*cmd;
+
+	/*
+	 *	Any responses that arrive for these commands
+	 *	belong to a request, pctx and rctx that either
+	 *	no longer exist, or have moved elsewhere.
+	 */
+	for (cmd = fr_dlist_head(&cmds->sent);
+	     cmd;
+	     cmd = fr_dlist_next(&cmds->sent, cmd)) {
+		fr_redis_connection_ignore_response(h, cmd->sqn);
+	}
 
 	/*
 	 *	How we cancel is very different depending
@@ -531,39 +1285,22 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 	 */
 	switch (reason) {
 	/*
-	 *	Cancel is only called for requests that
-	 *	have been sent, and only when the connection
-	 *	is about to be closed for some reason.
-	 *
-	 *	We don't need to tell the handle to ignore
-	 *	the responses, we just need to get the
-	 *	command set back into the correct state for
-	 *	execution by another handle.
+	 *	The connection is going away, or the trunk wants
+	 *	to send the commands again.  Get the command set
+	 *	back into the correct state for execution by
+	 *	another handle.
 	 */
 	case FR_TRUNK_CANCEL_REASON_MOVE:
-		fr_dlist_move(&cmds->pending, &cmds->sent);
+	case FR_TRUNK_CANCEL_REASON_REQUEUE:
+		redis_command_set_reset(cmds);
 		return;
 
 	/*
-	 *	If the request was cancelled due to a signal
-	 *	we'll have a response coming back for a
-	 *	request, pctx and rctx that no longer exist.
-	 *	Tell the handle to signal that the response
-	 *	should be ignored when it's received.
-	 *
-	 *      Free will take care of cleaning up the
+	 *	Free will take care of cleaning up the
 	 *	pending commands.
 	 */
 	case FR_TRUNK_CANCEL_REASON_SIGNAL:
-	{
-		fr_redis_command_t	*cmd;
-
-		for (cmd = fr_dlist_head(&cmds->sent);
-		     cmd;
-		     cmd = fr_dlist_next(&cmds->sent, cmd)) {
-			fr_redis_connection_ignore_response(h, cmd->sqn);
-		}
-	}
+		return;
 
 	case FR_TRUNK_CANCEL_REASON_NONE:
 		fr_assert(0);
@@ -579,6 +1316,8 @@ static void _redis_pipeline_command_set_complete(UNUSED request_t *request, void
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
+	if (cmds->redirecting) return;	/* Being moved to another trunk */
+
 	if (cmds->complete) cmds->complete(cmds->request, &cmds->completed, cmds->rctx);
 }
 
@@ -586,10 +1325,18 @@ static void _redis_pipeline_command_set_complete(UNUSED request_t *request, void
  *
  */
 static void _redis_pipeline_command_set_fail(UNUSED request_t *request, void *preq,
-					     UNUSED void *rctx, UNUSED void *uctx)
+					     UNUSED void *rctx, UNUSED fr_trunk_request_state_t state,
+					     UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
+	/*
+	 *	Connections to the node failed, or it didn't
+	 *	answer in time.  It may no longer be serving
+	 *	the key slot.
+	 */
+	redis_command_set_slot_invalidate(cmds);
+
 	if (cmds->fail) cmds->fail(cmds->request, &cmds->completed, cmds->rctx);
 }
 
@@ -601,6 +1348,15 @@ static void _redis_pipeline_command_set_free(UNUSED request_t *request, void *pr
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
+	/*
+	 *	Being moved to another trunk, the
+	 *	old trunk request is no longer valid.
+	 */
+	if (cmds->redirecting) {
+		cmds->treq = NULL;
+		return;
+	}
+
 	talloc_free(cmds);
 }
 
@@ -627,6 +1383,7 @@ fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread
 
 	MEM(rtrunk = talloc_zero(cluster_thread, fr_redis_trunk_t));
 	rtrunk->io_conf = io_conf;
+	rtrunk->cluster = cluster_thread;
 	rtrunk->trunk = fr_trunk_alloc(rtrunk, cluster_thread->el,
 				       &io_funcs, cluster_thread->tconf, cluster_thread->log_prefix, rtrunk,
 				       cluster_thread->delay_start);
@@ -638,13 +1395,46 @@ fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread
 	return rtrunk;
 }
 
+static int _redis_trunk_cmp(void const *one, void const *two)
+{
+	fr_redis_trunk_t const	*a = one, *b = two;
+	int			ret;
+
+	ret = fr_ipaddr_cmp(&a->addr.inet.dst_ipaddr, &b->addr.inet.dst_ipaddr);
+	if (ret != 0) return ret;
+
+	return (a->addr.inet.dst_port > b->addr.inet.dst_port) - (a->addr.inet.dst_port < b->addr.inet.dst_port);
+}
+
+/** Free this thread's command set free list with its last cluster thread
+ *
+ * Runs before the trunks are freed, so the command sets they still hold
+ * are freed outright.
+ */
+static int _redis_cluster_thread_free(UNUSED fr_redis_cluster_thread_t *cluster_thread)
+{
+	if (--cluster_thread_count == 0) command_set_free_list_free();
+
+	return 0;
+}
+
 /** Allocate per-thread, per-cluster instance
  *
  * This structure represents all the connections for a given thread for a given cluster.
  * The structures holds the trunk connections to talk to each cluster member.
  *
+ * @param[in] ctx	to allocate the cluster thread in.
+ * @param[in] el	to run the connections in.
+ * @param[in] tconf	Trunk configuration, used for the trunk to each node.
+ * @param[in] cluster	Shared cluster state, used to resolve keys to nodes.
+ *			May be NULL if trunks will be allocated explicitly.
+ * @param[in] conf	Redis configuration.  Provides the database, password and
+ *			redirect limits for the trunks to each node.  May be NULL.
+ * @return A new cluster thread.
  */
-fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, fr_trunk_conf_t const *tconf)
+fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+							 fr_trunk_conf_t const *tconf,
+							 fr_redis_cluster_t *cluster, fr_redis_conf_t const *conf)
 {
 	fr_redis_cluster_thread_t *cluster_thread;
 	fr_trunk_conf_t *our_tconf;
@@ -655,8 +1445,16 @@ fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_eve
 
 	cluster_thread->el = el;
 	cluster_thread->tconf = our_tconf;
+	cluster_thread->cluster = cluster;
+	cluster_thread->conf = conf;
+	if (conf && conf->log_prefix) cluster_thread->log_prefix = talloc_typed_strdup(cluster_thread, conf->log_prefix);
 
-	return cluster_thread;
-}
+	MEM(cluster_thread->trunks = rbtree_alloc(cluster_thread, _redis_trunk_cmp, NULL, RBTREE_FLAG_NONE));
+	MEM(cluster_thread->slot = talloc_zero_array(cluster_thread, fr_redis_trunk_t *, FR_REDIS_CLUSTER_KEY_SLOTS));
+	MEM(cluster_thread->slot_unknown = talloc_zero_array(cluster_thread, bool, FR_REDIS_CLUSTER_KEY_SLOTS));
 
+	cluster_thread_count++;
+	talloc_set_destructor(cluster_thread, _redis_cluster_thread_free);
 
+	return cluster_thread;
+}
@@ -1,5 +1,5 @@
 /*
- *  cc  -g3 -Wall -DHAVE_DLFCN_H -I../../../src -include freeradius-devel/build.h -L../../../build/lib/local/.libs -ltalloc -lhiredis -lfreeradius-unlang -lfreeradius-util -lfreeradius-server -o test_redis test.c redis.c io.c crc16.c
+ *  cc  -g3 -Wall -DHAVE_DLFCN_H -I../../../src -include freeradius-devel/build.h -L../../../build/lib/local/.libs -ltalloc -lhiredis -lfreeradius-unlang -lfreeradius-util -lfreeradius-server -o test_redis test.c redis.c io.c pipeline.c cluster.c crc16.c
  */
 #include <freeradius-devel/util/acutest.h>
 #include "base.h"
@@ -64,10 +64,11 @@ static void test_basic_connection(void)
 	 *	Enqueue 10 set commands
 	 */
 	for (i = 0; i < 1000000; i++) {
-		TEST_CHECK(fr_redis_command_preformatted_add(cmds, "PING", sizeof("PING") - 1) == FR_REDIS_PIPELINE_OK);
+		TEST_CHECK(fr_redis_command_preformatted_add(cmds, "*1\r\n$4\r\nPING\r\n",
+							     sizeof("*1\r\n$4\r\nPING\r\n") - 1) == FR_REDIS_PIPELINE_OK);
 	}
 
-	cluster_thread = fr_redis_cluster_thread_alloc(ctx, el, &trunk_conf);
+	cluster_thread = fr_redis_cluster_thread_alloc(ctx, el, &trunk_conf, NULL, NULL);
 	rtrunk = fr_redis_trunk_alloc(cluster_thread,  &(fr_redis_io_conf_t){ .hostname = "127.0.0.1", .port = 30001 });
 
 	stats.enqueued = 1000000;
@@ -875,6 +875,9 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *serv
 	}
 #endif
 
+	if (c->secret) MEM(c->secret_key = fr_md5_key_alloc(c, (uint8_t const *) c->secret,
+							   talloc_array_length(c->secret) - 1));
+
 	if ((c->proto == IPPROTO_TCP) || (c->proto == IPPROTO_IP)) {
 		if ((c->limit.idle_timeout > 0) && (c->limit.idle_timeout < 5))
 			c->limit.idle_timeout = 5;
@@ -924,6 +927,7 @@ RADCLIENT *client_afrom_query(TALLOC_CTX *ctx, char const *identifier, char cons
 	 *	Other values (secret, shortname, nas_type, virtual_server)
 	 */
 	c->secret = talloc_typed_strdup(c, secret);
+	MEM(c->secret_key = fr_md5_key_alloc(c, (uint8_t const *) c->secret, talloc_array_length(c->secret) - 1));
 	if (shortname) c->shortname = talloc_typed_strdup(c, shortname);
 	if (type) c->nas_type = talloc_typed_strdup(c, type);
 	if (server) c->server = talloc_typed_strdup(c, server);
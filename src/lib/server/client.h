@@ -70,6 +70,7 @@ typedef int (*client_value_cb_t)(char **out, CONF_PAIR const *cp, void *data);
 #include <freeradius-devel/server/socket.h>
 #include <freeradius-devel/server/stats.h>
 #include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/md5.h>
 
 /** Describes a host allowed to send packets to the server
  *
@@ -83,6 +84,8 @@ struct rad_client {
 	char const		*shortname;		//!< Client nickname.
 
 	char const		*secret;		//!< Secret PSK.
+	fr_md5_key_t const	*secret_key;		//!< MD5 states precomputed from the secret,
+							///< so they're not recalculated for every packet.
 
 	bool			message_authenticator;	//!< Require RADIUS message authenticator in requests.
 	bool			dynamic;		//!< Whether the client was dynamically defined.
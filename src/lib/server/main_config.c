@@ -142,6 +142,9 @@ static const CONF_PARSER log_config[] = {
 	{ FR_CONF_OFFSET("line_number", FR_TYPE_BOOL, main_config_t, log_line_number) },
 	{ FR_CONF_OFFSET("timestamp", FR_TYPE_BOOL, main_config_t, log_timestamp) },
 	{ FR_CONF_OFFSET("use_utc", FR_TYPE_BOOL, main_config_t, log_dates_utc) },
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, main_config_t, log_async), .dflt = "no" },
+	{ FR_CONF_OFFSET("async_queue_size", FR_TYPE_UINT32, main_config_t, log_async_queue_size), .dflt = "16384" },
+	{ FR_CONF_OFFSET("async_full", FR_TYPE_STRING, main_config_t, log_async_full), .dflt = "drop" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -164,6 +167,12 @@ static const CONF_PARSER thread_config[] = {
 	{ FR_CONF_OFFSET("num_workers", FR_TYPE_UINT32, main_config_t, max_workers), .dflt = STRINGIFY(4),
 	  .func = num_workers_parse },
 
+	{ FR_CONF_OFFSET("per_core", FR_TYPE_BOOL, main_config_t, per_core), .dflt = "no" },
+	{ FR_CONF_OFFSET("pin_threads", FR_TYPE_BOOL, main_config_t, pin_threads), .dflt = "no" },
+	{ FR_CONF_OFFSET("network_cpus", FR_TYPE_STRING, main_config_t, network_cpus) },
+	{ FR_CONF_OFFSET("worker_cpus", FR_TYPE_STRING, main_config_t, worker_cpus) },
+	{ FR_CONF_OFFSET("work_stealing", FR_TYPE_BOOL, main_config_t, work_stealing), .dflt = "no" },
+
 	{ FR_CONF_OFFSET("stats_interval | FR_TYPE_HIDDEN", FR_TYPE_TIME_DELTA, main_config_t, stats_interval), },
 
 	CONF_PARSER_TERMINATOR
@@ -436,7 +445,8 @@ static int num_networks_parse(TALLOC_CTX *ctx, void *out, void *parent,
 
 	memcpy(&value, out, sizeof(value));
 
-	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, ==, 1);
+	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, >=, 1);
+	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, <=, 64);
 
 	memcpy(out, &value, sizeof(value));
 
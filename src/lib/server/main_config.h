@@ -90,6 +90,10 @@ struct main_config_s {
 
 	int32_t		syslog_facility;
 
+	bool		log_async;			//!< Write log messages from a dedicated thread.
+	uint32_t	log_async_queue_size;		//!< Maximum number of messages waiting to be written.
+	char const	*log_async_full;		//!< What to do when the queue is full.
+
 	char const	*dict_dir;			//!< Where to load dictionaries from.
 
 	size_t		talloc_pool_size;		//!< Size of pool to allocate to hold each #request_t.
@@ -137,6 +141,11 @@ struct main_config_s {
 							//!< Only applicable in single threaded mode.
 	uint32_t	max_networks;			//!< for the scheduler
 	uint32_t	max_workers;			//!< for the scheduler
+	bool		per_core;			//!< for the scheduler
+	bool		pin_threads;			//!< for the scheduler
+	char const	*network_cpus;			//!< for the scheduler
+	char const	*worker_cpus;			//!< for the scheduler
+	bool		work_stealing;			//!< for the scheduler
 	fr_time_delta_t	stats_interval;			//!< for the scheduler
 
 };
@@ -51,15 +51,23 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 /** Holds a state value, and associated fr_pair_ts and data
  *
  */
 typedef struct {
 	uint64_t		id;				//!< State number within state tree.
+	uint32_t		hash;				//!< Hash of the state value.  Picks the shard.
 	union {
 		/** Server ID components
 		 *
@@ -99,7 +107,7 @@ typedef struct {
 
 	uint64_t		seq_start;			//!< Number of first request in this sequence.
 	time_t			cleanup;			//!< When this entry should be cleaned up.
-	fr_dlist_t		list;				//!< Entry in the list of things to expire.
+	fr_dlist_t		list;				//!< Entry in the shard's list of things to expire.
 
 	int			tries;
 
@@ -112,28 +120,58 @@ typedef struct {
 	request_t			*thawed;			//!< The request that thawed this entry.
 } fr_state_entry_t;
 
-struct fr_state_tree_s {
-	uint64_t		id;				//!< Next ID to assign.
-	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
+/** A single shard of the state tree
+ *
+ * Entries are assigned to a shard by the hash of their State value.
+ * Each round of a conversation gets a new State value, so consecutive
+ * rounds usually use different shards, and different conversations
+ * rarely contend for the same lock.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	fr_hash_table_t		*ht;				//!< Hash table used to lookup state value.
+	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
+
+	atomic_uint_fast64_t	timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
+	atomic_uint_fast64_t	contended;			//!< Number of times the mutex was already held
+								//!< when we tried to take it.
+} fr_state_shard_t;
+
+struct fr_state_tree_s {
+	atomic_uint_fast64_t	id;				//!< Next ID to assign.
+	atomic_uint_fast32_t	num_entries;			//!< Number of entries across all shards.
 	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
-	rbtree_t		*tree;				//!< rbtree used to lookup state value.
-	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
+
+	uint32_t		num_shards;			//!< Number of initialised shards.
+	fr_state_shard_t	*shards;			//!< Array of shards.
 
 	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
 
-	bool			thread_safe;			//!< Whether we lock the tree whilst modifying it.
-	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	bool			thread_safe;			//!< Whether we lock the shards whilst modifying them.
 
 	uint8_t			server_id;			//!< ID to use for load balancing.
 
 	fr_dict_attr_t const	*da;				//!< State attribute used.
+
+	char const		*server;			//!< Virtual server, for radmin statistics.
 };
 
-#define PTHREAD_MUTEX_LOCK if (state->thread_safe) pthread_mutex_lock
-#define PTHREAD_MUTEX_UNLOCK if (state->thread_safe) pthread_mutex_unlock
+/*
+ *	Number of shards to use when the tree is shared between threads.
+ *	Enough that workers rarely wait for each other, without wasting
+ *	memory on empty hash tables.
+ */
+#define STATE_SHARDS	64
+
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry);
+
+static uint32_t state_entry_hash(void const *data)
+{
+	fr_state_entry_t const *entry = data;
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+	return entry->hash;
+}
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -145,27 +183,62 @@ static int state_entry_cmp(void const *one, void const *two)
 	return memcmp(a->state, b->state, sizeof(a->state));
 }
 
+/** Pick the shard for a state value
+ *
+ * The hash tables use the low bits of the hash for their buckets, so
+ * we use the high bits to pick the shard.
+ */
+static inline CC_HINT(always_inline) fr_state_shard_t *state_shard(fr_state_tree_t const *state, uint32_t hash)
+{
+	return &state->shards[((uint64_t) hash * state->num_shards) >> 32];
+}
+
+/** Lock a shard, recording whether we had to wait for it
+ *
+ */
+static inline CC_HINT(always_inline) void state_shard_lock(fr_state_tree_t *state, fr_state_shard_t *shard)
+{
+	if (!state->thread_safe) return;
+
+	if (pthread_mutex_trylock(&shard->mutex) == 0) return;
+
+	atomic_fetch_add_explicit(&shard->contended, 1, memory_order_relaxed);
+	pthread_mutex_lock(&shard->mutex);
+}
+
+static inline CC_HINT(always_inline) void state_shard_unlock(fr_state_tree_t *state, fr_state_shard_t *shard)
+{
+	if (!state->thread_safe) return;
+
+	pthread_mutex_unlock(&shard->mutex);
+}
+
 /** Free the state tree
  *
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
-	fr_state_entry_t *entry;
-
-	if (state->thread_safe) pthread_mutex_destroy(&state->mutex);
+	fr_state_entry_t	*entry;
+	uint32_t		i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while ((entry = fr_dlist_head(&state->to_expire))) {
-		DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
-		state_entry_unlink(state, entry);
-		talloc_free(entry);
-	}
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
 
-	/*
-	 *	Free the rbtree
-	 */
-	talloc_free(state->tree);
+		while ((entry = fr_dlist_head(&shard->to_expire))) {
+			DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
+			state_entry_unlink(state, shard, entry);
+			talloc_free(entry);
+		}
+
+		/*
+		 *	Free the hash table
+		 */
+		talloc_free(shard->ht);
+
+		if (state->thread_safe) pthread_mutex_destroy(&shard->mutex);
+	}
 
 	return 0;
 }
@@ -186,12 +259,14 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 				    uint32_t max_sessions, uint32_t timeout, uint8_t server_id)
 {
 	fr_state_tree_t *state;
+	uint32_t	i, num_shards;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
 
 	state->max_sessions = max_sessions;
 	state->timeout = timeout;
+	state->thread_safe = thread_safe;
 
 	/*
 	 *	Create a break in the contexts.
@@ -202,46 +277,70 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 	 */
 	talloc_link_ctx(ctx, state);
 
-	if (thread_safe && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
+	/*
+	 *	Without threads there's no contention, so one
+	 *	shard is enough.
+	 */
+	num_shards = thread_safe ? STATE_SHARDS : 1;
+
+	state->shards = talloc_zero_array(state, fr_state_shard_t, num_shards);
+	if (!state->shards) {
 		talloc_free(state);
 		return NULL;
 	}
-
-	fr_dlist_talloc_init(&state->to_expire, fr_state_entry_t, list);
+	talloc_set_destructor(state, _state_tree_free);
 
 	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
+	 *	num_shards counts the shards which have been
+	 *	initialised, so the destructor only cleans up those.
 	 */
-	state->tree = rbtree_talloc_alloc(NULL, state_entry_cmp, fr_state_entry_t, NULL, 0);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+	for (i = 0; i < num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
+
+		fr_dlist_talloc_init(&shard->to_expire, fr_state_entry_t, list);
+
+		/*
+		 *	We need to do controlled freeing of the
+		 *	hash table, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->ht = fr_hash_table_create(NULL, state_entry_hash, state_entry_cmp, NULL);
+		if (!shard->ht) {
+			talloc_free(state);
+			return NULL;
+		}
+
+		if (thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(shard->ht);
+			talloc_free(state);
+			return NULL;
+		}
+
+		state->num_shards++;
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	state->da = da;		/* Remember which attribute we use to load/store state */
 	state->server_id = server_id;
-	state->thread_safe = thread_safe;
 
 	return state;
 }
 
 /** Unlink an entry and remove if from the tree
  *
+ * @note Called with the shard's mutex held.
  */
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry)
 {
 	/*
 	 *	Check the memory is still valid
 	 */
 	(void) talloc_get_type_abort(entry, fr_state_entry_t);
 
-	fr_dlist_remove(&state->to_expire, entry);
+	fr_dlist_remove(&shard->to_expire, entry);
 
-	rbtree_deletebydata(state->tree, entry);
+	fr_hash_table_yank(shard->ht, entry);
+	atomic_fetch_sub_explicit(&state->num_entries, 1, memory_order_relaxed);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
@@ -284,119 +383,125 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	return 0;
 }
 
-/** Create a new state entry
+/** Unlink timed out entries from a shard
+ *
+ * The entries are added to a list, so that they can be freed once the
+ * mutex has been released.
+ *
+ * @note Called with the shard's mutex held.
  *
- * @note Called with the mutex held.
+ * @param[in] state	tree the shard belongs to.
+ * @param[in] shard	to clean up.
+ * @param[out] to_free	where to put the entries which have timed out.
+ * @param[in] now	the current time.
+ * @return the number of entries which timed out.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *request,
-					    fr_radius_packet_t *packet, fr_state_entry_t *old)
+static uint64_t state_shard_expire(fr_state_tree_t *state, fr_state_shard_t *shard,
+				   fr_dlist_head_t *to_free, time_t now)
 {
-	size_t			i;
-	uint32_t		x;
-	time_t			now = time(NULL);
-	fr_pair_t		*vp;
 	fr_state_entry_t	*entry, *next;
-
-	uint8_t			old_state[sizeof(old->state)];
-	int			old_tries = 0;
 	uint64_t		timed_out = 0;
-	bool			too_many = false;
-	fr_dlist_head_t		to_free;
-
-	fr_dlist_init(&to_free, fr_state_entry_t, list);
 
-	/*
-	 *	Clean up old entries.
-	 */
-	for (entry = fr_dlist_head(&state->to_expire);
+	for (entry = fr_dlist_head(&shard->to_expire);
 	     entry != NULL;
 	     entry = next) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
-		next = fr_dlist_next(&state->to_expire, entry);		/* Advance *before* potential unlinking */
-
-		if (entry == old) continue;
+		next = fr_dlist_next(&shard->to_expire, entry);		/* Advance *before* potential unlinking */
 
 		/*
-		 *	Too old, we can delete it.
+		 *	The list is ordered by cleanup time, so
+		 *	everything after this is newer.
 		 */
-		if (entry->cleanup < now) {
-			state_entry_unlink(state, entry);
-			fr_dlist_insert_tail(&to_free, entry);
-			timed_out++;
-			continue;
-		}
+		if (entry->cleanup >= now) break;
 
-		break;
+		state_entry_unlink(state, shard, entry);
+		fr_dlist_insert_tail(to_free, entry);
+		timed_out++;
 	}
 
-	state->timed_out += timed_out;
+	if (timed_out > 0) atomic_fetch_add_explicit(&shard->timed_out, timed_out, memory_order_relaxed);
 
-	if (!old && (rbtree_num_elements(state->tree) >= (uint32_t) state->max_sessions)) too_many = true;
+	return timed_out;
+}
 
-	/*
-	 *	Record the information from the old state, we may base the
-	 *	new state off the old one.
-	 *
-	 *	Once we release the mutex, the state of old becomes indeterminate
-	 *	so we have to grab the values now.
-	 */
-	if (old) {
-		old_tries = old->tries;
+/** Free entries which have been unlinked from the tree
+ *
+ * We do it without the mutex held, as freeing may involve significantly
+ * more work than just freeing the data.
+ *
+ * If there's request data that was persisted it will now be freed also,
+ * and it may have complex destructors associated with it.
+ */
+static void state_entries_free(fr_dlist_head_t *to_free)
+{
+	fr_state_entry_t *entry;
 
-		memcpy(old_state, old->state, sizeof(old_state));
+	while ((entry = fr_dlist_pop_head(to_free)) != NULL) talloc_free(entry);
+}
 
-		/*
-		 *	The old one isn't used any more, so we can free it.
-		 */
-		if (fr_dlist_empty(&old->data)) {
-			state_entry_unlink(state, old);
-			fr_dlist_insert_tail(&to_free, old);
-		}
+/** Clean up timed out entries in every shard
+ *
+ * Shards are normally cleaned when a new entry is inserted into them.
+ * When we're at the session limit, the entries in the other shards
+ * need to be cleaned too, before we can decide that there's no room.
+ */
+static void state_expire_all(fr_state_tree_t *state, request_t *request)
+{
+	fr_dlist_head_t		to_free;
+	uint64_t		timed_out = 0;
+	time_t			now = time(NULL);
+	uint32_t		i;
+
+	fr_dlist_init(&to_free, fr_state_entry_t, list);
+
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
+
+		state_shard_lock(state, shard);
+		timed_out += state_shard_expire(state, shard, &to_free, now);
+		state_shard_unlock(state, shard);
 	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
 
 	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
 
-	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
-	 */
-	while ((entry = fr_dlist_head(&to_free)) != NULL) {
-		fr_dlist_remove(&to_free, entry);
-		talloc_free(entry);
-	}
+	state_entries_free(&to_free);
+}
 
-	/*
-	 *	Have to do this post-cleanup, else we end up returning with
-	 *	a list full of entries to free with none of them being
-	 *	freed which is bad...
-	 */
-	if (too_many) {
-		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
-		       state->max_sessions);
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+/** Create a new state entry
+ *
+ * The entry is not inserted into the tree.  That's done by
+ * #state_entry_insert, once the caller has filled it in.
+ *
+ * @note Called with no mutexes held.
+ *
+ * @param[in] state	tree the entry will be inserted into.
+ * @param[in] request	the entry is being created for.
+ * @param[in] packet	to add the State attribute to.
+ * @param[in] old_state	value of the entry for the previous round, or NULL.
+ * @param[in] old_tries	how many rounds the previous entry had.
+ * @return
+ *	- A new state entry.
+ *	- NULL on failure.
+ */
+static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *request,
+					    fr_radius_packet_t *packet, uint8_t const *old_state, int old_tries)
+{
+	size_t			i;
+	uint32_t		x;
+	time_t			now = time(NULL);
+	fr_pair_t		*vp;
+	fr_state_entry_t	*entry;
 
 	/*
 	 *	Allocation doesn't need to occur inside the critical region
 	 *	and would add significantly to contention.
 	 */
 	entry = talloc_zero(NULL, fr_state_entry_t);
-	if (!entry) {
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+	if (!entry) return NULL;
 
 	request_data_list_init(&entry->data);
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
+	entry->id = atomic_fetch_add_explicit(&state->id, 1, memory_order_relaxed);
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -445,7 +550,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 		 *	16 octets of randomness should be enough to
 		 *	have a globally unique state.
 		 */
-		if (old) {
+		if (old_state) {
 			memcpy(entry->state, old_state, sizeof(entry->state));
 			entry->tries = old_tries + 1;
 		/*
@@ -483,8 +588,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	DEBUG4("State ID %" PRIu64 " created, value 0x%pH, expires %" PRIu64 "s",
 	       entry->id, fr_box_octets(entry->state, sizeof(entry->state)), (uint64_t)entry->cleanup - now);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -493,57 +596,105 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	 */
 	*((uint32_t *)(&entry->state_comp.server_hash)) ^= fr_hash_string(cf_section_name2(request->server_cs));
 
-	if (!rbtree_insert(state->tree, entry)) {
-		RERROR("Failed inserting state entry - Insertion into state tree failed");
-		fr_pair_delete_by_da(&packet->vps, state->da);
-		talloc_free(entry);
-		return NULL;
-	}
+	entry->hash = fr_hash(entry->state, sizeof(entry->state));
+
+	return entry;
+}
+
+/** Insert a new state entry into its shard
+ *
+ * Timed out entries in the same shard are cleaned up at the same time.
+ *
+ * @note Called with no mutexes held.
+ */
+static int state_entry_insert(fr_state_tree_t *state, request_t *request, fr_state_entry_t *entry)
+{
+	fr_state_shard_t	*shard = state_shard(state, entry->hash);
+	fr_dlist_head_t		to_free;
+	uint64_t		timed_out;
+	int			ret = 0;
+
+	fr_dlist_init(&to_free, fr_state_entry_t, list);
+
+	state_shard_lock(state, shard);
 
 	/*
-	 *	Link it to the end of the list, which is implicitely
-	 *	ordered by cleanup time.
+	 *	Clean up old entries.
 	 */
-	fr_dlist_insert_tail(&state->to_expire, entry);
+	timed_out = state_shard_expire(state, shard, &to_free, time(NULL));
 
-	return entry;
+	if (!fr_hash_table_insert(shard->ht, entry)) {
+		ret = -1;
+	} else {
+		/*
+		 *	Link it to the end of the list, which is implicitely
+		 *	ordered by cleanup time.
+		 */
+		fr_dlist_insert_tail(&shard->to_expire, entry);
+		atomic_fetch_add_explicit(&state->num_entries, 1, memory_order_relaxed);
+	}
+
+	state_shard_unlock(state, shard);
+
+	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
+
+	state_entries_free(&to_free);
+
+	return ret;
 }
 
-/** Find the entry, based on the State attribute
+/** Build a key for looking up a state entry, based on the State attribute
  *
+ * @param[out] key	to populate with the state value, and its hash.
+ * @param[in] state	tree to lookup the entry in.
+ * @param[in] request	the State attribute was received in.
+ * @param[in] vb	value of the State attribute.
+ * @return the shard the entry would be in.
  */
-static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, request_t *request, fr_value_box_t const *vb)
+static fr_state_shard_t *state_entry_key(fr_state_entry_t *key, fr_state_tree_t *state,
+					 request_t *request, fr_value_box_t const *vb)
 {
-	fr_state_entry_t *entry, my_entry;
-
 	/*
 	 *	Assume our own State first.
 	 */
-	if (vb->vb_length == sizeof(my_entry.state)) {
-		memcpy(my_entry.state, vb->vb_octets, sizeof(my_entry.state));
+	if (vb->vb_length == sizeof(key->state)) {
+		memcpy(key->state, vb->vb_octets, sizeof(key->state));
 
 		/*
 		 *	Too big?  Get the MD5 hash, in order
 		 *	to depend on the entire contents of State.
 		 */
-	} else if (vb->vb_length > sizeof(my_entry.state)) {
-		fr_md5_calc(my_entry.state, vb->vb_octets, vb->vb_length);
+	} else if (vb->vb_length > sizeof(key->state)) {
+		fr_md5_calc(key->state, vb->vb_octets, vb->vb_length);
 
 		/*
 		 *	Too small?  Use the whole thing, and
 		 *	set the rest of my_entry.state to zero.
 		 */
 	} else {
-		memcpy(my_entry.state, vb->vb_octets, vb->vb_length);
-		memset(&my_entry.state[vb->vb_length], 0, sizeof(my_entry.state) - vb->vb_length);
+		memcpy(key->state, vb->vb_octets, vb->vb_length);
+		memset(&key->state[vb->vb_length], 0, sizeof(key->state) - vb->vb_length);
 	}
 
 	/*
 	 *	Make it unique for different virtual servers handling the same request
 	 */
-	my_entry.state_comp.server_hash ^= fr_hash_string(cf_section_name2(request->server_cs));
+	key->state_comp.server_hash ^= fr_hash_string(cf_section_name2(request->server_cs));
+
+	key->hash = fr_hash(key->state, sizeof(key->state));
+
+	return state_shard(state, key->hash);
+}
+
+/** Find the entry, based on the key built by #state_entry_key
+ *
+ * @note Called with the shard's mutex held.
+ */
+static fr_state_entry_t *state_entry_find(fr_state_shard_t *shard, fr_state_entry_t const *key)
+{
+	fr_state_entry_t *entry;
 
-	entry = rbtree_finddata(state->tree, &my_entry);
+	entry = fr_hash_table_find_by_data(shard->ht, key);
 
 	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
 
@@ -555,20 +706,23 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, request_t *req
  */
 void fr_state_discard(fr_state_tree_t *state, request_t *request)
 {
-	fr_state_entry_t	*entry;
+	fr_state_entry_t	*entry, my_entry;
+	fr_state_shard_t	*shard;
 	fr_pair_t		*vp;
 
 	vp = fr_pair_find_by_da(&request->request_pairs, state->da);
 	if (!vp) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, &vp->data);
+	shard = state_entry_key(&my_entry, state, request, &vp->data);
+
+	state_shard_lock(state, shard);
+	entry = state_entry_find(shard, &my_entry);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		state_shard_unlock(state, shard);
 		return;
 	}
-	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_entry_unlink(state, shard, entry);
+	state_shard_unlock(state, shard);
 
 	/*
 	 *	If fr_state_to_request was never called, this ensures
@@ -605,7 +759,8 @@ void fr_state_discard(fr_state_tree_t *state, request_t *request)
  */
 void fr_state_to_request(fr_state_tree_t *state, request_t *request)
 {
-	fr_state_entry_t	*entry;
+	fr_state_entry_t	*entry, my_entry;
+	fr_state_shard_t	*shard;
 	TALLOC_CTX		*old_ctx = NULL;
 	fr_pair_t		*vp;
 
@@ -621,13 +776,15 @@ void fr_state_to_request(fr_state_tree_t *state, request_t *request)
 		return;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, &vp->data);
+	shard = state_entry_key(&my_entry, state, request, &vp->data);
+
+	state_shard_lock(state, shard);
+	entry = state_entry_find(shard, &my_entry);
 	if (entry) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);
 		if (entry->thawed) {
 			REDEBUG("State entry has already been thawed by a request %"PRIu64, entry->thawed->number);
-			PTHREAD_MUTEX_UNLOCK(&state->mutex);
+			state_shard_unlock(state, shard);
 			return;
 		}
 		if (request->state_ctx) old_ctx = request->state_ctx;	/* Store for later freeing */
@@ -643,7 +800,7 @@ void fr_state_to_request(fr_state_tree_t *state, request_t *request)
 		entry->vps = NULL;
 		entry->thawed = request;
 	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_shard_unlock(state, shard);
 
 	if (request->state) {
 		RDEBUG2("Restored &session-state");
@@ -675,6 +832,10 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 	fr_dlist_head_t		data;
 	fr_pair_t		*vp;
 
+	uint8_t			old_state[sizeof(entry->state)];
+	int			old_tries = 0;
+	bool			have_old = false;
+
 	request_data_list_init(&data);
 	request_data_by_persistance(&data, request, true);
 
@@ -686,19 +847,60 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 	}
 
 	vp = fr_pair_find_by_da(&request->request_pairs, state->da);
+	if (vp) {
+		fr_state_entry_t	my_entry;
+		fr_state_shard_t	*shard;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	if (vp) old = state_entry_find(state, request, &vp->data);
+		shard = state_entry_key(&my_entry, state, request, &vp->data);
 
-	entry = state_entry_create(state, request, request->reply, old);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
-		RERROR("Creating state entry failed");
-		request_data_restore(request, &data);	/* Put it back again */
-		return -1;
+		state_shard_lock(state, shard);
+		old = state_entry_find(shard, &my_entry);
+		if (old) {
+			/*
+			 *	Record the information from the old state, we may
+			 *	base the new state off the old one.
+			 *
+			 *	Once we release the mutex, the state of old becomes
+			 *	indeterminate so we have to grab the values now.
+			 */
+			old_tries = old->tries;
+			memcpy(old_state, old->state, sizeof(old_state));
+			have_old = true;
+
+			/*
+			 *	The old one isn't used any more, so we can free it.
+			 */
+			if (fr_dlist_empty(&old->data)) {
+				state_entry_unlink(state, shard, old);
+			} else {
+				old = NULL;
+			}
+		}
+		state_shard_unlock(state, shard);
+
+		talloc_free(old);
 	}
 
-	fr_assert(entry->ctx == NULL);
+	/*
+	 *	Other shards may be holding entries which have timed
+	 *	out, but which haven't been cleaned up yet.
+	 */
+	if (!have_old && (atomic_load_explicit(&state->num_entries, memory_order_relaxed) >= state->max_sessions)) {
+		state_expire_all(state, request);
+
+		if (atomic_load_explicit(&state->num_entries, memory_order_relaxed) >= state->max_sessions) {
+			RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
+			       state->max_sessions);
+		fail:
+			RERROR("Creating state entry failed");
+			request_data_restore(request, &data);	/* Put it back again */
+			return -1;
+		}
+	}
+
+	entry = state_entry_create(state, request, request->reply, have_old ? old_state : NULL, old_tries);
+	if (!entry) goto fail;
+
 	fr_assert(request->state_ctx);
 
 	entry->seq_start = request->seq_start;
@@ -706,11 +908,20 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 	entry->vps = request->state;
 	fr_dlist_move(&entry->data, &data);
 
+	if (state_entry_insert(state, request, entry) < 0) {
+		RERROR("Failed inserting state entry - Insertion into state tree failed");
+		fr_pair_delete_by_da(&request->reply->vps, state->da);
+
+		fr_dlist_move(&data, &entry->data);
+		entry->ctx = NULL;
+		entry->vps = NULL;
+		talloc_free(entry);
+		goto fail;
+	}
+
 	request->state_ctx = NULL;
 	request->state_pairs = NULL;
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
-
 	RDEBUG3("%s - saved", state->da->name);
 	REQUEST_VERIFY(request);
 
@@ -850,7 +1061,7 @@ void fr_state_detach(request_t *request, bool will_free)
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	return atomic_load_explicit(&state->id, memory_order_relaxed);
 }
 
 /** Return number of entries that timed out
@@ -858,7 +1069,14 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	uint64_t	timed_out = 0;
+	uint32_t	i;
+
+	for (i = 0; i < state->num_shards; i++) {
+		timed_out += atomic_load_explicit(&state->shards[i].timed_out, memory_order_relaxed);
+	}
+
+	return timed_out;
 }
 
 /** Return number of entries we're currently tracking
@@ -866,5 +1084,83 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return (uint32_t)rbtree_num_elements(state->tree);
+	return atomic_load_explicit(&state->num_entries, memory_order_relaxed);
+}
+
+/** Return number of times a thread had to wait for another to release a shard
+ *
+ * If this is a significant fraction of #fr_state_entries_created, the
+ * shards are too busy.
+ */
+uint64_t fr_state_lock_contended(fr_state_tree_t *state)
+{
+	uint64_t	contended = 0;
+	uint32_t	i;
+
+	for (i = 0; i < state->num_shards; i++) {
+		contended += atomic_load_explicit(&state->shards[i].contended, memory_order_relaxed);
+	}
+
+	return contended;
+}
+
+static int cmd_stats_state(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_state_tree_t *state = talloc_get_type_abort(ctx, fr_state_tree_t);
+
+	if (state->server) fprintf(fp, "server\t%s\n", state->server);
+	fprintf(fp, "entries\t%u\n", fr_state_entries_tracked(state));
+	fprintf(fp, "max_sessions\t%u\n", state->max_sessions);
+	fprintf(fp, "shards\t%u\n", state->num_shards);
+	fprintf(fp, "count.created\t%" PRIu64 "\n", fr_state_entries_created(state));
+	fprintf(fp, "count.timeout\t%" PRIu64 "\n", fr_state_entries_timeout(state));
+	fprintf(fp, "count.contended\t%" PRIu64 "\n", fr_state_lock_contended(state));
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_state_table[] = {
+	{
+		.parent = "stats",
+		.name = "state",
+		.help = "Statistics for session state.",
+		.read_only = true
+	},
+
+	{
+		.parent = "stats state",
+		.add_name = true,
+		.name = "self",
+		.func = cmd_stats_state,
+		.help = "Show statistics for the session state of a listener.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+
+/** Register radmin commands to show the statistics of a state tree
+ *
+ * A virtual server may have several listeners, each with its own
+ * state tree, so the trees are numbered in the order they're registered.
+ *
+ * @param[in] state	to show statistics for.
+ * @param[in] server	name of the virtual server the state tree belongs to.  May be NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_state_tree_register_stats(fr_state_tree_t *state, char const *server)
+{
+	static unsigned int	num = 0;
+	char			buffer[32];
+
+	if (server) {
+		state->server = talloc_typed_strdup(state, server);
+		if (!state->server) return -1;
+	}
+
+	snprintf(buffer, sizeof(buffer), "%u", num++);
+
+	return fr_command_register_hook(NULL, buffer, state, cmd_state_table);
 }
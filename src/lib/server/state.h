@@ -52,6 +52,9 @@ void	fr_state_detach(request_t *request, bool will_free);
 uint64_t fr_state_entries_created(fr_state_tree_t *state);
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state);
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state);
+uint64_t fr_state_lock_contended(fr_state_tree_t *state);
+
+int	fr_state_tree_register_stats(fr_state_tree_t *state, char const *server);
 
 #ifdef __cplusplus
 }
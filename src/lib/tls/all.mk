@@ -5,6 +5,7 @@ TARGET		:= $(TARGETNAME).a
 endif
 
 SOURCES	:= \
+	async.c \
 	base.c \
 	cache.c \
 	conf.c \
@@ -0,0 +1,536 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/async.c
+ * @brief Run private key operations for async TLS sessions in a pool of threads.
+ *
+ * When a TLS session is in async mode (SSL_MODE_ASYNC), OpenSSL runs the
+ * handshake as an async job.  The engine created here is attached to the
+ * private keys of async server contexts, and replaces their RSA and EC
+ * private key operations (sign and decrypt).  If the operation is
+ * called from an async job, it's passed to a pool thread, and the job is
+ * paused until the pool thread is done.  The job's wait fd becomes readable
+ * at that point, and the worker resumes the handshake.
+ *
+ * Operations which aren't run from an async job are run inline, as before.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#ifdef WITH_TLS
+#define LOG_PREFIX "tls - "
+
+/*
+ *	Included before base.h, which hides the deprecated
+ *	interfaces.  Engines are deprecated in OpenSSL 3.0,
+ *	but still the only way of replacing private key
+ *	operations for keys loaded by the default provider.
+ */
+#include <openssl/async.h>
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include "base.h"
+#include "missing.h"
+
+#ifdef SSL_MODE_ASYNC
+#ifndef OPENSSL_NO_ENGINE
+#include <pthread.h>
+
+/** Signature of the EVP_PKEY_METHOD sign and decrypt functions
+ *
+ */
+typedef int (*tls_async_pkey_op_t)(EVP_PKEY_CTX *ctx, unsigned char *out, size_t *outlen,
+				   unsigned char const *in, size_t inlen);
+
+typedef enum {
+	TLS_ASYNC_OP_QUEUED = 0,			//!< Waiting for a pool thread.
+	TLS_ASYNC_OP_RUNNING,				//!< Being run by a pool thread.
+	TLS_ASYNC_OP_DONE				//!< Finished, and the wait fd is readable.
+} tls_async_op_state_t;
+
+/** A private key operation which runs in the pool
+ *
+ * Everything but the state belongs to the async job while the operation
+ * is queued, and to the pool thread while it runs.
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the pool's queue.
+	tls_async_op_state_t	state;			//!< Protected by the pool's mutex.
+
+	tls_async_pkey_op_t	func;			//!< Original OpenSSL operation.
+	EVP_PKEY_CTX		*ctx;			//!< Arguments for func.
+	unsigned char		*out;
+	size_t			*outlen;
+	unsigned char const	*in;
+	size_t			inlen;
+	int			ret;			//!< What func returned.
+
+	int			pipe[2];		//!< Wait fd of the async job, written when
+							///< the operation is done.
+} tls_async_op_t;
+
+/** Threads which run private key operations, and the engine which passes them over
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;			//!< Protects everything below.
+	pthread_cond_t		cond;			//!< Signalled when there are operations to run.
+	pthread_cond_t		done;			//!< Signalled when an operation is done.
+	fr_dlist_head_t		queue;			//!< Operations waiting for a thread.
+	bool			exiting;		//!< Threads should exit.
+
+	pthread_t		*threads;		//!< Pool threads.
+	uint32_t		num_threads;		//!< Number of threads which were started.
+
+	ENGINE			*engine;		//!< Provides the pkey methods below.
+	int			nids[2];		//!< Key types we handle.
+	int			num_nids;		//!< Number of entries in nids.
+	EVP_PKEY_METHOD		*rsa;			//!< RSA method, with sign and decrypt replaced.
+	EVP_PKEY_METHOD		*ec;			//!< EC method, with sign replaced.
+} tls_async_pool_t;
+
+static tls_async_pool_t		*async_pool;
+
+static tls_async_pkey_op_t	rsa_sign_orig;
+static tls_async_pkey_op_t	rsa_decrypt_orig;
+static tls_async_pkey_op_t	ec_sign_orig;
+
+/** Run private key operations from the queue, until the pool is freed
+ *
+ */
+static void *tls_async_thread(void *arg)
+{
+	tls_async_pool_t	*pool = arg;
+	tls_async_op_t		*op;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->exiting && (fr_dlist_num_elements(&pool->queue) == 0)) {
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+		if (pool->exiting) break;
+
+		op = fr_dlist_head(&pool->queue);
+		fr_dlist_remove(&pool->queue, op);
+		op->state = TLS_ASYNC_OP_RUNNING;
+		pthread_mutex_unlock(&pool->mutex);
+
+		op->ret = op->func(op->ctx, op->out, op->outlen, op->in, op->inlen);
+
+		/*
+		 *	The error queue is per thread, so the worker
+		 *	would never see these.
+		 */
+		if (op->ret <= 0) fr_tls_log_error(NULL, "Private key operation failed");
+
+		/*
+		 *	The op may be freed as soon as it's marked
+		 *	done, so the fd is written first.  If the
+		 *	job is resumed before then, it just pauses
+		 *	again.
+		 */
+		if (write(op->pipe[1], "", 1) < 0) ERROR("Failed signalling async job: %s", fr_syserror(errno));
+
+		pthread_mutex_lock(&pool->mutex);
+		op->state = TLS_ASYNC_OP_DONE;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/** Free an op, once no pool thread can use it
+ *
+ */
+static int _tls_async_op_free(tls_async_op_t *op)
+{
+	close(op->pipe[0]);
+	close(op->pipe[1]);
+
+	return 0;
+}
+
+/** Called by OpenSSL if the session is freed while its job is paused
+ *
+ * If the op is running, we have to wait for it, as the output buffer
+ * may belong to the session.
+ */
+static void tls_async_op_cleanup(UNUSED ASYNC_WAIT_CTX *wait_ctx, UNUSED void const *key,
+				 UNUSED OSSL_ASYNC_FD fd, void *custom)
+{
+	tls_async_op_t		*op = talloc_get_type_abort(custom, tls_async_op_t);
+	tls_async_pool_t	*pool = async_pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (op->state == TLS_ASYNC_OP_QUEUED) fr_dlist_remove(&pool->queue, op);
+	while (op->state == TLS_ASYNC_OP_RUNNING) pthread_cond_wait(&pool->done, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	talloc_free(op);
+}
+
+/** Pass a private key operation to the pool, and pause the job until it's done
+ *
+ * Operations outside of an async job, and requests for the output length,
+ * are run inline.
+ */
+static int tls_async_offload(tls_async_pkey_op_t func, EVP_PKEY_CTX *ctx,
+			     unsigned char *out, size_t *outlen, unsigned char const *in, size_t inlen)
+{
+	tls_async_pool_t	*pool = async_pool;
+	ASYNC_JOB		*job;
+	ASYNC_WAIT_CTX		*wait_ctx;
+	tls_async_op_t		*op;
+	tls_async_op_state_t	state;
+	int			ret;
+
+	job = ASYNC_get_current_job();
+	if (!job || !out) return func(ctx, out, outlen, in, inlen);
+
+	wait_ctx = ASYNC_get_wait_ctx(job);
+
+	op = talloc_zero(NULL, tls_async_op_t);
+	if (!op) return func(ctx, out, outlen, in, inlen);
+
+	if (pipe(op->pipe) < 0) {
+		ERROR("Failed creating async job fd: %s", fr_syserror(errno));
+		talloc_free(op);
+		return func(ctx, out, outlen, in, inlen);
+	}
+	talloc_set_destructor(op, _tls_async_op_free);
+
+	op->func = func;
+	op->ctx = ctx;
+	op->out = out;
+	op->outlen = outlen;
+	op->in = in;
+	op->inlen = inlen;
+
+	if (ASYNC_WAIT_CTX_set_wait_fd(wait_ctx, op, op->pipe[0], op, tls_async_op_cleanup) != 1) {
+		talloc_free(op);
+		return func(ctx, out, outlen, in, inlen);
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	fr_dlist_insert_tail(&pool->queue, op);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (;;) {
+		pthread_mutex_lock(&pool->mutex);
+		state = op->state;
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (state == TLS_ASYNC_OP_DONE) break;
+
+		(void) ASYNC_pause_job();
+	}
+
+	ret = op->ret;
+	ASYNC_WAIT_CTX_clear_fd(wait_ctx, op);
+	talloc_free(op);
+
+	return ret;
+}
+
+static int tls_async_rsa_sign(EVP_PKEY_CTX *ctx, unsigned char *out, size_t *outlen,
+			      unsigned char const *in, size_t inlen)
+{
+	return tls_async_offload(rsa_sign_orig, ctx, out, outlen, in, inlen);
+}
+
+static int tls_async_rsa_decrypt(EVP_PKEY_CTX *ctx, unsigned char *out, size_t *outlen,
+				 unsigned char const *in, size_t inlen)
+{
+	return tls_async_offload(rsa_decrypt_orig, ctx, out, outlen, in, inlen);
+}
+
+static int tls_async_ec_sign(EVP_PKEY_CTX *ctx, unsigned char *out, size_t *outlen,
+			     unsigned char const *in, size_t inlen)
+{
+	return tls_async_offload(ec_sign_orig, ctx, out, outlen, in, inlen);
+}
+
+/** Return the pkey methods of the engine
+ *
+ */
+static int tls_async_pkey_meths(UNUSED ENGINE *e, EVP_PKEY_METHOD **pmeth, int const **nids, int nid)
+{
+	tls_async_pool_t *pool = async_pool;
+
+	if (!pmeth) {
+		*nids = pool->nids;
+		return pool->num_nids;
+	}
+
+	switch (nid) {
+	case EVP_PKEY_RSA:
+		*pmeth = pool->rsa;
+		break;
+
+	case EVP_PKEY_EC:
+		*pmeth = pool->ec;
+		break;
+
+	default:
+		*pmeth = NULL;
+		break;
+	}
+
+	return *pmeth ? 1 : 0;
+}
+
+/** Copy the default method for a key type
+ *
+ * @return
+ *	- The copy.
+ *	- NULL if OpenSSL has no method for the key type, or an engine
+ *	  (such as a crypto accelerator) provides one.
+ */
+static EVP_PKEY_METHOD *tls_async_pkey_meth_copy(int nid)
+{
+	EVP_PKEY_METHOD const	*src;
+	EVP_PKEY_METHOD		*meth;
+	ENGINE			*e;
+	int			id, flags;
+
+	e = ENGINE_get_pkey_meth_engine(nid);
+	if (e) {
+		INFO("Engine \"%s\" provides %s keys, not offloading their operations",
+		     ENGINE_get_id(e), OBJ_nid2sn(nid));
+		ENGINE_finish(e);
+		return NULL;
+	}
+
+	src = EVP_PKEY_meth_find(nid);
+	if (!src) return NULL;
+
+	EVP_PKEY_meth_get0_info(&id, &flags, src);
+
+	meth = EVP_PKEY_meth_new(nid, flags);
+	if (!meth) return NULL;
+
+	EVP_PKEY_meth_copy(meth, src);
+
+	return meth;
+}
+
+/** Stop the pool threads, and free the engine
+ *
+ * Keys which were attached to the engine hold a reference to it, so
+ * this must be called after all the SSL_CTXs have been freed.
+ */
+static int _tls_async_pool_free(tls_async_pool_t *pool)
+{
+	uint32_t i;
+
+	if (pool->engine) ENGINE_free(pool->engine);
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->exiting = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i], NULL);
+
+	if (pool->rsa) EVP_PKEY_meth_free(pool->rsa);
+	if (pool->ec) EVP_PKEY_meth_free(pool->ec);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+
+	return 0;
+}
+
+/** Start the pool threads, and create the engine which passes private key operations to them
+ *
+ * The pool is shared by all TLS configurations.  Only the first call starts
+ * it, later calls do nothing.
+ *
+ * @param[in] num_threads	to start.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_tls_async_init(uint32_t num_threads)
+{
+	tls_async_pool_t	*pool;
+	int			(*init)(EVP_PKEY_CTX *ctx);
+	uint32_t		i;
+	int			ret;
+
+	if (async_pool) return 0;
+
+	MEM(pool = talloc_zero(NULL, tls_async_pool_t));
+	fr_dlist_talloc_init(&pool->queue, tls_async_op_t, entry);
+	MEM(pool->threads = talloc_array(pool, pthread_t, num_threads));
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	talloc_set_destructor(pool, _tls_async_pool_free);
+
+	async_pool = pool;
+
+	pool->rsa = tls_async_pkey_meth_copy(EVP_PKEY_RSA);
+	if (pool->rsa) {
+		EVP_PKEY_meth_get_sign(pool->rsa, &init, &rsa_sign_orig);
+		EVP_PKEY_meth_set_sign(pool->rsa, init, tls_async_rsa_sign);
+		EVP_PKEY_meth_get_decrypt(pool->rsa, &init, &rsa_decrypt_orig);
+		EVP_PKEY_meth_set_decrypt(pool->rsa, init, tls_async_rsa_decrypt);
+		pool->nids[pool->num_nids++] = EVP_PKEY_RSA;
+	}
+
+	pool->ec = tls_async_pkey_meth_copy(EVP_PKEY_EC);
+	if (pool->ec) {
+		EVP_PKEY_meth_get_sign(pool->ec, &init, &ec_sign_orig);
+		EVP_PKEY_meth_set_sign(pool->ec, init, tls_async_ec_sign);
+		pool->nids[pool->num_nids++] = EVP_PKEY_EC;
+	}
+
+	pool->engine = ENGINE_new();
+	if (!pool->engine ||
+	    (ENGINE_set_id(pool->engine, "freeradius_async") != 1) ||
+	    (ENGINE_set_name(pool->engine, "FreeRADIUS async private key operations") != 1) ||
+	    (ENGINE_set_pkey_meths(pool->engine, tls_async_pkey_meths) != 1)) {
+		fr_tls_log_error(NULL, "Failed creating async TLS engine");
+	error:
+		TALLOC_FREE(async_pool);
+		return -1;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		ret = pthread_create(&pool->threads[i], NULL, tls_async_thread, pool);
+		if (ret != 0) {
+			ERROR("Failed creating async TLS thread: %s", fr_syserror(ret));
+			goto error;
+		}
+		pool->num_threads++;
+	}
+
+	return 0;
+}
+
+/** Pass the private key operations of a server context to the pool
+ *
+ * The engine is attached to each private key of the context, so only
+ * operations using those keys are passed to the pool, and only when they're
+ * run from an async job.
+ *
+ * With OpenSSL >= 3.0, RSA decryption with the TLS padding check is only
+ * available from the default provider, not from an engine.  Cipher suites
+ * using RSA key exchange are removed from contexts with RSA keys.
+ *
+ * @param[in] ctx		to attach the keys of.
+ * @param[in] cipher_list	the context was configured with, may be NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_tls_async_ctx_attach(SSL_CTX *ctx, char const *cipher_list)
+{
+	tls_async_pool_t	*pool = async_pool;
+	EVP_PKEY		*pkey;
+	bool			rsa = false;
+	int			ret;
+
+	fr_assert(pool);
+
+	for (ret = SSL_CTX_set_current_cert(ctx, SSL_CERT_SET_FIRST);
+	     ret == 1;
+	     ret = SSL_CTX_set_current_cert(ctx, SSL_CERT_SET_NEXT)) {
+		pkey = SSL_CTX_get0_privatekey(ctx);
+		if (!pkey) continue;
+
+		switch (EVP_PKEY_base_id(pkey)) {
+		case EVP_PKEY_RSA:
+			if (!pool->rsa) continue;
+			rsa = true;
+			break;
+
+		case EVP_PKEY_EC:
+			if (!pool->ec) continue;
+			break;
+
+		default:
+			continue;
+		}
+
+		if (EVP_PKEY_set1_engine(pkey, pool->engine) != 1) {
+			fr_tls_log_error(NULL, "Failed attaching async TLS engine to private key");
+			return -1;
+		}
+	}
+	(void)SSL_CTX_set_current_cert(ctx, SSL_CERT_SET_FIRST);	/* Reset */
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (rsa) {
+		char *ciphers;
+
+		ciphers = talloc_asprintf(NULL, "%s:!kRSA", cipher_list ? cipher_list : OSSL_default_cipher_list());
+		ret = SSL_CTX_set_cipher_list(ctx, ciphers);
+		talloc_free(ciphers);
+		if (ret != 1) {
+			fr_tls_log_error(NULL, "Failed removing RSA key exchange from cipher list");
+			return -1;
+		}
+	}
+#else
+	UNUSED_VAR(cipher_list);
+	UNUSED_VAR(rsa);
+#endif
+
+	return 0;
+}
+
+/** Stop the pool threads, and free the engine
+ *
+ */
+void fr_tls_async_free(void)
+{
+	TALLOC_FREE(async_pool);
+}
+#else
+int fr_tls_async_init(UNUSED uint32_t num_threads)
+{
+	ERROR("async requires OpenSSL with engine support");
+	return -1;
+}
+
+int fr_tls_async_ctx_attach(UNUSED SSL_CTX *ctx, UNUSED char const *cipher_list)
+{
+	return -1;
+}
+
+void fr_tls_async_free(void)
+{
+}
+#endif	/* OPENSSL_NO_ENGINE */
+#endif	/* SSL_MODE_ASYNC */
+#endif	/* WITH_TLS */
@@ -487,6 +487,9 @@ void fr_openssl_free(void)
  */
 void fr_openssl_free(void)
 {
+#ifdef SSL_MODE_ASYNC
+	fr_tls_async_free();
+#endif
 	OPENSSL_cleanup();
 	fr_dict_autofree(tls_dict);
 }
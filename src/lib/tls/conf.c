@@ -153,6 +153,10 @@ CONF_PARSER fr_tls_server_config[] = {
 	{ FR_CONF_OFFSET("cipher_server_preference", FR_TYPE_BOOL, fr_tls_conf_t, cipher_server_preference), .dflt = "yes" },
 #ifdef SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS
 	{ FR_CONF_OFFSET("allow_renegotiation", FR_TYPE_BOOL, fr_tls_conf_t, allow_renegotiation), .dflt = "no" },
+#endif
+#ifdef SSL_MODE_ASYNC
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, fr_tls_conf_t, async), .dflt = "no" },
+	{ FR_CONF_OFFSET("async_threads", FR_TYPE_UINT32, fr_tls_conf_t, async_threads), .dflt = "4" },
 #endif
 	{ FR_CONF_OFFSET("check_cert_issuer", FR_TYPE_STRING, fr_tls_conf_t, check_cert_issuer) },
 	{ FR_CONF_OFFSET("require_client_cert", FR_TYPE_BOOL, fr_tls_conf_t, require_client_cert) },
@@ -428,6 +432,17 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 	 */
 	if (conf->fragment_size < 100) conf->fragment_size = 100;
 
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	Start the threads which run private key
+	 *	operations for async sessions.
+	 */
+	if (conf->async) {
+		FR_INTEGER_BOUND_CHECK("async_threads", conf->async_threads, >=, 1);
+		if (fr_tls_async_init(conf->async_threads) < 0) goto error;
+	}
+#endif
+
 #ifdef __APPLE__
 	if (conf_cert_admin_password(conf) < 0) goto error;
 #endif
@@ -820,6 +820,14 @@ post_ca:
 		}
 	}
 
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	Pass private key operations of async sessions
+	 *	to the async threads.
+	 */
+	if (!client && conf->async && (fr_tls_async_ctx_attach(ctx, conf->cipher_list) < 0)) goto error;
+#endif
+
 	/*
 	 *	Print the actual cipher list
 	 */
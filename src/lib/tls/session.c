@@ -1320,6 +1320,10 @@ static void fr_tls_session_alert_send(request_t *request, fr_tls_session_t *sess
  * Advance the TLS handshake by feeding OpenSSL data from dirty_in,
  * and reading data from OpenSSL into dirty_out.
  *
+ * If the session is in async mode, the handshake may pause while waiting
+ * for an async job.  In that case async_pending is set, and this function
+ * should be called again (with no new data) once the job's fds are readable.
+ *
  * @param request The current request.
  * @param session The current TLS session.
  * @return
@@ -1385,8 +1389,12 @@ int fr_tls_session_handshake(request_t *request, fr_tls_session_t *session)
 	 *	If acting as a server SSL_set_accept_state must have
 	 *	been called before this function.
 	 */
+#ifdef SSL_MODE_ASYNC
+read:
+#endif
 	ret = SSL_read(session->ssl, session->clean_out.data + session->clean_out.used,
 		       sizeof(session->clean_out.data) - session->clean_out.used);
+	session->async_pending = false;
 	if (ret > 0) {
 		session->clean_out.used += ret;
 	success:
@@ -1394,6 +1402,33 @@ int fr_tls_session_handshake(request_t *request, fr_tls_session_t *session)
 		goto finish;
 	}
 
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	The handshake is paused, waiting for an async job.
+	 *	The caller should wait for the job's fds to become
+	 *	readable, and then call us again to resume it.
+	 */
+	switch (SSL_get_error(session->ssl, ret)) {
+	case SSL_ERROR_WANT_ASYNC:
+		RDEBUG3("TLS handshake waiting for async job");
+		session->async_pending = true;
+		ret = 0;
+		goto finish;
+
+	/*
+	 *	No job could be started, so nothing has been
+	 *	done.  Continue the handshake in this thread.
+	 */
+	case SSL_ERROR_WANT_ASYNC_JOB:
+		RWDEBUG("No async jobs available, continuing TLS handshake in the worker");
+		SSL_clear_mode(session->ssl, SSL_MODE_ASYNC);
+		goto read;
+
+	default:
+		break;
+	}
+#endif
+
 	/*
 	 *	Returns 0 if we can continue processing the handshake
 	 *	Returns -1 if we encountered a fatal error.
@@ -1724,6 +1759,15 @@ fr_tls_session_t *fr_tls_session_init_server(TALLOC_CTX *ctx, fr_tls_conf_t *con
 	SSL_set_msg_callback_arg(new_tls, session);
 	SSL_set_info_callback(new_tls, fr_tls_session_info_cb);
 
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	Run the handshake as an async job, so that private
+	 *	key operations can be passed to the async threads,
+	 *	instead of blocking the worker.
+	 */
+	if (conf->async) SSL_set_mode(new_tls, SSL_MODE_ASYNC);
+#endif
+
 	/*
 	 *	This sets the context sessions can be resumed in.
 	 *	This is to prevent sessions being created by one application
@@ -1,5 +1,6 @@
 SUBMAKEFILES := \
 	dbuff_tests.mk \
+	hash_tests.mk \
 	heap_tests.mk \
 	libfreeradius-util.mk \
 	pair_tests.mk \
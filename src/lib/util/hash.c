@@ -214,16 +214,26 @@ static int list_insert(fr_hash_table_t *ht,
 
 	for (cur = *head; cur != &ht->null; cur = cur->next) {
 		if (cur->reversed > node->reversed) break;
-		last = &(cur->next);
 
+		/*
+		 *	Entries with the same hash are ordered the
+		 *	way list_find() expects, so the new entry
+		 *	goes in front of the first one it's greater
+		 *	than.
+		 */
 		if (cur->reversed == node->reversed) {
 			if (ht->cmp) {
 				int cmp = ht->cmp(node->data, cur->data);
 				if (cmp > 0) break;
-				if (cmp < 0) continue;
+				if (cmp < 0) {
+					last = &(cur->next);
+					continue;
+				}
 			}
 			return 0;
 		}
+
+		last = &(cur->next);
 	}
 
 	node->next = *last;
@@ -520,6 +530,42 @@ void *fr_hash_table_find_by_key(fr_hash_table_t *ht, uint32_t key, void const *d
 	return out;
 }
 
+/** Find data from a template, without modifying the table
+ *
+ * #fr_hash_table_find_by_data initialises buckets lazily, which writes
+ * to the table.  This searches the nearest initialised parent bucket
+ * instead.  Its list holds every entry for the uninitialised bucket,
+ * in order, so the result is the same, but the lookup is slower until
+ * the bucket is initialised by a call which may write to the table.
+ *
+ * As nothing is written, multiple threads may call this concurrently,
+ * provided that no thread is modifying the table.
+ */
+void *fr_hash_table_find_by_data_read_only(fr_hash_table_t *ht, void const *data)
+{
+	fr_hash_entry_t *node;
+	uint32_t key;
+	uint32_t entry;
+	void *out;
+
+	if (!ht) return NULL;
+
+	key = ht->hash(data);
+	entry = key & ht->mask;
+
+	/*
+	 *	Bucket 0 is always initialised.
+	 */
+	while (!ht->buckets[entry]) entry = parent_of(entry);
+
+	node = list_find(ht, ht->buckets[entry], reverse(key), data);
+	if (!node) return NULL;
+
+	memcpy(&out, &node->data, sizeof(out));
+
+	return out;
+}
+
 /*
  *	Yank an entry from the hash table, without freeing the data.
  */
@@ -76,6 +76,8 @@ void		*fr_hash_table_find_by_data(fr_hash_table_t *ht, void const *data);
 
 void		*fr_hash_table_find_by_key(fr_hash_table_t *ht, uint32_t key, void const *data);
 
+void		*fr_hash_table_find_by_data_read_only(fr_hash_table_t *ht, void const *data);
+
 int		fr_hash_table_num_elements(fr_hash_table_t *ht);
 
 int		fr_hash_table_walk(fr_hash_table_t *ht,
@@ -0,0 +1,112 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "hash.c"
+
+#define HASH_TEST_SIZE (4096)
+
+static uint32_t hash_int(void const *data)
+{
+	return fr_hash((int const *) data, sizeof(int));
+}
+
+static int hash_int_cmp(void const *one, void const *two)
+{
+	int const *a = one, *b = two;
+
+	return (*a > *b) - (*a < *b);
+}
+
+static int hash_buckets_initialised(fr_hash_table_t *ht)
+{
+	int i, count = 0;
+
+	for (i = 0; i < ht->num_buckets; i++) if (ht->buckets[i]) count++;
+
+	return count;
+}
+
+static void hash_find_read_only(void)
+{
+	fr_hash_table_t	*ht;
+	int		*array;
+	int		i, missing, initialised;
+
+	ht = fr_hash_table_create(NULL, hash_int, hash_int_cmp, NULL);
+	TEST_CHECK(ht != NULL);
+
+	array = talloc_array(ht, int, HASH_TEST_SIZE);
+
+	/*
+	 *	Grow the table well past its initial size, so most
+	 *	buckets are left uninitialised.
+	 */
+	TEST_CASE("insertions");
+	for (i = 0; i < HASH_TEST_SIZE; i++) {
+		array[i] = i;
+		TEST_CHECK(fr_hash_table_insert(ht, &array[i]) == 1);
+		TEST_MSG("insert of %i failed", i);
+	}
+
+	initialised = hash_buckets_initialised(ht);
+	TEST_CHECK(initialised < ht->num_buckets);
+	TEST_MSG("expected uninitialised buckets, all %i are initialised", ht->num_buckets);
+
+	TEST_CASE("lookups find every entry");
+	for (i = 0; i < HASH_TEST_SIZE; i++) {
+		TEST_CHECK(fr_hash_table_find_by_data_read_only(ht, &i) == &array[i]);
+		TEST_MSG("lookup of %i failed", i);
+	}
+
+	TEST_CASE("lookups of missing entries fail");
+	for (i = HASH_TEST_SIZE; i < (HASH_TEST_SIZE * 2); i++) {
+		TEST_CHECK(fr_hash_table_find_by_data_read_only(ht, &i) == NULL);
+		TEST_MSG("found %i, which was never inserted", i);
+	}
+
+	TEST_CASE("lookups don't modify the table");
+	TEST_CHECK(hash_buckets_initialised(ht) == initialised);
+	TEST_MSG("expected %i initialised buckets", initialised);
+	TEST_MSG("got %i", hash_buckets_initialised(ht));
+
+	/*
+	 *	Delete every other entry.  This initialises buckets,
+	 *	so the lookups below see a mix of initialised and
+	 *	uninitialised buckets.
+	 */
+	TEST_CASE("deletions");
+	for (i = 0; i < HASH_TEST_SIZE; i += 2) {
+		TEST_CHECK(fr_hash_table_delete(ht, &i) == 1);
+		TEST_MSG("delete of %i failed", i);
+	}
+
+	TEST_CASE("lookups after deletions");
+	missing = 0;
+	for (i = 0; i < HASH_TEST_SIZE; i++) {
+		void *found = fr_hash_table_find_by_data_read_only(ht, &i);
+
+		if (i & 0x01) {
+			TEST_CHECK(found == &array[i]);
+			TEST_MSG("lookup of %i failed", i);
+		} else if (!found) {
+			missing++;
+		}
+	}
+	TEST_CHECK(missing == (HASH_TEST_SIZE / 2));
+	TEST_MSG("expected %i deleted entries to be missing", HASH_TEST_SIZE / 2);
+	TEST_MSG("got %i", missing);
+
+	TEST_CASE("results match fr_hash_table_find_by_data");
+	for (i = 0; i < (HASH_TEST_SIZE * 2); i++) {
+		void *expected = fr_hash_table_find_by_data_read_only(ht, &i);
+
+		TEST_CHECK(fr_hash_table_find_by_data(ht, &i) == expected);
+		TEST_MSG("lookups of %i disagree", i);
+	}
+
+	talloc_free(ht);
+}
+
+TEST_LIST = {
+	{ "hash_find_read_only",	hash_find_read_only	},
+	{ NULL }
+};
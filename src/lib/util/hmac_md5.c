@@ -150,6 +150,100 @@ void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *in, size_t in
 }
 #endif /* HAVE_OPENSSL_EVP_H */
 
+static int _md5_key_free(fr_md5_key_t *key)
+{
+	if (key->prefix) fr_md5_ctx_free(&key->prefix);
+	if (key->hmac_inner) fr_md5_ctx_free(&key->hmac_inner);
+	if (key->hmac_outer) fr_md5_ctx_free(&key->hmac_outer);
+
+	return 0;
+}
+
+/** Precompute the MD5 states for a key
+ *
+ * Hashing the key, and setting up the HMAC pads, is done once here,
+ * instead of once per call to #fr_hmac_md5.
+ *
+ * @param[in] ctx	to allocate the key in.
+ * @param[in] key	to precompute states for.
+ * @param[in] key_len	Length of the key.
+ * @return
+ *	- The precomputed key.
+ *	- NULL if out of memory.
+ */
+fr_md5_key_t *fr_md5_key_alloc(TALLOC_CTX *ctx, uint8_t const *key, size_t key_len)
+{
+	fr_md5_key_t	*md5_key;
+	uint8_t		k_ipad[64];
+	uint8_t		k_opad[64];
+	uint8_t		tk[MD5_DIGEST_LENGTH];
+	size_t		i;
+
+	md5_key = talloc_zero(ctx, fr_md5_key_t);
+	if (unlikely(!md5_key)) return NULL;
+	talloc_set_destructor(md5_key, _md5_key_free);
+
+	md5_key->prefix = fr_md5_ctx_alloc(false);
+	md5_key->hmac_inner = fr_md5_ctx_alloc(false);
+	md5_key->hmac_outer = fr_md5_ctx_alloc(false);
+	if (unlikely(!md5_key->prefix || !md5_key->hmac_inner || !md5_key->hmac_outer)) {
+		talloc_free(md5_key);
+		return NULL;
+	}
+
+	fr_md5_update(md5_key->prefix, key, key_len);
+
+	/* if key is longer than 64 bytes reset it to key=MD5(key) */
+	if (key_len > sizeof(k_ipad)) {
+		fr_md5_calc(tk, key, key_len);
+
+		key = tk;
+		key_len = sizeof(tk);
+	}
+
+	memset(k_ipad, 0, sizeof(k_ipad));
+	memset(k_opad, 0, sizeof(k_opad));
+	memcpy(k_ipad, key, key_len);
+	memcpy(k_opad, key, key_len);
+
+	for (i = 0; i < sizeof(k_ipad); i++) {
+		k_ipad[i] ^= 0x36;
+		k_opad[i] ^= 0x5c;
+	}
+
+	fr_md5_update(md5_key->hmac_inner, k_ipad, sizeof(k_ipad));
+	fr_md5_update(md5_key->hmac_outer, k_opad, sizeof(k_opad));
+
+	return md5_key;
+}
+
+/** Calculate HMAC using a precomputed key
+ *
+ * Gives the same digest as #fr_hmac_md5, but only hashes the data.
+ *
+ * @param digest Caller digest to be filled in.
+ * @param in Pointer to data stream.
+ * @param inlen length of data stream.
+ * @param key precomputed with #fr_md5_key_alloc.
+ */
+void fr_hmac_md5_key(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
+		     fr_md5_key_t const *key)
+{
+	fr_md5_ctx_t	*ctx;
+
+	ctx = fr_md5_ctx_alloc(true);
+
+	fr_md5_ctx_copy(ctx, key->hmac_inner);
+	fr_md5_update(ctx, in, inlen);
+	fr_md5_final(digest, ctx);
+
+	fr_md5_ctx_copy(ctx, key->hmac_outer);
+	fr_md5_update(ctx, digest, MD5_DIGEST_LENGTH);
+	fr_md5_final(digest, ctx);
+
+	fr_md5_ctx_free(&ctx);
+}
+
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
 
@@ -61,3 +61,40 @@ size_t fr_hw_cache_line_size(void)
 	return CACHE_LINE_DEFAULT;
 }
 #endif
+
+/*
+ *	__builtin_cpu_supports() also checks that the OS saves
+ *	the extended registers, so the instructions are usable,
+ *	and not just present.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/** Whether the CPU supports AVX2
+ *
+ */
+bool fr_hw_has_avx2(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("avx2");
+}
+
+/** Whether the CPU supports AVX-512 Foundation
+ *
+ */
+bool fr_hw_has_avx512(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("avx512f");
+}
+#else
+bool fr_hw_has_avx2(void)
+{
+	return false;
+}
+
+bool fr_hw_has_avx512(void)
+{
+	return false;
+}
+#endif
@@ -27,10 +27,15 @@ RCSIDH(hw_h, "$Id$")
 #ifdef __cplusplus
 extern "C" {
 #endif
+#include <stdbool.h>
 #include <stddef.h>
 
 size_t	fr_hw_cache_line_size(void);
 
+bool	fr_hw_has_avx2(void);
+
+bool	fr_hw_has_avx512(void);
+
 #ifdef __cplusplus
 }
 #endif
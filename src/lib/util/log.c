@@ -32,6 +32,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/value.h>
 
 #include <fcntl.h>
+#include <stdatomic.h>
 #ifdef HAVE_FEATURES_H
 #  include <features.h>
 #endif
@@ -49,6 +50,11 @@ static _Thread_local TALLOC_CTX *fr_log_pool;
 
 static uint32_t location_indent = 30;
 
+/** Set by the log writer thread, when it's running
+ *
+ */
+static _Atomic(fr_log_async_write_t) log_async_write = NULL;
+
 /** Canonicalize error strings, removing tabs, and generate spaces for error marker
  *
  * @note talloc_free must be called on the buffer returned in spaces and text
@@ -260,6 +266,7 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *file, int line,
 	char const	*fmt_facility = "";
 	char const	*fmt_type = "";
 	char		*fmt_msg;
+	fr_log_async_write_t async_write;
 
 	static char const *spaces = "                                    ";	/* 40 */
 
@@ -416,7 +423,7 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *file, int line,
 #ifdef HAVE_SYSLOG_H
 	case L_DST_SYSLOG:
 	{
-		int syslog_priority;
+		int syslog_priority = LOG_INFO;
 
 		switch (type) {
 		case L_DBG:
@@ -444,6 +451,18 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *file, int line,
 			syslog_priority = LOG_AUTH | LOG_INFO;
 			break;
 		}
+
+		/*
+		 *	Let the log writer thread block on syslog,
+		 *	instead of us.
+		 */
+		async_write = atomic_load_explicit(&log_async_write, memory_order_acquire);
+		if (async_write) {
+			buffer = talloc_asprintf(pool, "%s%s%s", fmt_time, fmt_time[0] ? ": " : "", fmt_msg);
+			ret = async_write(log, syslog_priority, buffer, talloc_array_length(buffer) - 1);
+			break;
+		}
+
 		syslog(syslog_priority,
 		       "%s"	/* time */
 		       "%s"	/* time sep */
@@ -481,6 +500,21 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *file, int line,
 				 	 colourise ? VTC_RESET : "");
 
 		len = talloc_array_length(buffer) - 1;
+
+		/*
+		 *	Only log files are slow enough to be worth
+		 *	writing from another thread.  Debug output to
+		 *	stdout / stderr stays in order with everything
+		 *	else written to the terminal.
+		 */
+		if (log->dst == L_DST_FILES) {
+			async_write = atomic_load_explicit(&log_async_write, memory_order_acquire);
+			if (async_write) {
+				ret = async_write(log, 0, buffer, len);
+				break;
+			}
+		}
+
 		wrote = write(log->fd, buffer, len);
 		if (wrote < len) ret = -1;
 	}
@@ -856,6 +890,19 @@ static int _restore_std(UNUSED int sig)
 	return 0;
 }
 
+/** Hand messages for the "files" and "syslog" destinations to another thread
+ *
+ * Should be set before any other threads start logging, and cleared
+ * after they've exited.
+ *
+ * @param[in] func	which queues the message, or NULL to write messages
+ *			directly again.
+ */
+void fr_log_async_write_set(fr_log_async_write_t func)
+{
+	atomic_store_explicit(&log_async_write, func, memory_order_release);
+}
+
 /** Initialise file descriptors based on logging destination
  *
  * @param log Logger to manipulate.
@@ -117,6 +117,21 @@ typedef struct {
 	char const		*subsq_prefix;	//!< Prefix for subsequent lines.
 } fr_log_perror_format_t;
 
+/** Hand a formatted message to another thread, which writes it
+ *
+ * Only used for the "files" and "syslog" destinations.
+ *
+ * @param[in] log	destination.  Only used during the call, the fd and
+ *			destination are copied into the queued message.
+ * @param[in] priority	syslog priority of the message.
+ * @param[in] msg	to write, including any trailing newline.
+ * @param[in] msg_len	length of msg.
+ * @return
+ *	- 0 if the message will be written.
+ *	- -1 if the message was discarded.
+ */
+typedef int (*fr_log_async_write_t)(fr_log_t const *log, int priority, char const *msg, size_t msg_len);
+
 extern fr_log_t default_log;
 extern bool fr_log_rate_limit;
 
@@ -133,6 +148,8 @@ static inline bool fr_rate_limit_enabled(void)
 
 int	fr_log_init(fr_log_t *log, bool daemonize);
 
+void	fr_log_async_write_set(fr_log_async_write_t func);
+
 TALLOC_CTX	*fr_log_pool_init(void);
 
 int	fr_vlog(fr_log_t const *log, fr_log_type_t lvl, char const *file, int line, char const *fmt, va_list ap)
@@ -7,6 +7,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hw.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/talloc.h>
 #include <freeradius-devel/util/thread_local.h>
@@ -23,6 +24,7 @@ RCSID("$Id$")
  * Any entries remaining in the list will be freed when the thread is joined
  */
 static _Thread_local fr_md5_ctx_t * md5_ctx;
+static _Thread_local bool md5_ctx_used;
 
 /*
  *	If we have OpenSSL's EVP API available, then build wrapper functions.
@@ -90,8 +92,6 @@ static fr_md5_ctx_t *fr_md5_openssl_ctx_alloc(bool thread_local)
 	EVP_MD_CTX *md_ctx;
 	fr_md5_free_list_t *free_list;
 
-	thread_local = true;
-
 	/*
 	 *	Use the thread local ctx to avoid heap allocations.
 	 */
@@ -180,7 +180,6 @@ static void fr_md5_openssl_final(uint8_t out[static MD5_DIGEST_LENGTH], fr_md5_c
 }
 #endif
 
-#  define MD5_BLOCK_LENGTH 64
 typedef struct {
 	uint32_t state[4];			//!< State.
 	uint32_t count[2];			//!< Number of bits, mod 2^64.
@@ -238,6 +237,80 @@ static const uint8_t PADDING[MD5_BLOCK_LENGTH] = {
 /* This is the central step in the MD5 algorithm. */
 #define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = w << s | w >> (32 - s),  w += x)
 
+/** All 64 steps of the MD5 algorithm
+ *
+ * Works with scalar, or GCC vector types for a, b, c, d and in.
+ */
+#define MD5_ROUNDS(a, b, c, d, in) do { \
+	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12); \
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17); \
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22); \
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7); \
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12); \
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17); \
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22); \
+\
+	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9); \
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5); \
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9); \
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5); \
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20); \
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14); \
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20); \
+\
+	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11); \
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16); \
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16); \
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23); \
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16); \
+	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4); \
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11); \
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16); \
+	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23); \
+\
+	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6); \
+	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10); \
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15); \
+	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21); \
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6); \
+	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10); \
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15); \
+	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21); \
+	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6); \
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10); \
+	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15); \
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21); \
+	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6); \
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10); \
+	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15); \
+	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21); \
+} while (0)
+
 /** The core of the MD5 algorithm
  *
  * This alters an existing MD5 hash to reflect the addition of 16
@@ -264,73 +337,7 @@ static void fr_md5_local_transform(uint32_t state[static 4], uint8_t const block
 	c = state[2];
 	d = state[3];
 
-	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7);
-	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12);
-	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17);
-	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22);
-	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7);
-	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12);
-	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17);
-	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22);
-	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7);
-	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12);
-	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7);
-	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
-	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
-	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
-
-	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5);
-	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9);
-	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20);
-	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5);
-	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9);
-	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20);
-	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5);
-	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9);
-	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14);
-	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20);
-	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5);
-	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9);
-	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14);
-	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
-
-	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4);
-	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11);
-	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4);
-	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11);
-	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16);
-	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4);
-	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11);
-	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16);
-	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23);
-	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4);
-	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23);
-
-	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6);
-	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10);
-	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21);
-	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6);
-	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10);
-	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21);
-	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6);
-	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15);
-	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6);
-	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15);
-	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21);
+	MD5_ROUNDS(a, b, c, d, in);
 
 	state[0] += a;
 	state[1] += b;
@@ -406,8 +413,10 @@ static fr_md5_ctx_t *fr_md5_local_ctx_alloc(bool thread_local)
 
 	/*
 	 *	Use the thread local ctx to avoid heap allocations.
+	 *	There's only one, so if the caller already has it,
+	 *	fall back to allocating a new ctx.
 	 */
-	if (thread_local) {
+	if (thread_local && !md5_ctx_used) {
 		if (unlikely(!md5_ctx)) {
 			ctx_local = talloc(NULL, fr_md5_ctx_local_t);
 			if (unlikely(!ctx_local)) return NULL;
@@ -416,6 +425,7 @@ static fr_md5_ctx_t *fr_md5_local_ctx_alloc(bool thread_local)
 		} else {
 			ctx_local = md5_ctx;
 		}
+		md5_ctx_used = true;
 	/*
 	 *	If the MD5 ctx might be used across a yield point
 	 *	shared should be set to false, and new contexts
@@ -437,6 +447,7 @@ static void fr_md5_local_ctx_free(fr_md5_ctx_t **ctx)
 {
 	if (md5_ctx && (md5_ctx == *ctx)) {
 		fr_md5_local_ctx_reset(*ctx);
+		md5_ctx_used = false;
 		*ctx = NULL;
 		return;	/* Don't free the thread_local ctx */
 	}
@@ -548,3 +559,221 @@ void fr_md5_calc(uint8_t out[static MD5_DIGEST_LENGTH], uint8_t const *in, size_
 	fr_md5_final(out, ctx);
 	fr_md5_ctx_free(&ctx);
 }
+
+/*
+ *	Multi-buffer MD5
+ *
+ *	Each lane of a SIMD register holds the state of a different
+ *	message, so one pass through the MD5 steps processes one
+ *	block from each of 8 (AVX2) or 16 (AVX-512) messages.  When
+ *	a message is complete, the next one is started in its lane.
+ */
+#define MD5_MB_MAX_LANES	16
+
+/** Progress through one message in a lane
+ *
+ */
+typedef struct {
+	fr_md5_mb_msg_t const	*msg;					//!< Message being hashed, NULL if the
+									///< lane is idle.
+	uint8_t const		*next;					//!< Next full block of the message.
+	size_t			full;					//!< Full blocks left.
+	size_t			tail_blocks;				//!< Blocks in the tail.
+	size_t			tail_used;				//!< Blocks of the tail processed.
+	uint8_t			tail[2 * MD5_BLOCK_LENGTH];		//!< The last partial block, padding
+									///< and length.
+} md5_mb_lane_t;
+
+/** Process one block for every lane
+ *
+ * @param[in,out] state	4 words for each lane, word major.
+ * @param[in] in	16 words of input for each lane, word major.
+ */
+typedef void (*md5_mb_transform_t)(uint32_t *state, uint32_t const *in);
+
+static void fr_md5_mb_resolve(fr_md5_mb_msg_t const *msgs, size_t num);
+
+fr_md5_mb_t fr_md5_mb = fr_md5_mb_resolve;
+
+/** Start hashing a message in a lane
+ *
+ */
+static void md5_mb_lane_start(md5_mb_lane_t *lane, uint32_t *state, size_t lanes, size_t i,
+			      fr_md5_mb_msg_t const *msg)
+{
+	size_t		partial = msg->inlen % MD5_BLOCK_LENGTH;
+	uint32_t	count[2];
+
+	lane->msg = msg;
+	lane->next = msg->in;
+	lane->full = msg->inlen / MD5_BLOCK_LENGTH;
+	lane->tail_used = 0;
+
+	/*
+	 *	The padding and length need 9 bytes, so if there
+	 *	isn't room in the last block, they go in another.
+	 */
+	lane->tail_blocks = (partial < (MD5_BLOCK_LENGTH - 8)) ? 1 : 2;
+
+	memset(lane->tail, 0, sizeof(lane->tail));
+	if (partial) memcpy(lane->tail, msg->in + (msg->inlen - partial), partial);
+	lane->tail[partial] = 0x80;
+
+	count[0] = (uint32_t) (msg->inlen << 3);
+	count[1] = (uint32_t) ((uint64_t) msg->inlen >> 29);
+	PUT_64BIT_LE(lane->tail + (lane->tail_blocks * MD5_BLOCK_LENGTH) - 8, count);
+
+	state[(0 * lanes) + i] = 0x67452301;
+	state[(1 * lanes) + i] = 0xefcdab89;
+	state[(2 * lanes) + i] = 0x98badcfe;
+	state[(3 * lanes) + i] = 0x10325476;
+}
+
+/** Return the next block of a message, or NULL if there are none left
+ *
+ */
+static inline uint8_t const *md5_mb_lane_block(md5_mb_lane_t *lane)
+{
+	uint8_t const *block;
+
+	if (lane->full > 0) {
+		block = lane->next;
+		lane->next += MD5_BLOCK_LENGTH;
+		lane->full--;
+		return block;
+	}
+
+	if (lane->tail_used < lane->tail_blocks) return lane->tail + (MD5_BLOCK_LENGTH * lane->tail_used++);
+
+	return NULL;
+}
+
+/** Hash messages, using a transform which processes lanes blocks at once
+ *
+ */
+static void md5_mb_run(fr_md5_mb_msg_t const *msgs, size_t num, size_t lanes, md5_mb_transform_t transform)
+{
+	md5_mb_lane_t	lane[MD5_MB_MAX_LANES];
+	uint32_t	state[4 * MD5_MB_MAX_LANES];
+	uint32_t	in[(MD5_BLOCK_LENGTH / 4) * MD5_MB_MAX_LANES];
+	size_t		next = 0, active = 0, i, j;
+
+	for (i = 0; i < lanes; i++) {
+		lane[i].msg = NULL;
+		if (next == num) continue;
+
+		md5_mb_lane_start(&lane[i], state, lanes, i, &msgs[next++]);
+		active++;
+	}
+
+	while (active > 0) {
+		/*
+		 *	Transpose the blocks so that each word of
+		 *	the input is contiguous for all lanes.  Idle
+		 *	lanes hash the padding, and the result is
+		 *	ignored.
+		 */
+		for (i = 0; i < lanes; i++) {
+			uint8_t const *block = lane[i].msg ? md5_mb_lane_block(&lane[i]) : PADDING;
+
+			for (j = 0; j < (MD5_BLOCK_LENGTH / 4); j++) {
+				in[(j * lanes) + i] = (uint32_t)(
+				    (uint32_t)(block[j * 4 + 0]) |
+				    (uint32_t)(block[j * 4 + 1]) <<  8 |
+				    (uint32_t)(block[j * 4 + 2]) << 16 |
+				    (uint32_t)(block[j * 4 + 3]) << 24);
+			}
+		}
+
+		transform(state, in);
+
+		for (i = 0; i < lanes; i++) {
+			if (!lane[i].msg || (lane[i].full > 0) || (lane[i].tail_used < lane[i].tail_blocks)) continue;
+
+			for (j = 0; j < 4; j++) PUT_32BIT_LE(lane[i].msg->out + (j * 4), state[(j * lanes) + i]);
+
+			lane[i].msg = NULL;
+			active--;
+
+			if (next == num) continue;
+
+			md5_mb_lane_start(&lane[i], state, lanes, i, &msgs[next++]);
+			active++;
+		}
+	}
+}
+
+/** Hash messages one at a time
+ *
+ * Used when the CPU has no suitable SIMD instructions.
+ */
+static void fr_md5_mb_scalar(fr_md5_mb_msg_t const *msgs, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++) fr_md5_calc(msgs[i].out, msgs[i].in, msgs[i].inlen);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/*
+ *	The MD5 steps only use operators which GCC and clang support
+ *	for vector types, so the same code is compiled for each
+ *	width, with the instruction set enabled for that function.
+ */
+#define MD5_MB_TRANSFORM(_name, _lanes, _target) \
+static __attribute__((target(_target))) void _name(uint32_t *state, uint32_t const *block) \
+{ \
+	typedef uint32_t md5_vec_t __attribute__((vector_size((_lanes) * sizeof(uint32_t)))); \
+	md5_vec_t	a, b, c, d, in[MD5_BLOCK_LENGTH / 4]; \
+	md5_vec_t	s[4]; \
+	int		i; \
+\
+	for (i = 0; i < (MD5_BLOCK_LENGTH / 4); i++) memcpy(&in[i], block + (i * (_lanes)), sizeof(in[i])); \
+	for (i = 0; i < 4; i++) memcpy(&s[i], state + (i * (_lanes)), sizeof(s[i])); \
+\
+	a = s[0]; \
+	b = s[1]; \
+	c = s[2]; \
+	d = s[3]; \
+\
+	MD5_ROUNDS(a, b, c, d, in); \
+\
+	s[0] += a; \
+	s[1] += b; \
+	s[2] += c; \
+	s[3] += d; \
+\
+	for (i = 0; i < 4; i++) memcpy(state + (i * (_lanes)), &s[i], sizeof(s[i])); \
+}
+
+MD5_MB_TRANSFORM(md5_mb_transform_avx2, 8, "avx2")
+MD5_MB_TRANSFORM(md5_mb_transform_avx512, 16, "avx512f")
+
+static void fr_md5_mb_avx2(fr_md5_mb_msg_t const *msgs, size_t num)
+{
+	md5_mb_run(msgs, num, 8, md5_mb_transform_avx2);
+}
+
+static void fr_md5_mb_avx512(fr_md5_mb_msg_t const *msgs, size_t num)
+{
+	md5_mb_run(msgs, num, 16, md5_mb_transform_avx512);
+}
+#endif
+
+/** Pick the widest implementation the CPU supports, then hash the messages
+ *
+ */
+static void fr_md5_mb_resolve(fr_md5_mb_msg_t const *msgs, size_t num)
+{
+	fr_md5_mb = fr_md5_mb_scalar;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	if (fr_hw_has_avx512()) {
+		fr_md5_mb = fr_md5_mb_avx512;
+	} else if (fr_hw_has_avx2()) {
+		fr_md5_mb = fr_md5_mb_avx2;
+	}
+#endif
+
+	fr_md5_mb(msgs, num);
+}
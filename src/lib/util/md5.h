@@ -14,6 +14,7 @@ extern "C" {
 
 #include <freeradius-devel/build.h>
 #include <freeradius-devel/missing.h>
+#include <freeradius-devel/util/talloc.h>
 
 #include <inttypes.h>
 #include <sys/types.h>
@@ -25,6 +26,10 @@ extern "C" {
 #  define MD5_DIGEST_LENGTH 16
 #endif
 
+#ifndef MD5_BLOCK_LENGTH
+#  define MD5_BLOCK_LENGTH 64
+#endif
+
 typedef void fr_md5_ctx_t;
 
 /* md5.c */
@@ -84,9 +89,46 @@ extern		fr_md5_final_t		fr_md5_final;
  */
 void		fr_md5_calc(uint8_t out[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen);
 
+/** A message to hash with #fr_md5_mb
+ *
+ */
+typedef struct {
+	uint8_t const	*in;		//!< Data to hash.
+	size_t		inlen;		//!< Length of the data.
+	uint8_t		*out;		//!< Where to write the digest.  Must be MD5_DIGEST_LENGTH bytes.
+} fr_md5_mb_msg_t;
+
+/** Calculate the digests of many independent messages at once
+ *
+ * Uses AVX-512 or AVX2 to hash 16 or 8 messages in parallel, if
+ * the CPU supports it, and hashes them one at a time if not.
+ *
+ * @param[in] msgs	to hash.
+ * @param[in] num	Number of messages.
+ */
+typedef		void (*fr_md5_mb_t)(fr_md5_mb_msg_t const *msgs, size_t num);
+extern		fr_md5_mb_t		fr_md5_mb;
+
+/** MD5 states precomputed from a key
+ *
+ * For keys such as RADIUS shared secrets, which are hashed with
+ * every packet.  The states are never modified after they're
+ * created, so one key can be used by many threads at once.
+ */
+typedef struct {
+	fr_md5_ctx_t	*prefix;	//!< State after ingesting the key.
+	fr_md5_ctx_t	*hmac_inner;	//!< HMAC-MD5 state after ingesting the key XOR ipad.
+	fr_md5_ctx_t	*hmac_outer;	//!< HMAC-MD5 state after ingesting the key XOR opad.
+} fr_md5_key_t;
+
 /* hmac.c */
 void		fr_hmac_md5(uint8_t digest[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
 			    uint8_t const *key, size_t key_len);
+
+fr_md5_key_t	*fr_md5_key_alloc(TALLOC_CTX *ctx, uint8_t const *key, size_t key_len);
+
+void		fr_hmac_md5_key(uint8_t digest[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
+				fr_md5_key_t const *key);
 #ifdef __cplusplus
 }
 #endif
@@ -44,6 +44,10 @@
 
 #include <ifaddrs.h>
 
+#ifdef __linux__
+#  include <linux/filter.h>
+#endif
+
 /** Resolve a named service to a port
  *
  * @param[in] proto	The protocol. Either IPPROTO_TCP or IPPROTO_UDP.
@@ -1046,3 +1050,89 @@ done:
 #endif
 	return 0;
 }
+
+/** Steer packets for a group of SO_REUSEPORT sockets by source IP address
+ *
+ * By default the kernel picks a socket from the group by hashing the
+ * full 4-tuple.  Clients which use a new source port for each
+ * retransmission would then have their packets spread across the
+ * group.  This attaches a classic BPF program which picks the socket
+ * by hashing only the source IP address, so that all packets from one
+ * client go to the same socket.
+ *
+ * The program is shared by every socket in the group, and sockets are
+ * numbered in the order they were bound.  It should be attached once
+ * all of the sockets have been bound.
+ *
+ * @param[in] sockfd		any socket in the group.
+ * @param[in] af		address family of the sockets.
+ * @param[in] num		number of sockets in the group.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, or if the platform doesn't support it.
+ */
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+int fr_socket_reuseport_steer(int sockfd, int af, unsigned int num)
+{
+	struct sock_fprog	fprog;
+
+	/*
+	 *	The socket buffer starts at the UDP header, so we use
+	 *	SKF_NET_OFF to get at the IP header.  The multiply
+	 *	mixes the low bits of the address, so that clients
+	 *	in the same subnet are spread evenly.
+	 */
+	struct sock_filter	ipv4[] = {
+		{ BPF_LD  | BPF_W | BPF_ABS,	0, 0, SKF_NET_OFF + 12 },	/* A = saddr */
+		{ BPF_ALU | BPF_MUL | BPF_K,	0, 0, 0x9e3779b1 },
+		{ BPF_ALU | BPF_RSH | BPF_K,	0, 0, 16 },
+		{ BPF_ALU | BPF_MOD | BPF_K,	0, 0, num },
+		{ BPF_RET | BPF_A,		0, 0, 0 }
+	};
+
+	struct sock_filter	ipv6[] = {
+		{ BPF_LD  | BPF_W | BPF_ABS,	0, 0, SKF_NET_OFF + 8 },	/* A = saddr[0] */
+		{ BPF_MISC | BPF_TAX,		0, 0, 0 },
+		{ BPF_LD  | BPF_W | BPF_ABS,	0, 0, SKF_NET_OFF + 20 },	/* A = saddr[3] */
+		{ BPF_ALU | BPF_XOR | BPF_X,	0, 0, 0 },
+		{ BPF_ALU | BPF_MUL | BPF_K,	0, 0, 0x9e3779b1 },
+		{ BPF_ALU | BPF_RSH | BPF_K,	0, 0, 16 },
+		{ BPF_ALU | BPF_MOD | BPF_K,	0, 0, num },
+		{ BPF_RET | BPF_A,		0, 0, 0 }
+	};
+
+	if (num < 1) {
+		fr_strerror_const("Invalid number of sockets");
+		return -1;
+	}
+
+	switch (af) {
+	case AF_INET:
+		fprog.len = NUM_ELEMENTS(ipv4);
+		fprog.filter = ipv4;
+		break;
+
+	case AF_INET6:
+		fprog.len = NUM_ELEMENTS(ipv6);
+		fprog.filter = ipv6;
+		break;
+
+	default:
+		fr_strerror_printf("Unsupported address family %i", af);
+		return -1;
+	}
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog)) < 0) {
+		fr_strerror_printf("Failed attaching reuseport filter: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+#else
+int fr_socket_reuseport_steer(UNUSED int sockfd, UNUSED int af, UNUSED unsigned int num)
+{
+	fr_strerror_const("Steering SO_REUSEPORT packets is not supported on this platform");
+	return -1;
+}
+#endif
@@ -213,3 +213,480 @@ done:
 
 	return slen;
 }
+
+#ifdef HAVE_RECVMMSG
+#  define udp_recvmmsg(_fd, _msgvec, _vlen, _flags) recvmmsg(_fd, _msgvec, _vlen, _flags, NULL)
+#else
+/** Emulates recvmmsg in userland
+ *
+ * As with the sendmmsg() emulation, this doesn't reduce the number of
+ * system calls, but it means we don't need ifdefs in the callers.
+ *
+ * The first datagram is read with the caller's flags.  Subsequent
+ * datagrams are read with MSG_DONTWAIT, so that we only return what
+ * is already queued on the socket.
+ */
+static int udp_recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < vlen; i++) {
+		ssize_t slen;
+
+		slen = recvmsg(sockfd, &msgvec[i].msg_hdr, (i == 0) ? flags : (flags | MSG_DONTWAIT));
+		if (slen < 0) {
+			msgvec[i].msg_len = 0;
+
+			if (i == 0) return -1;
+			return i;
+		}
+		msgvec[i].msg_len = (unsigned int)slen;
+	}
+
+	return i;
+}
+#endif
+
+/** Per-datagram control message buffer size
+ *
+ *  Large enough for PKTINFO (v4 or v6) plus a receive timestamp.
+ */
+#define UDP_BATCH_CMSG_SIZE	(256)
+
+struct udp_batch_s {
+	int			sockfd;			//!< we're reading from.
+	unsigned int		num;			//!< maximum number of datagrams per recvmmsg()
+	unsigned int		count;			//!< number of datagrams returned by the last recvmmsg()
+	unsigned int		current;		//!< next datagram to return to the caller.
+	size_t			max_packet_size;	//!< size of each datagram buffer.
+
+	struct sockaddr_storage	bound;			//!< address the socket is bound to.
+	socklen_t		sizeof_bound;
+
+	uint8_t			*buffer;		//!< num * max_packet_size bytes of packet data
+	uint8_t			*cbuf;			//!< num * UDP_BATCH_CMSG_SIZE bytes of control data
+	struct iovec		*iov;			//!< one per datagram
+	struct sockaddr_storage	*src;			//!< source address of each datagram
+	struct mmsghdr		*mmsgvec;		//!< vector passed to recvmmsg()
+};
+
+/** Allocate a batch for reading multiple datagrams with one system call
+ *
+ * The socket must already be bound, as we cache its address for use
+ * as the destination address of the received packets.  Kernel
+ * receive timestamps are enabled on the socket, if available.
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] sockfd		we're reading from.
+ * @param[in] num		maximum number of datagrams to read at once.
+ * @param[in] max_packet_size	the largest datagram we accept.
+ * @return
+ *	- NULL on error.
+ *	- a new batch on success.
+ */
+udp_batch_t *udp_batch_alloc(TALLOC_CTX *ctx, int sockfd, unsigned int num, size_t max_packet_size)
+{
+	udp_batch_t	*batch;
+	unsigned int	i;
+
+	if (!num || !max_packet_size) {
+		fr_strerror_const("Invalid arguments");
+		return NULL;
+	}
+
+	batch = talloc_zero(ctx, udp_batch_t);
+	if (!batch) {
+	nomem:
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+
+	batch->sockfd = sockfd;
+	batch->num = num;
+	batch->max_packet_size = max_packet_size;
+
+	batch->sizeof_bound = sizeof(batch->bound);
+	if (getsockname(sockfd, (struct sockaddr *) &batch->bound, &batch->sizeof_bound) < 0) {
+		fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+		talloc_free(batch);
+		return NULL;
+	}
+
+	/*
+	 *	Not all platforms have kernel timestamps.  In which
+	 *	case we fall back to reading the time ourselves.
+	 */
+	(void) udpfromto_timestamp_init(sockfd);
+
+	batch->buffer = talloc_array(batch, uint8_t, num * max_packet_size);
+	batch->cbuf = talloc_zero_array(batch, uint8_t, num * UDP_BATCH_CMSG_SIZE);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->src = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->mmsgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	if (!batch->buffer || !batch->cbuf || !batch->iov || !batch->src || !batch->mmsgvec) {
+		talloc_free(batch);
+		goto nomem;
+	}
+
+	for (i = 0; i < num; i++) {
+		batch->iov[i].iov_base = batch->buffer + (i * max_packet_size);
+		batch->iov[i].iov_len = max_packet_size;
+
+		batch->mmsgvec[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->mmsgvec[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return batch;
+}
+
+/** Read the next UDP packet from a batch
+ *
+ * If all of the datagrams from the previous recvmmsg() call have been
+ * returned, the socket is read again, for up to "num" datagrams.
+ * Otherwise the next buffered datagram is returned without any system
+ * calls.
+ *
+ * @param[in] batch		to read from.
+ * @param[out] socket_out	Information about the src/dst address of the packet
+ *				and the interface it was received on.
+ * @param[out] data		pointer where data will be written
+ * @param[in] data_len		length of data to read
+ * @param[out] when		the packet was received.
+ * @return
+ *	- > 0 on success (number of bytes read).
+ *	- 0 if there's no data to read.
+ *	- < 0 on failure.
+ */
+ssize_t udp_batch_recv(udp_batch_t *batch, fr_socket_t *socket_out, void *data, size_t data_len, fr_time_t *when)
+{
+	struct mmsghdr		*mmsg;
+	struct sockaddr_storage	dst;
+	socklen_t		sizeof_dst;
+	ssize_t			slen;
+
+	if (when) *when = 0;
+
+	*socket_out = (fr_socket_t){
+		.fd = batch->sockfd,
+		.proto = IPPROTO_UDP
+	};
+
+	if (batch->current == batch->count) {
+		unsigned int	i;
+		int		ret;
+
+		batch->current = batch->count = 0;
+
+		/*
+		 *	recvmmsg() updates the lengths, so we have to
+		 *	reset them before every call.
+		 */
+		for (i = 0; i < batch->num; i++) {
+			batch->mmsgvec[i].msg_hdr.msg_name = &batch->src[i];
+			batch->mmsgvec[i].msg_hdr.msg_namelen = sizeof(batch->src[i]);
+			batch->mmsgvec[i].msg_hdr.msg_control = batch->cbuf + (i * UDP_BATCH_CMSG_SIZE);
+			batch->mmsgvec[i].msg_hdr.msg_controllen = UDP_BATCH_CMSG_SIZE;
+			batch->mmsgvec[i].msg_hdr.msg_flags = 0;
+			batch->mmsgvec[i].msg_len = 0;
+		}
+
+		ret = udp_recvmmsg(batch->sockfd, batch->mmsgvec, batch->num, MSG_DONTWAIT);
+		if (ret < 0) {
+			if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) return 0;
+
+			fr_strerror_printf("Failed reading socket: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		batch->count = ret;
+		if (!batch->count) return 0;
+	}
+
+	mmsg = &batch->mmsgvec[batch->current];
+	slen = mmsg->msg_len;
+
+	/*
+	 *	As with recvfrom(), data past the end of the callers
+	 *	buffer is discarded.
+	 */
+	if ((size_t) slen > data_len) slen = data_len;
+	memcpy(data, batch->iov[batch->current].iov_base, slen);
+
+	batch->current++;
+
+	if (fr_ipaddr_from_sockaddr(&socket_out->inet.src_ipaddr, &socket_out->inet.src_port,
+				    mmsg->msg_hdr.msg_name, mmsg->msg_hdr.msg_namelen) < 0) {
+		fr_strerror_const_push("Failed converting src sockaddr to ipaddr");
+		return -1;
+	}
+
+	/*
+	 *	Initialize the "to" address with the bound address,
+	 *	which gets us the port.  The IP address is then
+	 *	filled in from PKTINFO.
+	 */
+	memcpy(&dst, &batch->bound, sizeof(dst));
+	sizeof_dst = batch->sizeof_bound;
+
+	udpfromto_cmsg(&mmsg->msg_hdr, &socket_out->inet.ifindex, (struct sockaddr *) &dst, &sizeof_dst, when);
+
+	if (fr_ipaddr_from_sockaddr(&socket_out->inet.dst_ipaddr, &socket_out->inet.dst_port, &dst, sizeof_dst) < 0) {
+		fr_strerror_const_push("Failed converting dst sockaddr to ipaddr");
+		return -1;
+	}
+
+	/*
+	 *	We didn't get it from the kernel
+	 *	so use our own time source.
+	 */
+	if (when && !*when) *when = fr_time();
+
+	return slen;
+}
+
+/** Return the number of datagrams which have been read, but not yet returned
+ *
+ * @param[in] batch	to check.
+ * @return the number of buffered datagrams.
+ */
+unsigned int udp_batch_pending(udp_batch_t const *batch)
+{
+	return batch->count - batch->current;
+}
+
+struct udp_send_batch_s {
+	int			sockfd;			//!< we're writing to.
+	unsigned int		num;			//!< maximum number of queued datagrams.
+	unsigned int		count;			//!< number of datagrams queued.
+	unsigned int		current;		//!< first datagram which hasn't been sent.
+	size_t			max_packet_size;	//!< size of each datagram buffer.
+
+	bool			set_src;		//!< socket is bound to a wildcard address, so
+							///< we need to set the source address of each datagram.
+	bool			failed;			//!< a datagram was discarded since the last flush
+							///< which reported it.
+
+	uint8_t			*buffer;		//!< num * max_packet_size bytes of packet data
+	uint8_t			*cbuf;			//!< num * UDPFROMTO_CMSG_SRC_SIZE bytes of control data
+	struct iovec		*iov;			//!< one per datagram
+	struct sockaddr_storage	*dst;			//!< destination address of each datagram
+	struct mmsghdr		*mmsgvec;		//!< vector passed to sendmmsg()
+};
+
+/** Allocate a batch for writing multiple datagrams with one system call
+ *
+ * The socket must already be bound.  If it's bound to a specific
+ * address, the kernel will use that as the source address of the
+ * datagrams, and we don't need to add it to each message.
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] sockfd		we're writing to.
+ * @param[in] num		maximum number of datagrams to write at once.
+ * @param[in] max_packet_size	the largest datagram we send.
+ * @return
+ *	- NULL on error.
+ *	- a new batch on success.
+ */
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, int sockfd, unsigned int num, size_t max_packet_size)
+{
+	udp_send_batch_t	*batch;
+	struct sockaddr_storage	bound;
+	socklen_t		sizeof_bound = sizeof(bound);
+	unsigned int		i;
+
+	if (!num || !max_packet_size) {
+		fr_strerror_const("Invalid arguments");
+		return NULL;
+	}
+
+	if (getsockname(sockfd, (struct sockaddr *) &bound, &sizeof_bound) < 0) {
+		fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+		return NULL;
+	}
+
+	batch = talloc_zero(ctx, udp_send_batch_t);
+	if (!batch) {
+	nomem:
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+
+	batch->sockfd = sockfd;
+	batch->num = num;
+	batch->max_packet_size = max_packet_size;
+
+	switch (bound.ss_family) {
+	case AF_INET:
+		batch->set_src = (((struct sockaddr_in *) &bound)->sin_addr.s_addr == INADDR_ANY);
+		break;
+
+	case AF_INET6:
+		batch->set_src = IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *) &bound)->sin6_addr);
+		break;
+
+	default:
+		break;
+	}
+
+	batch->buffer = talloc_array(batch, uint8_t, num * max_packet_size);
+	batch->cbuf = talloc_array(batch, uint8_t, num * UDPFROMTO_CMSG_SRC_SIZE);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->dst = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->mmsgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	if (!batch->buffer || !batch->cbuf || !batch->iov || !batch->dst || !batch->mmsgvec) {
+		talloc_free(batch);
+		goto nomem;
+	}
+
+	for (i = 0; i < num; i++) {
+		batch->iov[i].iov_base = batch->buffer + (i * max_packet_size);
+
+		batch->mmsgvec[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->mmsgvec[i].msg_hdr.msg_iovlen = 1;
+		batch->mmsgvec[i].msg_hdr.msg_name = &batch->dst[i];
+	}
+
+	return batch;
+}
+
+/** Queue a UDP packet for sending
+ *
+ * The packet data is copied into the batch, so the caller can free
+ * its buffer as soon as this function returns.  If the batch is full,
+ * it is flushed first.
+ *
+ * @param[in] batch		to add the packet to.
+ * @param[in] socket		src/dst address of the packet, as for udp_send().
+ * @param[in] data		to send.
+ * @param[in] data_len		length of data to send.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  errno is EWOULDBLOCK if the batch is full, and the
+ *	  socket isn't writable.
+ */
+int udp_send_batch_queue(udp_send_batch_t *batch, fr_socket_t const *socket, void const *data, size_t data_len)
+{
+	struct msghdr		*msgh;
+	unsigned int		i;
+	struct sockaddr_storage	src;
+	socklen_t		sizeof_src;
+
+	if (unlikely(socket->proto != IPPROTO_UDP)) {
+		fr_strerror_printf("Invalid proto type %u", socket->proto);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (data_len > batch->max_packet_size) {
+		fr_strerror_printf("Packet is too large (%zu > %zu)", data_len, batch->max_packet_size);
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	/*
+	 *	Datagrams which fail with hard errors are discarded
+	 *	by the flush, so we only care if the socket is
+	 *	blocked, and we still have datagrams queued.
+	 */
+	if (batch->count == batch->num) {
+		int rcode;
+
+		rcode = udp_send_batch_flush(batch);
+		if (rcode > 0) {
+			fr_strerror_const("Send batch is full");
+			errno = EWOULDBLOCK;
+			return -1;
+		}
+
+		/*
+		 *	Let the caller's next flush report the
+		 *	datagrams which were discarded.
+		 */
+		if (rcode < 0) batch->failed = true;
+	}
+
+	i = batch->count;
+	msgh = &batch->mmsgvec[i].msg_hdr;
+
+	if (fr_ipaddr_to_sockaddr(&batch->dst[i], &msgh->msg_namelen,
+				  &socket->inet.dst_ipaddr, socket->inet.dst_port) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	msgh->msg_control = NULL;
+	msgh->msg_controllen = 0;
+	msgh->msg_flags = 0;
+
+	if (batch->set_src) {
+		uint8_t *cbuf = batch->cbuf + (i * UDPFROMTO_CMSG_SRC_SIZE);
+
+		if (fr_ipaddr_to_sockaddr(&src, &sizeof_src,
+					  &socket->inet.src_ipaddr, socket->inet.src_port) < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		memset(cbuf, 0, UDPFROMTO_CMSG_SRC_SIZE);
+		udpfromto_cmsg_src(msgh, cbuf, socket->inet.ifindex, (struct sockaddr *) &src);
+	}
+
+	memcpy(batch->iov[i].iov_base, data, data_len);
+	batch->iov[i].iov_len = data_len;
+	batch->mmsgvec[i].msg_len = 0;
+
+	batch->count++;
+
+	return 0;
+}
+
+/** Write all queued packets to the socket
+ *
+ * Datagrams which the kernel refuses for reasons other than the socket
+ * being blocked are discarded, so that one bad destination doesn't stall
+ * the rest of the batch.  The error for the last discarded datagram is
+ * left in the strerror buffer.
+ *
+ * @param[in] batch		to flush.
+ * @return
+ *	- 0 all packets were written.
+ *	- >0 the socket would block, and this many packets are still queued.
+ *	- -1 all packets were written or discarded, and one or more were
+ *	  discarded since the last flush which returned -1.
+ */
+int udp_send_batch_flush(udp_send_batch_t *batch)
+{
+	while (batch->current < batch->count) {
+		int ret;
+
+		ret = sendmmsg(batch->sockfd, &batch->mmsgvec[batch->current], batch->count - batch->current, 0);
+		if (ret < 0) {
+			if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) return batch->count - batch->current;
+
+			fr_strerror_printf("Failed sending packet: %s", fr_syserror(errno));
+			batch->failed = true;
+			ret = 1;	/* skip the datagram which failed */
+		}
+
+		batch->current += ret;
+	}
+
+	batch->current = batch->count = 0;
+
+	if (batch->failed) {
+		batch->failed = false;
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Return the number of datagrams which have been queued, but not yet sent
+ *
+ * @param[in] batch	to check.
+ * @return the number of queued datagrams.
+ */
+unsigned int udp_send_batch_pending(udp_send_batch_t const *batch)
+{
+	return batch->count - batch->current;
+}
@@ -46,6 +46,30 @@ ssize_t udp_recv_peek(int sockfd, void *data, size_t data_len, int flags, fr_ipa
 ssize_t udp_recv(int sockfd, int flags,
 		 fr_socket_t *socket_out, void *data, size_t data_len, fr_time_t *when);
 
+/** A batch of datagrams read from a socket with one recvmmsg() call
+ *
+ */
+typedef struct udp_batch_s udp_batch_t;
+
+udp_batch_t *udp_batch_alloc(TALLOC_CTX *ctx, int sockfd, unsigned int num, size_t max_packet_size);
+
+ssize_t udp_batch_recv(udp_batch_t *batch, fr_socket_t *socket_out, void *data, size_t data_len, fr_time_t *when);
+
+unsigned int udp_batch_pending(udp_batch_t const *batch);
+
+/** A batch of datagrams written to a socket with one sendmmsg() call
+ *
+ */
+typedef struct udp_send_batch_s udp_send_batch_t;
+
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, int sockfd, unsigned int num, size_t max_packet_size);
+
+int udp_send_batch_queue(udp_send_batch_t *batch, fr_socket_t const *socket, void const *data, size_t data_len);
+
+int udp_send_batch_flush(udp_send_batch_t *batch);
+
+unsigned int udp_send_batch_pending(udp_send_batch_t const *batch);
+
 #ifdef __cplusplus
 }
 #endif
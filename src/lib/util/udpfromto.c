@@ -162,6 +162,119 @@ int udpfromto_init(int s)
 	return setsockopt(s, proto, flag, &opt, sizeof(opt));
 }
 
+/** Process the control messages returned by recvmsg()
+ *
+ * Extracts the destination address, receiving interface, and kernel
+ * receive timestamp from the auxiliary data of a received datagram.
+ *
+ * @param[in] msgh	as populated by recvmsg() or recvmmsg().
+ * @param[out] ifindex	The interface which received the datagram (may be NULL).
+ * @param[in,out] to	The destination address.  Should be initialised
+ *			with the address the socket is bound to, the IP
+ *			address is overwritten with the more specific one
+ *			from the control messages.
+ * @param[out] to_len	Length of the structure pointed to by to.
+ * @param[out] when	the packet was received (may be NULL).  Set to 0
+ *			if the kernel didn't provide a timestamp.
+ */
+void udpfromto_cmsg(struct msghdr *msgh, int *ifindex, struct sockaddr *to, socklen_t *to_len, fr_time_t *when)
+{
+	struct cmsghdr		*cmsg;
+
+	if (ifindex) *ifindex = 0;
+	if (when) *when = 0;
+
+	/* Process auxiliary received data in msgh */
+	for (cmsg = CMSG_FIRSTHDR(msgh);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+
+#ifdef IP_PKTINFO
+		if ((cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == IP_PKTINFO)) {
+			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
+			*to_len = sizeof(struct sockaddr_in);
+
+			if (ifindex) *ifindex = i->ipi_ifindex;
+
+			continue;
+		}
+#endif
+
+#ifdef IP_RECVDSTADDR
+		if ((cmsg->cmsg_level == IPPROTO_IP) &&
+		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
+			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = *i;
+
+			*to_len = sizeof(struct sockaddr_in);
+
+			continue;
+		}
+#endif
+
+#ifdef IPV6_PKTINFO
+		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
+			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
+			*to_len = sizeof(struct sockaddr_in6);
+
+			if (ifindex) *ifindex = i->ipi6_ifindex;
+
+			continue;
+		}
+#endif
+
+#ifdef SCM_TIMESTAMPNS
+		if (when && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS)) {
+			struct timespec ts;
+
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			*when = fr_time_from_timespec(&ts);
+			continue;
+		}
+#endif
+
+#ifdef SO_TIMESTAMP
+		if (when && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
+			struct timeval tv;
+
+			memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+			*when = fr_time_from_timeval(&tv);
+		}
+#endif
+	}
+}
+
+/** Enable kernel receive timestamps on a socket
+ *
+ * Prefers nanosecond resolution (SO_TIMESTAMPNS) where it's available.
+ * The timestamps are returned via udpfromto_cmsg().
+ *
+ * @param[in] s		the socket.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, or if the platform doesn't support receive timestamps.
+ */
+int udpfromto_timestamp_init(int s)
+{
+	int opt = 1;
+
+#if defined(SO_TIMESTAMPNS)
+	return setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt));
+#elif defined(SO_TIMESTAMP)
+	return setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, &opt, sizeof(opt));
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 /** Read a packet from a file descriptor, retrieving additional header information
  *
  * Abstracts away the complexity of using the complexity of using recvmsg().
@@ -196,7 +309,6 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 	       fr_time_t *when)
 {
 	struct msghdr		msgh;
-	struct cmsghdr		*cmsg;
 	struct iovec		iov;
 	char			cbuf[256];
 	int			ret;
@@ -299,65 +411,86 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 
 	if (from_len) *from_len = msgh.msg_namelen;
 
-	if (ifindex) *ifindex = 0;
-	if (when) *when = 0;
+	udpfromto_cmsg(&msgh, ifindex, to, to_len, when);
 
-	/* Process auxiliary received data in msgh */
-	for (cmsg = CMSG_FIRSTHDR(&msgh);
-	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+	if (when && !*when) *when = fr_time();
 
-#ifdef IP_PKTINFO
-		if ((cmsg->cmsg_level == SOL_IP) &&
-		    (cmsg->cmsg_type == IP_PKTINFO)) {
-			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+	return ret;
+}
 
-			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
-			*to_len = sizeof(struct sockaddr_in);
+/** Add the source address and outbound interface to a message header
+ *
+ * Writes an IP_PKTINFO, IP_SENDSRCADDR or IPV6_PKTINFO control message
+ * into cbuf, and points the msghdr at it.  If the platform can't set the
+ * source address for the family of "from", the msghdr is left alone.
+ *
+ * @param[in,out] msgh		to add the control message to.
+ * @param[in] cbuf		zeroed control buffer, at least UDPFROMTO_CMSG_SRC_SIZE bytes.
+ * @param[in] ifindex		interface to send the packet on.
+ * @param[in] from		source address to use.
+ */
+void udpfromto_cmsg_src(struct msghdr *msgh, void *cbuf, int ifindex, struct sockaddr const *from)
+{
+# if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
+	if (from->sa_family == AF_INET) {
+		struct sockaddr_in const *s4 = (struct sockaddr_in const *) from;
 
-			if (ifindex) *ifindex = i->ipi_ifindex;
+#  ifdef IP_PKTINFO
+		struct cmsghdr *cmsg;
+		struct in_pktinfo *pkt;
 
-			break;
-		}
-#endif
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-#ifdef IP_RECVDSTADDR
-		if ((cmsg->cmsg_level == IPPROTO_IP) &&
-		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
-			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = SOL_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
 
-			((struct sockaddr_in *)to)->sin_addr = *i;
+		pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
+		memset(pkt, 0, sizeof(*pkt));
+		pkt->ipi_spec_dst = s4->sin_addr;
+		pkt->ipi_ifindex = ifindex;
 
-			*to_len = sizeof(struct sockaddr_in);
+#  elif defined(IP_SENDSRCADDR)
+		struct cmsghdr *cmsg;
+		struct in_addr *in;
 
-			break;
-		}
-#endif
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
 
-#ifdef IPV6_PKTINFO
-		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
-		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
-			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_SENDSRCADDR;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
 
-			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
-			*to_len = sizeof(struct sockaddr_in6);
+		in = (struct in_addr *) CMSG_DATA(cmsg);
+		*in = s4->sin_addr;
+#  endif
+	}
+#endif
 
-			if (ifindex) *ifindex = i->ipi6_ifindex;
+#  if defined(IPV6_PKTINFO)
+	if (from->sa_family == AF_INET6) {
+		struct sockaddr_in6 const *s6 = (struct sockaddr_in6 const *) from;
 
-			break;
-		}
-#endif
+		struct cmsghdr *cmsg;
+		struct in6_pktinfo *pkt;
 
-#ifdef SO_TIMESTAMP
-		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
-			*when = fr_time_from_timeval((struct timeval *)CMSG_DATA(cmsg));
-		}
-#endif
-	}
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-	if (when && !*when) *when = fr_time();
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
 
-	return ret;
+		pkt = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+		memset(pkt, 0, sizeof(*pkt));
+		pkt->ipi6_addr = s6->sin6_addr;
+		pkt->ipi6_ifindex = ifindex;
+	}
+#  endif	/* IPV6_PKTINFO */
 }
 
 /** Send packet via a file descriptor, setting the src address and outbound interface
@@ -455,66 +588,7 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 	msgh.msg_name = to;
 	msgh.msg_namelen = to_len;
 
-# if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
-	if (from->sa_family == AF_INET) {
-		struct sockaddr_in *s4 = (struct sockaddr_in *) from;
-
-#  ifdef IP_PKTINFO
-		struct cmsghdr *cmsg;
-		struct in_pktinfo *pkt;
-
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
-
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = SOL_IP;
-		cmsg->cmsg_type = IP_PKTINFO;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
-
-		pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
-		memset(pkt, 0, sizeof(*pkt));
-		pkt->ipi_spec_dst = s4->sin_addr;
-		pkt->ipi_ifindex = ifindex;
-
-#  elif defined(IP_SENDSRCADDR)
-		struct cmsghdr *cmsg;
-		struct in_addr *in;
-
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
-
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = IPPROTO_IP;
-		cmsg->cmsg_type = IP_SENDSRCADDR;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
-
-		in = (struct in_addr *) CMSG_DATA(cmsg);
-		*in = s4->sin_addr;
-#  endif
-	}
-#endif
-
-#  if defined(IPV6_PKTINFO)
-	if (from->sa_family == AF_INET6) {
-		struct sockaddr_in6 *s6 = (struct sockaddr_in6 *) from;
-
-		struct cmsghdr *cmsg;
-		struct in6_pktinfo *pkt;
-
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
-
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = IPPROTO_IPV6;
-		cmsg->cmsg_type = IPV6_PKTINFO;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
-
-		pkt = (struct in6_pktinfo *) CMSG_DATA(cmsg);
-		memset(pkt, 0, sizeof(*pkt));
-		pkt->ipi6_addr = s6->sin6_addr;
-		pkt->ipi6_ifindex = ifindex;
-	}
-#  endif	/* IPV6_PKTINFO */
+	udpfromto_cmsg_src(&msgh, cbuf, ifindex, from);
 
 	return sendmsg(fd, &msgh, flags);
 }
@@ -37,8 +37,20 @@ extern "C" {
 #include <stddef.h>
 #include <stdlib.h>
 
+/** Space needed for the control message written by udpfromto_cmsg_src()
+ */
+#define UDPFROMTO_CMSG_SRC_SIZE	64
+
 int	udpfromto_init(int s);
 
+int	udpfromto_timestamp_init(int s);
+
+void	udpfromto_cmsg(struct msghdr *msgh, int *ifindex,
+		       struct sockaddr *to, socklen_t *to_len,
+		       fr_time_t *when);
+
+void	udpfromto_cmsg_src(struct msghdr *msgh, void *cbuf, int ifindex, struct sockaddr const *from);
+
 int	recvfromto(int s, void *buf, size_t len, int flags,
 		   int *ifindex,
 	       	   struct sockaddr *from, socklen_t *fromlen,
@@ -43,6 +43,8 @@ typedef struct {
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	udp_batch_t			*batch;			//!< for reading multiple packets at once.
+
 	fr_stats_t			stats;			//!< statistics for this socket
 }  proto_dhcpv6_udp_thread_t;
 
@@ -63,6 +65,9 @@ typedef struct {
 	uint32_t			max_packet_size;	//!< for message ring buffer.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
+	uint32_t			recv_batch;		//!< Maximum number of packets to read with
+								///< one recvmmsg() call.
+
 	uint16_t			port;			//!< Port to listen on.
 
 	bool				multicast;		//!< whether or not we listen for multicast packets
@@ -99,6 +104,7 @@ static const CONF_PARSER udp_listen_config[] = {
 
 	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, proto_dhcpv6_udp_t, port), .dflt = "547"  },
 	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, proto_dhcpv6_udp_t, recv_buff) },
+	{ FR_CONF_OFFSET("recv_batch", FR_TYPE_UINT32, proto_dhcpv6_udp_t, recv_batch), .dflt = "1" },
 
 	{ FR_CONF_OFFSET("hop_limit", FR_TYPE_UINT32, proto_dhcpv6_udp_t, hop_limit) },
 
@@ -154,11 +160,21 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	address = *address_p;
 
 	/*
-	 *      Tell udp_recv if we're connected or not.
+	 *	Return the next packet from the batch, reading more
+	 *	from the socket only when the batch is empty.
 	 */
-	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
+	if (thread->batch) {
+		data_size = udp_batch_recv(thread->batch, &address->socket, buffer, buffer_len, recv_time_p);
+		li->read_pending = (udp_batch_pending(thread->batch) > 0);
+
+	} else {
+		/*
+		 *      Tell udp_recv if we're connected or not.
+		 */
+		flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+		data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	}
 	if (data_size < 0) {
 		RATE_LIMIT_GLOBAL(PERROR, "Read error (%zd)", data_size);
 		return data_size;
@@ -351,6 +367,19 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Connected sockets only ever have one client, so
+	 *	there's no point in batching reads.
+	 */
+	if ((inst->recv_batch > 1) && !thread->connection) {
+		thread->batch = udp_batch_alloc(thread, sockfd, inst->recv_batch, inst->max_packet_size);
+		if (!thread->batch) {
+			close(sockfd);
+			PERROR("Failed allocating receive batch");
+			goto error;
+		}
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_dhcpv6_udp,
@@ -558,6 +587,9 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 4);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, <=, 256);
+
 	if (!inst->port) {
 		struct servent *s;
 
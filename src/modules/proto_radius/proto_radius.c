@@ -221,9 +221,8 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 	 *	transport, via a call to fr_radius_ok().
 	 */
 	fr_cursor_init(&cursor, &request->request_pairs);
-	if (fr_radius_decode(request->packet, request->packet->data, request->packet->data_len,
-			     NULL, client->secret, talloc_array_length(client->secret) - 1,
-			     &cursor) < 0) {
+	if (fr_radius_decode_key(request->packet, request->packet->data, request->packet->data_len,
+				 NULL, client->secret, client->secret_key, &cursor) < 0) {
 		RPEDEBUG("Failed decoding packet");
 		return -1;
 	}
@@ -386,16 +385,17 @@ static ssize_t mod_encode(void const *instance, request_t *request, uint8_t *buf
 		request->reply->socket.inet.src_ipaddr = client->src_ipaddr;
 	}
 
-	data_len = fr_radius_encode(buffer, buffer_len, request->packet->data,
-				    client->secret, talloc_array_length(client->secret) - 1,
-				    request->reply->code, request->reply->id, &request->reply_pairs);
+	data_len = fr_radius_encode_key(buffer, buffer_len, request->packet->data,
+					client->secret, client->secret_key,
+					request->reply->code, request->reply->id, &request->reply_pairs);
 	if (data_len < 0) {
 		RPEDEBUG("Failed encoding RADIUS reply");
 		return -1;
 	}
 
-	if (fr_radius_sign(buffer, request->packet->data,
-			   (uint8_t const *) client->secret, talloc_array_length(client->secret) - 1) < 0) {
+	if (fr_radius_sign_key(buffer, request->packet->data,
+			       (uint8_t const *) client->secret, talloc_array_length(client->secret) - 1,
+			       client->secret_key) < 0) {
 		RPEDEBUG("Failed signing RADIUS reply");
 		return -1;
 	}
@@ -44,6 +44,9 @@ typedef struct {
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	udp_batch_t			*batch;			//!< for reading multiple packets at once.
+	udp_send_batch_t		*send_batch;		//!< for writing multiple replies at once.
+
 	fr_stats_t			stats;			//!< statistics for this socket
 } proto_radius_udp_thread_t;
 
@@ -61,12 +64,20 @@ typedef struct {
 	uint32_t			max_packet_size;	//!< for message ring buffer.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
+	uint32_t			recv_batch;		//!< Maximum number of packets to read with
+								///< one recvmmsg() call.
+	uint32_t			send_batch;		//!< Maximum number of replies to write with
+								///< one sendmmsg() call.
+
 	uint16_t			port;			//!< Port to listen on.
 
 	bool				recv_buff_is_set;	//!< Whether we were provided with a recv_buff
 	bool				send_buff_is_set;	//!< Whether we were provided with a send_buff
 	bool				dynamic_clients;	//!< whether we have dynamic clients
 	bool				dedup_authenticator;	//!< dedup using the request authenticator
+	bool				per_network_socket;	//!< open one socket per network thread.
+	bool				steer_by_source;	//!< steer packets to the per-network sockets
+								///< by source IP address.
 
 	RADCLIENT_LIST			*clients;		//!< local clients
 
@@ -97,6 +108,12 @@ static const CONF_PARSER udp_listen_config[] = {
 	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, proto_radius_udp_t, recv_buff) },
 	{ FR_CONF_OFFSET_IS_SET("send_buff", FR_TYPE_UINT32, proto_radius_udp_t, send_buff) },
 
+	{ FR_CONF_OFFSET("recv_batch", FR_TYPE_UINT32, proto_radius_udp_t, recv_batch), .dflt = "1" },
+	{ FR_CONF_OFFSET("send_batch", FR_TYPE_UINT32, proto_radius_udp_t, send_batch), .dflt = "1" },
+
+	{ FR_CONF_OFFSET("per_network_socket", FR_TYPE_BOOL, proto_radius_udp_t, per_network_socket), .dflt = "no" },
+	{ FR_CONF_OFFSET("steer_by_source", FR_TYPE_BOOL, proto_radius_udp_t, steer_by_source), .dflt = "yes" },
+
 	{ FR_CONF_OFFSET("accept_conflicting_packets", FR_TYPE_BOOL, proto_radius_udp_t, dedup_authenticator) } ,
 	{ FR_CONF_OFFSET("dynamic_clients", FR_TYPE_BOOL, proto_radius_udp_t, dynamic_clients) } ,
 	{ FR_CONF_POINTER("networks", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) networks_config },
@@ -130,11 +147,21 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	address = *address_p;
 
 	/*
-	 *      Tell udp_recv if we're connected or not.
+	 *	Return the next packet from the batch, reading more
+	 *	from the socket only when the batch is empty.
 	 */
-	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
+	if (thread->batch) {
+		data_size = udp_batch_recv(thread->batch, &address->socket, buffer, buffer_len, recv_time_p);
+		li->read_pending = (udp_batch_pending(thread->batch) > 0);
 
-	data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	} else {
+		/*
+		 *      Tell udp_recv if we're connected or not.
+		 */
+		flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
+
+		data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	}
 	if (data_size < 0) {
 		PDEBUG2("proto_radius_udp got read error");
 		return data_size;
@@ -235,7 +262,11 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 
 			memcpy(&packet, &track->reply, sizeof(packet)); /* const issues */
 
-			(void) udp_send(&socket, flags, packet, track->reply_len);
+			if (thread->send_batch) {
+				(void) udp_send_batch_queue(thread->send_batch, &socket, packet, track->reply_len);
+			} else {
+				(void) udp_send(&socket, flags, packet, track->reply_len);
+			}
 		}
 
 		return buffer_len;
@@ -246,6 +277,26 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	 */
 	fr_assert(buffer_len >= 20);
 
+	/*
+	 *	Queue the reply.  The network side calls mod_flush()
+	 *	once it has written all of the replies it has, and
+	 *	we send them all with one system call.
+	 *
+	 *	If the batch is full and the socket is blocked, tell
+	 *	the network side.  It keeps the reply, and writes it
+	 *	again once mod_flush() has emptied the batch.
+	 */
+	if (thread->send_batch) {
+		if (udp_send_batch_queue(thread->send_batch, &socket, buffer, buffer_len) < 0) {
+			if (errno == EWOULDBLOCK) return -1;
+
+			PERROR("Failed queueing reply");
+		}
+
+		data_size = buffer_len;
+		goto done;
+	}
+
 	/*
 	 *	Only write replies if they're RADIUS packets.
 	 *	sometimes we want to NOT send a reply...
@@ -257,6 +308,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	 */
 	if (data_size <= 0) return data_size;
 
+done:
 	/*
 	 *	Root through the reply to determine any
 	 *	connection-level negotiation data.
@@ -269,6 +321,23 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 }
 
 
+/** Send any replies which have been queued by mod_write()
+ *
+ * @return
+ *	- 0 all replies were sent.
+ *	- >0 the socket is blocked, and this many replies are still queued.
+ *	- <0 sendmmsg() failed for one or more replies.
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	if (!thread->send_batch) return 0;
+
+	return udp_send_batch_flush(thread->send_batch);
+}
+
+
 static int mod_connection_set(fr_listen_t *li, fr_io_address_t *connection)
 {
 	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
@@ -351,6 +420,38 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Ask the master IO handler to open one of these
+	 *	sockets for each network thread.  Connected sockets
+	 *	are already owned by one network.
+	 */
+	if (!thread->connection) {
+		li->per_network_socket = inst->per_network_socket;
+		li->steer_by_source = inst->steer_by_source;
+	}
+
+	/*
+	 *	Connected sockets only ever have one client, so
+	 *	there's no point in batching reads.
+	 */
+	if ((inst->recv_batch > 1) && !thread->connection) {
+		thread->batch = udp_batch_alloc(thread, sockfd, inst->recv_batch, inst->max_packet_size);
+		if (!thread->batch) {
+			close(sockfd);
+			PERROR("Failed allocating receive batch");
+			goto error;
+		}
+	}
+
+	if ((inst->send_batch > 1) && !thread->connection) {
+		thread->send_batch = udp_send_batch_alloc(thread, sockfd, inst->send_batch, inst->max_packet_size);
+		if (!thread->send_batch) {
+			close(sockfd);
+			PERROR("Failed allocating send batch");
+			goto error;
+		}
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_radius_udp,
@@ -453,6 +554,12 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 20);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, <=, 256);
+
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, <=, 256);
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -542,6 +649,7 @@ fr_app_io_t proto_radius_udp = {
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.fd_set			= mod_fd_set,
 	.track			= mod_track_create,
 	.compare		= mod_compare,
@@ -467,9 +467,10 @@ static virtual_server_compile_t compile_list[] = {
 	COMPILE_TERMINATOR
 };
 
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *process_app_cs)
+static int mod_instantiate(void *instance, CONF_SECTION *process_app_cs)
 {
 	proto_tacacs_auth_t	*inst = instance;
+	CONF_SECTION		*server_cs;
 
 	/*
 	 *	Usually we use the 'State' attribute. But, in this
@@ -481,6 +482,17 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *process_app_cs)
 	inst->state_tree = fr_state_tree_init(inst, attr_tacacs_state, main_config->spawn_workers, inst->max_session,
 					      inst->session_timeout, inst->state_server_id);
 
+	/*
+	 *	We're in a "listen" section, which is in a "server".
+	 */
+	server_cs = cf_item_to_section(cf_parent(cf_parent(process_app_cs)));
+	if (server_cs && (strcmp(cf_section_name1(server_cs), "server") != 0)) server_cs = NULL;
+
+	if (fr_state_tree_register_stats(inst->state_tree, server_cs ? cf_section_name2(server_cs) : NULL) < 0) {
+		cf_log_perr(process_app_cs, "Failed registering radmin commands for session state");
+		return -1;
+	}
+
 	return 0;
 }
 
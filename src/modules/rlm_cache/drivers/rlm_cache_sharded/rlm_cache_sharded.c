@@ -0,0 +1,606 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_sharded.c
+ * @brief Sharded in-memory cache.
+ *
+ * Entries are spread over a number of shards by the hash of their key.
+ * Each shard has its own hash table, expiry heap, LRU list and
+ * reader/writer lock, so lookups in different shards never contend,
+ * and lookups in the same shard run concurrently.
+ *
+ * Entries are reference counted.  A lookup takes a reference under
+ * the shard's read lock, and drops the lock immediately.  The reference
+ * is released by rlm_cache via our "free" callback, so an entry which
+ * is expired or evicted by another thread stays valid until every
+ * request using it is done with it.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/command.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/heap.h>
+#include "../../rlm_cache.h"
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** A single shard of the cache
+ *
+ */
+typedef struct {
+	pthread_rwlock_t	lock;		//!< Readers for lookups, writers for everything else.
+
+	fr_hash_table_t		*cache;		//!< Hash table for looking up cache keys.
+	fr_heap_t		*heap;		//!< For managing entry expiry.
+	fr_dlist_head_t		lru;		//!< Entries, most recently inserted first.
+
+	uint32_t		max_entries;	//!< Maximum number of entries in this shard.
+
+	atomic_uint_fast64_t	hits;		//!< Lookups which found an entry.
+	atomic_uint_fast64_t	misses;		//!< Lookups which didn't find an entry.
+	atomic_uint_fast64_t	inserts;	//!< Entries added.
+	atomic_uint_fast64_t	expired;	//!< Entries removed because their TTL passed.
+	atomic_uint_fast64_t	evictions;	//!< Entries removed to make room for new ones.
+} rlm_cache_shard_t;
+
+typedef struct {
+	uint32_t		num_shards;	//!< How many shards to split the cache into.
+
+	rlm_cache_shard_t	*shards;	//!< Array of shards.
+
+	atomic_uint_fast32_t	num_entries;	//!< Total entries across all shards.
+} rlm_cache_sharded_t;
+
+typedef struct {
+	rlm_cache_entry_t	fields;		//!< Entry data.
+
+	uint32_t		hash;		//!< Hash of the key.
+	fr_unix_time_t		heap_expires;	//!< Copy of fields.expires used by the heap.
+						///< rlm_cache updates fields.expires without
+						///< holding our lock.
+	int32_t			heap_id;	//!< Offset used for heap.
+	fr_dlist_t		entry;		//!< Entry in the shard's LRU list.
+	bool			in_cache;	//!< Whether the entry is in a shard.
+
+	atomic_bool		referenced;	//!< Entry was found since the last eviction pass.
+	atomic_uint_fast32_t	refs;		//!< The shard holds one, each request using it another.
+} rlm_cache_sharded_entry_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", FR_TYPE_UINT32, rlm_cache_sharded_t, num_shards), .dflt = "16" },
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_sharded_entry_t const *c = data;
+
+	return c->hash;
+}
+
+/** Compare two entries by key
+ *
+ * There may only be one entry with the same key.
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Compare two entries by expiry time
+ *
+ * There may be multiple entries with the same expiry time.
+ */
+static int8_t cache_heap_cmp(void const *one, void const *two)
+{
+	rlm_cache_sharded_entry_t const *a = one, *b = two;
+
+	return (a->heap_expires > b->heap_expires) - (a->heap_expires < b->heap_expires);
+}
+
+/** Pick the shard for a key
+ *
+ * The hash tables use the low bits of the hash for their buckets, so
+ * we use the high bits to pick the shard.
+ */
+static inline CC_HINT(always_inline) rlm_cache_shard_t *cache_shard(rlm_cache_sharded_t const *driver, uint32_t hash)
+{
+	return &driver->shards[((uint64_t) hash * driver->num_shards) >> 32];
+}
+
+/** Drop a reference to an entry, freeing it if it was the last one
+ *
+ * @copydetails cache_entry_free_t
+ */
+static void cache_entry_free(rlm_cache_entry_t *c)
+{
+	rlm_cache_sharded_entry_t *e = (rlm_cache_sharded_entry_t *)c;
+
+	if (atomic_fetch_sub_explicit(&e->refs, 1, memory_order_acq_rel) == 1) talloc_free(e);
+}
+
+/** Remove an entry from its shard
+ *
+ * Must be called with the shard write locked.
+ */
+static void cache_shard_remove(rlm_cache_sharded_t *driver, rlm_cache_shard_t *shard, rlm_cache_sharded_entry_t *e)
+{
+	fr_assert(e->in_cache);
+
+	fr_hash_table_delete(shard->cache, e);
+	fr_heap_extract(shard->heap, e);
+	fr_dlist_remove(&shard->lru, e);
+	e->in_cache = false;
+
+	atomic_fetch_sub_explicit(&driver->num_entries, 1, memory_order_relaxed);
+
+	cache_entry_free(&e->fields);
+}
+
+/** Remove expired entries, and evict entries until there's room for one more
+ *
+ * Eviction is approximately LRU.  Entries are kept in insertion order.
+ * An entry which has been found since the last pass gets a second chance,
+ * and goes back to the head of the list.  Otherwise the oldest entry is
+ * evicted.
+ *
+ * Must be called with the shard write locked.
+ */
+static void cache_shard_make_room(rlm_cache_sharded_t *driver, rlm_cache_shard_t *shard, fr_unix_time_t now)
+{
+	rlm_cache_sharded_entry_t	*e;
+	uint32_t			skipped = 0;
+
+	while ((e = fr_heap_peek(shard->heap)) && (e->heap_expires < now)) {
+		cache_shard_remove(driver, shard, e);
+		atomic_fetch_add_explicit(&shard->expired, 1, memory_order_relaxed);
+	}
+
+	if (!shard->max_entries) return;
+
+	while (fr_dlist_num_elements(&shard->lru) >= shard->max_entries) {
+		e = fr_dlist_tail(&shard->lru);
+
+		/*
+		 *	After a full pass every entry has lost its
+		 *	referenced flag, so this loop always ends.
+		 */
+		if (atomic_exchange_explicit(&e->referenced, false, memory_order_relaxed) &&
+		    (skipped++ < shard->max_entries)) {
+			fr_dlist_remove(&shard->lru, e);
+			fr_dlist_insert_head(&shard->lru, e);
+			continue;
+		}
+
+		cache_shard_remove(driver, shard, e);
+		atomic_fetch_add_explicit(&shard->evictions, 1, memory_order_relaxed);
+	}
+}
+
+/** Cleanup a cache_sharded instance
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_sharded_t	*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	uint32_t		i;
+
+	if (!driver->shards) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_shard_t		*shard = &driver->shards[i];
+		rlm_cache_sharded_entry_t	*e;
+
+		/*
+		 *	No requests are running, so the shard
+		 *	holds the only reference to each entry.
+		 */
+		while ((e = fr_dlist_head(&shard->lru))) {
+			fr_dlist_remove(&shard->lru, e);
+			talloc_free(e);
+		}
+
+		pthread_rwlock_destroy(&shard->lock);
+	}
+
+	return 0;
+}
+
+static int cmd_show_cache(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
+{
+	rlm_cache_sharded_t const	*driver = ctx;
+	uint32_t			i;
+	uint64_t			hits = 0, misses = 0, inserts = 0, expired = 0, evictions = 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_shard_t *shard = &driver->shards[i];
+		uint64_t s_hits, s_misses, s_inserts, s_expired, s_evictions;
+
+		s_hits = atomic_load_explicit(&shard->hits, memory_order_relaxed);
+		s_misses = atomic_load_explicit(&shard->misses, memory_order_relaxed);
+		s_inserts = atomic_load_explicit(&shard->inserts, memory_order_relaxed);
+		s_expired = atomic_load_explicit(&shard->expired, memory_order_relaxed);
+		s_evictions = atomic_load_explicit(&shard->evictions, memory_order_relaxed);
+
+		hits += s_hits;
+		misses += s_misses;
+		inserts += s_inserts;
+		expired += s_expired;
+		evictions += s_evictions;
+
+		if ((info->argc == 0) || (strcmp(info->argv[0], "shards") != 0)) continue;
+
+		fprintf(fp, "shard.%u.hits\t\t\t%" PRIu64 "\n", i, s_hits);
+		fprintf(fp, "shard.%u.misses\t\t\t%" PRIu64 "\n", i, s_misses);
+		fprintf(fp, "shard.%u.inserts\t\t%" PRIu64 "\n", i, s_inserts);
+		fprintf(fp, "shard.%u.expired\t\t%" PRIu64 "\n", i, s_expired);
+		fprintf(fp, "shard.%u.evictions\t\t%" PRIu64 "\n", i, s_evictions);
+	}
+
+	fprintf(fp, "entries\t\t\t\t%" PRIuFAST32 "\n", atomic_load_explicit(&driver->num_entries, memory_order_relaxed));
+	fprintf(fp, "hits\t\t\t\t%" PRIu64 "\n", hits);
+	fprintf(fp, "misses\t\t\t\t%" PRIu64 "\n", misses);
+	fprintf(fp, "inserts\t\t\t\t%" PRIu64 "\n", inserts);
+	fprintf(fp, "expired\t\t\t\t%" PRIu64 "\n", expired);
+	fprintf(fp, "evictions\t\t\t%" PRIu64 "\n", evictions);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "cache",
+		.syntax = "[shards]",
+		.func = cmd_show_cache,
+		.help = "Show hit, miss, and eviction counters for a sharded cache.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+
+/** Create a new cache_sharded instance
+ *
+ * @param instance	A uint8_t array of inst_size if inst_size > 0, else NULL,
+ *			this should contain the result of parsing the driver's
+ *			CONF_PARSER array that it specified in the interface struct.
+ * @param conf		section holding driver specific #CONF_PAIR (s).
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_cache_sharded_t		*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	rlm_cache_config_t const	*config = dl_module_parent_data_by_child_data(instance);
+	uint32_t			i;
+
+	fr_assert(config);
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, 1024);
+
+	/*
+	 *	No point in having shards which can't hold anything.
+	 */
+	if (config->max_entries && (driver->num_shards > config->max_entries)) {
+		cf_log_warn(conf, "Ignoring \"shards = %u\", forcing to \"shards = %u\" (max_entries)",
+			    driver->num_shards, config->max_entries);
+		driver->num_shards = config->max_entries;
+	}
+
+	driver->shards = talloc_zero_array(driver, rlm_cache_shard_t, driver->num_shards);
+	if (!driver->shards) {
+		ERROR("Failed allocating cache shards");
+		return -1;
+	}
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_shard_t *shard = &driver->shards[i];
+
+		shard->cache = fr_hash_table_create(driver->shards, cache_entry_hash, cache_entry_cmp, NULL);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+
+		shard->heap = fr_heap_talloc_alloc(driver->shards, cache_heap_cmp, rlm_cache_sharded_entry_t, heap_id);
+		if (!shard->heap) {
+			ERROR("Failed to create heap for the cache");
+			return -1;
+		}
+
+		fr_dlist_talloc_init(&shard->lru, rlm_cache_sharded_entry_t, entry);
+
+		/*
+		 *	Round down, so that the total never exceeds
+		 *	max_entries, and rlm_cache never refuses an
+		 *	insert because the cache is full.
+		 */
+		if (config->max_entries) shard->max_entries = config->max_entries / driver->num_shards;
+
+		if (pthread_rwlock_init(&shard->lock, NULL) != 0) {
+			ERROR("Failed initializing lock: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	if (fr_command_register_hook(NULL, config->name, driver, cmd_table) < 0) {
+		PERROR("Failed registering radmin commands for cache %s", config->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    request_t *request)
+{
+	rlm_cache_sharded_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_sharded_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+	c->heap_id = -1;
+	atomic_init(&c->refs, 1);	/* The caller's reference */
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * Only takes the shard's read lock, so lookups can run concurrently.
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       UNUSED request_t *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_sharded_t		*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	rlm_cache_sharded_entry_t	find, *e;
+	rlm_cache_shard_t		*shard;
+
+	find = (rlm_cache_sharded_entry_t){
+		.fields = { .key = key, .key_len = key_len },
+		.hash = fr_hash(key, key_len)
+	};
+	shard = cache_shard(driver, find.hash);
+
+	/*
+	 *	fr_hash_table_find_by_data() may initialise buckets,
+	 *	which isn't safe with other readers in the shard.
+	 */
+	pthread_rwlock_rdlock(&shard->lock);
+	e = fr_hash_table_find_by_data_read_only(shard->cache, &find);
+	if (!e) {
+		pthread_rwlock_unlock(&shard->lock);
+		atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	/*
+	 *	Take a reference before dropping the lock, so
+	 *	the entry can't be freed while the request is
+	 *	using it.
+	 */
+	atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
+	atomic_store_explicit(&e->referenced, true, memory_order_relaxed);
+	pthread_rwlock_unlock(&shard->lock);
+
+	atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+	*out = &e->fields;
+
+	return CACHE_OK;
+}
+
+/** Remove an entry from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 request_t *request, UNUSED void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_sharded_t		*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	rlm_cache_sharded_entry_t	find, *e;
+	rlm_cache_shard_t		*shard;
+
+	if (!request) return CACHE_ERROR;
+
+	find = (rlm_cache_sharded_entry_t){
+		.fields = { .key = key, .key_len = key_len },
+		.hash = fr_hash(key, key_len)
+	};
+	shard = cache_shard(driver, find.hash);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	e = fr_hash_table_find_by_data(shard->cache, &find);
+	if (!e) {
+		pthread_rwlock_unlock(&shard->lock);
+		return CACHE_MISS;
+	}
+
+	cache_shard_remove(driver, shard, e);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * Overwrites any existing entry with the same key, and evicts entries
+ * if the shard is full.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
+					 request_t *request, UNUSED void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_sharded_t		*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	rlm_cache_sharded_entry_t	*e, *old;
+	rlm_cache_shard_t		*shard;
+
+	if (!request) return CACHE_ERROR;
+
+	memcpy(&e, &c, sizeof(e));
+
+	e->hash = fr_hash(e->fields.key, e->fields.key_len);
+	shard = cache_shard(driver, e->hash);
+
+	pthread_rwlock_wrlock(&shard->lock);
+
+	/*
+	 *	Allow overwriting
+	 */
+	old = fr_hash_table_find_by_data(shard->cache, e);
+	if (old) cache_shard_remove(driver, shard, old);
+
+	cache_shard_make_room(driver, shard, fr_time_to_unix_time(request->packet->timestamp));
+
+	e->heap_expires = e->fields.expires;
+	if (fr_heap_insert(shard->heap, e) < 0) {
+		pthread_rwlock_unlock(&shard->lock);
+		RERROR("Failed adding entry to expiry heap");
+		return CACHE_ERROR;
+	}
+
+	if (!fr_hash_table_insert(shard->cache, e)) {
+		fr_heap_extract(shard->heap, e);
+		pthread_rwlock_unlock(&shard->lock);
+		RERROR("Failed adding entry");
+		return CACHE_ERROR;
+	}
+
+	fr_dlist_insert_head(&shard->lru, e);
+	e->in_cache = true;
+	atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);	/* The shard's reference */
+
+	pthread_rwlock_unlock(&shard->lock);
+
+	atomic_fetch_add_explicit(&driver->num_entries, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&shard->inserts, 1, memory_order_relaxed);
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(rlm_cache_config_t const *config, void *instance,
+					  request_t *request, void *handle,
+					  rlm_cache_entry_t *c)
+{
+	rlm_cache_sharded_t		*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	rlm_cache_sharded_entry_t	*e = (rlm_cache_sharded_entry_t *)c;
+	rlm_cache_shard_t		*shard;
+
+	if (!request) return CACHE_ERROR;
+
+	shard = cache_shard(driver, e->hash);
+
+	pthread_rwlock_wrlock(&shard->lock);
+
+	/*
+	 *	Another request removed the entry after we found
+	 *	it.  Put it back, with the new TTL.
+	 */
+	if (!e->in_cache) {
+		pthread_rwlock_unlock(&shard->lock);
+		return cache_entry_insert(config, instance, request, handle, c);
+	}
+
+	if (!fr_cond_assert(fr_heap_extract(shard->heap, e) == 0)) {
+		pthread_rwlock_unlock(&shard->lock);
+		RERROR("Entry not in heap");
+		return CACHE_ERROR;
+	}
+
+	e->heap_expires = e->fields.expires;
+	if (fr_heap_insert(shard->heap, e) < 0) {
+		fr_hash_table_delete(shard->cache, e);
+		fr_dlist_remove(&shard->lru, e);
+		e->in_cache = false;
+		atomic_fetch_sub_explicit(&driver->num_entries, 1, memory_order_relaxed);
+		pthread_rwlock_unlock(&shard->lock);
+
+		cache_entry_free(c);	/* The shard's reference */
+		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
+		return CACHE_ERROR;
+	}
+
+	pthread_rwlock_unlock(&shard->lock);
+
+	return CACHE_OK;
+}
+
+/** Return the number of entries in the cache
+ *
+ * @copydetails cache_entry_count_t
+ */
+static uint32_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *instance,
+				  UNUSED request_t *request, UNUSED void *handle)
+{
+	rlm_cache_sharded_t *driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+
+	return atomic_load_explicit(&driver->num_entries, memory_order_relaxed);
+}
+
+extern rlm_cache_driver_t rlm_cache_sharded;
+rlm_cache_driver_t rlm_cache_sharded = {
+	.name		= "rlm_cache_sharded",
+	.magic		= RLM_MODULE_INIT,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_sharded_t),
+	.config		= driver_config,
+	.alloc		= cache_entry_alloc,
+	.free		= cache_entry_free,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+	.count		= cache_entry_count,
+};
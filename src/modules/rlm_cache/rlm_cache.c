@@ -36,6 +36,33 @@ RCSID("$Id$")
 
 extern module_t rlm_cache;
 
+/** An entry in a worker's local cache
+ *
+ * Wraps an entry retrieved from the driver.  The entry is owned by the local
+ * cache until it's evicted, at which point it's released with cache_free().
+ */
+typedef struct {
+	rlm_cache_entry_t	*c;			//!< Deserialised entry retrieved from the driver.
+	fr_unix_time_t		expires;		//!< When the local copy must be discarded.
+							///< Never later than c->expires.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+} rlm_cache_local_t;
+
+/** Per-worker state
+ *
+ */
+typedef struct {
+	rlm_cache_t const	*inst;			//!< Instance we belong to.
+	rbtree_t		*tree;			//!< Local entries, keyed by cache key.
+	fr_dlist_head_t		lru;			//!< Most recently used entry at the head.
+} rlm_cache_thread_t;
+
+static const CONF_PARSER local_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_cache_config_t, local_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("ttl", FR_TYPE_UINT32, rlm_cache_config_t, local_ttl), .dflt = "5" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", FR_TYPE_STRING, rlm_cache_config_t, driver_name), .dflt = "rlm_cache_rbtree" },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_cache_config_t, key) },
@@ -45,6 +72,7 @@ static const CONF_PARSER module_config[] = {
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ FR_CONF_OFFSET("epoch", FR_TYPE_INT32, rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", FR_TYPE_BOOL, rlm_cache_config_t, stats), .dflt = "no" },
+	{ FR_CONF_POINTER("local", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) local_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -146,6 +174,151 @@ static void cache_free(rlm_cache_t const *inst, rlm_cache_entry_t **c)
 	*c = NULL;
 }
 
+/** Compare two local entries by key
+ *
+ */
+static int cache_local_cmp(void const *one, void const *two)
+{
+	rlm_cache_local_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->c->key_len > b->c->key_len) - (a->c->key_len < b->c->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->c->key, b->c->key, a->c->key_len);
+}
+
+/** Remove an entry from the local cache, returning the driver entry it wrapped
+ *
+ */
+static rlm_cache_entry_t *cache_local_remove(rlm_cache_thread_t *t, rlm_cache_local_t *local)
+{
+	rlm_cache_entry_t *c = local->c;
+
+	rbtree_deletebydata(t->tree, local);
+	fr_dlist_remove(&t->lru, local);
+	talloc_free(local);
+
+	return c;
+}
+
+/** Lookup an entry in the worker's local cache
+ *
+ * Entries past their local expiry are discarded, and the lookup treated as a miss.
+ *
+ * @param[in] t		Thread specific data.
+ * @param[in] request	The current request.
+ * @param[in] key	to lookup.
+ * @param[in] key_len	Length of key.
+ * @return
+ *	- The cache entry.  This remains owned by the local cache.
+ *	- NULL if no valid entry was found.
+ */
+static rlm_cache_entry_t *cache_local_find(rlm_cache_thread_t *t, request_t *request,
+					   uint8_t const *key, size_t key_len)
+{
+	rlm_cache_entry_t	find_c = { .key = key, .key_len = key_len };
+	rlm_cache_local_t	find = { .c = &find_c }, *local;
+	rlm_cache_entry_t	*c;
+
+	local = rbtree_finddata(t->tree, &find);
+	if (!local) return NULL;
+
+	if (local->expires < fr_time_to_unix_time(request->packet->timestamp)) {
+		RDEBUG3("Local entry for \"%pV\" expired, discarding it",
+			fr_box_strvalue_len((char const *)key, key_len));
+		c = cache_local_remove(t, local);
+		cache_free(t->inst, &c);
+		return NULL;
+	}
+
+	fr_dlist_remove(&t->lru, local);
+	fr_dlist_insert_head(&t->lru, local);
+
+	return local->c;
+}
+
+/** Drop any local entry for a key
+ *
+ * Used when the entry is expired or overwritten by this worker, so that we
+ * don't continue serving the old version.
+ *
+ * @param[in] t		Thread specific data.
+ * @param[in] key	to invalidate.
+ * @param[in] key_len	Length of key.
+ * @param[in] in_use	Entry the caller is currently using, if it was retrieved
+ *			from the local cache.  If this is the entry removed,
+ *			ownership is transferred to the caller.
+ * @return
+ *	- true if ownership of in_use was transferred to the caller.
+ *	- false otherwise.
+ */
+static bool cache_local_invalidate(rlm_cache_thread_t *t, uint8_t const *key, size_t key_len,
+				   rlm_cache_entry_t *in_use)
+{
+	rlm_cache_entry_t	find_c = { .key = key, .key_len = key_len };
+	rlm_cache_local_t	find = { .c = &find_c }, *local;
+	rlm_cache_entry_t	*c;
+
+	if (!t->inst->config.local_max_entries) return false;
+
+	local = rbtree_finddata(t->tree, &find);
+	if (!local) return false;
+
+	c = cache_local_remove(t, local);
+	if (c == in_use) return true;
+
+	cache_free(t->inst, &c);
+	return false;
+}
+
+/** Hand an entry retrieved from the driver to the worker's local cache
+ *
+ * The local cache takes ownership of the entry, evicting the least recently
+ * used entry if it's full.
+ *
+ * @param[in] t		Thread specific data.
+ * @param[in] request	The current request.
+ * @param[in,out] c	Entry to add.  Will be set to NULL.
+ */
+static void cache_local_insert(rlm_cache_thread_t *t, request_t *request, rlm_cache_entry_t **c)
+{
+	rlm_cache_t const	*inst = t->inst;
+	rlm_cache_local_t	*local;
+	fr_unix_time_t		now = fr_time_to_unix_time(request->packet->timestamp);
+
+	if ((*c)->expires <= now) {
+		cache_free(inst, c);
+		return;
+	}
+
+	(void)cache_local_invalidate(t, (*c)->key, (*c)->key_len, NULL);
+
+	if (rbtree_num_elements(t->tree) >= inst->config.local_max_entries) {
+		rlm_cache_entry_t *evicted;
+
+		local = fr_dlist_tail(&t->lru);
+		fr_assert(local);
+
+		evicted = cache_local_remove(t, local);
+		cache_free(inst, &evicted);
+	}
+
+	MEM(local = talloc_zero(t, rlm_cache_local_t));
+	local->c = *c;
+	local->expires = now + fr_unix_time_from_sec(inst->config.local_ttl);
+	if (local->expires > local->c->expires) local->expires = local->c->expires;
+
+	if (!rbtree_insert(t->tree, local)) {
+		talloc_free(local);
+		cache_free(inst, c);
+		return;
+	}
+	fr_dlist_insert_head(&t->lru, local);
+
+	*c = NULL;
+}
+
 /** Merge a cached entry into a #request_t
  *
  * @return
@@ -184,7 +357,7 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, request_t *request, rlm_
 	if (inst->config.stats) {
 		fr_assert(request->packet != NULL);
 		MEM(pair_update_request(&vp, attr_cache_entry_hits) >= 0);
-		vp->vp_uint32 = c->hits;
+		vp->vp_uint32 = atomic_load_explicit(&c->hits, memory_order_relaxed);
 	}
 
 	return merged > 0 ?
@@ -194,13 +367,26 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, request_t *request, rlm_
 
 /** Find a cached entry.
  *
+ * If the worker has a local cache, that's checked first, and the driver is
+ * only consulted on a local miss.
+ *
+ * @param[out] p_result	Result of the lookup.
+ * @param[out] out	Where to write the entry.
+ * @param[out] local	Set to true if the entry is owned by the local cache,
+ *			and must not be freed by the caller.
+ * @param[in] inst	Module instance.
+ * @param[in] t		Thread specific data.  May be NULL to bypass the local cache.
+ * @param[in] request	The current request.
+ * @param[in] handle	Driver handle.
+ * @param[in] key	to lookup.
+ * @param[in] key_len	Length of key.
  * @return
  *	- #RLM_MODULE_OK on cache hit.
  *	- #RLM_MODULE_FAIL on failure.
  *	- #RLM_MODULE_NOTFOUND on cache miss.
  */
-static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out,
-				  rlm_cache_t const *inst, request_t *request,
+static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out, bool *local,
+				  rlm_cache_t const *inst, rlm_cache_thread_t *t, request_t *request,
 				  rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
 {
 	cache_status_t ret;
@@ -208,6 +394,20 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 	rlm_cache_entry_t *c;
 
 	*out = NULL;
+	*local = false;
+
+	if (t && inst->config.local_max_entries) {
+		c = cache_local_find(t, request, key, key_len);
+		if (c) {
+			RDEBUG2("Found local entry for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
+
+			atomic_fetch_add_explicit(&c->hits, 1, memory_order_relaxed);
+			*out = c;
+			*local = true;
+
+			RETURN_MODULE_OK;
+		}
+	}
 
 	for (;;) {
 		ret = inst->driver->find(&c, &inst->config, inst->driver_inst->dl_inst->data, request, *handle, key, key_len);
@@ -250,7 +450,7 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 
 	RDEBUG2("Found entry for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
 
-	c->hits++;
+	atomic_fetch_add_explicit(&c->hits, 1, memory_order_relaxed);
 	*out = c;
 
 	RETURN_MODULE_OK;
@@ -539,7 +739,9 @@ static int cache_verify(map_t *map, void *ctx)
 static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_cache_entry_t	*c = NULL;
+	bool			local = false;
 	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
 
 	rlm_cache_handle_t	*handle;
 
@@ -581,7 +783,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 			RETURN_MODULE_FAIL;
 		}
 
-		cache_find(&rcode, &c, inst, request, &handle, key, key_len);
+		cache_find(&rcode, &c, &local, inst, t, request, &handle, key, key_len);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
 		fr_assert(!inst->driver->acquire || handle);
 
@@ -628,7 +830,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	 *	recording whether the entry existed.
 	 */
 	if (merge) {
-		cache_find(&rcode, &c, inst, request, &handle, key, key_len);
+		cache_find(&rcode, &c, &local, inst, t, request, &handle, key, key_len);
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 			goto finish;
@@ -661,6 +863,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 			rlm_rcode_t tmp;
 
 			fr_assert(!set_ttl);
+			if (cache_local_invalidate(t, key, key_len, local ? c : NULL)) local = false;
 			cache_expire(&tmp, inst, request, &handle, key, key_len);
 			switch (tmp) {
 			case RLM_MODULE_FAIL:
@@ -693,7 +896,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	if ((exists < 0) && (insert || set_ttl)) {
 		rlm_rcode_t tmp;
 
-		cache_find(&tmp, &c, inst, request, &handle, key, key_len);
+		cache_find(&tmp, &c, &local, inst, t, request, &handle, key, key_len);
 		switch (tmp) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
@@ -749,6 +952,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	if (insert && (exists == 0)) {
 		rlm_rcode_t tmp;
 
+		if (cache_local_invalidate(t, key, key_len, local ? c : NULL)) local = false;
 		cache_insert(&tmp, inst, request, &handle, key, key_len, ttl);
 		switch (tmp) {
 		case RLM_MODULE_FAIL:
@@ -772,6 +976,16 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 
 
 finish:
+	/*
+	 *	Entries we retrieved from the driver, which are still
+	 *	current, are handed to the local cache.  Entries which
+	 *	came from the local cache remain owned by it.
+	 */
+	if (local) {
+		c = NULL;
+	} else if (c && inst->config.local_max_entries && (exists != 0)) {
+		cache_local_insert(t, request, &c);
+	}
 	cache_free(inst, &c);
 	cache_release(inst, request, &handle);
 
@@ -814,7 +1028,9 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 			  request_t *request, char const *fmt)
 {
 	rlm_cache_entry_t 	*c = NULL;
+	bool			local = false;
 	rlm_cache_t const	*inst = mod_inst;
+	rlm_cache_thread_t	*t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_cache_thread_t);
 	rlm_cache_handle_t	*handle = NULL;
 
 	ssize_t			slen;
@@ -849,19 +1065,22 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 		return -1;
 	}
 
-	cache_find(&rcode, &c, mod_inst, request, &handle, key, key_len);
+	cache_find(&rcode, &c, &local, mod_inst, t, request, &handle, key, key_len);
 	switch (rcode) {
 	case RLM_MODULE_OK:		/* found */
 		break;
 
 	case RLM_MODULE_NOTFOUND:	/* not found */
-		return 0;
+		goto finish;
 
 	default:
-		talloc_free(target);
-		return -1;
+		ret = -1;
+		goto finish;
 	}
 
+	/*
+	 *	If there's no matching map, we return 0.
+	 */
 	for (map = c->maps; map; map = map->next) {
 		if ((tmpl_da(map->lhs) != tmpl_da(target)) ||
 		    (tmpl_list(map->lhs) != tmpl_list(target))) continue;
@@ -871,13 +1090,18 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 		break;
 	}
 
+finish:
 	talloc_free(target);
 
 	/*
-	 *	Check if we found a matching map
+	 *	Always release the handle, otherwise drivers
+	 *	which lock in acquire() never unlock.
 	 */
-	if (!map) return 0;
-
+	if (local) {
+		c = NULL;
+	} else if (c && inst->config.local_max_entries) {
+		cache_local_insert(t, request, &c);
+	}
 	cache_free(mod_inst, &c);
 	cache_release(mod_inst, request, &handle);
 
@@ -904,6 +1128,46 @@ static int mod_detach(void *instance)
 	return 0;
 }
 
+/** Allocate the worker's local cache
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_cache_t const	*inst = talloc_get_type_abort_const(instance, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(thread, rlm_cache_thread_t);
+
+	t->inst = inst;
+	fr_dlist_talloc_init(&t->lru, rlm_cache_local_t, entry);
+
+	t->tree = rbtree_talloc_alloc(t, cache_local_cmp, rlm_cache_local_t, NULL, 0);
+	if (!t->tree) {
+		ERROR("Failed creating local cache");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Release all entries held by the worker's local cache
+ *
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_cache_thread_t	*t = talloc_get_type_abort(thread, rlm_cache_thread_t);
+	rlm_cache_local_t	*local;
+
+	while ((local = fr_dlist_head(&t->lru))) {
+		rlm_cache_entry_t *c;
+
+		c = cache_local_remove(t, local);
+		cache_free(t->inst, &c);
+	}
+	TALLOC_FREE(t->tree);
+
+	return 0;
+}
+
 /** Register module xlats
  *
  */
@@ -987,6 +1251,24 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	The local cache holds on to the entries the driver
+	 *	gives us, which only works if the driver hands out
+	 *	entries that we're responsible for freeing.
+	 */
+	if (inst->config.local_max_entries) {
+		if (!inst->driver->free) {
+			cf_log_err(conf, "Driver \"%s\" does not support a 'local' cache, "
+				   "set 'local.max_entries = 0'", inst->driver->name);
+			return -1;
+		}
+
+		if (inst->config.local_ttl == 0) {
+			cf_log_err(conf, "Must set 'local.ttl' to non-zero");
+			return -1;
+		}
+	}
+
 	update = cf_section_find(inst->cs, "update", CF_IDENT_ANY);
 	if (!update) {
 		cf_log_err(conf, "Must have an 'update' section in order to cache anything");
@@ -1029,10 +1311,13 @@ module_t rlm_cache = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "cache",
 	.inst_size	= sizeof(rlm_cache_t),
+	.thread_inst_size	= sizeof(rlm_cache_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_cache_it,
 		[MOD_PREACCT]		= mod_cache_it,
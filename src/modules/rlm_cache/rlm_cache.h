@@ -30,6 +30,12 @@ RCSIDH(cache_h, "$Id$")
 #include <freeradius-devel/server/map.h>
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 typedef struct rlm_cache_driver_s rlm_cache_driver_t;
 
 typedef void rlm_cache_handle_t;
@@ -56,6 +62,11 @@ typedef struct {
 	uint32_t		max_entries;		//!< Maximum entries allowed.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
 	bool			stats;			//!< Generate statistics.
+
+	uint32_t		local_max_entries;	//!< Maximum entries in each worker's local cache.
+							///< 0 disables the local cache.
+	uint32_t		local_ttl;		//!< Longest time an entry may be served from a
+							///< worker's local cache.
 } rlm_cache_config_t;
 
 /*
@@ -79,7 +90,9 @@ typedef struct {
 typedef struct {
 	uint8_t const		*key;			//!< Key used to identify entry.
 	size_t			key_len;		//!< Length of key data.
-	long long int		hits;			//!< How many times the entry has been retrieved.
+	atomic_llong		hits;			//!< How many times the entry has been retrieved.
+							///< Entries may be shared between workers, so this
+							///< is only updated atomically.
 	fr_unix_time_t		created;		//!< When the entry was created.
 	fr_unix_time_t		expires;		//!< When the entry expires.
 
@@ -30,10 +30,12 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/unlang/interpret.h>
 
 #include <ctype.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #ifdef HAVE_UNISTD_H
 #  include <unistd.h>
@@ -44,6 +46,17 @@ RCSID("$Id$")
 #endif
 
 #define DIRLEN	8192		//!< Maximum path length.
+#define DETAIL_IOV_MAX	64	//!< Maximum number of records written with one writev().
+
+/** Configuration for batched writes
+ *
+ */
+typedef struct {
+	bool		enable;		//!< Whether records are batched.
+	fr_time_delta_t	interval;	//!< Longest time a record waits before it's written.
+	size_t		max_size;	//!< Write the batch as soon as it's this large.
+	bool		sync;		//!< Call fdatasync() after writing each batch.
+} rlm_detail_batch_config_t;
 
 /** Instance configuration for rlm_detail
  *
@@ -67,8 +80,51 @@ typedef struct {
 	exfile_t    	*ef;		//!< Log file handler
 
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
+
+	rlm_detail_batch_config_t batch; //!< Batched write configuration.
 } rlm_detail_t;
 
+/** Per-thread state for rlm_detail
+ *
+ */
+typedef struct {
+	rlm_detail_t const	*inst;		//!< Instance of rlm_detail.
+	fr_event_list_t		*el;		//!< Event list for the batch timers.
+	rbtree_t		*batches;	//!< Batches waiting to be written, by filename.
+} rlm_detail_thread_t;
+
+/** Records waiting to be written to one detail file
+ *
+ */
+typedef struct {
+	rlm_detail_thread_t	*t;		//!< Thread which owns the batch.
+	char const		*filename;	//!< Expanded name of the detail file.
+	fr_dlist_head_t		records;	//!< Records to write, in the order they were added.
+	size_t			size;		//!< Total length of all records.
+	fr_event_timer_t const	*ev;		//!< When the batch must be written.
+} rlm_detail_batch_t;
+
+/** A single encoded detail entry
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the batch's list of records.
+	rlm_detail_batch_t	*batch;		//!< Batch we're in, NULL once written.
+	request_t		*request;	//!< Request which produced the record.
+	char			*data;		//!< The encoded entry.
+	size_t			len;		//!< Length of the encoded entry.
+	rlm_rcode_t		rcode;		//!< Result of writing the batch.
+	bool			yielded;	//!< The request is waiting for the batch to be written.
+} rlm_detail_record_t;
+
+static const CONF_PARSER batch_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_detail_t, batch.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("interval", FR_TYPE_TIME_DELTA, rlm_detail_t, batch.interval), .dflt = "0.01" },
+	{ FR_CONF_OFFSET("max_size", FR_TYPE_SIZE, rlm_detail_t, batch.max_size), .dflt = "65536" },
+	{ FR_CONF_OFFSET("sync", FR_TYPE_BOOL, rlm_detail_t, batch.sync), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_detail_t, filename), .dflt = "%A/%{Packet-Src-IP-Address}/detail" },
 	{ FR_CONF_OFFSET("header", FR_TYPE_TMPL | FR_TYPE_XLAT | FR_TYPE_NON_BLOCKING, rlm_detail_t, header),
@@ -78,6 +134,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("locking", FR_TYPE_BOOL, rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", FR_TYPE_BOOL, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_POINTER("batch", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) batch_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -153,6 +210,12 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->batch.enable) {
+		FR_TIME_DELTA_BOUND_CHECK("batch.interval", inst->batch.interval, >=, fr_time_delta_from_usec(100));
+		FR_TIME_DELTA_BOUND_CHECK("batch.interval", inst->batch.interval, <=, fr_time_delta_from_sec(1));
+		FR_SIZE_BOUND_CHECK("batch.max_size", inst->batch.max_size, >=, (size_t) 1024);
+	}
+
 	/*
 	 *	Suppress certain attributes.
 	 */
@@ -212,29 +275,41 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 /*
  *	Wrapper for VPs allocated on the stack.
  */
-static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, fr_pair_t const *stacked)
+static int detail_pair_print(TALLOC_CTX *ctx, fr_sbuff_t *out, fr_pair_t const *stacked)
 {
-	fr_pair_t *vp;
+	fr_pair_t	*vp;
+	int		ret = 0;
 
 	vp = talloc(ctx, fr_pair_t);
-	if (!vp) return;
+	if (!vp) return -1;
 
 	memcpy(vp, stacked, sizeof(*vp));
 	vp->op = T_OP_EQ;
-	fr_pair_fprint(out, NULL, vp);
+
+	if ((fr_sbuff_in_char(out, '\t') <= 0) || (fr_pair_print(out, NULL, vp) <= 0) ||
+	    (fr_sbuff_in_char(out, '\n') <= 0)) ret = -1;
 	talloc_free(vp);
-}
 
+	return ret;
+}
 
-/** Write a single detail entry to file pointer
+/** Encode a single detail entry
+ *
+ * The entry is written to a buffer, and not directly to the file, so
+ * that it can be written with one system call, either on its own or
+ * as part of a batch.
  *
- * @param[in] out Where to write entry.
+ * @param[out] out Where to write entry.
  * @param[in] inst Instance of rlm_detail.
  * @param[in] request The current request.
  * @param[in] packet associated with the request (request, reply...).
  * @param[in] compat Write out entry in compatibility mode.
+ * @return
+ *	- 0 on success.  Nothing is written for empty packets.
+ *	- -1 on failure.
  */
-static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request, fr_radius_packet_t *packet, bool compat)
+static int detail_encode(fr_sbuff_t *out, rlm_detail_t const *inst, request_t *request,
+			 fr_radius_packet_t *packet, bool compat)
 {
 	fr_pair_t *vp;
 	char timestamp[256];
@@ -250,8 +325,15 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 	}
 
 #define WRITE(fmt, ...) do {\
-	if (fprintf(out, fmt, ## __VA_ARGS__) < 0) {\
-		RERROR("Failed writing to detail file: %s", fr_syserror(errno));\
+	if (fr_sbuff_in_sprintf(out, fmt, ## __VA_ARGS__) < 0) {\
+		RERROR("Failed encoding detail entry");\
+		return -1;\
+	}\
+} while(0)
+
+#define WRITE_PAIR(_vp) do {\
+	if (detail_pair_print(request, out, _vp) < 0) {\
+		RERROR("Failed encoding detail entry");\
 		return -1;\
 	}\
 } while(0)
@@ -306,8 +388,10 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 			break;
 		}
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		if (src_vp.da) {
+			WRITE_PAIR(&src_vp);
+			WRITE_PAIR(&dst_vp);
+		}
 
 		src_vp.da = attr_packet_src_port;
 		fr_value_box_shallow(&src_vp.data, packet->socket.inet.src_port, true);
@@ -315,8 +399,8 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 		dst_vp.da = attr_packet_dst_port;
 		fr_value_box_shallow(&dst_vp.data, packet->socket.inet.dst_port, true);
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		WRITE_PAIR(&src_vp);
+		WRITE_PAIR(&dst_vp);
 	}
 
 	{
@@ -325,7 +409,8 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 		for (vp = fr_cursor_init(&cursor, &packet->vps);
 		     vp;
 		     vp = fr_cursor_next(&cursor)) {
-			fr_token_t op;
+			fr_token_t	op;
+			ssize_t		slen;
 
 			if (inst->ht && fr_hash_table_find_by_data(inst->ht, vp->da)) continue;
 
@@ -337,10 +422,16 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 			/*
 			 *	Print all of the attributes, operator should always be '='.
 			 */
+			WRITE("\t");
 			op = vp->op;
 			vp->op = T_OP_EQ;
-			fr_pair_fprint(out, NULL, vp);
+			slen = fr_pair_print(out, NULL, vp);
 			vp->op = op;
+			if (slen <= 0) {
+				RERROR("Failed encoding detail entry");
+				return -1;
+			}
+			WRITE("\n");
 		}
 	}
 
@@ -357,21 +448,300 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 	return 0;
 }
 
-/*
- *	Do detail, compatible with old accounting
+/** Set the group of a detail file, if one was configured
+ *
  */
-static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
-						  fr_radius_packet_t *packet, bool compat)
+static void detail_group_set(rlm_detail_t const *inst, request_t *request, char const *filename)
 {
-	int		outfd, dupfd;
-	char		buffer[DIRLEN];
-
-	FILE		*outfp;
-
 #ifdef HAVE_GRP_H
 	gid_t		gid;
 	char		*endptr;
+
+	if (!inst->group) return;
+
+	gid = strtol(inst->group, &endptr, 10);
+	if (*endptr != '\0') {
+		if (rad_getgid(request, &gid, inst->group) < 0) {
+			RDEBUG2("Unable to find system group '%s'", inst->group);
+			return;
+		}
+	}
+
+	if (chown(filename, -1, gid) == -1) {
+		RDEBUG2("Unable to change system group of '%s'", filename);
+	}
+#endif
+}
+
+/** Write a set of buffers to a file, dealing with short writes
+ *
+ * @param[in] fd	to write to.
+ * @param[in] iov	buffers to write.  Updated as data is written.
+ * @param[in] iovcnt	number of buffers.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with errno set.
+ */
+static int detail_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	int	i = 0;
+
+	while (i < iovcnt) {
+		ssize_t	slen;
+
+		slen = writev(fd, iov + i, iovcnt - i);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		while ((i < iovcnt) && ((size_t) slen >= iov[i].iov_len)) {
+			slen -= iov[i].iov_len;
+			i++;
+		}
+
+		if (i < iovcnt) {
+			iov[i].iov_base = ((uint8_t *) iov[i].iov_base) + slen;
+			iov[i].iov_len -= slen;
+		}
+	}
+
+	return 0;
+}
+
+/** Flush data for a detail file to disk
+ *
+ */
+static int detail_sync(int fd)
+{
+	int ret;
+
+	do {
+#if defined(_POSIX_SYNCHRONIZED_IO) && (_POSIX_SYNCHRONIZED_IO > 0)
+		ret = fdatasync(fd);
+#else
+		ret = fsync(fd);
 #endif
+	} while ((ret < 0) && (errno == EINTR));
+
+	return ret;
+}
+
+static int detail_batch_cmp(void const *one, void const *two)
+{
+	rlm_detail_batch_t const *a = one, *b = two;
+
+	return strcmp(a->filename, b->filename);
+}
+
+/** Write all of the records in a batch, and resume the requests waiting for them
+ *
+ * The batch is removed from the thread's tree, and freed.
+ */
+static void detail_batch_commit(rlm_detail_batch_t *batch)
+{
+	rlm_detail_thread_t	*t = batch->t;
+	rlm_detail_t const	*inst = t->inst;
+	rlm_detail_record_t	*record;
+	request_t		*request;
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	int			fd;
+
+	rbtree_deletebydata(t->batches, batch);
+
+	/*
+	 *	All of the requests were cancelled.
+	 */
+	record = fr_dlist_head(&batch->records);
+	if (!record) goto finish;
+
+	/*
+	 *	Log against the first request in the batch.
+	 */
+	request = record->request;
+
+	fd = exfile_open(inst->ef, request, batch->filename, inst->perm);
+	if (fd < 0) {
+		RPERROR("Couldn't open file %s", batch->filename);
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	detail_group_set(inst, request, batch->filename);
+
+	RDEBUG2("Writing %zu detail entries (%zu bytes) to %s",
+		fr_dlist_num_elements(&batch->records), batch->size, batch->filename);
+
+	/*
+	 *	One writev() per DETAIL_IOV_MAX records.  The file is
+	 *	locked (if locking is enabled) for the whole batch, so
+	 *	the entries can't be interleaved with anyone else's.
+	 */
+	record = NULL;
+	for (;;) {
+		struct iovec	iov[DETAIL_IOV_MAX];
+		int		num;
+
+		for (num = 0; num < DETAIL_IOV_MAX; num++) {
+			record = fr_dlist_next(&batch->records, record);
+			if (!record) break;
+
+			iov[num].iov_base = record->data;
+			iov[num].iov_len = record->len;
+		}
+
+		if ((num > 0) && (detail_writev(fd, iov, num) < 0)) {
+			RERROR("Failed writing to detail file %s: %s", batch->filename, fr_syserror(errno));
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+
+		if (!record) break;
+	}
+
+	if ((rcode == RLM_MODULE_OK) && inst->batch.sync && (detail_sync(fd) < 0)) {
+		RERROR("Failed syncing detail file %s: %s", batch->filename, fr_syserror(errno));
+		rcode = RLM_MODULE_FAIL;
+	}
+
+	exfile_close(inst->ef, request, fd);
+
+finish:
+	while ((record = fr_dlist_pop_head(&batch->records))) {
+		record->batch = NULL;
+		record->rcode = rcode;
+		if (record->yielded) unlang_interpret_mark_resumable(record->request);
+	}
+
+	talloc_free(batch);
+}
+
+/** Write a batch once its interval has passed
+ *
+ */
+static void _detail_batch_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_detail_batch_t *batch = talloc_get_type_abort(uctx, rlm_detail_batch_t);
+
+	batch->ev = NULL;
+	detail_batch_commit(batch);
+}
+
+/** Return the result of writing the batch the request's record was in
+ *
+ */
+static unlang_action_t detail_batch_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					   UNUSED request_t *request, void *rctx)
+{
+	rlm_detail_record_t	*record = talloc_get_type_abort(rctx, rlm_detail_record_t);
+	rlm_rcode_t		rcode = record->rcode;
+
+	talloc_free(record);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Remove the request's record from its batch if the request is cancelled
+ *
+ */
+static void detail_batch_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+				void *rctx, fr_state_signal_t action)
+{
+	rlm_detail_record_t	*record = talloc_get_type_abort(rctx, rlm_detail_record_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (record->batch) {
+		fr_dlist_remove(&record->batch->records, record);
+		record->batch->size -= record->len;
+		record->batch = NULL;
+	}
+
+	talloc_free(record);
+}
+
+/** Add a detail entry to the batch for a file
+ *
+ * The request yields until the batch has been written, either when
+ * its interval has passed, or when it's grown larger than max_size.
+ */
+static unlang_action_t detail_batch_add(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+					char const *filename, fr_radius_packet_t *packet, bool compat)
+{
+	rlm_detail_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_detail_t);
+	rlm_detail_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_detail_thread_t);
+	rlm_detail_batch_t	*batch;
+	rlm_detail_record_t	*record;
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
+	rlm_rcode_t		rcode;
+
+	MEM(record = talloc_zero(request, rlm_detail_record_t));
+	MEM(fr_sbuff_init_talloc(record, &sbuff, &tctx, 1024, SIZE_MAX));
+
+	if (detail_encode(&sbuff, inst, request, packet, compat) < 0) {
+		talloc_free(record);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (fr_sbuff_used(&sbuff) == 0) {
+		talloc_free(record);
+		RETURN_MODULE_OK;
+	}
+
+	record->request = request;
+	record->data = fr_sbuff_start(&sbuff);
+	record->len = fr_sbuff_used(&sbuff);
+
+	batch = rbtree_finddata(t->batches, &(rlm_detail_batch_t){ .filename = filename });
+	if (!batch) {
+		MEM(batch = talloc_zero(t, rlm_detail_batch_t));
+		batch->t = t;
+		MEM(batch->filename = talloc_typed_strdup(batch, filename));
+		fr_dlist_talloc_init(&batch->records, rlm_detail_record_t, entry);
+
+		if (fr_event_timer_in(batch, t->el, &batch->ev, inst->batch.interval,
+				      _detail_batch_timer, batch) < 0) {
+			RPERROR("Failed inserting batch timer");
+			talloc_free(batch);
+			talloc_free(record);
+			RETURN_MODULE_FAIL;
+		}
+
+		rbtree_insert(t->batches, batch);
+	}
+
+	record->batch = batch;
+	fr_dlist_insert_tail(&batch->records, record);
+	batch->size += record->len;
+
+	if (batch->size >= inst->batch.max_size) detail_batch_commit(batch);
+
+	/*
+	 *	Our record was written immediately, no need to yield.
+	 */
+	if (!record->batch) {
+		rcode = record->rcode;
+		talloc_free(record);
+		RETURN_MODULE_RCODE(rcode);
+	}
+
+	record->yielded = true;
+
+	return unlang_module_yield(request, detail_batch_resume, detail_batch_signal, record);
+}
+
+/*
+ *	Do detail, compatible with old accounting
+ */
+static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+						  fr_radius_packet_t *packet, bool compat)
+{
+	int			outfd;
+	char			buffer[DIRLEN];
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
+	struct iovec		iov;
 
 	rlm_detail_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_detail_t);
 
@@ -386,53 +756,41 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 
 	RDEBUG2("%s expands to %s", inst->filename, buffer);
 
-	outfd = exfile_open(inst->ef, request, buffer, inst->perm);
-	if (outfd < 0) {
-		RPERROR("Couldn't open file %s", buffer);
-		/* coverity[missing_unlock] */
+	if (inst->batch.enable) return detail_batch_add(p_result, mctx, request, buffer, packet, compat);
+
+	MEM(fr_sbuff_init_talloc(request, &sbuff, &tctx, 1024, SIZE_MAX));
+
+	if (detail_encode(&sbuff, inst, request, packet, compat) < 0) {
+	fail:
+		talloc_free(fr_sbuff_buff(&sbuff));
 		RETURN_MODULE_FAIL;
 	}
 
-	if (inst->group != NULL) {
-		gid = strtol(inst->group, &endptr, 10);
-		if (*endptr != '\0') {
-			if (rad_getgid(request, &gid, inst->group) < 0) {
-				RDEBUG2("Unable to find system group '%s'", inst->group);
-				goto skip_group;
-			}
-		}
-
-		if (chown(buffer, -1, gid) == -1) {
-			RDEBUG2("Unable to change system group of '%s'", buffer);
-		}
+	if (fr_sbuff_used(&sbuff) == 0) {
+		talloc_free(fr_sbuff_buff(&sbuff));
+		RETURN_MODULE_OK;
 	}
 
-skip_group:
-	outfp = NULL;
-	dupfd = dup(outfd);
-	if (dupfd < 0) {
-		RERROR("Failed to dup() file descriptor for detail file");
+	outfd = exfile_open(inst->ef, request, buffer, inst->perm);
+	if (outfd < 0) {
+		RPERROR("Couldn't open file %s", buffer);
+		/* coverity[missing_unlock] */
 		goto fail;
 	}
 
-	/*
-	 *	Open the output fp for buffering.
-	 */
-	if ((outfp = fdopen(dupfd, "a")) == NULL) {
-		RERROR("Couldn't open file %s: %s", buffer, fr_syserror(errno));
-	fail:
-		if (outfp) fclose(outfp);
+	detail_group_set(inst, request, buffer);
+
+	iov.iov_base = fr_sbuff_start(&sbuff);
+	iov.iov_len = fr_sbuff_used(&sbuff);
+
+	if (detail_writev(outfd, &iov, 1) < 0) {
+		RERROR("Failed writing to detail file: %s", fr_syserror(errno));
 		exfile_close(inst->ef, request, outfd);
-		RETURN_MODULE_FAIL;
+		goto fail;
 	}
 
-	if (detail_write(outfp, inst, request, packet, compat) < 0) goto fail;
-
-	/*
-	 *	Flush everything
-	 */
-	fclose(outfp);
 	exfile_close(inst->ef, request, outfd);
+	talloc_free(fr_sbuff_buff(&sbuff));
 
 	/*
 	 *	And everything is fine.
@@ -464,15 +822,57 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 	return detail_do(p_result, mctx, request, request->reply, false);
 }
 
+/** Set up the tree of batches for this thread
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_detail_t const	*inst = talloc_get_type_abort_const(instance, rlm_detail_t);
+	rlm_detail_thread_t	*t = talloc_get_type_abort(thread, rlm_detail_thread_t);
+
+	t->inst = inst;
+	t->el = el;
+
+	t->batches = rbtree_talloc_alloc(t, detail_batch_cmp, rlm_detail_batch_t, NULL, 0);
+	if (!t->batches) {
+		ERROR("Failed creating batch tree");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Write any batches which are still pending
+ *
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_detail_thread_t	*t = talloc_get_type_abort(thread, rlm_detail_thread_t);
+	rlm_detail_batch_t	**batches;
+	uint32_t		i, num;
+
+	num = rbtree_flatten(t, (void ***) &batches, t->batches, RBTREE_IN_ORDER);
+	for (i = 0; i < num; i++) detail_batch_commit(batches[i]);
+	talloc_free(batches);
+
+	TALLOC_FREE(t->batches);
+
+	return 0;
+}
 
 /* globally exported name */
 extern module_t rlm_detail;
 module_t rlm_detail = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "detail",
-	.inst_size	= sizeof(rlm_detail_t),
-	.config		= module_config,
-	.instantiate	= mod_instantiate,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "detail",
+	.inst_size		= sizeof(rlm_detail_t),
+	.thread_inst_size	= sizeof(rlm_detail_thread_t),
+	.thread_inst_type	= "rlm_detail_thread_t",
+	.config			= module_config,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 		[MOD_PREACCT]		= mod_accounting,
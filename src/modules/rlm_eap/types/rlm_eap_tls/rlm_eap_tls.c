@@ -192,6 +192,15 @@ static unlang_action_t eap_tls_virtual_server(rlm_rcode_t *p_result, rlm_eap_tls
 	return UNLANG_ACTION_YIELD;
 }
 
+/** Continue the handshake once the async job it was waiting for has finished
+ *
+ */
+static unlang_action_t mod_handshake_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+					    UNUSED void *rctx)
+{
+	return mod_process(p_result, mctx, request);
+}
+
 static unlang_action_t mod_process(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_eap_tls_t		*inst = talloc_get_type_abort(mctx->instance, rlm_eap_tls_t);
@@ -229,6 +238,12 @@ static unlang_action_t mod_process(rlm_rcode_t *p_result, module_ctx_t const *mc
 	case EAP_TLS_HANDLED:
 		RETURN_MODULE_HANDLED;
 
+	/*
+	 *	The handshake is waiting for an async job.
+	 */
+	case EAP_TLS_YIELD:
+		return eap_tls_async_yield(p_result, request, eap_session, mod_handshake_resume);
+
 	/*
 	 *	Handshake is done, proceed with decoding tunneled
 	 *	data.
@@ -0,0 +1,593 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file cache.c
+ * @brief Cache the results of user DN lookups and group membership checks
+ *
+ * Two kinds of entries are stored in the same tree:
+ *
+ * - User DN lookups, keyed by the expanded base DN, scope and filter of
+ *   the user search.  Lookups which found nothing are cached too, so
+ *   unknown users don't cause a search on every request.
+ * - Group memberships, keyed by the user's normalised DN.  Each holds the
+ *   groups the user has been compared against, and whether they're a member.
+ *
+ * Entries are shared by all threads, and evicted least recently used
+ * first when the cache grows beyond its configured size.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+USES_APPLE_DEPRECATED_API
+
+#include <freeradius-devel/util/debug.h>
+
+#include "rlm_ldap.h"
+
+#include <ctype.h>
+#include <pthread.h>
+
+typedef enum {
+	LDAP_CACHE_USER_DN = 0,				//!< Result of a user object search.
+	LDAP_CACHE_MEMBERSHIP				//!< Group memberships of a user.
+} ldap_cache_type_t;
+
+/** An entry in the cache
+ *
+ */
+typedef struct {
+	ldap_cache_type_t	type;			//!< What kind of entry this is.
+	char			*key;			//!< Search for #LDAP_CACHE_USER_DN,
+							///< normalised user DN for #LDAP_CACHE_MEMBERSHIP.
+
+	char			*dn;			//!< DN of the user found.  NULL if the search
+							///< returned no results.
+	char			*dn_norm;		//!< Normalised DN of the user found, for
+							///< matching change notifications.
+	fr_time_t		expires;		//!< When the user DN lookup expires.
+
+	rbtree_t		*groups;		//!< Groups the user has been compared against.
+
+	size_t			size;			//!< Approximate memory used by the entry.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+} ldap_cache_entry_t;
+
+/** Result of a group membership check
+ *
+ */
+typedef struct {
+	char			*group;			//!< Group name or DN, as it was compared.
+	bool			member;			//!< Whether the user is a member.
+	fr_time_t		expires;		//!< When the result expires.
+} ldap_cache_group_t;
+
+struct rlm_ldap_cache_s {
+	rlm_ldap_t const	*inst;			//!< Instance of rlm_ldap.
+
+	pthread_mutex_t		mutex;			//!< Protects everything below.
+	rbtree_t		*tree;			//!< Entries, indexed by type and key.
+	fr_dlist_head_t		lru;			//!< Entries, most recently used first.
+	size_t			size;			//!< Approximate memory used by all entries.
+
+	uint64_t		hits;			//!< Lookups answered from the cache.
+	uint64_t		misses;			//!< Lookups which weren't.
+	uint64_t		expired;		//!< Results found which had expired.
+	uint64_t		evictions;		//!< Entries removed to stay within max_size.
+	uint64_t		invalidations;		//!< Entries removed by change notifications.
+};
+
+static int ldap_cache_entry_cmp(void const *one, void const *two)
+{
+	ldap_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->type > b->type) - (a->type < b->type);
+	if (ret != 0) return ret;
+
+	return strcmp(a->key, b->key);
+}
+
+static int ldap_cache_group_cmp(void const *one, void const *two)
+{
+	ldap_cache_group_t const *a = one, *b = two;
+
+	return strcmp(a->group, b->group);
+}
+
+static int _ldap_cache_free(rlm_ldap_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Remove an entry from the cache, and free it
+ *
+ * Must be called with the mutex held.
+ */
+static void ldap_cache_entry_free(rlm_ldap_cache_t *cache, ldap_cache_entry_t *c)
+{
+	rbtree_deletebydata(cache->tree, c);
+	fr_dlist_remove(&cache->lru, c);
+	cache->size -= c->size;
+
+	talloc_free(c);
+}
+
+/** Evict the least recently used entries, until we're within max_size
+ *
+ * Must be called with the mutex held.
+ */
+static void ldap_cache_evict(rlm_ldap_cache_t *cache, ldap_cache_entry_t const *keep)
+{
+	ldap_cache_entry_t *c;
+
+	while (cache->size > cache->inst->lookup_cache.max_size) {
+		c = fr_dlist_tail(&cache->lru);
+		if (!c || (c == keep)) break;
+
+		ldap_cache_entry_free(cache, c);
+		cache->evictions++;
+	}
+}
+
+/** Find an entry and mark it as recently used
+ *
+ * Must be called with the mutex held.
+ */
+static ldap_cache_entry_t *ldap_cache_entry_find(rlm_ldap_cache_t *cache, ldap_cache_type_t type, char const *key)
+{
+	ldap_cache_entry_t	*c;
+	char			*name;
+
+	memcpy(&name, &key, sizeof(name));	/* const issues */
+	c = rbtree_finddata(cache->tree, &(ldap_cache_entry_t){ .type = type, .key = name });
+	if (!c) return NULL;
+
+	fr_dlist_remove(&cache->lru, c);
+	fr_dlist_insert_head(&cache->lru, c);
+
+	return c;
+}
+
+/** Find an entry, creating it if it doesn't exist
+ *
+ * Must be called with the mutex held.
+ */
+static ldap_cache_entry_t *ldap_cache_entry_alloc(rlm_ldap_cache_t *cache, ldap_cache_type_t type, char const *key)
+{
+	ldap_cache_entry_t	*c;
+
+	c = ldap_cache_entry_find(cache, type, key);
+	if (c) return c;
+
+	c = talloc_zero(cache, ldap_cache_entry_t);
+	if (!c) return NULL;
+
+	c->type = type;
+	c->key = talloc_typed_strdup(c, key);
+	if (!c->key) {
+	error:
+		talloc_free(c);
+		return NULL;
+	}
+	c->size = sizeof(*c) + talloc_array_length(c->key);
+
+	if (type == LDAP_CACHE_MEMBERSHIP) {
+		c->groups = rbtree_alloc(c, ldap_cache_group_cmp, NULL, RBTREE_FLAG_NONE);
+		if (!c->groups) goto error;
+	}
+
+	if (!rbtree_insert(cache->tree, c)) goto error;
+	fr_dlist_insert_head(&cache->lru, c);
+	cache->size += c->size;
+
+	return c;
+}
+
+/** Normalise a DN, so that DNs which only differ in escaping or case match
+ *
+ * The naming attributes used in practice are all matched case
+ * insensitively, so DNs which only differ in case are the same object.
+ */
+static char *ldap_cache_dn_normalise(TALLOC_CTX *ctx, char const *dn)
+{
+	char	*norm, *p;
+
+	norm = talloc_array(ctx, char, strlen(dn) + 1);
+	if (!norm) return NULL;
+
+	fr_ldap_util_normalise_dn(norm, dn);
+	for (p = norm; *p != '\0'; p++) *p = tolower((uint8_t) *p);
+
+	return norm;
+}
+
+/** Build the key for a user search
+ *
+ */
+static char *ldap_cache_user_key(TALLOC_CTX *ctx, char const *base_dn, int scope, char const *filter)
+{
+	return talloc_typed_asprintf(ctx, "%s?%i?%s", base_dn, scope, filter ? filter : "");
+}
+
+/** Allocate the cache for an instance of rlm_ldap
+ *
+ * @param[in] ctx	to allocate the cache in.
+ * @param[in] inst	rlm_ldap configuration.
+ * @return
+ *	- The new cache.
+ *	- NULL on error.
+ */
+rlm_ldap_cache_t *rlm_ldap_cache_alloc(TALLOC_CTX *ctx, rlm_ldap_t const *inst)
+{
+	rlm_ldap_cache_t	*cache;
+
+	cache = talloc_zero(ctx, rlm_ldap_cache_t);
+	if (!cache) return NULL;
+
+	cache->inst = inst;
+	cache->tree = rbtree_alloc(cache, ldap_cache_entry_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!cache->tree) {
+		talloc_free(cache);
+		return NULL;
+	}
+	fr_dlist_talloc_init(&cache->lru, ldap_cache_entry_t, entry);
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _ldap_cache_free);
+
+	return cache;
+}
+
+/** Find the result of a previous user search
+ *
+ * @param[out] found	Whether the search found a user.
+ * @param[out] dn	Where to write the user's DN, allocated in ctx.
+ *			Set to NULL if the search returned no results.
+ * @param[in] ctx	to allocate the DN in.
+ * @param[in] cache	to search in.
+ * @param[in] base_dn	of the search.
+ * @param[in] scope	of the search.
+ * @param[in] filter	of the search, may be NULL.
+ * @return
+ *	- 1 if the result was cached.
+ *	- 0 if the search must be performed.
+ */
+int rlm_ldap_cache_user_dn_find(bool *found, char **dn, TALLOC_CTX *ctx, rlm_ldap_cache_t *cache,
+				char const *base_dn, int scope, char const *filter)
+{
+	ldap_cache_entry_t	*c;
+	char			*key;
+	int			ret = 0;
+
+	*found = false;
+	*dn = NULL;
+
+	key = ldap_cache_user_key(NULL, base_dn, scope, filter);
+	if (!key) return 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	c = ldap_cache_entry_find(cache, LDAP_CACHE_USER_DN, key);
+	if (c && (c->expires <= fr_time())) {
+		ldap_cache_entry_free(cache, c);
+		cache->expired++;
+		c = NULL;
+	}
+
+	if (!c) {
+		cache->misses++;
+		goto finish;
+	}
+
+	if (c->dn) {
+		*dn = talloc_typed_strdup(ctx, c->dn);
+		if (!*dn) goto finish;
+		*found = true;
+	}
+	cache->hits++;
+	ret = 1;
+
+finish:
+	pthread_mutex_unlock(&cache->mutex);
+	talloc_free(key);
+
+	return ret;
+}
+
+/** Record the result of a user search
+ *
+ * @param[in] cache	to add the result to.
+ * @param[in] base_dn	of the search.
+ * @param[in] scope	of the search.
+ * @param[in] filter	of the search, may be NULL.
+ * @param[in] dn	of the user found.  NULL if the search returned no results.
+ */
+void rlm_ldap_cache_user_dn_insert(rlm_ldap_cache_t *cache, char const *base_dn, int scope, char const *filter,
+				   char const *dn)
+{
+	rlm_ldap_t const	*inst = cache->inst;
+	ldap_cache_entry_t	*c;
+	char			*key;
+	fr_time_delta_t		lifetime;
+
+	lifetime = dn ? inst->lookup_cache.lifetime : inst->lookup_cache.negative_lifetime;
+	if (!lifetime) return;
+
+	key = ldap_cache_user_key(NULL, base_dn, scope, filter);
+	if (!key) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	c = ldap_cache_entry_alloc(cache, LDAP_CACHE_USER_DN, key);
+	if (!c) goto finish;
+
+	if (c->dn) {
+		cache->size -= talloc_array_length(c->dn) + talloc_array_length(c->dn_norm);
+		TALLOC_FREE(c->dn);
+		TALLOC_FREE(c->dn_norm);
+		c->size = sizeof(*c) + talloc_array_length(c->key);
+	}
+
+	if (dn) {
+		c->dn = talloc_typed_strdup(c, dn);
+		c->dn_norm = ldap_cache_dn_normalise(c, dn);
+		if (!c->dn || !c->dn_norm) {
+			ldap_cache_entry_free(cache, c);
+			goto finish;
+		}
+		c->size += talloc_array_length(c->dn) + talloc_array_length(c->dn_norm);
+		cache->size += talloc_array_length(c->dn) + talloc_array_length(c->dn_norm);
+	}
+	c->expires = fr_time() + lifetime;
+
+	ldap_cache_evict(cache, c);
+
+finish:
+	pthread_mutex_unlock(&cache->mutex);
+	talloc_free(key);
+}
+
+/** Find the result of a previous group membership check
+ *
+ * @param[out] member	Whether the user is a member of the group.
+ * @param[in] cache	to search in.
+ * @param[in] user_dn	DN of the user.
+ * @param[in] group	name or DN of the group.
+ * @return
+ *	- 1 if the result was cached.
+ *	- 0 if the membership must be checked.
+ */
+int rlm_ldap_cache_membership_find(bool *member, rlm_ldap_cache_t *cache, char const *user_dn, char const *group)
+{
+	ldap_cache_entry_t	*c;
+	ldap_cache_group_t	*g = NULL;
+	char			*name, *key;
+	int			ret = 0;
+
+	*member = false;
+
+	key = ldap_cache_dn_normalise(NULL, user_dn);
+	if (!key) return 0;
+
+	memcpy(&name, &group, sizeof(name));	/* const issues */
+
+	pthread_mutex_lock(&cache->mutex);
+	c = ldap_cache_entry_find(cache, LDAP_CACHE_MEMBERSHIP, key);
+	if (c) g = rbtree_finddata(c->groups, &(ldap_cache_group_t){ .group = name });
+	if (g && (g->expires <= fr_time())) {
+		size_t size = sizeof(*g) + talloc_array_length(g->group);
+
+		rbtree_deletebydata(c->groups, g);
+		talloc_free(g);
+		c->size -= size;
+		cache->size -= size;
+		cache->expired++;
+		g = NULL;
+	}
+
+	if (!g) {
+		cache->misses++;
+		goto finish;
+	}
+
+	*member = g->member;
+	cache->hits++;
+	ret = 1;
+
+finish:
+	pthread_mutex_unlock(&cache->mutex);
+	talloc_free(key);
+
+	return ret;
+}
+
+/** Record the result of a group membership check
+ *
+ * @param[in] cache	to add the result to.
+ * @param[in] user_dn	DN of the user.
+ * @param[in] group	name or DN of the group.
+ * @param[in] member	Whether the user is a member of the group.
+ */
+void rlm_ldap_cache_membership_insert(rlm_ldap_cache_t *cache, char const *user_dn, char const *group, bool member)
+{
+	rlm_ldap_t const	*inst = cache->inst;
+	ldap_cache_entry_t	*c;
+	ldap_cache_group_t	*g;
+	char			*name, *key;
+	fr_time_delta_t		lifetime;
+
+	lifetime = member ? inst->lookup_cache.lifetime : inst->lookup_cache.negative_lifetime;
+	if (!lifetime) return;
+
+	key = ldap_cache_dn_normalise(NULL, user_dn);
+	if (!key) return;
+
+	memcpy(&name, &group, sizeof(name));	/* const issues */
+
+	pthread_mutex_lock(&cache->mutex);
+	c = ldap_cache_entry_alloc(cache, LDAP_CACHE_MEMBERSHIP, key);
+	if (!c) goto finish;
+
+	g = rbtree_finddata(c->groups, &(ldap_cache_group_t){ .group = name });
+	if (!g) {
+		size_t size;
+
+		g = talloc_zero(c, ldap_cache_group_t);
+		if (!g) goto finish;
+
+		g->group = talloc_typed_strdup(g, group);
+		if (!g->group || !rbtree_insert(c->groups, g)) {
+			talloc_free(g);
+			goto finish;
+		}
+
+		size = sizeof(*g) + talloc_array_length(g->group);
+		c->size += size;
+		cache->size += size;
+	}
+	g->member = member;
+	g->expires = fr_time() + lifetime;
+
+	ldap_cache_evict(cache, c);
+
+finish:
+	pthread_mutex_unlock(&cache->mutex);
+	talloc_free(key);
+}
+
+/** Remove cached results which may have been affected by a change to an object
+ *
+ * If the DN is that of a user we've cached, the user's group memberships
+ * and the searches which found them are removed.  Otherwise the object may
+ * be a group, so all group memberships are removed.
+ *
+ * Searches which found nothing are always removed, as the object may be a
+ * new user.
+ *
+ * @param[in] cache	to remove results from.
+ * @param[in] dn	of the object which changed.
+ * @return The number of entries removed.
+ */
+int rlm_ldap_cache_invalidate(rlm_ldap_cache_t *cache, char const *dn)
+{
+	ldap_cache_entry_t	*c, *next;
+	char			*norm;
+	bool			is_user = false;
+	int			removed = 0;
+
+	norm = ldap_cache_dn_normalise(NULL, dn);
+	if (!norm) return -1;
+
+	pthread_mutex_lock(&cache->mutex);
+	c = ldap_cache_entry_find(cache, LDAP_CACHE_MEMBERSHIP, norm);
+	if (c) {
+		ldap_cache_entry_free(cache, c);
+		removed++;
+		is_user = true;
+	}
+
+	for (c = fr_dlist_head(&cache->lru); c; c = next) {
+		next = fr_dlist_next(&cache->lru, c);
+
+		switch (c->type) {
+		case LDAP_CACHE_USER_DN:
+			if (c->dn_norm && (strcmp(c->dn_norm, norm) != 0)) continue;
+			if (c->dn) is_user = true;
+			break;
+
+		case LDAP_CACHE_MEMBERSHIP:
+			continue;
+		}
+
+		ldap_cache_entry_free(cache, c);
+		removed++;
+	}
+
+	if (!is_user) for (c = fr_dlist_head(&cache->lru); c; c = next) {
+		next = fr_dlist_next(&cache->lru, c);
+
+		if (c->type != LDAP_CACHE_MEMBERSHIP) continue;
+
+		ldap_cache_entry_free(cache, c);
+		removed++;
+	}
+	cache->invalidations += removed;
+	pthread_mutex_unlock(&cache->mutex);
+
+	talloc_free(norm);
+
+	return removed;
+}
+
+/** Return one of the cache's statistics
+ *
+ * @param[out] out	Where to write the value.
+ * @param[in] cache	to return the statistic of.
+ * @param[in] name	of the statistic, as written by #rlm_ldap_cache_stats.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there's no statistic with that name.
+ */
+int rlm_ldap_cache_stat(uint64_t *out, rlm_ldap_cache_t *cache, char const *name)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (strcmp(name, "entries") == 0) {
+		*out = fr_dlist_num_elements(&cache->lru);
+	} else if (strcmp(name, "size") == 0) {
+		*out = cache->size;
+	} else if (strcmp(name, "max_size") == 0) {
+		*out = cache->inst->lookup_cache.max_size;
+	} else if (strcmp(name, "count.hits") == 0) {
+		*out = cache->hits;
+	} else if (strcmp(name, "count.misses") == 0) {
+		*out = cache->misses;
+	} else if (strcmp(name, "count.expired") == 0) {
+		*out = cache->expired;
+	} else if (strcmp(name, "count.evictions") == 0) {
+		*out = cache->evictions;
+	} else if (strcmp(name, "count.invalidations") == 0) {
+		*out = cache->invalidations;
+	} else {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return ret;
+}
+
+/** Write the cache's statistics
+ *
+ * @param[in] fp	to write to.
+ * @param[in] cache	to write statistics for.
+ */
+void rlm_ldap_cache_stats(FILE *fp, rlm_ldap_cache_t *cache)
+{
+	pthread_mutex_lock(&cache->mutex);
+	fprintf(fp, "entries			%zu\n", fr_dlist_num_elements(&cache->lru));
+	fprintf(fp, "size			%zu\n", cache->size);
+	fprintf(fp, "max_size		%zu\n", cache->inst->lookup_cache.max_size);
+	fprintf(fp, "count.hits		%" PRIu64 "\n", cache->hits);
+	fprintf(fp, "count.misses		%" PRIu64 "\n", cache->misses);
+	fprintf(fp, "count.expired		%" PRIu64 "\n", cache->expired);
+	fprintf(fp, "count.evictions		%" PRIu64 "\n", cache->evictions);
+	fprintf(fp, "count.invalidations	%" PRIu64 "\n", cache->invalidations);
+	pthread_mutex_unlock(&cache->mutex);
+}
@@ -36,59 +36,67 @@ USES_APPLE_DEPRECATED_API
 
 #include "rlm_ldap.h"
 
-/** Convert multiple group names into a DNs
+/** Which search caching group memberships over the trunk is waiting for
  *
- * Given an array of group names, builds a filter matching all names, then retrieves all group objects
- * and stores the DN associated with each group object.
+ */
+typedef enum {
+	LDAP_GROUPS_USEROBJ = 0,			//!< Processing membership values in the user object.
+	LDAP_GROUPS_DN2NAME,				//!< Resolving a group DN to a name.
+	LDAP_GROUPS_NAME2DN,				//!< Resolving group names to DNs.
+	LDAP_GROUPS_GROUPOBJ_START,			//!< Need to search for group objects.
+	LDAP_GROUPS_GROUPOBJ,				//!< Searching for group objects which reference the user.
+	LDAP_GROUPS_DONE				//!< Finished.
+} rlm_ldap_groups_state_t;
+
+/** State for caching group memberships over the thread's trunk
+ *
+ */
+struct rlm_ldap_groups_ctx_s {
+	rlm_ldap_t const	*inst;				//!< rlm_ldap configuration.
+	rlm_ldap_groups_state_t	state;				//!< Which search we're waiting for.
+	ldap_trunk_result_t	search;				//!< Search in progress.
+	char const		*attrs[2];			//!< Attributes to retrieve in the search.
+
+	struct berval		**values;			//!< Membership values from the user object.
+	int			count;				//!< How many values to process.
+	int			idx;				//!< Next value to process.
+	char			*dn;				//!< Group DN being resolved to a name.
+
+	char			*group_name[LDAP_MAX_CACHEABLE + 1];	//!< Group names to resolve to DNs.
+	unsigned int		name_cnt;			//!< How many group names there are.
+	fr_pair_list_t		groups;				//!< Memberships resolved so far.
+};
+
+/** Build a filter matching multiple group names
+ *
+ * It'll probably only save a few ms in network latency, but it means we can send a query
+ * for the entire group list at once.
  *
- * @param[out] p_result		The result of trying to resolve a group name to a dn.
  * @param[in] inst		rlm_ldap configuration.
  * @param[in] request		Current request.
- * @param[in,out] pconn		to use. May change as this function calls functions which auto re-connect.
- * @param[in] names		to convert to DNs (NULL terminated).
- * @param[out] out		Where to write the DNs. DNs must be freed with
- *				ldap_memfree(). Will be NULL terminated.
- * @param[in] outlen		Size of out.
- * @return One of the RLM_MODULE_* values.
+ * @param[in] names		to match (NULL terminated).
+ * @param[out] name_cnt		How many names the filter matches.
+ * @return
+ *	- The filter, talloced in the request.
+ *	- NULL on error.
  */
-static unlang_action_t rlm_ldap_group_name2dn(rlm_rcode_t *p_result, rlm_ldap_t const *inst, request_t *request,
-					      fr_ldap_connection_t **pconn,
-					      char **names, char **out, size_t outlen)
+static char *rlm_ldap_group_name2dn_filter(rlm_ldap_t const *inst, request_t *request,
+					   char **names, unsigned int *name_cnt)
 {
-	rlm_rcode_t rcode = RLM_MODULE_OK;
-	fr_ldap_rcode_t status;
-	int ldap_errno;
-
-	unsigned int name_cnt = 0;
-	unsigned int entry_cnt;
-	char const *attrs[] = { NULL };
-
-	LDAPMessage *result = NULL, *entry;
-
 	char **name = names;
-	char **dn = out;
-	char const *base_dn = NULL;
-	char base_dn_buff[LDAP_MAX_DN_STR_LEN];
 	char buffer[LDAP_MAX_GROUP_NAME_LEN + 1];
-
 	char *filter;
 
-	*dn = NULL;
-
-	if (!*names) RETURN_MODULE_OK;
+	*name_cnt = 0;
 
 	if (!inst->groupobj_name_attr) {
 		REDEBUG("Told to convert group names to DNs but missing 'group.name_attribute' directive");
 
-		RETURN_MODULE_INVALID;
+		return NULL;
 	}
 
 	RDEBUG2("Converting group name(s) to group DN(s)");
 
-	/*
-	 *	It'll probably only save a few ms in network latency, but it means we can send a query
-	 *	for the entire group list at once.
-	 */
 	filter = talloc_typed_asprintf(request, "%s%s%s",
 				 inst->groupobj_filter ? "(&" : "",
 				 inst->groupobj_filter ? inst->groupobj_filter : "",
@@ -97,47 +105,52 @@ static unlang_action_t rlm_ldap_group_name2dn(rlm_rcode_t *p_result, rlm_ldap_t
 		fr_ldap_escape_func(request, buffer, sizeof(buffer), *name++, NULL);
 		filter = talloc_asprintf_append_buffer(filter, "(%s=%s)", inst->groupobj_name_attr, buffer);
 
-		name_cnt++;
+		(*name_cnt)++;
 	}
 	filter = talloc_asprintf_append_buffer(filter, "%s%s",
 					       inst->groupobj_filter ? ")" : "",
 					       names[0] && names[1] ? ")" : "");
 
-	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
-			inst->groupobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
-		REDEBUG("Failed creating base_dn");
+	return filter;
+}
 
-		RETURN_MODULE_INVALID;
-	}
+/** Retrieve the DNs of the group objects returned by a search for group names
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @param[in] conn		the result was received on.
+ * @param[in] result		of the search.
+ * @param[in] name_cnt		How many names were searched for.
+ * @param[out] out		Where to write the DNs. DNs must be freed with
+ *				ldap_memfree(). Will be NULL terminated.
+ * @param[in] outlen		Size of out.
+ * @return One of the RLM_MODULE_* values.
+ */
+static rlm_rcode_t rlm_ldap_group_name2dn_result(rlm_ldap_t const *inst, request_t *request,
+						 fr_ldap_connection_t const *conn, LDAPMessage *result,
+						 unsigned int name_cnt, char **out, size_t outlen)
+{
+	rlm_rcode_t rcode = RLM_MODULE_OK;
+	int ldap_errno;
 
-	status = fr_ldap_search(&result, request, pconn, base_dn, inst->groupobj_scope,
-				filter, attrs, NULL, NULL);
-	switch (status) {
-	case LDAP_PROC_SUCCESS:
-		break;
+	unsigned int entry_cnt;
+	LDAPMessage *entry;
 
-	case LDAP_PROC_NO_RESULT:
-		RDEBUG2("Tried to resolve group name(s) to DNs but got no results");
-		goto finish;
+	char **dn = out;
 
-	default:
-		rcode = RLM_MODULE_FAIL;
-		goto finish;
-	}
+	*dn = NULL;
 
-	entry_cnt = ldap_count_entries((*pconn)->handle, result);
+	entry_cnt = ldap_count_entries(conn->handle, result);
 	if (entry_cnt > name_cnt) {
 		REDEBUG("Number of DNs exceeds number of names, group and/or dn should be more restrictive");
-		rcode = RLM_MODULE_INVALID;
 
-		goto finish;
+		return RLM_MODULE_INVALID;
 	}
 
 	if (entry_cnt > (outlen - 1)) {
 		REDEBUG("Number of DNs exceeds limit (%zu)", outlen - 1);
-		rcode = RLM_MODULE_INVALID;
 
-		goto finish;
+		return RLM_MODULE_INVALID;
 	}
 
 	if (entry_cnt < name_cnt) {
@@ -145,48 +158,153 @@ static unlang_action_t rlm_ldap_group_name2dn(rlm_rcode_t *p_result, rlm_ldap_t
 			name_cnt, entry_cnt);
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, result);
+	entry = ldap_first_entry(conn->handle, result);
 	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
 
-		rcode = RLM_MODULE_FAIL;
-		goto finish;
+		return RLM_MODULE_FAIL;
 	}
 
 	do {
-		*dn = ldap_get_dn((*pconn)->handle, entry);
+		*dn = ldap_get_dn(conn->handle, entry);
 		if (!*dn) {
-			ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+			ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 			REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
 
 			rcode = RLM_MODULE_FAIL;
-			goto finish;
+			break;
 		}
 		fr_ldap_util_normalise_dn(*dn, *dn);
 
 		RDEBUG2("Got group DN \"%s\"", *dn);
 		dn++;
-	} while((entry = ldap_next_entry((*pconn)->handle, entry)));
+	} while((entry = ldap_next_entry(conn->handle, entry)));
 
 	*dn = NULL;
 
-finish:
-	talloc_free(filter);
-	if (result) ldap_msgfree(result);
-
 	/*
 	 *	Be nice and cleanup the output array if we error out.
 	 */
 	if (rcode != RLM_MODULE_OK) {
-		dn = out;
-		while(*dn) ldap_memfree(*dn++);
-		*dn = NULL;
+		for (dn = out; *dn; dn++) ldap_memfree(*dn);
+		*out = NULL;
 	}
 
+	return rcode;
+}
+
+/** Convert multiple group names into a DNs
+ *
+ * Given an array of group names, builds a filter matching all names, then retrieves all group objects
+ * and stores the DN associated with each group object.
+ *
+ * @param[out] p_result		The result of trying to resolve a group name to a dn.
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @param[in,out] pconn		to use. May change as this function calls functions which auto re-connect.
+ * @param[in] names		to convert to DNs (NULL terminated).
+ * @param[out] out		Where to write the DNs. DNs must be freed with
+ *				ldap_memfree(). Will be NULL terminated.
+ * @param[in] outlen		Size of out.
+ * @return One of the RLM_MODULE_* values.
+ */
+static unlang_action_t rlm_ldap_group_name2dn(rlm_rcode_t *p_result, rlm_ldap_t const *inst, request_t *request,
+					      fr_ldap_connection_t **pconn,
+					      char **names, char **out, size_t outlen)
+{
+	rlm_rcode_t rcode = RLM_MODULE_OK;
+	fr_ldap_rcode_t status;
+
+	unsigned int name_cnt;
+	char const *attrs[] = { NULL };
+
+	LDAPMessage *result = NULL;
+
+	char const *base_dn = NULL;
+	char base_dn_buff[LDAP_MAX_DN_STR_LEN];
+
+	char *filter;
+
+	*out = NULL;
+
+	if (!*names) RETURN_MODULE_OK;
+
+	filter = rlm_ldap_group_name2dn_filter(inst, request, names, &name_cnt);
+	if (!filter) RETURN_MODULE_INVALID;
+
+	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
+			inst->groupobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Failed creating base_dn");
+		talloc_free(filter);
+
+		RETURN_MODULE_INVALID;
+	}
+
+	status = fr_ldap_search(&result, request, pconn, base_dn, inst->groupobj_scope,
+				filter, attrs, NULL, NULL);
+	talloc_free(filter);
+	switch (status) {
+	case LDAP_PROC_SUCCESS:
+		rcode = rlm_ldap_group_name2dn_result(inst, request, *pconn, result, name_cnt, out, outlen);
+		break;
+
+	case LDAP_PROC_NO_RESULT:
+		RDEBUG2("Tried to resolve group name(s) to DNs but got no results");
+		break;
+
+	default:
+		rcode = RLM_MODULE_FAIL;
+		break;
+	}
+
+	if (result) ldap_msgfree(result);
+
 	RETURN_MODULE_RCODE(rcode);
 }
 
+/** Retrieve the group name from the group object returned by a search for a group DN
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @param[in] conn		the result was received on.
+ * @param[in] result		of the search.
+ * @param[in] dn		which was searched for.
+ * @param[out] out		Where to write group name (must be freed with talloc_free).
+ * @return One of the RLM_MODULE_* values.
+ */
+static rlm_rcode_t rlm_ldap_group_dn2name_result(rlm_ldap_t const *inst, request_t *request,
+						 fr_ldap_connection_t const *conn, LDAPMessage *result,
+						 char const *dn, char **out)
+{
+	int ldap_errno;
+
+	struct berval **values;
+	LDAPMessage *entry;
+
+	entry = ldap_first_entry(conn->handle, result);
+	if (!entry) {
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
+
+		return RLM_MODULE_INVALID;
+	}
+
+	values = ldap_get_values_len(conn->handle, entry, inst->groupobj_name_attr);
+	if (!values) {
+		REDEBUG("No %s attributes found in object", inst->groupobj_name_attr);
+
+		return RLM_MODULE_INVALID;
+	}
+
+	*out = fr_ldap_berval_to_string(request, values[0]);
+	RDEBUG2("Group DN \"%s\" resolves to name \"%s\"", dn, *out);
+
+	ldap_value_free_len(values);
+
+	return RLM_MODULE_OK;
+}
+
 /** Convert a single group name into a DN
  *
  * Unlike the inverse conversion of a name to a DN, most LDAP directories don't allow filtering by DN,
@@ -203,13 +321,11 @@ finish:
 static unlang_action_t rlm_ldap_group_dn2name(rlm_rcode_t *p_result, rlm_ldap_t const *inst, request_t *request,
 					      fr_ldap_connection_t **pconn, char const *dn, char **out)
 {
-	rlm_rcode_t rcode = RLM_MODULE_OK;
+	rlm_rcode_t rcode;
 	fr_ldap_rcode_t status;
-	int ldap_errno;
 
-	struct berval **values = NULL;
 	char const *attrs[] = { inst->groupobj_name_attr, NULL };
-	LDAPMessage *result = NULL, *entry;
+	LDAPMessage *result = NULL;
 
 	*out = NULL;
 
@@ -234,32 +350,120 @@ static unlang_action_t rlm_ldap_group_dn2name(rlm_rcode_t *p_result, rlm_ldap_t
 		RETURN_MODULE_FAIL;
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, result);
-	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
+	rcode = rlm_ldap_group_dn2name_result(inst, request, *pconn, result, dn, out);
+	ldap_msgfree(result);
 
-		rcode = RLM_MODULE_INVALID;
-		goto finish;
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Add a membership value from the user object to the list of groups
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] ctx		to allocate new pairs in.
+ * @param[in] groups_cursor	to append new pairs to.
+ * @param[in] names_ctx		to allocate group names in.
+ * @param[in,out] names		Group names which need resolving to DNs.
+ * @param[in,out] name_cnt	How many names there are in names.
+ * @param[in] value		to add.
+ * @return
+ *	- true if the value is a DN which needs resolving to a group name.
+ *	- false if there's nothing more to do.
+ */
+static bool rlm_ldap_cacheable_userobj_value(rlm_ldap_t const *inst, TALLOC_CTX *ctx, fr_cursor_t *groups_cursor,
+					     TALLOC_CTX *names_ctx, char **names, unsigned int *name_cnt,
+					     struct berval const *value)
+{
+	fr_pair_t	*vp;
+	int		is_dn;
+
+	is_dn = fr_ldap_util_is_dn(value->bv_val, value->bv_len);
+
+	if (inst->cacheable_group_dn) {
+		/*
+		 *	The easy case, we're caching DNs and we got a DN.
+		 */
+		if (is_dn) {
+			MEM(vp = fr_pair_afrom_da(ctx, inst->cache_da));
+			fr_pair_value_bstrndup(vp, value->bv_val, value->bv_len, true);
+			fr_cursor_append(groups_cursor, vp);
+		/*
+		 *	We were told to cache DNs but we got a name, we now need to resolve
+		 *	this to a DN. Store all the group names in an array so we can do one query.
+		 */
+		} else {
+			names[(*name_cnt)++] = fr_ldap_berval_to_string(names_ctx, value);
+		}
 	}
 
-	values = ldap_get_values_len((*pconn)->handle, entry, inst->groupobj_name_attr);
-	if (!values) {
-		REDEBUG("No %s attributes found in object", inst->groupobj_name_attr);
+	if (inst->cacheable_group_name) {
+		/*
+		 *	The easy case, we're caching names and we got a name.
+		 */
+		if (!is_dn) {
+			MEM(vp = fr_pair_afrom_da(ctx, inst->cache_da));
+			fr_pair_value_bstrndup(vp, value->bv_val, value->bv_len, true);
+			fr_cursor_append(groups_cursor, vp);
+		/*
+		 *	We were told to cache names but we got a DN, we now need to resolve
+		 *	this to a name.
+		 *	Only Active Directory supports filtering on DN, so we have to search
+		 *	for each individual group.
+		 */
+		} else {
+			return true;
+		}
+	}
 
-		rcode = RLM_MODULE_INVALID;
+	return false;
+}
 
-		goto finish;
+/** Add the group memberships found in the user object to the control list
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @param[in] groups		Memberships to add.  Will be empty on return.
+ * @param[in] group_dn		Group DNs to add (NULL terminated).  Will be freed.
+ */
+static void rlm_ldap_cacheable_userobj_merge(rlm_ldap_t const *inst, request_t *request,
+					     fr_pair_list_t *groups, char **group_dn)
+{
+	fr_pair_t		*vp;
+	fr_pair_list_t		*list;
+	TALLOC_CTX		*list_ctx;
+	fr_cursor_t		list_cursor, groups_cursor;
+	char			**dn_p;
+
+	list = radius_list(request, PAIR_LIST_CONTROL);
+	list_ctx = radius_list_ctx(request, PAIR_LIST_CONTROL);
+	fr_assert(list != NULL);
+	fr_assert(list_ctx != NULL);
+
+	fr_cursor_init(&list_cursor, list);
+	fr_cursor_init(&groups_cursor, groups);
+
+	RDEBUG2("Adding cacheable user object memberships");
+	RINDENT();
+	if (RDEBUG_ENABLED) {
+		for (vp = fr_cursor_head(&groups_cursor);
+		     vp;
+		     vp = fr_cursor_next(&groups_cursor)) {
+			RDEBUG2("&control.%s += \"%pV\"", inst->cache_da->name, &vp->data);
+		}
 	}
 
-	*out = fr_ldap_berval_to_string(request, values[0]);
-	RDEBUG2("Group DN \"%s\" resolves to name \"%s\"", dn, *out);
+	fr_cursor_head(&groups_cursor);
+	fr_cursor_merge(&list_cursor, &groups_cursor);
+	fr_pair_list_init(groups);
 
-finish:
-	if (result) ldap_msgfree(result);
-	if (values) ldap_value_free_len(values);
+	for (dn_p = group_dn; *dn_p; dn_p++) {
+		MEM(vp = fr_pair_afrom_da(list_ctx, inst->cache_da));
+		fr_pair_value_strdup(vp, *dn_p);
+		fr_cursor_append(&list_cursor, vp);
 
-	RETURN_MODULE_RCODE(rcode);
+		RDEBUG2("&control.%s += \"%pV\"", inst->cache_da->name, &vp->data);
+		ldap_memfree(*dn_p);
+	}
+	REXDENT();
 }
 
 /** Convert group membership information into attributes
@@ -281,19 +485,18 @@ unlang_action_t rlm_ldap_cacheable_userobj(rlm_rcode_t *p_result, rlm_ldap_t con
 	struct berval **values;
 
 	char *group_name[LDAP_MAX_CACHEABLE + 1];
-	char **name_p = group_name;
+	unsigned int name_cnt = 0;
 
 	char *group_dn[LDAP_MAX_CACHEABLE + 1];
-	char **dn_p;
 
 	char *name;
 
 	fr_pair_t *vp;
-	fr_pair_list_t *list, groups;
+	fr_pair_list_t groups;
 	TALLOC_CTX *list_ctx, *value_ctx;
-	fr_cursor_t list_cursor, groups_cursor;
+	fr_cursor_t groups_cursor;
 
-	int is_dn, i, count;
+	int i, count;
 
 	fr_assert(entry);
 	fr_assert(attr);
@@ -310,9 +513,7 @@ unlang_action_t rlm_ldap_cacheable_userobj(rlm_rcode_t *p_result, rlm_ldap_t con
 	}
 	count = ldap_count_values_len(values);
 
-	list = radius_list(request, PAIR_LIST_CONTROL);
 	list_ctx = radius_list_ctx(request, PAIR_LIST_CONTROL);
-	fr_assert(list != NULL);
 	fr_assert(list_ctx != NULL);
 
 	/*
@@ -328,98 +529,110 @@ unlang_action_t rlm_ldap_cacheable_userobj(rlm_rcode_t *p_result, rlm_ldap_t con
 	fr_cursor_init(&groups_cursor, &groups);
 
 	for (i = 0; (i < LDAP_MAX_CACHEABLE) && (i < count); i++) {
-		is_dn = fr_ldap_util_is_dn(values[i]->bv_val, values[i]->bv_len);
+		char *dn;
 
-		if (inst->cacheable_group_dn) {
-			/*
-			 *	The easy case, we're caching DNs and we got a DN.
-			 */
-			if (is_dn) {
-				MEM(vp = fr_pair_afrom_da(list_ctx, inst->cache_da));
-				fr_pair_value_bstrndup(vp, values[i]->bv_val, values[i]->bv_len, true);
-				fr_cursor_append(&groups_cursor, vp);
-			/*
-			 *	We were told to cache DNs but we got a name, we now need to resolve
-			 *	this to a DN. Store all the group names in an array so we can do one query.
-			 */
-			} else {
-				*name_p++ = fr_ldap_berval_to_string(value_ctx, values[i]);
-			}
-		}
+		if (!rlm_ldap_cacheable_userobj_value(inst, list_ctx, &groups_cursor,
+						      value_ctx, group_name, &name_cnt, values[i])) continue;
 
-		if (inst->cacheable_group_name) {
-			/*
-			 *	The easy case, we're caching names and we got a name.
-			 */
-			if (!is_dn) {
-				MEM(vp = fr_pair_afrom_da(list_ctx, inst->cache_da));
-				fr_pair_value_bstrndup(vp, values[i]->bv_val, values[i]->bv_len, true);
-				fr_cursor_append(&groups_cursor, vp);
-			/*
-			 *	We were told to cache names but we got a DN, we now need to resolve
-			 *	this to a name.
-			 *	Only Active Directory supports filtering on DN, so we have to search
-			 *	for each individual group.
-			 */
-			} else {
-				char *dn;
-
-				dn = fr_ldap_berval_to_string(value_ctx, values[i]);
-				rlm_ldap_group_dn2name(&rcode, inst, request, pconn, dn, &name);
-				talloc_free(dn);
-
-				if (rcode == RLM_MODULE_NOOP) continue;
-
-				if (rcode != RLM_MODULE_OK) {
-					ldap_value_free_len(values);
-					talloc_free(value_ctx);
-					fr_pair_list_free(&groups);
-
-					RETURN_MODULE_RCODE(rcode);
-				}
+		dn = fr_ldap_berval_to_string(value_ctx, values[i]);
+		rlm_ldap_group_dn2name(&rcode, inst, request, pconn, dn, &name);
+		talloc_free(dn);
 
-				MEM(vp = fr_pair_afrom_da(list_ctx, inst->cache_da));
-				fr_pair_value_bstrdup_buffer(vp, name, true);
-				fr_cursor_append(&groups_cursor, vp);
-				talloc_free(name);
-			}
+		if (rcode == RLM_MODULE_NOOP) continue;
+
+		if (rcode != RLM_MODULE_OK) {
+			ldap_value_free_len(values);
+			talloc_free(value_ctx);
+			fr_pair_list_free(&groups);
+
+			RETURN_MODULE_RCODE(rcode);
 		}
+
+		MEM(vp = fr_pair_afrom_da(list_ctx, inst->cache_da));
+		fr_pair_value_bstrdup_buffer(vp, name, true);
+		fr_cursor_append(&groups_cursor, vp);
+		talloc_free(name);
 	}
-	*name_p = NULL;
+	group_name[name_cnt] = NULL;
 
-	rlm_ldap_group_name2dn(&rcode, inst, request, pconn, group_name, group_dn, sizeof(group_dn));
+	rlm_ldap_group_name2dn(&rcode, inst, request, pconn, group_name, group_dn, NUM_ELEMENTS(group_dn));
 
 	ldap_value_free_len(values);
 	talloc_free(value_ctx);
 
-	if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
-
-	fr_cursor_init(&list_cursor, list);
+	if (rcode != RLM_MODULE_OK) {
+		fr_pair_list_free(&groups);
 
-	RDEBUG2("Adding cacheable user object memberships");
-	RINDENT();
-	if (RDEBUG_ENABLED) {
-		for (vp = fr_cursor_head(&groups_cursor);
-		     vp;
-		     vp = fr_cursor_next(&groups_cursor)) {
-			RDEBUG2("&control.%s += \"%pV\"", inst->cache_da->name, &vp->data);
-		}
+		RETURN_MODULE_RCODE(rcode);
 	}
 
-	fr_cursor_head(&groups_cursor);
-	fr_cursor_merge(&list_cursor, &groups_cursor);
+	rlm_ldap_cacheable_userobj_merge(inst, request, &groups, group_dn);
 
-	for (dn_p = group_dn; *dn_p; dn_p++) {
-		MEM(vp = fr_pair_afrom_da(list_ctx, inst->cache_da));
-		fr_pair_value_strdup(vp, *dn_p);
-		fr_cursor_append(&list_cursor, vp);
+	RETURN_MODULE_RCODE(rcode);
+}
 
-		RDEBUG2("&control.%s += \"%pV\"", inst->cache_da->name, &vp->data);
-		ldap_memfree(*dn_p);
+/** Add the groups returned by a search for group objects referencing the user to the control list
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @param[in] conn		the result was received on.
+ * @param[in] result		of the search.
+ */
+static void rlm_ldap_cacheable_groupobj_result(rlm_ldap_t const *inst, request_t *request,
+					       fr_ldap_connection_t const *conn, LDAPMessage *result)
+{
+	int ldap_errno;
+
+	LDAPMessage *entry;
+
+	fr_pair_t *vp;
+	char *dn;
+
+	entry = ldap_first_entry(conn->handle, result);
+	if (!entry) {
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
+
+		return;
 	}
-	REXDENT();
 
-	RETURN_MODULE_RCODE(rcode);
+	RDEBUG2("Adding cacheable group object memberships");
+	do {
+		if (inst->cacheable_group_dn) {
+			dn = ldap_get_dn(conn->handle, entry);
+			if (!dn) {
+				ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+				REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
+
+				return;
+			}
+			fr_ldap_util_normalise_dn(dn, dn);
+
+			MEM(pair_add_control(&vp, inst->cache_da) == 0);
+			fr_pair_value_strdup(vp, dn);
+
+			RINDENT();
+			RDEBUG2("&control.%pP", vp);
+			REXDENT();
+			ldap_memfree(dn);
+		}
+
+		if (inst->cacheable_group_name) {
+			struct berval **values;
+
+			values = ldap_get_values_len(conn->handle, entry, inst->groupobj_name_attr);
+			if (!values) continue;
+
+			MEM(pair_add_control(&vp, inst->cache_da) == 0);
+			fr_pair_value_bstrndup(vp, values[0]->bv_val, values[0]->bv_len, true);
+
+			RINDENT();
+			RDEBUG2("&control.%pP", vp);
+			REXDENT();
+
+			ldap_value_free_len(values);
+		}
+	} while ((entry = ldap_next_entry(conn->handle, entry)));
 }
 
 /** Convert group membership information into attributes
@@ -435,10 +648,8 @@ unlang_action_t rlm_ldap_cacheable_groupobj(rlm_rcode_t *p_result, rlm_ldap_t co
 {
 	rlm_rcode_t rcode = RLM_MODULE_OK;
 	fr_ldap_rcode_t status;
-	int ldap_errno;
 
 	LDAPMessage *result = NULL;
-	LDAPMessage *entry;
 
 	char const *base_dn;
 	char base_dn_buff[LDAP_MAX_DN_STR_LEN];
@@ -448,9 +659,6 @@ unlang_action_t rlm_ldap_cacheable_groupobj(rlm_rcode_t *p_result, rlm_ldap_t co
 
 	char const *attrs[] = { inst->groupobj_name_attr, NULL };
 
-	fr_pair_t *vp;
-	char *dn;
-
 	fr_assert(inst->groupobj_base_dn);
 
 	if (!inst->groupobj_membership_filter) {
@@ -476,67 +684,315 @@ unlang_action_t rlm_ldap_cacheable_groupobj(rlm_rcode_t *p_result, rlm_ldap_t co
 				inst->groupobj_scope, filter, attrs, NULL, NULL);
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
+		rlm_ldap_cacheable_groupobj_result(inst, request, *pconn, result);
 		break;
 
 	case LDAP_PROC_NO_RESULT:
 		RDEBUG2("No cacheable group memberships found in group objects");
-		goto finish;
+		break;
 
 	default:
 		rcode = RLM_MODULE_FAIL;
-		goto finish;
+		break;
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, result);
-	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
+	if (result) ldap_msgfree(result);
 
-		goto finish;
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static int _groups_ctx_free(rlm_ldap_groups_ctx_t *g)
+{
+	ldap_trunk_result_free(&g->search);
+	if (g->values) ldap_value_free_len(g->values);
+	fr_pair_list_free(&g->groups);
+
+	return 0;
+}
+
+/** Allocate the state for caching group memberships over the thread's trunk
+ *
+ * @param[in] ctx		to allocate the state in.
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @param[in] conn		the user object was received on.
+ * @param[in] entry		User object.
+ * @return The state, to be passed to #rlm_ldap_cacheable_async, and freed with talloc_free.
+ */
+rlm_ldap_groups_ctx_t *rlm_ldap_cacheable_async_alloc(TALLOC_CTX *ctx, rlm_ldap_t const *inst, request_t *request,
+						      fr_ldap_connection_t const *conn, LDAPMessage *entry)
+{
+	rlm_ldap_groups_ctx_t	*g;
+
+	MEM(g = talloc_zero(ctx, rlm_ldap_groups_ctx_t));
+	g->inst = inst;
+	fr_pair_list_init(&g->groups);
+	talloc_set_destructor(g, _groups_ctx_free);
+
+	if (!inst->userobj_membership_attr) {
+		g->state = LDAP_GROUPS_GROUPOBJ_START;
+		return g;
 	}
 
-	RDEBUG2("Adding cacheable group object memberships");
-	do {
-		if (inst->cacheable_group_dn) {
-			dn = ldap_get_dn((*pconn)->handle, entry);
-			if (!dn) {
-				ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-				REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
+	/*
+	 *	Parse the membership information we got in the initial user query.
+	 *	The values are copies, so don't need the connection once we have them.
+	 */
+	g->values = ldap_get_values_len(conn->handle, entry, inst->userobj_membership_attr);
+	if (!g->values) {
+		RDEBUG2("No cacheable group memberships found in user object");
+
+		g->state = LDAP_GROUPS_GROUPOBJ_START;
+		return g;
+	}
+	g->count = ldap_count_values_len(g->values);
+	if (g->count > LDAP_MAX_CACHEABLE) g->count = LDAP_MAX_CACHEABLE;
+
+	g->state = LDAP_GROUPS_USEROBJ;
+
+	return g;
+}
+
+/** Cache group memberships, searching over the thread's trunk
+ *
+ * Performs the same lookups as #rlm_ldap_cacheable_userobj and
+ * #rlm_ldap_cacheable_groupobj, one search at a time.  Whenever a search
+ * has been enqueued the caller should yield, and call this function again
+ * when it's resumed.
+ *
+ * @param[out] p_result		Result of caching the memberships, once we're done.
+ * @param[in] g			State allocated by #rlm_ldap_cacheable_async_alloc.
+ * @param[in] t			Thread instance.
+ * @param[in] request		Current request.
+ * @return
+ *	- 1 if a search was enqueued.
+ *	- 0 if we're done.
+ */
+int rlm_ldap_cacheable_async(rlm_rcode_t *p_result, rlm_ldap_groups_ctx_t *g, rlm_ldap_thread_t *t,
+			     request_t *request)
+{
+	rlm_ldap_t const	*inst = g->inst;
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	TALLOC_CTX		*list_ctx;
+	fr_cursor_t		groups_cursor;
+	fr_pair_t		*vp;
 
+	char const		*base_dn;
+	char			base_dn_buff[LDAP_MAX_DN_STR_LEN];
+
+	list_ctx = radius_list_ctx(request, PAIR_LIST_CONTROL);
+	fr_assert(list_ctx != NULL);
+
+	fr_cursor_init(&groups_cursor, &g->groups);
+	fr_cursor_tail(&groups_cursor);
+
+	switch (g->state) {
+	case LDAP_GROUPS_DN2NAME:
+	{
+		char *name = NULL;
+
+		switch (g->search.status) {
+		case LDAP_PROC_SUCCESS:
+			if (!g->search.conn) {
+				REDEBUG("Connection closed before the group object could be processed");
+				rcode = RLM_MODULE_FAIL;
+				break;
+			}
+			rcode = rlm_ldap_group_dn2name_result(inst, request, g->search.conn, g->search.result,
+							      g->dn, &name);
+			break;
+
+		case LDAP_PROC_NO_RESULT:
+			REDEBUG("Group DN \"%s\" did not resolve to an object", g->dn);
+			rcode = inst->allow_dangling_group_refs ? RLM_MODULE_NOOP : RLM_MODULE_INVALID;
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		ldap_trunk_result_free(&g->search);
+		TALLOC_FREE(g->dn);
+
+		if (rcode == RLM_MODULE_NOOP) {
+			rcode = RLM_MODULE_OK;
+		} else if (rcode != RLM_MODULE_OK) {
+			goto finish;
+		} else {
+			MEM(vp = fr_pair_afrom_da(list_ctx, inst->cache_da));
+			fr_pair_value_bstrdup_buffer(vp, name, true);
+			fr_cursor_append(&groups_cursor, vp);
+			talloc_free(name);
+		}
+	}
+		FALL_THROUGH;
+
+	case LDAP_GROUPS_USEROBJ:
+		while (g->idx < g->count) {
+			struct berval *value = g->values[g->idx++];
+
+			if (!rlm_ldap_cacheable_userobj_value(inst, list_ctx, &groups_cursor,
+							      g, g->group_name, &g->name_cnt, value)) continue;
+
+			if (!inst->groupobj_name_attr) {
+				REDEBUG("Told to resolve group DN to name but missing 'group.name_attribute' directive");
+				rcode = RLM_MODULE_INVALID;
 				goto finish;
 			}
-			fr_ldap_util_normalise_dn(dn, dn);
 
-			MEM(pair_add_control(&vp, inst->cache_da) == 0);
-			fr_pair_value_strdup(vp, dn);
+			g->dn = fr_ldap_berval_to_string(g, value);
+			RDEBUG2("Resolving group DN \"%s\" to group name", g->dn);
 
-			RINDENT();
-			RDEBUG2("&control.%pP", vp);
-			REXDENT();
-			ldap_memfree(dn);
+			g->attrs[0] = inst->groupobj_name_attr;
+			g->attrs[1] = NULL;
+			if (ldap_trunk_search(&g->search, t, request, g->dn, LDAP_SCOPE_BASE, NULL, g->attrs, NULL) < 0) {
+				REDEBUG("Failed enqueueing group search");
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
+			}
+			g->state = LDAP_GROUPS_DN2NAME;
+
+			return 1;
 		}
+		g->group_name[g->name_cnt] = NULL;
 
-		if (inst->cacheable_group_name) {
-			struct berval **values;
+		if (g->name_cnt) {
+			char		*filter;
+			unsigned int	name_cnt;
+			int		ret;
 
-			values = ldap_get_values_len((*pconn)->handle, entry, inst->groupobj_name_attr);
-			if (!values) continue;
+			filter = rlm_ldap_group_name2dn_filter(inst, request, g->group_name, &name_cnt);
+			if (!filter) {
+				rcode = RLM_MODULE_INVALID;
+				goto finish;
+			}
 
-			MEM(pair_add_control(&vp, inst->cache_da) == 0);
-			fr_pair_value_bstrndup(vp, values[0]->bv_val, values[0]->bv_len, true);
+			if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
+					inst->groupobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
+				REDEBUG("Failed creating base_dn");
+				talloc_free(filter);
+				rcode = RLM_MODULE_INVALID;
+				goto finish;
+			}
 
-			RINDENT();
-			RDEBUG2("&control.%pP", vp);
-			REXDENT();
+			g->attrs[0] = NULL;
+			ret = ldap_trunk_search(&g->search, t, request, base_dn, inst->groupobj_scope, filter,
+						g->attrs, NULL);
+			talloc_free(filter);
+			if (ret < 0) {
+				REDEBUG("Failed enqueueing group search");
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
+			}
+			g->state = LDAP_GROUPS_NAME2DN;
 
-			ldap_value_free_len(values);
+			return 1;
 		}
-	} while ((entry = ldap_next_entry((*pconn)->handle, entry)));
+
+		rlm_ldap_cacheable_userobj_merge(inst, request, &g->groups, (char *[]){ NULL });
+		goto groupobj;
+
+	case LDAP_GROUPS_NAME2DN:
+	{
+		char *group_dn[LDAP_MAX_CACHEABLE + 1] = { NULL };
+
+		switch (g->search.status) {
+		case LDAP_PROC_SUCCESS:
+			if (!g->search.conn) {
+				REDEBUG("Connection closed before the group objects could be processed");
+				rcode = RLM_MODULE_FAIL;
+				break;
+			}
+			rcode = rlm_ldap_group_name2dn_result(inst, request, g->search.conn, g->search.result,
+							      g->name_cnt, group_dn, NUM_ELEMENTS(group_dn));
+			break;
+
+		case LDAP_PROC_NO_RESULT:
+			RDEBUG2("Tried to resolve group name(s) to DNs but got no results");
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		ldap_trunk_result_free(&g->search);
+		if (rcode != RLM_MODULE_OK) goto finish;
+
+		rlm_ldap_cacheable_userobj_merge(inst, request, &g->groups, group_dn);
+	}
+		FALL_THROUGH;
+
+	case LDAP_GROUPS_GROUPOBJ_START:
+	groupobj:
+	{
+		char const	*filters[] = { inst->groupobj_filter, inst->groupobj_membership_filter };
+		char		filter[LDAP_MAX_FILTER_STR_LEN + 1];
+
+		fr_assert(inst->groupobj_base_dn);
+
+		if (!inst->groupobj_membership_filter) {
+			RDEBUG2("Skipping caching group objects as directive 'group.membership_filter' is not set");
+			goto finish;
+		}
+
+		if (fr_ldap_xlat_filter(request,
+					 filters, NUM_ELEMENTS(filters),
+					 filter, sizeof(filter)) < 0) {
+			rcode = RLM_MODULE_INVALID;
+			goto finish;
+		}
+
+		if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
+				inst->groupobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
+			REDEBUG("Failed creating base_dn");
+			rcode = RLM_MODULE_INVALID;
+			goto finish;
+		}
+
+		g->attrs[0] = inst->groupobj_name_attr;
+		g->attrs[1] = NULL;
+		if (ldap_trunk_search(&g->search, t, request, base_dn, inst->groupobj_scope, filter,
+				      g->attrs, NULL) < 0) {
+			REDEBUG("Failed enqueueing group search");
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+		g->state = LDAP_GROUPS_GROUPOBJ;
+	}
+		return 1;
+
+	case LDAP_GROUPS_GROUPOBJ:
+		switch (g->search.status) {
+		case LDAP_PROC_SUCCESS:
+			if (!g->search.conn) {
+				REDEBUG("Connection closed before the group objects could be processed");
+				rcode = RLM_MODULE_FAIL;
+				break;
+			}
+			rlm_ldap_cacheable_groupobj_result(inst, request, g->search.conn, g->search.result);
+			break;
+
+		case LDAP_PROC_NO_RESULT:
+			RDEBUG2("No cacheable group memberships found in group objects");
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		ldap_trunk_result_free(&g->search);
+		break;
+
+	case LDAP_GROUPS_DONE:
+		fr_assert(0);
+		break;
+	}
 
 finish:
-	if (result) ldap_msgfree(result);
+	g->state = LDAP_GROUPS_DONE;
+	*p_result = rcode;
 
-	RETURN_MODULE_RCODE(rcode);
+	return 0;
 }
 
 /** Query the LDAP directory to check if a group object includes a user object as a member
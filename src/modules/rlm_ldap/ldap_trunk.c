@@ -0,0 +1,617 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file ldap_trunk.c
+ * @brief Multiplex searches over per-thread trunks of LDAP connections
+ *
+ * Each worker thread gets its own trunk.  Searches are sent with
+ * ldap_search_ext(), and many may be outstanding on one connection at
+ * the same time.  Results are read when the connection's file descriptor
+ * becomes readable, and matched to the search that produced them by the
+ * message ID.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+USES_APPLE_DEPRECATED_API
+
+#define LOG_PREFIX "rlm_ldap (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "rlm_ldap.h"
+
+typedef struct ldap_trunk_request_s ldap_trunk_request_t;
+
+/** Connection specific data
+ *
+ */
+typedef struct {
+	rlm_ldap_t const	*inst;			//!< Instance of rlm_ldap.
+	fr_ldap_connection_t	*conn;			//!< Bound libldap connection.
+	fr_event_list_t		*el;			//!< Event list the fd is registered with.
+	int			fd;			//!< Connection's file descriptor.
+	rbtree_t		*sent;			//!< Searches sent, indexed by message ID.
+	fr_dlist_head_t		unconsumed;		//!< Results received on this connection, which
+							///< the requests they belong to haven't freed.
+} ldap_trunk_handle_t;
+
+/** A search to send on a connection
+ *
+ */
+struct ldap_trunk_request_s {
+	fr_trunk_request_t	*treq;			//!< Trunk request we belong to.
+	ldap_trunk_handle_t	*h;			//!< Connection the search was sent on.
+							///< NULL if it hasn't been sent.
+	int			msgid;			//!< Message ID of the search.
+	fr_event_timer_t const	*ev;			//!< Fires if the result takes too long.
+
+	char			*dn;			//!< Base DN of the search.
+	int			scope;			//!< Scope of the search.
+	char			*filter;		//!< Filter, may be NULL.
+	char const * const	*attrs;			//!< Attributes to retrieve.
+	LDAPControl		*serverctrls[LDAP_MAX_CONTROLS];	//!< Controls to send with the search.
+};
+
+static int ldap_trunk_msgid_cmp(void const *one, void const *two)
+{
+	ldap_trunk_request_t const *a = one, *b = two;
+
+	return (a->msgid > b->msgid) - (a->msgid < b->msgid);
+}
+
+static int _ldap_trunk_handle_free(ldap_trunk_handle_t *h)
+{
+	ldap_trunk_result_t *r;
+
+	if (h->fd >= 0) (void) fr_event_fd_delete(h->el, h->fd, FR_EVENT_FILTER_IO);
+
+	/*
+	 *	The result messages don't need the
+	 *	connection, but anything parsing them
+	 *	does.  Let the owners know it's gone.
+	 */
+	while ((r = fr_dlist_head(&h->unconsumed))) {
+		fr_dlist_remove(&h->unconsumed, r);
+		r->conn = NULL;
+		r->unconsumed = NULL;
+	}
+
+	return 0;
+}
+
+/** Open a new connection
+ *
+ * StartTLS and the bind are driven by the libldap connection state machine,
+ * which signals the connection as connected once the bind completes, or
+ * failed if anything goes wrong.  Nothing here blocks, apart from
+ * ldap_install_tls(), which libldap provides no asynchronous version of.
+ */
+static fr_connection_state_t _ldap_trunk_conn_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(uctx, rlm_ldap_thread_t);
+	rlm_ldap_t const	*inst = t->inst;
+	ldap_trunk_handle_t	*h;
+
+	MEM(h = talloc_zero(conn, ldap_trunk_handle_t));
+	h->inst = inst;
+	h->el = conn->el;
+	h->fd = -1;
+	fr_dlist_talloc_init(&h->unconsumed, ldap_trunk_result_t, entry);
+	MEM(h->sent = rbtree_alloc(h, ldap_trunk_msgid_cmp, NULL, RBTREE_FLAG_NONE));
+	talloc_set_destructor(h, _ldap_trunk_handle_free);
+
+	MEM(h->conn = fr_ldap_connection_alloc(h));
+	h->conn->conn = conn;
+
+	if (fr_ldap_connection_configure(h->conn, &inst->handle_config) < 0) {
+	error:
+		talloc_free(h);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	/* Don't block */
+	if (ldap_set_option(h->conn->handle, LDAP_OPT_CONNECT_ASYNC, LDAP_OPT_ON) != LDAP_OPT_SUCCESS) goto error;
+	fr_ldap_connection_timeout_set(h->conn, 0);				/* Forces LDAP_X_CONNECTING */
+
+	/*
+	 *	Errors from here on are signalled by the
+	 *	state machine, which then frees the handle
+	 *	via _ldap_trunk_conn_close.
+	 */
+	fr_ldap_state_next(h->conn);
+
+	*h_out = h;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+static void _ldap_trunk_conn_close(UNUSED fr_event_list_t *el, void *handle, UNUSED void *uctx)
+{
+	ldap_trunk_handle_t	*h = talloc_get_type_abort(handle, ldap_trunk_handle_t);
+
+	talloc_free(h);
+}
+
+static fr_connection_t *ldap_trunk_conn_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+					      fr_connection_conf_t const *conf,
+					      char const *log_prefix, void *uctx)
+{
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(uctx, rlm_ldap_thread_t);
+	rlm_ldap_t const	*inst = t->inst;
+	fr_connection_t		*conn;
+
+	conn = fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = _ldap_trunk_conn_init,
+					.close = _ldap_trunk_conn_close
+				   },
+				   conf,
+				   log_prefix,
+				   t);
+	if (!conn) {
+		PERROR("Failed allocating state handler for new connection");
+		return NULL;
+	}
+
+	return conn;
+}
+
+static void ldap_trunk_conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+static void ldap_trunk_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_writable(tconn);
+}
+
+static void ldap_trunk_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				  int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	ldap_trunk_handle_t	*h = talloc_get_type_abort(tconn->conn->h, ldap_trunk_handle_t);
+	rlm_ldap_t const	*inst = h->inst;
+
+	ERROR("Connection failed: %s", fr_syserror(fd_errno));
+
+	fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+}
+
+static void ldap_trunk_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+				   fr_event_list_t *el,
+				   fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	ldap_trunk_handle_t	*h = talloc_get_type_abort(conn->h, ldap_trunk_handle_t);
+	rlm_ldap_t const	*inst = h->inst;
+	fr_event_fd_cb_t	read_fn = NULL;
+	fr_event_fd_cb_t	write_fn = NULL;
+
+	/*
+	 *	libldap only has a file descriptor
+	 *	once it's started connecting, so we
+	 *	retrieve it the first time we need it.
+	 */
+	if (h->fd < 0) {
+		if (notify_on == FR_TRUNK_CONN_EVENT_NONE) return;
+
+		if ((ldap_get_option(h->conn->handle, LDAP_OPT_DESC, &h->fd) != LDAP_OPT_SUCCESS) || (h->fd < 0)) {
+			ERROR("Failed retrieving file descriptor from libldap");
+			h->fd = -1;
+
+			/*
+			 *	May free the connection!
+			 */
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+	}
+
+	switch (notify_on) {
+	/*
+	 *	Nothing outstanding, stop listening
+	 *	for events.
+	 */
+	case FR_TRUNK_CONN_EVENT_NONE:
+		(void) fr_event_fd_delete(el, h->fd, FR_EVENT_FILTER_IO);
+		return;
+
+	case FR_TRUNK_CONN_EVENT_READ:
+		read_fn = ldap_trunk_conn_readable;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_WRITE:
+		write_fn = ldap_trunk_conn_writable;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_BOTH:
+		read_fn = ldap_trunk_conn_readable;
+		write_fn = ldap_trunk_conn_writable;
+		break;
+	}
+
+	if (fr_event_fd_insert(h, el, h->fd, read_fn, write_fn, ldap_trunk_conn_error, tconn) < 0) {
+		PERROR("Failed inserting FD event");
+
+		/*
+		 *	May free the connection!
+		 */
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Remove a search from the connection it was sent on
+ *
+ * @param[in] preq	to remove.
+ * @param[in] abandon	Tell the server we're no longer interested in the result.
+ */
+static void ldap_trunk_request_unsend(ldap_trunk_request_t *preq, bool abandon)
+{
+	ldap_trunk_handle_t	*h = preq->h;
+
+	if (!h) return;
+
+	if (abandon) (void) ldap_abandon_ext(h->conn->handle, preq->msgid, NULL, NULL);
+	rbtree_deletebydata(h->sent, preq);
+	fr_event_timer_delete(&preq->ev);
+	preq->h = NULL;
+}
+
+/** The server took longer than res_timeout to return the result
+ *
+ */
+static void _ldap_trunk_request_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	ldap_trunk_request_t	*preq = talloc_get_type_abort(uctx, ldap_trunk_request_t);
+	rlm_ldap_t const	*inst = preq->h->inst;
+	fr_trunk_request_t	*treq = preq->treq;
+	ldap_trunk_result_t	*r = treq->rctx;
+	request_t		*request = treq->request;
+
+	ROPTIONAL(REDEBUG, ERROR, "Timeout waiting for search result");
+
+	ldap_trunk_request_unsend(preq, true);
+
+	r->status = LDAP_PROC_TIMEOUT;
+	fr_trunk_request_signal_complete(treq);
+}
+
+/** Send searches
+ *
+ * Searches are written by libldap as soon as they're submitted, so we
+ * send everything pending, and let the server work on them in parallel.
+ */
+static void ldap_trunk_request_mux(UNUSED fr_event_list_t *el,
+				   fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	ldap_trunk_handle_t	*h = talloc_get_type_abort(conn->h, ldap_trunk_handle_t);
+	rlm_ldap_t const	*inst = h->inst;
+	fr_trunk_request_t	*treq;
+
+	while (fr_trunk_connection_pop_request(&treq, tconn) == 0) {
+		ldap_trunk_request_t	*preq = talloc_get_type_abort(treq->preq, ldap_trunk_request_t);
+		request_t		*request = treq->request;
+		fr_ldap_rcode_t		status;
+		int			ldap_errno;
+
+#ifdef LDAP_CONTROL_X_SESSION_TRACKING
+		/*
+		 *	Session tracking controls are specific
+		 *	to the request, so they're added to the
+		 *	connection only for the time it takes to
+		 *	send the search.
+		 */
+		if (inst->session_tracking && (fr_ldap_control_add_session_tracking(h->conn, request) < 0)) {
+			fr_ldap_control_clear(h->conn);
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+#endif
+
+		status = fr_ldap_search_async(&preq->msgid, request, &h->conn, preq->dn, preq->scope, preq->filter,
+					      preq->attrs, preq->serverctrls, NULL);
+		fr_ldap_control_clear(h->conn);
+		if (status != LDAP_PROC_SUCCESS) {
+			ldap_get_option(h->conn->handle, LDAP_OPT_ERROR_NUMBER, &ldap_errno);
+			if (ldap_errno == LDAP_SERVER_DOWN) {
+				/*
+				 *	Request stays pending, and will be
+				 *	moved to another connection.
+				 */
+				fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+				return;
+			}
+
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		if (!rbtree_insert(h->sent, preq)) {
+			ROPTIONAL(REDEBUG, ERROR, "Duplicate message ID %i", preq->msgid);
+			(void) ldap_abandon_ext(h->conn->handle, preq->msgid, NULL, NULL);
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+		preq->h = h;
+
+		if (inst->handle_config.res_timeout &&
+		    (fr_event_timer_in(preq, h->el, &preq->ev, inst->handle_config.res_timeout,
+				       _ldap_trunk_request_timeout, preq) < 0)) {
+			ROPTIONAL(RPWARN, PWARN, "Failed inserting result timeout");
+		}
+
+		fr_trunk_request_signal_sent(treq);
+	}
+}
+
+/** Check the messages returned for a search, and count the entries
+ *
+ * Mirrors the checks performed by fr_ldap_search().
+ */
+static fr_ldap_rcode_t ldap_trunk_result_check(request_t *request, ldap_trunk_handle_t *h,
+					       ldap_trunk_request_t *preq, LDAPMessage *result)
+{
+	rlm_ldap_t const	*inst = h->inst;
+	fr_ldap_rcode_t		status = LDAP_PROC_SUCCESS;
+	LDAPMessage		*msg;
+	int			count;
+
+	for (msg = ldap_first_message(h->conn->handle, result);
+	     msg;
+	     msg = ldap_next_message(h->conn->handle, msg)) {
+		status = fr_ldap_error_check(NULL, h->conn, msg, preq->dn);
+		if (status != LDAP_PROC_SUCCESS) break;
+	}
+
+	switch (status) {
+	case LDAP_PROC_SUCCESS:
+		break;
+
+	case LDAP_PROC_BAD_DN:
+		ROPTIONAL(RDEBUG2, DEBUG2, "DN %s does not exist", preq->dn);
+		return status;
+
+	default:
+		ROPTIONAL(RPEDEBUG, PERROR, "Failed performing search");
+		return status;
+	}
+
+	count = ldap_count_entries(h->conn->handle, result);
+	if (count < 0) {
+		ROPTIONAL(REDEBUG, ERROR, "Error counting results: %s", fr_ldap_error_str(h->conn));
+		return LDAP_PROC_ERROR;
+	}
+
+	if (count == 0) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Search returned no results");
+		return LDAP_PROC_NO_RESULT;
+	}
+
+	return LDAP_PROC_SUCCESS;
+}
+
+/** Read every complete result available on the connection
+ *
+ * libldap may have buffered more than one result, so we keep reading
+ * until it tells us there's nothing left, rather than waiting for the
+ * file descriptor to become readable again.
+ */
+static void ldap_trunk_request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	ldap_trunk_handle_t	*h = talloc_get_type_abort(conn->h, ldap_trunk_handle_t);
+	rlm_ldap_t const	*inst = h->inst;
+
+	for (;;) {
+		ldap_trunk_request_t	*preq;
+		fr_trunk_request_t	*treq;
+		ldap_trunk_result_t	*r;
+		request_t		*request;
+		LDAPMessage		*result = NULL;
+		int			ret;
+
+		ret = ldap_result(h->conn->handle, LDAP_RES_ANY, LDAP_MSG_ALL, &(struct timeval){ 0 }, &result);
+		if (ret == 0) return;
+		if (ret < 0) {
+			ERROR("Failed reading search result: %s", fr_ldap_error_str(h->conn));
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		/*
+		 *	Search was cancelled, or timed out,
+		 *	discard the result.
+		 */
+		preq = rbtree_finddata(h->sent, &(ldap_trunk_request_t){ .msgid = ldap_msgid(result) });
+		if (!preq) {
+			ldap_msgfree(result);
+			continue;
+		}
+		ldap_trunk_request_unsend(preq, false);
+
+		treq = preq->treq;
+		r = treq->rctx;
+		request = treq->request;
+
+		r->status = ldap_trunk_result_check(request, h, preq, result);
+		if (r->status != LDAP_PROC_SUCCESS) {
+			ldap_msgfree(result);
+		} else {
+			r->result = result;
+			r->conn = h->conn;
+			r->unconsumed = &h->unconsumed;
+			fr_dlist_insert_tail(&h->unconsumed, r);
+		}
+
+		fr_trunk_request_signal_complete(treq);
+	}
+}
+
+/** Disassociate the request from the connection
+ *
+ * If the search has already been sent, tell the server we're no longer
+ * interested in the result.
+ */
+static void ldap_trunk_request_conn_release(UNUSED fr_connection_t *conn, void *preq_to_reset, UNUSED void *uctx)
+{
+	ldap_trunk_request_t	*preq = talloc_get_type_abort(preq_to_reset, ldap_trunk_request_t);
+
+	ldap_trunk_request_unsend(preq, true);
+}
+
+static void ldap_trunk_request_complete(request_t *request, UNUSED void *preq, void *rctx, UNUSED void *uctx)
+{
+	ldap_trunk_result_t	*r = rctx;
+
+	r->treq = NULL;
+
+	unlang_interpret_mark_resumable(request);
+}
+
+static void ldap_trunk_request_fail(request_t *request, UNUSED void *preq, void *rctx,
+				    UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	ldap_trunk_result_t	*r = rctx;
+
+	r->status = LDAP_PROC_ERROR;
+	r->treq = NULL;
+
+	unlang_interpret_mark_resumable(request);
+}
+
+static void ldap_trunk_request_free(UNUSED request_t *request, void *preq_to_free, UNUSED void *uctx)
+{
+	ldap_trunk_request_t	*preq = talloc_get_type_abort(preq_to_free, ldap_trunk_request_t);
+
+	fr_assert(!preq->h);	/* Dealt with by request_conn_release */
+
+	talloc_free(preq);
+}
+
+/** Allocate the trunk for a thread
+ *
+ * @param[in] t		Thread instance to allocate the trunk in.
+ *			t->inst must already be set.
+ * @param[in] el	Thread's event list.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int ldap_trunk_thread_instantiate(rlm_ldap_thread_t *t, fr_event_list_t *el)
+{
+	rlm_ldap_t const		*inst = t->inst;
+	static fr_trunk_io_funcs_t	io_funcs = {
+						.connection_alloc = ldap_trunk_conn_alloc,
+						.connection_notify = ldap_trunk_conn_notify,
+						.request_mux = ldap_trunk_request_mux,
+						.request_demux = ldap_trunk_request_demux,
+						.request_conn_release = ldap_trunk_request_conn_release,
+						.request_complete = ldap_trunk_request_complete,
+						.request_fail = ldap_trunk_request_fail,
+						.request_free = ldap_trunk_request_free
+					};
+
+	t->el = el;
+	t->trunk = fr_trunk_alloc(t, el, &io_funcs, &inst->trunk_conf, inst->name, t, false);
+	if (!t->trunk) return -1;
+
+	return 0;
+}
+
+/** Enqueue a search on the thread's trunk
+ *
+ * The caller should yield after this returns successfully, and will be
+ * resumed once the result has been written to r.
+ *
+ * @param[out] r		Where to write the result.  Must remain valid until
+ *				#ldap_trunk_result_free is called.
+ * @param[in] t			Thread instance.
+ * @param[in] request		The current request.
+ * @param[in] dn		to use as base for the search.
+ * @param[in] scope		to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter		to use, should be pre-escaped.  May be NULL.
+ * @param[in] attrs		to retrieve.  Must remain valid until the request is resumed.
+ * @param[in] serverctrls	Search controls to pass to the server.  May be NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int ldap_trunk_search(ldap_trunk_result_t *r, rlm_ldap_thread_t *t, request_t *request,
+		      char const *dn, int scope, char const *filter, char const * const *attrs,
+		      LDAPControl **serverctrls)
+{
+	fr_trunk_request_t	*treq;
+	ldap_trunk_request_t	*preq;
+	size_t			i;
+
+	*r = (ldap_trunk_result_t){ .status = LDAP_PROC_ERROR };
+
+	treq = fr_trunk_request_alloc(t->trunk, request);
+	if (!treq) return -1;
+
+	MEM(preq = talloc_zero(treq, ldap_trunk_request_t));
+	preq->treq = treq;
+	MEM(preq->dn = talloc_typed_strdup(preq, dn));
+	preq->scope = scope;
+	if (filter) MEM(preq->filter = talloc_typed_strdup(preq, filter));
+	preq->attrs = attrs;
+
+	if (serverctrls) for (i = 0; serverctrls[i] && (i < (NUM_ELEMENTS(preq->serverctrls) - 1)); i++) {
+		preq->serverctrls[i] = serverctrls[i];
+	}
+
+	if (fr_trunk_request_enqueue(&treq, t->trunk, request, preq, r) < 0) {
+		fr_trunk_request_free(&treq);	/* Return to the free list, and free preq */
+		return -1;
+	}
+	r->treq = treq;
+
+	return 0;
+}
+
+/** Release a search result, cancelling the search if it's still outstanding
+ *
+ * @param[in] r		to release.
+ */
+void ldap_trunk_result_free(ldap_trunk_result_t *r)
+{
+	if (r->treq) {
+		fr_trunk_request_signal_cancel(r->treq);
+		r->treq = NULL;
+	}
+
+	if (r->unconsumed) {
+		fr_dlist_remove(r->unconsumed, r);
+		r->unconsumed = NULL;
+	}
+	r->conn = NULL;
+
+	if (r->result) {
+		ldap_msgfree(r->result);
+		r->result = NULL;
+	}
+}
@@ -31,6 +31,7 @@ RCSID("$Id$")
 
 USES_APPLE_DEPRECATED_API
 
+#include <freeradius-devel/server/command.h>
 #include <freeradius-devel/util/debug.h>
 
 #include "rlm_ldap.h"
@@ -124,6 +125,17 @@ static CONF_PARSER group_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Cache of user DNs and group memberships
+ */
+static const CONF_PARSER lookup_cache_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_ldap_t, lookup_cache.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_TIME_DELTA, rlm_ldap_t, lookup_cache.lifetime), .dflt = "300" },
+	{ FR_CONF_OFFSET("negative_lifetime", FR_TYPE_TIME_DELTA, rlm_ldap_t, lookup_cache.negative_lifetime), .dflt = "30" },
+	{ FR_CONF_OFFSET("max_size", FR_TYPE_SIZE, rlm_ldap_t, lookup_cache.max_size), .dflt = "16777216" },
+	CONF_PARSER_TERMINATOR
+};
+
 /*
  *	Reference for accounting updates
  */
@@ -222,11 +234,16 @@ static const CONF_PARSER module_config[] = {
 
 	{ FR_CONF_POINTER("profile", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) profile_config },
 
+	{ FR_CONF_POINTER("lookup_cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) lookup_cache_config },
+
 	{ FR_CONF_POINTER("options", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) option_config },
 
 	{ FR_CONF_POINTER("global", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) global_config },
 
 	{ FR_CONF_OFFSET("tls", FR_TYPE_SUBSECTION, rlm_ldap_t, handle_config), .subcs = (void const *) tls_config },
+
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, rlm_ldap_t, async), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_ldap_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -286,6 +303,68 @@ static ssize_t ldap_unescape_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t out
 	return fr_ldap_unescape_func(request, *out, outlen, fmt, NULL);
 }
 
+/** Remove cached lookups affected by a change to an LDAP object
+ *
+ * Intended to be called with the DN of entries reported by the ldap_sync listener.
+ * Writes the number of cached entries removed.
+ *
+ * @ingroup xlat_functions
+ */
+static ssize_t ldap_invalidate_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+				    void const *mod_inst, UNUSED void const *xlat_inst,
+				    request_t *request, char const *fmt)
+{
+	rlm_ldap_t const	*inst = mod_inst;
+	int			removed;
+
+	if (!inst->cache) {
+		RDEBUG2("Lookup cache is disabled, nothing to invalidate");
+		return snprintf(*out, outlen, "0");
+	}
+
+	fr_skip_whitespace(fmt);
+	if (!fr_ldap_util_is_dn(fmt, strlen(fmt))) {
+		REDEBUG("\"%s\" is not a valid DN", fmt);
+		return -1;
+	}
+
+	removed = rlm_ldap_cache_invalidate(inst->cache, fmt);
+	if (removed < 0) {
+		REDEBUG("Failed invalidating cached lookups");
+		return -1;
+	}
+	RDEBUG2("Removed %i cached lookup(s) for \"%s\"", removed, fmt);
+
+	return snprintf(*out, outlen, "%i", removed);
+}
+
+/** Return one of the lookup cache's statistics
+ *
+ * Takes the name of a statistic, as shown by "show module <name> lookup_cache".
+ *
+ * @ingroup xlat_functions
+ */
+static ssize_t ldap_lookup_cache_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+				      void const *mod_inst, UNUSED void const *xlat_inst,
+				      request_t *request, char const *fmt)
+{
+	rlm_ldap_t const	*inst = mod_inst;
+	uint64_t		value;
+
+	if (!inst->cache) {
+		REDEBUG("Lookup cache is disabled");
+		return -1;
+	}
+
+	fr_skip_whitespace(fmt);
+	if (rlm_ldap_cache_stat(&value, inst->cache, fmt) < 0) {
+		REDEBUG("Unknown lookup cache statistic \"%s\"", fmt);
+		return -1;
+	}
+
+	return snprintf(*out, outlen, "%" PRIu64, value);
+}
+
 /** Expand an LDAP URL into a query, and return a string result from that query.
  *
  * @ingroup xlat_functions
@@ -657,19 +736,27 @@ static int rlm_ldap_groupcmp(void *instance, request_t *request, UNUSED fr_pair_
 		}
 	}
 
-	conn = mod_conn_get(inst, request);
-	if (!conn) return 1;
-
 	/*
 	 *	This is used in the default membership filter.
+	 *
+	 *	The DN may come from the request, or the lookup
+	 *	cache, in which case no connection is taken.
 	 */
 	user_dn = rlm_ldap_find_user(inst, request, &conn, NULL, false, NULL, &rcode);
 	if (!user_dn) {
-		ldap_mod_conn_release(inst, request, conn);
+		if (conn) ldap_mod_conn_release(inst, request, conn);
 		return 1;
 	}
 
-	fr_assert(conn);
+	if (inst->cache && rlm_ldap_cache_membership_find(&found, inst->cache, user_dn, check->vp_strvalue)) {
+		RDEBUG2("Using cached membership of \"%pV\"", &check->data);
+		goto finish;
+	}
+
+	if (!conn) {
+		conn = mod_conn_get(inst, request);
+		if (!conn) return 1;
+	}
 
 	/*
 	 *	Check groupobj user membership
@@ -684,7 +771,7 @@ static int rlm_ldap_groupcmp(void *instance, request_t *request, UNUSED fr_pair_
 
 		case RLM_MODULE_OK:
 			found = true;
-			FALL_THROUGH;
+			goto store;
 
 		default:
 			goto finish;
@@ -706,7 +793,7 @@ static int rlm_ldap_groupcmp(void *instance, request_t *request, UNUSED fr_pair_
 
 		case RLM_MODULE_OK:
 			found = true;
-			FALL_THROUGH;
+			goto store;
 
 		default:
 			goto finish;
@@ -715,6 +802,9 @@ static int rlm_ldap_groupcmp(void *instance, request_t *request, UNUSED fr_pair_
 
 	fr_assert(conn);
 
+store:
+	if (inst->cache) rlm_ldap_cache_membership_insert(inst->cache, user_dn, check->vp_strvalue, found);
+
 finish:
 	if (conn) ldap_mod_conn_release(inst, request, conn);
 
@@ -868,6 +958,65 @@ finish:
 	RETURN_MODULE_RCODE(rcode);
 }
 
+/** Expand the filter used to retrieve profile objects
+ *
+ * @param[out] filter		Where to write the expanded filter.
+ * @param[in] filter_buff	Buffer to expand the filter into, of LDAP_MAX_FILTER_STR_LEN bytes.
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rlm_ldap_profile_filter(char const **filter, char *filter_buff, rlm_ldap_t const *inst, request_t *request)
+{
+	fr_assert(inst->profile_filter); 	/* We always have a default filter set */
+
+	if (tmpl_expand(filter, filter_buff, LDAP_MAX_FILTER_STR_LEN, request,
+			inst->profile_filter, fr_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Failed creating profile filter");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Apply the result of a profile search
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @param[in] conn		the result was received on.
+ * @param[in] result		of the profile search.
+ * @param[in] expanded		Structure containing a list of xlat
+ *				expanded attribute names and mapping information.
+ * @return One of the RLM_MODULE_* values.
+ */
+static rlm_rcode_t rlm_ldap_map_profile_result(rlm_ldap_t const *inst, request_t *request,
+					       fr_ldap_connection_t *conn, LDAPMessage *result,
+					       fr_ldap_map_exp_t const *expanded)
+{
+	LDAPMessage	*entry;
+	int		ldap_errno;
+
+	entry = ldap_first_entry(conn->handle, result);
+	if (!entry) {
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
+
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	RDEBUG2("Processing profile attributes");
+	RINDENT();
+	if (fr_ldap_map_do(request, conn, inst->valuepair_attr, expanded, entry) > 0) {
+		REXDENT();
+		return RLM_MODULE_UPDATED;
+	}
+	REXDENT();
+
+	return RLM_MODULE_OK;
+}
+
 /** Search for and apply an LDAP profile
  *
  * LDAP profiles are mapped using the same attribute map as user objects, they're used to add common
@@ -886,24 +1035,15 @@ static unlang_action_t rlm_ldap_map_profile(rlm_rcode_t *p_result, rlm_ldap_t co
 					    request_t *request, fr_ldap_connection_t **pconn,
 					    char const *dn, fr_ldap_map_exp_t const *expanded)
 {
-	rlm_rcode_t	rcode = RLM_MODULE_OK;
+	rlm_rcode_t	rcode;
 	fr_ldap_rcode_t	status;
-	LDAPMessage	*result = NULL, *entry = NULL;
-	int		ldap_errno;
-	LDAP		*handle = (*pconn)->handle;
+	LDAPMessage	*result = NULL;
 	char const	*filter;
 	char		filter_buff[LDAP_MAX_FILTER_STR_LEN];
 
-	fr_assert(inst->profile_filter); 	/* We always have a default filter set */
-
 	if (!dn || !*dn) RETURN_MODULE_OK;
 
-	if (tmpl_expand(&filter, filter_buff, sizeof(filter_buff), request,
-			inst->profile_filter, fr_ldap_escape_func, NULL) < 0) {
-		REDEBUG("Failed creating profile filter");
-
-		RETURN_MODULE_INVALID;
-	}
+	if (rlm_ldap_profile_filter(&filter, filter_buff, inst, request) < 0) RETURN_MODULE_INVALID;
 
 	status = fr_ldap_search(&result, request, pconn, dn,
 				LDAP_SCOPE_BASE, filter, expanded->attrs, NULL, NULL);
@@ -923,30 +1063,338 @@ static unlang_action_t rlm_ldap_map_profile(rlm_rcode_t *p_result, rlm_ldap_t co
 	fr_assert(*pconn);
 	fr_assert(result);
 
-	entry = ldap_first_entry(handle, result);
-	if (!entry) {
-		ldap_get_option(handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+	rcode = rlm_ldap_map_profile_result(inst, request, *pconn, result, expanded);
+	ldap_msgfree(result);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Add the attributes we need for checking access, memberships, and profiles
+ *
+ */
+static void rlm_ldap_autz_attrs_add(rlm_ldap_t const *inst, fr_ldap_map_exp_t *expanded)
+{
+	if (inst->userobj_access_attr) {
+		expanded->attrs[expanded->count++] = inst->userobj_access_attr;
+	}
+
+	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
+		expanded->attrs[expanded->count++] = inst->userobj_membership_attr;
+	}
+
+	if (inst->profile_attr) {
+		expanded->attrs[expanded->count++] = inst->profile_attr;
+	}
+
+	if (inst->valuepair_attr) {
+		expanded->attrs[expanded->count++] = inst->valuepair_attr;
+	}
+
+	expanded->attrs[expanded->count] = NULL;
+}
+
+/** Cache the group memberships of the user, using a connection from the pool
+ *
+ */
+static rlm_rcode_t rlm_ldap_autz_groups(rlm_ldap_t const *inst, request_t *request,
+					fr_ldap_connection_t **pconn, LDAPMessage *entry)
+{
+	rlm_rcode_t	rcode = RLM_MODULE_OK;
+
+	if (inst->userobj_membership_attr) {
+		rlm_ldap_cacheable_userobj(&rcode, inst, request, pconn, entry, inst->userobj_membership_attr);
+		if (rcode != RLM_MODULE_OK) return rcode;
+	}
+
+	rlm_ldap_cacheable_groupobj(&rcode, inst, request, pconn);
+
+	return rcode;
+}
+
+/** State for an authorize call run over the thread's trunk
+ *
+ */
+typedef struct {
+	fr_ldap_map_exp_t	expanded;		//!< Attributes to retrieve, and maps to apply.
+	ldap_trunk_result_t	user;			//!< Result of the user search.
+	ldap_trunk_result_t	profile;		//!< Result of the profile search in progress.
+	LDAPMessage		*entry;			//!< The user object.
+	bool			default_profile;	//!< Whether the default profile has been searched for.
+	bool			applying_default;	//!< Whether the profile search in progress is for
+							///< the default profile.
+	rlm_ldap_groups_ctx_t	*groups;		//!< State for caching group memberships.
+	struct berval		**profiles;		//!< Values of the profile attribute in the user object.
+	int			profile_idx;		//!< Next profile to apply.
+	rlm_rcode_t		rcode;			//!< Result of the authorize call so far.
+} ldap_autz_ctx_t;
+
+static int _autz_ctx_free(ldap_autz_ctx_t *autz)
+{
+	ldap_trunk_result_free(&autz->profile);
+	ldap_trunk_result_free(&autz->user);
+	if (autz->profiles) ldap_value_free_len(autz->profiles);
+	talloc_free(autz->expanded.ctx);
+
+	return 0;
+}
+
+static void mod_authorize_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+				 void *rctx, fr_state_signal_t action)
+{
+	ldap_autz_ctx_t *autz = talloc_get_type_abort(rctx, ldap_autz_ctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(autz);
+}
+
+static unlang_action_t mod_authorize_profile_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+						    request_t *request, void *rctx);
+
+/** Search for the next profile to apply, or apply the user object if there are none left
+ *
+ */
+static unlang_action_t rlm_ldap_autz_next(rlm_rcode_t *p_result, rlm_ldap_t const *inst, rlm_ldap_thread_t *t,
+					  request_t *request, ldap_autz_ctx_t *autz)
+{
+	char const	*profile = NULL;
+	char		profile_buff[1024];
+	char		*value = NULL;
+	char const	*filter;
+	char		filter_buff[LDAP_MAX_FILTER_STR_LEN];
+
+	/*
+	 *	Apply ONE user profile, or a default user profile.
+	 */
+	if (!autz->default_profile) {
+		autz->default_profile = true;
+
+		if (inst->default_profile) {
+			if (tmpl_expand(&profile, profile_buff, sizeof(profile_buff),
+					request, inst->default_profile, NULL, NULL) < 0) {
+				REDEBUG("Failed creating default profile string");
+
+				autz->rcode = RLM_MODULE_INVALID;
+				goto finish;
+			}
+			autz->applying_default = true;
+		}
+	}
+
+	/*
+	 *	Apply a SET of user profiles.
+	 */
+	while ((!profile || !*profile) && autz->profiles && autz->profiles[autz->profile_idx]) {
+		talloc_free(value);
+		value = fr_ldap_berval_to_string(autz, autz->profiles[autz->profile_idx++]);
+		profile = value;
+		autz->applying_default = false;
+	}
+
+	if (profile && *profile) {
+		if (rlm_ldap_profile_filter(&filter, filter_buff, inst, request) < 0) {
+			talloc_free(value);
+			if (autz->applying_default) {
+				autz->rcode = RLM_MODULE_INVALID;
+				goto finish;
+			}
+			return rlm_ldap_autz_next(p_result, inst, t, request, autz);
+		}
+
+		if (ldap_trunk_search(&autz->profile, t, request, profile, LDAP_SCOPE_BASE, filter,
+				      autz->expanded.attrs, NULL) < 0) {
+			REDEBUG("Failed enqueueing profile search");
+			talloc_free(value);
+			autz->rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+		talloc_free(value);
+
+		return unlang_module_yield(request, mod_authorize_profile_resume, mod_authorize_signal, autz);
+	}
+	talloc_free(value);
+
+	if (inst->user_map || inst->valuepair_attr) {
+		if (!autz->user.conn) {
+			REDEBUG("Connection closed before the user object could be processed");
+			autz->rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+
+		RDEBUG2("Processing user attributes");
+		RINDENT();
+		if (fr_ldap_map_do(request, autz->user.conn, inst->valuepair_attr,
+				   &autz->expanded, autz->entry) > 0) autz->rcode = RLM_MODULE_UPDATED;
+		REXDENT();
+		rlm_ldap_check_reply(inst, request, autz->user.conn);
+	}
+
+finish:
+	{
+		rlm_rcode_t rcode = autz->rcode;
+
+		talloc_free(autz);
+
+		RETURN_MODULE_RCODE(rcode);
+	}
+}
+
+/** Apply the result of a profile search
+ *
+ */
+static unlang_action_t mod_authorize_profile_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+						    request_t *request, void *rctx)
+{
+	rlm_ldap_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_ldap_t);
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ldap_thread_t);
+	ldap_autz_ctx_t		*autz = talloc_get_type_abort(rctx, ldap_autz_ctx_t);
+	rlm_rcode_t		ret;
+
+	switch (autz->profile.status) {
+	case LDAP_PROC_SUCCESS:
+		if (!autz->profile.conn) {
+			REDEBUG("Connection closed before the profile could be processed");
+			ret = RLM_MODULE_FAIL;
+			break;
+		}
+		ret = rlm_ldap_map_profile_result(inst, request, autz->profile.conn, autz->profile.result,
+						  &autz->expanded);
+		break;
+
+	case LDAP_PROC_BAD_DN:
+	case LDAP_PROC_NO_RESULT:
+		RDEBUG2("Profile object not found");
+		ret = RLM_MODULE_NOTFOUND;
+		break;
+
+	default:
+		ret = RLM_MODULE_FAIL;
+		break;
+	}
+	ldap_trunk_result_free(&autz->profile);
+
+	if (ret == RLM_MODULE_FAIL) {
+		autz->rcode = ret;
+		talloc_free(autz);
+		RETURN_MODULE_RCODE(ret);
+	}
+
+	if (autz->applying_default && (ret == RLM_MODULE_UPDATED)) autz->rcode = RLM_MODULE_UPDATED;
+
+	return rlm_ldap_autz_next(p_result, inst, t, request, autz);
+}
+
+/** Continue caching group memberships, and start applying profiles once that's done
+ *
+ */
+static unlang_action_t mod_authorize_groups_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+						   request_t *request, void *rctx)
+{
+	rlm_ldap_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_ldap_t);
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ldap_thread_t);
+	ldap_autz_ctx_t		*autz = talloc_get_type_abort(rctx, ldap_autz_ctx_t);
+	rlm_rcode_t		rcode;
+
+	if (rlm_ldap_cacheable_async(&autz->rcode, autz->groups, t, request) > 0) {
+		return unlang_module_yield(request, mod_authorize_groups_resume, mod_authorize_signal, autz);
+	}
+	TALLOC_FREE(autz->groups);
+
+	if (autz->rcode != RLM_MODULE_OK) {
+		rcode = autz->rcode;
+		talloc_free(autz);
+
+		RETURN_MODULE_RCODE(rcode);
+	}
+
+	return rlm_ldap_autz_next(p_result, inst, t, request, autz);
+}
+
+/** Process the user object, and start applying profiles
+ *
+ * Mirrors the checks in mod_authorize().
+ */
+static unlang_action_t mod_authorize_user_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+						 request_t *request, void *rctx)
+{
+	rlm_ldap_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_ldap_t);
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ldap_thread_t);
+	ldap_autz_ctx_t		*autz = talloc_get_type_abort(rctx, ldap_autz_ctx_t);
+	fr_ldap_connection_t	*conn;
+	int			ldap_errno;
+	rlm_rcode_t		rcode;
+
+	if (!rlm_ldap_find_user_resume(inst, request, &autz->user, &autz->rcode)) goto finish;
+
+	conn = autz->user.conn;
+	autz->entry = ldap_first_entry(conn->handle, autz->user.result);
+	if (!autz->entry) {
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
 
-		rcode = RLM_MODULE_NOTFOUND;
+		goto finish;
+	}
 
-		goto free_result;
+	/*
+	 *	Check for access.
+	 */
+	if (inst->userobj_access_attr) {
+		autz->rcode = rlm_ldap_check_access(inst, request, conn, autz->entry);
+		if (autz->rcode != RLM_MODULE_OK) goto finish;
 	}
 
-	RDEBUG2("Processing profile attributes");
-	RINDENT();
-	if (fr_ldap_map_do(request, *pconn, inst->valuepair_attr, expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
-	REXDENT();
+	if (inst->profile_attr) autz->profiles = ldap_get_values_len(conn->handle, autz->entry, inst->profile_attr);
 
-free_result:
-	ldap_msgfree(result);
+	/*
+	 *	Check if we need to cache group memberships
+	 */
+	if (inst->cacheable_group_dn || inst->cacheable_group_name) {
+		autz->groups = rlm_ldap_cacheable_async_alloc(autz, inst, request, conn, autz->entry);
+
+		return mod_authorize_groups_resume(p_result, mctx, request, autz);
+	}
+
+	return rlm_ldap_autz_next(p_result, inst, t, request, autz);
+
+finish:
+	rcode = autz->rcode;
+	talloc_free(autz);
 
 	RETURN_MODULE_RCODE(rcode);
 }
 
+/** Search for the user object over the thread's trunk
+ *
+ */
+static unlang_action_t mod_authorize_async(rlm_rcode_t *p_result, rlm_ldap_t const *inst, rlm_ldap_thread_t *t,
+					   request_t *request)
+{
+	ldap_autz_ctx_t		*autz;
+	rlm_rcode_t		rcode;
+
+	MEM(autz = talloc_zero(request, ldap_autz_ctx_t));
+	autz->rcode = RLM_MODULE_OK;
+
+	if (fr_ldap_map_expand(&autz->expanded, request, inst->user_map) < 0) {
+		talloc_free(autz);
+		RETURN_MODULE_FAIL;
+	}
+	talloc_set_destructor(autz, _autz_ctx_free);
+
+	rlm_ldap_autz_attrs_add(inst, &autz->expanded);
+
+	if (rlm_ldap_find_user_async(&autz->user, inst, t, request, autz->expanded.attrs, &rcode) < 0) {
+		talloc_free(autz);
+		RETURN_MODULE_RCODE(rcode);
+	}
+
+	return unlang_module_yield(request, mod_authorize_user_resume, mod_authorize_signal, autz);
+}
+
 static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_ldap_t const 	*inst = talloc_get_type_abort_const(mctx->instance, rlm_ldap_t);
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ldap_thread_t);
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
 	int			ldap_errno;
 	int			i;
@@ -965,31 +1413,14 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	 *	for many things besides searching for users.
 	 */
 
+	if (t->trunk) return mod_authorize_async(p_result, inst, t, request);
+
 	if (fr_ldap_map_expand(&expanded, request, inst->user_map) < 0) RETURN_MODULE_FAIL;
 
 	conn = mod_conn_get(inst, request);
 	if (!conn) RETURN_MODULE_FAIL;
 
-	/*
-	 *	Add any additional attributes we need for checking access, memberships, and profiles
-	 */
-	if (inst->userobj_access_attr) {
-		expanded.attrs[expanded.count++] = inst->userobj_access_attr;
-	}
-
-	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
-		expanded.attrs[expanded.count++] = inst->userobj_membership_attr;
-	}
-
-	if (inst->profile_attr) {
-		expanded.attrs[expanded.count++] = inst->profile_attr;
-	}
-
-	if (inst->valuepair_attr) {
-		expanded.attrs[expanded.count++] = inst->valuepair_attr;
-	}
-
-	expanded.attrs[expanded.count] = NULL;
+	rlm_ldap_autz_attrs_add(inst, &expanded);
 
 	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
 	if (!dn) {
@@ -1018,14 +1449,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	 *	Check if we need to cache group memberships
 	 */
 	if (inst->cacheable_group_dn || inst->cacheable_group_name) {
-		if (inst->userobj_membership_attr) {
-			rlm_ldap_cacheable_userobj(&rcode, inst, request, &conn, entry, inst->userobj_membership_attr);
-			if (rcode != RLM_MODULE_OK) {
-				goto finish;
-			}
-		}
-
-		rlm_ldap_cacheable_groupobj(&rcode, inst, request, &conn);
+		rcode = rlm_ldap_autz_groups(inst, request, &conn, entry);
 		if (rcode != RLM_MODULE_OK) {
 			goto finish;
 		}
@@ -1434,6 +1858,28 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 }
 
 
+static int cmd_show_lookup_cache(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	rlm_ldap_cache_t	*cache = talloc_get_type_abort(ctx, rlm_ldap_cache_t);
+
+	rlm_ldap_cache_stats(fp, cache);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "lookup_cache",
+		.func = cmd_show_lookup_cache,
+		.help = "Show the size of the lookup cache, and how many lookups it has answered.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+
 /** Detach from the LDAP server and cleanup internal state.
  *
  */
@@ -1550,6 +1996,12 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	xlat_register_legacy(inst, inst->name, ldap_xlat, fr_ldap_escape_func, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register_legacy(inst, "ldap_escape", ldap_escape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register_legacy(inst, "ldap_unescape", ldap_unescape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+
+	snprintf(buffer, sizeof(buffer), "%s_invalidate", inst->name);
+	xlat_register_legacy(inst, buffer, ldap_invalidate_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+
+	snprintf(buffer, sizeof(buffer), "%s_lookup_cache", inst->name);
+	xlat_register_legacy(inst, buffer, ldap_lookup_cache_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	map_proc_register(inst, inst->name, mod_map_proc, ldap_map_verify, 0);
 
 	return 0;
@@ -2037,6 +2489,27 @@ if (inst->handle_config.tls_min_version_str) {
 						 ldap_mod_conn_create, NULL, NULL, NULL, NULL);
 	if (!inst->pool) goto error;
 
+	if (inst->lookup_cache.enable) {
+		inst->cache = rlm_ldap_cache_alloc(inst, inst);
+		if (!inst->cache) {
+			ERROR("rlm_ldap (%s) - Failed allocating lookup cache", inst->name);
+			goto error;
+		}
+
+		if (fr_command_register_hook(NULL, inst->name, inst->cache, cmd_table) < 0) {
+			PERROR("Failed registering radmin commands for %s", inst->name);
+			goto error;
+		}
+	}
+
+#ifdef WITH_EDIR
+	if (inst->async && inst->edir) {
+		WARN("eDirectory password retrieval requires blocking operations, ignoring 'async = yes'");
+		inst->async = false;
+	}
+#endif
+	inst->trunk_conf.always_writable = true;
+
 	fr_ldap_global_config(inst->ldap_debug, inst->tls_random_file);
 
 	return 0;
@@ -2045,6 +2518,19 @@ error:
 	return -1;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_ldap_t		*inst = talloc_get_type_abort(instance, rlm_ldap_t);
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(thread, rlm_ldap_thread_t);
+
+	t->inst = inst;
+	t->el = el;
+
+	if (!inst->async) return 0;
+
+	return ldap_trunk_thread_instantiate(t, el);
+}
+
 static int mod_load(void)
 {
 	fr_ldap_init();
@@ -2064,11 +2550,13 @@ module_t rlm_ldap = {
 	.name		= "ldap",
 	.type		= 0,
 	.inst_size	= sizeof(rlm_ldap_t),
+	.thread_inst_size	= sizeof(rlm_ldap_thread_t),
 	.config		= module_config,
 	.onload		= mod_load,
 	.unload		= mod_unload,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
@@ -15,9 +15,11 @@
  */
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/trunk.h>
 #include <freeradius-devel/ldap/base.h>
 
 typedef struct ldap_inst_s rlm_ldap_t;
+typedef struct rlm_ldap_cache_s rlm_ldap_cache_t;
 
 typedef struct {
 	tmpl_t	*mech;				//!< SASL mech(s) to try.
@@ -142,6 +144,22 @@ struct ldap_inst_s {
 	fr_pool_t	*pool;				//!< Connection pool instance.
 	fr_ldap_config_t handle_config;			//!< Connection configuration instance.
 
+	bool		async;				//!< Run user and profile searches over per-thread
+							///< trunks of connections, instead of the pool.
+	fr_trunk_conf_t	trunk_conf;			//!< Configuration for the per-thread trunk.
+
+	/*
+	 *	Lookup cache
+	 */
+	struct {
+		bool		enable;			//!< Cache user DNs and group memberships.
+		fr_time_delta_t	lifetime;		//!< How long users found, and memberships, are cached.
+		fr_time_delta_t	negative_lifetime;	//!< How long users not found, and non-memberships,
+							///< are cached.
+		size_t		max_size;		//!< Approximate memory limit, in bytes.
+	} lookup_cache;
+	rlm_ldap_cache_t *cache;			//!< Cached lookups.  NULL if disabled.
+
 	/*
 	 *	Global config
 	 */
@@ -151,6 +169,32 @@ struct ldap_inst_s {
 	uint32_t	ldap_debug;			//!< Debug flag for the SDK.
 };
 
+/** Per-thread instance data
+ *
+ */
+typedef struct {
+	rlm_ldap_t const	*inst;				//!< Instance we belong to.
+	fr_event_list_t		*el;				//!< Event list for this thread.
+	fr_trunk_t		*trunk;				//!< Connections searches are multiplexed over.
+								///< NULL if searches use the blocking pool.
+} rlm_ldap_thread_t;
+
+/** The result of a search run over the trunk
+ *
+ * Must be released with #ldap_trunk_result_free once the caller is done with it.
+ */
+typedef struct {
+	fr_trunk_request_t	*treq;				//!< Outstanding trunk request.  NULL once the
+								///< result is available.
+	fr_ldap_rcode_t		status;				//!< Result of the search.
+	LDAPMessage		*result;			//!< Entries returned by the search.
+	fr_ldap_connection_t	*conn;				//!< Connection the result was received on.
+								///< Set to NULL if the connection is closed
+								///< before the result is freed.
+	fr_dlist_head_t		*unconsumed;			//!< List in the connection we're in.
+	fr_dlist_t		entry;				//!< Entry in the connection's list of results.
+} ldap_trunk_result_t;
+
 extern fr_dict_attr_t const *attr_cleartext_password;
 extern fr_dict_attr_t const *attr_crypt_password;
 extern fr_dict_attr_t const *attr_ldap_userdn;
@@ -166,14 +210,43 @@ extern fr_dict_attr_t const *attr_user_name;
 char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ldap_connection_t **pconn,
 			       char const *attrs[], bool force, LDAPMessage **result, rlm_rcode_t *rcode);
 
+int rlm_ldap_find_user_async(ldap_trunk_result_t *r, rlm_ldap_t const *inst, rlm_ldap_thread_t *t,
+			     request_t *request, char const * const *attrs, rlm_rcode_t *rcode);
+
+char const *rlm_ldap_find_user_resume(rlm_ldap_t const *inst, request_t *request,
+				      ldap_trunk_result_t *r, rlm_rcode_t *rcode);
+
 rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, request_t *request,
 				  fr_ldap_connection_t const *conn, LDAPMessage *entry);
 
 void rlm_ldap_check_reply(rlm_ldap_t const *inst, request_t *request, fr_ldap_connection_t const *conn);
 
+/*
+ *	cache.c - Lookup cache functions.
+ */
+rlm_ldap_cache_t *rlm_ldap_cache_alloc(TALLOC_CTX *ctx, rlm_ldap_t const *inst);
+
+int rlm_ldap_cache_user_dn_find(bool *found, char **dn, TALLOC_CTX *ctx, rlm_ldap_cache_t *cache,
+				char const *base_dn, int scope, char const *filter);
+
+void rlm_ldap_cache_user_dn_insert(rlm_ldap_cache_t *cache, char const *base_dn, int scope, char const *filter,
+				   char const *dn);
+
+int rlm_ldap_cache_membership_find(bool *member, rlm_ldap_cache_t *cache, char const *user_dn, char const *group);
+
+void rlm_ldap_cache_membership_insert(rlm_ldap_cache_t *cache, char const *user_dn, char const *group, bool member);
+
+int rlm_ldap_cache_invalidate(rlm_ldap_cache_t *cache, char const *dn);
+
+int rlm_ldap_cache_stat(uint64_t *out, rlm_ldap_cache_t *cache, char const *name);
+
+void rlm_ldap_cache_stats(FILE *fp, rlm_ldap_cache_t *cache);
+
 /*
  *	groups.c - Group membership functions.
  */
+typedef struct rlm_ldap_groups_ctx_s rlm_ldap_groups_ctx_t;
+
 unlang_action_t rlm_ldap_cacheable_userobj(rlm_rcode_t *p_result, rlm_ldap_t const *inst,
 					   request_t *request, fr_ldap_connection_t **pconn,
 					   LDAPMessage *entry, char const *attr);
@@ -181,6 +254,12 @@ unlang_action_t rlm_ldap_cacheable_userobj(rlm_rcode_t *p_result, rlm_ldap_t con
 unlang_action_t rlm_ldap_cacheable_groupobj(rlm_rcode_t *p_result,
 					    rlm_ldap_t const *inst, request_t *request, fr_ldap_connection_t **pconn);
 
+rlm_ldap_groups_ctx_t *rlm_ldap_cacheable_async_alloc(TALLOC_CTX *ctx, rlm_ldap_t const *inst, request_t *request,
+						      fr_ldap_connection_t const *conn, LDAPMessage *entry);
+
+int rlm_ldap_cacheable_async(rlm_rcode_t *p_result, rlm_ldap_groups_ctx_t *g, rlm_ldap_thread_t *t,
+			     request_t *request);
+
 unlang_action_t rlm_ldap_check_groupobj_dynamic(rlm_rcode_t *p_result,
 						rlm_ldap_t const *inst, request_t *request, fr_ldap_connection_t **pconn,
 						fr_pair_t *check);
@@ -200,3 +279,14 @@ fr_ldap_connection_t	*mod_conn_get(rlm_ldap_t const *inst, request_t *request);
 void		ldap_mod_conn_release(rlm_ldap_t const *inst, request_t *request, fr_ldap_connection_t *conn);
 
 void		*ldap_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
+
+/*
+ *	ldap_trunk.c - Searches multiplexed over per-thread connections.
+ */
+int		ldap_trunk_thread_instantiate(rlm_ldap_thread_t *t, fr_event_list_t *el);
+
+int		ldap_trunk_search(ldap_trunk_result_t *r, rlm_ldap_thread_t *t, request_t *request,
+				  char const *dn, int scope, char const *filter, char const * const *attrs,
+				  LDAPControl **serverctrls);
+
+void		ldap_trunk_result_free(ldap_trunk_result_t *r);
@@ -36,6 +36,116 @@ USES_APPLE_DEPRECATED_API
 
 #include "rlm_ldap.h"
 
+/** Expand the base DN and filter used to search for user objects
+ *
+ * @param[out] base_dn		Where to write the expanded base DN.
+ * @param[in] base_dn_buff	Buffer to expand the base DN into, of LDAP_MAX_DN_STR_LEN bytes.
+ * @param[out] filter		Where to write the expanded filter.  NULL if there's no filter.
+ * @param[in] filter_buff	Buffer to expand the filter into, of LDAP_MAX_FILTER_STR_LEN bytes.
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int user_search_expand(char const **base_dn, char *base_dn_buff, char const **filter, char *filter_buff,
+			      rlm_ldap_t const *inst, request_t *request)
+{
+	*filter = NULL;
+
+	if (inst->userobj_filter) {
+		if (tmpl_expand(filter, filter_buff, LDAP_MAX_FILTER_STR_LEN, request, inst->userobj_filter,
+				fr_ldap_escape_func, NULL) < 0) {
+			REDEBUG("Unable to create filter");
+			return -1;
+		}
+	}
+
+	if (tmpl_expand(base_dn, base_dn_buff, LDAP_MAX_DN_STR_LEN, request,
+			inst->userobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Unable to create base_dn");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Retrieve the DN of the user object from a search result
+ *
+ * Adds the DN to the control list as LDAP-UserDN.
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @param[in] conn	the result was received on.
+ * @param[in] result	of the user search.
+ * @param[out] rcode	The status of the operation, one of the RLM_MODULE_* codes.
+ * @return The user's DN or NULL on error.
+ */
+static char const *user_search_result(rlm_ldap_t const *inst, request_t *request, fr_ldap_connection_t const *conn,
+				      LDAPMessage *result, rlm_rcode_t *rcode)
+{
+	fr_pair_t	*vp;
+	LDAPMessage	*entry;
+	int		ldap_errno;
+	int		cnt;
+	char		*dn;
+
+	*rcode = RLM_MODULE_FAIL;
+
+	/*
+	 *	Forbid the use of unsorted search results that
+	 *	contain multiple entries, as it's a potential
+	 *	security issue, and likely non deterministic.
+	 */
+	if (!inst->userobj_sort_ctrl) {
+		cnt = ldap_count_entries(conn->handle, result);
+		if (cnt > 1) {
+			REDEBUG("Ambiguous search result, returned %i unsorted entries (should return 1 or 0).  "
+				"Enable sorting, or specify a more restrictive base_dn, filter or scope", cnt);
+			REDEBUG("The following entries were returned:");
+			RINDENT();
+			for (entry = ldap_first_entry(conn->handle, result);
+			     entry;
+			     entry = ldap_next_entry(conn->handle, entry)) {
+				dn = ldap_get_dn(conn->handle, entry);
+				REDEBUG("%s", dn);
+				ldap_memfree(dn);
+			}
+			REXDENT();
+			*rcode = RLM_MODULE_INVALID;
+			return NULL;
+		}
+	}
+
+	entry = ldap_first_entry(conn->handle, result);
+	if (!entry) {
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		REDEBUG("Failed retrieving entry: %s",
+			ldap_err2string(ldap_errno));
+
+		return NULL;
+	}
+
+	dn = ldap_get_dn(conn->handle, entry);
+	if (!dn) {
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
+
+		return NULL;
+	}
+	fr_ldap_util_normalise_dn(dn, dn);
+
+	RDEBUG2("User object found at DN \"%s\"", dn);
+
+	MEM(pair_update_control(&vp, attr_ldap_userdn) >= 0);
+	fr_pair_value_strdup(vp, dn);
+	*rcode = RLM_MODULE_OK;
+
+	ldap_memfree(dn);
+
+	return vp->vp_strvalue;
+}
+
 /** Retrieve the DN of a user object
  *
  * Retrieves the DN of a user and adds it to the control list as LDAP-UserDN. Will also retrieve any
@@ -45,9 +155,14 @@ USES_APPLE_DEPRECATED_API
  * ldap search operation, which is a big bonus given the number of crappy, slow *cough*AD*cough*
  * LDAP directory servers out there.
  *
+ * If the lookup cache is enabled, and the caller only wants the DN, the result of a previous
+ * search may be used instead.
+ *
  * @param[in] inst rlm_ldap configuration.
  * @param[in] request Current request.
  * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ *	If *pconn is NULL, a connection is only taken if the DN has to be searched for,
+ *	and the caller must release it if *pconn is no longer NULL.
  * @param[in] attrs Additional attributes to retrieve, may be NULL.
  * @param[in] force Query even if the User-DN already exists.
  * @param[out] result Where to write the result, may be NULL in which case result is discarded.
@@ -61,10 +176,8 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ld
 
 	fr_ldap_rcode_t	status;
 	fr_pair_t	*vp = NULL;
-	LDAPMessage	*tmp_msg = NULL, *entry = NULL;
-	int		ldap_errno;
-	int		cnt;
-	char		*dn = NULL;
+	LDAPMessage	*tmp_msg = NULL;
+	char const	*dn = NULL;
 	char const	*filter = NULL;
 	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
 	char const	*base_dn;
@@ -73,6 +186,8 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ld
 
 	bool freeit = false;					//!< Whether the message should
 								//!< be freed after being processed.
+	bool use_cache;						//!< Whether the lookup cache may
+								//!< answer the search.
 
 	*rcode = RLM_MODULE_FAIL;
 
@@ -98,6 +213,47 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ld
 		}
 	}
 
+	if (user_search_expand(&base_dn, base_dn_buff, &filter, filter_buff, inst, request) < 0) {
+		*rcode = RLM_MODULE_INVALID;
+		return NULL;
+	}
+
+	/*
+	 *	If the caller only wants the DN, a previous
+	 *	search for the same user may have found it.
+	 */
+	use_cache = inst->cache && !force && freeit;
+	if (use_cache) {
+		bool	found;
+		char	*cached;
+
+		if (rlm_ldap_cache_user_dn_find(&found, &cached, request, inst->cache,
+						base_dn, inst->userobj_scope, filter)) {
+			if (!found) {
+				RDEBUG2("User object not found (cached)");
+				*rcode = RLM_MODULE_NOTFOUND;
+				return NULL;
+			}
+
+			RDEBUG2("User object found at DN \"%s\" (cached)", cached);
+
+			MEM(pair_update_control(&vp, attr_ldap_userdn) >= 0);
+			fr_pair_value_strdup(vp, cached);
+			talloc_free(cached);
+			*rcode = RLM_MODULE_OK;
+
+			return vp->vp_strvalue;
+		}
+	}
+
+	if (!*pconn) {
+		*pconn = mod_conn_get(inst, request);
+		if (!*pconn) {
+			*rcode = RLM_MODULE_FAIL;
+			return NULL;
+		}
+	}
+
 	/*
 	 *	Perform all searches as the admin user.
 	 */
@@ -115,24 +271,6 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ld
 		(*pconn)->rebound = false;
 	}
 
-	if (inst->userobj_filter) {
-		if (tmpl_expand(&filter, filter_buff, sizeof(filter_buff), request, inst->userobj_filter,
-				fr_ldap_escape_func, NULL) < 0) {
-			REDEBUG("Unable to create filter");
-			*rcode = RLM_MODULE_INVALID;
-
-			return NULL;
-		}
-	}
-
-	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
-			inst->userobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
-		REDEBUG("Unable to create base_dn");
-		*rcode = RLM_MODULE_INVALID;
-
-		return NULL;
-	}
-
 	status = fr_ldap_search(result, request, pconn, base_dn,
 				inst->userobj_scope, filter, attrs, serverctrls, NULL);
 	switch (status) {
@@ -141,6 +279,7 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ld
 
 	case LDAP_PROC_BAD_DN:
 	case LDAP_PROC_NO_RESULT:
+		if (use_cache) rlm_ldap_cache_user_dn_insert(inst->cache, base_dn, inst->userobj_scope, filter, NULL);
 		*rcode = RLM_MODULE_NOTFOUND;
 		return NULL;
 
@@ -151,64 +290,88 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ld
 
 	fr_assert(*pconn);
 
-	/*
-	 *	Forbid the use of unsorted search results that
-	 *	contain multiple entries, as it's a potential
-	 *	security issue, and likely non deterministic.
-	 */
-	if (!inst->userobj_sort_ctrl) {
-		cnt = ldap_count_entries((*pconn)->handle, *result);
-		if (cnt > 1) {
-			REDEBUG("Ambiguous search result, returned %i unsorted entries (should return 1 or 0).  "
-				"Enable sorting, or specify a more restrictive base_dn, filter or scope", cnt);
-			REDEBUG("The following entries were returned:");
-			RINDENT();
-			for (entry = ldap_first_entry((*pconn)->handle, *result);
-			     entry;
-			     entry = ldap_next_entry((*pconn)->handle, entry)) {
-				dn = ldap_get_dn((*pconn)->handle, entry);
-				REDEBUG("%s", dn);
-				ldap_memfree(dn);
-			}
-			REXDENT();
-			*rcode = RLM_MODULE_INVALID;
-			goto finish;
-		}
+	dn = user_search_result(inst, request, *pconn, *result, rcode);
+	if (use_cache && dn) rlm_ldap_cache_user_dn_insert(inst->cache, base_dn, inst->userobj_scope, filter, dn);
+
+	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
+		ldap_msgfree(*result);
+		*result = NULL;
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, *result);
-	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		REDEBUG("Failed retrieving entry: %s",
-			ldap_err2string(ldap_errno));
+	return dn;
+}
 
-		goto finish;
-	}
+/** Start searching for a user object over the thread's trunk
+ *
+ * The caller should yield if this returns 0, then call #rlm_ldap_find_user_resume
+ * to retrieve the user's DN.
+ *
+ * @param[out] r	Where to write the search result.
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] t		Thread instance.
+ * @param[in] request	Current request.
+ * @param[in] attrs	Additional attributes to retrieve.  Must remain valid until the
+ *			request is resumed.
+ * @param[out] rcode	The status of the operation if the search couldn't be started.
+ * @return
+ *	- 0 if the search was enqueued.
+ *	- -1 on failure.
+ */
+int rlm_ldap_find_user_async(ldap_trunk_result_t *r, rlm_ldap_t const *inst, rlm_ldap_thread_t *t,
+			     request_t *request, char const * const *attrs, rlm_rcode_t *rcode)
+{
+	char const	*filter = NULL;
+	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
+	char const	*base_dn;
+	char	    	base_dn_buff[LDAP_MAX_DN_STR_LEN];
+	LDAPControl	*serverctrls[] = { inst->userobj_sort_ctrl, NULL };
 
-	dn = ldap_get_dn((*pconn)->handle, entry);
-	if (!dn) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
+	if (user_search_expand(&base_dn, base_dn_buff, &filter, filter_buff, inst, request) < 0) {
+		*rcode = RLM_MODULE_INVALID;
+		return -1;
+	}
 
-		goto finish;
+	if (ldap_trunk_search(r, t, request, base_dn, inst->userobj_scope, filter, attrs, serverctrls) < 0) {
+		REDEBUG("Failed enqueueing user search");
+		*rcode = RLM_MODULE_FAIL;
+		return -1;
 	}
-	fr_ldap_util_normalise_dn(dn, dn);
 
-	RDEBUG2("User object found at DN \"%s\"", dn);
+	return 0;
+}
 
-	MEM(pair_update_control(&vp, attr_ldap_userdn) >= 0);
-	fr_pair_value_strdup(vp, dn);
-	*rcode = RLM_MODULE_OK;
+/** Retrieve the DN of a user object, from a search started with #rlm_ldap_find_user_async
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @param[in] r		Result of the search.  Freed by the caller.
+ * @param[out] rcode	The status of the operation, one of the RLM_MODULE_* codes.
+ * @return The user's DN or NULL on error.
+ */
+char const *rlm_ldap_find_user_resume(rlm_ldap_t const *inst, request_t *request,
+				      ldap_trunk_result_t *r, rlm_rcode_t *rcode)
+{
+	switch (r->status) {
+	case LDAP_PROC_SUCCESS:
+		break;
 
-	ldap_memfree(dn);
+	case LDAP_PROC_BAD_DN:
+	case LDAP_PROC_NO_RESULT:
+		*rcode = RLM_MODULE_NOTFOUND;
+		return NULL;
 
-finish:
-	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
-		ldap_msgfree(*result);
-		*result = NULL;
+	default:
+		*rcode = RLM_MODULE_FAIL;
+		return NULL;
+	}
+
+	if (!r->conn) {
+		REDEBUG("Connection closed before the search result could be processed");
+		*rcode = RLM_MODULE_FAIL;
+		return NULL;
 	}
 
-	return vp ? vp->vp_strvalue : NULL;
+	return user_search_result(inst, request, r->conn, r->result, rcode);
 }
 
 /** Check for presence of access attribute in result
@@ -272,7 +435,11 @@ void rlm_ldap_check_reply(rlm_ldap_t const *inst, request_t *request, fr_ldap_co
 	    !fr_pair_find_by_da(&request->control_pairs, attr_user_password) &&
 	    !fr_pair_find_by_da(&request->control_pairs, attr_password_with_header) &&
 	    !fr_pair_find_by_da(&request->control_pairs, attr_crypt_password)) {
-		switch (conn->directory->type) {
+		/*
+		 *	Connections in the trunk don't look
+		 *	up the directory type.
+		 */
+		switch (conn->directory ? conn->directory->type : FR_LDAP_DIRECTORY_UNKNOWN) {
 		case FR_LDAP_DIRECTORY_ACTIVE_DIRECTORY:
 			RWDEBUG2("!!! Found map between LDAP attribute and a FreeRADIUS password attribute");
 			RWDEBUG2("!!! Active Directory does not allow passwords to be read via LDAP");
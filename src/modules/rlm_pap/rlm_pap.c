@@ -27,20 +27,25 @@ RCSID("$Id$")
 USES_APPLE_DEPRECATED_API
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/command.h>
 #include <freeradius-devel/server/crypt.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/password.h>
 #include <freeradius-devel/tls/base.h>
+#include <freeradius-devel/unlang/interpret.h>
 
 #include <freeradius-devel/util/base64.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/hex.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/sha1.h>
+#include <freeradius-devel/util/syserror.h>
 
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.password.h>
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #ifdef HAVE_OPENSSL_EVP_H
 #  include <openssl/evp.h>
@@ -53,16 +58,137 @@ USES_APPLE_DEPRECATED_API
  *      a lot cleaner to do so, and a pointer to the structure can
  *      be used as the instance handle.
  */
+typedef struct pap_offload_pool_s pap_offload_pool_t;
+typedef struct pap_offload_job_s pap_offload_job_t;
+
 typedef struct {
 	char const		*name;
 	fr_dict_enum_t		*auth_type;
 	bool			normify;
+
+	uint32_t		offload_threads;	//!< Number of threads to run expensive checks in.
+	uint32_t		offload_queue_size;	//!< Maximum number of checks waiting for a thread.
+	pap_offload_pool_t	*pool;			//!< Threads for expensive checks, NULL if disabled.
 } rlm_pap_t;
 
 typedef unlang_action_t (*pap_auth_func_t)(rlm_rcode_t *p_result, rlm_pap_t const *inst, request_t *request, fr_pair_t const *, fr_pair_t const *);
 
+/** Per-thread instance data
+ *
+ */
+typedef struct {
+	rlm_pap_t const		*inst;			//!< Instance of rlm_pap.
+	fr_event_list_t		*el;			//!< Event list of the worker.
+	int			pipe[2];		//!< Written by the pool to wake the worker.
+
+	pthread_mutex_t		mutex;			//!< Protects done, and the state of jobs in it.
+	pthread_cond_t		cond;			//!< Signalled when a job is added to done.
+	fr_dlist_head_t		done;			//!< Jobs the pool has finished.
+} rlm_pap_thread_t;
+
+#ifdef HAVE_OPENSSL_EVP_H
+/** A parsed PBKDF2-Password
+ *
+ */
+typedef struct {
+	EVP_MD const		*evp_md;			//!< Digest used by the HMAC.
+	size_t			digest_len;			//!< Length of the digest.
+	uint32_t		iterations;			//!< Number of iterations.
+	uint8_t			*salt;				//!< Decoded salt.
+	size_t			salt_len;			//!< Length of the salt.
+	uint8_t			hash[EVP_MAX_MD_SIZE];		//!< "known good" hash.
+	uint8_t			digest[EVP_MAX_MD_SIZE];	//!< Hash of the password the user sent.
+} pap_pbkdf2_t;
+#endif
+
+typedef rlm_rcode_t (*pap_offload_prepare_t)(pap_offload_job_t *job, request_t *request);
+typedef rlm_rcode_t (*pap_offload_func_t)(pap_offload_job_t *job);
+typedef void (*pap_offload_log_t)(pap_offload_job_t *job, request_t *request, rlm_rcode_t rcode);
+
+/** How to run a password check in the offload pool
+ *
+ * Only func is run by a pool thread.  It must not log, or allocate
+ * memory, as the request and its log destinations belong to the worker.
+ */
+typedef struct {
+	pap_offload_prepare_t	prepare;			//!< Parses the "known good" password.  May be NULL.
+	pap_offload_func_t	func;				//!< Hashes and compares the password.
+	pap_offload_log_t	log;				//!< Logs the result of func.
+} pap_offload_t;
+
+typedef enum {
+	PAP_JOB_QUEUED = 0,				//!< Waiting for a pool thread.
+	PAP_JOB_RUNNING,				//!< Being run by a pool thread.
+	PAP_JOB_DONE,					//!< In the worker's list of finished jobs.
+	PAP_JOB_RESUMABLE				//!< The request has been marked resumable.
+} pap_job_state_t;
+
+/** A password check which runs in the offload pool
+ *
+ */
+struct pap_offload_job_s {
+	fr_dlist_t		entry;			//!< Entry in the pool's queue, or the worker's done list.
+	pap_job_state_t		state;			//!< Protected by the pool's mutex until the job
+							///< starts running, and by the worker's after.
+
+	rlm_pap_thread_t	*t;			//!< Worker to return the result to.
+	request_t		*request;		//!< The request being authenticated.
+	pap_offload_t const	*offload;		//!< How to run the check.
+	fr_pair_t		*known_good;		//!< "known good" password.
+	fr_pair_t		*password;		//!< Password the user sent.
+	bool			ephemeral;		//!< known_good must be freed after the check.
+#ifdef HAVE_OPENSSL_EVP_H
+	pap_pbkdf2_t		pbkdf2;			//!< Parsed PBKDF2-Password.
+#endif
+
+	fr_time_t		queued;			//!< When the job was added to the queue.
+	rlm_rcode_t		rcode;			//!< Result of the check.
+};
+
+#define PAP_OFFLOAD_LATENCY_BUCKETS	6
+
+/*
+ *	Upper bounds of the latency histogram, in microseconds.
+ *	The last bucket holds everything slower.
+ */
+static uint64_t const pap_offload_latency_usec[PAP_OFFLOAD_LATENCY_BUCKETS - 1] = {
+	100, 1000, 10000, 100000, 1000000
+};
+
+static char const *pap_offload_latency_names[PAP_OFFLOAD_LATENCY_BUCKETS] = {
+	"lt_100us", "lt_1ms", "lt_10ms", "lt_100ms", "lt_1s", "ge_1s"
+};
+
+/** Threads which run expensive password checks, instead of the workers
+ *
+ */
+struct pap_offload_pool_s {
+	rlm_pap_t const		*inst;			//!< Instance of rlm_pap.
+
+	pthread_mutex_t		mutex;			//!< Protects everything below.
+	pthread_cond_t		cond;			//!< Signalled when there are jobs to run.
+	fr_dlist_head_t		queue;			//!< Jobs waiting for a thread.
+	bool			exiting;		//!< Threads should exit.
+
+	pthread_t		*threads;		//!< Pool threads.
+	uint32_t		num_threads;		//!< Number of threads which were started.
+
+	uint64_t		max_depth;		//!< Most jobs which have been waiting at once.
+	uint64_t		offloaded;		//!< Checks run by the pool.
+	uint64_t		overflow;		//!< Checks refused, because the queue was full.
+	uint64_t		cancelled;		//!< Jobs whose request was cancelled.
+	uint64_t		latency[PAP_OFFLOAD_LATENCY_BUCKETS];	//!< Time from queueing to completion.
+};
+
+static const CONF_PARSER offload_config[] = {
+	{ FR_CONF_OFFSET("threads", FR_TYPE_UINT32, rlm_pap_t, offload_threads), .dflt = "0" },
+	{ FR_CONF_OFFSET("queue_size", FR_TYPE_UINT32, rlm_pap_t, offload_queue_size), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_pap_t, normify), .dflt = "yes" },
+	{ FR_CONF_POINTER("offload", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) offload_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -389,9 +515,10 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_384, "SSHA3-384", EVP_sha
 PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha3_512())
 #  endif
 
-/** Validates Crypt::PBKDF2 LDAP format strings
+/** Parses Crypt::PBKDF2 LDAP format strings
  *
- * @param[out] p_result		The result of comparing the pbkdf2 hash with the password.
+ * @param[out] out		The parsed PBKDF2-Password.
+ * @param[in] ctx		to allocate the decoded salt in.
  * @param[in] request		The current request.
  * @param[in] str		Raw PBKDF2 string.
  * @param[in] len		Length of string.
@@ -401,18 +528,16 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha
  * @param[in] iter_sep		Separation character between the iterations and the next component.
  * @param[in] salt_sep		Separation character between the salt and the next component.
  * @param[in] iter_is_base64	Whether the iterations is are encoded as base64.
- * @param[in] password		to validate.
  * @return
- *	- RLM_MODULE_REJECT
- *	- RLM_MODULE_OK
+ *	- RLM_MODULE_OK if the string was parsed.
+ *	- RLM_MODULE_INVALID if it's malformed.
  */
-static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t *p_result,
-								     request_t *request, const uint8_t *str, size_t len,
-								     fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
-								     char scheme_sep, char iter_sep, char salt_sep,
-								     bool iter_is_base64, fr_pair_t const *password)
+static inline CC_HINT(nonnull) rlm_rcode_t pap_pbkdf2_parse(pap_pbkdf2_t *out, TALLOC_CTX *ctx,
+							    request_t *request, const uint8_t *str, size_t len,
+							    fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
+							    char scheme_sep, char iter_sep, char salt_sep,
+							    bool iter_is_base64)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_INVALID;
 
 	uint8_t const		*p, *q, *end;
 	ssize_t			slen;
@@ -424,9 +549,6 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 	uint32_t		iterations;
 
 	uint8_t			*salt = NULL;
-	size_t			salt_len;
-	uint8_t			hash[EVP_MAX_MD_SIZE];
-	uint8_t			digest[EVP_MAX_MD_SIZE];
 
 	RDEBUG2("Comparing with \"known-good\" PBKDF2-Password");
 
@@ -559,13 +681,13 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 		goto finish;
 	}
 
-	MEM(salt = talloc_array(request, uint8_t, FR_BASE64_DEC_LENGTH(q - p)));
+	MEM(salt = talloc_array(ctx, uint8_t, FR_BASE64_DEC_LENGTH(q - p)));
 	slen = fr_base64_decode(salt, talloc_array_length(salt), (char const *) p, q - p);
 	if (slen < 0) {
 		RPEDEBUG("Failed decoding PBKDF2-Password salt component");
 		goto finish;
 	}
-	salt_len = (size_t)slen;
+	out->salt_len = (size_t)slen;
 
 	p = q + 1;
 
@@ -574,7 +696,7 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 		goto finish;
 	}
 
-	slen = fr_base64_decode(hash, sizeof(hash), (char const *)p, end - p);
+	slen = fr_base64_decode(out->hash, sizeof(out->hash), (char const *)p, end - p);
 	if (slen < 0) {
 		RPEDEBUG("Failed decoding PBKDF2-Password hash component");
 		goto finish;
@@ -584,53 +706,93 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 		REDEBUG("PBKDF2-Password hash component length is incorrect for hash type, expected %zu, got %zd",
 			digest_len, slen);
 
-		RHEXDUMP2(hash, slen, "hash component");
+		RHEXDUMP2(out->hash, slen, "hash component");
 
 		goto finish;
 	}
 
 	RDEBUG2("PBKDF2 %s: Iterations %u, salt length %zu, hash length %zd",
 		fr_table_str_by_value(pbkdf2_crypt_names, digest_type, "<UNKNOWN>"),
-		iterations, salt_len, slen);
+		iterations, out->salt_len, slen);
 
-	/*
-	 *	Hash and compare
-	 */
-	if (PKCS5_PBKDF2_HMAC((char const *)password->vp_octets, (int)password->vp_length,
-			      (unsigned char const *)salt, (int)salt_len,
-			      (int)iterations,
-			      evp_md,
-			      (int)digest_len, (unsigned char *)digest) == 0) {
-		REDEBUG("PBKDF2 digest failure");
-		goto finish;
-	}
+	out->evp_md = evp_md;
+	out->digest_len = digest_len;
+	out->iterations = iterations;
+	out->salt = salt;
 
-	if (fr_digest_cmp(digest, hash, (size_t)digest_len) != 0) {
-		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
-		REDEBUG3("Salt       : %pH", fr_box_octets(salt, salt_len));
-		REDEBUG3("Calculated : %pH", fr_box_octets(digest, digest_len));
-		REDEBUG3("Expected   : %pH", fr_box_octets(hash, slen));
-		rcode = RLM_MODULE_REJECT;
-	} else {
-		rcode = RLM_MODULE_OK;
-	}
+	return RLM_MODULE_OK;
 
 finish:
 	talloc_free(salt);
 
-	RETURN_MODULE_RCODE(rcode);
+	return RLM_MODULE_INVALID;
 }
 
-static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_result,
-							       UNUSED rlm_pap_t const *inst,
-							       request_t *request,
-							       fr_pair_t const *known_good, fr_pair_t const *password)
+/** Hash the password with the parameters from a PBKDF2-Password, and compare it with the "known good" hash
+ *
+ * This doesn't log, or allocate memory, so it can be run by the offload pool.
+ *
+ * @param[in,out] pbkdf2	The parsed PBKDF2-Password.  The hash of the password
+ *				is written to pbkdf2->digest.
+ * @param[in] password		to validate.
+ * @return
+ *	- RLM_MODULE_OK if the password matches.
+ *	- RLM_MODULE_REJECT if it doesn't.
+ *	- RLM_MODULE_INVALID if hashing failed.
+ */
+static rlm_rcode_t pap_pbkdf2_hash(pap_pbkdf2_t *pbkdf2, fr_pair_t const *password)
+{
+	if (PKCS5_PBKDF2_HMAC((char const *)password->vp_octets, (int)password->vp_length,
+			      (unsigned char const *)pbkdf2->salt, (int)pbkdf2->salt_len,
+			      (int)pbkdf2->iterations,
+			      pbkdf2->evp_md,
+			      (int)pbkdf2->digest_len, (unsigned char *)pbkdf2->digest) == 0) return RLM_MODULE_INVALID;
+
+	if (fr_digest_cmp(pbkdf2->digest, pbkdf2->hash, pbkdf2->digest_len) != 0) return RLM_MODULE_REJECT;
+
+	return RLM_MODULE_OK;
+}
+
+/** Log the result of #pap_pbkdf2_hash
+ *
+ */
+static void pap_pbkdf2_log(request_t *request, pap_pbkdf2_t const *pbkdf2, rlm_rcode_t rcode)
+{
+	switch (rcode) {
+	case RLM_MODULE_INVALID:
+		REDEBUG("PBKDF2 digest failure");
+		break;
+
+	case RLM_MODULE_REJECT:
+		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
+		REDEBUG3("Salt       : %pH", fr_box_octets(pbkdf2->salt, pbkdf2->salt_len));
+		REDEBUG3("Calculated : %pH", fr_box_octets(pbkdf2->digest, pbkdf2->digest_len));
+		REDEBUG3("Expected   : %pH", fr_box_octets(pbkdf2->hash, pbkdf2->digest_len));
+		break;
+
+	default:
+		break;
+	}
+}
+
+/** Parse a PBKDF2-Password in any of the formats we support
+ *
+ * @param[out] out		The parsed PBKDF2-Password.
+ * @param[in] ctx		to allocate the decoded salt in.
+ * @param[in] request		The current request.
+ * @param[in] known_good	PBKDF2-Password to parse.
+ * @return
+ *	- RLM_MODULE_OK if the password was parsed.
+ *	- RLM_MODULE_INVALID if it's malformed.
+ */
+static rlm_rcode_t CC_HINT(nonnull) pap_pbkdf2_prepare(pap_pbkdf2_t *out, TALLOC_CTX *ctx,
+						       request_t *request, fr_pair_t const *known_good)
 {
 	uint8_t const *p = known_good->vp_octets, *q, *end = p + known_good->vp_length;
 
 	if (end - p < 2) {
 		REDEBUG("PBKDF2-Password too short");
-		RETURN_MODULE_INVALID;
+		return RLM_MODULE_INVALID;
 	}
 
 	/*
@@ -647,9 +809,9 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 			q = memchr(p, '}', end - p);
 			p = q + 1;
 		}
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
-					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
-					     ':', ':', ':', true, password);
+		return pap_pbkdf2_parse(out, ctx, request, p, end - p,
+					pbkdf2_crypt_names, pbkdf2_crypt_names_len,
+					':', ':', ':', true);
 	}
 
 	/*
@@ -659,9 +821,9 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$PBKDF2$") && (memcmp(p, "$PBKDF2$", sizeof("$PBKDF2$") - 1) == 0)) {
 		p += sizeof("$PBKDF2$") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
-					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
-					     ':', ':', '$', false, password);
+		return pap_pbkdf2_parse(out, ctx, request, p, end - p,
+					pbkdf2_crypt_names, pbkdf2_crypt_names_len,
+					':', ':', '$', false);
 	}
 
 	/*
@@ -673,14 +835,32 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$pbkdf2-") && (memcmp(p, "$pbkdf2-", sizeof("$pbkdf2-") - 1) == 0)) {
 		p += sizeof("$pbkdf2-") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
-					     pbkdf2_passlib_names, pbkdf2_passlib_names_len,
-					     '$', '$', '$', false, password);
+		return pap_pbkdf2_parse(out, ctx, request, p, end - p,
+					pbkdf2_passlib_names, pbkdf2_passlib_names_len,
+					'$', '$', '$', false);
 	}
 
 	REDEBUG("Can't determine format of PBKDF2-Password");
 
-	RETURN_MODULE_INVALID;
+	return RLM_MODULE_INVALID;
+}
+
+static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_result,
+							       UNUSED rlm_pap_t const *inst,
+							       request_t *request,
+							       fr_pair_t const *known_good, fr_pair_t const *password)
+{
+	pap_pbkdf2_t	pbkdf2;
+	rlm_rcode_t	rcode;
+
+	rcode = pap_pbkdf2_prepare(&pbkdf2, request, request, known_good);
+	if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
+
+	rcode = pap_pbkdf2_hash(&pbkdf2, password);
+	pap_pbkdf2_log(request, &pbkdf2, rcode);
+	talloc_free(pbkdf2.salt);
+
+	RETURN_MODULE_RCODE(rcode);
 }
 #endif
 
@@ -865,6 +1045,288 @@ static const pap_auth_func_t auth_func_table[] = {
 #endif	/* HAVE_OPENSSL_EVP_H */
 };
 
+#ifdef HAVE_CRYPT
+static rlm_rcode_t pap_offload_crypt(pap_offload_job_t *job)
+{
+	if (fr_crypt_check(job->password->vp_strvalue, job->known_good->vp_strvalue) != 0) return RLM_MODULE_REJECT;
+
+	return RLM_MODULE_OK;
+}
+
+static void pap_offload_crypt_log(UNUSED pap_offload_job_t *job, request_t *request, rlm_rcode_t rcode)
+{
+	if (rcode == RLM_MODULE_REJECT) REDEBUG("Crypt digest does not match \"known good\" digest");
+}
+#endif
+
+#ifdef HAVE_OPENSSL_EVP_H
+static rlm_rcode_t pap_offload_pbkdf2_prepare(pap_offload_job_t *job, request_t *request)
+{
+	return pap_pbkdf2_prepare(&job->pbkdf2, job, request, job->known_good);
+}
+
+static rlm_rcode_t pap_offload_pbkdf2(pap_offload_job_t *job)
+{
+	return pap_pbkdf2_hash(&job->pbkdf2, job->password);
+}
+
+static void pap_offload_pbkdf2_log(pap_offload_job_t *job, request_t *request, rlm_rcode_t rcode)
+{
+	pap_pbkdf2_log(request, &job->pbkdf2, rcode);
+}
+#endif
+
+/** Password types which are expensive enough to run in the offload pool
+ *
+ * Everything else is a single hash, which is cheaper than the
+ * round trip to another thread.
+ */
+static pap_offload_t const auth_func_offload[] = {
+#ifdef HAVE_CRYPT
+	[FR_CRYPT]	= { .func = pap_offload_crypt, .log = pap_offload_crypt_log },
+#endif
+#ifdef HAVE_OPENSSL_EVP_H
+	[FR_PBKDF2]	= { .prepare = pap_offload_pbkdf2_prepare, .func = pap_offload_pbkdf2,
+			    .log = pap_offload_pbkdf2_log },
+#endif
+};
+
+/** Log the result of a password check, and return it
+ *
+ */
+static unlang_action_t pap_auth_finish(rlm_rcode_t *p_result, request_t *request, rlm_rcode_t rcode)
+{
+	switch (rcode) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("Password incorrect");
+		break;
+
+	case RLM_MODULE_OK:
+		RDEBUG2("User authenticated successfully");
+		break;
+
+	default:
+		break;
+	}
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Run password checks from the queue, until the pool is freed
+ *
+ */
+static void *pap_offload_thread(void *arg)
+{
+	pap_offload_pool_t	*pool = arg;
+	pap_offload_job_t	*job;
+	rlm_pap_thread_t	*t;
+	uint64_t		usec;
+	size_t			i;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->exiting && (fr_dlist_num_elements(&pool->queue) == 0)) {
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+		if (pool->exiting) break;
+
+		job = fr_dlist_head(&pool->queue);
+		fr_dlist_remove(&pool->queue, job);
+		job->state = PAP_JOB_RUNNING;
+		pthread_mutex_unlock(&pool->mutex);
+
+		/*
+		 *	The check only uses the job, and the pairs it
+		 *	points to.  The worker doesn't touch either
+		 *	until we return the job.
+		 */
+		job->rcode = job->offload->func(job);
+		usec = fr_time_delta_to_usec(fr_time() - job->queued);
+
+		/*
+		 *	The job may be freed by the worker as soon as
+		 *	the mutex is released, so it's not used after
+		 *	this point.
+		 */
+		t = job->t;
+		pthread_mutex_lock(&t->mutex);
+		job->state = PAP_JOB_DONE;
+		fr_dlist_insert_tail(&t->done, job);
+		pthread_cond_broadcast(&t->cond);
+		if ((write(t->pipe[1], "", 1) < 0) && (errno != EAGAIN)) {
+			ERROR("Failed signalling worker: %s", fr_syserror(errno));
+		}
+		pthread_mutex_unlock(&t->mutex);
+
+		for (i = 0; i < NUM_ELEMENTS(pap_offload_latency_usec); i++) {
+			if (usec < pap_offload_latency_usec[i]) break;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->offloaded++;
+		pool->latency[i]++;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/** Stop the pool threads
+ *
+ * Any jobs left in the queue belong to requests which have already
+ * been cancelled, and freed them.
+ */
+static int _pap_offload_pool_free(pap_offload_pool_t *pool)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->exiting = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+
+	return 0;
+}
+
+/** Create the offload pool, and start its threads
+ *
+ */
+static pap_offload_pool_t *pap_offload_pool_alloc(rlm_pap_t const *inst)
+{
+	pap_offload_pool_t	*pool;
+	uint32_t		i;
+	int			ret;
+
+	MEM(pool = talloc_zero(NULL, pap_offload_pool_t));
+	pool->inst = inst;
+	fr_dlist_talloc_init(&pool->queue, pap_offload_job_t, entry);
+	MEM(pool->threads = talloc_array(pool, pthread_t, inst->offload_threads));
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	talloc_set_destructor(pool, _pap_offload_pool_free);
+
+	for (i = 0; i < inst->offload_threads; i++) {
+		ret = pthread_create(&pool->threads[i], NULL, pap_offload_thread, pool);
+		if (ret != 0) {
+			ERROR("Failed creating offload thread: %s", fr_syserror(ret));
+			talloc_free(pool);
+			return NULL;
+		}
+		pool->num_threads++;
+	}
+
+	return pool;
+}
+
+/** Mark requests whose password checks are complete as resumable
+ *
+ */
+static void pap_offload_done(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(uctx, rlm_pap_thread_t);
+	fr_dlist_head_t		done;
+	pap_offload_job_t	*job;
+	uint8_t			buffer[64];
+
+	while (read(fd, buffer, sizeof(buffer)) > 0);
+
+	fr_dlist_talloc_init(&done, pap_offload_job_t, entry);
+
+	pthread_mutex_lock(&t->mutex);
+	fr_dlist_move(&done, &t->done);
+	for (job = fr_dlist_head(&done); job; job = fr_dlist_next(&done, job)) job->state = PAP_JOB_RESUMABLE;
+	pthread_mutex_unlock(&t->mutex);
+
+	while ((job = fr_dlist_pop_head(&done))) unlang_interpret_mark_resumable(job->request);
+}
+
+/** Return the result of an offloaded password check
+ *
+ */
+static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					       request_t *request, void *rctx)
+{
+	pap_offload_job_t	*job = talloc_get_type_abort(rctx, pap_offload_job_t);
+	rlm_rcode_t		rcode = job->rcode;
+
+	fr_assert(job->state == PAP_JOB_RESUMABLE);
+
+	job->offload->log(job, request, rcode);
+
+	if (job->ephemeral) talloc_list_free(&job->known_good);
+	talloc_free(job);
+
+	return pap_auth_finish(p_result, request, rcode);
+}
+
+/** Take an offloaded password check back from the pool
+ *
+ * If a pool thread is running the check, we wait for it to finish,
+ * as the check uses pairs which are freed with the request.
+ */
+static void mod_authenticate_signal(module_ctx_t const *mctx, UNUSED request_t *request, void *rctx,
+				    fr_state_signal_t action)
+{
+	rlm_pap_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_pap_t);
+	pap_offload_job_t	*job = talloc_get_type_abort(rctx, pap_offload_job_t);
+	rlm_pap_thread_t	*t = job->t;
+	pap_offload_pool_t	*pool = inst->pool;
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->cancelled++;
+	if (job->state == PAP_JOB_QUEUED) {
+		fr_dlist_remove(&pool->queue, job);
+		pthread_mutex_unlock(&pool->mutex);
+		goto done;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	pthread_mutex_lock(&t->mutex);
+	while (job->state == PAP_JOB_RUNNING) pthread_cond_wait(&t->cond, &t->mutex);
+	if (job->state == PAP_JOB_DONE) fr_dlist_remove(&t->done, job);
+	pthread_mutex_unlock(&t->mutex);
+
+done:
+	if (job->ephemeral) talloc_list_free(&job->known_good);
+	talloc_free(job);
+}
+
+/** Pass a password check to the offload pool
+ *
+ * @return
+ *	- true if the check was queued, and the request should yield.
+ *	- false if the queue is full.
+ */
+static bool pap_offload_submit(pap_offload_job_t *job, pap_offload_pool_t *pool, rlm_pap_t const *inst)
+{
+	size_t depth;
+
+	pthread_mutex_lock(&pool->mutex);
+	depth = fr_dlist_num_elements(&pool->queue);
+	if (depth >= inst->offload_queue_size) {
+		pool->overflow++;
+		pthread_mutex_unlock(&pool->mutex);
+		return false;
+	}
+
+	job->state = PAP_JOB_QUEUED;
+	job->queued = fr_time();
+	fr_dlist_insert_tail(&pool->queue, job);
+	if ((depth + 1) > pool->max_depth) pool->max_depth = depth + 1;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return true;
+}
+
 /*
  *	Authenticate the user via one of any well-known password.
  */
@@ -923,24 +1385,59 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	}
 
 	/*
-	 *	Authenticate, and return.
+	 *	Expensive checks are run by the offload pool, so
+	 *	that they don't hold up the other requests in this
+	 *	worker.
 	 */
-	auth_func(&rcode, inst, request, known_good, password);
-	if (ephemeral) talloc_list_free(&known_good);
-	switch (rcode) {
-	case RLM_MODULE_REJECT:
-		REDEBUG("Password incorrect");
-		break;
+	if (inst->pool && (known_good->da->attr < NUM_ELEMENTS(auth_func_offload)) &&
+	    auth_func_offload[known_good->da->attr].func) {
+		pap_offload_t const	*offload = &auth_func_offload[known_good->da->attr];
+		pap_offload_job_t	*job;
+
+		MEM(job = talloc_zero(request, pap_offload_job_t));
+		job->t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
+		job->request = request;
+		job->offload = offload;
+		job->known_good = known_good;
+		job->password = password;
+		job->ephemeral = ephemeral;
 
-	case RLM_MODULE_OK:
-		RDEBUG2("User authenticated successfully");
-		break;
+		/*
+		 *	Anything which needs to log, or allocate
+		 *	memory, is done here, before the job is
+		 *	handed to a pool thread.
+		 */
+		if (offload->prepare) {
+			rcode = offload->prepare(job, request);
+			if (rcode != RLM_MODULE_OK) {
+				talloc_free(job);
+				if (ephemeral) talloc_list_free(&known_good);
+				return pap_auth_finish(p_result, request, rcode);
+			}
+		}
 
-	default:
-		break;
+		if (pap_offload_submit(job, inst->pool, inst)) {
+			return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, job);
+		}
+
+		/*
+		 *	Running the check here would block every other
+		 *	request on this worker, which is what the pool
+		 *	is there to prevent.
+		 */
+		REDEBUG("Offload queue is full, refusing to check password");
+		talloc_free(job);
+		if (ephemeral) talloc_list_free(&known_good);
+		RETURN_MODULE_FAIL;
 	}
 
-	RETURN_MODULE_RCODE(rcode);
+	/*
+	 *	Authenticate, and return.
+	 */
+	auth_func(&rcode, inst, request, known_good, password);
+	if (ephemeral) talloc_list_free(&known_good);
+
+	return pap_auth_finish(p_result, request, rcode);
 }
 
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
@@ -958,6 +1455,40 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+static int cmd_show_offload(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	pap_offload_pool_t	*pool = talloc_get_type_abort(ctx, pap_offload_pool_t);
+	size_t			i;
+
+	pthread_mutex_lock(&pool->mutex);
+	fprintf(fp, "queue.depth		%zu\n", fr_dlist_num_elements(&pool->queue));
+	fprintf(fp, "queue.max_depth		%" PRIu64 "\n", pool->max_depth);
+	fprintf(fp, "queue.size		%u\n", pool->inst->offload_queue_size);
+	fprintf(fp, "threads			%u\n", pool->num_threads);
+	fprintf(fp, "count.offloaded		%" PRIu64 "\n", pool->offloaded);
+	fprintf(fp, "count.overflow		%" PRIu64 "\n", pool->overflow);
+	fprintf(fp, "count.cancelled		%" PRIu64 "\n", pool->cancelled);
+	for (i = 0; i < NUM_ELEMENTS(pool->latency); i++) {
+		fprintf(fp, "latency.%s\t\t%" PRIu64 "\n", pap_offload_latency_names[i], pool->latency[i]);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "offload",
+		.func = cmd_show_offload,
+		.help = "Show the queue depth, and latency of password checks run by the offload pool.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+
 static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
 {
 	rlm_pap_t	*inst = talloc_get_type_abort(instance, rlm_pap_t);
@@ -968,6 +1499,91 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
 		     inst->name);
 	}
 
+	if (inst->offload_threads == 0) return 0;
+
+	FR_INTEGER_BOUND_CHECK("offload.threads", inst->offload_threads, <=, 256);
+	FR_INTEGER_BOUND_CHECK("offload.queue_size", inst->offload_queue_size, >=, 1);
+
+	/*
+	 *	Not parented by the instance, so that the threads
+	 *	are stopped before the instance data is freed.
+	 */
+	inst->pool = pap_offload_pool_alloc(inst);
+	if (!inst->pool) return -1;
+
+	if (fr_command_register_hook(NULL, inst->name, inst->pool, cmd_table) < 0) {
+		PERROR("Failed registering radmin commands for %s", inst->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_pap_t	*inst = talloc_get_type_abort(instance, rlm_pap_t);
+
+	TALLOC_FREE(inst->pool);
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_pap_t const		*inst = talloc_get_type_abort_const(instance, rlm_pap_t);
+	rlm_pap_thread_t	*t = talloc_get_type_abort(thread, rlm_pap_thread_t);
+
+	t->inst = inst;
+	t->el = el;
+	t->pipe[0] = t->pipe[1] = -1;
+
+	if (!inst->pool) return 0;
+
+	if (pipe(t->pipe) < 0) {
+		ERROR("Failed creating offload pipe: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fcntl(t->pipe[0], F_SETFL, O_NONBLOCK) < 0) ||
+	    (fcntl(t->pipe[1], F_SETFL, O_NONBLOCK) < 0) ||
+	    (fcntl(t->pipe[0], F_SETFD, FD_CLOEXEC) < 0) ||
+	    (fcntl(t->pipe[1], F_SETFD, FD_CLOEXEC) < 0)) {
+		ERROR("Failed setting offload pipe flags: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (fr_event_fd_insert(t, el, t->pipe[0], pap_offload_done, NULL, NULL, t) < 0) {
+		PERROR("Failed inserting offload pipe into event loop");
+		goto error;
+	}
+
+	pthread_mutex_init(&t->mutex, NULL);
+	pthread_cond_init(&t->cond, NULL);
+	fr_dlist_talloc_init(&t->done, pap_offload_job_t, entry);
+
+	return 0;
+
+error:
+	close(t->pipe[0]);
+	close(t->pipe[1]);
+	t->pipe[0] = t->pipe[1] = -1;
+	return -1;
+}
+
+static int mod_thread_detach(fr_event_list_t *el, void *thread)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(thread, rlm_pap_thread_t);
+
+	if (t->pipe[0] < 0) return 0;
+
+	fr_event_fd_delete(el, t->pipe[0], FR_EVENT_FILTER_IO);
+	close(t->pipe[0]);
+	close(t->pipe[1]);
+
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->mutex);
+
 	return 0;
 }
 
@@ -1046,6 +1662,11 @@ module_t rlm_pap = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_pap_thread_t),
+	.thread_inst_type	= "rlm_pap_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
@@ -39,6 +39,12 @@ RCSID("$Id$")
 #include "rlm_radius.h"
 #include "track.h"
 
+/*
+ *	How many replies we read from the socket before verifying
+ *	their signatures together.
+ */
+#define RECV_BATCH	(16)
+
 /** Static configuration for the module.
  *
  */
@@ -50,6 +56,7 @@ typedef struct {
 	fr_ipaddr_t		src_ipaddr;		//!< IP we open our socket on.
 	uint16_t		dst_port;		//!< Port of the home server.
 	char const		*secret;		//!< Shared secret.
+	fr_md5_key_t		*secret_key;		//!< MD5 states precomputed from the secret.
 
 	char const		*interface;		//!< Interface to bind to.
 
@@ -116,8 +123,8 @@ typedef struct {
 							//!< src_ipaddr field.
 	uint16_t		src_port;		//!< Source port specific to this connection.
 
-	uint8_t			*buffer;		//!< Receive buffer.
-	size_t			buflen;			//!< Receive buffer length.
+	uint8_t			*buffer;		//!< Receive buffer, with room for #RECV_BATCH packets.
+	size_t			buflen;			//!< Maximum length of one packet in the receive buffer.
 
 	radius_track_t		*tt;			//!< RADIUS ID tracking structure.
 
@@ -268,9 +275,10 @@ static int 		encode(rlm_radius_udp_t const *inst, request_t *request, udp_reques
 static decode_fail_t	decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *response_code,
 			       udp_handle_t *h, request_t *request, udp_request_t *u,
 			       uint8_t const request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH],
-			       uint8_t *data, size_t data_len);
+			       uint8_t const *verified, uint8_t *data, size_t data_len);
 
-static void		protocol_error_reply(udp_request_t *u, udp_result_t *r, udp_handle_t *h);
+static void		protocol_error_reply(udp_request_t *u, udp_result_t *r, udp_handle_t *h,
+					     uint8_t const *data);
 
 #ifndef NDEBUG
 /** Log additional information about a tracking entry
@@ -522,6 +530,21 @@ static void conn_status_check_again(fr_event_list_t *el, UNUSED fr_time_t now, v
 	}
 }
 
+/** Make sure the receive buffer can hold #RECV_BATCH packets of the current maximum length
+ *
+ * Protocol-Error replies can increase the length, in which case the
+ * buffer grows before the next read.
+ */
+static void udp_buffer_alloc(udp_handle_t *h)
+{
+	size_t	len = h->buflen * RECV_BATCH;
+
+	if (h->buffer && (talloc_array_length(h->buffer) >= len)) return;
+
+	talloc_free(h->buffer);
+	MEM(h->buffer = talloc_array(h, uint8_t, len));
+}
+
 /** Read the incoming status-check response.  If it's correct mark the connection as connected
  *
  */
@@ -537,6 +560,8 @@ static void conn_readable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSE
 	uint8_t			code = 0;
 
 	fr_pair_list_init(&reply);
+	udp_buffer_alloc(h);
+
 	slen = read(h->fd, h->buffer, h->buflen);
 	if (slen == 0) return;
 
@@ -578,7 +603,7 @@ static void conn_readable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSE
 
 	if (decode(h, &reply, &code,
 		   h, h->status_request, h->status_u, u->packet + RADIUS_AUTH_VECTOR_OFFSET,
-		   h->buffer, slen) != DECODE_FAIL_NONE) return;
+		   NULL, h->buffer, slen) != DECODE_FAIL_NONE) return;
 
 	fr_pair_list_free(&reply);	/* FIXME - Do something with these... */
 
@@ -587,7 +612,7 @@ static void conn_readable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSE
 	 *	This is usually used for dynamic configuration
 	 *	on startup.
 	 */
-	if (code == FR_CODE_PROTOCOL_ERROR) protocol_error_reply(u, NULL, h);
+	if (code == FR_CODE_PROTOCOL_ERROR) protocol_error_reply(u, NULL, h, h->buffer);
 
 	/*
 	 *	Last trunk event was a failure, be more careful about
@@ -749,8 +774,8 @@ static fr_connection_state_t conn_init(void **h_out, fr_connection_t *conn, void
 		h->mmsgvec[i].msg_hdr.msg_iovlen = 1;
 	}
 
-	MEM(h->buffer = talloc_array(h, uint8_t, h->max_packet_size));
 	h->buflen = h->max_packet_size;
+	udp_buffer_alloc(h);
 
 	if (!h->inst->replicate) MEM(h->tt = radius_track_alloc(h));
 
@@ -1161,6 +1186,19 @@ static int8_t request_prioritise(void const *one, void const *two)
 	return (a->recv_time > b->recv_time) - (a->recv_time < b->recv_time);
 }
 
+/** Build the header of the original request, for verifying and decoding a response
+ *
+ */
+static inline void udp_original(uint8_t original[static RADIUS_HEADER_LENGTH], udp_request_t const *u,
+				uint8_t const request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH])
+{
+	original[0] = u->code;
+	original[1] = 0;			/* not looked at by fr_radius_verify() */
+	original[2] = 0;
+	original[3] = RADIUS_HEADER_LENGTH;	/* for debugging */
+	memcpy(original + RADIUS_AUTH_VECTOR_OFFSET, request_authenticator, RADIUS_AUTH_VECTOR_LENGTH);
+}
+
 /** Decode response packet data, extracting relevant information and validating the packet
  *
  * @param[in] ctx			to allocate pairs in.
@@ -1170,6 +1208,8 @@ static int8_t request_prioritise(void const *one, void const *two)
  * @param[in] request			the request.
  * @param[in] u				UDP request.
  * @param[in] request_authenticator	from the original request.
+ * @param[in] verified			original request header the packet was already
+ *					verified against by #fr_radius_verify_batch, or NULL.
  * @param[in] data			to decode.
  * @param[in] data_len			Length of input data.
  * @return
@@ -1179,7 +1219,7 @@ static int8_t request_prioritise(void const *one, void const *two)
 static decode_fail_t decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *response_code,
 			    udp_handle_t *h, request_t *request, udp_request_t *u,
 			    uint8_t const request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH],
-			    uint8_t *data, size_t data_len)
+			    uint8_t const *verified, uint8_t *data, size_t data_len)
 {
 	rlm_radius_udp_t const *inst = h->thread->inst;
 	size_t			packet_len;
@@ -1198,14 +1238,16 @@ static decode_fail_t decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *res
 
 	RHEXDUMP3(data, packet_len, "Read packet");
 
-	original[0] = u->code;
-	original[1] = 0;			/* not looked at by fr_radius_verify() */
-	original[2] = 0;
-	original[3] = RADIUS_HEADER_LENGTH;	/* for debugging */
-	memcpy(original + RADIUS_AUTH_VECTOR_OFFSET, request_authenticator, RADIUS_AUTH_VECTOR_LENGTH);
+	udp_original(original, u, request_authenticator);
 
-	if (fr_radius_verify(data, original,
-			     (uint8_t const *) inst->secret, talloc_array_length(inst->secret) - 1) < 0) {
+	/*
+	 *	Only skip the check if the batch verified the packet
+	 *	against the request we're now matching it to.
+	 */
+	if ((!verified || (memcmp(verified, original, sizeof(original)) != 0)) &&
+	    (fr_radius_verify_key(data, original,
+				  (uint8_t const *) inst->secret, talloc_array_length(inst->secret) - 1,
+				  inst->secret_key) < 0)) {
 		RPWDEBUG("Ignoring response with invalid signature");
 		return DECODE_FAIL_MA_INVALID;
 	}
@@ -1242,8 +1284,8 @@ static decode_fail_t decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *res
 	 *	or if we run out of memory.
 	 */
 	fr_cursor_init(&cursor, reply);
-	if (fr_radius_decode(ctx, data, packet_len, original,
-			     inst->secret, talloc_array_length(inst->secret) - 1, &cursor) < 0) {
+	if (fr_radius_decode_key(ctx, data, packet_len, original,
+				 inst->secret, inst->secret_key, &cursor) < 0) {
 		REDEBUG("Failed decoding attributes for packet");
 		fr_pair_list_free(reply);
 		return DECODE_FAIL_UNKNOWN;
@@ -1353,9 +1395,9 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 	 *	Encode it, leaving room for Proxy-State and
 	 *	Message-Authenticator if necessary.
 	 */
-	packet_len = fr_radius_encode(u->packet, u->packet_len - (proxy_state + message_authenticator), NULL,
-				      inst->secret, talloc_array_length(inst->secret) - 1,
-				      u->code, id, &request->request_pairs);
+	packet_len = fr_radius_encode_key(u->packet, u->packet_len - (proxy_state + message_authenticator), NULL,
+					  inst->secret, inst->secret_key,
+					  u->code, id, &request->request_pairs);
 	if (fr_pair_encode_is_error(packet_len)) {
 		RPERROR("Failed encoding packet");
 
@@ -1514,8 +1556,8 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 		/*
 		 *	Now that we're done mangling the packet, sign it.
 		 */
-		if (fr_radius_sign(u->packet, NULL, (uint8_t const *) inst->secret,
-				   talloc_array_length(inst->secret) - 1) < 0) {
+		if (fr_radius_sign_key(u->packet, NULL, (uint8_t const *) inst->secret,
+				       talloc_array_length(inst->secret) - 1, inst->secret_key) < 0) {
 			RERROR("Failed signing packet");
 			goto error;
 		}
@@ -2125,15 +2167,15 @@ static void request_mux_replicate(UNUSED fr_event_list_t *el,
 /** Deal with Protocol-Error replies, and possible negotiation
  *
  */
-static void protocol_error_reply(udp_request_t *u, udp_result_t *r, udp_handle_t *h)
+static void protocol_error_reply(udp_request_t *u, udp_result_t *r, udp_handle_t *h, uint8_t const *data)
 {
 	bool	  	error_601 = false;
 	uint32_t  	response_length = 0;
 	uint8_t const	*attr, *end;
 
-	end = h->buffer + ((h->buffer[2] << 8) | h->buffer[3]);
+	end = data + ((data[2] << 8) | data[3]);
 
-	for (attr = h->buffer + RADIUS_HEADER_LENGTH;
+	for (attr = data + RADIUS_HEADER_LENGTH;
 	     attr < end;
 	     attr += attr[1]) {
 		/*
@@ -2213,13 +2255,11 @@ static void protocol_error_reply(udp_request_t *u, udp_result_t *r, udp_handle_t
 		DEBUG("%s - Increasing buffer size to %u for connection %s", h->module_name, response_length, h->name);
 
 		/*
-		 *	Make sure to copy the packet over!
+		 *	We may still be processing other packets in
+		 *	the receive buffer, so it's only reallocated
+		 *	before the next read.
 		 */
-		attr = h->buffer;
 		h->buflen = response_length;
-		MEM(h->buffer = talloc_array(h, uint8_t, h->buflen));
-
-		memcpy(h->buffer, attr, (attr[2] << 8) | attr[3]);
 	}
 
 	/*
@@ -2255,7 +2295,7 @@ static void status_check_next(UNUSED fr_event_list_t *el, UNUSED fr_time_t now,
 /** Deal with replies replies to status checks and possible negotiation
  *
  */
-static void status_check_reply(fr_trunk_request_t *treq, fr_time_t now)
+static void status_check_reply(fr_trunk_request_t *treq, fr_time_t now, uint8_t const *data)
 {
 	udp_handle_t		*h = talloc_get_type_abort(treq->tconn->conn->h, udp_handle_t);
 	rlm_radius_t const 	*inst = h->inst->parent;
@@ -2270,7 +2310,7 @@ static void status_check_reply(fr_trunk_request_t *treq, fr_time_t now)
 	/*
 	 *	@todo - do other negotiation and signaling.
 	 */
-	if (h->buffer[0] == FR_CODE_PROTOCOL_ERROR) protocol_error_reply(u, NULL, h);
+	if (data[0] == FR_CODE_PROTOCOL_ERROR) protocol_error_reply(u, NULL, h, data);
 
 	if (u->num_replies < inst->num_answers_to_alive) {
 		DEBUG("Received %d / %u replies for status check, on connection - %s",
@@ -2313,159 +2353,240 @@ static void status_check_reply(fr_trunk_request_t *treq, fr_time_t now)
 
 static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
 {
-	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);;
+	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);
+	rlm_radius_udp_t const	*inst = h->inst;
 
 	DEBUG3("%s - Reading data for connection %s", h->module_name, h->name);
 
 	while (true) {
 		ssize_t			slen;
+		size_t			i, num, num_verify = 0;
+		bool			drained = false;
 
-		fr_trunk_request_t	*treq;
-		request_t			*request;
-		udp_request_t		*u;
-		udp_result_t		*r;
-		radius_track_entry_t	*rr;
-		decode_fail_t		reason;
-		uint8_t			code = 0;
-		fr_pair_list_t		reply;
+		size_t			data_len[RECV_BATCH];
+		uint8_t			original[RECV_BATCH][RADIUS_HEADER_LENGTH];
+		fr_radius_verify_t	verify[RECV_BATCH];
+		uint8_t const		*verified[RECV_BATCH];
 
-		fr_time_t		now;
+		udp_buffer_alloc(h);
 
-		fr_pair_list_init(&reply);
 		/*
 		 *	Drain the socket of all packets.  If we're busy, this
 		 *	saves a round through the event loop.  If we're not
 		 *	busy, a few extra system calls don't matter.
 		 */
-		slen = read(h->fd, h->buffer, h->buflen);
-		if (slen == 0) return;
+		for (num = 0; num < RECV_BATCH; num++) {
+			slen = read(h->fd, h->buffer + (num * h->buflen), h->buflen);
+			if (slen == 0) {
+				drained = true;
+				break;
+			}
 
-		if (slen < 0) {
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+			if (slen < 0) {
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+					drained = true;
+					break;
+				}
 
-			ERROR("%s - Failed reading response from socket: %s",
-			      h->module_name, fr_syserror(errno));
-			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
-			return;
-		}
+				ERROR("%s - Failed reading response from socket: %s",
+				      h->module_name, fr_syserror(errno));
+				fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+				return;
+			}
 
-		if (slen < RADIUS_HEADER_LENGTH) {
-			ERROR("%s - Packet too short, expected at least %zu bytes got %zd bytes",
-			      h->module_name, (size_t)RADIUS_HEADER_LENGTH, slen);
-			continue;
+			data_len[num] = slen;
 		}
 
 		/*
-		 *	Note that we don't care about packet codes.  All
-		 *	packet codes share the same ID space.
+		 *	Verify the signatures of the replies we can match
+		 *	to a request all at once, as the MD5 calculations
+		 *	for several packets can then run in parallel.
+		 *
+		 *	Anything which fails here is verified again by
+		 *	decode(), so that the error is logged against the
+		 *	request.
 		 */
-		rr = radius_track_entry_find(h->tt, h->buffer[1], NULL);
-		if (!rr) {
-			WARN("%s - Ignoring reply with ID %i that arrived too late",
-			     h->module_name, h->buffer[1]);
-			continue;
-		}
+		for (i = 0; i < num; i++) {
+			uint8_t			*data = h->buffer + (i * h->buflen);
+			size_t			packet_len = data_len[i];
+			fr_trunk_request_t	*treq;
+			radius_track_entry_t	*rr;
+			decode_fail_t		reason;
 
-		treq = talloc_get_type_abort(rr->uctx, fr_trunk_request_t);
-		request = treq->request;
-		fr_assert(request != NULL);
-		u = talloc_get_type_abort(treq->preq, udp_request_t);
-		r = talloc_get_type_abort(treq->rctx, udp_result_t);
+			verified[i] = NULL;
 
-		/*
-		 *	Validate and decode the incoming packet
-		 */
-		reason = decode(request->reply, &reply, &code, h, request, u, rr->vector, h->buffer, (size_t)slen);
-		if (reason != DECODE_FAIL_NONE) {
-			RWDEBUG("Ignoring invalid response");
-			continue;
-		}
+			if (packet_len < RADIUS_HEADER_LENGTH) continue;
 
-		/*
-		 *	Only valid packets are processed
-		 *	Otherwise an attacker could perform
-		 *	a DoS attack against the proxying servers
-		 *	by sending fake responses for upstream
-		 *	servers.
-		 */
-		h->last_reply = now = fr_time();
+			rr = radius_track_entry_find(h->tt, data[1], NULL);
+			if (!rr) continue;
 
-		/*
-		 *	Status-Server can have any reply code, we don't care
-		 *	what it is.  So long as it's signed properly, we
-		 *	accept it.  This flexibility is because we don't
-		 *	expose Status-Server to the admins.  It's only used by
-		 *	this module for internal signalling.
-		 */
-		if (u == h->status_u) {
-			fr_pair_list_free(&reply);	/* Probably want to pass this to status_check_reply? */
-			status_check_reply(treq, now);
-			fr_trunk_request_signal_complete(treq);
-			continue;
-		}
+			if (!fr_radius_ok(data, &packet_len, inst->parent->max_attributes, false, &reason)) continue;
 
-		/*
-		 *	Handle any state changes, etc. needed by receiving a
-		 *	Protocol-Error reply packet.
-		 *
-		 *	Protocol-Error is permitted as a reply to any
-		 *	packet.
-		 */
-		switch (code) {
-		case FR_CODE_PROTOCOL_ERROR:
-			protocol_error_reply(u, r, h);
-			break;
+			treq = talloc_get_type_abort(rr->uctx, fr_trunk_request_t);
+			udp_original(original[i], talloc_get_type_abort(treq->preq, udp_request_t), rr->vector);
 
-		default:
-			break;
+			verify[num_verify++] = (fr_radius_verify_t){
+				.packet = data,
+				.original = original[i],
+				.secret = (uint8_t const *) inst->secret,
+				.secret_len = talloc_array_length(inst->secret) - 1
+			};
 		}
 
 		/*
-		 *	Mark up the request as being an Access-Challenge, if
-		 *	required.
-		 *
-		 *	We don't do this for other packet types, because the
-		 *	ok/fail nature of the module return code will
-		 *	automatically result in it the parent request
-		 *	returning an ok/fail packet code.
+		 *	One packet is cheaper to verify with the
+		 *	precomputed key in decode().
 		 */
-		if ((u->code == FR_CODE_ACCESS_REQUEST) && (code == FR_CODE_ACCESS_CHALLENGE)) {
-			fr_pair_t	*vp;
+		if (num_verify > 1) {
+			fr_radius_verify_batch(verify, num_verify);
 
-			vp = fr_pair_find_by_da(&request->reply_pairs, attr_packet_type);
-			if (!vp) {
-				MEM(vp = fr_pair_afrom_da(request->reply, attr_packet_type));
-				vp->vp_uint32 = FR_CODE_ACCESS_CHALLENGE;
-				fr_pair_add(&request->reply_pairs, vp);
+			for (i = 0; i < num_verify; i++) {
+				if (verify[i].rcode < 0) continue;
+
+				verified[(verify[i].packet - h->buffer) / h->buflen] = verify[i].original;
 			}
 		}
 
-		/*
-		 *	Delete Proxy-State attributes from the reply.
-		 */
-		fr_pair_delete_by_da(&reply, attr_proxy_state);
+		for (i = 0; i < num; i++) {
+			uint8_t			*data = h->buffer + (i * h->buflen);
 
-		/*
-		 *	If the reply has Message-Authenticator, delete
-		 *	it from the proxy reply so that it isn't
-		 *	copied over to our reply.  But also create a
-		 *	reply.Message-Authenticator attribute, so that
-		 *	it ends up in our reply.
-		 */
-		if (fr_pair_find_by_da(&reply, attr_message_authenticator)) {
-			fr_pair_t *vp;
+			fr_trunk_request_t	*treq;
+			request_t		*request;
+			udp_request_t		*u;
+			udp_result_t		*r;
+			radius_track_entry_t	*rr;
+			decode_fail_t		reason;
+			uint8_t			code = 0;
+			fr_pair_list_t		reply;
+
+			fr_time_t		now;
 
-			fr_pair_delete_by_da(&reply, attr_message_authenticator);
+			fr_pair_list_init(&reply);
+
+			if (data_len[i] < RADIUS_HEADER_LENGTH) {
+				ERROR("%s - Packet too short, expected at least %zu bytes got %zu bytes",
+				      h->module_name, (size_t)RADIUS_HEADER_LENGTH, data_len[i]);
+				continue;
+			}
 
-			MEM(vp = fr_pair_afrom_da(request->reply, attr_message_authenticator));
-			(void) fr_pair_value_memdup(vp, (uint8_t const *) "", 1, false);
-			fr_pair_add(&request->reply_pairs, vp);
+			/*
+			 *	Note that we don't care about packet codes.  All
+			 *	packet codes share the same ID space.
+			 *
+			 *	Replies earlier in the batch may have completed
+			 *	requests, so we look the ID up again here.
+			 */
+			rr = radius_track_entry_find(h->tt, data[1], NULL);
+			if (!rr) {
+				WARN("%s - Ignoring reply with ID %i that arrived too late",
+				     h->module_name, data[1]);
+				continue;
+			}
+
+			treq = talloc_get_type_abort(rr->uctx, fr_trunk_request_t);
+			request = treq->request;
+			fr_assert(request != NULL);
+			u = talloc_get_type_abort(treq->preq, udp_request_t);
+			r = talloc_get_type_abort(treq->rctx, udp_result_t);
+
+			/*
+			 *	Validate and decode the incoming packet
+			 */
+			reason = decode(request->reply, &reply, &code, h, request, u, rr->vector,
+					verified[i], data, data_len[i]);
+			if (reason != DECODE_FAIL_NONE) {
+				RWDEBUG("Ignoring invalid response");
+				continue;
+			}
+
+			/*
+			 *	Only valid packets are processed
+			 *	Otherwise an attacker could perform
+			 *	a DoS attack against the proxying servers
+			 *	by sending fake responses for upstream
+			 *	servers.
+			 */
+			h->last_reply = now = fr_time();
+
+			/*
+			 *	Status-Server can have any reply code, we don't care
+			 *	what it is.  So long as it's signed properly, we
+			 *	accept it.  This flexibility is because we don't
+			 *	expose Status-Server to the admins.  It's only used by
+			 *	this module for internal signalling.
+			 */
+			if (u == h->status_u) {
+				fr_pair_list_free(&reply);	/* Probably want to pass this to status_check_reply? */
+				status_check_reply(treq, now, data);
+				fr_trunk_request_signal_complete(treq);
+				continue;
+			}
+
+			/*
+			 *	Handle any state changes, etc. needed by receiving a
+			 *	Protocol-Error reply packet.
+			 *
+			 *	Protocol-Error is permitted as a reply to any
+			 *	packet.
+			 */
+			switch (code) {
+			case FR_CODE_PROTOCOL_ERROR:
+				protocol_error_reply(u, r, h, data);
+				break;
+
+			default:
+				break;
+			}
+
+			/*
+			 *	Mark up the request as being an Access-Challenge, if
+			 *	required.
+			 *
+			 *	We don't do this for other packet types, because the
+			 *	ok/fail nature of the module return code will
+			 *	automatically result in it the parent request
+			 *	returning an ok/fail packet code.
+			 */
+			if ((u->code == FR_CODE_ACCESS_REQUEST) && (code == FR_CODE_ACCESS_CHALLENGE)) {
+				fr_pair_t	*vp;
+
+				vp = fr_pair_find_by_da(&request->reply_pairs, attr_packet_type);
+				if (!vp) {
+					MEM(vp = fr_pair_afrom_da(request->reply, attr_packet_type));
+					vp->vp_uint32 = FR_CODE_ACCESS_CHALLENGE;
+					fr_pair_add(&request->reply_pairs, vp);
+				}
+			}
+
+			/*
+			 *	Delete Proxy-State attributes from the reply.
+			 */
+			fr_pair_delete_by_da(&reply, attr_proxy_state);
+
+			/*
+			 *	If the reply has Message-Authenticator, delete
+			 *	it from the proxy reply so that it isn't
+			 *	copied over to our reply.  But also create a
+			 *	reply.Message-Authenticator attribute, so that
+			 *	it ends up in our reply.
+			 */
+			if (fr_pair_find_by_da(&reply, attr_message_authenticator)) {
+				fr_pair_t *vp;
+
+				fr_pair_delete_by_da(&reply, attr_message_authenticator);
+
+				MEM(vp = fr_pair_afrom_da(request->reply, attr_message_authenticator));
+				(void) fr_pair_value_memdup(vp, (uint8_t const *) "", 1, false);
+				fr_pair_add(&request->reply_pairs, vp);
+			}
+
+			treq->request->reply->code = code;
+			r->rcode = radius_code_to_rcode[code];
+			fr_pair_add(&request->reply_pairs, reply);
+			fr_trunk_request_signal_complete(treq);
 		}
 
-		treq->request->reply->code = code;
-		r->rcode = radius_code_to_rcode[code];
-		fr_pair_add(&request->reply_pairs, reply);
-		fr_trunk_request_signal_complete(treq);
+		if (drained) return;
 	}
 }
 
@@ -2874,6 +2995,16 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, <=, (1 << 30));
 	}
 
+	/*
+	 *	The secret is hashed with every packet, so do
+	 *	the parts which only depend on the secret once.
+	 */
+	inst->secret_key = fr_md5_key_alloc(inst, (uint8_t const *) inst->secret,
+					    talloc_array_length(inst->secret) - 1);
+	if (!inst->secret_key) {
+		ERROR("Failed precomputing MD5 states for secret");
+		return -1;
+	}
 
 	return 0;
 }
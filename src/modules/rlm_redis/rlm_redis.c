@@ -285,6 +285,9 @@ static xlat_action_t redis_node_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 @verbatim
 %{redis:<redis command>}
 @endverbatim
+ *
+ * Uses a pooled connection and blocks, as this is mostly called from
+ * conditions, and xlats evaluated there can't yet yield.
  *
  * @ingroup xlat_functions
  */
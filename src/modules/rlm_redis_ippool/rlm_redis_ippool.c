@@ -50,6 +50,9 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
+#include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/unlang/base.h>
 #include "redis_ippool.h"
 
 #include <freeradius-devel/dhcpv4/dhcpv4.h>
@@ -98,10 +101,45 @@ typedef struct {
 						//!< allocated_address_attr if updates are successful.
 
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
+
+	fr_trunk_conf_t		trunk_conf;	//!< Configuration for the per-thread trunks.
 } rlm_redis_ippool_t;
 
+/** rlm_redis_ippool thread instance
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster_thread;	//!< Trunks to each cluster node.
+} rlm_redis_ippool_thread_t;
+
+/** State for a pool operation, whilst we wait for the script to run
+ *
+ */
+typedef struct {
+	ippool_action_t		action;		//!< What we're doing to the lease.
+
+	uint8_t			*key_prefix;	//!< Pool name, used to find the cluster node.
+	size_t			key_prefix_len;	//!< Length of the pool name.
+
+	char const		*digest;	//!< SHA1 of the script.
+	char const		*script;	//!< Script to load if the node hasn't cached it.
+	char			*evalsha;	//!< RESP encoded EVALSHA command.
+	size_t			evalsha_len;	//!< Length of the EVALSHA command.
+	bool			loaded;		//!< We've asked the node to load the script.
+
+	char			*ip_str;	//!< Address being updated or released.
+	uint32_t		expires;	//!< Lease time for allocations and updates.
+
+	fr_redis_command_set_t	*cmds;		//!< Commands, whilst they're outstanding.
+	redisReply		*replies[5];	//!< Must be equal to the maximum number of pipelined commands.
+	size_t			reply_cnt;	//!< How many replies we received.
+} ippool_rctx_t;
+
 static CONF_PARSER redis_config[] = {
 	REDIS_COMMON_CONFIG,
+
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_redis_ippool_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -453,212 +491,226 @@ static void ippool_action_print(request_t *request, ippool_action_t action,
 	talloc_free(gateway_str);
 }
 
-/** Execute a script against Redis cluster
+/** Free any replies we've received
  *
- * Handles uploading the script to the server if required.
+ */
+static void ippool_replies_free(ippool_rctx_t *rctx)
+{
+	fr_redis_pipeline_free(rctx->replies, rctx->reply_cnt);
+	rctx->reply_cnt = 0;
+}
+
+static int _ippool_rctx_free(ippool_rctx_t *rctx)
+{
+	/*
+	 *	Request was cancelled whilst the
+	 *	commands were outstanding.
+	 */
+	if (rctx->cmds) fr_redis_command_set_cancel(rctx->cmds);
+	ippool_replies_free(rctx);
+
+	return 0;
+}
+
+/** Format the EVALSHA command for a script
  *
- * @note All replies will be freed on error.
+ * The command is kept in the rctx, so we can send it again if the
+ * node needs to load the script first.
  *
- * @param[out] out		Where to write Redis reply object resulting from the command.
- * @param[in] request		The current request.
- * @param[in] cluster		configuration.
- * @param[in] key		to use to determine the cluster node.
- * @param[in] key_len		length of the key.
- * @param[in] wait_num		If > 0 wait until this many slaves have replicated the data
- *				from the last command.
- * @param[in] wait_timeout	How long to wait for slaves.
- * @param[in] digest		of script.
- * @param[in] script		to upload.
- * @param[in] cmd		EVALSHA command to execute.
- * @param[in] ...		Arguments for the eval command.
- * @return status of the command.
+ * @param[in] rctx	to write the command to.
+ * @param[in] digest	of script.
+ * @param[in] script	to upload, if the node hasn't cached it.
+ * @param[in] fmt	EVALSHA command to execute.
+ * @param[in] ...	Arguments for the eval command.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static fr_redis_rcode_t ippool_script(redisReply **out, request_t *request, fr_redis_cluster_t *cluster,
-				      uint8_t const *key, size_t key_len,
-				      uint32_t wait_num, fr_time_delta_t wait_timeout,
-				      char const digest[], char const *script,
-				      char const *cmd, ...)
+static int ippool_script_format(ippool_rctx_t *rctx, char const digest[], char const *script, char const *fmt, ...)
 {
-	fr_redis_conn_t			*conn;
-	redisReply			*replies[5];	/* Must be equal to the maximum number of pipelined commands */
-	size_t				reply_cnt = 0, i;
+	va_list	ap;
+	char	*cmd = NULL;
+	int	len;
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		s_ret, status;
-	unsigned int			pipelined = 0;
-
-	va_list				ap;
+	va_start(ap, fmt);
+	len = redisvFormatCommand(&cmd, fmt, ap);
+	va_end(ap);
+	if (len < 0) return -1;
 
-	*out = NULL;
+	MEM(rctx->evalsha = talloc_memdup(rctx, cmd, (size_t)len));
+	rctx->evalsha_len = (size_t)len;
+	free(cmd);	/* Allocated by hiredis */
 
-#ifndef NDEBUG
-	memset(replies, 0, sizeof(replies));
-#endif
-
-	va_start(ap, cmd);
-
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &replies[0])) {
-	     	va_list	copy;
-
-	     	RDEBUG3("Calling script 0x%s", digest);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
-		pipelined = 1;
-		if (wait_num) {
-			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, fr_time_delta_to_msec(wait_timeout));
-			pipelined++;
-		}
-		reply_cnt = fr_redis_pipeline_result(&pipelined, &status,
-						     replies, NUM_ELEMENTS(replies),
-						     conn);
-		if (status != REDIS_RCODE_NO_SCRIPT) continue;
+	rctx->digest = digest;
+	rctx->script = script;
 
-		/*
-		 *	Clear out the existing reply
-		 */
-		fr_redis_pipeline_free(replies, reply_cnt);
+	return 0;
+}
 
-		/*
-		 *	Last command failed with NOSCRIPT, this means
-		 *	we have to send the Lua script up to the node
-		 *	so it can be cached.
-		 */
-	     	RDEBUG3("Loading script 0x%s", digest);
-		redisAppendCommand(conn->handle, "MULTI");
-		redisAppendCommand(conn->handle, "SCRIPT LOAD %s", script);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
-		redisAppendCommand(conn->handle, "EXEC");
-		pipelined = 4;
-		if (wait_num) {
-			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, wait_timeout);
-			pipelined++;
-		}
+static void _ippool_script_complete(request_t *request, fr_dlist_head_t *completed, void *uctx)
+{
+	ippool_rctx_t		*rctx = talloc_get_type_abort(uctx, ippool_rctx_t);
+	fr_redis_command_t	*cmd;
 
-		reply_cnt = fr_redis_pipeline_result(&pipelined, &status,
-						     replies, NUM_ELEMENTS(replies),
-						     conn);
-		if (status == REDIS_RCODE_SUCCESS) {
-			if (RDEBUG_ENABLED3) for (i = 0; i < reply_cnt; i++) {
-				fr_redis_reply_print(L_DBG_LVL_3, replies[i], request, i);
-			}
+	rctx->cmds = NULL;	/* Freed by the trunk */
 
-			if (replies[3]->type != REDIS_REPLY_ARRAY) {
-				REDEBUG("Bad response to EXEC, expected array got %s",
-					fr_table_str_by_value(redis_reply_types, replies[3]->type, "<UNKNOWN>"));
-			error:
-				fr_redis_pipeline_free(replies, reply_cnt);
-				status = REDIS_RCODE_ERROR;
-				goto finish;
-			}
-			if (replies[3]->elements != 2) {
-				REDEBUG("Bad response to EXEC, expected 2 result elements, got %zu",
-					replies[3]->elements);
-				goto error;
-			}
-			if (replies[3]->element[0]->type != REDIS_REPLY_STRING) {
-				REDEBUG("Bad response to SCRIPT LOAD, expected string got %s",
-					fr_table_str_by_value(redis_reply_types, replies[3]->element[0]->type, "<UNKNOWN>"));
-				goto error;
-			}
-			if (strcmp(replies[3]->element[0]->str, digest) != 0) {
-				RWDEBUG("Incorrect SHA1 from SCRIPT LOAD, expected %s, got %s",
-					digest, replies[3]->element[0]->str);
-				goto error;
-			}
-		}
+	for (cmd = fr_dlist_head(completed);
+	     cmd && (rctx->reply_cnt < NUM_ELEMENTS(rctx->replies));
+	     cmd = fr_dlist_next(completed, cmd)) {
+		rctx->replies[rctx->reply_cnt++] = fr_redis_command_steal_result(cmd);
 	}
-	if (s_ret != REDIS_RCODE_SUCCESS) goto error;
 
-	switch (reply_cnt) {
-	case 2:	/* EVALSHA with wait */
-		if (ippool_wait_check(request, wait_num, replies[1]) < 0) goto error;
-		fr_redis_reply_free(&replies[1]);	/* Free the wait response */
-		break;
+	unlang_interpret_mark_resumable(request);
+}
 
-	case 1:	/* EVALSHA */
-		*out = replies[0];
-		break;
+static void _ippool_script_fail(request_t *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	ippool_rctx_t		*rctx = talloc_get_type_abort(uctx, ippool_rctx_t);
 
-	case 5: /* LOADSCRIPT + EVALSHA + WAIT */
-		if (ippool_wait_check(request, wait_num, replies[4]) < 0) goto error;
-		fr_redis_reply_free(&replies[4]);	/* Free the wait response */
-		FALL_THROUGH;
-
-	case 4: /* LOADSCRIPT + EVALSHA */
-		fr_redis_reply_free(&replies[2]);	/* Free the queued cmd response*/
-		fr_redis_reply_free(&replies[1]);	/* Free the queued script load response */
-		fr_redis_reply_free(&replies[0]);	/* Free the queued multi response */
-		*out = replies[3]->element[1];
-		replies[3]->element[1] = NULL;		/* Prevent double free */
-		fr_redis_reply_free(&replies[3]);	/* This works because hiredis checks for NULL elements */
-		break;
+	rctx->cmds = NULL;	/* Freed by the trunk */
 
-	case 0:
-		break;
+	REDEBUG("Failed executing script");
+	unlang_interpret_mark_resumable(request);
+}
+
+/** Send a script to the node serving the pool
+ *
+ * @param[in] inst	This instance of the rlm_redis_ippool module.
+ * @param[in] t		Thread specific data.
+ * @param[in] request	The current request.
+ * @param[in] rctx	Containing the EVALSHA command.  If rctx->loaded is true
+ *			the script is loaded in the same transaction.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int ippool_script_enqueue(rlm_redis_ippool_t const *inst, rlm_redis_ippool_thread_t *t,
+				 request_t *request, ippool_rctx_t *rctx)
+{
+	fr_redis_command_set_t *cmds;
+
+	/*
+	 *	Set before enqueueing, so the complete and fail
+	 *	functions, and the rctx destructor, always see
+	 *	the command set we're waiting on.
+	 */
+	cmds = fr_redis_command_set_alloc(NULL, request, _ippool_script_complete, _ippool_script_fail, rctx);
+	rctx->cmds = cmds;
+
+	if (!rctx->loaded) {
+		RDEBUG3("Calling script 0x%s", rctx->digest);
+
+		if (fr_redis_command_preformatted_add(cmds, rctx->evalsha, rctx->evalsha_len) != FR_REDIS_PIPELINE_OK) {
+		error:
+			TALLOC_FREE(rctx->cmds);
+			return -1;
+		}
+	} else {
+		RDEBUG3("Loading script 0x%s", rctx->digest);
+
+		if ((fr_redis_command_printf_add(cmds, "MULTI") != FR_REDIS_PIPELINE_OK) ||
+		    (fr_redis_command_printf_add(cmds, "SCRIPT LOAD %s", rctx->script) != FR_REDIS_PIPELINE_OK) ||
+		    (fr_redis_command_preformatted_add(cmds, rctx->evalsha, rctx->evalsha_len) != FR_REDIS_PIPELINE_OK) ||
+		    (fr_redis_command_printf_add(cmds, "EXEC") != FR_REDIS_PIPELINE_OK)) goto error;
 	}
 
-finish:
-	va_end(ap);
-	return s_ret;
+	if (inst->wait_num &&
+	    (fr_redis_command_printf_add(cmds, "WAIT %i %i", inst->wait_num,
+	    				 (int)fr_time_delta_to_msec(inst->wait_timeout)) != FR_REDIS_PIPELINE_OK)) goto error;
+
+	if (fr_redis_command_set_enqueue(t->cluster_thread, cmds,
+					 rctx->key_prefix, rctx->key_prefix_len) != FR_REDIS_PIPELINE_OK) {
+		REDEBUG("Failed enqueueing script");
+		goto error;
+	}
+
+	return 0;
 }
 
-/** Allocate a new IP address from a pool
+/** Find the reply to the EVALSHA command, checking the replies to any other commands
  *
+ * @param[out] out	Where to write the reply to the EVALSHA command.
+ * @param[in] inst	This instance of the rlm_redis_ippool module.
+ * @param[in] request	The current request.
+ * @param[in] rctx	Containing the replies.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, request_t *request,
-					    uint8_t const *key_prefix, size_t key_prefix_len,
-					    uint8_t const *owner, size_t owner_len,
-					    uint8_t const *gateway_id, size_t gateway_id_len,
-					    uint32_t expires)
+static int ippool_script_reply(redisReply **out, rlm_redis_ippool_t const *inst, request_t *request,
+			       ippool_rctx_t *rctx)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
+	redisReply	**replies = rctx->replies;
+	size_t		expected = (rctx->loaded ? 4 : 1) + (inst->wait_num ? 1 : 0);
+	size_t		i;
 
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+	*out = NULL;
 
-	fr_assert(key_prefix);
-	fr_assert(owner);
+	if (rctx->reply_cnt != expected) {
+		REDEBUG("Expected %zu replies, got %zu", expected, rctx->reply_cnt);
+		return -1;
+	}
 
-	now = fr_time_to_timeval(fr_time());
+	for (i = 0; i < rctx->reply_cnt; i++) {
+		if (!replies[i]) {
+			REDEBUG("Missing reply to command %zu", i);
+			return -1;
+		}
+		if (RDEBUG_ENABLED3) fr_redis_reply_print(L_DBG_LVL_3, replies[i], request, i);
+	}
 
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!gateway_id) gateway_id = (uint8_t const *)"";
+	if (inst->wait_num && (ippool_wait_check(request, inst->wait_num, replies[expected - 1]) < 0)) return -1;
+
+	if (!rctx->loaded) {
+		*out = replies[0];
+		return 0;
+	}
+
+	/* MULTI + SCRIPT LOAD + EVALSHA + EXEC */
+	if (replies[3]->type != REDIS_REPLY_ARRAY) {
+		REDEBUG("Bad response to EXEC, expected array got %s",
+			fr_table_str_by_value(redis_reply_types, replies[3]->type, "<UNKNOWN>"));
+		return -1;
+	}
+	if (replies[3]->elements != 2) {
+		REDEBUG("Bad response to EXEC, expected 2 result elements, got %zu",
+			replies[3]->elements);
+		return -1;
+	}
+	if (replies[3]->element[0]->type != REDIS_REPLY_STRING) {
+		REDEBUG("Bad response to SCRIPT LOAD, expected string got %s",
+			fr_table_str_by_value(redis_reply_types, replies[3]->element[0]->type, "<UNKNOWN>"));
+		return -1;
+	}
+	if (strcmp(replies[3]->element[0]->str, rctx->digest) != 0) {
+		RWDEBUG("Incorrect SHA1 from SCRIPT LOAD, expected %s, got %s",
+			rctx->digest, replies[3]->element[0]->str);
+		return -1;
+	}
+	*out = replies[3]->element[1];
 
-	status = ippool_script(&reply, request, inst->cluster,
-			       key_prefix, key_prefix_len,
-			       inst->wait_num, inst->wait_timeout,
-			       lua_alloc_digest, lua_alloc_cmd,
-	 		       "EVALSHA %s 1 %b %u %u %b %b",
-	 		       lua_alloc_digest,
-			       key_prefix, key_prefix_len,
-			       (unsigned int)now.tv_sec, expires,
-			       owner, owner_len,
-			       gateway_id, gateway_id_len);
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+	return 0;
+}
+
+/** Process the return code the scripts place in the first element of their result
+ *
+ */
+static ippool_rcode_t ippool_script_rcode(request_t *request, redisReply *reply)
+{
+	if (reply->type == REDIS_REPLY_ERROR) {
+		REDEBUG("Script failed: %.*s", (int)reply->len, reply->str);
+		return IPPOOL_RCODE_FAIL;
 	}
 
-	fr_assert(reply);
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	if (reply->elements == 0) {
 		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	/*
@@ -667,11 +719,21 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
 		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
-	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
+
+	return reply->element[0]->integer;
+}
+
+/** Process the result of allocating a new IP address from a pool
+ *
+ */
+static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, request_t *request, redisReply *reply)
+{
+	ippool_rcode_t		ret;
+
+	ret = ippool_script_rcode(request, reply);
+	if (ret < 0) return ret;
 
 	/*
 	 *	Process IP address
@@ -702,8 +764,7 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 				if (fr_value_box_cast(NULL, tmpl_value(ip_map.rhs), FR_TYPE_IPV4_ADDR,
 						      NULL, &tmp)) {
 					RPEDEBUG("Failed converting integer to IPv4 address");
-					ret = IPPOOL_RCODE_FAIL;
-					goto finish;
+					return IPPOOL_RCODE_FAIL;
 				}
 			} else {
 				fr_value_box_shallow(&ip_map.rhs->data.literal,
@@ -716,17 +777,13 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 			fr_value_box_bstrndup_shallow(&ip_map.rhs->data.literal,
 						      NULL, reply->element[1]->str, reply->element[1]->len, false);
 		do_ip_map:
-			if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
-			}
+			if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
 			break;
 
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for IP element (result[1])",
 				fr_table_str_by_value(redis_reply_types, reply->element[1]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
@@ -750,10 +807,7 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 			tmpl_init_shallow(&range_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0);
 			fr_value_box_bstrndup_shallow(&range_map.rhs->data.literal,
 						      NULL, reply->element[2]->str, reply->element[2]->len, true);
-			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
-			}
+			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
 		}
 			break;
 
@@ -763,8 +817,7 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for range element (result[2])",
 				fr_table_str_by_value(redis_reply_types, reply->element[2]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
@@ -783,107 +836,31 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 		if (reply->element[3]->type != REDIS_REPLY_INTEGER) {
 			REDEBUG("Server returned unexpected type \"%s\" for expiry element (result[3])",
 				fr_table_str_by_value(redis_reply_types, reply->element[3]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 
 		fr_value_box_shallow(&expiry_map.rhs->data.literal, (uint32_t)reply->element[3]->integer, true);
-		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) {
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
-		}
+		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
 	}
-finish:
-	fr_redis_reply_free(&reply);
+
 	return ret;
 }
 
-/** Update an existing IP address in a pool
+/** Process the result of updating an existing IP address in a pool
  *
  */
-static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, request_t *request,
-					  uint8_t const *key_prefix, size_t key_prefix_len,
-					  fr_ipaddr_t *ip,
-					  uint8_t const *owner, size_t owner_len,
-					  uint8_t const *gateway_id, size_t gateway_id_len,
+static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, request_t *request, redisReply *reply,
 					  uint32_t expires)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+	ippool_rcode_t	ret;
 
 	tmpl_t		range_rhs;
 	map_t		range_map = { .lhs = inst->range_attr, .op = T_OP_SET, .rhs = &range_rhs };
 
 	tmpl_init_shallow(&range_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0);
 
-	now = fr_time_to_timeval(fr_time());
-
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!owner) owner = (uint8_t const *)"";
-	if (!gateway_id) gateway_id = (uint8_t const *)"";
-
-	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %u %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       htonl(ip->addr.v4.s_addr),
-				       owner, owner_len,
-				       gateway_id, gateway_id_len);
-	} else {
-		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %s %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       ip_buff,
-				       owner, owner_len,
-				       gateway_id, gateway_id_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	if (reply->type != REDIS_REPLY_ARRAY) {
-		REDEBUG("Expected result to be array got \"%s\"",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	if (reply->elements == 0) {
-		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	/*
-	 *	Process return code
-	 */
-	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
-		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
+	ret = ippool_script_rcode(request, reply);
+	if (ret < 0) return ret;
 
 	/*
 	 *	Process Range identifier
@@ -896,10 +873,7 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 		case REDIS_REPLY_STRING:
 			fr_value_box_bstrndup_shallow(&range_map.rhs->data.literal, NULL,
 						      reply->element[1]->str, reply->element[1]->len, true);
-			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
-			}
+			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
 			break;
 
 		case REDIS_REPLY_NIL:
@@ -908,8 +882,7 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for range element (result[1])",
 				fr_table_str_by_value(redis_reply_types, reply->element[0]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
@@ -928,97 +901,8 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 		tmpl_init_shallow(&expiry_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0);
 
 		fr_value_box_shallow(&expiry_map.rhs->data.literal, expires, false);
-		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) {
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
-		}
-	}
-
-finish:
-	fr_redis_reply_free(&reply);
-
-	return ret;
-}
-
-/** Release an existing IP address in a pool
- *
- */
-static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, request_t *request,
-					   uint8_t const *key_prefix, size_t key_prefix_len,
-					   fr_ipaddr_t *ip,
-					   uint8_t const *owner, size_t owner_len)
-{
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
-
-	now = fr_time_to_timeval(fr_time());
-
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!owner) owner = (uint8_t const *)"";
-
-	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %u %b",
-				       lua_release_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec,
-				       htonl(ip->addr.v4.s_addr),
-				       owner, owner_len);
-	} else {
-		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %s %b",
-				       lua_release_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec,
-				       ip_buff,
-				       owner, owner_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	if (reply->type != REDIS_REPLY_ARRAY) {
-		REDEBUG("Expected result to be array got \"%s\"",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	if (reply->elements == 0) {
-		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	/*
-	 *	Process return code
-	 */
-	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
-		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
 	}
-	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
-
-finish:
-	fr_redis_reply_free(&reply);
 
 	return ret;
 }
@@ -1062,8 +946,167 @@ static inline ssize_t ippool_pool_name(uint8_t const **out, uint8_t buff[], size
 	return slen;
 }
 
-static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t const *inst, request_t *request, ippool_action_t action)
+static void mod_action_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+			      void *rctx, fr_state_signal_t action)
 {
+	ippool_rctx_t *our_rctx = talloc_get_type_abort(rctx, ippool_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(our_rctx);
+}
+
+/** Process the result of the script, and map it to a module rcode
+ *
+ */
+static unlang_action_t mod_action_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					 request_t *request, void *rctx)
+{
+	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+	ippool_rctx_t			*our_rctx = talloc_get_type_abort(rctx, ippool_rctx_t);
+	redisReply			*reply;
+	ippool_rcode_t			ret = IPPOOL_RCODE_FAIL;
+	rlm_rcode_t			rcode = RLM_MODULE_FAIL;
+	char const			*ip_str = our_rctx->ip_str;
+
+	if (our_rctx->reply_cnt == 0) goto finish;
+
+	/*
+	 *	EVALSHA failed with NOSCRIPT, this means
+	 *	we have to send the Lua script up to the node
+	 *	so it can be cached.
+	 */
+	if (!our_rctx->loaded && our_rctx->replies[0] &&
+	    (our_rctx->replies[0]->type == REDIS_REPLY_ERROR) &&
+	    (strncmp(our_rctx->replies[0]->str, REDIS_ERROR_NO_SCRIPT_STR,
+	    	     sizeof(REDIS_ERROR_NO_SCRIPT_STR) - 1) == 0)) {
+		ippool_replies_free(our_rctx);
+		our_rctx->loaded = true;
+
+		if (ippool_script_enqueue(inst, t, request, our_rctx) < 0) goto finish;
+
+		return unlang_module_yield(request, mod_action_resume, mod_action_signal, our_rctx);
+	}
+
+	if (ippool_script_reply(&reply, inst, request, our_rctx) < 0) goto finish;
+
+	switch (our_rctx->action) {
+	case POOL_ACTION_ALLOCATE:
+		switch (redis_ippool_allocate(inst, request, reply)) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("IP address lease allocated");
+			rcode = RLM_MODULE_UPDATED;
+			break;
+
+		case IPPOOL_RCODE_POOL_EMPTY:
+			RWDEBUG("Pool contains no free addresses");
+			rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		default:
+			break;
+		}
+		break;
+
+	case POOL_ACTION_UPDATE:
+		ret = redis_ippool_update(inst, request, reply, our_rctx->expires);
+		switch (ret) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
+
+			/*
+			 *	Copy over the input IP address to the reply attribute
+			 */
+			if (inst->copy_on_update) {
+				tmpl_t ip_rhs = {
+					.name = "",
+					.type = TMPL_TYPE_DATA,
+					.quote = T_BARE_WORD,
+				};
+				map_t ip_map = {
+					.lhs = inst->allocated_address_attr,
+					.op = T_OP_SET,
+					.rhs = &ip_rhs
+				};
+
+				fr_value_box_strdup_shallow(&ip_rhs.data.literal, NULL, ip_str, false);
+
+				if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) break;
+			}
+			rcode = RLM_MODULE_UPDATED;
+			break;
+
+		/*
+		 *	It's useful to be able to identify the 'not found' case
+		 *	as we can relay to a server where the IP address might
+		 *	be found.  This extremely useful for migrations.
+		 */
+		case IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
+			rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		case IPPOOL_RCODE_EXPIRED:
+			REDEBUG("Requested IP address' \"%s\" lease already expired at time of renewal", ip_str);
+			rcode = RLM_MODULE_INVALID;
+			break;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
+			rcode = RLM_MODULE_INVALID;
+			break;
+
+		default:
+			break;
+		}
+		break;
+
+	case POOL_ACTION_RELEASE:
+		switch (ippool_script_rcode(request, reply)) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("IP address \"%s\" released", ip_str);
+			rcode = RLM_MODULE_UPDATED;
+			break;
+
+		/*
+		 *	It's useful to be able to identify the 'not found' case
+		 *	as we can relay to a server where the IP address might
+		 *	be found.  This extremely useful for migrations.
+		 */
+		case IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
+			rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
+			rcode = RLM_MODULE_INVALID;
+			break;
+
+		default:
+			break;
+		}
+		break;
+
+	default:
+		fr_assert(0);
+		break;
+	}
+
+finish:
+	talloc_free(our_rctx);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static unlang_action_t mod_action(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				  ippool_action_t action)
+{
+	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+	ippool_rctx_t			*rctx;
+
 	uint8_t		key_prefix_buff[IPPOOL_MAX_KEY_PREFIX_SIZE], owner_buff[256], gateway_id_buff[256];
 	uint8_t const	*key_prefix, *owner = NULL, *gateway_id = NULL;
 	size_t		key_prefix_len, owner_len = 0, gateway_id_len = 0;
@@ -1073,8 +1116,25 @@ static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t cons
 	char const	*expires_str;
 	unsigned long	expires = 0;
 	char		*q;
+	struct timeval	now;
+	int		ret = -1;
+
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+	case POOL_ACTION_UPDATE:
+	case POOL_ACTION_RELEASE:
+		break;
 
-	slen = ippool_pool_name(&key_prefix, (uint8_t *)&key_prefix_buff, sizeof(key_prefix_len), inst, request);
+	case POOL_ACTION_BULK_RELEASE:
+		RDEBUG2("Bulk release not yet implemented");
+		RETURN_MODULE_NOOP;
+
+	default:
+		fr_assert(0);
+		RETURN_MODULE_FAIL;
+	}
+
+	slen = ippool_pool_name(&key_prefix, (uint8_t *)&key_prefix_buff, sizeof(key_prefix_buff), inst, request);
 	if (slen < 0) RETURN_MODULE_FAIL;
 	if (slen == 0) RETURN_MODULE_NOOP;
 
@@ -1102,36 +1162,45 @@ static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t cons
 		gateway_id_len = (size_t)slen;
 	}
 
+	/*
+	 *	hiredis doesn't deal well with NULL string pointers
+	 */
+	if (!owner) owner = (uint8_t const *)"";
+	if (!gateway_id) gateway_id = (uint8_t const *)"";
+
+	MEM(rctx = talloc_zero(request, ippool_rctx_t));
+	talloc_set_destructor(rctx, _ippool_rctx_free);
+	rctx->action = action;
+	MEM(rctx->key_prefix = talloc_memdup(rctx, key_prefix, key_prefix_len));
+	rctx->key_prefix_len = key_prefix_len;
+
+	now = fr_time_to_timeval(fr_time());
+
 	switch (action) {
 	case POOL_ACTION_ALLOCATE:
 		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
 				request, inst->offer_time, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding offer_time (%s)", inst->offer_time->name);
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
 
 		expires = strtoul(expires_str, &q, 10);
 		if (q != (expires_str + strlen(expires_str))) {
 			REDEBUG("Invalid offer_time.  Must be an integer value");
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
+		rctx->expires = (uint32_t)expires;
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len, NULL,
 				    owner, owner_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
-					      owner, owner_len,
-					      gateway_id, gateway_id_len, (uint32_t)expires)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("IP address lease allocated");
-			RETURN_MODULE_UPDATED;
-
-		case IPPOOL_RCODE_POOL_EMPTY:
-			RWDEBUG("Pool contains no free addresses");
-			RETURN_MODULE_NOTFOUND;
-
-		default:
-			RETURN_MODULE_FAIL;
-		}
+		ret = ippool_script_format(rctx, lua_alloc_digest, lua_alloc_cmd,
+					   "EVALSHA %s 1 %b %u %u %b %b",
+					   lua_alloc_digest,
+					   key_prefix, key_prefix_len,
+					   (unsigned int)now.tv_sec, rctx->expires,
+					   owner, owner_len,
+					   gateway_id, gateway_id_len);
+		break;
 
 	case POOL_ACTION_UPDATE:
 	{
@@ -1141,75 +1210,54 @@ static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t cons
 		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
 				request, inst->lease_time, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding lease_time (%s)", inst->lease_time->name);
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
 
 		expires = strtoul(expires_str, &q, 10);
 		if (q != (expires_str + strlen(expires_str))) {
 			REDEBUG("Invalid expires.  Must be an integer value");
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
+		rctx->expires = (uint32_t)expires;
 
 		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
 
 		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
 			RPEDEBUG("Failed parsing address");
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
+		MEM(rctx->ip_str = talloc_typed_strdup(rctx, ip_str));
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, owner, owner_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_update(inst, request, key_prefix, key_prefix_len,
-					    &ip, owner, owner_len,
-					    gateway_id, gateway_id_len, (uint32_t)expires)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
-
-			/*
-			 *	Copy over the input IP address to the reply attribute
-			 */
-			if (inst->copy_on_update) {
-				tmpl_t ip_rhs = {
-					.name = "",
-					.type = TMPL_TYPE_DATA,
-					.quote = T_BARE_WORD,
-				};
-				map_t ip_map = {
-					.lhs = inst->allocated_address_attr,
-					.op = T_OP_SET,
-					.rhs = &ip_rhs
-				};
-
-				fr_value_box_strdup_shallow(&ip_rhs.data.literal, NULL, ip_str, false);
-
-				if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) RETURN_MODULE_FAIL;
-			}
-			RETURN_MODULE_UPDATED;
-
-		/*
-		 *	It's useful to be able to identify the 'not found' case
-		 *	as we can relay to a server where the IP address might
-		 *	be found.  This extremely useful for migrations.
-		 */
-		case IPPOOL_RCODE_NOT_FOUND:
-			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
-			RETURN_MODULE_NOTFOUND;
-
-		case IPPOOL_RCODE_EXPIRED:
-			REDEBUG("Requested IP address' \"%s\" lease already expired at time of renewal", ip_str);
-			RETURN_MODULE_INVALID;
-
-		case IPPOOL_RCODE_DEVICE_MISMATCH:
-			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
-			RETURN_MODULE_INVALID;
 
-		default:
-			RETURN_MODULE_FAIL;
+		if ((ip.af == AF_INET) && inst->ipv4_integer) {
+			ret = ippool_script_format(rctx, lua_update_digest, lua_update_cmd,
+						   "EVALSHA %s 1 %b %u %u %u %b %b",
+						   lua_update_digest,
+						   key_prefix, key_prefix_len,
+						   (unsigned int)now.tv_sec, rctx->expires,
+						   htonl(ip.addr.v4.s_addr),
+						   owner, owner_len,
+						   gateway_id, gateway_id_len);
+		} else {
+			char ip_prefix_buff[FR_IPADDR_PREFIX_STRLEN];
+
+			IPPOOL_SPRINT_IP(ip_prefix_buff, &ip, ip.prefix);
+			ret = ippool_script_format(rctx, lua_update_digest, lua_update_cmd,
+						   "EVALSHA %s 1 %b %u %u %s %b %b",
+						   lua_update_digest,
+						   key_prefix, key_prefix_len,
+						   (unsigned int)now.tv_sec, rctx->expires,
+						   ip_prefix_buff,
+						   owner, owner_len,
+						   gateway_id, gateway_id_len);
 		}
 	}
+		break;
 
 	case POOL_ACTION_RELEASE:
 	{
@@ -1218,60 +1266,63 @@ static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t cons
 
 		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
 
 		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
 			RPEDEBUG("Failed parsing address");
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
+		MEM(rctx->ip_str = talloc_typed_strdup(rctx, ip_str));
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, owner, owner_len, gateway_id, gateway_id_len, 0);
-		switch (redis_ippool_release(inst, request, key_prefix, key_prefix_len,
-					     &ip, owner, owner_len)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("IP address \"%s\" released", ip_str);
-			RETURN_MODULE_UPDATED;
 
-		/*
-		 *	It's useful to be able to identify the 'not found' case
-		 *	as we can relay to a server where the IP address might
-		 *	be found.  This extremely useful for migrations.
-		 */
-		case IPPOOL_RCODE_NOT_FOUND:
-			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
-			RETURN_MODULE_NOTFOUND;
-
-		case IPPOOL_RCODE_DEVICE_MISMATCH:
-			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
-			RETURN_MODULE_INVALID;
-
-		default:
-			RETURN_MODULE_FAIL;
+		if ((ip.af == AF_INET) && inst->ipv4_integer) {
+			ret = ippool_script_format(rctx, lua_release_digest, lua_release_cmd,
+						   "EVALSHA %s 1 %b %u %u %b",
+						   lua_release_digest,
+						   key_prefix, key_prefix_len,
+						   (unsigned int)now.tv_sec,
+						   htonl(ip.addr.v4.s_addr),
+						   owner, owner_len);
+		} else {
+			char ip_prefix_buff[FR_IPADDR_PREFIX_STRLEN];
+
+			IPPOOL_SPRINT_IP(ip_prefix_buff, &ip, ip.prefix);
+			ret = ippool_script_format(rctx, lua_release_digest, lua_release_cmd,
+						   "EVALSHA %s 1 %b %u %s %b",
+						   lua_release_digest,
+						   key_prefix, key_prefix_len,
+						   (unsigned int)now.tv_sec,
+						   ip_prefix_buff,
+						   owner, owner_len);
 		}
 	}
-
-	case POOL_ACTION_BULK_RELEASE:
-		RDEBUG2("Bulk release not yet implemented");
-		RETURN_MODULE_NOOP;
+		break;
 
 	default:
-		fr_assert(0);
+		break;
+	}
+
+	if ((ret < 0) || (ippool_script_enqueue(inst, t, request, rctx) < 0)) {
+	error:
+		talloc_free(rctx);
 		RETURN_MODULE_FAIL;
 	}
+
+	return unlang_module_yield(request, mod_action_resume, mod_action_signal, rctx);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
 	 *	IP-Pool.Action override
 	 */
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action);
-	if (vp) return mod_action(p_result, inst, request, vp->vp_uint32);
+	if (vp) return mod_action(p_result, mctx, request, vp->vp_uint32);
 
 	/*
 	 *	Otherwise, guess the action by Acct-Status-Type
@@ -1284,14 +1335,14 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 
 	if ((vp->vp_uint32 == enum_acct_status_type_start->vb_uint32) ||
 	    (vp->vp_uint32 == enum_acct_status_type_interim_update->vb_uint32)) {
-		return mod_action(p_result, inst, request, POOL_ACTION_UPDATE);
+		return mod_action(p_result, mctx, request, POOL_ACTION_UPDATE);
 
 	} else if (vp->vp_uint32 == enum_acct_status_type_stop->vb_uint32) {
-		return mod_action(p_result, inst, request, POOL_ACTION_RELEASE);
+		return mod_action(p_result, mctx, request, POOL_ACTION_RELEASE);
 
 	} else if ((vp->vp_uint32 == enum_acct_status_type_on->vb_uint32) ||
 		   (vp->vp_uint32 == enum_acct_status_type_off->vb_uint32)) {
-		return mod_action(p_result, inst, request, POOL_ACTION_BULK_RELEASE);
+		return mod_action(p_result, mctx, request, POOL_ACTION_BULK_RELEASE);
 
 	}
 
@@ -1300,7 +1351,6 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 
 static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1308,12 +1358,11 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	 *	when called in Post-Auth.
 	 */
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
+	return mod_action(p_result, mctx, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 	ippool_action_t			action = POOL_ACTION_ALLOCATE;
 
@@ -1339,12 +1388,11 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 	}
 
 run:
-	return mod_action(p_result, inst, request, action);
+	return mod_action(p_result, mctx, request, action);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_request(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1353,12 +1401,11 @@ static unlang_action_t CC_HINT(nonnull) mod_request(rlm_rcode_t *p_result, modul
 	 */
 
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_UPDATE);
+	return mod_action(p_result, mctx, request, vp ? vp->vp_uint32 : POOL_ACTION_UPDATE);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1367,7 +1414,7 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
 	 */
 
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_RELEASE);
+	return mod_action(p_result, mctx, request, vp ? vp->vp_uint32 : POOL_ACTION_RELEASE);
 }
 
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
@@ -1417,6 +1464,33 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	 */
 	if (!inst->offer_time) inst->offer_time = inst->lease_time;
 
+	inst->trunk_conf.always_writable = true;
+
+	/*
+	 *	WAIT blocks the connection it's sent on until
+	 *	enough slaves have acknowledged the writes, or
+	 *	wait_timeout expires.  It only covers writes made
+	 *	on the same connection, so it can't be sent on
+	 *	another one.  Instead only run one script per
+	 *	connection, so WAIT doesn't delay the commands
+	 *	of every other request pipelined behind it.
+	 */
+	if (inst->wait_num) {
+		inst->trunk_conf.max_req_per_conn = 1;
+		inst->trunk_conf.target_req_per_conn = 1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_redis_ippool_t		*inst = talloc_get_type_abort(instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(thread, rlm_redis_ippool_thread_t);
+
+	t->cluster_thread = fr_redis_cluster_thread_alloc(t, el, &inst->trunk_conf, inst->cluster, &inst->conf);
+	if (!t->cluster_thread) return -1;
+
 	return 0;
 }
 
@@ -1436,6 +1510,10 @@ module_t rlm_redis_ippool = {
 	.config		= module_config,
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
+
+	.thread_inst_size	= sizeof(rlm_redis_ippool_thread_t),
+	.thread_inst_type	= "rlm_redis_ippool_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_AUTHORIZE]		= mod_authorize,
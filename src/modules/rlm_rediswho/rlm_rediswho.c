@@ -35,6 +35,9 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
+#include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/unlang/base.h>
 
 typedef struct {
 	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
@@ -44,6 +47,8 @@ typedef struct {
 	CONF_SECTION		*cs;
 	fr_redis_cluster_t	*cluster;	//!< Pool O pools
 
+	fr_trunk_conf_t		trunk_conf;	//!< Configuration for the per-thread trunks.
+
 	int			expiry_time;	//!< Expiry time in seconds if no updates are received for a user
 
 	int			trim_count;	//!< How many session updates to keep track of per user.
@@ -53,6 +58,34 @@ typedef struct {
 	char const		*expire;	//!< Command for expiring entries.
 } rlm_rediswho_t;
 
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster_thread;	//!< Trunks to each cluster node.
+} rlm_rediswho_thread_t;
+
+typedef struct rediswho_rctx_s rediswho_rctx_t;
+
+/** A command sent to Redis, and its result
+ *
+ */
+typedef struct {
+	rediswho_rctx_t		*rctx;		//!< Resume context this command belongs to.
+	fr_redis_command_set_t	*cmds;		//!< Command set, while it's outstanding.
+	int			ret;		//!< Result of the command, or -1 on error.
+} rediswho_command_t;
+
+/** State for a single accounting request
+ *
+ */
+struct rediswho_rctx_s {
+	char const		*trim;		//!< Command for trimming the session list.
+	char const		*expire;	//!< Command for expiring entries.
+
+	unsigned int		outstanding;	//!< How many commands we're waiting for.
+	rediswho_command_t	insert;
+	rediswho_command_t	trim_cmd;
+	rediswho_command_t	expire_cmd;
+};
+
 static CONF_PARSER section_config[] = {
 	{ FR_CONF_OFFSET("insert", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_rediswho_t, insert) },
 	{ FR_CONF_OFFSET("trim", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_rediswho_t, trim) }, /* required only if trim_count > 0 */
@@ -63,6 +96,8 @@ static CONF_PARSER section_config[] = {
 static CONF_PARSER module_config[] = {
 	REDIS_COMMON_CONFIG,
 
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_rediswho_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+
 	{ FR_CONF_OFFSET("trim_count", FR_TYPE_INT32, rlm_rediswho_t, trim_count), .dflt = "-1" },
 
 	/*
@@ -95,20 +130,81 @@ fr_dict_attr_autoload_t rlm_rediswho_dict_attr[] = {
 	{ NULL }
 };
 
-/*
- *	Query the database executing a command with no result rows
+/** Interpret the reply to a command
+ *
+ * @return
+ *	- The integer returned by the command, if it was positive.
+ *	- -1 otherwise.
  */
-static int rediswho_command(rlm_rediswho_t const *inst, request_t *request, char const *fmt)
+static int rediswho_reply_process(request_t *request, redisReply *reply)
 {
-	fr_redis_conn_t		*conn;
+	int ret = -1;
+
+	if (!fr_cond_assert(reply)) return -1;
+
+	/*
+	 *	Write the response to the debug log
+	 */
+	fr_redis_reply_print(L_DBG_LVL_2, reply, request, 0);
 
-	int 			ret = -1;
+	switch (reply->type) {
+	case REDIS_REPLY_ERROR:
+		break;
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		status;
-	redisReply		*reply = NULL;
-	int			s_ret;
+	case REDIS_REPLY_INTEGER:
+		if (reply->integer > 0) ret = reply->integer;
+		break;
+
+	/*
+	 *	We don't know to interpret this, the user has probably messed
+	 *	up the queries, so print an error message and fail.
+	 */
+	default:
+		REDEBUG("Expected type \"integer\" got type \"%s\"",
+			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		break;
+	}
+
+	return ret;
+}
+
+/** Record that a command has finished, and resume the request if it was the last one
+ *
+ */
+static void rediswho_command_done(request_t *request, rediswho_command_t *cmd)
+{
+	cmd->cmds = NULL;	/* Freed by the trunk */
+
+	if (--cmd->rctx->outstanding == 0) unlang_interpret_mark_resumable(request);
+}
+
+static void _rediswho_command_complete(request_t *request, fr_dlist_head_t *completed, void *uctx)
+{
+	rediswho_command_t *cmd = uctx;
+
+	cmd->ret = rediswho_reply_process(request, fr_redis_command_get_result(fr_dlist_head(completed)));
+	rediswho_command_done(request, cmd);
+}
+
+static void _rediswho_command_fail(request_t *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	rediswho_command_t *cmd = uctx;
 
+	RERROR("Failed executing command");
+	cmd->ret = -1;
+	rediswho_command_done(request, cmd);
+}
+
+/** Expand a command, and enqueue it on the trunk for the node serving its key
+ *
+ * @return
+ *	- 1 if the command was enqueued.
+ *	- 0 if there was no command to send.
+ *	- -1 on error.
+ */
+static int rediswho_command_enqueue(rediswho_command_t *cmd, rlm_rediswho_thread_t *t,
+				    request_t *request, char const *fmt)
+{
 	uint8_t	const		*key = NULL;
 	size_t			key_len = 0;
 
@@ -136,74 +232,91 @@ static int rediswho_command(rlm_rediswho_t const *inst, request_t *request, char
 	 	key_len = strlen((char const *)key);
 	}
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
-		reply = redisCommandArgv(conn->handle, argc, argv, NULL);
-		status = fr_redis_command_status(conn, reply);
-	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
-		RERROR("Failed inserting accounting data");
-	error:
-		fr_redis_reply_free(&reply);
+	cmd->cmds = fr_redis_command_set_alloc(NULL, request, _rediswho_command_complete, _rediswho_command_fail, cmd);
+	if ((fr_redis_command_argv_add(cmd->cmds, argc, argv, NULL) != FR_REDIS_PIPELINE_OK) ||
+	    (fr_redis_command_set_enqueue(t->cluster_thread, cmd->cmds, key, key_len) != FR_REDIS_PIPELINE_OK)) {
+		RERROR("Failed sending command");
+		TALLOC_FREE(cmd->cmds);
 		return -1;
 	}
-	if (!fr_cond_assert(reply)) goto error;
+	cmd->rctx->outstanding++;
 
-	/*
-	 *	Write the response to the debug log
-	 */
-	fr_redis_reply_print(L_DBG_LVL_2, reply, request, 0);
+	return 1;
+}
 
-	switch (reply->type) {
-	case REDIS_REPLY_ERROR:
-		break;
+static void mod_accounting_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+				  void *rctx, fr_state_signal_t action)
+{
+	rediswho_rctx_t *our_rctx = talloc_get_type_abort(rctx, rediswho_rctx_t);
 
-	case REDIS_REPLY_INTEGER:
-		if (reply->integer > 0) ret = reply->integer;
-		break;
+	if (action != FR_SIGNAL_CANCEL) return;
 
-	/*
-	 *	We don't know to interpret this, the user has probably messed
-	 *	up the queries, so print an error message and fail.
-	 */
-	default:
-		REDEBUG("Expected type \"integer\" got type \"%s\"",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		break;
-	}
-	fr_redis_reply_free(&reply);
+	if (our_rctx->insert.cmds) fr_redis_command_set_cancel(our_rctx->insert.cmds);
+	if (our_rctx->trim_cmd.cmds) fr_redis_command_set_cancel(our_rctx->trim_cmd.cmds);
+	if (our_rctx->expire_cmd.cmds) fr_redis_command_set_cancel(our_rctx->expire_cmd.cmds);
 
-	return ret;
+	talloc_free(our_rctx);
+}
+
+static unlang_action_t mod_accounting_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					     UNUSED request_t *request, void *rctx)
+{
+	rediswho_rctx_t *our_rctx = talloc_get_type_abort(rctx, rediswho_rctx_t);
+	bool		failed;
+
+	failed = (our_rctx->trim_cmd.ret < 0) || (our_rctx->expire_cmd.ret < 0);
+	talloc_free(our_rctx);
+
+	if (failed) RETURN_MODULE_FAIL;
+
+	RETURN_MODULE_OK;
 }
 
-static unlang_action_t mod_accounting_all(rlm_rcode_t *p_result, rlm_rediswho_t const *inst, request_t *request,
-					  char const *insert,
-					  char const *trim,
-					  char const *expire)
+/** Trim the session list if it's grown too long, and set its expiry
+ *
+ * The list must be trimmed after the insert completes, but the trim and
+ * expire commands don't depend on each other, so are sent together.
+ */
+static unlang_action_t mod_accounting_insert_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+						    request_t *request, void *rctx)
 {
-	int ret;
+	rlm_rediswho_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_rediswho_t);
+	rlm_rediswho_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_rediswho_thread_t);
+	rediswho_rctx_t		*our_rctx = talloc_get_type_abort(rctx, rediswho_rctx_t);
 
-	ret = rediswho_command(inst, request, insert);
-	if (ret < 0) RETURN_MODULE_FAIL;
+	if (our_rctx->insert.ret < 0) {
+	fail:
+		talloc_free(our_rctx);
+		RETURN_MODULE_FAIL;
+	}
 
 	/* Only trim if necessary */
-	if ((inst->trim_count >= 0) && (ret > inst->trim_count)) {
-		if (rediswho_command(inst, request, trim) < 0) RETURN_MODULE_FAIL;
+	if ((inst->trim_count >= 0) && (our_rctx->insert.ret > inst->trim_count)) {
+		if (rediswho_command_enqueue(&our_rctx->trim_cmd, t, request, our_rctx->trim) < 0) goto fail;
 	}
 
-	if (rediswho_command(inst, request, expire) < 0) RETURN_MODULE_FAIL;
-	RETURN_MODULE_OK;
+	if (rediswho_command_enqueue(&our_rctx->expire_cmd, t, request, our_rctx->expire) < 0) {
+		/*
+		 *	The trim command will be freed
+		 *	by the trunk once it completes.
+		 */
+		if (our_rctx->trim_cmd.cmds) fr_redis_command_set_cancel(our_rctx->trim_cmd.cmds);
+		goto fail;
+	}
+
+	if (our_rctx->outstanding == 0) return mod_accounting_resume(p_result, mctx, request, our_rctx);
+
+	return unlang_module_yield(request, mod_accounting_resume, mod_accounting_signal, our_rctx);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_rediswho_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_rediswho_t);
-	rlm_rcode_t		rcode;
+	rlm_rediswho_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_rediswho_thread_t);
 	fr_pair_t		*vp;
 	fr_dict_enum_t		*dv;
 	CONF_SECTION		*cs;
-	char const		*insert, *trim, *expire;
+	rediswho_rctx_t		*our_rctx;
 
 	vp = fr_pair_find_by_da(&request->request_pairs, attr_acct_status_type);
 	if (!vp) {
@@ -223,11 +336,22 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 		RETURN_MODULE_NOOP;
 	}
 
-	insert = cf_pair_value(cf_pair_find(cs, "insert"));
-	trim = cf_pair_value(cf_pair_find(cs, "trim"));
-	expire = cf_pair_value(cf_pair_find(cs, "expire"));
+	MEM(our_rctx = talloc_zero(request, rediswho_rctx_t));
+	our_rctx->trim = cf_pair_value(cf_pair_find(cs, "trim"));
+	our_rctx->expire = cf_pair_value(cf_pair_find(cs, "expire"));
+	our_rctx->insert.rctx = our_rctx->trim_cmd.rctx = our_rctx->expire_cmd.rctx = our_rctx;
+
+	switch (rediswho_command_enqueue(&our_rctx->insert, t, request, cf_pair_value(cf_pair_find(cs, "insert")))) {
+	case 1:
+		return unlang_module_yield(request, mod_accounting_insert_resume, mod_accounting_signal, our_rctx);
+
+	case 0:
+		return mod_accounting_insert_resume(p_result, mctx, request, our_rctx);
 
-	return mod_accounting_all(&rcode, inst, request, insert, trim, expire);
+	default:
+		talloc_free(our_rctx);
+		RETURN_MODULE_FAIL;
+	}
 }
 
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
@@ -248,6 +372,19 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->cluster = fr_redis_cluster_alloc(inst, conf, &inst->conf, true, NULL, NULL, NULL);
 	if (!inst->cluster) return -1;
 
+	inst->trunk_conf.always_writable = true;
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_rediswho_t		*inst = talloc_get_type_abort(instance, rlm_rediswho_t);
+	rlm_rediswho_thread_t	*t = talloc_get_type_abort(thread, rlm_rediswho_thread_t);
+
+	t->cluster_thread = fr_redis_cluster_thread_alloc(t, el, &inst->trunk_conf, inst->cluster, &inst->conf);
+	if (!t->cluster_thread) return -1;
+
 	return 0;
 }
 
@@ -260,14 +397,18 @@ static int mod_load(void)
 
 extern module_t rlm_rediswho;
 module_t rlm_rediswho = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "rediswho",
-	.type		= RLM_TYPE_THREAD_SAFE,
-	.inst_size	= sizeof(rlm_rediswho_t),
-	.config		= module_config,
-	.onload		= mod_load,
-	.instantiate	= mod_instantiate,
-	.bootstrap	= mod_bootstrap,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "rediswho",
+	.type			= RLM_TYPE_THREAD_SAFE,
+	.inst_size		= sizeof(rlm_rediswho_t),
+	.config			= module_config,
+	.onload			= mod_load,
+	.instantiate		= mod_instantiate,
+	.bootstrap		= mod_bootstrap,
+
+	.thread_inst_size	= sizeof(rlm_rediswho_thread_t),
+	.thread_inst_type	= "rlm_rediswho_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting
 	},
@@ -69,6 +69,13 @@ DIAG_ON(strict-prototypes)
 #define HAVE_TLS_VERIFY_OPTIONS 0
 #endif
 
+/*
+ *	Non-blocking API used for queries run over a trunk.
+ */
+#if !defined(MARIADB_BASE_VERSION) && (MYSQL_VERSION_ID >= 80016)
+#define HAVE_MYSQL_NONBLOCKING	1
+#endif
+
 #include "rlm_sql.h"
 
 typedef enum {
@@ -84,10 +91,29 @@ static fr_table_num_sorted_t const server_warnings_table[] = {
 };
 static size_t server_warnings_table_len = NUM_ELEMENTS(server_warnings_table);
 
+#ifdef HAVE_MYSQL_NONBLOCKING
+/** Where we are in reading the result of a non-blocking query
+ *
+ */
+typedef enum {
+	MYSQL_ASYNC_QUERY = 0,			//!< Waiting for the query to complete.
+	MYSQL_ASYNC_STORE,			//!< Retrieving a result set, so its rows can be
+						///< copied out, or it can be discarded.
+	MYSQL_ASYNC_NEXT			//!< Checking for more result sets.
+} rlm_sql_mysql_async_state_t;
+#endif
+
 typedef struct {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
+#ifdef HAVE_MYSQL_NONBLOCKING
+	unsigned long	async_flags;		//!< Client flags, passed on each call while connecting.
+	char		*async_query;		//!< Query being run with the non-blocking API.
+	rlm_sql_mysql_async_state_t async_state;	//!< What we're waiting for.
+	int		async_affected_rows;	//!< Rows affected by the query being run.
+	rlm_sql_row_t	*async_rows;		//!< Rows returned by the query being run.
+#endif
 } rlm_sql_mysql_conn_t;
 
 typedef struct {
@@ -217,7 +243,11 @@ static int mod_load(void)
 	return 0;
 }
 
-static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *config, fr_time_delta_t timeout)
+/** Allocate a connection, and set its options
+ *
+ * @return the client flags to pass when connecting.
+ */
+static unsigned long sql_socket_setup(rlm_sql_handle_t *handle, rlm_sql_config_t *config, fr_time_delta_t timeout)
 {
 	rlm_sql_mysql_conn_t *conn;
 	rlm_sql_mysql_t *inst = config->driver;
@@ -227,8 +257,6 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *c
 	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_mysql_conn_t));
 	talloc_set_destructor(conn, _sql_socket_destructor);
 
-	DEBUG("Starting connect to MySQL server");
-
 	mysql_init(&(conn->db));
 
 	/*
@@ -323,6 +351,20 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *c
 #ifdef CLIENT_MULTI_STATEMENTS
 	sql_flags |= CLIENT_MULTI_STATEMENTS;
 #endif
+
+	return sql_flags;
+}
+
+static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *config, fr_time_delta_t timeout)
+{
+	rlm_sql_mysql_conn_t *conn;
+	unsigned long sql_flags;
+
+	DEBUG("Starting connect to MySQL server");
+
+	sql_flags = sql_socket_setup(handle, config, timeout);
+	conn = handle->conn;
+
 	conn->sock = mysql_real_connect(&(conn->db),
 					config->sql_server,
 					config->sql_login,
@@ -817,6 +859,284 @@ static sql_rcode_t sql_finish_query(rlm_sql_handle_t *handle, rlm_sql_config_t *
 	return RLM_SQL_OK;
 }
 
+#ifdef HAVE_MYSQL_NONBLOCKING
+/** Continue connecting, without blocking
+ *
+ * The non-blocking API doesn't say what it's waiting for, so we always
+ * wait for the socket to become readable.  The server speaks first, so
+ * the greeting arriving also tells us the TCP connection is open, and
+ * everything we send while connecting is small enough to be written
+ * immediately.
+ */
+static sql_rcode_t sql_async_connect_poll(bool *want_write, rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+
+	switch (mysql_real_connect_nonblocking(&(conn->db),
+					       config->sql_server,
+					       config->sql_login,
+					       config->sql_password,
+					       config->sql_db,
+					       config->sql_port,
+					       NULL,
+					       conn->async_flags)) {
+	case NET_ASYNC_NOT_READY:
+		*want_write = false;
+		return RLM_SQL_PENDING;
+
+	case NET_ASYNC_ERROR:
+		ERROR("Couldn't connect to MySQL server %s@%s:%s", config->sql_login,
+		      config->sql_server, config->sql_db);
+		ERROR("MySQL error: %s", mysql_error(&conn->db));
+		return RLM_SQL_ERROR;
+
+	default:
+		break;
+	}
+
+	conn->sock = &(conn->db);
+
+	DEBUG2("Connected to database '%s' on %s, server version %s, protocol version %i",
+	       config->sql_db, mysql_get_host_info(conn->sock),
+	       mysql_get_server_info(conn->sock), mysql_get_proto_info(conn->sock));
+
+	return RLM_SQL_OK;
+}
+
+/** Start connecting, without blocking
+ *
+ * The connection's timeout is enforced by the trunk.
+ */
+static sql_rcode_t sql_async_connect(bool *want_write, rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	unsigned long		sql_flags;
+	rlm_sql_mysql_conn_t	*conn;
+
+	DEBUG("Starting connect to MySQL server");
+
+	sql_flags = sql_socket_setup(handle, config, 0);
+	conn = handle->conn;
+	conn->async_flags = sql_flags;
+
+	return sql_async_connect_poll(want_write, handle, config);
+}
+
+/** Return the connection's file descriptor so the trunk can wait on it
+ *
+ * The descriptor is valid once we've started connecting.
+ */
+static int sql_async_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	return conn->db.net.fd;
+}
+
+/** Start a query without waiting for the result
+ *
+ * The MySQL protocol only allows one outstanding query per connection,
+ * so the trunk never gives us another until this one has been read.
+ *
+ * The non-blocking API doesn't say whether a query it hasn't finished
+ * is still being written, or is waiting for the result, so there's no
+ * way to know when to wait for the socket to become writable.  Instead
+ * we refuse queries which may not fit in the socket's send buffer.  As
+ * the previous query has been read in full the buffer is empty, so any
+ * smaller query is written by the first call.
+ */
+static sql_rcode_t sql_async_send(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, char const *query)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	size_t			len = strlen(query);
+	int			sndbuf;
+	socklen_t		optlen = sizeof(sndbuf);
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *	Linux reports double the usable size, to
+	 *	allow for its own bookkeeping.
+	 */
+	if (getsockopt(conn->sock->net.fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) < 0) {
+		ERROR("Failed getting socket send buffer size: %s", fr_syserror(errno));
+		return RLM_SQL_RECONNECT;
+	}
+	if (len > ((size_t)sndbuf / 2)) {
+		ERROR("Query length %zu exceeds the maximum of %i bytes for non-blocking queries", len, sndbuf / 2);
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	/*
+	 *	The same query must be passed to each call
+	 *	until the query completes.
+	 */
+	talloc_free(conn->async_query);
+	MEM(conn->async_query = talloc_typed_strdup(conn, query));
+	conn->async_state = MYSQL_ASYNC_QUERY;
+	conn->async_affected_rows = 0;
+	TALLOC_FREE(conn->async_rows);
+
+	switch (mysql_real_query_nonblocking(conn->sock, conn->async_query, len)) {
+	case NET_ASYNC_NOT_READY:
+		break;
+
+	case NET_ASYNC_ERROR:
+		TALLOC_FREE(conn->async_query);
+		return sql_check_error(conn->sock, 0);
+
+	/*
+	 *	The result was already available.  Calling
+	 *	mysql_real_query_nonblocking() again would
+	 *	start the query a second time.
+	 */
+	default:
+		conn->async_affected_rows = mysql_affected_rows(conn->sock);
+		conn->async_state = MYSQL_ASYNC_STORE;
+		break;
+	}
+
+	return RLM_SQL_OK;
+}
+
+/** Continue the outstanding query, returning the result if it's complete
+ *
+ * Once the query completes, any result sets are drained with the
+ * non-blocking API, the same as #sql_finish_query does with the blocking
+ * one, so the connection is ready for the next query without ever
+ * waiting on the server.
+ *
+ * Rows from every result set are kept, as #sql_fetch_row returns them.
+ * We always copy them, as we don't know whether the caller still wants
+ * them until the query completes.
+ */
+static sql_rcode_t sql_async_read(int *out, TALLOC_CTX *ctx, rlm_sql_row_t **rows,
+				  rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	MYSQL_RES		*result;
+	MYSQL_ROW		row;
+	unsigned long		*field_lens;
+	unsigned int		num_fields, i;
+	size_t			num_rows;
+	sql_rcode_t		rcode;
+
+	if (!conn->sock || !conn->async_query) {
+		ERROR("No query outstanding");
+		return RLM_SQL_RECONNECT;
+	}
+
+	for (;;) switch (conn->async_state) {
+	case MYSQL_ASYNC_QUERY:
+		switch (mysql_real_query_nonblocking(conn->sock, conn->async_query,
+						     talloc_array_length(conn->async_query) - 1)) {
+		case NET_ASYNC_NOT_READY:
+			return RLM_SQL_PENDING;
+
+		case NET_ASYNC_ERROR:
+			goto error;
+
+		default:
+			break;
+		}
+		conn->async_affected_rows = mysql_affected_rows(conn->sock);
+		conn->async_state = MYSQL_ASYNC_STORE;
+		FALL_THROUGH;
+
+	case MYSQL_ASYNC_STORE:
+		/*
+		 *	Statements which don't return rows have
+		 *	no result set to retrieve.
+		 */
+		if (mysql_field_count(conn->sock) > 0) {
+			switch (mysql_store_result_nonblocking(conn->sock, &result)) {
+			case NET_ASYNC_NOT_READY:
+				return RLM_SQL_PENDING;
+
+			case NET_ASYNC_ERROR:
+				goto error;
+
+			default:
+				break;
+			}
+
+			/*
+			 *	The result set has been read in full,
+			 *	so fetching rows and freeing it does
+			 *	no I/O.
+			 */
+			if (result) {
+				num_fields = mysql_num_fields(result);
+				num_rows = talloc_array_length(conn->async_rows);
+
+				if (num_fields && (mysql_num_rows(result) > 0)) {
+					MEM(conn->async_rows = talloc_realloc(conn, conn->async_rows, rlm_sql_row_t,
+									      num_rows + mysql_num_rows(result)));
+				}
+
+				while (num_fields && (row = mysql_fetch_row(result))) {
+					field_lens = mysql_fetch_lengths(result);
+
+					MEM(conn->async_rows[num_rows] = talloc_zero_array(conn->async_rows, char *,
+											   num_fields + 1));
+					for (i = 0; i < num_fields; i++) {
+						MEM(conn->async_rows[num_rows][i] = talloc_bstrndup(conn->async_rows[num_rows],
+												    row[i], field_lens[i]));
+					}
+					num_rows++;
+				}
+				mysql_free_result(result);
+			}
+		}
+		conn->async_state = MYSQL_ASYNC_NEXT;
+		FALL_THROUGH;
+
+	case MYSQL_ASYNC_NEXT:
+		switch (mysql_next_result_nonblocking(conn->sock)) {
+		case NET_ASYNC_NOT_READY:
+			return RLM_SQL_PENDING;
+
+		case NET_ASYNC_ERROR:
+			goto error;
+
+		/*
+		 *	Another result set follows.
+		 */
+		case NET_ASYNC_COMPLETE:
+			conn->async_state = MYSQL_ASYNC_STORE;
+			continue;
+
+		default:
+			break;
+		}
+
+		TALLOC_FREE(conn->async_query);
+		*out = conn->async_affected_rows;
+		if (rows) {
+			*rows = talloc_steal(ctx, conn->async_rows);
+			conn->async_rows = NULL;
+		} else {
+			TALLOC_FREE(conn->async_rows);
+		}
+
+		return RLM_SQL_OK;
+	}
+
+error:
+	TALLOC_FREE(conn->async_query);
+	TALLOC_FREE(conn->async_rows);
+	rcode = sql_check_error(conn->sock, 0);
+
+	/*
+	 *	Errors are only reported by the call which hit
+	 *	them, so make sure we don't report success.
+	 */
+	return (rcode == RLM_SQL_OK) ? RLM_SQL_ERROR : rcode;
+}
+#endif
+
 static int sql_affected_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
@@ -864,5 +1184,12 @@ rlm_sql_driver_t rlm_sql_mysql = {
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
 	.sql_finish_select_query	= sql_finish_query,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+#ifdef HAVE_MYSQL_NONBLOCKING
+	.sql_async_connect		= sql_async_connect,
+	.sql_async_connect_poll		= sql_async_connect_poll,
+	.sql_async_fd			= sql_async_fd,
+	.sql_async_send			= sql_async_send,
+	.sql_async_read			= sql_async_read
+#endif
 };
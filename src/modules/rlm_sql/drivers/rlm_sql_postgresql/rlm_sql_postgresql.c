@@ -388,6 +388,265 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 	return sql_classify_error(inst, status, conn->result);;
 }
 
+/** Start connecting, without blocking
+ *
+ * libpq may still block resolving host names.  Use hostaddr in the
+ * connection parameters to avoid that.
+ */
+static sql_rcode_t sql_async_connect(bool *want_write, rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_t	*inst = config->driver;
+	rlm_sql_postgres_conn_t	*conn;
+
+	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_postgres_conn_t));
+	talloc_set_destructor(conn, _sql_socket_destructor);
+
+	DEBUG2("Connecting using parameters: %s", inst->db_string);
+	conn->db = PQconnectStart(inst->db_string);
+	if (!conn->db) {
+		ERROR("Connection failed: Out of memory");
+		return RLM_SQL_ERROR;
+	}
+	if (PQstatus(conn->db) == CONNECTION_BAD) {
+		ERROR("Connection failed: %s", PQerrorMessage(conn->db));
+		PQfinish(conn->db);
+		conn->db = NULL;
+		return RLM_SQL_ERROR;
+	}
+
+	/*
+	 *	As if PQconnectPoll had returned PGRES_POLLING_WRITING.
+	 */
+	*want_write = true;
+
+	return RLM_SQL_PENDING;
+}
+
+/** Continue connecting, without blocking
+ *
+ */
+static sql_rcode_t sql_async_connect_poll(bool *want_write, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_ERROR;
+	}
+
+	switch (PQconnectPoll(conn->db)) {
+	case PGRES_POLLING_READING:
+		*want_write = false;
+		return RLM_SQL_PENDING;
+
+	case PGRES_POLLING_WRITING:
+		*want_write = true;
+		return RLM_SQL_PENDING;
+
+	case PGRES_POLLING_OK:
+		break;
+
+	default:
+		ERROR("Connection failed: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_ERROR;
+	}
+
+	DEBUG2("Connected to database '%s' on '%s' server version %i, protocol version %i, backend PID %i ",
+	       PQdb(conn->db), PQhost(conn->db), PQserverVersion(conn->db), PQprotocolVersion(conn->db),
+	       PQbackendPID(conn->db));
+
+	return RLM_SQL_OK;
+}
+
+/** Return the connection's file descriptor so the trunk can wait on it
+ *
+ */
+static int sql_async_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!conn->db) return -1;
+
+	return PQsocket(conn->db);
+}
+
+/** Send a query without waiting for the result
+ *
+ * The connection is switched to non-blocking mode, so libpq buffers
+ * anything it can't write immediately.  The buffer is written out by
+ * #sql_async_flush.
+ *
+ * Where libpq supports it the connection is put into pipeline mode, so
+ * multiple queries can be outstanding at once.  Each query is followed by
+ * a sync point, so an error in one query doesn't abort the ones after it.
+ */
+static sql_rcode_t sql_async_send(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, char const *query)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQisnonblocking(conn->db) && (PQsetnonblocking(conn->db, 1) != 0)) {
+		ERROR("Failed setting connection to non-blocking: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+#ifdef LIBPQ_HAS_PIPELINING
+	if ((PQpipelineStatus(conn->db) == PQ_PIPELINE_OFF) && !PQenterPipelineMode(conn->db)) {
+		ERROR("Failed entering pipeline mode: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *	Only the extended query protocol is allowed in
+	 *	pipeline mode, so queries must be single statements.
+	 */
+	if (!PQsendQueryParams(conn->db, query, 0, NULL, NULL, NULL, NULL, 0) || !PQpipelineSync(conn->db)) {
+#else
+	if (!PQsendQuery(conn->db, query)) {
+#endif
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return RLM_SQL_OK;
+}
+
+/** Write out queries libpq has buffered
+ *
+ */
+static sql_rcode_t sql_async_flush(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	switch (PQflush(conn->db)) {
+	case 0:
+		return RLM_SQL_OK;
+
+	case 1:
+		return RLM_SQL_PENDING;
+
+	default:
+		ERROR("Failed writing queries: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+}
+
+/** Copy the rows of a result, so they outlive it
+ *
+ */
+static rlm_sql_row_t *sql_async_rows(TALLOC_CTX *ctx, PGresult *result)
+{
+	rlm_sql_row_t	*rows;
+	int		num_rows, num_fields, i, j, len;
+
+	num_rows = PQntuples(result);
+	num_fields = PQnfields(result);
+	if ((num_rows <= 0) || (num_fields <= 0)) return NULL;
+
+	MEM(rows = talloc_zero_array(ctx, rlm_sql_row_t, num_rows));
+	for (i = 0; i < num_rows; i++) {
+		MEM(rows[i] = talloc_zero_array(rows, char *, num_fields + 1));
+		for (j = 0; j < num_fields; j++) {
+			len = PQgetlength(result, i, j);
+			MEM(rows[i][j] = talloc_array(rows[i], char, len + 1));
+			strlcpy(rows[i][j], PQgetvalue(result, i, j), len + 1);
+		}
+	}
+
+	return rows;
+}
+
+/** Retrieve the result of the oldest outstanding query, if it's available
+ *
+ */
+static sql_rcode_t sql_async_read(int *out, TALLOC_CTX *ctx, rlm_sql_row_t **rows,
+				  rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	rlm_sql_postgres_t	*inst = config->driver;
+	PGresult		*tmp_result;
+	ExecStatusType		status;
+	sql_rcode_t		rcode;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQconsumeInput(conn->db)) {
+		ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *	A query's results are terminated by a NULL
+	 *	result.  We keep the first result, and
+	 *	discard the results of any appended queries.
+	 */
+	for (;;) {
+		if (PQisBusy(conn->db)) return RLM_SQL_PENDING;
+
+		tmp_result = PQgetResult(conn->db);
+		if (!tmp_result) {
+			if (!conn->result) return RLM_SQL_PENDING;
+			break;
+		}
+
+#ifdef LIBPQ_HAS_PIPELINING
+		/*
+		 *	Sync point following the previous query.
+		 */
+		if (PQresultStatus(tmp_result) == PGRES_PIPELINE_SYNC) {
+			PQclear(tmp_result);
+			continue;
+		}
+#endif
+
+		if (conn->result) {
+			PQclear(tmp_result);
+			continue;
+		}
+		conn->result = tmp_result;
+	}
+
+	status = PQresultStatus(conn->result);
+	switch (status) {
+	case PGRES_COMMAND_OK:
+		*out = affected_rows(conn->result);
+		DEBUG2("query affected rows = %i", *out);
+		break;
+
+#ifdef HAVE_PGRES_SINGLE_TUPLE
+	case PGRES_SINGLE_TUPLE:
+#endif
+	case PGRES_TUPLES_OK:
+		*out = PQntuples(conn->result);
+		DEBUG2("query returned rows = %i", *out);
+		if (rows) *rows = sql_async_rows(ctx, conn->result);
+		break;
+
+	default:
+		*out = 0;
+		break;
+	}
+
+	rcode = sql_classify_error(inst, status, conn->result);
+
+	PQclear(conn->result);
+	conn->result = NULL;
+
+	return rcode;
+}
+
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t *config, char const *query)
 {
 	return sql_query(handle, config, query);
@@ -657,7 +916,11 @@ extern rlm_sql_driver_t rlm_sql_postgresql;
 rlm_sql_driver_t rlm_sql_postgresql = {
 	.name				= "rlm_sql_postgresql",
 	.magic				= RLM_MODULE_INIT,
+#ifdef LIBPQ_HAS_PIPELINING
+	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY | RLM_SQL_FLAGS_ASYNC_PIPELINE,
+#else
 	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,
+#endif
 	.inst_size			= sizeof(rlm_sql_postgres_t),
 	.onload				= mod_load,
 	.config				= driver_config,
@@ -672,5 +935,11 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
 	.sql_affected_rows		= sql_affected_rows,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_async_connect		= sql_async_connect,
+	.sql_async_connect_poll		= sql_async_connect_poll,
+	.sql_async_fd			= sql_async_fd,
+	.sql_async_send			= sql_async_send,
+	.sql_async_read			= sql_async_read,
+	.sql_async_flush		= sql_async_flush
 };
@@ -110,6 +110,12 @@ static const CONF_PARSER module_config[] = {
 	 */
 	{ FR_CONF_OFFSET("query_timeout", FR_TYPE_UINT32, rlm_sql_config_t, query_timeout) },
 
+	/*
+	 *	Only works for drivers with non-blocking support.
+	 */
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, rlm_sql_config_t, async), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_sql_config_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+
 	{ FR_CONF_POINTER("accounting", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) acct_config },
 
 	{ FR_CONF_POINTER("post-auth", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) postauth_config },
@@ -1182,14 +1188,550 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->pool = module_connection_pool_init(inst->cs, inst, sql_mod_conn_create, NULL, NULL, NULL, NULL);
 	if (!inst->pool) return -1;
 
+	if (inst->config->async) {
+		if (!sql_trunk_supported(inst)) {
+			WARN("Driver %s does not support non-blocking queries, ignoring 'async = yes'",
+			     inst->driver->name);
+			inst->config->async = false;
+		/*
+		 *	Drivers which can't pipeline queries can only
+		 *	have one query outstanding per connection.
+		 */
+		} else if (!(inst->driver->flags & RLM_SQL_FLAGS_ASYNC_PIPELINE)) {
+			inst->config->trunk_conf.max_req_per_conn = 1;
+			inst->config->trunk_conf.target_req_per_conn = 1;
+		}
+	}
+	inst->config->trunk_conf.always_writable = true;
+
 	return 0;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_sql_t		*inst = talloc_get_type_abort(instance, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(thread, rlm_sql_thread_t);
+
+	t->inst = inst;
+	t->el = el;
+
+	if (!inst->config->async) return 0;
+
+	return sql_trunk_thread_instantiate(t, el);
+}
+
+/** Which query an authorize run over the trunk is waiting for
+ *
+ */
+typedef enum {
+	SQL_AUTZ_INIT = 0,				//!< Nothing sent yet.
+	SQL_AUTZ_CHECK,					//!< Check items for the user.
+	SQL_AUTZ_REPLY,					//!< Reply items for the user.
+	SQL_AUTZ_GROUP_MEMB,				//!< Groups the user or profile is a member of.
+	SQL_AUTZ_GROUP_CHECK,				//!< Check items for the current group.
+	SQL_AUTZ_GROUP_REPLY				//!< Reply items for the current group.
+} sql_autz_status_t;
+
+/** State for authorize queries run over the trunk
+ *
+ * Holds the locals of mod_authorize() and rlm_sql_process_groups(), which
+ * must survive across yields.
+ */
+typedef struct {
+	sql_autz_status_t	status;			//!< Query we're waiting for.
+	rlm_rcode_t		rcode;			//!< What we'll return.
+	bool			user_found;		//!< Found the user in any of the tables.
+	sql_fall_through_t	do_fall_through;	//!< Whether to carry on to groups or profiles.
+
+	bool			profile;		//!< Processing the groups of a profile,
+							///< rather than the user.
+	rlm_rcode_t		group_rcode;		//!< Result of processing the current set of groups.
+	rlm_sql_grouplist_t	*head;			//!< Groups the user or profile is a member of.
+	rlm_sql_grouplist_t	*entry;			//!< Group we're currently processing.
+
+	sql_trunk_result_t	result;			//!< Result of the current query.
+} sql_autz_rctx_t;
+
+static unlang_action_t mod_authorize_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					    request_t *request, void *rctx);
+
+/** Free the authorize state, and remove any attributes we added
+ *
+ */
+static void sql_autz_free(rlm_sql_t const *inst, request_t *request, sql_autz_rctx_t *autz)
+{
+	if (autz->head) pair_delete_request(inst->group_da);
+	talloc_free(autz->result.rows);
+	talloc_free(autz);
+	sql_unset_user(inst, request);
+}
+
+static void mod_authorize_signal(module_ctx_t const *mctx, request_t *request,
+				 void *rctx, fr_state_signal_t action)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	sql_autz_rctx_t		*autz = talloc_get_type_abort(rctx, sql_autz_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	sql_trunk_cancel(&autz->result);
+	sql_autz_free(inst, request, autz);
+}
+
+/** Enqueue an authorize query, and yield until the result is available
+ *
+ */
+static unlang_action_t mod_authorize_enqueue(rlm_rcode_t *p_result, rlm_sql_t const *inst, rlm_sql_thread_t *t,
+					     request_t *request, sql_autz_rctx_t *autz,
+					     sql_autz_status_t status, char const *query)
+{
+	autz->status = status;
+
+	if (sql_trunk_enqueue(&autz->result, t, request, NULL, query, true) < 0) {
+		REDEBUG("Failed enqueueing query");
+		sql_autz_free(inst, request, autz);
+		RETURN_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_authorize_resume, mod_authorize_signal, autz);
+}
+
+/** Convert the rows an authorize query returned to pairs
+ *
+ * @return
+ *	- The number of rows.
+ *	- -1 on error.
+ */
+static int sql_autz_pairs(TALLOC_CTX *ctx, request_t *request, fr_pair_list_t *out, sql_trunk_result_t *r)
+{
+	fr_cursor_t	cursor;
+	int		rows;
+
+	/*
+	 *	Same as rlm_sql_select_query().
+	 */
+	if (r->empty) {
+		REDEBUG("Zero length query");
+		return -1;
+	}
+	if (r->rcode != RLM_SQL_OK) return -1;
+
+	fr_cursor_init(&cursor, out);
+	rows = sql_pair_list_afrom_rows(ctx, request, &cursor, r->rows);
+	TALLOC_FREE(r->rows);
+
+	return rows;
+}
+
+/** Process the result of an authorize query, and send the next one
+ *
+ * Mirrors mod_authorize() and rlm_sql_process_groups(), with each query
+ * replaced by a yield.  The labels match the points the synchronous code
+ * branches to.
+ */
+static unlang_action_t mod_authorize_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					    request_t *request, void *rctx)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
+	sql_autz_rctx_t		*autz = talloc_get_type_abort(rctx, sql_autz_rctx_t);
+	sql_trunk_result_t	*r = &autz->result;
+
+	fr_pair_list_t		tmp;
+	fr_cursor_t		cursor;
+	fr_pair_t		*vp, *sql_group = NULL, *user_profile;
+	rlm_sql_grouplist_t	*entry;
+	char const		*profile;
+	size_t			i;
+	int			rows;
+
+	fr_pair_list_init(&tmp);
+
+	switch (autz->status) {
+	case SQL_AUTZ_INIT:
+		break;
+
+	case SQL_AUTZ_CHECK:
+		goto check_result;
+
+	case SQL_AUTZ_REPLY:
+		goto reply_result;
+
+	case SQL_AUTZ_GROUP_MEMB:
+		goto group_memb_result;
+
+	case SQL_AUTZ_GROUP_CHECK:
+		goto group_check_result;
+
+	case SQL_AUTZ_GROUP_REPLY:
+		goto group_reply_result;
+	}
+
+	/*
+	 *	Query the check table to find any conditions associated with this user/realm/whatever...
+	 */
+	if (!inst->config->authorize_check_query) goto reply;
+
+	return mod_authorize_enqueue(p_result, inst, t, request, autz, SQL_AUTZ_CHECK,
+				     inst->config->authorize_check_query);
+
+check_result:
+	rows = sql_autz_pairs(request, request, &tmp, r);
+	if (rows < 0) {
+		REDEBUG("Failed getting check attributes");
+		fr_pair_list_free(&tmp);
+		autz->rcode = RLM_MODULE_FAIL;
+		goto error;
+	}
+
+	if (rows == 0) goto skip_reply;	/* Don't need to free VPs we don't have */
+
+	/*
+	 *	Only do this if *some* check pairs were returned
+	 */
+	RDEBUG2("User found in radcheck table");
+	autz->user_found = true;
+	if (paircmp(request, &request->request_pairs, &tmp) != 0) {
+		fr_pair_list_free(&tmp);
+		goto skip_reply;
+	}
+
+	RDEBUG2("Conditional check items matched, merging assignment check items");
+	RINDENT();
+	for (vp = fr_cursor_init(&cursor, &tmp);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		if (!fr_assignment_op[vp->op]) continue;
+		RDEBUG2("&%pP", vp);
+	}
+	REXDENT();
+	radius_pairmove(request, &request->control_pairs, &tmp, true);
+	fr_pair_list_init(&tmp);
+
+	autz->rcode = RLM_MODULE_OK;
+
+reply:
+	if (!inst->config->authorize_reply_query) goto groups_configured;
+
+	/*
+	 *	Now get the reply pairs since the paircmp matched
+	 */
+	return mod_authorize_enqueue(p_result, inst, t, request, autz, SQL_AUTZ_REPLY,
+				     inst->config->authorize_reply_query);
+
+reply_result:
+	rows = sql_autz_pairs(request->reply, request, &tmp, r);
+	if (rows < 0) {
+		REDEBUG("SQL query error getting reply attributes");
+		fr_pair_list_free(&tmp);
+		autz->rcode = RLM_MODULE_FAIL;
+		goto error;
+	}
+
+	if (rows == 0) goto skip_reply;
+
+	autz->do_fall_through = fall_through(&tmp);
+
+	RDEBUG2("User found in radreply table, merging reply items");
+	autz->user_found = true;
+
+	log_request_pair_list(L_DBG_LVL_2, request, NULL, &tmp, NULL);
+
+	radius_pairmove(request, &request->reply_pairs, &tmp, true);
+	fr_pair_list_init(&tmp);
+
+	autz->rcode = RLM_MODULE_OK;
+
+groups_configured:
+	/*
+	 *	Neither group checks or profiles will work without
+	 *	a group membership query.
+	 */
+	if (!inst->config->groupmemb_query) goto release;
+
+skip_reply:
+	if ((autz->do_fall_through == FALL_THROUGH_YES) ||
+	    (inst->config->read_groups && (autz->do_fall_through == FALL_THROUGH_DEFAULT))) {
+		RDEBUG3("... falling-through to group processing");
+		goto groups;
+	}
+
+profiles:
+	/*
+	 *	Repeat the above process with the default profile or User-Profile
+	 */
+	if ((autz->do_fall_through == FALL_THROUGH_YES) ||
+	    (inst->config->read_profiles && (autz->do_fall_through == FALL_THROUGH_DEFAULT))) {
+		/*
+		 *  Check for a default_profile or for a User-Profile.
+		 */
+		RDEBUG3("... falling-through to profile processing");
+		user_profile = fr_pair_find_by_da(&request->control_pairs, attr_user_profile);
+
+		profile = user_profile ?
+				      user_profile->vp_strvalue :
+				      inst->config->default_profile;
+
+		if (!profile || !*profile) goto release;
+
+		RDEBUG2("Checking profile %s", profile);
+
+		if (sql_set_user(inst, request, profile) < 0) {
+			REDEBUG("Error setting profile");
+			autz->rcode = RLM_MODULE_FAIL;
+			goto error;
+		}
+
+		autz->profile = true;
+		goto groups;
+	}
+
+	/*
+	 *	At this point the key (user) hasn't be found in the check table, the reply table
+	 *	or the group mapping table, and there was no matching profile.
+	 */
+release:
+	if (!autz->user_found) autz->rcode = RLM_MODULE_NOTFOUND;
+
+error:
+	{
+		rlm_rcode_t	rcode = autz->rcode;
+
+		sql_autz_free(inst, request, autz);
+
+		RETURN_MODULE_RCODE(rcode);
+	}
+
+	/*
+	 *	rlm_sql_process_groups()
+	 */
+groups:
+	autz->group_rcode = RLM_MODULE_NOOP;
+
+	if (!inst->config->groupmemb_query) {
+		RWARN("Cannot do check groups when group_membership_query is not set");
+
+	do_nothing:
+		autz->do_fall_through = FALL_THROUGH_DEFAULT;
+
+		/*
+		 *	Didn't add group attributes or allocate
+		 *	memory, so don't do anything else.
+		 */
+		autz->group_rcode = RLM_MODULE_NOTFOUND;
+		goto groups_done;
+	}
+
+	/*
+	 *	Get the list of groups this user is a member of
+	 */
+	return mod_authorize_enqueue(p_result, inst, t, request, autz, SQL_AUTZ_GROUP_MEMB,
+				     inst->config->groupmemb_query);
+
+group_memb_result:
+	if (r->empty) REDEBUG("Zero length query");
+	if (r->empty || (r->rcode != RLM_SQL_OK)) {
+	group_memb_error:
+		REDEBUG("Error retrieving group list");
+		autz->group_rcode = RLM_MODULE_FAIL;
+		goto groups_done;
+	}
+
+	rows = talloc_array_length(r->rows);
+	for (i = 0, entry = NULL; i < (size_t)rows; i++) {
+		if (!r->rows[i][0]) {
+			RDEBUG2("row[0] returned NULL");
+			TALLOC_FREE(r->rows);
+			TALLOC_FREE(autz->head);
+			goto group_memb_error;
+		}
+
+		if (!autz->head) {
+			MEM(autz->head = talloc_zero(autz, rlm_sql_grouplist_t));
+			entry = autz->head;
+		} else {
+			MEM(entry->next = talloc_zero(autz->head, rlm_sql_grouplist_t));
+			entry = entry->next;
+		}
+		entry->name = talloc_typed_strdup(entry, r->rows[i][0]);
+	}
+	TALLOC_FREE(r->rows);
+
+	if (rows == 0) {
+		RDEBUG2("User not found in any groups");
+		goto do_nothing;
+	}
+	fr_assert(autz->head);
+
+	RDEBUG2("User found in the group table");
+
+	autz->entry = autz->head;
+
+group_next:
+	/*
+	 *	Add the Sql-Group attribute to the request list so we know
+	 *	which group we're retrieving attributes for
+	 */
+	fr_assert(autz->entry != NULL);
+	MEM(pair_update_request(&sql_group, inst->group_da) >= 0);
+	fr_pair_value_strdup(sql_group, autz->entry->name);
+
+	if (!inst->config->authorize_group_check_query) goto group_reply;
+
+	return mod_authorize_enqueue(p_result, inst, t, request, autz, SQL_AUTZ_GROUP_CHECK,
+				     inst->config->authorize_group_check_query);
+
+group_check_result:
+	rows = sql_autz_pairs(request, request, &tmp, r);
+	if (rows < 0) {
+		REDEBUG("Error retrieving check pairs for group %s", autz->entry->name);
+		fr_pair_list_free(&tmp);
+		autz->group_rcode = RLM_MODULE_FAIL;
+		goto groups_finish;
+	}
+
+	/*
+	 *	If we got check rows we need to process them before we decide to
+	 *	process the reply rows
+	 */
+	if ((rows > 0) &&
+	    (paircmp(request, &request->request_pairs, &tmp) != 0)) {
+		fr_pair_list_free(&tmp);
+		autz->entry = autz->entry->next;
+
+		if (!autz->entry) goto groups_finish;
+
+		goto group_next;
+	}
+
+	RDEBUG2("Group \"%s\": Conditional check items matched", autz->entry->name);
+	autz->group_rcode = RLM_MODULE_OK;
+
+	RDEBUG2("Group \"%s\": Merging assignment check items", autz->entry->name);
+	RINDENT();
+	for (vp = fr_cursor_init(&cursor, &tmp);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		if (!fr_assignment_op[vp->op]) continue;
+
+		autz->group_rcode = RLM_MODULE_UPDATED;
+		RDEBUG2("&%pP", vp);
+	}
+	REXDENT();
+	radius_pairmove(request, &request->control_pairs, &tmp, true);
+	fr_pair_list_init(&tmp);
+
+group_reply:
+	/*
+	 *	If there's no reply query configured, then we assume
+	 *	FALL_THROUGH_NO, which is the same as the users file if you
+	 *	had no reply attributes.
+	 */
+	if (!inst->config->authorize_group_reply_query) {
+		autz->do_fall_through = FALL_THROUGH_DEFAULT;
+		goto group_continue;
+	}
+
+	/*
+	 *	Now get the reply pairs since the paircmp matched
+	 */
+	return mod_authorize_enqueue(p_result, inst, t, request, autz, SQL_AUTZ_GROUP_REPLY,
+				     inst->config->authorize_group_reply_query);
+
+group_reply_result:
+	rows = sql_autz_pairs(request->reply, request, &tmp, r);
+	if (rows < 0) {
+		REDEBUG("Error retrieving reply pairs for group %s", autz->entry->name);
+		fr_pair_list_free(&tmp);
+		autz->group_rcode = RLM_MODULE_FAIL;
+		goto groups_finish;
+	}
+
+	if (rows == 0) {
+		autz->do_fall_through = FALL_THROUGH_DEFAULT;
+		goto group_condition;
+	}
+
+	autz->do_fall_through = fall_through(&tmp);
+
+	RDEBUG2("Group \"%s\": Merging reply items", autz->entry->name);
+	if (autz->group_rcode == RLM_MODULE_NOOP) autz->group_rcode = RLM_MODULE_UPDATED;
+
+	log_request_pair_list(L_DBG_LVL_2, request, NULL, &tmp, NULL);
+
+	radius_pairmove(request, &request->reply_pairs, &tmp, true);
+	fr_pair_list_init(&tmp);
+
+group_continue:
+	autz->entry = autz->entry->next;
+
+group_condition:
+	if (autz->entry && (autz->do_fall_through == FALL_THROUGH_YES)) goto group_next;
+
+groups_finish:
+	TALLOC_FREE(autz->head);
+	autz->entry = NULL;
+	pair_delete_request(inst->group_da);
+
+	/*
+	 *	Back in mod_authorize()
+	 */
+groups_done:
+	switch (autz->group_rcode) {
+	/*
+	 *	Nothing bad happened, continue...
+	 */
+	case RLM_MODULE_UPDATED:
+		autz->rcode = RLM_MODULE_UPDATED;
+		FALL_THROUGH;
+
+	case RLM_MODULE_OK:
+		if (autz->rcode != RLM_MODULE_UPDATED) autz->rcode = RLM_MODULE_OK;
+		FALL_THROUGH;
+
+	case RLM_MODULE_NOOP:
+		autz->user_found = true;
+		break;
+
+	case RLM_MODULE_NOTFOUND:
+		break;
+
+	default:
+		autz->rcode = autz->group_rcode;
+		goto release;
+	}
+
+	if (!autz->profile) goto profiles;
+
+	goto release;
+}
+
+/** Run authorize queries over the thread's trunk
+ *
+ */
+static unlang_action_t mod_authorize_async(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	sql_autz_rctx_t		*autz;
+
+	/*
+	 *	Set, escape, and check the user attr here
+	 */
+	if (sql_set_user(inst, request, NULL) < 0) RETURN_MODULE_FAIL;
+
+	MEM(autz = talloc_zero(request, sql_autz_rctx_t));
+	autz->rcode = RLM_MODULE_NOOP;
+	autz->do_fall_through = FALL_THROUGH_DEFAULT;
+
+	return mod_authorize_resume(p_result, mctx, request, autz);
+}
+
 static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 
 	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
 	rlm_sql_handle_t	*handle;
 
 	fr_pair_t		*check_tmp = NULL;
@@ -1214,6 +1756,8 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 		RETURN_MODULE_NOOP;
 	}
 
+	if (t->trunk) return mod_authorize_async(p_result, mctx, request);
+
 	/*
 	 *	Set, escape, and check the user attr here
 	 */
@@ -1433,41 +1977,29 @@ release:
 	RETURN_MODULE_RCODE(rcode);
 }
 
-/*
- *	Generic function for failing between a bunch of queries.
- *
- *	Uses the same principle as rlm_linelog, expanding the 'reference' config
- *	item using xlat to figure out what query it should execute.
+/** Resolve the query to run for accounting or post-auth
  *
- *	If the reference matches multiple config items, and a query fails or
- *	doesn't update any rows, the next matching config item is used.
+ * Expands the section's 'reference' to find the first of a set of redundant queries.
  *
+ * @param[out] out	Where to write the first query.  NULL if there's nothing to run.
+ * @param[in] request	The current request.
+ * @param[in] section	to resolve the reference in.
+ * @return The rcode to return if out is NULL.
  */
-static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *inst, request_t *request, sql_acct_section_t *section)
+static rlm_rcode_t acct_reference(CONF_PAIR **out, request_t *request, sql_acct_section_t *section)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
-
-	rlm_sql_handle_t	*handle = NULL;
-	int			sql_ret;
-	int			numaffected = 0;
-
 	CONF_ITEM		*item;
-	CONF_PAIR 		*pair;
-	char const		*attr = NULL;
-	char const		*value;
-
 	char			path[FR_MAX_STRING_LEN];
 	char			*p = path;
-	char			*expanded = NULL;
 
 	fr_assert(section);
 
+	*out = NULL;
+
 	if (section->reference[0] != '.') *p++ = '.';
 
 	if (xlat_eval(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
+		return RLM_MODULE_FAIL;
 	}
 
 	/*
@@ -1477,18 +2009,45 @@ static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *in
 	item = cf_reference_item(NULL, section->cs, path);
 	if (!item) {
 		RWDEBUG("No such configuration item %s", path);
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 	if (cf_item_is_section(item)){
 		RWDEBUG("Sections are not supported as references");
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 
-	pair = cf_item_to_pair(item);
+	*out = cf_item_to_pair(item);
+
+	return RLM_MODULE_OK;
+}
+
+/*
+ *	Generic function for failing between a bunch of queries.
+ *
+ *	Uses the same principle as rlm_linelog, expanding the 'reference' config
+ *	item using xlat to figure out what query it should execute.
+ *
+ *	If the reference matches multiple config items, and a query fails or
+ *	doesn't update any rows, the next matching config item is used.
+ *
+ */
+static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *inst, request_t *request, sql_acct_section_t *section)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	rlm_sql_handle_t	*handle = NULL;
+	int			sql_ret;
+	int			numaffected = 0;
+
+	CONF_PAIR 		*pair;
+	char const		*attr = NULL;
+	char const		*value;
+
+	char			*expanded = NULL;
+
+	rcode = acct_reference(&pair, request, section);
+	if (!pair) goto finish;
+
 	attr = cf_pair_attr(pair);
 
 	RDEBUG2("Using query template '%s'", attr);
@@ -1601,14 +2160,154 @@ finish:
 	RETURN_MODULE_RCODE(rcode);
 }
 
+/** State for accounting and post-auth queries run over the trunk
+ *
+ */
+typedef struct {
+	sql_acct_section_t	*section;		//!< Section the queries come from.
+	CONF_PAIR		*pair;			//!< Query we're currently running.
+	char const		*attr;			//!< Name shared by the set of redundant queries.
+	sql_trunk_result_t	result;			//!< Result of the current query.
+} sql_acct_rctx_t;
+
+static unlang_action_t acct_redundant_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					     request_t *request, void *rctx);
+
+static void acct_redundant_signal(module_ctx_t const *mctx, request_t *request,
+				  void *rctx, fr_state_signal_t action)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	sql_acct_rctx_t		*acct = talloc_get_type_abort(rctx, sql_acct_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	sql_trunk_cancel(&acct->result);
+	talloc_free(acct);
+	sql_unset_user(inst, request);
+}
+
+/** Enqueue the current query, and yield until the result is available
+ *
+ */
+static unlang_action_t acct_redundant_enqueue(rlm_rcode_t *p_result, rlm_sql_t const *inst, rlm_sql_thread_t *t,
+					      request_t *request, sql_acct_rctx_t *acct)
+{
+	char const		*value;
+
+	value = cf_pair_value(acct->pair);
+	if (!value) {
+		RDEBUG2("Ignoring null query");
+		talloc_free(acct);
+		sql_unset_user(inst, request);
+		RETURN_MODULE_NOOP;
+	}
+
+	if (sql_trunk_enqueue(&acct->result, t, request, acct->section, value, false) < 0) {
+		REDEBUG("Failed enqueueing query");
+		talloc_free(acct);
+		sql_unset_user(inst, request);
+		RETURN_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, acct_redundant_resume, acct_redundant_signal, acct);
+}
+
+/** Process the result of a query run over the trunk
+ *
+ * Mirrors the result handling in acct_redundant().
+ */
+static unlang_action_t acct_redundant_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					     request_t *request, void *rctx)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
+	sql_acct_rctx_t		*acct = talloc_get_type_abort(rctx, sql_acct_rctx_t);
+	sql_trunk_result_t	*r = &acct->result;
+	rlm_rcode_t		rcode;
+
+	if (r->empty) {
+		RDEBUG2("Ignoring null query");
+		rcode = RLM_MODULE_NOOP;
+		goto finish;
+	}
+
+	RDEBUG2("SQL query returned: %s", fr_table_str_by_value(sql_rcode_description_table, r->rcode, "<INVALID>"));
+
+	switch (r->rcode) {
+	case RLM_SQL_OK:
+		break;
+
+	case RLM_SQL_QUERY_INVALID:
+		rcode = RLM_MODULE_INVALID;
+		goto finish;
+
+	case RLM_SQL_ALT_QUERY:
+		goto next;
+
+	default:
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	RDEBUG2("%i record(s) updated", r->affected_rows);
+	if (r->affected_rows > 0) {
+		rcode = RLM_MODULE_OK;
+		goto finish;
+	}
+
+next:
+	acct->pair = cf_pair_find_next(acct->section->cs, acct->pair, acct->attr);
+	if (!acct->pair) {
+		RDEBUG2("No additional queries configured");
+		rcode = RLM_MODULE_NOOP;
+		goto finish;
+	}
+
+	RDEBUG2("Trying next query...");
+
+	return acct_redundant_enqueue(p_result, inst, t, request, acct);
+
+finish:
+	talloc_free(acct);
+	sql_unset_user(inst, request);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Run accounting or post-auth queries over the thread's trunk
+ *
+ */
+static unlang_action_t acct_redundant_async(rlm_rcode_t *p_result, rlm_sql_t const *inst, rlm_sql_thread_t *t,
+					    request_t *request, sql_acct_section_t *section)
+{
+	sql_acct_rctx_t		*acct;
+	CONF_PAIR		*pair;
+	rlm_rcode_t		rcode;
+
+	rcode = acct_reference(&pair, request, section);
+	if (!pair) RETURN_MODULE_RCODE(rcode);
+
+	MEM(acct = talloc_zero(request, sql_acct_rctx_t));
+	acct->section = section;
+	acct->pair = pair;
+	acct->attr = cf_pair_attr(pair);
+
+	sql_set_user(inst, request, NULL);
+
+	return acct_redundant_enqueue(p_result, inst, t, request, acct);
+}
+
 /*
  *	Accounting: Insert or update session data in our sql table
  */
 static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	rlm_sql_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
 
 	if (inst->config->accounting.reference_cp) {
+		if (t->trunk) return acct_redundant_async(p_result, inst, t, request, &inst->config->accounting);
+
 		return acct_redundant(p_result, inst, request, &inst->config->accounting);
 	}
 
@@ -1621,8 +2320,11 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
+	rlm_sql_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
 
 	if (inst->config->postauth.reference_cp) {
+		if (t->trunk) return acct_redundant_async(p_result, inst, t, request, &inst->config->postauth);
+
 		return acct_redundant(p_result, inst, request, &inst->config->postauth);
 	}
 
@@ -1640,9 +2342,11 @@ module_t rlm_sql = {
 	.name		= "sql",
 	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_sql_t),
+	.thread_inst_size	= sizeof(rlm_sql_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
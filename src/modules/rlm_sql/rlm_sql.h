@@ -29,6 +29,7 @@ RCSIDH(rlm_sql_h, "$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/pool.h>
+#include <freeradius-devel/server/trunk.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/exfile.h>
 
@@ -46,6 +47,8 @@ typedef enum {
 	RLM_SQL_RECONNECT = 1,		//!< Stale connection, should reconnect.
 	RLM_SQL_ALT_QUERY,		//!< Key constraint violation, use an alternative query.
 	RLM_SQL_NO_MORE_ROWS,		//!< No more rows available
+	RLM_SQL_PENDING			//!< Result not yet available, wait for the
+					///< connection to become readable.
 } sql_rcode_t;
 
 typedef enum {
@@ -128,6 +131,12 @@ typedef struct {
 	void			*driver;			//!< Where drivers should write a
 								//!< pointer to their configurations.
 
+	bool			async;				//!< Run authorize, accounting and post-auth
+								///< queries over non-blocking connections,
+								///< if the driver supports them.
+	fr_trunk_conf_t		trunk_conf;			//!< Configuration for the per-thread trunk
+								///< of non-blocking connections.
+
 	/*
 	 *	@todo The rest of the queries should also be moved into
 	 *	their own sections.
@@ -160,6 +169,8 @@ extern size_t sql_rcode_table_len;
  */
 #define RLM_SQL_RCODE_FLAGS_ALT_QUERY	1			//!< Can distinguish between other errors and those
 								//!< resulting from a unique key violation.
+#define RLM_SQL_FLAGS_ASYNC_PIPELINE	2			//!< Can have multiple non-blocking queries
+								//!< outstanding on a single connection.
 
 /** Retrieve errors from the last query operation
  *
@@ -184,6 +195,98 @@ extern size_t sql_rcode_table_len;
 typedef size_t (*sql_error_t)(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen, rlm_sql_handle_t *handle,
 			      rlm_sql_config_t *config);
 
+/** Open a connection, or continue opening one, without blocking
+ *
+ * Only used for connections managed by the per-thread trunk.
+ *
+ * #rlm_sql_driver_t.sql_async_connect starts connecting, and must allocate
+ * handle->conn, as sql_socket_init does.  #rlm_sql_driver_t.sql_async_connect_poll
+ * is called each time the file descriptor returned by #sql_async_fd_t becomes
+ * readable, or writable if that's what the previous call asked for.
+ *
+ * @param[out] want_write	Set to true if we should wait for the connection to become
+ *				writable, false if we should wait for it to become readable.
+ *				Only written if #RLM_SQL_PENDING is returned.
+ * @param[in] handle		being connected.
+ * @param[in] config		of the SQL instance.
+ * @return
+ *	- #RLM_SQL_OK if the connection is open.
+ *	- #RLM_SQL_PENDING if we're waiting on the server.
+ *	- #RLM_SQL_ERROR if the connection failed.
+ */
+typedef sql_rcode_t (*sql_async_connect_t)(bool *want_write, rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
+/** Return the file descriptor used by a connection
+ *
+ * Only used for connections managed by the per-thread trunk.
+ *
+ * @param[in] handle	to retrieve the file descriptor for.
+ * @param[in] config	of the SQL instance.
+ * @return
+ *	- >= 0 the file descriptor.
+ *	- -1 if the connection has no file descriptor.
+ */
+typedef int (*sql_async_fd_t)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
+/** Send a query without waiting for the result
+ *
+ * The query string remains valid until the result has been retrieved
+ * with #sql_async_read_t.  Must not block.  If the query can't be written
+ * immediately the driver should buffer it, and write it out when
+ * #sql_async_flush_t is called.  Drivers which can't do that must refuse
+ * queries which may not be written in full.
+ *
+ * #sql_async_read_t is called once the queries have been sent, in case
+ * the driver read the result while sending.
+ *
+ * @param[in] handle	to send the query on.
+ * @param[in] config	of the SQL instance.
+ * @param[in] query	to send.
+ * @return
+ *	- #RLM_SQL_OK if the query was sent.
+ *	- #RLM_SQL_RECONNECT if the connection is no longer viable.
+ *	- #RLM_SQL_QUERY_INVALID if the query was refused.
+ *	- #RLM_SQL_ERROR if the query couldn't be sent.
+ */
+typedef sql_rcode_t (*sql_async_send_t)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query);
+
+/** Retrieve the result of the oldest outstanding query, without blocking
+ *
+ * Any result data is released by the driver before returning.  If the
+ * caller wants the rows a SELECT returned, they're copied out first,
+ * as the next query may be sent as soon as this returns.
+ *
+ * @param[out] affected_rows	Number of rows the query affected, or returned.
+ * @param[in] ctx		to allocate the rows in.  NULL if rows is NULL.
+ * @param[out] rows		Where to write a talloced array of the rows the query
+ *				returned.  Each row is an array of the row's fields.
+ *				NULL if the caller doesn't want the rows.  Only written
+ *				when the result is complete.
+ * @param[in] handle		to read the result from.
+ * @param[in] config		of the SQL instance.
+ * @return
+ *	- #RLM_SQL_PENDING if the result is not yet available.
+ *	- #RLM_SQL_RECONNECT if the connection is no longer viable.
+ *	- Any other #sql_rcode_t as the result of the query.
+ */
+typedef sql_rcode_t (*sql_async_read_t)(int *affected_rows, TALLOC_CTX *ctx, rlm_sql_row_t **rows,
+					rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
+/** Write out any query data the driver has buffered
+ *
+ * Optional.  Drivers which may buffer data in #sql_async_send_t, because
+ * the connection wasn't writable, must provide this.
+ *
+ * @param[in] handle	to flush.
+ * @param[in] config	of the SQL instance.
+ * @return
+ *	- #RLM_SQL_OK if all data has been written.
+ *	- #RLM_SQL_PENDING if data remains, and the connection must become
+ *	  writable before it can be written.
+ *	- #RLM_SQL_RECONNECT if the connection is no longer viable.
+ */
+typedef sql_rcode_t (*sql_async_flush_t)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
 typedef struct {
 	DL_MODULE_COMMON;				//!< Common fields to all loadable modules.
 
@@ -211,6 +314,17 @@ typedef struct {
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
 	xlat_escape_legacy_t	sql_escape_func;
+
+	/*
+	 *	Optional non-blocking interface.  Everything but flush
+	 *	must be provided for the driver to be used with a trunk.
+	 */
+	sql_async_connect_t	sql_async_connect;		//!< Start opening a connection.
+	sql_async_connect_t	sql_async_connect_poll;		//!< Continue opening a connection.
+	sql_async_fd_t		sql_async_fd;			//!< Get the connection's file descriptor.
+	sql_async_send_t	sql_async_send;			//!< Send a query.
+	sql_async_read_t	sql_async_read;			//!< Retrieve a query result.
+	sql_async_flush_t	sql_async_flush;		//!< Write buffered query data, optional.
 } rlm_sql_driver_t;
 
 struct sql_inst {
@@ -236,16 +350,42 @@ struct sql_inst {
 	fr_dict_attr_t const	*group_da;		//!< Group dictionary attribute.
 };
 
+/** Per-thread instance data
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;			//!< Instance we belong to.
+	fr_event_list_t		*el;			//!< Event list for this thread.
+	fr_trunk_t		*trunk;			//!< Non-blocking connections, or NULL if
+							///< queries use the blocking pool.
+} rlm_sql_thread_t;
+
+/** Result of a query run over the trunk
+ *
+ */
+typedef struct {
+	fr_trunk_request_t	*treq;			//!< Trunk request, NULL once the query is
+							///< complete or failed.
+	sql_rcode_t		rcode;			//!< What the driver returned.
+	int			affected_rows;		//!< Rows the query affected.
+	bool			empty;			//!< Query expanded to an empty string, and
+							///< was not sent.
+	rlm_sql_row_t		*rows;			//!< Rows the query returned, if they were
+							///< asked for.  Allocated in the request.
+} sql_trunk_result_t;
+
 typedef struct rlm_sql_grouplist_s rlm_sql_grouplist_t;
 struct rlm_sql_grouplist_s {
 	char			*name;
 	rlm_sql_grouplist_t	*next;
 };
 
+rlm_sql_handle_t *sql_handle_alloc(TALLOC_CTX *ctx, rlm_sql_t *inst);
 void		*sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
 int		sql_pair_list_afrom_str(TALLOC_CTX *ctx, request_t *request, fr_cursor_t *cursor, rlm_sql_row_t row);
 int		sql_read_realms(rlm_sql_handle_t *handle);
 int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, fr_cursor_t *cursor, char const *query);
+int		sql_pair_list_afrom_rows(TALLOC_CTX *ctx, request_t *request, fr_cursor_t *cursor, rlm_sql_row_t *rows);
 int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, request_t *request, sql_acct_section_t *section, char const *query) CC_HINT(nonnull (1, 2, 4));
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
@@ -254,6 +394,15 @@ int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, request_t *req
 void		rlm_sql_print_error(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, request_t *request, char const *username);
 
+/*
+ *	sql_trunk.c
+ */
+bool		sql_trunk_supported(rlm_sql_t const *inst);
+int		sql_trunk_thread_instantiate(rlm_sql_thread_t *t, fr_event_list_t *el);
+int		sql_trunk_enqueue(sql_trunk_result_t *r, rlm_sql_thread_t *t, request_t *request,
+				  sql_acct_section_t *section, char const *query, bool want_rows) CC_HINT(nonnull(1, 2, 3, 5));
+void		sql_trunk_cancel(sql_trunk_result_t *r);
+
 /*
  *	sql_state.c
  */
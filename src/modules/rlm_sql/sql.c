@@ -47,6 +47,7 @@ fr_table_num_sorted_t const sql_rcode_description_table[] = {
 	{ L("need alt query"),	RLM_SQL_ALT_QUERY	},
 	{ L("no connection"),	RLM_SQL_RECONNECT	},
 	{ L("no more rows"),	RLM_SQL_NO_MORE_ROWS	},
+	{ L("pending"),		RLM_SQL_PENDING		},
 	{ L("query invalid"),	RLM_SQL_QUERY_INVALID	},
 	{ L("server error"),	RLM_SQL_ERROR		},
 	{ L("success"),		RLM_SQL_OK		}
@@ -63,10 +64,11 @@ fr_table_num_sorted_t const sql_rcode_table[] = {
 };
 size_t sql_rcode_table_len = NUM_ELEMENTS(sql_rcode_table);
 
-void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout)
+/** Allocate a connection handle, without connecting it
+ *
+ */
+rlm_sql_handle_t *sql_handle_alloc(TALLOC_CTX *ctx, rlm_sql_t *inst)
 {
-	int rcode;
-	rlm_sql_t *inst = instance;
 	rlm_sql_handle_t *handle;
 
 	/*
@@ -88,6 +90,18 @@ void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeo
 	 */
 	handle->inst = inst;
 
+	return handle;
+}
+
+void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout)
+{
+	int rcode;
+	rlm_sql_t *inst = instance;
+	rlm_sql_handle_t *handle;
+
+	handle = sql_handle_alloc(ctx, inst);
+	if (!handle) return NULL;
+
 	rcode = (inst->driver->sql_socket_init)(handle, inst->config, timeout);
 	if (rcode != 0) {
 	fail:
@@ -535,6 +549,31 @@ int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request, rl
 	return rows;
 }
 
+/** Convert rows returned by an asynchronous query into check or reply pairs
+ *
+ * @param[in] ctx	to allocate the pairs in.
+ * @param[in] request	the current request.
+ * @param[in] cursor	to insert the pairs into.
+ * @param[in] rows	talloced array of rows, as returned by #sql_trunk_enqueue.
+ *			May be NULL if the query returned no rows.
+ * @return
+ *	- The number of rows processed.
+ *	- -1 on error.
+ */
+int sql_pair_list_afrom_rows(TALLOC_CTX *ctx, request_t *request, fr_cursor_t *cursor, rlm_sql_row_t *rows)
+{
+	size_t	i, num = talloc_array_length(rows);
+
+	for (i = 0; i < num; i++) {
+		if (sql_pair_list_afrom_str(ctx, request, cursor, rows[i]) != 0) {
+			REDEBUG("Error parsing user data from database result");
+			return -1;
+		}
+	}
+
+	return num;
+}
+
 /*
  *	Log the query to a file.
  */
@@ -0,0 +1,856 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file sql_trunk.c
+ * @brief Run queries over per-thread trunks of non-blocking connections
+ *
+ * Used for drivers which implement the sql_async_* callbacks.  Each worker
+ * thread gets its own trunk, so a slow query only delays the requests
+ * waiting on it, and not every other request on the same worker.
+ *
+ * Results are returned by drivers in the order queries were sent, so each
+ * connection keeps a FIFO of the queries it has outstanding.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "rlm_sql.h"
+
+/** Starts a value in an expanded query, which must be escaped before the query is sent
+ *
+ */
+#define SQL_TRUNK_MARK	'\x01'
+
+typedef struct sql_trunk_request_s sql_trunk_request_t;
+
+/** A query we've sent, and are waiting for the result of
+ *
+ * These are allocated separately from the #sql_trunk_request_t, as the
+ * request may be cancelled before the result arrives, and we still need
+ * to consume the result to keep the FIFO in sync.
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the connection's sent list.
+	sql_trunk_request_t	*preq;			//!< Request the result belongs to.
+							///< NULL if the request was cancelled.
+} sql_trunk_sent_t;
+
+/** Connection specific data
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;			//!< Instance of rlm_sql.
+	rlm_sql_handle_t	*handle;		//!< Driver connection handle.
+	fr_event_list_t		*el;			//!< Event list the fd is registered with.
+	int			fd;			//!< Connection's file descriptor.
+	fr_dlist_head_t		sent;			//!< Queries sent, oldest first.
+
+	fr_trunk_connection_event_t events;		//!< Events the trunk wants notifications for.
+	bool			flush_pending;		//!< The driver has buffered query data, which
+							///< must be written before results can arrive.
+	bool			connect_query_sent;	//!< We're waiting for the result of the connect_query.
+} sql_trunk_handle_t;
+
+/** A query to write to a connection
+ *
+ */
+struct sql_trunk_request_s {
+	fr_trunk_request_t	*treq;			//!< Trunk request we belong to.
+	sql_acct_section_t	*section;		//!< Section the query came from, used for logging.
+	char			*query_marked;		//!< Query expanded when it was enqueued, with the
+							///< values still to be escaped marked.
+	char			*query;			//!< Query escaped with the escaping function of the
+							///< connection it was written to.
+	sql_trunk_sent_t	*sent;			//!< Entry in the connection's sent list.
+	bool			want_rows;		//!< Copy out the rows the query returns.
+};
+
+/** Whether we can use a trunk with this instance
+ *
+ */
+bool sql_trunk_supported(rlm_sql_t const *inst)
+{
+	return inst->driver->sql_async_connect && inst->driver->sql_async_connect_poll &&
+	       inst->driver->sql_async_fd && inst->driver->sql_async_send && inst->driver->sql_async_read;
+}
+
+static int _sql_trunk_handle_free(sql_trunk_handle_t *h)
+{
+	if (h->fd >= 0) (void) fr_event_fd_delete(h->el, h->fd, FR_EVENT_FILTER_IO);
+
+	return 0;
+}
+
+static void sql_trunk_conn_connecting(fr_event_list_t *el, int fd, int flags, void *uctx);
+
+static void sql_trunk_conn_connect_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+					 int fd_errno, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	sql_trunk_handle_t	*h = talloc_get_type_abort(conn->h, sql_trunk_handle_t);
+	rlm_sql_t const		*inst = h->inst;
+	bool			want_write;
+
+	/*
+	 *	Let the driver say why the connection failed,
+	 *	it usually knows better than we do.
+	 */
+	if (h->connect_query_sent ||
+	    (inst->driver->sql_async_connect_poll(&want_write, h->handle, inst->config) != RLM_SQL_ERROR)) {
+		ERROR("Connection failed: %s", fr_syserror(fd_errno));
+	}
+
+	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+}
+
+/** Wait for the connection to become readable or writable, so we can continue opening it
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sql_trunk_conn_connect_wait(fr_connection_t *conn, sql_trunk_handle_t *h, bool want_write)
+{
+	rlm_sql_t const		*inst = h->inst;
+	int			fd;
+
+	fd = inst->driver->sql_async_fd(h->handle, inst->config);
+	if (fd < 0) {
+		ERROR("Driver returned invalid file descriptor");
+		return -1;
+	}
+
+	/*
+	 *	libpq opens a new socket for each address it
+	 *	tries, and will have closed the old one.
+	 */
+	if ((h->fd >= 0) && (h->fd != fd)) (void) fr_event_fd_delete(h->el, h->fd, FR_EVENT_FILTER_IO);
+	h->fd = fd;
+
+	if (fr_event_fd_insert(h, h->el, h->fd,
+			       want_write ? NULL : sql_trunk_conn_connecting,
+			       want_write ? sql_trunk_conn_connecting : NULL,
+			       sql_trunk_conn_connect_error, conn) < 0) {
+		PERROR("Failed inserting FD event");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Write the connect_query, and read its result
+ *
+ * @return
+ *	- #RLM_SQL_OK if the query completed.
+ *	- #RLM_SQL_PENDING if we're waiting on the server.  want_write says for what.
+ *	- Any other #sql_rcode_t on failure.
+ */
+static sql_rcode_t sql_trunk_conn_connect_query(bool *want_write, sql_trunk_handle_t *h)
+{
+	rlm_sql_t const		*inst = h->inst;
+	sql_rcode_t		ret;
+	int			affected_rows;
+
+	if (!h->connect_query_sent) {
+		DEBUG2("Executing query: %s", inst->config->connect_query);
+		ret = inst->driver->sql_async_send(h->handle, inst->config, inst->config->connect_query);
+		if (ret != RLM_SQL_OK) goto error;
+
+		h->connect_query_sent = true;
+	}
+
+	if (inst->driver->sql_async_flush) {
+		ret = inst->driver->sql_async_flush(h->handle, inst->config);
+		if (ret == RLM_SQL_PENDING) {
+			*want_write = true;
+			return RLM_SQL_PENDING;
+		}
+		if (ret != RLM_SQL_OK) goto error;
+	}
+
+	ret = inst->driver->sql_async_read(&affected_rows, NULL, NULL, h->handle, inst->config);
+	if (ret == RLM_SQL_PENDING) {
+		*want_write = false;
+		return RLM_SQL_PENDING;
+	}
+	if (ret != RLM_SQL_OK) {
+	error:
+		rlm_sql_print_error(inst, NULL, h->handle, false);
+		ERROR("Failed running connect_query");
+		return (ret == RLM_SQL_OK) ? RLM_SQL_ERROR : ret;
+	}
+
+	return RLM_SQL_OK;
+}
+
+/** Act on the result of the driver's last attempt to open the connection
+ *
+ * Once the connection is open the connect_query is run, if there is one,
+ * and then the connection is signalled as connected.
+ *
+ * @return
+ *	- 0 if we're waiting on the server, or the connection is open.
+ *	- -1 if the connection failed.
+ */
+static int sql_trunk_conn_connect_continue(fr_connection_t *conn, sql_trunk_handle_t *h,
+					   sql_rcode_t ret, bool want_write)
+{
+	rlm_sql_t const		*inst = h->inst;
+
+	if ((ret == RLM_SQL_OK) && inst->config->connect_query) {
+		ret = sql_trunk_conn_connect_query(&want_write, h);
+	}
+
+	switch (ret) {
+	case RLM_SQL_OK:
+		break;
+
+	case RLM_SQL_PENDING:
+		return sql_trunk_conn_connect_wait(conn, h, want_write);
+
+	default:
+		return -1;
+	}
+
+	/*
+	 *	The trunk inserts the events it wants once
+	 *	the connection is open.
+	 */
+	if (h->fd >= 0) (void) fr_event_fd_delete(h->el, h->fd, FR_EVENT_FILTER_IO);
+
+	h->fd = inst->driver->sql_async_fd(h->handle, inst->config);
+	if (h->fd < 0) {
+		ERROR("Driver returned invalid file descriptor");
+		return -1;
+	}
+
+	fr_connection_signal_connected(conn);
+
+	return 0;
+}
+
+static void sql_trunk_conn_connecting(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	sql_trunk_handle_t	*h = talloc_get_type_abort(conn->h, sql_trunk_handle_t);
+	rlm_sql_t const		*inst = h->inst;
+	sql_rcode_t		ret = RLM_SQL_OK;
+	bool			want_write = false;
+
+	if (!h->connect_query_sent) ret = inst->driver->sql_async_connect_poll(&want_write, h->handle, inst->config);
+
+	if (sql_trunk_conn_connect_continue(conn, h, ret, want_write) < 0) {
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Start opening a new connection
+ *
+ * The driver connects without blocking, and we're called back each time
+ * the connection's file descriptor is ready for it to continue.
+ */
+static fr_connection_state_t _sql_trunk_conn_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+	rlm_sql_t const		*inst = t->inst;
+	rlm_sql_t		*mutable;
+	sql_trunk_handle_t	*h;
+	sql_rcode_t		ret;
+	bool			want_write = false;
+
+	MEM(h = talloc_zero(conn, sql_trunk_handle_t));
+	h->inst = inst;
+	h->el = conn->el;
+	h->fd = -1;
+	fr_dlist_talloc_init(&h->sent, sql_trunk_sent_t, entry);
+	talloc_set_destructor(h, _sql_trunk_handle_free);
+
+	memcpy(&mutable, &inst, sizeof(mutable)); /* const issues */
+	MEM(h->handle = sql_handle_alloc(h, mutable));
+
+	ret = inst->driver->sql_async_connect(&want_write, h->handle, inst->config);
+	if (sql_trunk_conn_connect_continue(conn, h, ret, want_write) < 0) {
+		talloc_free(h);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	*h_out = h;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+static void _sql_trunk_conn_close(UNUSED fr_event_list_t *el, void *handle, UNUSED void *uctx)
+{
+	sql_trunk_handle_t	*h = talloc_get_type_abort(handle, sql_trunk_handle_t);
+
+	talloc_free(h);
+}
+
+static fr_connection_t *sql_trunk_conn_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+					     fr_connection_conf_t const *conf,
+					     char const *log_prefix, void *uctx)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+	rlm_sql_t const		*inst = t->inst;
+	fr_connection_t		*conn;
+
+	conn = fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = _sql_trunk_conn_init,
+					.close = _sql_trunk_conn_close
+				   },
+				   conf,
+				   log_prefix,
+				   t);
+	if (!conn) {
+		PERROR("Failed allocating state handler for new connection");
+		return NULL;
+	}
+
+	return conn;
+}
+
+static void sql_trunk_conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+static void sql_trunk_conn_writable(fr_event_list_t *el, int fd, int flags, void *uctx);
+
+static void sql_trunk_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				 int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	sql_trunk_handle_t	*h = talloc_get_type_abort(tconn->conn->h, sql_trunk_handle_t);
+	rlm_sql_t const		*inst = h->inst;
+
+	ERROR("Connection failed: %s", fr_syserror(fd_errno));
+
+	fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+}
+
+/** Register for the events the trunk wants, and writable events if we have data to flush
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the events couldn't be inserted.  The connection has been
+ *	  signalled to reconnect, and may have been freed.
+ */
+static int sql_trunk_conn_events_update(fr_trunk_connection_t *tconn, sql_trunk_handle_t *h)
+{
+	rlm_sql_t const		*inst = h->inst;
+	fr_event_fd_cb_t	read_fn = NULL;
+	fr_event_fd_cb_t	write_fn = NULL;
+
+	switch (h->events) {
+	case FR_TRUNK_CONN_EVENT_NONE:
+		break;
+
+	case FR_TRUNK_CONN_EVENT_READ:
+		read_fn = sql_trunk_conn_readable;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_WRITE:
+		write_fn = sql_trunk_conn_writable;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_BOTH:
+		read_fn = sql_trunk_conn_readable;
+		write_fn = sql_trunk_conn_writable;
+		break;
+	}
+
+	if (h->flush_pending) write_fn = sql_trunk_conn_writable;
+
+	/*
+	 *	Nothing outstanding, stop listening
+	 *	for events.
+	 */
+	if (!read_fn && !write_fn) {
+		(void) fr_event_fd_delete(h->el, h->fd, FR_EVENT_FILTER_IO);
+		return 0;
+	}
+
+	if (fr_event_fd_insert(h, h->el, h->fd, read_fn, write_fn, sql_trunk_conn_error, tconn) < 0) {
+		PERROR("Failed inserting FD event");
+
+		/*
+		 *	May free the connection!
+		 */
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Write out query data the driver has buffered
+ *
+ * @return
+ *	- 0 if everything was written, or the driver doesn't buffer.
+ *	- 1 if data remains, and we're waiting for the connection to become writable.
+ *	- -1 if the connection failed, and has been signalled to reconnect.
+ */
+static int sql_trunk_flush(fr_trunk_connection_t *tconn, sql_trunk_handle_t *h)
+{
+	rlm_sql_t const		*inst = h->inst;
+	bool			was_pending = h->flush_pending;
+
+	if (!inst->driver->sql_async_flush) return 0;
+
+	switch (inst->driver->sql_async_flush(h->handle, inst->config)) {
+	case RLM_SQL_OK:
+		h->flush_pending = false;
+		break;
+
+	case RLM_SQL_PENDING:
+		h->flush_pending = true;
+		break;
+
+	default:
+		ERROR("Connection failed writing queries");
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return -1;
+	}
+
+	if ((h->flush_pending != was_pending) && (sql_trunk_conn_events_update(tconn, h) < 0)) return -1;
+
+	return h->flush_pending ? 1 : 0;
+}
+
+static void sql_trunk_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	sql_trunk_handle_t	*h = talloc_get_type_abort(tconn->conn->h, sql_trunk_handle_t);
+
+	/*
+	 *	Finish writing the queries we've already sent
+	 *	before writing any more.
+	 */
+	if (h->flush_pending && (sql_trunk_flush(tconn, h) != 0)) return;
+
+	if ((h->events == FR_TRUNK_CONN_EVENT_WRITE) || (h->events == FR_TRUNK_CONN_EVENT_BOTH)) {
+		fr_trunk_connection_signal_writable(tconn);
+	}
+}
+
+static void sql_trunk_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+				  UNUSED fr_event_list_t *el,
+				  fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	sql_trunk_handle_t	*h = talloc_get_type_abort(conn->h, sql_trunk_handle_t);
+
+	h->events = notify_on;
+	(void) sql_trunk_conn_events_update(tconn, h);
+}
+
+/** Mark a value for escaping when the query is sent
+ *
+ * The escaping functions of some drivers need the connection the query is
+ * written to, which isn't known until the query is muxed.  Values are
+ * length prefixed, so nothing in them can be mistaken for query text.
+ */
+static size_t sql_trunk_escape_mark(UNUSED request_t *request, char *out, size_t outlen,
+				    char const *in, UNUSED void *arg)
+{
+	int len;
+
+	/*
+	 *	Truncated values fail the length check in
+	 *	sql_trunk_query_escape(), and are never sent.
+	 */
+	len = snprintf(out, outlen, "%c%zu:%s", SQL_TRUNK_MARK, strlen(in), in);
+	if (len < 0) return 0;
+
+	return len;
+}
+
+/** Escape the values marked by #sql_trunk_escape_mark
+ *
+ * @param[in] ctx	To allocate the escaped query in.
+ * @param[in] request	The query belongs to.
+ * @param[in] inst	Instance of rlm_sql.
+ * @param[in] handle	Connection the query is written to.
+ * @param[in] in	Marked query.
+ * @param[in] inlen	Length of the marked query.
+ * @return
+ *	- The escaped query.
+ *	- NULL if a marked value was malformed.
+ */
+static char *sql_trunk_query_escape(TALLOC_CTX *ctx, request_t *request, rlm_sql_t const *inst,
+				    rlm_sql_handle_t *handle, char const *in, size_t inlen)
+{
+	char const	*p = in, *end = in + inlen;
+	char		*out;
+
+	MEM(out = talloc_typed_strdup(ctx, ""));
+
+	while (p < end) {
+		char const	*mark;
+		char		*q, *value, *escaped;
+		unsigned long	len;
+		size_t		escaped_len;
+
+		mark = memchr(p, SQL_TRUNK_MARK, end - p);
+		if (!mark) {
+			MEM(out = talloc_strndup_append_buffer(out, p, end - p));
+			break;
+		}
+		MEM(out = talloc_strndup_append_buffer(out, p, mark - p));
+
+		if (!isdigit((uint8_t)mark[1])) {
+		error:
+			talloc_free(out);
+			return NULL;
+		}
+
+		len = strtoul(mark + 1, &q, 10);
+		if ((q >= end) || (*q != ':') || (len > (size_t)(end - q - 1))) goto error;
+		q++;
+
+		/*
+		 *	xlat escapes the result of an alternation
+		 *	again, so marked values may be nested.
+		 */
+		value = sql_trunk_query_escape(ctx, request, inst, handle, q, len);
+		if (!value) goto error;
+
+		escaped_len = talloc_array_length(value) * 3;
+		MEM(escaped = talloc_array(ctx, char, escaped_len));
+		inst->sql_escape_func(request, escaped, escaped_len, value, handle);
+		MEM(out = talloc_strdup_append_buffer(out, escaped));
+
+		talloc_free(value);
+		talloc_free(escaped);
+
+		p = q + len;
+	}
+
+	return out;
+}
+
+static void sql_trunk_request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, void *uctx);
+
+/** Escape and send queries
+ *
+ * Queries are expanded when they're enqueued, but escaping happens here,
+ * as the escaping function needs the connection the query is written to.
+ */
+static void sql_trunk_request_mux(UNUSED fr_event_list_t *el,
+				  fr_trunk_connection_t *tconn, fr_connection_t *conn, void *uctx)
+{
+	sql_trunk_handle_t	*h = talloc_get_type_abort(conn->h, sql_trunk_handle_t);
+	rlm_sql_t const		*inst = h->inst;
+	fr_trunk_request_t	*treq;
+	bool			sent = false;
+
+	/*
+	 *	The connection can't take any more until the
+	 *	driver has written out what it's buffered.
+	 */
+	if (h->flush_pending && (sql_trunk_flush(tconn, h) != 0)) return;
+
+	while (fr_trunk_connection_pop_request(&treq, tconn) == 0) {
+		sql_trunk_request_t	*preq = talloc_get_type_abort(treq->preq, sql_trunk_request_t);
+		sql_trunk_result_t	*r = treq->rctx;
+		request_t		*request = treq->request;
+
+		if (!*preq->query_marked) {
+			r->empty = true;
+			fr_trunk_request_signal_complete(treq);
+			continue;
+		}
+
+		preq->query = sql_trunk_query_escape(preq, request, inst, h->handle,
+						     preq->query_marked, talloc_array_length(preq->query_marked) - 1);
+		if (!preq->query) {
+			REDEBUG("Failed escaping query");
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		/*
+		 *	Only accounting and post-auth queries are
+		 *	logged, the same as with the pool.
+		 */
+		if (preq->section) rlm_sql_query_log(inst, request, preq->section, preq->query);
+
+		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", preq->query);
+		switch (inst->driver->sql_async_send(h->handle, inst->config, preq->query)) {
+		case RLM_SQL_OK:
+			break;
+
+		case RLM_SQL_RECONNECT:
+			/*
+			 *	Request stays pending, and will be
+			 *	moved to another connection.
+			 */
+			TALLOC_FREE(preq->query);
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+
+		default:
+			rlm_sql_print_error(inst, request, h->handle, false);
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		MEM(preq->sent = talloc_zero(h, sql_trunk_sent_t));
+		preq->sent->preq = preq;
+		fr_dlist_insert_tail(&h->sent, preq->sent);
+
+		fr_trunk_request_signal_sent(treq);
+		sent = true;
+
+		/*
+		 *	Stop if the driver couldn't write the query
+		 *	out.  We'll be called again once it has.
+		 */
+		if (sql_trunk_flush(tconn, h) != 0) return;
+	}
+
+	/*
+	 *	Drivers may read the result while sending the
+	 *	query, in which case the socket won't become
+	 *	readable again.
+	 */
+	if (sent) sql_trunk_request_demux(tconn, conn, uctx);
+}
+
+/** Retrieve results for the queries we've sent
+ *
+ */
+static void sql_trunk_request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	sql_trunk_handle_t	*h = talloc_get_type_abort(conn->h, sql_trunk_handle_t);
+	rlm_sql_t const		*inst = h->inst;
+	sql_trunk_sent_t	*sent;
+
+	/*
+	 *	Some drivers must write out buffered data
+	 *	before the server will answer.
+	 */
+	if (h->flush_pending && (sql_trunk_flush(tconn, h) < 0)) return;
+
+	while ((sent = fr_dlist_head(&h->sent))) {
+		sql_trunk_request_t	*preq = sent->preq;
+		fr_trunk_request_t	*treq;
+		sql_trunk_result_t	*r;
+		request_t		*request;
+		sql_rcode_t		ret;
+		int			affected_rows = 0;
+		rlm_sql_row_t		*rows = NULL;
+
+		/*
+		 *	Rows are allocated in the request, so they
+		 *	outlive the connection's result data.
+		 */
+		if (preq && preq->want_rows) {
+			ret = inst->driver->sql_async_read(&affected_rows, preq->treq->request, &rows,
+							   h->handle, inst->config);
+		} else {
+			ret = inst->driver->sql_async_read(&affected_rows, NULL, NULL, h->handle, inst->config);
+		}
+		if (ret == RLM_SQL_PENDING) return;
+		if (ret == RLM_SQL_RECONNECT) {
+			ERROR("Connection lost waiting for query result");
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		fr_dlist_remove(&h->sent, sent);
+		talloc_free(sent);
+
+		/*
+		 *	Request was cancelled, discard the result.
+		 */
+		if (!preq) continue;
+		preq->sent = NULL;
+
+		treq = preq->treq;
+		r = treq->rctx;
+		request = treq->request;
+
+		if ((ret != RLM_SQL_OK) && (ret != RLM_SQL_ALT_QUERY)) rlm_sql_print_error(inst, request, h->handle, false);
+
+		r->rcode = ret;
+		r->affected_rows = affected_rows;
+		r->rows = rows;
+
+		fr_trunk_request_signal_complete(treq);
+	}
+}
+
+/** Disassociate the request from the connection
+ *
+ * If the query has already been sent, the result will still arrive, so we
+ * leave a placeholder in the sent list for the demuxer to discard.
+ */
+static void sql_trunk_request_conn_release(UNUSED fr_connection_t *conn, void *preq_to_reset, UNUSED void *uctx)
+{
+	sql_trunk_request_t	*preq = talloc_get_type_abort(preq_to_reset, sql_trunk_request_t);
+
+	if (preq->sent) {
+		preq->sent->preq = NULL;
+		preq->sent = NULL;
+	}
+	TALLOC_FREE(preq->query);
+}
+
+static void sql_trunk_request_complete(request_t *request, UNUSED void *preq, void *rctx, UNUSED void *uctx)
+{
+	sql_trunk_result_t	*r = rctx;
+
+	r->treq = NULL;
+
+	unlang_interpret_mark_resumable(request);
+}
+
+static void sql_trunk_request_fail(request_t *request, UNUSED void *preq, void *rctx,
+				   UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	sql_trunk_result_t	*r = rctx;
+
+	r->rcode = RLM_SQL_ERROR;
+	r->treq = NULL;
+
+	unlang_interpret_mark_resumable(request);
+}
+
+static void sql_trunk_request_free(UNUSED request_t *request, void *preq_to_free, UNUSED void *uctx)
+{
+	sql_trunk_request_t	*preq = talloc_get_type_abort(preq_to_free, sql_trunk_request_t);
+
+	fr_assert(!preq->sent && !preq->query);	/* Dealt with by request_conn_release */
+
+	talloc_free(preq);
+}
+
+/** Allocate the trunk for a thread
+ *
+ * @param[in] t		Thread instance to allocate the trunk in.
+ *			t->inst must already be set.
+ * @param[in] el	Thread's event list.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sql_trunk_thread_instantiate(rlm_sql_thread_t *t, fr_event_list_t *el)
+{
+	rlm_sql_t const			*inst = t->inst;
+	static fr_trunk_io_funcs_t	io_funcs = {
+						.connection_alloc = sql_trunk_conn_alloc,
+						.connection_notify = sql_trunk_conn_notify,
+						.request_mux = sql_trunk_request_mux,
+						.request_demux = sql_trunk_request_demux,
+						.request_conn_release = sql_trunk_request_conn_release,
+						.request_complete = sql_trunk_request_complete,
+						.request_fail = sql_trunk_request_fail,
+						.request_free = sql_trunk_request_free
+					};
+
+	t->el = el;
+	t->trunk = fr_trunk_alloc(t, el, &io_funcs, &inst->config->trunk_conf, inst->name, t, false);
+	if (!t->trunk) return -1;
+
+	return 0;
+}
+
+/** Enqueue a query on the thread's trunk
+ *
+ * The caller should yield after this returns successfully, and will be
+ * resumed once the result is written to r.
+ *
+ * @param[out] r	Where to write the result.  Must remain valid until the
+ *			request is resumed, or #sql_trunk_cancel is called.
+ * @param[in] t		Thread instance.
+ * @param[in] request	The current request.
+ * @param[in] section	The query came from.  NULL if the query shouldn't be logged.
+ * @param[in] query	to expand and run.  Expanded immediately, and escaped
+ *			once the query is written to a connection.
+ * @param[in] want_rows	Write the rows the query returns to r->rows.  The caller
+ *			must free them.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sql_trunk_enqueue(sql_trunk_result_t *r, rlm_sql_thread_t *t, request_t *request,
+		      sql_acct_section_t *section, char const *query, bool want_rows)
+{
+	fr_trunk_request_t	*treq;
+	sql_trunk_request_t	*preq;
+	char			*marked;
+
+	*r = (sql_trunk_result_t){ .rcode = RLM_SQL_ERROR };
+
+	if (strchr(query, SQL_TRUNK_MARK)) {
+		REDEBUG("Query must not contain \\001");
+		return -1;
+	}
+
+	/*
+	 *	Expand the query now, while we're running
+	 *	in the context of the request.
+	 */
+	if (xlat_aeval(request, &marked, request, query, sql_trunk_escape_mark, NULL) < 0) return -1;
+
+	treq = fr_trunk_request_alloc(t->trunk, request);
+	if (!treq) {
+		talloc_free(marked);
+		return -1;
+	}
+
+	MEM(preq = talloc_zero(treq, sql_trunk_request_t));
+	preq->treq = treq;
+	preq->section = section;
+	preq->query_marked = talloc_steal(preq, marked);
+	preq->want_rows = want_rows;
+
+	if (fr_trunk_request_enqueue(&treq, t->trunk, request, preq, r) < 0) {
+		fr_trunk_request_free(&treq);	/* Return to the free list, and free preq */
+		return -1;
+	}
+	r->treq = treq;
+
+	return 0;
+}
+
+/** Cancel an outstanding query
+ *
+ * If the query has already been sent its result is discarded.
+ *
+ * @param[in] r		Result of the query to cancel.
+ */
+void sql_trunk_cancel(sql_trunk_result_t *r)
+{
+	if (!r->treq) return;
+
+	fr_trunk_request_signal_cancel(r->treq);
+	r->treq = NULL;
+}
@@ -31,12 +31,31 @@ RCSID("$Id$")
 #include <rlm_sql.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/radius/radius.h>
+#include <freeradius-devel/unlang/interpret.h>
 
 #include <ctype.h>
 
 
 #define MAX_QUERY_LEN 4096
 
+/** Configuration for pre-reserving addresses
+ *
+ */
+typedef struct {
+	uint32_t	size;			//!< How many addresses each thread claims at once.
+	fr_time_delta_t	lifetime;		//!< How long claimed addresses are held before
+						///< unused ones are returned to the pool.
+} rlm_sqlippool_reserve_config_t;
+
+/** Configuration for batched writes
+ *
+ */
+typedef struct {
+	bool		enable;			//!< Whether updates and releases are batched.
+	fr_time_delta_t	interval;		//!< Longest time a write waits before it's committed.
+	uint32_t	max_size;		//!< Commit the batch as soon as it has this many writes.
+} rlm_sqlippool_batch_config_t;
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -59,9 +78,16 @@ typedef struct {
 	char const	*alloc_find;		//!< SQL query to find an unused IP.
 	char const	*alloc_update;		//!< SQL query to mark an IP as used.
 	char const	*alloc_commit;		//!< SQL query to commit.
+	char const	*alloc_rollback;	//!< SQL query to roll back a failed batch.
 
 	char const	*pool_check;		//!< Query to check for the existence of the pool.
 
+						/* Pre-reservation sequence */
+	char const	*reserve_find;		//!< SQL query to find a block of unused IPs.
+	char const	*reserve_claim;		//!< SQL query to mark a block of IPs as reserved.
+	char const	*reserve_alloc;		//!< SQL query to mark a reserved IP as used.
+	char const	*reserve_return;	//!< SQL query to return unused reserved IPs.
+
 						/* Update sequence */
 	char const	*update_begin;		//!< SQL query to begin.
 	char const	*update_free;		//!< SQL query to clear offered IPs
@@ -93,8 +119,48 @@ typedef struct {
 						/* Reserved to handle 255.255.255.254 Requests */
 	char const	*defaultpool;		//!< Default Pool-Name if there is none in the check items.
 
+	rlm_sqlippool_reserve_config_t reserve;	//!< Pre-reservation configuration.
+	rlm_sqlippool_batch_config_t batch;	//!< Batched write configuration.
 } rlm_sqlippool_t;
 
+/** Per-thread state for rlm_sqlippool
+ *
+ */
+typedef struct {
+	rlm_sqlippool_t const	*inst;		//!< Instance of rlm_sqlippool.
+	fr_event_list_t		*el;		//!< Event list for the reservation and batch timers.
+	rbtree_t		*reserved;	//!< Addresses claimed by this thread, by pool name.
+
+	fr_dlist_head_t		writes;		//!< Updates and releases waiting to be committed.
+	fr_event_timer_t const	*ev;		//!< When the batch must be committed.
+} rlm_sqlippool_thread_t;
+
+/** A block of addresses claimed from one pool
+ *
+ */
+typedef struct {
+	rlm_sqlippool_thread_t	*t;		//!< Thread which owns the block.
+	char			*pool;		//!< Name of the pool the addresses were claimed from.
+	char			*pool_escaped;	//!< Pool name, escaped for use in queries.
+	char			**addresses;	//!< Addresses claimed.
+	uint32_t		next;		//!< Next address to hand out.
+	uint32_t		num;		//!< How many addresses were claimed.
+	fr_event_timer_t const	*ev;		//!< When unused addresses are returned.
+} rlm_sqlippool_reserved_t;
+
+/** An expanded update or release, waiting to be committed
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the thread's list of writes.
+	request_t		*request;	//!< Request which produced the write.
+	char			*queries[2];	//!< Queries to run, in order.  Either may be NULL.
+	int			affected;	//!< Rows affected by the last query, -1 on error,
+						///< or if the write wasn't run.
+	bool			queued;		//!< The write hasn't been committed yet.
+	bool			yielded;	//!< The request is waiting for the batch to be committed.
+} rlm_sqlippool_write_t;
+
 static CONF_PARSER message_config[] = {
 	{ FR_CONF_OFFSET("exists", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, log_exists) },
 	{ FR_CONF_OFFSET("success", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, log_success) },
@@ -104,6 +170,19 @@ static CONF_PARSER message_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static CONF_PARSER reserve_config[] = {
+	{ FR_CONF_OFFSET("size", FR_TYPE_UINT32, rlm_sqlippool_t, reserve.size), .dflt = "0" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_TIME_DELTA, rlm_sqlippool_t, reserve.lifetime), .dflt = "30" },
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER batch_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_sqlippool_t, batch.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("interval", FR_TYPE_TIME_DELTA, rlm_sqlippool_t, batch.interval), .dflt = "0.01" },
+	{ FR_CONF_OFFSET("max_size", FR_TYPE_UINT32, rlm_sqlippool_t, batch.max_size), .dflt = "64" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("sql_module_instance", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_sqlippool_t, sql_instance_name), .dflt = "sql" },
 
@@ -130,10 +209,21 @@ static CONF_PARSER module_config[] = {
 
 	{ FR_CONF_OFFSET("alloc_commit", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, alloc_commit), .dflt = "COMMIT" },
 
+	{ FR_CONF_OFFSET("alloc_rollback", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, alloc_rollback), .dflt = "ROLLBACK" },
+
 
 	{ FR_CONF_OFFSET("pool_check", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, pool_check) },
 
 
+	{ FR_CONF_OFFSET("reserve_find", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, reserve_find) },
+
+	{ FR_CONF_OFFSET("reserve_claim", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, reserve_claim) },
+
+	{ FR_CONF_OFFSET("reserve_alloc", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, reserve_alloc) },
+
+	{ FR_CONF_OFFSET("reserve_return", FR_TYPE_STRING, rlm_sqlippool_t, reserve_return) },
+
+
 	{ FR_CONF_OFFSET("update_begin", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, update_begin) },
 
 	{ FR_CONF_OFFSET("update_free", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, update_free) },
@@ -164,6 +254,10 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("mark_commit", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, mark_commit) },
 
 
+	{ FR_CONF_POINTER("reserve", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) reserve_config },
+
+	{ FR_CONF_POINTER("batch", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) batch_config },
+
 	{ FR_CONF_POINTER("messages", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) message_config },
 	CONF_PARSER_TERMINATOR
 };
@@ -197,10 +291,13 @@ fr_dict_attr_autoload_t rlm_sqlippool_dict_attr[] = {
  *	%P	pool_name
  *	%I	param
  *	%J	lease_duration
+ *	%G	pool the reserved addresses were claimed from
+ *	%N	reserve.size
+ *	%L	reserve.lifetime
  *
  */
 static int sqlippool_expand(char * out, int outlen, char const * fmt,
-			    rlm_sqlippool_t const *data, char * param, int param_len)
+			    rlm_sqlippool_t const *data, char const *pool, char * param, int param_len)
 {
 	char *q;
 	char const *p;
@@ -249,6 +346,22 @@ static int sqlippool_expand(char * out, int outlen, char const * fmt,
 				strlcpy(q, tmp, freespace);
 				q += strlen(q);
 				break;
+			case 'G': /* pool of reserved addresses */
+				if (pool) {
+					strlcpy(q, pool, freespace);
+					q += strlen(q);
+				}
+				break;
+			case 'N': /* reserve size */
+				sprintf(tmp, "%u", data->reserve.size);
+				strlcpy(q, tmp, freespace);
+				q += strlen(q);
+				break;
+			case 'L': /* reserve lifetime */
+				sprintf(tmp, "%" PRIu64, (uint64_t)fr_time_delta_to_sec(data->reserve.lifetime));
+				strlcpy(q, tmp, freespace);
+				q += strlen(q);
+				break;
 
 			default:
 				*q++ = '%';
@@ -266,6 +379,74 @@ static int sqlippool_expand(char * out, int outlen, char const * fmt,
 	return strlen(out);
 }
 
+/** Expand an sqlippool query
+ *
+ * Performs the sqlippool sequence substitutions, then expands the format string.
+ *
+ * @param[out] out	Where to write the expanded query.
+ * @param[in] ctx	to allocate the expanded query in.
+ * @param[in] fmt	sql query to expand.
+ * @param[in] handle	sql connection handle, used for escaping.
+ * @param[in] data	Instance of rlm_sqlippool.
+ * @param[in] request	Current request.  If NULL, only the sqlippool
+ *			substitutions are performed.
+ * @param[in] pool	escaped name of the pool, for %G.  May be NULL.
+ * @param[in] param	ip address string.
+ * @param[in] param_len	ip address string len.
+ * @return
+ *	- 0 on success.
+ *	- < 0 on error.
+ */
+static int sqlippool_command_expand(TALLOC_CTX *ctx, char **out, char const *fmt, rlm_sql_handle_t *handle,
+				    rlm_sqlippool_t const *data, request_t *request,
+				    char const *pool, char *param, int param_len)
+{
+	char query[MAX_QUERY_LEN];
+
+	/*
+	 *	@todo this needs to die (should just be done in xlat expansion)
+	 */
+	sqlippool_expand(query, sizeof(query), fmt, data, pool, param, param_len);
+
+	if (!request) {
+		MEM(*out = talloc_typed_strdup(ctx, query));
+		return 0;
+	}
+
+	if (xlat_aeval(ctx, out, request, query, data->sql_inst->sql_escape_func, handle) < 0) return -1;
+
+	return 0;
+}
+
+/** Run an expanded sqlippool query
+ *
+ * @param query		to run.
+ * @param handle	sql connection handle.
+ * @param data		Instance of rlm_sqlippool.
+ * @param request	Current request.  May be NULL.
+ * @return
+ *	- Number of rows affected on success.
+ *	- < 0 on error.
+ */
+static int sqlippool_command_run(char const *query, rlm_sql_handle_t **handle,
+				 rlm_sqlippool_t const *data, request_t *request)
+{
+	int affected;
+
+	if (data->sql_inst->sql_query(data->sql_inst, request, handle, query) < 0) return -1;
+
+	/*
+	 *	No handle, we can't continue.
+	 */
+	if (!*handle) return -1;
+
+	affected = (data->sql_inst->driver->sql_affected_rows)(*handle, data->sql_inst->config);
+
+	(data->sql_inst->driver->sql_finish_query)(*handle, data->sql_inst->config);
+
+	return affected;
+}
+
 /** Perform a single sqlippool query
  *
  * Mostly wrapper around sql_query which does some special sqlippool sequence substitutions and expands
@@ -274,22 +455,20 @@ static int sqlippool_expand(char * out, int outlen, char const * fmt,
  * @param fmt sql query to expand.
  * @param handle sql connection handle.
  * @param data Instance of rlm_sqlippool.
- * @param request Current request.
+ * @param request Current request.  If NULL, the query is not xlat expanded.
+ * @param pool escaped name of the pool, for %G.  May be NULL.
  * @param param ip address string.
  * @param param_len ip address string len.
  * @return
- *	- 0 on success.
+ *	- Number of rows affected on success.
  *	- < 0 on error.
  */
 static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
 			     rlm_sqlippool_t const *data, request_t *request,
-			     char *param, int param_len)
+			     char const *pool, char *param, int param_len)
 {
-	char query[MAX_QUERY_LEN];
 	char *expanded = NULL;
-
 	int ret;
-	int affected;
 
 	/*
 	 *	If we don't have a command, do nothing.
@@ -301,38 +480,20 @@ static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
 	 */
 	if (!handle || !*handle) return -1;
 
-	/*
-	 *	@todo this needs to die (should just be done in xlat expansion)
-	 */
-	sqlippool_expand(query, sizeof(query), fmt, data, param, param_len);
+	if (sqlippool_command_expand(NULL, &expanded, fmt, *handle, data, request, pool, param, param_len) < 0) return -1;
 
-	if (xlat_aeval(request, &expanded, request, query, data->sql_inst->sql_escape_func, *handle) < 0) return -1;
-
-	ret = data->sql_inst->sql_query(data->sql_inst, request, handle, expanded);
-	if (ret < 0){
-		talloc_free(expanded);
-		return -1;
-	}
+	ret = sqlippool_command_run(expanded, handle, data, request);
 	talloc_free(expanded);
 
-	/*
-	 *	No handle, we can't continue.
-	 */
-	if (!*handle) return -1;
-
-	affected = (data->sql_inst->driver->sql_affected_rows)(*handle, data->sql_inst->config);
-
-	(data->sql_inst->driver->sql_finish_query)(*handle, data->sql_inst->config);
-
-	return affected;
+	return ret;
 }
 
 /*
  *	Don't repeat yourself
  */
 #undef DO
-#define DO(_x) if(sqlippool_command(inst->_x, handle, inst, request, NULL, 0) < 0) return RLM_MODULE_FAIL
-#define DO_PART(_x) if(sqlippool_command(inst->_x, &handle, inst, request, NULL, 0) <0) goto error
+#define DO(_x) if(sqlippool_command(inst->_x, handle, inst, request, NULL, NULL, 0) < 0) return RLM_MODULE_FAIL
+#define DO_PART(_x) if(sqlippool_command(inst->_x, &handle, inst, request, NULL, NULL, 0) <0) goto error
 
 /*
  * Query the database expecting a single result row
@@ -351,7 +512,7 @@ static int CC_HINT(nonnull (1, 3, 4, 5)) sqlippool_query1(char *out, int outlen,
 	/*
 	 *	@todo this needs to die (should just be done in xlat expansion)
 	 */
-	sqlippool_expand(query, sizeof(query), fmt, data, param, param_len);
+	sqlippool_expand(query, sizeof(query), fmt, data, NULL, param, param_len);
 
 	*out = '\0';
 
@@ -399,6 +560,428 @@ finish:
 	return retval;
 }
 
+static int sqlippool_reserved_cmp(void const *one, void const *two)
+{
+	rlm_sqlippool_reserved_t const *a = one, *b = two;
+
+	return strcmp(a->pool, b->pool);
+}
+
+/** Build a list of quoted addresses, for use in an IN (...) clause
+ *
+ * The addresses were validated when they were claimed, so don't need escaping.
+ */
+static char *sqlippool_address_list(TALLOC_CTX *ctx, char * const *addresses, uint32_t num)
+{
+	char		*list;
+	uint32_t	i;
+
+	MEM(list = talloc_typed_strdup(ctx, ""));
+	for (i = 0; i < num; i++) {
+		MEM(list = talloc_asprintf_append_buffer(list, "%s'%s'", (i > 0) ? "," : "", addresses[i]));
+	}
+
+	return list;
+}
+
+/** Return any addresses in a block which haven't been handed out, then free it
+ *
+ * @param[in] block	to return.
+ * @param[in] request	Current request.  NULL if the addresses are being returned
+ *			on a timer, or because the thread is exiting.
+ * @param[in] handle	to use.  If NULL, a connection is reserved from the pool.
+ */
+static void sqlippool_reserved_return(rlm_sqlippool_reserved_t *block, request_t *request,
+				      rlm_sql_handle_t **handle)
+{
+	rlm_sqlippool_thread_t	*t = block->t;
+	rlm_sqlippool_t const	*inst = t->inst;
+	rlm_sql_handle_t	*our_handle = NULL;
+	char			*list;
+	uint32_t		unused = block->num - block->next;
+
+	rbtree_deletebydata(t->reserved, block);
+
+	if ((unused == 0) || !inst->reserve_return || !*inst->reserve_return) goto finish;
+
+	if (!handle) {
+		our_handle = fr_pool_connection_get(inst->sql_inst->pool, request);
+		if (!our_handle) {
+			ROPTIONAL(RWARN, WARN, "Failed reserving SQL connection, %u reserved addresses in pool "
+				  "\"%s\" will be held until their reservation expires", unused, block->pool);
+			goto finish;
+		}
+		handle = &our_handle;
+	}
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Returning %u unused addresses to pool \"%s\"", unused, block->pool);
+
+	list = sqlippool_address_list(NULL, block->addresses + block->next, unused);
+	if (sqlippool_command(inst->reserve_return, handle, inst, NULL,
+			      block->pool_escaped, list, strlen(list)) < 0) {
+		ROPTIONAL(RWARN, WARN, "Failed returning reserved addresses to pool \"%s\"", block->pool);
+	}
+	talloc_free(list);
+
+	if (our_handle) fr_pool_connection_release(inst->sql_inst->pool, request, our_handle);
+
+finish:
+	talloc_free(block);
+}
+
+/** Return unused addresses once their reservation has expired
+ *
+ */
+static void _sqlippool_reserved_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_sqlippool_reserved_t *block = talloc_get_type_abort(uctx, rlm_sqlippool_reserved_t);
+
+	block->ev = NULL;
+	sqlippool_reserved_return(block, NULL, NULL);
+}
+
+/** Claim a block of unused addresses from a pool
+ *
+ * The addresses are found and marked as reserved in a single transaction,
+ * and are then handed out by this thread without touching the rest of
+ * the pool.
+ *
+ * @param[out] out	The new block.  NULL if the pool has no free addresses.
+ * @param[in] t		Thread specific data.
+ * @param[in] handle	sql connection handle.
+ * @param[in] request	Current request.
+ * @param[in] pool	name.
+ * @return
+ *	- 0 on success.
+ *	- < 0 on error.
+ */
+static int sqlippool_reserved_claim(rlm_sqlippool_reserved_t **out, rlm_sqlippool_thread_t *t,
+				    rlm_sql_handle_t **handle, request_t *request, char const *pool)
+{
+	rlm_sqlippool_t const		*inst = t->inst;
+	rlm_sqlippool_reserved_t	*block;
+	rlm_sql_row_t			row;
+	char				*expanded = NULL, *list;
+	char				escaped[256];
+	fr_type_t			type = inst->allocated_address_da->type;
+
+	*out = NULL;
+
+	MEM(block = talloc_zero(t, rlm_sqlippool_reserved_t));
+	block->t = t;
+	MEM(block->pool = talloc_typed_strdup(block, pool));
+	MEM(block->addresses = talloc_zero_array(block, char *, inst->reserve.size));
+
+	inst->sql_inst->sql_escape_func(request, escaped, sizeof(escaped), pool, *handle);
+	MEM(block->pool_escaped = talloc_typed_strdup(block, escaped));
+
+	if (sqlippool_command(inst->alloc_begin, handle, inst, request, NULL, NULL, 0) < 0) {
+	error:
+		talloc_free(block);
+		return -1;
+	}
+
+	if (sqlippool_command_expand(NULL, &expanded, inst->reserve_find, *handle,
+				     inst, request, block->pool_escaped, NULL, 0) < 0) goto error;
+
+	if ((inst->sql_inst->sql_select_query(inst->sql_inst, request, handle, expanded) != RLM_SQL_OK) || !*handle) {
+		REDEBUG("Failed finding addresses to reserve");
+		talloc_free(expanded);
+		goto error;
+	}
+	talloc_free(expanded);
+
+	while ((block->num < inst->reserve.size) &&
+	       (inst->sql_inst->sql_fetch_row(&row, inst->sql_inst, request, handle) == RLM_SQL_OK) && row) {
+		fr_value_box_t	box;
+
+		if (!row[0]) continue;
+
+		/*
+		 *	Addresses are written into queries without
+		 *	escaping, so they must be valid.
+		 */
+		if (fr_value_box_from_str(NULL, &box, &type, NULL, row[0], -1, '\0', true) < 0) {
+			RWDEBUG("Ignoring invalid address \"%s\" returned by reserve_find", row[0]);
+			continue;
+		}
+		fr_value_box_clear(&box);
+
+		MEM(block->addresses[block->num++] = talloc_typed_strdup(block->addresses, row[0]));
+	}
+	(inst->sql_inst->driver->sql_finish_select_query)(*handle, inst->sql_inst->config);
+
+	if (block->num == 0) {
+		if (sqlippool_command(inst->alloc_commit, handle, inst, request, NULL, NULL, 0) < 0) goto error;
+		talloc_free(block);
+		return 0;
+	}
+
+	list = sqlippool_address_list(NULL, block->addresses, block->num);
+	if (sqlippool_command(inst->reserve_claim, handle, inst, request,
+			      block->pool_escaped, list, strlen(list)) < 0) {
+		talloc_free(list);
+		goto error;
+	}
+	talloc_free(list);
+
+	if (sqlippool_command(inst->alloc_commit, handle, inst, request, NULL, NULL, 0) < 0) goto error;
+
+	if (fr_event_timer_in(block, t->el, &block->ev, inst->reserve.lifetime,
+			      _sqlippool_reserved_timer, block) < 0) {
+		RPERROR("Failed inserting reservation timer");
+		sqlippool_reserved_return(block, request, handle);
+		return -1;
+	}
+
+	rbtree_insert(t->reserved, block);
+
+	RDEBUG2("Reserved %u addresses from pool \"%s\"", block->num, pool);
+
+	*out = block;
+
+	return 0;
+}
+
+/** Allocate an address from the ones this thread has reserved
+ *
+ * @param[out] out	Where to write the address.
+ * @param[in] outlen	Size of the output buffer.
+ * @param[in] t		Thread specific data.
+ * @param[in] handle	sql connection handle.
+ * @param[in] request	Current request.
+ * @return
+ *	- > 0 on success (length of data written to out).
+ *	- 0 if there are no free addresses in the pool.
+ *	- < 0 on error.
+ */
+static int sqlippool_reserved_alloc(char *out, size_t outlen, rlm_sqlippool_thread_t *t,
+				    rlm_sql_handle_t **handle, request_t *request)
+{
+	rlm_sqlippool_t const		*inst = t->inst;
+	rlm_sqlippool_reserved_t	*block;
+	fr_pair_t			*vp;
+	char				*pool, *address;
+	int				affected;
+
+	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_name);
+	if (!vp) return 0;
+
+	memcpy(&pool, &vp->vp_strvalue, sizeof(pool));	/* const issues */
+
+	for (;;) {
+		block = rbtree_finddata(t->reserved, &(rlm_sqlippool_reserved_t){ .pool = pool });
+		if (!block) {
+			if (sqlippool_reserved_claim(&block, t, handle, request, pool) < 0) return -1;
+			if (!block) return 0;
+		}
+
+		address = block->addresses[block->next++];
+
+		affected = sqlippool_command(inst->reserve_alloc, handle, inst, request,
+					     block->pool_escaped, address, strlen(address));
+		if (affected > 0) {
+			strlcpy(out, address, outlen);
+
+		/*
+		 *	The reservation expired, and the address
+		 *	was allocated by someone else.
+		 */
+		} else if (affected == 0) {
+			RWDEBUG("Reserved address %s is no longer available", address);
+		}
+
+		if (block->next == block->num) sqlippool_reserved_return(block, request, handle);
+
+		if (affected > 0) return strlen(out);
+		if ((affected < 0) || !*handle) return -1;
+	}
+}
+
+/** Commit all of the writes in the batch, and resume the requests waiting for them
+ *
+ * If alloc_begin starts a transaction, a failed write rolls back the
+ * whole batch, and every write in it fails.  Otherwise each query is
+ * committed as it runs, so only the writes which failed, or which
+ * weren't run because the connection was lost, fail.
+ */
+static void sqlippool_batch_commit(rlm_sqlippool_thread_t *t)
+{
+	rlm_sqlippool_t const	*inst = t->inst;
+	rlm_sqlippool_write_t	*write;
+	rlm_sql_handle_t	*handle;
+	request_t		*request;
+	bool			transaction = (inst->alloc_begin && *inst->alloc_begin);
+	bool			failed = false;
+	size_t			i;
+
+	fr_event_timer_delete(&t->ev);
+
+	write = fr_dlist_head(&t->writes);
+	if (!write) return;
+
+	/*
+	 *	Log against the first request in the batch.
+	 */
+	request = write->request;
+
+	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
+	if (!handle) {
+		REDEBUG("Failed reserving SQL connection");
+		failed = true;
+		goto finish;
+	}
+
+	RDEBUG2("Committing %zu updates and releases", fr_dlist_num_elements(&t->writes));
+
+	if (sqlippool_command(inst->alloc_begin, &handle, inst, request, NULL, NULL, 0) < 0) {
+		failed = true;
+		goto finish;
+	}
+
+	for (write = fr_dlist_head(&t->writes);
+	     write;
+	     write = fr_dlist_next(&t->writes, write)) {
+		write->affected = 0;
+
+		for (i = 0; i < NUM_ELEMENTS(write->queries); i++) {
+			if (!write->queries[i]) continue;
+
+			write->affected = sqlippool_command_run(write->queries[i], &handle, inst, request);
+			if (write->affected < 0) break;
+		}
+		if (write->affected >= 0) continue;
+
+		/*
+		 *	Some databases abort the whole transaction if
+		 *	any query fails, and we can't run any more
+		 *	queries without a connection.
+		 */
+		if (transaction || !handle) {
+			failed = true;
+			break;
+		}
+	}
+
+	if (!handle) goto finish;
+
+	if (failed) {
+		RWDEBUG("Rolling back %zu updates and releases", fr_dlist_num_elements(&t->writes));
+		(void) sqlippool_command(inst->alloc_rollback, &handle, inst, request, NULL, NULL, 0);
+	} else if (sqlippool_command(inst->alloc_commit, &handle, inst, request, NULL, NULL, 0) < 0) {
+		failed = true;
+	}
+
+finish:
+	if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+
+	while ((write = fr_dlist_pop_head(&t->writes))) {
+		write->queued = false;
+		if (failed && transaction) write->affected = -1;
+		if (write->yielded) unlang_interpret_mark_resumable(write->request);
+	}
+}
+
+/** Commit a batch once its interval has passed
+ *
+ */
+static void _sqlippool_batch_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_sqlippool_thread_t *t = talloc_get_type_abort(uctx, rlm_sqlippool_thread_t);
+
+	t->ev = NULL;
+	sqlippool_batch_commit(t);
+}
+
+/** Remove the request's write from the batch if the request is cancelled
+ *
+ */
+static void sqlippool_batch_signal(module_ctx_t const *mctx, UNUSED request_t *request,
+				   void *rctx, fr_state_signal_t action)
+{
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sqlippool_thread_t);
+	rlm_sqlippool_write_t	*write = talloc_get_type_abort(rctx, rlm_sqlippool_write_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (write->queued) fr_dlist_remove(&t->writes, write);
+
+	talloc_free(write);
+}
+
+/** Add an update or release to the thread's batch
+ *
+ * The queries are expanded now, while the request's attributes are
+ * available, and run later with the rest of the batch.
+ *
+ * @param[out] out	The queued write.  Its result is available
+ *			once write->queued is false.
+ * @param[in] t		Thread specific data.
+ * @param[in] request	Current request.
+ * @param[in] fmt	Queries to expand.
+ * @param[in] num	Number of queries.
+ * @return
+ *	- 0 on success.
+ *	- < 0 on error.
+ */
+static int sqlippool_batch_add(rlm_sqlippool_write_t **out, rlm_sqlippool_thread_t *t, request_t *request,
+			       char const * const *fmt, size_t num)
+{
+	rlm_sqlippool_t const	*inst = t->inst;
+	rlm_sqlippool_write_t	*write;
+	rlm_sql_handle_t	*handle;
+	size_t			i;
+
+	fr_assert(num <= NUM_ELEMENTS(write->queries));
+
+	/*
+	 *	The connection is only needed to escape
+	 *	values in the queries.
+	 */
+	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
+	if (!handle) {
+		REDEBUG("Failed reserving SQL connection");
+		return -1;
+	}
+
+	if (inst->sql_inst->sql_set_user(inst->sql_inst, request, NULL) < 0) {
+	error:
+		fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+		return -1;
+	}
+
+	MEM(write = talloc_zero(request, rlm_sqlippool_write_t));
+	write->request = request;
+	write->affected = -1;		/* Until it's been run */
+
+	for (i = 0; i < num; i++) {
+		if (!fmt[i] || !*fmt[i]) continue;
+
+		if (sqlippool_command_expand(write, &write->queries[i], fmt[i], handle,
+					     inst, request, NULL, NULL, 0) < 0) {
+			talloc_free(write);
+			goto error;
+		}
+	}
+	fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+
+	if (!t->ev && (fr_event_timer_in(t, t->el, &t->ev, inst->batch.interval,
+					 _sqlippool_batch_timer, t) < 0)) {
+		RPERROR("Failed inserting batch timer");
+		talloc_free(write);
+		return -1;
+	}
+
+	write->queued = true;
+	fr_dlist_insert_tail(&t->writes, write);
+
+	if (fr_dlist_num_elements(&t->writes) >= inst->batch.max_size) sqlippool_batch_commit(t);
+
+	*out = write;
+
+	return 0;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -462,6 +1045,65 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->reserve.size) {
+		if (!inst->reserve_find || !*inst->reserve_find || !inst->reserve_alloc || !*inst->reserve_alloc) {
+			cf_log_err(conf, "'reserve_find' and 'reserve_alloc' queries are required when "
+				   "'reserve.size' is set");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("reserve.size", inst->reserve.size, <=, 1024);
+		FR_TIME_DELTA_BOUND_CHECK("reserve.lifetime", inst->reserve.lifetime, >=, fr_time_delta_from_sec(1));
+	}
+
+	if (inst->batch.enable) {
+		FR_TIME_DELTA_BOUND_CHECK("batch.interval", inst->batch.interval, >=, fr_time_delta_from_usec(100));
+		FR_TIME_DELTA_BOUND_CHECK("batch.interval", inst->batch.interval, <=, fr_time_delta_from_sec(1));
+		FR_INTEGER_BOUND_CHECK("batch.max_size", inst->batch.max_size, >=, 1);
+	}
+
+	return 0;
+}
+
+/** Set up the thread's reserved addresses and batch
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_sqlippool_t const	*inst = talloc_get_type_abort_const(instance, rlm_sqlippool_t);
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(thread, rlm_sqlippool_thread_t);
+
+	t->inst = inst;
+	t->el = el;
+
+	t->reserved = rbtree_talloc_alloc(t, sqlippool_reserved_cmp, rlm_sqlippool_reserved_t, NULL, 0);
+	if (!t->reserved) {
+		ERROR("Failed creating reservation tree");
+		return -1;
+	}
+	fr_dlist_talloc_init(&t->writes, rlm_sqlippool_write_t, entry);
+
+	return 0;
+}
+
+/** Commit any pending writes, and return any reserved addresses
+ *
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_sqlippool_thread_t		*t = talloc_get_type_abort(thread, rlm_sqlippool_thread_t);
+	rlm_sqlippool_reserved_t	**blocks;
+	uint32_t			i, num;
+
+	sqlippool_batch_commit(t);
+
+	num = rbtree_flatten(t, (void ***) &blocks, t->reserved, RBTREE_IN_ORDER);
+	for (i = 0; i < num; i++) sqlippool_reserved_return(blocks[i], NULL, NULL);
+	talloc_free(blocks);
+
+	TALLOC_FREE(t->reserved);
+
 	return 0;
 }
 
@@ -495,10 +1137,12 @@ static unlang_action_t do_logging(rlm_rcode_t *p_result, UNUSED rlm_sqlippool_t
 static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sqlippool_thread_t);
 	char			allocation[FR_MAX_STRING_LEN];
 	int			allocation_len;
 	fr_pair_t		*vp;
 	rlm_sql_handle_t	*handle;
+	bool			reserved = false;
 
 	/*
 	 *	If there is a Framed-IP-Address attribute in the reply do nothing
@@ -562,9 +1206,20 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 
 	/*
 	 *	If no existing IP was found (or no query was run),
-	 *	run the query to find a free IP
+	 *	hand out one of the addresses this thread has
+	 *	reserved, claiming more if we've run out.
 	 */
-	if (allocation_len == 0) {
+	if ((allocation_len == 0) && inst->reserve.size) {
+		DO_PART(alloc_commit);
+		reserved = true;
+
+		allocation_len = sqlippool_reserved_alloc(allocation, sizeof(allocation), t, &handle, request);
+		if (allocation_len < 0) goto error;
+
+	/*
+	 *	Or run the query to find a free IP
+	 */
+	} else if (allocation_len == 0) {
 		allocation_len = sqlippool_query1(allocation, sizeof(allocation),
 						  inst->alloc_find, &handle,
 						  inst, request, (char *) NULL, 0);
@@ -575,7 +1230,7 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 	 *	Nothing found...
 	 */
 	if (allocation_len == 0) {
-		DO_PART(alloc_commit);
+		if (!reserved) DO_PART(alloc_commit);
 
 		/*
 		 *Should we perform pool-check ?
@@ -630,7 +1285,7 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 	 */
 	MEM(vp = fr_pair_afrom_da(request->reply, inst->allocated_address_da));
 	if (fr_pair_value_from_str(vp, allocation, allocation_len, '\0', true) < 0) {
-		DO_PART(alloc_commit);
+		if (!reserved) DO_PART(alloc_commit);
 
 		RDEBUG2("Invalid IP number [%s] returned from instbase query.", allocation);
 		fr_pool_connection_release(inst->sql_inst->pool, request, handle);
@@ -642,21 +1297,45 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 
 	/*
 	 *	UPDATE
+	 *
+	 *	Reserved addresses have already been marked
+	 *	as used by reserve_alloc.
 	 */
-	if (sqlippool_command(inst->alloc_update, &handle, inst, request,
-			      allocation, allocation_len) < 0) {
-	error:
-		if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
-		RETURN_MODULE_FAIL;
-	}
+	if (!reserved) {
+		if (sqlippool_command(inst->alloc_update, &handle, inst, request,
+				      NULL, allocation, allocation_len) < 0) {
+		error:
+			if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+			RETURN_MODULE_FAIL;
+		}
 
-	DO_PART(alloc_commit);
+		DO_PART(alloc_commit);
+	}
 
 	if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
 
 	return do_logging(p_result, inst, request, inst->log_success, RLM_MODULE_OK);
 }
 
+/*
+ *	Return the result of a batched lease update.
+ */
+static unlang_action_t mod_update_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					 request_t *request, void *rctx)
+{
+	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
+	rlm_sqlippool_write_t	*write = talloc_get_type_abort(rctx, rlm_sqlippool_write_t);
+	int			affected = write->affected;
+
+	talloc_free(write);
+
+	if (affected < 0) RETURN_MODULE_FAIL;
+
+	if (affected > 0) return do_logging(p_result, inst, request, inst->log_success, RLM_MODULE_OK);
+
+	return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOTFOUND);
+}
+
 /*
  *	Update a lease.
  */
@@ -666,6 +1345,26 @@ static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module
 	rlm_sql_handle_t	*handle;
 	int			affected;
 
+	/*
+	 *	The batch is committed in one transaction,
+	 *	so update_begin and update_commit aren't used.
+	 */
+	if (inst->batch.enable) {
+		rlm_sqlippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sqlippool_thread_t);
+		rlm_sqlippool_write_t	*write;
+
+		if (sqlippool_batch_add(&write, t, request,
+					(char const *[]){ inst->update_free, inst->update_update }, 2) < 0) {
+			RETURN_MODULE_FAIL;
+		}
+
+		if (!write->queued) return mod_update_resume(p_result, mctx, request, write);
+
+		write->yielded = true;
+
+		return unlang_module_yield(request, mod_update_resume, sqlippool_batch_signal, write);
+	}
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -685,7 +1384,7 @@ static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module
 	 */
 	DO_PART(update_free);
 
-	affected = sqlippool_command(inst->update_update, &handle, inst, request, NULL, 0);
+	affected = sqlippool_command(inst->update_update, &handle, inst, request, NULL, NULL, 0);
 
 	if (affected < 0) {
 	error:
@@ -710,6 +1409,22 @@ static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module
 	}
 }
 
+/*
+ *	Return the result of a batched lease release.
+ */
+static unlang_action_t mod_release_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					  UNUSED request_t *request, void *rctx)
+{
+	rlm_sqlippool_write_t	*write = talloc_get_type_abort(rctx, rlm_sqlippool_write_t);
+	int			affected = write->affected;
+
+	talloc_free(write);
+
+	if (affected < 0) RETURN_MODULE_FAIL;
+
+	RETURN_MODULE_OK;
+}
+
 /*
  *	Release a lease.
  */
@@ -718,6 +1433,20 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
 	rlm_sql_handle_t	*handle;
 
+	if (inst->batch.enable) {
+		rlm_sqlippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_sqlippool_thread_t);
+		rlm_sqlippool_write_t	*write;
+
+		if (sqlippool_batch_add(&write, t, request,
+					(char const *[]){ inst->release_clear }, 1) < 0) RETURN_MODULE_FAIL;
+
+		if (!write->queued) return mod_release_resume(p_result, mctx, request, write);
+
+		write->yielded = true;
+
+		return unlang_module_yield(request, mod_release_resume, sqlippool_batch_signal, write);
+	}
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -853,6 +1582,11 @@ module_t rlm_sqlippool = {
 	.inst_size	= sizeof(rlm_sqlippool_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+
+	.thread_inst_size	= sizeof(rlm_sqlippool_thread_t),
+	.thread_inst_type	= "rlm_sqlippool_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_POST_AUTH]		= mod_alloc
@@ -29,14 +29,15 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/log.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/syserror.h>
+#include <ctype.h>
 #include <fcntl.h>
 
 #include "io.h"
 #include "log.h"
 
 typedef struct {
-	struct ub_ctx	*ub;   /* This must come first.  Do not move */
-
 	char const	*name;
 	char const	*xlat_a_name;
 	char const	*xlat_aaaa_name;
@@ -46,40 +47,77 @@ typedef struct {
 
 	char const	*filename;
 
-	unbound_log_t	*u_log;
+	uint32_t	cache_size;		//!< Maximum number of answers cached by each thread.
+	uint32_t	cache_max_ttl;		//!< Maximum time answers are cached for.
+	uint32_t	cache_negative_ttl;	//!< Maximum time failed lookups are cached for.
 } rlm_unbound_t;
 
+/** Per-thread instance data
+ *
+ */
+typedef struct {
+	rlm_unbound_t const	*inst;		//!< Instance of rlm_unbound.
+	fr_event_list_t		*el;		//!< Event list of the worker.
+	struct ub_ctx		*ub;		//!< Unbound context used by this thread.
+	int			fd;		//!< Readable when libunbound has results for us.
+	unbound_log_t		*u_log;		//!< Unbound log stream for this thread.
+
+	rbtree_t		*cache;		//!< Answers, indexed by type and owner name.
+	fr_dlist_head_t		lru;		//!< Answers, most recently used first.
+} rlm_unbound_thread_t;
+
+/** Wrapper around the module thread struct for individual xlats
+ *
+ */
+typedef struct {
+	rlm_unbound_t const	*inst;		//!< Instance of rlm_unbound.
+	rlm_unbound_thread_t	*t;		//!< rlm_unbound thread instance.
+} unbound_xlat_thread_inst_t;
+
+/** A cached answer
+ *
+ */
+typedef struct {
+	int			rrtype;		//!< Type of record looked up.
+	char			*owner;		//!< Owner name, lowercased.
+	char			*value;		//!< Stringified answer.  NULL if the lookup failed.
+	fr_time_t		expires;	//!< When the answer expires.
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+} unbound_cache_entry_t;
+
+/** A lookup in progress
+ *
+ */
+typedef struct {
+	rlm_unbound_thread_t	*t;		//!< Thread the lookup was started in.
+	request_t		*request;	//!< Request to resume when the lookup completes.
+	char const		*xlat_name;	//!< Name of the xlat, for log messages.
+
+	int			rrtype;		//!< Type of record to look up.
+	char			*owner;		//!< Owner name, lowercased.
+	int			async_id;	//!< ID of the lookup in libunbound.
+	bool			done;		//!< The callback has run, or the lookup timed out.
+
+	char			*value;		//!< Stringified answer.  NULL if the lookup failed.
+} unbound_request_t;
+
 /*
  *	A mapping of configuration file names to internal variables.
  */
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("size", FR_TYPE_UINT32, rlm_unbound_t, cache_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_ttl", FR_TYPE_UINT32, rlm_unbound_t, cache_max_ttl), .dflt = "3600" },
+	{ FR_CONF_OFFSET("negative_ttl", FR_TYPE_UINT32, rlm_unbound_t, cache_negative_ttl), .dflt = "60" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED, rlm_unbound_t, filename), .dflt = "${modconfdir}/unbound/default.conf" },
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, rlm_unbound_t, timeout), .dflt = "3000" },
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
-/*
- *	Callback sent to libunbound for xlat functions.  Simply links the
- *	new ub_result via a pointer that has been allocated from the heap.
- *	This pointer has been pre-initialized to a magic value.
- */
-static void link_ubres(void *my_arg, int err, struct ub_result *result)
-{
-	struct ub_result **ubres = (struct ub_result **)my_arg;
-
-	/*
-	 *	Note that while result will be NULL on error, we are explicit
-	 *	here because that is actually a behavior that is suboptimal
-	 *	and only documented in the examples.  It could change.
-	 */
-	if (err) {
-		ERROR("%s", ub_strerror(err));
-		*ubres = NULL;
-	} else {
-		*ubres = result;
-	}
-}
-
 /*
  *	Convert labels as found in a DNS result to a NULL terminated string.
  *
@@ -146,259 +184,407 @@ static int rrlabels_tostr(char *out, char *rr, size_t left)
 	return offset;
 }
 
-static int ub_common_wait(rlm_unbound_t const *inst, request_t *request,
-			  char const *name, struct ub_result **ub, int async_id)
+static int unbound_cache_cmp(void const *one, void const *two)
 {
-	useconds_t iv, waited;
+	unbound_cache_entry_t const *a = one, *b = two;
+	int ret;
 
-	iv = inst->timeout > 64 ? 64000 : inst->timeout * 1000;
-	ub_process(inst->ub);
+	ret = (a->rrtype > b->rrtype) - (a->rrtype < b->rrtype);
+	if (ret != 0) return ret;
 
-	for (waited = 0; (void const *)*ub == (void const *)inst; waited += iv, iv *= 2) {
+	return strcmp(a->owner, b->owner);
+}
 
-		if (waited + iv > (useconds_t)inst->timeout * 1000) {
-			usleep(inst->timeout * 1000 - waited);
-			ub_process(inst->ub);
-			break;
-		}
+static void unbound_cache_entry_free(rlm_unbound_thread_t *t, unbound_cache_entry_t *c)
+{
+	rbtree_deletebydata(t->cache, c);
+	fr_dlist_remove(&t->lru, c);
+	talloc_free(c);
+}
 
-		usleep(iv);
+/** Find an unexpired answer in the thread's cache
+ *
+ */
+static unbound_cache_entry_t *unbound_cache_find(rlm_unbound_thread_t *t, int rrtype, char *owner)
+{
+	unbound_cache_entry_t	*c;
 
-		/* Check if already handled by event loop */
-		if ((void const *)*ub != (void const *)inst) {
-			break;
-		}
+	if (!t->cache) return NULL;
+
+	c = rbtree_finddata(t->cache, &(unbound_cache_entry_t){ .rrtype = rrtype, .owner = owner });
+	if (!c) return NULL;
 
-		/* In case we are running single threaded */
-		ub_process(inst->ub);
+	if (c->expires <= fr_time()) {
+		unbound_cache_entry_free(t, c);
+		return NULL;
 	}
 
-	if ((void const *)*ub == (void const *)inst) {
-		int res;
+	fr_dlist_remove(&t->lru, c);
+	fr_dlist_insert_head(&t->lru, c);
 
-		REDEBUG2("%s - DNS took too long", name);
+	return c;
+}
 
-		res = ub_cancel(inst->ub, async_id);
-		if (res) {
-			REDEBUG("%s - ub_cancel: %s", name, ub_strerror(res));
-		}
-		return -1;
+/** Add an answer to the thread's cache, evicting the least recently used if it's full
+ *
+ */
+static void unbound_cache_insert(rlm_unbound_thread_t *t, int rrtype, char *owner, char const *value,
+				 uint32_t ttl)
+{
+	unbound_cache_entry_t	*c;
+
+	if (!t->cache || !ttl) return;
+
+	c = rbtree_finddata(t->cache, &(unbound_cache_entry_t){ .rrtype = rrtype, .owner = owner });
+	if (c) unbound_cache_entry_free(t, c);
+
+	if (fr_dlist_num_elements(&t->lru) >= t->inst->cache_size) {
+		c = fr_dlist_tail(&t->lru);
+		if (c) unbound_cache_entry_free(t, c);
 	}
 
-	return 0;
+	MEM(c = talloc_zero(t->cache, unbound_cache_entry_t));
+	c->rrtype = rrtype;
+	MEM(c->owner = talloc_typed_strdup(c, owner));
+	if (value) MEM(c->value = talloc_typed_strdup(c, value));
+	c->expires = fr_time() + fr_time_delta_from_sec(ttl);
+
+	if (!rbtree_insert(t->cache, c)) {
+		talloc_free(c);
+		return;
+	}
+	fr_dlist_insert_head(&t->lru, c);
 }
 
-static int ub_common_fail(request_t *request, char const *name, struct ub_result *ub)
+/** Convert the first record in a result to a string
+ *
+ */
+static int unbound_result_tostr(char *out, size_t outlen, int rrtype, struct ub_result *result)
 {
-	if (ub->bogus) {
-		RWDEBUG("%s - Bogus DNS response", name);
+	switch (rrtype) {
+	case 1:		/* A */
+		if ((result->len[0] != 4) || !inet_ntop(AF_INET, result->data[0], out, outlen)) return -1;
+		return 0;
+
+	case 28:	/* AAAA */
+		if ((result->len[0] != 16) || !inet_ntop(AF_INET6, result->data[0], out, outlen)) return -1;
+		return 0;
+
+	case 12:	/* PTR */
+		if (rrlabels_tostr(out, result->data[0], outlen) < 0) return -1;
+		return 0;
+
+	default:
 		return -1;
 	}
+}
 
-	if (ub->nxdomain) {
-		RDEBUG2("%s - NXDOMAIN", name);
-		return -1;
+/*
+ *	Callback sent to libunbound for xlat functions.  Called from
+ *	ub_process() when the thread's unbound fd becomes readable.
+ *	Converts and caches the result, then resumes the request.
+ */
+static void link_ubres(void *my_arg, int err, struct ub_result *result)
+{
+	unbound_request_t	*ur = talloc_get_type_abort(my_arg, unbound_request_t);
+	rlm_unbound_t const	*inst = ur->t->inst;
+	request_t		*request = ur->request;
+	char			buffer[256];
+	uint32_t		ttl = 0;
+
+	ur->done = true;
+
+	/*
+	 *	Note that while result will be NULL on error, we are explicit
+	 *	here because that is actually a behavior that is suboptimal
+	 *	and only documented in the examples.  It could change.
+	 */
+	if (err) {
+		REDEBUG("%s - %s", ur->xlat_name, ub_strerror(err));
+		goto finish;
 	}
 
-	if (!ub->havedata) {
-		RDEBUG2("%s - Empty result", name);
-		return -1;
+	if (result->bogus) {
+		RWDEBUG("%s - Bogus DNS response", ur->xlat_name);
+		goto finish;
 	}
 
-	return 0;
+	if (result->ttl > 0) ttl = result->ttl;
+
+	if (result->nxdomain || !result->havedata) {
+		RDEBUG2("%s - %s", ur->xlat_name, result->nxdomain ? "NXDOMAIN" : "Empty result");
+
+		if (!ttl || (ttl > inst->cache_negative_ttl)) ttl = inst->cache_negative_ttl;
+		unbound_cache_insert(ur->t, ur->rrtype, ur->owner, NULL, ttl);
+		goto finish;
+	}
+
+	if (unbound_result_tostr(buffer, sizeof(buffer), ur->rrtype, result) < 0) {
+		RWDEBUG("%s - Invalid record in result", ur->xlat_name);
+		goto finish;
+	}
+	MEM(ur->value = talloc_typed_strdup(ur, buffer));
+
+	if (ttl > inst->cache_max_ttl) ttl = inst->cache_max_ttl;
+	unbound_cache_insert(ur->t, ur->rrtype, ur->owner, ur->value, ttl);
+
+finish:
+	ub_resolve_free(result);	/* Handles NULL gracefully */
+
+	unlang_interpret_mark_resumable(request);
 }
 
-/** Perform a DNS lookup for an A record
+/** Cancel the lookup if it's still outstanding
  *
- * @ingroup xlat_functions
  */
-static ssize_t xlat_a(TALLOC_CTX *ctx, char **out, size_t outlen,
-		      void const *mod_inst, UNUSED void const *xlat_inst,
-		      request_t *request, char const *fmt)
+static void unbound_request_cancel(unbound_request_t *ur)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
+	request_t	*request = ur->request;
+	int		res;
 
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
+	if (ur->done) return;
+	ur->done = true;
 
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+	res = ub_cancel(ur->t->ub, ur->async_id);
+	if (res) REDEBUG("%s - ub_cancel: %s", ur->xlat_name, ub_strerror(res));
+}
 
-	fmt2 = talloc_typed_strdup(ctx, fmt);
-	ub_resolve_async(inst->ub, fmt2, 1, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
+static int _unbound_request_free(unbound_request_t *ur)
+{
+	unbound_request_cancel(ur);
 
-	if (ub_common_wait(inst, request, inst->xlat_a_name, ubres, async_id)) {
-		goto error0;
-	}
+	return 0;
+}
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_a_name, *ubres)) {
-			goto error1;
-		}
+static void _xlat_unbound_timeout(request_t *request, UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst,
+				  void *rctx, UNUSED fr_time_t fired)
+{
+	unbound_request_t	*ur = talloc_get_type_abort(rctx, unbound_request_t);
 
-		if (!inet_ntop(AF_INET, (*ubres)->data[0], *out, outlen)) {
-			goto error1;
-		};
+	REDEBUG2("%s - DNS took too long", ur->xlat_name);
+
+	/*
+	 *	Cancel now, so the callback can't
+	 *	run after we've been resumed.
+	 */
+	unbound_request_cancel(ur);
+
+	unlang_interpret_mark_resumable(request);
+}
 
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
+static xlat_action_t xlat_unbound_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
+					 request_t *request, UNUSED void const *xlat_inst,
+					 UNUSED void *xlat_thread_inst,
+					 UNUSED fr_value_box_t **in, void *rctx)
+{
+	unbound_request_t	*ur = talloc_get_type_abort(rctx, unbound_request_t);
+	fr_value_box_t		*vb;
+
+	if (!ur->value) {
+		RWDEBUG("%s - No result", ur->xlat_name);
+		talloc_free(ur);
+		return XLAT_ACTION_FAIL;
 	}
 
-	RWDEBUG("%s - No result", inst->xlat_a_name);
+	MEM(vb = fr_value_box_alloc_null(ctx));
+	if (fr_value_box_strdup(vb, vb, NULL, ur->value, false) < 0) {
+		talloc_free(vb);
+		talloc_free(ur);
+		return XLAT_ACTION_FAIL;
+	}
+	fr_cursor_append(out, vb);
 
- error1:
-	ub_resolve_free(*ubres); /* Handles NULL gracefully */
+	talloc_free(ur);
 
- error0:
-	talloc_free(ubres);
-	return -1;
+	return XLAT_ACTION_DONE;
 }
 
-/** Perform a DNS lookup for an AAAA record
+static void xlat_unbound_signal(request_t *request, UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst,
+				void *rctx, fr_state_signal_t action)
+{
+	unbound_request_t	*ur = talloc_get_type_abort(rctx, unbound_request_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	RDEBUG2("%s - Cancelling lookup", ur->xlat_name);
+
+	talloc_free(ur);
+}
+
+/** Start a lookup, yielding until libunbound returns a result
  *
- * @ingroup xlat_functions
+ * Answers are returned from the thread's cache if we have them.
  */
-static ssize_t xlat_aaaa(TALLOC_CTX *ctx, char **out, size_t outlen,
-			 void const *mod_inst, UNUSED void const *xlat_inst,
-			 request_t *request, char const *fmt)
+static xlat_action_t xlat_unbound_common(TALLOC_CTX *ctx, fr_cursor_t *out, request_t *request,
+					 void *xlat_thread_inst, fr_value_box_t **in,
+					 char const *xlat_name, int rrtype)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
+	unbound_xlat_thread_inst_t	*xt = xlat_thread_inst;
+	rlm_unbound_thread_t		*t = xt->t;
+	unbound_request_t		*ur;
+	unbound_cache_entry_t		*c;
+	char				*p;
+	int				res;
+
+	if (!*in) {
+		REDEBUG("%s - Missing owner name", xlat_name);
+		return XLAT_ACTION_FAIL;
+	}
 
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
+	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
+		RPEDEBUG("Failed concatenating input");
+		return XLAT_ACTION_FAIL;
+	}
 
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+	MEM(ur = talloc_zero(ctx, unbound_request_t));
+	ur->t = t;
+	ur->request = request;
+	ur->xlat_name = xlat_name;
+	ur->rrtype = rrtype;
+	MEM(ur->owner = talloc_typed_strdup(ur, (*in)->vb_strvalue));
+	for (p = ur->owner; *p; p++) *p = tolower((uint8_t) *p);
 
-	fmt2 = talloc_typed_strdup(ctx, fmt);
-	ub_resolve_async(inst->ub, fmt2, 28, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
+	c = unbound_cache_find(t, rrtype, ur->owner);
+	if (c) {
+		RDEBUG2("%s - Using cached answer for \"%s\"", xlat_name, ur->owner);
+		if (c->value) MEM(ur->value = talloc_typed_strdup(ur, c->value));
 
-	if (ub_common_wait(inst, request, inst->xlat_aaaa_name, ubres, async_id)) {
-		goto error0;
+		return xlat_unbound_resume(ctx, out, request, NULL, xlat_thread_inst, in, ur);
 	}
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_aaaa_name, *ubres)) {
-			goto error1;
-		}
-		if (!inet_ntop(AF_INET6, (*ubres)->data[0], *out, outlen)) {
-			goto error1;
-		};
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
+	res = ub_resolve_async(t->ub, ur->owner, rrtype, 1, ur, link_ubres, &ur->async_id);
+	if (res) {
+		REDEBUG("%s - %s", xlat_name, ub_strerror(res));
+		talloc_free(ur);
+		return XLAT_ACTION_FAIL;
 	}
+	talloc_set_destructor(ur, _unbound_request_free);
 
-	RWDEBUG("%s - No result", inst->xlat_aaaa_name);
+	if (unlang_xlat_event_timeout_add(request, _xlat_unbound_timeout, ur,
+					  fr_time() + fr_time_delta_from_msec(t->inst->timeout)) < 0) {
+		RPEDEBUG("Failed adding timeout");
+		talloc_free(ur);
+		return XLAT_ACTION_FAIL;
+	}
 
-error1:
-	ub_resolve_free(*ubres); /* Handles NULL gracefully */
+	return unlang_xlat_yield(request, xlat_unbound_resume, xlat_unbound_signal, ur);
+}
 
-error0:
-	talloc_free(ubres);
-	return -1;
+/** Perform a DNS lookup for an A record
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t xlat_a(TALLOC_CTX *ctx, fr_cursor_t *out,
+			    request_t *request, void const *xlat_inst, void *xlat_thread_inst,
+			    fr_value_box_t **in)
+{
+	rlm_unbound_t const *inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst), rlm_unbound_t);
+
+	return xlat_unbound_common(ctx, out, request, xlat_thread_inst, in, inst->xlat_a_name, 1);
 }
 
-typedef struct {
-	struct ub_result	*result;	//!< The result from the previous operation.
-} dns_resume_ctx_t;
+/** Perform a DNS lookup for an AAAA record
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t xlat_aaaa(TALLOC_CTX *ctx, fr_cursor_t *out,
+			       request_t *request, void const *xlat_inst, void *xlat_thread_inst,
+			       fr_value_box_t **in)
+{
+	rlm_unbound_t const *inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst), rlm_unbound_t);
 
-/*
+	return xlat_unbound_common(ctx, out, request, xlat_thread_inst, in, inst->xlat_aaaa_name, 28);
+}
+
+/** Perform a DNS lookup for a PTR record
+ *
+ * @ingroup xlat_functions
+ */
 static xlat_action_t xlat_ptr(TALLOC_CTX *ctx, fr_cursor_t *out,
 			      request_t *request, void const *xlat_inst, void *xlat_thread_inst,
 			      fr_value_box_t **in)
 {
-	if (!*in) return XLAT_ACTION_DONE;
+	rlm_unbound_t const *inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst), rlm_unbound_t);
 
-	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
-		RPEDEBUG("Failed concatenating input string for attribute reference");
-		return XLAT_ACTION_FAIL;
-	}
-
-	yield_to
+	return xlat_unbound_common(ctx, out, request, xlat_thread_inst, in, inst->xlat_ptr_name, 12);
+}
 
+static int mod_xlat_instantiate(void *xlat_inst, UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	*((void **)xlat_inst) = talloc_get_type_abort(uctx, rlm_unbound_t);
+	return 0;
 }
-*/
 
-/** Perform a DNS lookup for a PTR record
+/** Resolves and caches the module's thread instance for use by a specific xlat instance
  *
- * @ingroup xlat_functions
  */
-static ssize_t xlat_ptr(TALLOC_CTX *ctx, char **out, size_t outlen,
-			void const *mod_inst, UNUSED void const *xlat_inst,
-			request_t *request, char const *fmt)
+static int mod_xlat_thread_instantiate(UNUSED void *xlat_inst, void *xlat_thread_inst,
+				       UNUSED xlat_exp_t const *exp, void *uctx)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
-
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
+	rlm_unbound_t			*inst = talloc_get_type_abort(uctx, rlm_unbound_t);
+	unbound_xlat_thread_inst_t	*xt = xlat_thread_inst;
 
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+	xt->inst = inst;
+	xt->t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_unbound_thread_t);
 
-	fmt2 = talloc_typed_strdup(ctx, fmt);
-	ub_resolve_async(inst->ub, fmt2, 12, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
+	return 0;
+}
 
-	if (ub_common_wait(inst, request, inst->xlat_ptr_name,
-			   ubres, async_id)) {
-		goto error0;
-	}
+/** Process results when libunbound signals they're available
+ *
+ */
+static void mod_unbound_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	rlm_unbound_thread_t	*t = talloc_get_type_abort(uctx, rlm_unbound_thread_t);
+	rlm_unbound_t const	*inst = t->inst;
+	int			res;
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_ptr_name, *ubres)) {
-			goto error1;
-		}
-		if (rrlabels_tostr(*out, (*ubres)->data[0], outlen) < 0) {
-			goto error1;
-		}
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
-	}
+	res = ub_process(t->ub);
+	if (res) ERROR("%s - ub_process: %s", inst->name, ub_strerror(res));
+}
 
-	RWDEBUG("%s - No result", inst->xlat_ptr_name);
+static void mod_unbound_error(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	rlm_unbound_thread_t	*t = talloc_get_type_abort(uctx, rlm_unbound_thread_t);
+	rlm_unbound_t const	*inst = t->inst;
 
-error1:
-	ub_resolve_free(*ubres);  /* Handles NULL gracefully */
+	ERROR("%s - Failed reading from unbound: %s", inst->name, fr_syserror(fd_errno));
 
-error0:
-	talloc_free(ubres);
-	return -1;
+	(void) fr_event_fd_delete(el, t->fd, FR_EVENT_FILTER_IO);
+	t->fd = -1;
 }
 
-static int mod_instantiate(void *instance, CONF_SECTION *conf)
+/** Create the unbound context for a worker, and add its fd to the worker's event list
+ *
+ */
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
 {
-	rlm_unbound_t	*inst = instance;
-	int		res;
-	char		k[64]; /* To silence const warns until newer unbound in distros */
+	rlm_unbound_t		*inst = talloc_get_type_abort(instance, rlm_unbound_t);
+	rlm_unbound_thread_t	*t = talloc_get_type_abort(thread, rlm_unbound_thread_t);
+	int			res;
+	char			k[64]; /* To silence const warns until newer unbound in distros */
+
+	t->inst = inst;
+	t->el = el;
+	t->fd = -1;
+
+	if (inst->cache_size > 0) {
+		MEM(t->cache = rbtree_alloc(t, unbound_cache_cmp, NULL, RBTREE_FLAG_NONE));
+		fr_dlist_talloc_init(&t->lru, unbound_cache_entry_t, entry);
+	}
 
-	/*
-	 *	@todo - move this to the thread-instantiate function
-	 */
-	inst->ub = ub_ctx_create();
-	if (!inst->ub) {
+	t->ub = ub_ctx_create();
+	if (!t->ub) {
 		cf_log_err(conf, "ub_ctx_create failed");
 		return -1;
 	}
 
 	/*
-	 *	Note unbound threads WILL happen with -s option, if it matters.
-	 *	We cannot tell from here whether that option is in effect.
+	 *	Resolve in a background thread, which writes
+	 *	to the fd returned by ub_fd() when it has
+	 *	results.  We read them from the event loop.
 	 */
-	res = ub_ctx_async(inst->ub, 1);
+	res = ub_ctx_async(t->ub, 1);
 	if (res) goto error;
 
 	/* Now load the config file, which can override gleaned settings. */
@@ -406,11 +592,11 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		char *file;
 
 		memcpy(&file, &inst->filename, sizeof(file));
-		res = ub_ctx_config(inst->ub, file);
+		res = ub_ctx_config(t->ub, file);
 		if (res) goto error;
 	}
 
-	if (unbound_log_init(inst, &inst->u_log, inst->ub) < 0) goto error;
+	if (unbound_log_init(t, &t->u_log, t->ub) < 0) goto fail;
 
 	/*
 	 *  Now we need to finalize the context.
@@ -421,18 +607,64 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	 *  data did not exist.
 	 */
 	strcpy(k, "notar33lsite.foo123.nottld A 127.0.0.1");
-	ub_ctx_data_remove(inst->ub, k);
+	ub_ctx_data_remove(t->ub, k);
+
+	t->fd = ub_fd(t->ub);
+	if (t->fd < 0) {
+		cf_log_err(conf, "Failed retrieving unbound file descriptor");
+		goto fail;
+	}
+
+	if (fr_event_fd_insert(t, el, t->fd, mod_unbound_read, NULL, mod_unbound_error, t) < 0) {
+		cf_log_perr(conf, "Failed adding unbound file descriptor to event loop");
+		t->fd = -1;
+		goto fail;
+	}
+
 	return 0;
 
  error:
 	cf_log_err(conf, "%s", ub_strerror(res));
 
+ fail:
+	/*
+	 *	mod_thread_detach() isn't called for threads which
+	 *	failed to instantiate, so free the context here.
+	 */
+	TALLOC_FREE(t->u_log);
+	ub_ctx_delete(t->ub);
+	t->ub = NULL;
+
 	return -1;
 }
 
+static int mod_thread_detach(fr_event_list_t *el, void *thread)
+{
+	rlm_unbound_thread_t	*t = talloc_get_type_abort(thread, rlm_unbound_thread_t);
+
+	if (t->fd >= 0) (void) fr_event_fd_delete(el, t->fd, FR_EVENT_FILTER_IO);
+
+	if (!t->ub) return 0;
+
+	ub_process(t->ub);
+
+	/*
+	 *	This can hang/leave zombies currently
+	 *	see upstream bug #519
+	 *	...so expect valgrind to complain with -m
+	 */
+	TALLOC_FREE(t->u_log);	/* Free logging first */
+
+	ub_ctx_delete(t->ub);
+	t->ub = NULL;
+
+	return 0;
+}
+
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
-	rlm_unbound_t *inst = instance;
+	rlm_unbound_t	*inst = instance;
+	xlat_t const	*xlat;
 
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
@@ -446,30 +678,21 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	MEM(inst->xlat_aaaa_name = talloc_typed_asprintf(inst, "%s-aaaa", inst->name));
 	MEM(inst->xlat_ptr_name = talloc_typed_asprintf(inst, "%s-ptr", inst->name));
 
-	if (xlat_register_legacy(inst, inst->xlat_a_name, xlat_a, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN) ||
-	    xlat_register_legacy(inst, inst->xlat_aaaa_name, xlat_aaaa, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN) ||
-	    xlat_register_legacy(inst, inst->xlat_ptr_name, xlat_ptr, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN)) {
-		cf_log_err(conf, "Failed registering xlats");
-		return -1;
-	}
-
-	return 0;
-}
-
-static int mod_detach(void *instance)
-{
-	rlm_unbound_t *inst = instance;
-
-	ub_process(inst->ub);
-
-	/*
-	 *	This can hang/leave zombies currently
-	 *	see upstream bug #519
-	 *	...so expect valgrind to complain with -m
-	 */
-	talloc_free(inst->u_log);	/* Free logging first */
-
-	ub_ctx_delete(inst->ub);
+#define XLAT_REGISTER(_name, _func) \
+	do { \
+		xlat = xlat_register(inst, _name, _func, true); \
+		if (!xlat) { \
+			cf_log_err(conf, "Failed registering xlats"); \
+			return -1; \
+		} \
+		xlat_async_instantiate_set(xlat, mod_xlat_instantiate, rlm_unbound_t *, NULL, inst); \
+		xlat_async_thread_instantiate_set(xlat, mod_xlat_thread_instantiate, \
+						  unbound_xlat_thread_inst_t, NULL, inst); \
+	} while (0)
+
+	XLAT_REGISTER(inst->xlat_a_name, xlat_a);
+	XLAT_REGISTER(inst->xlat_aaaa_name, xlat_aaaa);
+	XLAT_REGISTER(inst->xlat_ptr_name, xlat_ptr);
 
 	return 0;
 }
@@ -482,6 +705,9 @@ module_t rlm_unbound = {
 	.inst_size		= sizeof(rlm_unbound_t),
 	.config			= module_config,
 	.bootstrap		= mod_bootstrap,
-	.instantiate		= mod_instantiate,
-	.detach			= mod_detach
+
+	.thread_inst_size	= sizeof(rlm_unbound_thread_t),
+	.thread_inst_type	= "rlm_unbound_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach
 };
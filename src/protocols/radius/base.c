@@ -328,6 +328,99 @@ invalid:
 	return packet_len;
 }
 
+/** Set the authenticator field of a packet to the value used when calculating the Message-Authenticator
+ *
+ * @param[in,out] packet	(request or response).
+ * @param[in] original		request (only if this is a response).
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int radius_ma_vector(uint8_t *packet, uint8_t const *original)
+{
+	switch (packet[0]) {
+	case FR_CODE_ACCOUNTING_RESPONSE:
+	case FR_CODE_DISCONNECT_ACK:
+	case FR_CODE_DISCONNECT_NAK:
+	case FR_CODE_COA_ACK:
+	case FR_CODE_COA_NAK:
+		if (!original) goto need_original;
+		if (original[0] == FR_CODE_STATUS_SERVER) goto do_ack;
+		FALL_THROUGH;
+
+	case FR_CODE_ACCOUNTING_REQUEST:
+	case FR_CODE_DISCONNECT_REQUEST:
+	case FR_CODE_COA_REQUEST:
+		memset(packet + 4, 0, RADIUS_AUTH_VECTOR_LENGTH);
+		return 0;
+
+	case FR_CODE_ACCESS_ACCEPT:
+	case FR_CODE_ACCESS_REJECT:
+	case FR_CODE_ACCESS_CHALLENGE:
+	do_ack:
+		if (!original) {
+		need_original:
+			fr_strerror_const("Cannot sign response packet without a request packet");
+			return -1;
+		}
+		memcpy(packet + 4, original + 4, RADIUS_AUTH_VECTOR_LENGTH);
+		return 0;
+
+	case FR_CODE_ACCESS_REQUEST:
+	case FR_CODE_STATUS_SERVER:
+		/* packet + 4 MUST be the Request Authenticator filled with random data */
+		return 0;
+
+	default:
+		fr_strerror_printf("Cannot sign unknown packet code %u", packet[0]);
+		return -1;
+	}
+}
+
+/** Set the authenticator field of a packet to the value used when calculating the Request / Response Authenticator
+ *
+ * @param[in,out] packet	(request or response).
+ * @param[in] original		request (only if this is a response).
+ * @return
+ *	- <0 on error
+ *	- 0 if the packet has a random Request Authenticator, which isn't calculated.
+ *	- 1 if the authenticator is MD5(packet + secret).
+ */
+static int radius_authenticator_vector(uint8_t *packet, uint8_t const *original)
+{
+	switch (packet[0]) {
+	case FR_CODE_ACCOUNTING_REQUEST:
+	case FR_CODE_DISCONNECT_REQUEST:
+	case FR_CODE_COA_REQUEST:
+		memset(packet + 4, 0, RADIUS_AUTH_VECTOR_LENGTH);
+		return 1;
+
+	case FR_CODE_ACCESS_ACCEPT:
+	case FR_CODE_ACCESS_REJECT:
+	case FR_CODE_ACCESS_CHALLENGE:
+	case FR_CODE_ACCOUNTING_RESPONSE:
+	case FR_CODE_DISCONNECT_ACK:
+	case FR_CODE_DISCONNECT_NAK:
+	case FR_CODE_COA_ACK:
+	case FR_CODE_COA_NAK:
+	case FR_CODE_PROTOCOL_ERROR:
+		if (!original) {
+			fr_strerror_const("Cannot sign response packet without a request packet");
+			return -1;
+		}
+		memcpy(packet + 4, original + 4, RADIUS_AUTH_VECTOR_LENGTH);
+		return 1;
+
+	case FR_CODE_ACCESS_REQUEST:
+	case FR_CODE_STATUS_SERVER:
+		return 0;
+
+	default:
+		fr_strerror_printf("Cannot sign unknown packet code %u", packet[0]);
+		return -1;
+	}
+}
+
 /** Sign a previously encoded packet
  *
  * Calculates the request/response authenticator for packets which need it, and fills
@@ -344,6 +437,29 @@ invalid:
 int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		   uint8_t const *secret, size_t secret_len)
 {
+	return fr_radius_sign_key(packet, original, secret, secret_len, NULL);
+}
+
+/** Sign a previously encoded packet, using precomputed MD5 states for the secret
+ *
+ * The Message-Authenticator HMAC starts from the states in secret_key, so only
+ * the packet is hashed.  The Request and Response Authenticators put the secret
+ * after the packet, so they still need the secret itself.
+ *
+ * @param[in,out] packet	(request or response).
+ * @param[in] original		request (only if this is a response).
+ * @param[in] secret		to sign the packet with.
+ * @param[in] secret_len	The length of the secret.
+ * @param[in] secret_key	precomputed from the secret with #fr_md5_key_alloc.
+ *				May be NULL.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_sign_key(uint8_t *packet, uint8_t const *original,
+		       uint8_t const *secret, size_t secret_len, fr_md5_key_t const *secret_key)
+{
+	int		rcode;
 	uint8_t		*msg, *end;
 	size_t		packet_len = (packet[2] << 8) | packet[3];
 
@@ -389,38 +505,7 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 			return -1;
 		}
 
-		switch (packet[0]) {
-		case FR_CODE_ACCOUNTING_RESPONSE:
-		case FR_CODE_DISCONNECT_ACK:
-		case FR_CODE_DISCONNECT_NAK:
-		case FR_CODE_COA_ACK:
-		case FR_CODE_COA_NAK:
-			if (!original) goto need_original;
-			if (original[0] == FR_CODE_STATUS_SERVER) goto do_ack;
-			FALL_THROUGH;
-
-		case FR_CODE_ACCOUNTING_REQUEST:
-		case FR_CODE_DISCONNECT_REQUEST:
-		case FR_CODE_COA_REQUEST:
-			memset(packet + 4, 0, RADIUS_AUTH_VECTOR_LENGTH);
-			break;
-
-		case FR_CODE_ACCESS_ACCEPT:
-		case FR_CODE_ACCESS_REJECT:
-		case FR_CODE_ACCESS_CHALLENGE:
-		do_ack:
-			if (!original) goto need_original;
-			memcpy(packet + 4, original + 4, RADIUS_AUTH_VECTOR_LENGTH);
-			break;
-
-		case FR_CODE_ACCESS_REQUEST:
-		case FR_CODE_STATUS_SERVER:
-			/* packet + 4 MUST be the Request Authenticator filled with random data */
-			break;
-
-		default:
-			goto bad_packet;
-		}
+		if (radius_ma_vector(packet, original) < 0) return -1;
 
 		/*
 		 *	Force Message-Authenticator to be zero,
@@ -428,51 +513,21 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		 *	Message-Authenticator attribute.
 		 */
 		memset(msg + 2, 0, RADIUS_AUTH_VECTOR_LENGTH);
-		fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		if (secret_key) {
+			fr_hmac_md5_key(msg + 2, packet, packet_len, secret_key);
+		} else {
+			fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		}
 		break;
 	}
 
 	/*
-	 *	Initialize the request authenticator.
+	 *	Initialize the request authenticator.  The Request
+	 *	Authenticator of Access-Request and Status-Server is
+	 *	random numbers, so there's nothing else to sign.
 	 */
-	switch (packet[0]) {
-	case FR_CODE_ACCOUNTING_REQUEST:
-	case FR_CODE_DISCONNECT_REQUEST:
-	case FR_CODE_COA_REQUEST:
-		memset(packet + 4, 0, RADIUS_AUTH_VECTOR_LENGTH);
-		break;
-
-	case FR_CODE_ACCESS_ACCEPT:
-	case FR_CODE_ACCESS_REJECT:
-	case FR_CODE_ACCESS_CHALLENGE:
-	case FR_CODE_ACCOUNTING_RESPONSE:
-	case FR_CODE_DISCONNECT_ACK:
-	case FR_CODE_DISCONNECT_NAK:
-	case FR_CODE_COA_ACK:
-	case FR_CODE_COA_NAK:
-	case FR_CODE_PROTOCOL_ERROR:
-		if (!original) {
-		need_original:
-			fr_strerror_const("Cannot sign response packet without a request packet");
-			return -1;
-		}
-		memcpy(packet + 4, original + 4, RADIUS_AUTH_VECTOR_LENGTH);
-		break;
-
-		/*
-		 *	The Request Authenticator is random numbers.
-		 *	We don't need to sign anything else, so
-		 *	return.
-		 */
-	case FR_CODE_ACCESS_REQUEST:
-	case FR_CODE_STATUS_SERVER:
-		return 0;
-
-	default:
-	bad_packet:
-		fr_strerror_printf("Cannot sign unknown packet code %u", packet[0]);
-		return -1;
-	}
+	rcode = radius_authenticator_vector(packet, original);
+	if (rcode <= 0) return rcode;
 
 	/*
 	 *	Request / Response Authenticator = MD5(packet + secret)
@@ -772,6 +827,23 @@ finish:
  */
 int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 		     uint8_t const *secret, size_t secret_len)
+{
+	return fr_radius_verify_key(packet, original, secret, secret_len, NULL);
+}
+
+/** Verify a request / response packet, using precomputed MD5 states for the secret
+ *
+ * @param packet the raw RADIUS packet (request or response)
+ * @param original the raw original request (if this is a response)
+ * @param secret the shared secret
+ * @param secret_len the length of the secret
+ * @param secret_key precomputed from the secret with #fr_md5_key_alloc.  May be NULL.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_verify_key(uint8_t *packet, uint8_t const *original,
+			 uint8_t const *secret, size_t secret_len, fr_md5_key_t const *secret_key)
 {
 	int rcode;
 	uint8_t *msg, *end;
@@ -827,7 +899,7 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 	 *	slightly more CPU work than having verify-specific
 	 *	functions, but it ends up being cleaner in the code.
 	 */
-	rcode = fr_radius_sign(packet, original, secret, secret_len);
+	rcode = fr_radius_sign_key(packet, original, secret, secret_len, secret_key);
 	if (rcode < 0) {
 		fr_strerror_const_push("Failed calculating correct authenticator");
 		return -1;
@@ -873,6 +945,251 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 	return 0;
 }
 
+/** Working state for one packet in #fr_radius_verify_batch
+ *
+ */
+typedef struct {
+	bool		live;					//!< Still being verified.
+	uint8_t		*msg;					//!< Message-Authenticator attribute, or NULL.
+	uint8_t		*scratch;				//!< HMAC inner input, then packet + secret.
+	uint8_t		outer[MD5_BLOCK_LENGTH + MD5_DIGEST_LENGTH];	//!< HMAC outer input.
+	uint8_t		request_authenticator[RADIUS_AUTH_VECTOR_LENGTH];
+	uint8_t		message_authenticator[RADIUS_AUTH_VECTOR_LENGTH];
+} radius_verify_batch_t;
+
+/** Put back the authenticators we overwrote while verifying a packet
+ *
+ */
+static inline void radius_verify_batch_restore(fr_radius_verify_t *p, radius_verify_batch_t *w)
+{
+	if (w->msg) memcpy(w->msg + 2, w->message_authenticator, sizeof(w->message_authenticator));
+	memcpy(p->packet + 4, w->request_authenticator, sizeof(w->request_authenticator));
+}
+
+/** Verify many request / response packets at once
+ *
+ * Gives the same results as calling #fr_radius_verify for each packet,
+ * but calculates the HMACs and authenticators with #fr_md5_mb, so the
+ * MD5 transforms of several packets run in parallel.  This is only worth
+ * doing when there is a burst of packets to verify, such as when
+ * draining a socket.
+ *
+ * As errors are per packet, they're returned in each entry, and not via
+ * fr_strerror().
+ *
+ * @param[in,out] packets	to verify.  rcode and error are set for each.
+ * @param[in] num		Number of packets.
+ */
+void fr_radius_verify_batch(fr_radius_verify_t *packets, size_t num)
+{
+	radius_verify_batch_t	*work;
+	fr_md5_mb_msg_t		*msgs;
+	uint8_t			*scratch;
+	size_t			i, j, n, total = 0;
+
+	if (num == 0) return;
+
+	work = talloc_zero_array(NULL, radius_verify_batch_t, num);
+	if (!work) goto oom;
+
+	msgs = talloc_array(work, fr_md5_mb_msg_t, num);
+	if (!msgs) goto oom;
+
+	/*
+	 *	Check the packets, save the values we're going to
+	 *	overwrite, and work out how much scratch space we need.
+	 */
+	for (i = 0; i < num; i++) {
+		fr_radius_verify_t	*p = &packets[i];
+		radius_verify_batch_t	*w = &work[i];
+		size_t			packet_len = (p->packet[2] << 8) | p->packet[3];
+		uint8_t			*msg, *end;
+
+		p->rcode = -1;
+		p->error = NULL;
+
+		if (packet_len < RADIUS_HEADER_LENGTH) {
+			p->error = "invalid packet length";
+			continue;
+		}
+
+		if (!fr_cond_assert(p->secret_len <= UINT16_MAX)) {
+			p->error = "Secret is too long";
+			continue;
+		}
+
+		memcpy(w->request_authenticator, p->packet + 4, sizeof(w->request_authenticator));
+
+		msg = p->packet + RADIUS_HEADER_LENGTH;
+		end = p->packet + packet_len;
+
+		while (msg < end) {
+			if (((end - msg) < 2) || (msg[1] < 2) || ((msg + msg[1]) > end)) {
+				p->error = "invalid attribute";
+				break;
+			}
+
+			if (msg[0] != FR_MESSAGE_AUTHENTICATOR) {
+				msg += msg[1];
+				continue;
+			}
+
+			if (msg[1] < 18) {
+				p->error = "too small Message-Authenticator";
+				break;
+			}
+
+			memcpy(w->message_authenticator, msg + 2, sizeof(w->message_authenticator));
+			w->msg = msg;
+			break;
+		}
+		if (p->error) continue;
+
+		w->live = true;
+		total += MD5_BLOCK_LENGTH + packet_len + p->secret_len;
+	}
+
+	scratch = talloc_array(work, uint8_t, total);
+	if (!scratch) goto oom;
+
+	/*
+	 *	HMAC inner hash, MD5((key ^ ipad) + packet), and the
+	 *	start of the outer hash, (key ^ opad).
+	 */
+	for (i = 0, n = 0; i < num; i++) {
+		fr_radius_verify_t	*p = &packets[i];
+		radius_verify_batch_t	*w = &work[i];
+		size_t			packet_len = (p->packet[2] << 8) | p->packet[3];
+		uint8_t			key[MD5_DIGEST_LENGTH];
+		uint8_t const		*key_p = p->secret;
+		size_t			key_len = p->secret_len;
+
+		if (!w->live) continue;
+
+		w->scratch = scratch;
+		scratch += MD5_BLOCK_LENGTH + packet_len + p->secret_len;
+
+		if (!w->msg) continue;
+
+		if (radius_ma_vector(p->packet, p->original) < 0) {
+			radius_verify_batch_restore(p, w);
+			p->error = "Failed calculating correct authenticator";
+			w->live = false;
+			continue;
+		}
+		memset(w->msg + 2, 0, RADIUS_AUTH_VECTOR_LENGTH);
+
+		if (key_len > MD5_BLOCK_LENGTH) {
+			fr_md5_calc(key, key_p, key_len);
+			key_p = key;
+			key_len = sizeof(key);
+		}
+
+		memset(w->scratch, 0x36, MD5_BLOCK_LENGTH);
+		memset(w->outer, 0x5c, MD5_BLOCK_LENGTH);
+		for (j = 0; j < key_len; j++) {
+			w->scratch[j] ^= key_p[j];
+			w->outer[j] ^= key_p[j];
+		}
+		memcpy(w->scratch + MD5_BLOCK_LENGTH, p->packet, packet_len);
+
+		msgs[n++] = (fr_md5_mb_msg_t){
+			.in = w->scratch,
+			.inlen = MD5_BLOCK_LENGTH + packet_len,
+			.out = w->outer + MD5_BLOCK_LENGTH
+		};
+	}
+	fr_md5_mb(msgs, n);
+
+	/*
+	 *	HMAC outer hash, MD5((key ^ opad) + inner), which is
+	 *	written to the Message-Authenticator.
+	 */
+	for (i = 0, n = 0; i < num; i++) {
+		if (!work[i].live || !work[i].msg) continue;
+
+		msgs[n++] = (fr_md5_mb_msg_t){
+			.in = work[i].outer,
+			.inlen = sizeof(work[i].outer),
+			.out = work[i].msg + 2
+		};
+	}
+	fr_md5_mb(msgs, n);
+
+	/*
+	 *	Request / Response Authenticator = MD5(packet + secret)
+	 */
+	for (i = 0, n = 0; i < num; i++) {
+		fr_radius_verify_t	*p = &packets[i];
+		radius_verify_batch_t	*w = &work[i];
+		size_t			packet_len = (p->packet[2] << 8) | p->packet[3];
+		int			rcode;
+
+		if (!w->live) continue;
+
+		rcode = radius_authenticator_vector(p->packet, p->original);
+		if (rcode < 0) {
+			radius_verify_batch_restore(p, w);
+			p->error = "Failed calculating correct authenticator";
+			w->live = false;
+			continue;
+		}
+		if (rcode == 0) continue;
+
+		memcpy(w->scratch, p->packet, packet_len);
+		memcpy(w->scratch + packet_len, p->secret, p->secret_len);
+
+		msgs[n++] = (fr_md5_mb_msg_t){
+			.in = w->scratch,
+			.inlen = packet_len + p->secret_len,
+			.out = p->packet + 4
+		};
+	}
+	fr_md5_mb(msgs, n);
+
+	/*
+	 *	Compare what we calculated with what was sent, as
+	 *	fr_radius_verify() does.
+	 */
+	for (i = 0; i < num; i++) {
+		fr_radius_verify_t	*p = &packets[i];
+		radius_verify_batch_t	*w = &work[i];
+
+		if (!w->live) continue;
+
+		if (w->msg &&
+		    (fr_digest_cmp(w->message_authenticator, w->msg + 2, sizeof(w->message_authenticator)) != 0)) {
+			radius_verify_batch_restore(p, w);
+
+			p->error = "invalid Message-Authenticator (shared secret is incorrect)";
+			continue;
+		}
+
+		if ((p->packet[0] != FR_CODE_ACCESS_REQUEST) && (p->packet[0] != FR_CODE_STATUS_SERVER) &&
+		    (fr_digest_cmp(w->request_authenticator, p->packet + 4, sizeof(w->request_authenticator)) != 0)) {
+			radius_verify_batch_restore(p, w);
+			if (p->original) {
+				p->error = "invalid Response Authenticator (shared secret is incorrect)";
+			} else {
+				p->error = "invalid Request Authenticator (shared secret is incorrect)";
+			}
+			continue;
+		}
+
+		p->rcode = 0;
+	}
+
+	talloc_free(work);
+	return;
+
+oom:
+	for (i = 0; i < num; i++) {
+		packets[i].rcode = -1;
+		packets[i].error = "Out of memory";
+	}
+	talloc_free(work);
+}
+
 void *fr_radius_next_encodable(void **prev, void *to_eval, void *uctx);
 
 void *fr_radius_next_encodable(void **prev, void *to_eval, void *uctx)
@@ -896,17 +1213,9 @@ void *fr_radius_next_encodable(void **prev, void *to_eval, void *uctx)
 }
 
 
-/** Encode VPS into a raw RADIUS packet.
- *
- */
-ssize_t fr_radius_encode(uint8_t *packet, size_t packet_len, uint8_t const *original,
-			 char const *secret, size_t secret_len, int code, int id, fr_pair_list_t *vps)
-{
-	return fr_radius_encode_dbuff(&FR_DBUFF_TMP(packet, packet_len), original, secret, secret_len, code, id, vps);
-}
-
-ssize_t fr_radius_encode_dbuff(fr_dbuff_t *dbuff, uint8_t const *original,
-			 char const *secret, UNUSED size_t secret_len, int code, int id, fr_pair_list_t *vps)
+static ssize_t radius_encode_dbuff(fr_dbuff_t *dbuff, uint8_t const *original,
+				   char const *secret, fr_md5_key_t const *secret_key,
+				   int code, int id, fr_pair_list_t *vps)
 {
 	ssize_t			slen;
 	fr_pair_t const	*vp;
@@ -915,6 +1224,7 @@ ssize_t fr_radius_encode_dbuff(fr_dbuff_t *dbuff, uint8_t const *original,
 	fr_dbuff_t		work_dbuff, length_dbuff;
 
 	packet_ctx.secret = secret;
+	packet_ctx.secret_key = secret_key;
 	packet_ctx.rand_ctx.a = fr_rand();
 	packet_ctx.rand_ctx.b = fr_rand();
 
@@ -1036,11 +1346,45 @@ ssize_t fr_radius_encode_dbuff(fr_dbuff_t *dbuff, uint8_t const *original,
 	return fr_dbuff_set(dbuff, &work_dbuff);
 }
 
+/** Encode VPS into a raw RADIUS packet.
+ *
+ */
+ssize_t fr_radius_encode(uint8_t *packet, size_t packet_len, uint8_t const *original,
+			 char const *secret, size_t secret_len, int code, int id, fr_pair_list_t *vps)
+{
+	return fr_radius_encode_dbuff(&FR_DBUFF_TMP(packet, packet_len), original, secret, secret_len, code, id, vps);
+}
+
+/** Encode VPS into a raw RADIUS packet, using precomputed MD5 states for the secret
+ *
+ */
+ssize_t fr_radius_encode_key(uint8_t *packet, size_t packet_len, uint8_t const *original,
+			     char const *secret, fr_md5_key_t const *secret_key,
+			     int code, int id, fr_pair_list_t *vps)
+{
+	return radius_encode_dbuff(&FR_DBUFF_TMP(packet, packet_len), original, secret, secret_key, code, id, vps);
+}
+
+ssize_t fr_radius_encode_dbuff(fr_dbuff_t *dbuff, uint8_t const *original,
+			 char const *secret, UNUSED size_t secret_len, int code, int id, fr_pair_list_t *vps)
+{
+	return radius_encode_dbuff(dbuff, original, secret, NULL, code, id, vps);
+}
+
 /** Decode a raw RADIUS packet into VPs.
  *
  */
 ssize_t	fr_radius_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len, uint8_t const *original,
 			 char const *secret, UNUSED size_t secret_len, fr_cursor_t *cursor)
+{
+	return fr_radius_decode_key(ctx, packet, packet_len, original, secret, NULL, cursor);
+}
+
+/** Decode a raw RADIUS packet into VPs, using precomputed MD5 states for the secret
+ *
+ */
+ssize_t	fr_radius_decode_key(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len, uint8_t const *original,
+			     char const *secret, fr_md5_key_t const *secret_key, fr_cursor_t *cursor)
 {
 	ssize_t			slen;
 	uint8_t const		*attr, *end;
@@ -1048,6 +1392,7 @@ ssize_t	fr_radius_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_l
 
 	packet_ctx.tmp_ctx = talloc_init_const("tmp");
 	packet_ctx.secret = secret;
+	packet_ctx.secret_key = secret_key;
 	memcpy(packet_ctx.vector, original ? original + 4 : packet + 4, sizeof(packet_ctx.vector));
 
 	attr = packet + 20;
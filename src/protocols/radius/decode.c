@@ -61,9 +61,11 @@ static void memcpy_bounded(void * restrict dst, const void * restrict src, size_
  * above.
  */
 ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen,
-					 char const *secret, uint8_t const *vector, bool tunnel_password_zeros)
+					 char const *secret, fr_md5_key_t const *secret_key,
+					 uint8_t const *vector, bool tunnel_password_zeros)
 {
-	fr_md5_ctx_t	*md5_ctx, *md5_ctx_old;
+	fr_md5_ctx_t	*md5_ctx, *md5_ctx_old = NULL;
+	fr_md5_ctx_t const *md5_secret;
 	uint8_t		digest[RADIUS_AUTH_VECTOR_LENGTH];
 	int		secretlen;
 	size_t		i, n, encrypted_len, embedded_len;
@@ -99,13 +101,17 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen,
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = talloc_array_length(secret) - 1;
-
-	md5_ctx = fr_md5_ctx_alloc(false);
-	md5_ctx_old = fr_md5_ctx_alloc(true);
+	md5_ctx = fr_md5_ctx_alloc(true);
+	if (secret_key) {
+		md5_secret = secret_key->prefix;
+	} else {
+		secretlen = talloc_array_length(secret) - 1;
 
-	fr_md5_update(md5_ctx, (uint8_t const *) secret, secretlen);
-	fr_md5_ctx_copy(md5_ctx_old, md5_ctx); /* save intermediate work */
+		md5_ctx_old = fr_md5_ctx_alloc(true);
+		fr_md5_update(md5_ctx_old, (uint8_t const *) secret, secretlen);
+		md5_secret = md5_ctx_old;
+	}
+	fr_md5_ctx_copy(md5_ctx, md5_secret);
 
 	/*
 	 *	Set up the initial key:
@@ -131,7 +137,7 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen,
 			base = 1;
 
 			fr_md5_final(digest, md5_ctx);
-			fr_md5_ctx_copy(md5_ctx, md5_ctx_old);
+			fr_md5_ctx_copy(md5_ctx, md5_secret);
 
 			/*
 			 *	A quick check: decrypt the first octet
@@ -143,7 +149,7 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen,
 				fr_strerror_printf("Tunnel Password is too long for the attribute "
 						   "(shared secret is probably incorrect!)");
 				fr_md5_ctx_free(&md5_ctx);
-				fr_md5_ctx_free(&md5_ctx_old);
+				if (md5_ctx_old) fr_md5_ctx_free(&md5_ctx_old);
 				return -1;
 			}
 
@@ -154,7 +160,7 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen,
 
 			fr_md5_final(digest, md5_ctx);
 
-			fr_md5_ctx_copy(md5_ctx, md5_ctx_old);
+			fr_md5_ctx_copy(md5_ctx, md5_secret);
 			fr_md5_update(md5_ctx, passwd + n + 2, block_len);
 		}
 
@@ -164,7 +170,7 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen,
 	}
 
 	fr_md5_ctx_free(&md5_ctx);
-	fr_md5_ctx_free(&md5_ctx_old);
+	if (md5_ctx_old) fr_md5_ctx_free(&md5_ctx_old);
 
 	/*
 	 *	Check trailing bytes
@@ -188,9 +194,11 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen,
 /** Decode password
  *
  */
-ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret, uint8_t const *vector)
+ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret, fr_md5_key_t const *secret_key,
+				  uint8_t const *vector)
 {
-	fr_md5_ctx_t	*md5_ctx, *md5_ctx_old;
+	fr_md5_ctx_t	*md5_ctx, *md5_ctx_old = NULL;
+	fr_md5_ctx_t const *md5_secret;
 	uint8_t		digest[RADIUS_AUTH_VECTOR_LENGTH];
 	int		i;
 	size_t		n, secretlen;
@@ -210,13 +218,17 @@ ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = talloc_array_length(secret) - 1;
-
-	md5_ctx = fr_md5_ctx_alloc(false);
-	md5_ctx_old = fr_md5_ctx_alloc(true);
+	md5_ctx = fr_md5_ctx_alloc(true);
+	if (secret_key) {
+		md5_secret = secret_key->prefix;
+	} else {
+		secretlen = talloc_array_length(secret) - 1;
 
-	fr_md5_update(md5_ctx, (uint8_t const *) secret, secretlen);
-	fr_md5_ctx_copy(md5_ctx_old, md5_ctx);	/* save intermediate work */
+		md5_ctx_old = fr_md5_ctx_alloc(true);
+		fr_md5_update(md5_ctx_old, (uint8_t const *) secret, secretlen);
+		md5_secret = md5_ctx_old;
+	}
+	fr_md5_ctx_copy(md5_ctx, md5_secret);
 
 	/*
 	 *	The inverse of the code above.
@@ -226,14 +238,14 @@ ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret
 			fr_md5_update(md5_ctx, vector, RADIUS_AUTH_VECTOR_LENGTH);
 			fr_md5_final(digest, md5_ctx);
 
-			fr_md5_ctx_copy(md5_ctx, md5_ctx_old);
+			fr_md5_ctx_copy(md5_ctx, md5_secret);
 			if (pwlen > AUTH_PASS_LEN) {
 				fr_md5_update(md5_ctx, (uint8_t *) passwd, AUTH_PASS_LEN);
 			}
 		} else {
 			fr_md5_final(digest, md5_ctx);
 
-			fr_md5_ctx_copy(md5_ctx, md5_ctx_old);
+			fr_md5_ctx_copy(md5_ctx, md5_secret);
 			if (pwlen > (n + AUTH_PASS_LEN)) {
 				fr_md5_update(md5_ctx, (uint8_t *) passwd + n, AUTH_PASS_LEN);
 			}
@@ -243,7 +255,7 @@ ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret
 	}
 
 	fr_md5_ctx_free(&md5_ctx);
-	fr_md5_ctx_free(&md5_ctx_old);
+	if (md5_ctx_old) fr_md5_ctx_free(&md5_ctx_old);
 
  done:
 	passwd[pwlen] = '\0';
@@ -1153,7 +1165,7 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dic
 		 */
 		case FLAG_ENCRYPT_USER_PASSWORD:
 			fr_radius_decode_password((char *)buffer, attr_len,
-						  packet_ctx->secret, packet_ctx->vector);
+						  packet_ctx->secret, packet_ctx->secret_key, packet_ctx->vector);
 			buffer[253] = '\0';
 
 			/*
@@ -1188,7 +1200,8 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dic
 		case FLAG_TAGGED_TUNNEL_PASSWORD:
 		case FLAG_ENCRYPT_TUNNEL_PASSWORD:
 			if (fr_radius_decode_tunnel_password(buffer, &data_len,
-							     packet_ctx->secret, packet_ctx->vector,
+							     packet_ctx->secret, packet_ctx->secret_key,
+							     packet_ctx->vector,
 							     packet_ctx->tunnel_password_zeros) < 0) {
 				goto raw;
 			}
@@ -81,9 +81,10 @@ void fr_radius_encode_chap_password(uint8_t out[static 1 + RADIUS_CHAP_CHALLENGE
  * Input and output buffers can be identical if in-place encryption is needed.
  */
 static ssize_t encode_password(fr_dbuff_t *dbuff, uint8_t const *input, size_t inlen,
-			       char const *secret, uint8_t const *vector)
+			       char const *secret, fr_md5_key_t const *secret_key, uint8_t const *vector)
 {
-	fr_md5_ctx_t	*md5_ctx, *md5_ctx_old;
+	fr_md5_ctx_t	*md5_ctx, *md5_ctx_old = NULL;
+	fr_md5_ctx_t const *md5_secret;
 	uint8_t	digest[RADIUS_AUTH_VECTOR_LENGTH];
 	uint8_t	passwd[RADIUS_MAX_PASS_LENGTH];
 	size_t		i, n;
@@ -105,11 +106,15 @@ static ssize_t encode_password(fr_dbuff_t *dbuff, uint8_t const *input, size_t i
 		len &= ~0x0f;
 	}
 
-	md5_ctx = fr_md5_ctx_alloc(false);
-	md5_ctx_old = fr_md5_ctx_alloc(true);
-
-	fr_md5_update(md5_ctx, (uint8_t const *) secret, talloc_array_length(secret) - 1);
-	fr_md5_ctx_copy(md5_ctx_old, md5_ctx);
+	md5_ctx = fr_md5_ctx_alloc(true);
+	if (secret_key) {
+		md5_secret = secret_key->prefix;
+	} else {
+		md5_ctx_old = fr_md5_ctx_alloc(true);
+		fr_md5_update(md5_ctx_old, (uint8_t const *) secret, talloc_array_length(secret) - 1);
+		md5_secret = md5_ctx_old;
+	}
+	fr_md5_ctx_copy(md5_ctx, md5_secret);
 
 	/*
 	 *	Do first pass.
@@ -118,7 +123,7 @@ static ssize_t encode_password(fr_dbuff_t *dbuff, uint8_t const *input, size_t i
 
 	for (n = 0; n < len; n += AUTH_PASS_LEN) {
 		if (n > 0) {
-			fr_md5_ctx_copy(md5_ctx, md5_ctx_old);
+			fr_md5_ctx_copy(md5_ctx, md5_secret);
 			fr_md5_update(md5_ctx, passwd + n - AUTH_PASS_LEN, AUTH_PASS_LEN);
 		}
 
@@ -127,7 +132,7 @@ static ssize_t encode_password(fr_dbuff_t *dbuff, uint8_t const *input, size_t i
 	}
 
 	fr_md5_ctx_free(&md5_ctx);
-	fr_md5_ctx_free(&md5_ctx_old);
+	if (md5_ctx_old) fr_md5_ctx_free(&md5_ctx_old);
 
 	return fr_dbuff_in_memcpy(dbuff, passwd, len);
 }
@@ -135,7 +140,8 @@ static ssize_t encode_password(fr_dbuff_t *dbuff, uint8_t const *input, size_t i
 
 static ssize_t encode_tunnel_password(fr_dbuff_t *dbuff, uint8_t const *in, size_t inlen, void *encoder_ctx)
 {
-	fr_md5_ctx_t	*md5_ctx, *md5_ctx_old;
+	fr_md5_ctx_t	*md5_ctx, *md5_ctx_old = NULL;
+	fr_md5_ctx_t const *md5_secret;
 	uint8_t		digest[RADIUS_AUTH_VECTOR_LENGTH];
 	uint8_t		tpasswd[RADIUS_MAX_STRING_LENGTH];
 	size_t		i, n;
@@ -205,11 +211,16 @@ static ssize_t encode_tunnel_password(fr_dbuff_t *dbuff, uint8_t const *in, size
 	tpasswd[1] = r & 0xff;
 	tpasswd[2] = inlen;	/* length of the password string */
 
-	md5_ctx = fr_md5_ctx_alloc(false);
-	md5_ctx_old = fr_md5_ctx_alloc(true);
-
-	fr_md5_update(md5_ctx, (uint8_t const *) packet_ctx->secret, talloc_array_length(packet_ctx->secret) - 1);
-	fr_md5_ctx_copy(md5_ctx_old, md5_ctx);
+	md5_ctx = fr_md5_ctx_alloc(true);
+	if (packet_ctx->secret_key) {
+		md5_secret = packet_ctx->secret_key->prefix;
+	} else {
+		md5_ctx_old = fr_md5_ctx_alloc(true);
+		fr_md5_update(md5_ctx_old, (uint8_t const *) packet_ctx->secret,
+			      talloc_array_length(packet_ctx->secret) - 1);
+		md5_secret = md5_ctx_old;
+	}
+	fr_md5_ctx_copy(md5_ctx, md5_secret);
 
 	fr_md5_update(md5_ctx, packet_ctx->vector, RADIUS_AUTH_VECTOR_LENGTH);
 	fr_md5_update(md5_ctx, &tpasswd[0], 2);
@@ -218,7 +229,7 @@ static ssize_t encode_tunnel_password(fr_dbuff_t *dbuff, uint8_t const *in, size
 		size_t block_len;
 
 		if (n > 0) {
-			fr_md5_ctx_copy(md5_ctx, md5_ctx_old);
+			fr_md5_ctx_copy(md5_ctx, md5_secret);
 			fr_md5_update(md5_ctx, tpasswd + 2 + n - AUTH_PASS_LEN, AUTH_PASS_LEN);
 		}
 		fr_md5_final(digest, md5_ctx);
@@ -230,7 +241,7 @@ static ssize_t encode_tunnel_password(fr_dbuff_t *dbuff, uint8_t const *in, size
 	}
 
 	fr_md5_ctx_free(&md5_ctx);
-	fr_md5_ctx_free(&md5_ctx_old);
+	if (md5_ctx_old) fr_md5_ctx_free(&md5_ctx_old);
 
 	FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, tpasswd, len);
 
@@ -543,7 +554,7 @@ static ssize_t encode_value(fr_dbuff_t *dbuff,
 		 *	Encode the password in place
 		 */
 		slen = encode_password(&work_dbuff, fr_dbuff_current(&value_start), fr_dbuff_used(&value_dbuff),
-				       packet_ctx->secret, packet_ctx->vector);
+				       packet_ctx->secret, packet_ctx->secret_key, packet_ctx->vector);
 		if (slen < 0) return slen;
 		encrypted = true;
 		break;
@@ -28,6 +28,7 @@
 #include <freeradius-devel/util/packet.h>
 #include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/log.h>
+#include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/dbuff.h>
 
 #define RADIUS_AUTH_VECTOR_OFFSET      		4
@@ -106,6 +107,19 @@ enum {
 #define flag_long_extended(_flags)   (!(_flags)->extra && (_flags)->subtype == FLAG_LONG_EXTENDED_ATTR)
 #define flag_tunnel_password(_flags) (!(_flags)->extra && (((_flags)->subtype == FLAG_ENCRYPT_TUNNEL_PASSWORD) || ((_flags)->subtype == FLAG_TAGGED_TUNNEL_PASSWORD)))
 
+/** A packet to verify with #fr_radius_verify_batch
+ *
+ */
+typedef struct {
+	uint8_t			*packet;		//!< the raw RADIUS packet (request or response).
+	uint8_t const		*original;		//!< the raw original request (if this is a response).
+	uint8_t const		*secret;		//!< the shared secret.
+	size_t			secret_len;		//!< the length of the secret.
+
+	int			rcode;			//!< 0 if the packet is valid, <0 if not.
+	char const		*error;			//!< Why the packet isn't valid.
+} fr_radius_verify_t;
+
 /*
  *	protocols/radius/base.c
  */
@@ -113,8 +127,13 @@ size_t		fr_radius_attr_len(fr_pair_t const *vp);
 
 int		fr_radius_sign(uint8_t *packet, uint8_t const *original,
 			       uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
+int		fr_radius_sign_key(uint8_t *packet, uint8_t const *original,
+				   uint8_t const *secret, size_t secret_len, fr_md5_key_t const *secret_key) CC_HINT(nonnull (1,3));
 int		fr_radius_verify(uint8_t *packet, uint8_t const *original,
 				 uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
+int		fr_radius_verify_key(uint8_t *packet, uint8_t const *original,
+				     uint8_t const *secret, size_t secret_len, fr_md5_key_t const *secret_key) CC_HINT(nonnull (1,3));
+void		fr_radius_verify_batch(fr_radius_verify_t *packets, size_t num);
 bool		fr_radius_ok(uint8_t const *packet, size_t *packet_len_p,
 			     uint32_t max_attributes, bool require_ma, decode_fail_t *reason) CC_HINT(nonnull (1,2));
 
@@ -126,12 +145,20 @@ ssize_t		fr_radius_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *sr
 ssize_t		fr_radius_encode(uint8_t *packet, size_t packet_len, uint8_t const *original,
 				 char const *secret, size_t secret_len, int code, int id, fr_pair_list_t *vps);
 
+ssize_t		fr_radius_encode_key(uint8_t *packet, size_t packet_len, uint8_t const *original,
+				     char const *secret, fr_md5_key_t const *secret_key,
+				     int code, int id, fr_pair_list_t *vps);
+
 ssize_t		fr_radius_encode_dbuff(fr_dbuff_t *dbuff, uint8_t const *original,
 				 char const *secret, UNUSED size_t secret_len, int code, int id, fr_pair_list_t *vps);
 
 ssize_t		fr_radius_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len, uint8_t const *original,
 				 char const *secret, UNUSED size_t secret_len, fr_cursor_t *cursor) CC_HINT(nonnull(1,2,5,7));
 
+ssize_t		fr_radius_decode_key(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len, uint8_t const *original,
+				     char const *secret, fr_md5_key_t const *secret_key,
+				     fr_cursor_t *cursor) CC_HINT(nonnull(1,2,5,7));
+
 int		fr_radius_init(void);
 
 void		fr_radius_free(void);
@@ -169,6 +196,7 @@ typedef struct {
 	TALLOC_CTX		*tmp_ctx;		//!< for temporary things cleaned up during decoding
 	uint8_t 		vector[RADIUS_AUTH_VECTOR_LENGTH]; //!< vector for encryption / decryption of data
 	char const		*secret;		//!< shared secret.  MUST be talloc'd
+	fr_md5_key_t const	*secret_key;		//!< MD5 states precomputed from the secret.  May be NULL.
 	fr_fast_rand_t		rand_ctx;		//!< for tunnel passwords
 	int			salt_offset;		//!< for tunnel passwords
 	bool 			tunnel_password_zeros;
@@ -198,10 +226,12 @@ ssize_t		fr_radius_encode_pair(fr_dbuff_t *dbuff, fr_cursor_t *cursor, void *enc
  */
 int		fr_radius_decode_tlv_ok(uint8_t const *data, size_t length, size_t dv_type, size_t dv_length);
 
-ssize_t		fr_radius_decode_password(char *encpw, size_t len, char const *secret, uint8_t const *vector);
+ssize_t		fr_radius_decode_password(char *encpw, size_t len, char const *secret,
+					  fr_md5_key_t const *secret_key, uint8_t const *vector);
 
 
 ssize_t		fr_radius_decode_tunnel_password(uint8_t *encpw, size_t *len, char const *secret,
+						 fr_md5_key_t const *secret_key,
 						 uint8_t const *vector, bool tunnel_password_zeros);
 
 ssize_t		fr_radius_decode_pair_value(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_t const *dict,
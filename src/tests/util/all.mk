@@ -1,9 +1,4 @@
-SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk 
-
-#
-#  This uses an old API, and we don't have time to fix it.
-#
-#control_test.mk 
+SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk control_test.mk
 
 #
 #  These require pthread.
@@ -11,3 +6,11 @@ SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk
 #ifneq "$(findstring thread,${CFLAGS})" ""
 #SUBMAKEFILES += channel_test.mk worker_test.mk radius1_test.mk schedule_test.mk radius_schedule_test.mk
 #endif
+
+#
+#  Benchmarks, built and run by hand.
+#
+ifneq "$(findstring thread,${CFLAGS})" ""
+SUBMAKEFILES += state_test.mk radius_schedule_test.mk
+endif
+SUBMAKEFILES += radius_sign_test.mk
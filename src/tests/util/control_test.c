@@ -23,12 +23,14 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/io/control.h>
+#include <freeradius-devel/io/ring_buffer.h>
 #include <freeradius-devel/util/time.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/talloc.h>
 
-#include <sys/event.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 
@@ -42,13 +44,18 @@ RCSID("$Id$")
 #define CONTROL_MAGIC 0xabcd6809
 
 static int		debug_lvl = 0;
-static int		kq = -1;
+static fr_event_list_t	*el = NULL;
 static fr_atomic_queue_t *aq;
 static size_t		max_messages = 10;
 static int		aq_size = 16;
+static int		send_delay = 0;
 static fr_control_t	*control = NULL;
 static fr_ring_buffer_t *rb = NULL;
 
+static size_t		received = 0;
+static fr_time_delta_t	*latency = NULL;
+static fr_time_t	start_time, end_time;
+
 /**********************************************************************/
 typedef struct request_s request_t;
 request_t *request_alloc(UNUSED TALLOC_CTX *ctx);
@@ -77,7 +84,9 @@ int talloc_const_free(void const *ptr)
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: control_test [OPTS]\n");
+	fprintf(stderr, "  -d <usec>              Delay between sending messages.\n");
 	fprintf(stderr, "  -m <messages>	  Send number of messages.\n");
+	fprintf(stderr, "  -q <size>              Size of the atomic queue.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
 	fr_exit_now(EXIT_SUCCESS);
@@ -86,8 +95,27 @@ static void NEVER_RETURNS usage(void)
 typedef struct {
 	uint32_t		header;
 	size_t			counter;
+	fr_time_t		when;		//!< when the message was sent
 } my_message_t;
 
+static void control_recv(UNUSED void *ctx, void const *data, size_t data_size, fr_time_t now)
+{
+	my_message_t m;
+
+	fr_assert(data_size == sizeof(m));
+	memcpy(&m, data, sizeof(m));
+
+	fr_assert(m.header == CONTROL_MAGIC);
+	fr_assert(m.counter < max_messages);
+
+	MPRINT1("Master got message %zu.\n", m.counter);
+
+	latency[m.counter] = now - m.when;
+	received++;
+
+	if (received == max_messages) end_time = now;
+}
+
 static void *control_master(UNUSED void *arg)
 {
 	TALLOC_CTX *ctx;
@@ -96,49 +124,20 @@ static void *control_master(UNUSED void *arg)
 
 	MPRINT1("Master started.\n");
 
-	/*
-	 *	Busy loop.  We're stupid.
-	 */
-	while (true) {
+	while (received < max_messages) {
 		int num_events;
-		ssize_t data_size;
-		my_message_t m;
-		struct kevent kev;
 
-	wait_for_events:
 		MPRINT1("Master waiting for events.\n");
 
-		num_events = kevent(kq, NULL, 0, &kev, 1, NULL);
+		num_events = fr_event_corral(el, fr_time(), true);
 		if (num_events < 0) {
-			fprintf(stderr, "Failed reading kevent: %s\n", fr_syserror(errno));
+			fprintf(stderr, "Failed reading events: %s\n", fr_strerror());
 			fr_exit_now(EXIT_FAILURE);
 		}
 
-		MPRINT1("Master draining the control plane.\n");
-
-		while (true) {
-			uint32_t id;
-
-			data_size = fr_control_message_pop(aq, &id, &m, sizeof(m));
-			if (data_size == 0) goto wait_for_events;
-
-			if (data_size < 0) {
-				fprintf(stderr, "Failed reading control message\n");
-				fr_exit_now(EXIT_FAILURE);
-			}
-
-			fr_assert(data_size == sizeof(m));
-			fr_assert(id == FR_CONTROL_ID_CHANNEL);
-
-			MPRINT1("Master got message %zu.\n", m.counter);
-
-			fr_assert(m.header == CONTROL_MAGIC);
-
-			if (m.counter == (max_messages - 1)) goto do_exit;
-		}
+		if (num_events > 0) fr_event_service(el);
 	}
 
-do_exit:
 	MPRINT1("Master exiting.\n");
 
 	talloc_free(ctx);
@@ -162,6 +161,7 @@ static void *control_worker(UNUSED void *arg)
 		m.counter = i;
 
 retry:
+		m.when = fr_time();
 		if (fr_control_message_send(control, rb, FR_CONTROL_ID_CHANNEL, &m, sizeof(m)) < 0) {
 			MPRINT1("\tWorker retrying message %zu\n", i);
 			usleep(10);
@@ -169,6 +169,8 @@ retry:
 		}
 
 		MPRINT1("\tWorker sent message %zu\n", i);
+
+		if (send_delay) usleep(send_delay);
 	}
 
 	MPRINT1("\tWorker exiting.\n");
@@ -180,24 +182,40 @@ retry:
 
 
 
+static int latency_cmp(void const *one, void const *two)
+{
+	fr_time_delta_t const *a = one, *b = two;
+
+	return (*a > *b) - (*a < *b);
+}
+
 int main(int argc, char *argv[])
 {
 	int 			c;
 	TALLOC_CTX		*autofree = talloc_autofree_context();
 	pthread_attr_t		attr;
 	pthread_t		master_id, worker_id;
+	fr_time_delta_t		elapsed;
 
 	fr_time_start();
 
-	while ((c = getopt(argc, argv, "hm:o:tx")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "d:hm:q:x")) != -1) switch (c) {
 		case 'x':
 			debug_lvl++;
 			break;
 
+		case 'd':
+			send_delay = atoi(optarg);
+			break;
+
 		case 'm':
 			max_messages = atoi(optarg);
 			break;
 
+		case 'q':
+			aq_size = atoi(optarg);
+			break;
+
 		case 'h':
 		default:
 			usage();
@@ -208,18 +226,28 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
-	kq = kqueue();
-	fr_assert(kq >= 0);
+	if (!max_messages) usage();
+
+	el = fr_event_list_alloc(autofree, NULL, NULL);
+	fr_assert(el != NULL);
 
 	aq = fr_atomic_queue_alloc(autofree, aq_size);
 	fr_assert(aq != NULL);
 
-	control = fr_control_create(autofree, kq, aq, 1024);
+	control = fr_control_create(autofree, el, aq);
 	if (!control) {
 		fprintf(stderr, "control_test: Failed to create control plane\n");
 		fr_exit_now(EXIT_FAILURE);
 	}
 
+	if (fr_control_callback_add(control, FR_CONTROL_ID_CHANNEL, NULL, control_recv) < 0) {
+		fprintf(stderr, "control_test: Failed adding callback\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	latency = talloc_zero_array(autofree, fr_time_delta_t, max_messages);
+	fr_assert(latency != NULL);
+
 	rb = fr_ring_buffer_create(autofree, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
 	if (!rb) fr_exit_now(EXIT_FAILURE);
 
@@ -229,13 +257,29 @@ int main(int argc, char *argv[])
 	(void) pthread_attr_init(&attr);
 	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
+	start_time = fr_time();
+
 	(void) pthread_create(&worker_id, &attr, control_worker, NULL);
 	(void) pthread_create(&master_id, &attr, control_master, NULL);
 
 	(void) pthread_join(master_id, NULL);
 	(void) pthread_join(worker_id, NULL);
 
-	close(kq);
+	/*
+	 *	Print out the signal rate, and the wakeup latency,
+	 *	i.e. the time from sending a message to the start
+	 *	of the receivers event callback.
+	 */
+	elapsed = end_time - start_time;
+	qsort(latency, max_messages, sizeof(latency[0]), latency_cmp);
+
+	printf("messages: %zu\n", max_messages);
+	if (elapsed > 0) {
+		printf("signals/s: %.0f\n", (double) max_messages * NSEC / elapsed);
+	}
+	printf("latency p50: %" PRId64 " ns\n", latency[max_messages / 2]);
+	printf("latency p99: %" PRId64 " ns\n", latency[(max_messages * 99) / 100]);
+	printf("latency max: %" PRId64 " ns\n", latency[max_messages - 1]);
 
 	fr_exit_now(EXIT_SUCCESS);
 }
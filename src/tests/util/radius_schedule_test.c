@@ -25,16 +25,19 @@ RCSID("$Id$")
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/radius/defs.h>
+#include <freeradius-devel/server/rcode.h>
+#include <freeradius-devel/server/request.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/util/inet.h>
 #include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/util/socket.h>
 #include <freeradius-devel/util/syserror.h>
 
-#include <sys/event.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <poll.h>
 
 #ifdef HAVE_GETOPT_H
 #	include <getopt.h>
@@ -42,28 +45,40 @@ RCSID("$Id$")
 
 #define MPRINT1 if (debug_lvl) printf
 
+/*
+ *	Where the reply goes.  Allocated by the network thread when
+ *	the packet is read, and freed when the reply is written.
+ */
 typedef struct {
-	uint8_t			vector[16];
-	uint8_t			id;
-	struct			sockaddr_storage src;
+	struct sockaddr_storage	src;
 	socklen_t		salen;
 } fr_test_packet_ctx_t;
 
 typedef struct {
-	int			sockfd;
 	fr_ipaddr_t		ipaddr;
 	uint16_t		port;
 } fr_listen_test_t;
 
+/*
+ *	Benchmark client.  Each one uses its own source port, so the
+ *	kernel spreads the clients over the SO_REUSEPORT sockets.
+ */
+typedef struct {
+	pthread_t		pthread_id;
+	int			sockfd;
+	unsigned int		num_packets;		//!< to send
+	unsigned int		window;			//!< maximum outstanding packets
+	unsigned int		received;		//!< replies received
+} fr_test_client_t;
+
 static int			debug_lvl = 0;
 static fr_ipaddr_t		my_ipaddr;
 static int			my_port;
 static char const		*secret = "testing123";
-static fr_test_packet_ctx_t	tpc;
 
-static rlm_rcode_t test_process(UNUSED void const *instance, request_t *request, fr_io_action_t action)
+static unlang_action_t test_process(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx, request_t *request)
 {
-	MPRINT1("\t\tPROCESS --- request %"PRIu64" action %d\n", request->number, action);
+	MPRINT1("\t\tPROCESS --- request %"PRIu64"\n", request->number);
 	RETURN_MODULE_OK;
 }
 
@@ -71,9 +86,11 @@ static int test_decode(void const *instance, request_t *request, uint8_t *const
 {
 	fr_listen_test_t const *pc = instance;
 
-	request->async->process = test_process;
+	if (data_len < RADIUS_HEADER_LENGTH) return -1;
 
-	if (!debug_lvl) return 0;
+	request->packet->code = data[0];
+	request->packet->id = data[1];
+	memcpy(request->packet->vector, data + 4, sizeof(request->packet->vector));
 
 	MPRINT1("\t\tDECODE <<< request %"PRIu64" - %p data %p size %zd\n", request->number, pc, data, data_len);
 
@@ -87,107 +104,117 @@ static ssize_t test_encode(void const *instance, request_t *request, uint8_t *bu
 
 	MPRINT1("\t\tENCODE >>> request %"PRIu64"- data %p %p room %zd\n", request->number, pc, buffer, buffer_len);
 
+	if (buffer_len < RADIUS_HEADER_LENGTH) return -1;
+
 	buffer[0] = FR_CODE_ACCESS_ACCEPT;
-	buffer[1] = tpc.id;
+	buffer[1] = request->packet->id;
 	buffer[2] = 0;
-	buffer[3] = 20;
+	buffer[3] = RADIUS_HEADER_LENGTH;
 
-	memcpy(buffer + 4, tpc.vector, 16);
+	memcpy(buffer + 4, request->packet->vector, RADIUS_AUTH_VECTOR_LENGTH);
 
 	md5_ctx = fr_md5_ctx_alloc(true);
-	fr_md5_update(md5_ctx, buffer, 20);
+	fr_md5_update(md5_ctx, buffer, RADIUS_HEADER_LENGTH);
 	fr_md5_update(md5_ctx, (uint8_t const *) secret, strlen(secret));
 	fr_md5_final(buffer + 4, md5_ctx);
 	fr_md5_ctx_free(&md5_ctx);
 
-	return 20;
+	return RADIUS_HEADER_LENGTH;
 }
 
-static size_t test_nak(void const *ctx, UNUSED void *packet_ctx, uint8_t *const packet, size_t packet_len, UNUSED uint8_t *reply, UNUSED size_t reply_len)
+static size_t test_nak(fr_listen_t *li, void *packet_ctx, uint8_t *const packet, size_t packet_len,
+		       UNUSED uint8_t *reply, UNUSED size_t reply_len)
 {
-	MPRINT1("\t\tNAK !!! request %d - data %p %p size %zd\n", packet[1], ctx, packet, packet_len);
+	MPRINT1("\t\tNAK !!! request %d - data %p %p size %zd\n", packet[1], li, packet, packet_len);
+
+	talloc_free(packet_ctx);
 
-	return 10;
+	return 0;
 }
 
-static int test_open(void *ctx, UNUSED void const *master_ctx)
+static int test_open(fr_listen_t *li)
 {
-	fr_listen_test_t	*io_ctx = talloc_get_type_abort(ctx, fr_listen_test_t);
+	fr_listen_test_t const	*io_ctx = talloc_get_type_abort_const(li->app_io_instance, fr_listen_test_t);
+	uint16_t		port = io_ctx->port;
+	int			on = 1;
 
-	io_ctx->sockfd = fr_socket_server_udp(&io_ctx->ipaddr, &io_ctx->port, NULL, true);
-	if (io_ctx->sockfd < 0) {
+	li->fd = fr_socket_server_udp(&io_ctx->ipaddr, &port, NULL, true);
+	if (li->fd < 0) {
 		fr_perror("radius_test: Failed creating socket");
 		fr_exit_now(EXIT_FAILURE);
 	}
 
-	if (fr_socket_bind(io_ctx->sockfd, &io_ctx->ipaddr, &io_ctx->port, NULL) < 0) {
+	/*
+	 *	So that there can be one socket per network.
+	 */
+	if (setsockopt(li->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		fprintf(stderr, "radius_test: Failed setting SO_REUSEPORT: %s\n", fr_syserror(errno));
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (fr_socket_bind(li->fd, &io_ctx->ipaddr, &port, NULL) < 0) {
 		fr_perror("radius_test: Failed binding to socket");
 		fr_exit_now(EXIT_FAILURE);
 	}
 
+	li->name = "schedule-test";
+
 	return 0;
 }
 
-static fr_time_t start_time;
-
-static ssize_t test_read(void *ctx, UNUSED void **packet_ctx, fr_time_t **recv_time, uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, bool *is_dup)
+static ssize_t test_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time, uint8_t *buffer,
+			 size_t buffer_len, size_t *leftover, uint32_t *priority, bool *is_dup)
 {
 	ssize_t			data_size;
-	fr_listen_test_t const	*io_ctx = talloc_get_type_abort(ctx, fr_listen_test_t);
+	fr_test_packet_ctx_t	*tpc;
 
-	tpc.salen = sizeof(tpc.src);
 	*leftover = 0;
 	*is_dup = false;
 
-	data_size = recvfrom(io_ctx->sockfd, buffer, buffer_len, 0, (struct sockaddr *) &tpc.src, &tpc.salen);
-	if (data_size <= 0) return data_size;
-
-	/*
-	 *	@todo - check if it's RADIUS.
-	 */
-	tpc.id = buffer[1];
-	memcpy(tpc.vector, buffer + 4, sizeof(tpc.vector));
+	tpc = talloc_zero(NULL, fr_test_packet_ctx_t);
+	if (!tpc) return -1;
+	tpc->salen = sizeof(tpc->src);
+
+	data_size = recvfrom(li->fd, buffer, buffer_len, 0, (struct sockaddr *) &tpc->src, &tpc->salen);
+	if ((data_size < RADIUS_HEADER_LENGTH) || (buffer[0] != FR_CODE_ACCESS_REQUEST)) {
+		talloc_free(tpc);
+
+		/*
+		 *	Another network thread may have read the
+		 *	packet from the shared port.  That's not an
+		 *	error, and we shouldn't close the socket.
+		 */
+		if ((data_size < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+			return data_size;
+		}
+		return 0;
+	}
 
-	start_time = fr_time();
-	*recv_time = &start_time;
+	*packet_ctx = tpc;
+	*recv_time = fr_time();
 	*priority = 0;
 
 	return data_size;
 }
 
-
-static ssize_t test_write(void *ctx, UNUSED void *packet_ctx,  UNUSED fr_time_t request_time,
+static ssize_t test_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
 			  uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
 	ssize_t			data_size;
-	fr_listen_test_t	*io_ctx = talloc_get_type_abort(ctx, fr_listen_test_t);
-
-	tpc.salen = sizeof(tpc.src);
+	fr_test_packet_ctx_t	*tpc = talloc_get_type_abort(packet_ctx, fr_test_packet_ctx_t);
 
-	data_size = sendto(io_ctx->sockfd, buffer, buffer_len, 0, (struct sockaddr *)&tpc.src, tpc.salen);
-	if (data_size <= 0) return data_size;
-
-	/*
-	 *	@todo - post-write cleanups
-	 */
+	data_size = sendto(li->fd, buffer, buffer_len, 0, (struct sockaddr *)&tpc->src, tpc->salen);
+	talloc_free(tpc);
 
 	return data_size;
 }
 
-static int test_fd(void const *ctx)
-{
-	fr_listen_test_t const *io_ctx = talloc_get_type_abort_const(ctx, fr_listen_test_t);
-
-	return io_ctx->sockfd;
-}
-
 static fr_app_io_t app_io = {
 	.name = "schedule-test",
 	.default_message_size = 4096,
 	.open = test_open,
 	.read = test_read,
 	.write = test_write,
-	.fd = test_fd,
 	.nak = test_nak,
 	.encode = test_encode,
 	.decode = test_decode
@@ -202,13 +229,117 @@ static fr_app_t test_app = {
 	.entry_point_set = entry_point_set,
 };
 
+/** Send packets, keeping up to "window" of them outstanding
+ *
+ */
+static void *test_client(void *arg)
+{
+	fr_test_client_t	*client = arg;
+	unsigned int		sent = 0;
+	uint8_t			packet[RADIUS_HEADER_LENGTH];
+	uint8_t			reply[4096];
+	struct pollfd		pfd = { .fd = client->sockfd, .events = POLLIN };
+
+	memset(packet, 0, sizeof(packet));
+	packet[0] = FR_CODE_ACCESS_REQUEST;
+	packet[3] = RADIUS_HEADER_LENGTH;
+
+	while (client->received < client->num_packets) {
+		while ((sent < client->num_packets) && ((sent - client->received) < client->window)) {
+			packet[1] = sent & 0xff;
+			fr_rand_buffer(packet + 4, RADIUS_AUTH_VECTOR_LENGTH);
+
+			if (send(client->sockfd, packet, sizeof(packet), 0) < 0) {
+				fprintf(stderr, "radius_test: Failed sending packet: %s\n", fr_syserror(errno));
+				return NULL;
+			}
+			sent++;
+		}
+
+		/*
+		 *	Packets may be dropped if the server is
+		 *	overloaded.  Give up on the ones outstanding,
+		 *	and send some more.
+		 */
+		if (poll(&pfd, 1, 1000) <= 0) {
+			MPRINT1("Timed out waiting for replies, %u lost\n", sent - client->received);
+			client->num_packets -= (sent - client->received);
+			sent = client->received;
+			continue;
+		}
+
+		if (recv(client->sockfd, reply, sizeof(reply), 0) >= RADIUS_HEADER_LENGTH) client->received++;
+	}
+
+	return NULL;
+}
+
+/** Time how long it takes to get replies to "num_packets"
+ *
+ */
+static void test_benchmark(unsigned int num_clients, unsigned int num_packets, unsigned int window)
+{
+	fr_test_client_t	*clients;
+	unsigned int		i, received = 0;
+	fr_time_t		start;
+	fr_time_delta_t		elapsed;
+
+	clients = talloc_zero_array(NULL, fr_test_client_t, num_clients);
+	if (!clients) fr_exit_now(EXIT_FAILURE);
+
+	for (i = 0; i < num_clients; i++) {
+		fr_ipaddr_t	src_ipaddr = my_ipaddr;
+		uint16_t	src_port = 0;
+
+		clients[i].sockfd = fr_socket_client_udp(&src_ipaddr, &src_port, &my_ipaddr, my_port, false);
+		if (clients[i].sockfd < 0) {
+			fr_perror("radius_test: Failed creating client socket");
+			fr_exit_now(EXIT_FAILURE);
+		}
+		clients[i].num_packets = num_packets / num_clients;
+		clients[i].window = window;
+	}
+
+	start = fr_time();
+
+	for (i = 0; i < num_clients; i++) {
+		if (fr_schedule_pthread_create(&clients[i].pthread_id, test_client, &clients[i]) < 0) {
+			fr_perror("radius_test");
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < num_clients; i++) {
+		pthread_join(clients[i].pthread_id, NULL);
+		received += clients[i].received;
+		close(clients[i].sockfd);
+	}
+
+	elapsed = fr_time() - start;
+	if (elapsed <= 0) elapsed = 1;
+
+	printf("%u replies in %.3fs, %.0f packets/s\n", received,
+	       (double) elapsed / NSEC, ((double) received * NSEC) / elapsed);
+
+	talloc_free(clients);
+}
+
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: schedule_test [OPTS]\n");
+	fprintf(stderr, "  -b <num>               Send num packets, and print how many are processed per second.\n");
+	fprintf(stderr, "  -c <num>               Use num client threads when benchmarking.\n");
 	fprintf(stderr, "  -n <num>               Start num network threads\n");
+	fprintf(stderr, "  -w <num>               Start num worker threads\n");
+	fprintf(stderr, "  -p                     Run a network and worker in each thread.\n");
+	fprintf(stderr, "  -P                     Pin per-core threads to CPUs.\n");
 	fprintf(stderr, "  -i <address>[:port]    Set IP address and optional port.\n");
 	fprintf(stderr, "  -s <secret>            Set shared secret.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Compare split and per-core scheduling with e.g.:\n");
+	fprintf(stderr, "  schedule_test -n 2 -w 2 -b 1000000\n");
+	fprintf(stderr, "  schedule_test -p -w 4 -b 1000000\n");
 
 	fr_exit_now(EXIT_FAILURE);
 }
@@ -216,15 +347,16 @@ static void NEVER_RETURNS usage(void)
 int main(int argc, char *argv[])
 {
 	int			c;
-	int			num_networks = 1;
-	int			num_workers = 2;
+	unsigned int		i, num_networks;
+	unsigned int		num_packets = 0;
+	unsigned int		num_clients = 4;
 	uint16_t		port16 = 0;
 	TALLOC_CTX		*autofree = talloc_autofree_context();
 	fr_schedule_t		*sched;
-	fr_listen_t		listen = { .app_io = &app_io, .app = &test_app };
+	fr_schedule_config_t	config = { .max_networks = 1, .max_workers = 2 };
 	fr_listen_test_t	*app_io_inst;
 
-	listen.app_io_instance = app_io_inst = talloc_zero(autofree, fr_listen_test_t);
+	app_io_inst = talloc_zero(autofree, fr_listen_test_t);
 
 	fr_time_start();
 
@@ -237,7 +369,17 @@ int main(int argc, char *argv[])
 	my_ipaddr.addr.v4.s_addr = htonl(INADDR_LOOPBACK);
 	my_port = 1812;
 
-	while ((c = getopt(argc, argv, "i:n:s:w:x")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "b:c:i:n:pPs:w:x")) != -1) switch (c) {
+		case 'b':
+			num_packets = atoi(optarg);
+			if (num_packets == 0) usage();
+			break;
+
+		case 'c':
+			num_clients = atoi(optarg);
+			if ((num_clients == 0) || (num_clients > 64)) usage();
+			break;
+
 		case 'i':
 			if (fr_inet_pton_port(&my_ipaddr, &port16, optarg, -1, AF_INET, true, false) < 0) {
 				fr_perror("Failed parsing ipaddr");
@@ -247,8 +389,16 @@ int main(int argc, char *argv[])
 			break;
 
 		case 'n':
-			num_networks = atoi(optarg);
-			if ((num_networks <= 0) || (num_networks > 16)) usage();
+			config.max_networks = atoi(optarg);
+			if ((config.max_networks == 0) || (config.max_networks > 16)) usage();
+			break;
+
+		case 'p':
+			config.per_core = true;
+			break;
+
+		case 'P':
+			config.pin_threads = true;
 			break;
 
 		case 's':
@@ -256,8 +406,8 @@ int main(int argc, char *argv[])
 			break;
 
 		case 'w':
-			num_workers = atoi(optarg);
-			if ((num_workers <= 0) || (num_workers > 1024)) usage();
+			config.max_workers = atoi(optarg);
+			if ((config.max_workers == 0) || (config.max_workers > 64)) usage();
 			break;
 
 		case 'x':
@@ -270,37 +420,46 @@ int main(int argc, char *argv[])
 			usage();
 	}
 
-#if 0
-	argc -= (optind - 1);
-	argv += (optind - 1);
-#endif
-
 	app_io_inst->ipaddr = my_ipaddr;
 	app_io_inst->port = my_port;
 
-	sched = fr_schedule_create(autofree, NULL, &default_log, debug_lvl, num_networks, num_workers, NULL, NULL);
+	sched = fr_schedule_create(autofree, NULL, &default_log, debug_lvl, NULL, NULL, &config);
 	if (!sched) {
-		fprintf(stderr, "schedule_test: Failed to create scheduler\n");
+		fr_perror("schedule_test: Failed to create scheduler");
 		fr_exit_now(EXIT_FAILURE);
 	}
 
-	if (listen.app_io->open(listen.app_io_instance, listen.app_io_instance) < 0) fr_exit_now(EXIT_FAILURE);
+	(void) fr_fault_setup(autofree, NULL, argv[0]);
 
-#if 0
 	/*
-	 *	Set up the KQ filter for reading.
+	 *	One socket per network, all bound to the same port.
 	 */
-	EV_SET(&events[0], sockfd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
-	if (kevent(kq_master, events, 1, NULL, 0, NULL) < 0) {
-		fr_perror("Failed setting KQ for EVFILT_READ");
-		fr_exit_now(EXIT_FAILURE);
+	num_networks = fr_schedule_num_networks(sched);
+	for (i = 0; i < num_networks; i++) {
+		fr_listen_t	*li;
+
+		li = talloc_zero(autofree, fr_listen_t);
+		li->app_io = &app_io;
+		li->app_io_instance = app_io_inst;
+		li->app = &test_app;
+		li->default_message_size = app_io.default_message_size;
+		li->num_messages = 256;
+
+		if (li->app_io->open(li) < 0) fr_exit_now(EXIT_FAILURE);
+
+		if (!fr_schedule_listen_add_network(sched, li, i)) {
+			fr_perror("schedule_test: Failed adding socket");
+			fr_exit_now(EXIT_FAILURE);
+		}
 	}
-#endif
-
-	(void) fr_fault_setup(autofree, NULL, argv[0]);
-	(void) fr_schedule_listen_add(sched, &listen);
 
-	sleep(10);
+	if (num_packets) {
+		printf("%s mode, %u networks, %u workers, %u clients\n",
+		       config.per_core ? "Per-core" : "Split", num_networks, config.max_workers, num_clients);
+		test_benchmark(num_clients, num_packets, 64);
+	} else {
+		sleep(10);
+	}
 
 	(void) fr_schedule_destroy(&sched);
 
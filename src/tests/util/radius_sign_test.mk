@@ -0,0 +1,6 @@
+TARGET := radius_sign_test
+
+SOURCES		:= radius_sign_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,297 @@
+/*
+ * state_test.c	Benchmark the session state tree
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+
+/*
+ *	Simulates many concurrent multi-round conversations, such as
+ *	EAP-TLS, each of which saves and restores its session-state
+ *	once per round.  Every worker thread owns a slice of the
+ *	conversations, and advances all of them by one round before
+ *	starting the next, so they're all live at the same time.
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/state.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <pthread.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+#define MAX_WORKERS 64
+
+/** One simulated conversation
+ *
+ */
+typedef struct {
+	uint8_t			state[FR_MAX_STRING_LEN];	//!< State from the last reply.
+	size_t			state_len;			//!< Length of the State, 0 before the first round.
+} state_test_conv_t;
+
+/** A worker thread, and the conversations it owns
+ *
+ */
+typedef struct {
+	pthread_t		pthread_id;
+	unsigned int		id;
+
+	state_test_conv_t	*conv;				//!< Our conversations.
+	unsigned int		num_conv;			//!< How many conversations we own.
+
+	uint64_t		failed;				//!< Rounds where the state couldn't be saved.
+	uint64_t		lost;				//!< Rounds where the state wasn't restored.
+} state_test_worker_t;
+
+static int			debug_lvl = 0;
+static fr_dict_t		*dict_freeradius;
+static fr_dict_t		*dict_radius;
+static fr_dict_attr_t const	*attr_state;
+static fr_dict_attr_t const	*attr_user_name;
+static CONF_SECTION		*server_cs;
+static fr_state_tree_t		*state_tree;
+static unsigned int		num_rounds = 8;
+
+static pthread_barrier_t	start_barrier;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: state_test [OPTS]\n");
+	fprintf(stderr, "  -c <conversations>     Number of concurrent conversations.  Default is 100000.\n");
+	fprintf(stderr, "  -D <dict_dir>          Dictionary files are in \"dict_dir/*\".\n");
+	fprintf(stderr, "  -r <rounds>            Rounds per conversation.  Default is 8.\n");
+	fprintf(stderr, "  -t <timeout>           Seconds before unused state entries expire.  Default is 60.\n");
+	fprintf(stderr, "  -w N                   Create N workers.  Default is 16.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_FAILURE);
+}
+
+/** Run one round of a conversation
+ *
+ */
+static void state_test_round(state_test_worker_t *sw, state_test_conv_t *conv, bool last)
+{
+	request_t	*request;
+	fr_pair_t	*vp;
+
+	request = request_alloc(NULL);
+	MEM(request->packet = fr_radius_alloc(request, false));
+	MEM(request->reply = fr_radius_alloc(request, false));
+	request->server_cs = server_cs;
+	request->dict = dict_radius;
+
+	if (conv->state_len > 0) {
+		MEM(vp = fr_pair_afrom_da(request->packet, attr_state));
+		fr_pair_value_memdup(vp, conv->state, conv->state_len, false);
+		fr_pair_add(&request->request_pairs, vp);
+	}
+
+	fr_state_to_request(state_tree, request);
+
+	if (conv->state_len == 0) {
+		/*
+		 *	First round, create the session-state which
+		 *	is carried through the conversation.
+		 */
+		MEM(vp = fr_pair_afrom_da(request->state_ctx, attr_user_name));
+		fr_pair_value_strdup(vp, "bob");
+		fr_pair_add(&request->state_pairs, vp);
+
+	} else if (!fr_pair_find_by_da(&request->state_pairs, attr_user_name)) {
+		sw->lost++;
+	}
+
+	if (last) {
+		fr_state_discard(state_tree, request);
+		conv->state_len = 0;
+		goto done;
+	}
+
+	if (fr_request_to_state(state_tree, request) < 0) {
+		sw->failed++;
+		conv->state_len = 0;
+		goto done;
+	}
+
+	vp = fr_pair_find_by_da(&request->reply->vps, attr_state);
+	if (!vp || (vp->vp_length > sizeof(conv->state))) {
+		sw->failed++;
+		conv->state_len = 0;
+		goto done;
+	}
+
+	memcpy(conv->state, vp->vp_octets, vp->vp_length);
+	conv->state_len = vp->vp_length;
+
+done:
+	talloc_free(request);
+}
+
+static void *state_test_worker(void *arg)
+{
+	state_test_worker_t	*sw = arg;
+	unsigned int		round, i;
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (round = 0; round < num_rounds; round++) {
+		bool last = (round == (num_rounds - 1));
+
+		for (i = 0; i < sw->num_conv; i++) state_test_round(sw, &sw->conv[i], last);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, ret;
+	unsigned int		i, num_conv = 100000, num_workers = 16, timeout = 60;
+	char const		*dict_dir = DICTDIR;
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+	state_test_worker_t	*workers;
+	fr_time_t		start, end;
+	uint64_t		failed = 0, lost = 0, rounds;
+	double			elapsed;
+
+	if (fr_time_start() < 0) {
+		fprintf(stderr, "state_test: Failed to start time: %s\n", fr_syserror(errno));
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	fr_log_init(&default_log, false);
+
+	while ((c = getopt(argc, argv, "c:D:hr:t:w:x")) != -1) switch (c) {
+		case 'c':
+			num_conv = atoi(optarg);
+			if (num_conv == 0) usage();
+			break;
+
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'r':
+			num_rounds = atoi(optarg);
+			if (num_rounds == 0) usage();
+			break;
+
+		case 't':
+			timeout = atoi(optarg);
+			if (timeout == 0) usage();
+			break;
+
+		case 'w':
+			num_workers = atoi(optarg);
+			if ((num_workers == 0) || (num_workers > MAX_WORKERS)) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (!fr_dict_global_ctx_init(autofree, dict_dir)) {
+		fr_perror("state_test");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if ((fr_dict_internal_afrom_file(&dict_freeradius, FR_DICTIONARY_INTERNAL_DIR) < 0) ||
+	    (fr_dict_protocol_afrom_file(&dict_radius, "radius", NULL) < 0)) {
+		fr_perror("state_test");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	attr_state = fr_dict_attr_by_name(NULL, fr_dict_root(dict_radius), "State");
+	attr_user_name = fr_dict_attr_by_name(NULL, fr_dict_root(dict_radius), "User-Name");
+	if (!attr_state || !attr_user_name) {
+		fprintf(stderr, "state_test: Failed resolving attributes\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	MEM(server_cs = cf_section_alloc(autofree, NULL, "server", "state_test"));
+
+	state_tree = fr_state_tree_init(autofree, attr_state, true, num_conv * 2, timeout, 0);
+	if (!state_tree) {
+		fprintf(stderr, "state_test: Failed creating state tree\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	MEM(workers = talloc_zero_array(autofree, state_test_worker_t, num_workers));
+	pthread_barrier_init(&start_barrier, NULL, num_workers + 1);
+
+	for (i = 0; i < num_workers; i++) {
+		state_test_worker_t *sw = &workers[i];
+
+		sw->id = i;
+		sw->num_conv = (num_conv / num_workers) + (i < (num_conv % num_workers));
+		MEM(sw->conv = talloc_zero_array(workers, state_test_conv_t, sw->num_conv));
+
+		ret = pthread_create(&sw->pthread_id, NULL, state_test_worker, sw);
+		if (ret != 0) {
+			fprintf(stderr, "state_test: Failed creating worker: %s\n", fr_syserror(ret));
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = fr_time();
+
+	pthread_barrier_wait(&start_barrier);
+	end = fr_time();
+
+	for (i = 0; i < num_workers; i++) {
+		pthread_join(workers[i].pthread_id, NULL);
+		failed += workers[i].failed;
+		lost += workers[i].lost;
+	}
+
+	pthread_barrier_destroy(&start_barrier);
+
+	rounds = (uint64_t) num_conv * num_rounds;
+	elapsed = (double) fr_time_delta_to_usec(end - start) / 1000000.0;
+
+	printf("conversations\t%u\n", num_conv);
+	printf("workers\t\t%u\n", num_workers);
+	printf("rounds\t\t%" PRIu64 "\n", rounds);
+	printf("elapsed\t\t%.3fs\n", elapsed);
+	printf("rounds/s\t%.0f\n", rounds / elapsed);
+	printf("failed\t\t%" PRIu64 "\n", failed);
+	printf("lost\t\t%" PRIu64 "\n", lost);
+	printf("created\t\t%" PRIu64 "\n", fr_state_entries_created(state_tree));
+	printf("timed_out\t%" PRIu64 "\n", fr_state_entries_timeout(state_tree));
+	printf("tracked\t\t%u\n", fr_state_entries_tracked(state_tree));
+	printf("contended\t%" PRIu64 "\n", fr_state_lock_contended(state_tree));
+
+	return (failed || lost) ? EXIT_FAILURE : EXIT_SUCCESS;
+}